@@ -0,0 +1,318 @@
+/*
+ * AccelerometerHandler.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "AccelerometerHandler.h"
+
+#if SUPPORT_ACCELEROMETERS
+
+#include "LIS3DH.h"
+#include <CAN/CanInterface.h>
+#include <CanMessageBuffer.h>
+#include <CanMessageGenericParser.h>
+#include <Hardware/IoPorts.h>
+#include <Movement/StepTimer.h>
+#include <RTOSIface/RTOSIface.h>
+#include <StackSizes.h>
+
+namespace AccelerometerHandler
+{
+	constexpr uint8_t AllAxes = 0x07;
+	constexpr size_t MaxSamplesPerMessage = 63;						// limited by the size of the numSamples field
+	constexpr size_t DataBitsPerMessage = sizeof(CanMessageAccelerometerData::data) * 8;
+
+	static Task<StackSizes::AccelerometerTaskWords> accelerometerTask;
+	static LIS3DH *accelerometer = nullptr;
+	static IoPort csPort, int1Port;
+	static uint16_t samplingRate = 0;
+	static uint8_t resolution = 12;
+
+	// The collection that has been requested. The task reads these when it is woken.
+	static volatile bool running = false;
+	static uint8_t axesRequested;
+	static uint16_t numSamplesRequested;
+	static uint32_t startTime;										// local step clock, only used if delayedStart is true
+	static bool delayedStart;
+
+	// Results of the last collection
+	static uint32_t numSamplesSent = 0, numMessagesSent = 0, numOverflows = 0;
+	static bool failed = false;
+
+	// Pack the readings of the selected axes of each sample into the data words of the message, lowest bits first
+	class BitPacker
+	{
+	public:
+		BitPacker(uint32_t *p) : dest(p), accumulator(0), bitsInAccumulator(0), wordsWritten(0) { }
+
+		void Add(uint32_t val, unsigned int numBits)
+		{
+			accumulator |= val << bitsInAccumulator;
+			bitsInAccumulator += numBits;
+			if (bitsInAccumulator >= 32)
+			{
+				dest[wordsWritten++] = accumulator;
+				bitsInAccumulator -= 32;
+				accumulator = (bitsInAccumulator == 0) ? 0 : val >> (numBits - bitsInAccumulator);
+			}
+		}
+
+		size_t Flush()
+		{
+			if (bitsInAccumulator != 0)
+			{
+				dest[wordsWritten++] = accumulator;
+				accumulator = 0;
+				bitsInAccumulator = 0;
+			}
+			return wordsWritten;
+		}
+
+	private:
+		uint32_t *dest;
+		uint32_t accumulator;
+		unsigned int bitsInAccumulator;
+		size_t wordsWritten;
+	};
+
+	// Collect the requested number of samples and send them. Return false if the accelerometer failed.
+	static bool CollectAndSend(CanMessageBuffer *buf)
+	{
+		const uint8_t axes = axesRequested;
+		const unsigned int numAxes = __builtin_popcount(axes);
+		const unsigned int bitsPerSample = resolution;
+		const size_t samplesPerMessage = min<size_t>(DataBitsPerMessage/(numAxes * bitsPerSample), MaxSamplesPerMessage);
+		const uint32_t valueMask = (1u << bitsPerSample) - 1;
+		const uint32_t samplePeriodTicks = StepTimer::StepClockRate/samplingRate;
+
+		if (!accelerometer->StartCollecting(axes))
+		{
+			return false;
+		}
+
+		uint16_t sampleNumber = 0;
+		bool ok = true;
+		bool overflowedSinceLastMessage = false;
+		while (running && sampleNumber < numSamplesRequested)
+		{
+			const uint16_t *data;
+			unsigned int numRead;
+			bool overflowed;
+			uint32_t firstSampleTicks;
+			if (!accelerometer->CollectData(data, numRead, overflowed, firstSampleTicks))
+			{
+				ok = false;
+				break;
+			}
+			if (overflowed)
+			{
+				++numOverflows;
+				overflowedSinceLastMessage = true;
+			}
+
+			// Send the samples we have read in as many messages as it takes
+			size_t index = 0;
+			while (index < numRead && sampleNumber < numSamplesRequested)
+			{
+				const size_t numToSend = min<size_t>(min<size_t>(numRead - index, samplesPerMessage), numSamplesRequested - sampleNumber);
+				CanMessageAccelerometerData * const msg = buf->SetupStatusMessage<CanMessageAccelerometerData>(CanInterface::GetCanAddress(), CanId::MasterAddress);
+				msg->firstSampleNumber = sampleNumber;
+				msg->firstSampleTime = StepTimer::ConvertToMasterTime(firstSampleTicks + index * samplePeriodTicks);
+				msg->numSamples = numToSend;
+				msg->axes = axes;
+				msg->bitsPerSampleMinusOne = bitsPerSample - 1;
+				msg->overflowed = overflowedSinceLastMessage;
+				msg->zero = 0;
+				overflowedSinceLastMessage = false;
+
+				BitPacker packer(msg->data);
+				for (size_t i = 0; i < numToSend; ++i)
+				{
+					const uint16_t *sample = data + (index + i) * 3;
+					for (unsigned int axis = 0; axis < 3; ++axis)
+					{
+						if ((axes & (1u << axis)) != 0)
+						{
+							// The readings are left justified, so keep the top bits
+							packer.Add((sample[axis] >> (16 - bitsPerSample)) & valueMask, bitsPerSample);
+						}
+					}
+				}
+				index += numToSend;
+				sampleNumber += numToSend;
+				msg->lastPacket = (sampleNumber >= numSamplesRequested);
+				buf->dataLength = msg->GetActualDataLength(packer.Flush());
+				CanInterface::Send(buf);
+				++numMessagesSent;
+			}
+		}
+
+		accelerometer->StopCollecting();
+		numSamplesSent = sampleNumber;
+		return ok;
+	}
+
+	extern "C" [[noreturn]] void AccelerometerTaskCode(void *)
+	{
+		CanMessageBuffer * const buf = CanInterface::AllocateBuffer(CanInterface::BufferUser::accelerometer);
+		for (;;)
+		{
+			(void)TaskBase::Take();									// wait until a collection is requested
+			if (running)
+			{
+				if (delayedStart)
+				{
+					// Wait until the start time, which the main board sets so that several boards start together
+					const int32_t ticksToWait = (int32_t)(startTime - StepTimer::GetTimerTicks());
+					if (ticksToWait > 0)
+					{
+						delay(((uint32_t)ticksToWait * 1000)/StepTimer::StepClockRate + 1);
+					}
+				}
+				numMessagesSent = numOverflows = 0;
+				failed = !CollectAndSend(buf);
+				running = false;
+			}
+		}
+	}
+}
+
+void AccelerometerHandler::Init()
+{
+	accelerometerTask.Create(AccelerometerTaskCode, "ACCEL", nullptr, TaskPriority::AccelerometerPriority);
+}
+
+// Configure the accelerometer. The P parameter gives the chip select port and the INT1 port, the R parameter the sampling rate and the S parameter the resolution in bits.
+GCodeResult AccelerometerHandler::Configure(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	if (running)
+	{
+		reply.copy("Accelerometer is busy collecting data");
+		return GCodeResult::error;
+	}
+
+	CanMessageGenericParser parser(msg, AccelerometerConfigParams);
+	bool seen = false;
+	String<StringLength50> portNames;
+	if (parser.GetStringParam('P', portNames.GetRef()))
+	{
+		seen = true;
+		delete accelerometer;
+		accelerometer = nullptr;
+		IoPort* const ports[] = { &csPort, &int1Port };
+		const PinAccess access[] = { PinAccess::write1, PinAccess::read };
+		const size_t numPorts = IoPort::AssignPorts(portNames.c_str(), reply, PinUsedBy::sensor, 2, ports, access);
+		if (numPorts < 2)
+		{
+			if (numPorts != 0)
+			{
+				reply.copy("Accelerometer needs a chip select port and an interrupt port");
+			}
+			csPort.Release();
+			int1Port.Release();
+			return GCodeResult::error;
+		}
+		accelerometer = new LIS3DH(csPort.GetPin(), int1Port.GetPin());
+		if (!accelerometer->CheckPresent())
+		{
+			delete accelerometer;
+			accelerometer = nullptr;
+			reply.copy("Accelerometer not found");
+			return GCodeResult::error;
+		}
+	}
+
+	if (parser.GetUintParam('R', samplingRate))
+	{
+		seen = true;
+	}
+	if (parser.GetUintParam('S', resolution))
+	{
+		seen = true;
+	}
+
+	if (accelerometer == nullptr)
+	{
+		reply.copy("No accelerometer configured");
+		return (seen) ? GCodeResult::error : GCodeResult::ok;
+	}
+
+	if (seen && !accelerometer->Configure(samplingRate, resolution))
+	{
+		reply.copy("Failed to configure accelerometer");
+		return GCodeResult::error;
+	}
+
+	reply.printf("Accelerometer on ");
+	csPort.AppendPinName(reply);
+	reply.cat(" interrupt ");
+	int1Port.AppendPinName(reply);
+	reply.catf(", %uHz, %u-bit", samplingRate, resolution);
+	return GCodeResult::ok;
+}
+
+// Start collecting data. The A parameter selects the axes (default all), the N parameter the number of samples (0 to stop) and the optional T parameter the master step clock time to start.
+GCodeResult AccelerometerHandler::Start(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	if (accelerometer == nullptr)
+	{
+		reply.copy("No accelerometer configured");
+		return GCodeResult::error;
+	}
+
+	CanMessageGenericParser parser(msg, StartAccelerometerParams);
+	uint16_t numSamples;
+	if (!parser.GetUintParam('N', numSamples))
+	{
+		reply.copy("Missing N parameter");
+		return GCodeResult::error;
+	}
+	if (numSamples == 0)
+	{
+		running = false;
+		return GCodeResult::ok;
+	}
+	if (running)
+	{
+		reply.copy("Accelerometer is already collecting data");
+		return GCodeResult::error;
+	}
+
+	uint8_t axes = AllAxes;
+	(void)parser.GetUintParam('A', axes);
+	axes &= AllAxes;
+	if (axes == 0)
+	{
+		reply.copy("No axes selected");
+		return GCodeResult::error;
+	}
+
+	uint32_t masterStartTime;
+	delayedStart = parser.GetUintParam('T', masterStartTime);
+	if (delayedStart)
+	{
+		startTime = StepTimer::ConvertToLocalTime(masterStartTime);
+	}
+	axesRequested = axes;
+	numSamplesRequested = numSamples;
+	running = true;
+	accelerometerTask.Give();
+	return GCodeResult::ok;
+}
+
+void AccelerometerHandler::Diagnostics(const StringRef& reply)
+{
+	if (accelerometer != nullptr)
+	{
+		reply.lcatf("Accelerometer: ");
+		accelerometer->AppendStatus(reply);
+		reply.catf(", %s, samples sent %" PRIu32 " in %" PRIu32 " messages, overflows %" PRIu32 "%s",
+					(running) ? "collecting" : "idle", numSamplesSent, numMessagesSent, numOverflows, (failed) ? ", last collection failed" : "");
+	}
+}
+
+#endif
+
+// End
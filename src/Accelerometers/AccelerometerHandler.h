@@ -0,0 +1,33 @@
+/*
+ * AccelerometerHandler.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Collects samples from an accelerometer on the shared SPI bus and streams them to the main board in accelerometerData messages,
+ *  so that the main board can measure the resonances of the machine. Each message carries the master step clock time of its first
+ *  sample, which we get from the time of the FIFO watermark interrupt, so the main board can line the samples up with the moves.
+ */
+
+#ifndef SRC_ACCELEROMETERS_ACCELEROMETERHANDLER_H_
+#define SRC_ACCELEROMETERS_ACCELEROMETERHANDLER_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_ACCELEROMETERS
+
+#include <GCodes/GCodeResult.h>
+
+struct CanMessageGeneric;
+
+namespace AccelerometerHandler
+{
+	void Init();
+	GCodeResult Configure(const CanMessageGeneric& msg, const StringRef& reply);	// process an accelerometerConfig message
+	GCodeResult Start(const CanMessageGeneric& msg, const StringRef& reply);		// process a startAccelerometer message
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif
+
+#endif /* SRC_ACCELEROMETERS_ACCELEROMETERHANDLER_H_ */
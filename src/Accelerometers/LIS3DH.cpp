@@ -0,0 +1,208 @@
+/*
+ * LIS3DH.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "LIS3DH.h"
+
+#if SUPPORT_ACCELEROMETERS
+
+#include <Hardware/IoPorts.h>
+#include <Hardware/Interrupts.h>
+#include <Movement/StepTimer.h>
+
+constexpr uint32_t Lis3dhSpiClockFrequency = 4000000;						// the device allows up to 10MHz
+constexpr uint8_t WhoAmIValue = 0x33;
+constexpr unsigned int FifoWatermark = 24;									// leaves 8 sample times for us to respond before the FIFO overflows
+constexpr uint16_t DefaultSamplingRate = 1344;
+
+// Bits in the address byte
+constexpr uint8_t ReadBit = 0x80;
+constexpr uint8_t AutoIncrementBit = 0x40;
+
+// Register bits
+constexpr uint8_t Ctrl1LowPower = 0x08;
+constexpr uint8_t Ctrl3Int1Watermark = 0x04;
+constexpr uint8_t Ctrl4BlockDataUpdate = 0x80;
+constexpr uint8_t Ctrl4HighResolution = 0x08;
+constexpr uint8_t Ctrl5FifoEnable = 0x40;
+constexpr uint8_t FifoModeBypass = 0x00;
+constexpr uint8_t FifoModeStream = 0x80;
+constexpr uint8_t FifoSourceOverrun = 0x40;
+constexpr uint8_t FifoSourceEmpty = 0x20;
+constexpr uint8_t FifoSourceCountMask = 0x1F;
+
+// The output data rates. The two highest are only available in low power mode, which gives 8-bit resolution.
+struct DataRate
+{
+	uint16_t rate;
+	uint8_t odr;
+	bool lowPowerOnly;
+};
+
+static constexpr DataRate DataRates[] =
+{
+	{ 25, 3, false }, { 50, 4, false }, { 100, 5, false }, { 200, 6, false }, { 400, 7, false }, { 1344, 9, false }, { 1600, 8, true }, { 5376, 9, true }
+};
+
+LIS3DH::LIS3DH(Pin csPin, Pin p_int1Pin)
+	: device(Lis3dhSpiClockFrequency, SpiMode::mode3, false), int1Pin(p_int1Pin), taskWaiting(nullptr), interruptTicks(0), interruptPending(false),
+	  numInterrupts(0), numTimeouts(0), numOverflows(0), samplingRate(0), ctrlReg1(0), ctrlReg4(0), resolution(0)
+{
+	device.SetCsPin(csPin);
+	device.InitMaster();
+	memset(txBuffer, 0xFF, sizeof(txBuffer));
+	uint16_t rate = 0;
+	uint8_t res = 12;
+	(void)Configure(rate, res);
+}
+
+bool LIS3DH::CheckPresent()
+{
+	return ReadRegisters(LisRegister::WhoAmI, 1) && rxBuffer[2] == WhoAmIValue;
+}
+
+bool LIS3DH::Configure(uint16_t& p_samplingRate, uint8_t& p_resolution)
+{
+	const uint16_t requestedRate = (p_samplingRate == 0) ? DefaultSamplingRate : p_samplingRate;
+	const DataRate *dr = &DataRates[ARRAY_SIZE(DataRates) - 1];
+	for (const DataRate& d : DataRates)
+	{
+		if (d.rate >= requestedRate)
+		{
+			dr = &d;
+			break;
+		}
+	}
+
+	resolution = (dr->lowPowerOnly || p_resolution < 10) ? 8 : (p_resolution < 12) ? 10 : 12;
+	samplingRate = dr->rate;
+	samplePeriodTicks = StepTimer::StepClockRate/samplingRate;
+	dataTimeoutMillis = ((FifoWatermark + 1) * 2000)/samplingRate + 10;		// twice the time to reach the watermark
+	ctrlReg1 = (dr->odr << 4) | ((resolution == 8) ? Ctrl1LowPower : 0);
+	ctrlReg4 = Ctrl4BlockDataUpdate | ((resolution == 12) ? Ctrl4HighResolution : 0);	// full scale +/-2g
+	p_samplingRate = samplingRate;
+	p_resolution = resolution;
+	return WriteRegister(LisRegister::Ctrl4, ctrlReg4);
+}
+
+bool LIS3DH::StartCollecting(uint8_t axes)
+{
+	// Empty the FIFO by switching it to bypass mode, then set it to stream mode and enable the watermark interrupt.
+	// Stream mode keeps collecting if we fall behind, and the overrun flag tells us that we lost samples.
+	taskWaiting = RTOSIface::GetCurrentTask();
+	(void)TaskBase::Take(0);												// clear any stale notification
+	interruptPending = false;
+	numInterrupts = numTimeouts = numOverflows = 0;
+	if (   !WriteRegister(LisRegister::FifoControl, FifoModeBypass)
+		|| !WriteRegister(LisRegister::Ctrl5, Ctrl5FifoEnable)
+		|| !WriteRegister(LisRegister::FifoControl, FifoModeStream | FifoWatermark)
+		|| !WriteRegister(LisRegister::Ctrl3, Ctrl3Int1Watermark)
+		|| !AttachInterrupt(int1Pin, CommonInt1Interrupt, InterruptMode::rising, CallbackParameter(this), InterruptFilter::none)
+	   )
+	{
+		return false;
+	}
+	return WriteRegister(LisRegister::Ctrl1, ctrlReg1 | (axes & 0x07));
+}
+
+bool LIS3DH::CollectData(const uint16_t *& data, unsigned int& numSamples, bool& overflowed, uint32_t& firstSampleTicks)
+{
+	// INT1 stays high until we have read the FIFO below the watermark, so if it is already high we don't need to wait for the edge
+	if (!IoPort::ReadPin(int1Pin) && !TaskBase::Take(dataTimeoutMillis))
+	{
+		++numTimeouts;
+		return false;
+	}
+
+	// No new edge can occur until we have read the FIFO, so it is safe to clear the pending flag now
+	const bool hadInterrupt = interruptPending;
+	const uint32_t whenInterrupted = interruptTicks;
+	interruptPending = false;
+
+	if (!ReadRegisters(LisRegister::FifoSource, 1))
+	{
+		return false;
+	}
+	const uint8_t fifoSource = rxBuffer[2];
+	overflowed = (fifoSource & FifoSourceOverrun) != 0;
+	if (overflowed)
+	{
+		++numOverflows;
+		numSamples = FifoSize;
+	}
+	else if ((fifoSource & FifoSourceEmpty) != 0)
+	{
+		numSamples = 0;
+		return true;
+	}
+	else
+	{
+		numSamples = fifoSource & FifoSourceCountMask;
+	}
+
+	// The address wraps from OUT_Z_H back to OUT_X_L when the FIFO is enabled, so we can read all the samples in one transfer
+	if (!ReadRegisters(LisRegister::OutXL, numSamples * BytesPerSample))
+	{
+		return false;
+	}
+	data = reinterpret_cast<const uint16_t *>(rxBuffer + 2);
+
+	// The watermark interrupt happens when the FIFO holds one more sample than the watermark, so we know when that sample was taken.
+	// If we didn't get the interrupt, the best we can do is to assume that the last sample has just been taken.
+	firstSampleTicks = (hadInterrupt) ? whenInterrupted - FifoWatermark * samplePeriodTicks : StepTimer::GetTimerTicks() - (numSamples - 1) * samplePeriodTicks;
+	return true;
+}
+
+void LIS3DH::StopCollecting()
+{
+	DetachInterrupt(int1Pin);
+	(void)WriteRegister(LisRegister::Ctrl1, 0);								// power down
+	(void)WriteRegister(LisRegister::Ctrl3, 0);
+	(void)WriteRegister(LisRegister::FifoControl, FifoModeBypass);
+	taskWaiting = nullptr;
+}
+
+void LIS3DH::AppendStatus(const StringRef& reply) const
+{
+	reply.catf("LIS3DH %uHz %u-bit, interrupts %" PRIu32 ", timeouts %" PRIu32 ", overflows %" PRIu32, samplingRate, resolution, numInterrupts, numTimeouts, numOverflows);
+}
+
+bool LIS3DH::ReadRegisters(LisRegister reg, size_t numToRead)
+{
+	if (numToRead > FifoSize * BytesPerSample)
+	{
+		return false;
+	}
+	txBuffer[0] = (uint8_t)reg | ReadBit | AutoIncrementBit;
+	return device.TransceivePacketDma(txBuffer, rxBuffer + 1, numToRead + 1);
+}
+
+bool LIS3DH::WriteRegister(LisRegister reg, uint8_t val)
+{
+	const uint8_t data[2] = { (uint8_t)reg, val };
+	return device.TransceivePacketDma(data, nullptr, 2);
+}
+
+void LIS3DH::Int1Interrupt()
+{
+	interruptTicks = StepTimer::GetTimerTicks();
+	interruptPending = true;
+	++numInterrupts;
+	const TaskHandle t = taskWaiting;
+	if (t != nullptr)
+	{
+		TaskBase::GiveFromISR(t);
+	}
+}
+
+/*static*/ void LIS3DH::CommonInt1Interrupt(CallbackParameter cbp)
+{
+	static_cast<LIS3DH*>(cbp.vp)->Int1Interrupt();
+}
+
+#endif
+
+// End
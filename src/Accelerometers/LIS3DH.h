@@ -0,0 +1,85 @@
+/*
+ * LIS3DH.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#ifndef SRC_ACCELEROMETERS_LIS3DH_H_
+#define SRC_ACCELEROMETERS_LIS3DH_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_ACCELEROMETERS
+
+#if !SUPPORT_SPI_SENSORS
+# error "SUPPORT_ACCELEROMETERS needs the shared SPI bus"
+#endif
+
+#include <Hardware/SharedSpiDevice.h>
+#include <RTOSIface/RTOSIface.h>
+
+// LIS3DH accelerometer on the shared SPI bus, with its INT1 output signalling that the FIFO has reached the watermark
+class LIS3DH
+{
+public:
+	static constexpr unsigned int FifoSize = 32;							// the number of samples that the FIFO holds
+	static constexpr unsigned int BytesPerSample = 6;						// the FIFO always holds all three axes, 16 bits each left justified
+
+	LIS3DH(Pin csPin, Pin p_int1Pin);
+
+	// Return true if the device is present and answers with the correct ID
+	bool CheckPresent();
+
+	// Choose the output data rate and resolution nearest to the requested ones, which are changed to the values used. A sampling rate of 0 selects the default.
+	bool Configure(uint16_t& samplingRate, uint8_t& resolution);
+
+	// Start filling the FIFO in stream mode with the selected axes
+	bool StartCollecting(uint8_t axes);
+
+	// Wait for the FIFO to reach the watermark and read all the samples in it. Must be called by the task that called StartCollecting.
+	// Return false if the device didn't signal data ready in time or the transfer failed.
+	// On success, 'data' points to 'numSamples' groups of three readings, and 'firstSampleTicks' is the local step clock when the first of them was taken.
+	bool CollectData(const uint16_t *& data, unsigned int& numSamples, bool& overflowed, uint32_t& firstSampleTicks);
+
+	void StopCollecting();
+	void AppendStatus(const StringRef& reply) const;
+
+private:
+	enum class LisRegister : uint8_t
+	{
+		WhoAmI = 0x0F,
+		Ctrl1 = 0x20,
+		Ctrl3 = 0x22,
+		Ctrl4 = 0x23,
+		Ctrl5 = 0x24,
+		OutXL = 0x28,
+		FifoControl = 0x2E,
+		FifoSource = 0x2F
+	};
+
+	bool ReadRegisters(LisRegister reg, size_t numToRead);
+	bool WriteRegister(LisRegister reg, uint8_t val);
+	void Int1Interrupt();
+	static void CommonInt1Interrupt(CallbackParameter cbp);
+
+	SharedSpiDevice device;
+	Pin int1Pin;
+	volatile TaskHandle taskWaiting;
+	volatile uint32_t interruptTicks;										// when INT1 last went high
+	volatile bool interruptPending;
+	uint32_t samplePeriodTicks;
+	uint32_t dataTimeoutMillis;
+	uint32_t numInterrupts, numTimeouts, numOverflows;
+	uint16_t samplingRate;
+	uint8_t ctrlReg1;														// the output data rate and low power mode bits, without the axis enable bits
+	uint8_t ctrlReg4;
+	uint8_t resolution;
+
+	uint8_t txBuffer[1 + FifoSize * BytesPerSample];
+	alignas(2) uint8_t rxBuffer[2 + FifoSize * BytesPerSample];			// we receive the address byte into rxBuffer[1] so that the samples are 16-bit aligned
+};
+
+#endif
+
+#endif /* SRC_ACCELEROMETERS_LIS3DH_H_ */
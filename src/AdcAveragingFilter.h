@@ -12,44 +12,132 @@
 #include "RTOSIface/RTOSIface.h"
 
 // Class to perform averaging of values read from the ADC
-// numAveraged should be a power of 2 for best efficiency
-template<size_t numAveraged> class AdcAveragingFilter
+// numAveraged is the length of the averaging buffer, and should be a power of 2 for best efficiency.
+// If decimation is greater than 1, each value in the averaging buffer is the mean of that many readings, so that the buffer can be shorter for the same number of readings averaged.
+// The number of readings averaged can be changed when the filter is initialised. Shorter windows use fewer buffer entries, and longer windows use a higher
+// decimation ratio, so a filter never needs more memory than its buffer.
+// If rejectSpikes is true, each reading is replaced by the median of it and the two readings before it, which removes isolated spikes at the cost of one reading of delay.
+// ProcessReading is only ever called from the ADC callback, so it is the only writer of the filter state and needs no lock. Init doesn't touch that state,
+// it asks ProcessReading to reset the filter on the next reading. Readers only see the sum, the number of entries and the valid flag. The writer publishes them
+// under a sequence counter, which is odd while they are being changed, so GetSnapshot can return values that belong together without taking a lock.
+template<size_t numAveraged, size_t decimation = 1, bool rejectSpikes = false> class AdcAveragingFilter
 {
 public:
+	static constexpr size_t MaxDecimation = 64;				// the highest decimation ratio we allow when the number of readings averaged is changed
+
+	static_assert(decimation >= 1 && decimation <= MaxDecimation, "bad decimation ratio");
+
 	AdcAveragingFilter()
 	{
-		Init(0);
+		SetWindow(numAveraged, decimation);
+		Reset(0);
+		resetPending = false;
 	}
 
-	void Init(uint16_t val) volatile
+	// Reset the filter. If readingsAveraged is zero we use the default number of readings, else it must be a power of 2 that IsValidWindow accepts.
+	void Init(uint16_t val, size_t readingsAveraged = 0) volatile
 	{
-		TaskCriticalSectionLocker lock;
-
-		sum = (uint32_t)val * (uint32_t)numAveraged;
-		index = 0;
+		resetValue = val;
+		requestedReadings = readingsAveraged;
 		isValid = false;
-		for (size_t i = 0; i < numAveraged; ++i)
-		{
-			readings[i] = val;
-		}
+		resetPending = true;								// this must be written last
+	}
+
+	// Return true if the filter can average this number of readings
+	static constexpr bool IsValidWindow(size_t readingsAveraged)
+	{
+		return readingsAveraged != 0 && (readingsAveraged & (readingsAveraged - 1)) == 0 && readingsAveraged <= MaxReadingsAveraged();
 	}
 
+	static constexpr size_t DefaultReadingsAveraged() { return numAveraged * decimation; }
+	static constexpr size_t MaxReadingsAveraged() { return numAveraged * MaxDecimation; }
+
 	// Call this to put a new reading into the filter
 	void ProcessReading(uint16_t r)
 	{
-		TaskCriticalSectionLocker lock;
+		if (resetPending)
+		{
+			resetPending = false;							// clear this first, in case Init is called again while we reset
+			const size_t readings = requestedReadings;
+			if (readings == 0 || !IsValidWindow(readings))
+			{
+				SetWindow(numAveraged, decimation);
+			}
+			else
+			{
+				const size_t entries = min<size_t>(readings, numAveraged);
+				SetWindow(entries, readings/entries);
+			}
+			Reset(resetValue);
+		}
+
+		lastReading = r;
+		if (rejectSpikes)
+		{
+			const uint16_t median = (r < previousReadings[0])
+										? ((r >= previousReadings[1]) ? r : min<uint16_t>(previousReadings[0], previousReadings[1]))
+										: ((r <= previousReadings[1]) ? r : max<uint16_t>(previousReadings[0], previousReadings[1]));
+			previousReadings[1] = previousReadings[0];
+			previousReadings[0] = r;
+			r = median;
+		}
 
-		sum = sum - readings[index] + r;
+		if (activeDecimation > 1)
+		{
+			decimationSum += r;
+			++decimationCount;
+			if (decimationCount < activeDecimation)
+			{
+				return;
+			}
+			r = (uint16_t)((decimationSum + activeDecimation/2)/activeDecimation);		// store the mean so that the entry can't overflow
+			decimationSum = 0;
+			decimationCount = 0;
+		}
+
+		runningSum = runningSum - readings[index] + r;
 		readings[index] = r;
 		++index;
-		if (index == numAveraged)
+		if (index == activeEntries)
 		{
 			index = 0;
-			isValid = true;
+			Publish(runningSum, true);
+		}
+		else
+		{
+			Publish(runningSum, isValid);
 		}
 	}
 
-	// Return the raw sum
+	// Get the sum and whether it is valid, consistently with each other. The writer runs at a higher priority than any reader and never waits,
+	// so if it updates the filter while we are reading it we just read it again.
+	bool GetSnapshot(uint32_t& p_sum) const volatile
+	{
+		size_t entries;
+		return GetSnapshot(p_sum, entries);
+	}
+
+	// Get the sum, the number of entries that it covers and whether it is valid, consistently with each other.
+	// Use this instead of calling NumAveraged separately if the number of readings averaged may be changed while we are reading the filter.
+	bool GetSnapshot(uint32_t& p_sum, size_t& p_entries) const volatile
+	{
+		for (;;)
+		{
+			const uint32_t seqBefore = sequence;
+			if ((seqBefore & 1u) == 0)
+			{
+				p_sum = sum;
+				p_entries = publishedEntries;
+				const bool valid = isValid;
+				if (sequence == seqBefore)
+				{
+					return valid;
+				}
+			}
+		}
+	}
+
+	// Return the raw sum. Use GetSnapshot instead if you need to know whether it is valid.
 	uint32_t GetSum() const volatile
 	{
 		return sum;
@@ -58,7 +146,7 @@ public:
 	// Return the last reading
 	uint32_t GetLastReading() const volatile
 	{
-		return readings[(index - 1) % numAveraged];
+		return lastReading;
 	}
 
 	// Return true if we have a valid average
@@ -70,28 +158,79 @@ public:
 	// Get the latest reading
 	uint16_t GetLatestReading() const volatile
 	{
-		size_t indexOfLastReading = index;			// capture volatile variable
-		indexOfLastReading =  (indexOfLastReading == 0) ? numAveraged - 1 : indexOfLastReading - 1;
-		return readings[indexOfLastReading];
+		return lastReading;
 	}
 
-	static constexpr size_t NumAveraged() { return numAveraged; }
+	// Return the number of entries that the sum covers. Each entry is the mean of one or more readings, so the sum divided by this is the mean reading.
+	size_t NumAveraged() const volatile { return publishedEntries; }
+
+	// Return the number of readings that the average covers
+	size_t NumReadingsAveraged() const volatile { return publishedEntries * publishedDecimation; }
 
 	// Function used as an ADC callback to feed a result into an averaging filter
 	static void CallbackFeedIntoFilter(CallbackParameter cp, uint16_t val);
 
 private:
+	// Publish the sum and valid flag to readers
+	void Publish(uint32_t newSum, bool valid)
+	{
+		++sequence;											// make it odd to tell readers that we are changing the sum and valid flag
+		sum = newSum;
+		publishedEntries = activeEntries;
+		publishedDecimation = activeDecimation;
+		isValid = valid;
+		++sequence;											// make it even again
+	}
+
+	// Set the number of buffer entries we use and the number of readings in each. Only the constructor and ProcessReading may call this.
+	void SetWindow(size_t entries, size_t p_decimation)
+	{
+		activeEntries = entries;
+		activeDecimation = p_decimation;
+	}
+
+	// Reset the filter state. Only the constructor and ProcessReading may call this.
+	void Reset(uint16_t val)
+	{
+		runningSum = (uint32_t)val * (uint32_t)activeEntries;
+		Publish(runningSum, false);
+		index = 0;
+		decimationSum = 0;
+		decimationCount = 0;
+		lastReading = previousReadings[0] = previousReadings[1] = val;
+		for (size_t i = 0; i < numAveraged; ++i)
+		{
+			readings[i] = val;
+		}
+	}
+
+	// These are only accessed by the writer
 	uint16_t readings[numAveraged];
 	size_t index;
-	uint32_t sum;
-	bool isValid;
-	//invariant(sum == + over readings)
-	//invariant(index < numAveraged)
+	size_t activeEntries;									// how many entries of the readings buffer we are using
+	size_t activeDecimation;								// how many readings we average for each entry
+	uint32_t runningSum;
+	uint32_t decimationSum;
+	uint16_t decimationCount;
+	uint16_t previousReadings[2];
+
+	// These are read by other tasks
+	volatile uint32_t sequence = 0;							// odd while the writer is changing the published values
+	volatile uint32_t sum;
+	volatile size_t publishedEntries;
+	volatile size_t publishedDecimation;
+	volatile size_t requestedReadings = 0;					// the number of readings to average when we next reset, or 0 for the default
+	volatile uint16_t lastReading;
+	volatile uint16_t resetValue;
+	volatile bool isValid;
+	volatile bool resetPending;
+	//invariant(runningSum == + over readings[0..activeEntries-1])
+	//invariant(index < activeEntries)
 };
 
-template<size_t numAveraged> void AdcAveragingFilter<numAveraged>::CallbackFeedIntoFilter(CallbackParameter cp, uint16_t val)
+template<size_t numAveraged, size_t decimation, bool rejectSpikes> void AdcAveragingFilter<numAveraged, decimation, rejectSpikes>::CallbackFeedIntoFilter(CallbackParameter cp, uint16_t val)
 {
-	static_cast<AdcAveragingFilter<numAveraged>*>(cp.vp)->ProcessReading(val);
+	static_cast<AdcAveragingFilter<numAveraged, decimation, rejectSpikes>*>(cp.vp)->ProcessReading(val);
 }
 
 #endif /* SRC_ADCAVERAGINGFILTER_H_ */
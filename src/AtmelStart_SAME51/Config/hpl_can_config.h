@@ -161,6 +161,30 @@
 
 // </h>
 
+// <h> RX FIFO 1 Configuration
+// <i> FIFO 1 receives the movement control messages, so that they don't queue behind configuration traffic
+
+// <o> Size <0-64>
+// <i> Number of Rx FIFO 1 element
+// <id> can_rxf1c_f1s
+#ifndef CONF_CAN1_RXF1C_F1S
+#define CONF_CAN1_RXF1C_F1S 8
+#endif
+
+// <o> Data Field Size
+// <i> Rx FIFO 1 Data Field Size
+// <id> can_rxesc_f1ds
+#ifndef CONF_CAN1_RXESC_F1DS
+#define CONF_CAN1_RXESC_F1DS 7
+#endif
+
+/* Bytes size for CAN FIFO 1 element, plus 8 bytes for R0,R1 */
+#undef CONF_CAN1_F1DS
+#define CONF_CAN1_F1DS                                                                                                 \
+	((CONF_CAN1_RXESC_F1DS < 5) ? ((CONF_CAN1_RXESC_F1DS << 2) + 16) : (40 + ((CONF_CAN1_RXESC_F1DS % 5) << 4)))
+
+// </h>
+
 // <h> TX FIFO Configuration
 
 // <o> Transmit FIFO Size <0-32>
@@ -198,14 +222,14 @@
 // <i> Watermark, 0 for disable watermark interrupt
 // <id> can_txefc_efwm
 #ifndef CONF_CAN1_TXEFC_EFWM
-#define CONF_CAN1_TXEFC_EFWM 0
+#define CONF_CAN1_TXEFC_EFWM 8
 #endif
 
 // <o> Size <0-32>
 // <i> Number of Event FIFO element
 // <id> can_txefc_efs
 #ifndef CONF_CAN1_TXEFC_EFS
-#define CONF_CAN1_TXEFC_EFS 2
+#define CONF_CAN1_TXEFC_EFS 16
 #endif
 
 // </h>
@@ -263,7 +287,7 @@
 // <i> Number of Extended Message ID filter elements
 // <id> can_xidfc_lss
 #ifndef CONF_CAN1_XIDFC_LSS
-#define CONF_CAN1_XIDFC_LSS 2
+#define CONF_CAN1_XIDFC_LSS 18
 #endif
 
 // <o> Extended ID Mask <0x0000-0x1FFFFFFF>
@@ -345,7 +369,11 @@
 #endif
 
 #ifndef CONF_CAN1_RXESC_REG
-#define CONF_CAN1_RXESC_REG CAN_RXESC_F0DS(CONF_CAN1_RXESC_F0DS)
+#define CONF_CAN1_RXESC_REG CAN_RXESC_F0DS(CONF_CAN1_RXESC_F0DS) | CAN_RXESC_F1DS(CONF_CAN1_RXESC_F1DS)
+#endif
+
+#ifndef CONF_CAN1_RXF1C_REG
+#define CONF_CAN1_RXF1C_REG CAN_RXF1C_F1S(CONF_CAN1_RXF1C_F1S)
 #endif
 
 #ifndef CONF_CAN1_TXESC_REG
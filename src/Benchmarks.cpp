@@ -0,0 +1,177 @@
+/*
+ * Benchmarks.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "Benchmarks.h"
+#include "Platform.h"
+#include <Movement/Move.h>
+#include <Movement/StepTimer.h>
+#include <Heating/Heat.h>
+#include <Heating/FOPDT.h>
+#include <Heating/Sensors/Thermistor.h>
+#include <CAN/CanInterface.h>
+#include <CanMessageBuffer.h>
+#include <Hardware/Peripherals.h>
+#include <Math/Isqrt.h>
+
+namespace Benchmarks
+{
+	constexpr size_t NumCalls = 64;						// keep this small because we time the calls with interrupts disabled
+
+	static volatile uint32_t benchmarkSink;				// to stop the compiler optimising the calculations away
+	static volatile float floatSink;
+
+	// Time NumCalls calls of a kernel with interrupts disabled, returning the elapsed step clocks
+	template<class F> static uint32_t TimeCalls(F kernel)
+	{
+		AtomicCriticalSectionLocker lock;
+		const uint32_t startTicks = StepTimer::GetTimerTicks();
+		for (size_t i = 0; i < NumCalls; ++i)
+		{
+			kernel(i);
+		}
+		return StepTimer::GetTimerTicks() - startTicks;
+	}
+
+	// Append the time per call to the reply in CPU cycles, less the loop overhead
+	static void AppendCyclesPerCall(const StringRef& reply, const char *name, uint32_t ticks, uint32_t overheadTicks, uint32_t numCalls)
+	{
+		const uint32_t netTicks = (ticks > overheadTicks) ? ticks - overheadTicks : 0;
+		const float cycles = ((float)netTicks * (float)SystemCoreClock)/((float)StepTimer::StepClockRate * (float)numCalls);
+		reply.catf(", %s %.1f", name, (double)cycles);
+	}
+
+	static void AppendStepCalculation(const StringRef& reply, const char *name, bool delta)
+	{
+		uint32_t ticks, steps;
+		bool ok;
+		{
+			TaskCriticalSectionLocker lock;				// stop the Move task taking a new move while we use a DM from its free list
+			ok = DDA::BenchmarkStepTimes(delta, ticks, steps);
+		}
+		if (ok)
+		{
+			AppendCyclesPerCall(reply, name, ticks, 0, steps);
+		}
+		else
+		{
+			reply.catf(", %s n/a", name);
+		}
+	}
+}
+
+// Run the benchmarks. The arguments are typical of the values we get in normal operation.
+GCodeResult Benchmarks::Run(const StringRef& reply)
+{
+	if (!moveInstance->NoLiveMovement())
+	{
+		reply.copy("Can't run benchmarks while moves are running");
+		return GCodeResult::error;
+	}
+
+	reply.printf("Benchmarks, CPU cycles per call at %" PRIu32 "MHz", SystemCoreClock/1000000);
+
+	// Loop overhead, which we subtract from the other results that use TimeCalls
+	const uint32_t overheadTicks = TimeCalls([](size_t i) { benchmarkSink = i; });
+
+	// Reading the step clock, which needs a read synchronisation of the TC count register. The step ISR does this several times per step.
+	AppendCyclesPerCall(reply, "GetTimerTicks", TimeCalls([](size_t) { benchmarkSink = StepTimer::GetTimerTicks(); }), overheadTicks, NumCalls);
+
+	// Integer square root of 64-bit step time calculations
+	{
+		uint64_t sqrtArgs[NumCalls];
+		uint32_t seed = 12345;
+		for (uint64_t& arg : sqrtArgs)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			const uint32_t stepTime = (seed >> 8) + 1000;			// up to 2^24 step clocks, about 22 seconds
+			arg = isquare64(stepTime) + (seed & 0xFFFF);
+		}
+		AppendCyclesPerCall(reply, "isqrt64", TimeCalls([&sqrtArgs](size_t i) { benchmarkSink = isqrt64(sqrtArgs[i]); }), overheadTicks, NumCalls);
+	}
+
+	// Step time calculations, per step
+	AppendStepCalculation(reply, "Cartesian step", false);
+	AppendStepCalculation(reply, "delta step", true);
+
+	// Thermistor reading conversion, using the first thermistor that has been configured
+	{
+		bool found = false;
+		for (unsigned int sn = 0; sn < MaxSensors && !found; ++sn)
+		{
+			const auto sensor = Heat::FindSensorAtOrAbove(sn);
+			if (sensor.IsNull())
+			{
+				break;
+			}
+			sn = sensor->GetSensorNumber();
+			if (strcmp(sensor->GetSensorType(), Thermistor::TypeNameThermistor) == 0)
+			{
+				TemperatureSensor * const ts = sensor.Ptr();
+				AppendCyclesPerCall(reply, "Thermistor::Poll", TimeCalls([ts](size_t) { ts->Poll(); }), overheadTicks, NumCalls);
+				found = true;
+			}
+		}
+		if (!found)
+		{
+			reply.cat(", Thermistor::Poll n/a");
+		}
+	}
+
+	// PT100 resistance to temperature conversion, from 0C to about 500C
+	AppendCyclesPerCall(reply, "GetPT100Temperature",
+						TimeCalls([](size_t i)
+									{
+										float t;
+										(void)TemperatureSensor::GetPT100Temperature(t, 10000 + 285 * i);
+										floatSink = t;
+									}),
+						overheadTicks, NumCalls);
+
+	// PID evaluation for a typical hot end holding its temperature
+	{
+		FopDt model;
+		(void)model.SetParameters(340.0, 140.0, 5.5, 1.0, 285.0, 24.0, true, false);
+		float iAccumulator = 0.3;
+		AppendCyclesPerCall(reply, "FopDt PID",
+							TimeCalls([&model, &iAccumulator](size_t i)
+										{
+											const float temperature = 209.6 + 0.1 * (float)(i & 7);
+											floatSink = model.CalcPidPwm(temperature, 210.0 - temperature, 0.05, 0.0, true, false, HeatSampleIntervalMillis, iAccumulator);
+										}),
+							overheadTicks, NumCalls);
+	}
+
+	// Packing a full sensor temperatures message
+	{
+		CanMessageBuffer buf(nullptr);
+		const CanAddress myAddress = CanInterface::GetCanAddress();
+		AppendCyclesPerCall(reply, "CAN sensor temps",
+							TimeCalls([&buf, myAddress](size_t i)
+										{
+											CanMessageSensorTemperatures * const msg = buf.SetupBroadcastMessage<CanMessageSensorTemperatures>(myAddress);
+											msg->whichSensors = 0;
+											for (size_t j = 0; j < ARRAY_SIZE(msg->temperatureReports); ++j)
+											{
+												msg->whichSensors |= (uint64_t)1u << j;
+												msg->temperatureReports[j].errorCode = 0;
+												msg->temperatureReports[j].temperature = 20.0 + (float)(i + j);
+											}
+											buf.dataLength = msg->GetActualDataLength(ARRAY_SIZE(msg->temperatureReports));
+										}),
+							overheadTicks, NumCalls);
+	}
+
+	// Thermistor ADC averaging filter
+	{
+		ThermistorAveragingFilter filter;
+		AppendCyclesPerCall(reply, "AdcAveragingFilter::ProcessReading", TimeCalls([&filter](size_t i) { filter.ProcessReading(2000 + (i & 15)); }), overheadTicks, NumCalls);
+	}
+
+	return GCodeResult::ok;
+}
+
+// End
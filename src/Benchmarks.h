@@ -0,0 +1,22 @@
+/*
+ * Benchmarks.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Times the core calculation kernels on the actual processor, so that we have a reproducible performance baseline for each build and board.
+ *  Run it using M122 B# P1005. It must be run when no moves are running, because it disables interrupts while it times each kernel.
+ */
+
+#ifndef SRC_BENCHMARKS_H_
+#define SRC_BENCHMARKS_H_
+
+#include "RepRapFirmware.h"
+#include <GCodes/GCodeResult.h>
+
+namespace Benchmarks
+{
+	GCodeResult Run(const StringRef& reply);			// run the benchmarks and put the CPU cycles per call of each kernel in the reply
+}
+
+#endif /* SRC_BENCHMARKS_H_ */
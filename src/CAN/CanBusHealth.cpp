@@ -0,0 +1,249 @@
+/*
+ * CanBusHealth.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "CanBusHealth.h"
+
+#if SUPPORT_CAN_BUS_HEALTH
+
+#include "CanInterface.h"
+#include <CanMessageBuffer.h>
+#include <Movement/StepTimer.h>
+#include <RTOSIface/RTOSIface.h>
+
+namespace CanBusHealth
+{
+	constexpr uint32_t SampleIntervalMillis = 100;					// how often we sample the error counters
+	constexpr size_t MaxMessageTypes = ARRAY_SIZE(CanMessageCanBusHealthReply::types);	// the number of message types we keep statistics for
+
+	struct MessageTypeStats
+	{
+		CanMessageType type;
+		uint32_t count;
+		uint32_t maxLatencyTicks;
+		uint64_t totalLatencyTicks;
+	};
+
+	static can_async_descriptor *device = nullptr;
+
+	// Updated by the CAN ISR
+	static volatile unsigned int numErrorWarnings = 0, numErrorPassive = 0, numBusOff = 0, numRxOverruns = 0;
+
+	// Updated by the async sender task and the CAN ISR
+	static volatile uint8_t maxTxErrorCount = 0, maxRxErrorCount = 0;
+
+	// Updated by the tasks that send messages
+	static volatile uint8_t maxTxQueueLevel = 0;
+
+	// Updated by the CAN receiver task
+	static MessageTypeStats messageTypes[MaxMessageTypes];
+	static size_t numMessageTypes = 0;
+	static uint32_t numUnrecordedMessages = 0;						// messages we didn't record because the message type table was full
+
+	static uint32_t whenLastReset = 0;
+	static uint32_t whenLastSampled = 0;
+
+	static inline float TicksToMicroseconds(uint32_t ticks)
+	{
+		return (float)ticks * (1000000.0/(float)StepTimer::StepClockRate);
+	}
+
+	// Sample the error counters and keep the highest values. Called with interrupts disabled or from the CAN ISR.
+	static void SampleErrorCounters()
+	{
+		const uint8_t tec = can_async_get_txerr(device);
+		const uint8_t rec = can_async_get_rxerr(device);
+		if (tec > maxTxErrorCount)
+		{
+			maxTxErrorCount = tec;
+		}
+		if (rec > maxRxErrorCount)
+		{
+			maxRxErrorCount = rec;
+		}
+	}
+
+	// Reset the statistics. Called by the main task after reporting them.
+	static void Reset()
+	{
+		{
+			AtomicCriticalSectionLocker lock;
+			numErrorWarnings = numErrorPassive = numBusOff = numRxOverruns = 0;
+			maxTxErrorCount = maxRxErrorCount = 0;
+			maxTxQueueLevel = 0;
+			SampleErrorCounters();
+		}
+		{
+			TaskCriticalSectionLocker lock;
+			numMessageTypes = 0;
+			numUnrecordedMessages = 0;
+		}
+		whenLastReset = millis();
+	}
+}
+
+void CanBusHealth::Init(can_async_descriptor *descr)
+{
+	device = descr;
+	whenLastReset = whenLastSampled = millis();
+}
+
+// Record an error interrupt. If we have gone bus off, start recovery so that we rejoin the bus when it is quiet again.
+void CanBusHealth::RecordEvent(can_async_interrupt_type type)
+{
+	switch (type)
+	{
+	case CAN_IRQ_EW:
+		++numErrorWarnings;
+		break;
+
+	case CAN_IRQ_EP:
+		++numErrorPassive;
+		break;
+
+	case CAN_IRQ_BO:
+		++numBusOff;
+		can_async_start_bus_off_recovery(device);
+		break;
+
+	case CAN_IRQ_DO:
+		++numRxOverruns;
+		break;
+
+	default:
+		break;
+	}
+	SampleErrorCounters();
+}
+
+// Record a message that the receiver task has taken from the receive FIFO
+void CanBusHealth::RecordReceived(CanMessageType type, uint32_t latencyTicks)
+{
+	MessageTypeStats *stats = nullptr;
+	for (size_t i = 0; i < numMessageTypes; ++i)
+	{
+		if (messageTypes[i].type == type)
+		{
+			stats = &messageTypes[i];
+			break;
+		}
+	}
+
+	if (stats == nullptr)
+	{
+		if (numMessageTypes == MaxMessageTypes)
+		{
+			++numUnrecordedMessages;
+			return;
+		}
+		stats = &messageTypes[numMessageTypes];
+		stats->type = type;
+		stats->count = 0;
+		stats->maxLatencyTicks = 0;
+		stats->totalLatencyTicks = 0;
+		++numMessageTypes;
+	}
+
+	++stats->count;
+	stats->totalLatencyTicks += latencyTicks;
+	if (latencyTicks > stats->maxLatencyTicks)
+	{
+		stats->maxLatencyTicks = latencyTicks;
+	}
+}
+
+// Record how many messages are waiting to be sent. Called just after a message has been queued, when the level is highest.
+void CanBusHealth::RecordTxQueueLevel()
+{
+	const uint8_t level = can_async_get_tx_queue_level(device);
+	if (level > maxTxQueueLevel)
+	{
+		maxTxQueueLevel = level;
+	}
+}
+
+// Sample the error counters if it is time to
+uint32_t CanBusHealth::Spin()
+{
+	const uint32_t now = millis();
+	const uint32_t timeSinceSampled = now - whenLastSampled;
+	if (timeSinceSampled < SampleIntervalMillis)
+	{
+		return SampleIntervalMillis - timeSinceSampled;
+	}
+
+	{
+		AtomicCriticalSectionLocker lock;
+		SampleErrorCounters();
+	}
+	whenLastSampled = now;
+	return SampleIntervalMillis;
+}
+
+// Reply to a canBusHealthRequest message, then reset the statistics
+void CanBusHealth::SendReport(CanMessageBuffer *buf)
+{
+	const CanRequestId requestId = buf->msg.canBusHealthRequest.requestId;
+	CanMessageCanBusHealthReply * const reply = buf->SetupResponseMessage<CanMessageCanBusHealthReply>(requestId, CanInterface::GetCanAddress(), buf->id.Src());
+	bool errorPassive;
+	const bool busOff = can_async_get_error_state(device, errorPassive);
+	reply->txErrorCount = can_async_get_txerr(device);
+	reply->rxErrorCount = can_async_get_rxerr(device);
+	reply->maxTxErrorCount = maxTxErrorCount;
+	reply->maxRxErrorCount = maxRxErrorCount;
+	reply->flags = ((errorPassive) ? CanMessageCanBusHealthReply::FlagErrorPassive : 0) | ((busOff) ? CanMessageCanBusHealthReply::FlagBusOff : 0);
+	reply->maxTxQueueLevel = maxTxQueueLevel;
+	reply->numErrorWarnings = min<unsigned int>(numErrorWarnings, 0xFFFF);
+	reply->numErrorPassive = min<unsigned int>(numErrorPassive, 0xFFFF);
+	reply->numBusOff = min<unsigned int>(numBusOff, 0xFFFF);
+	reply->numRxOverruns = min<unsigned int>(numRxOverruns, 0xFFFF);
+	reply->intervalMillis = millis() - whenLastReset;
+	{
+		TaskCriticalSectionLocker lock;
+		reply->numTypes = numMessageTypes;
+		for (size_t i = 0; i < numMessageTypes; ++i)
+		{
+			const MessageTypeStats& stats = messageTypes[i];
+			reply->types[i].type = (uint16_t)stats.type;
+			reply->types[i].count = min<uint32_t>(stats.count, 0xFFFF);
+			reply->types[i].avgLatencyMicros = min<uint32_t>(lrintf(TicksToMicroseconds(stats.totalLatencyTicks/stats.count)), 0xFFFF);
+			reply->types[i].maxLatencyMicros = min<uint32_t>(lrintf(TicksToMicroseconds(stats.maxLatencyTicks)), 0xFFFF);
+		}
+	}
+	buf->dataLength = reply->GetActualDataLength();
+	CanInterface::SendAndFree(buf);
+	Reset();
+}
+
+// Append the statistics to the reply, then reset them
+void CanBusHealth::Diagnostics(const StringRef& reply)
+{
+	bool errorPassive;
+	const bool busOff = can_async_get_error_state(device, errorPassive);
+	reply.lcatf("CAN bus %s, error counts tx %u (max %u) rx %u (max %u), error warnings %u, error passive %u, bus off %u, receive overruns %u, max transmit queue %u",
+				(busOff) ? "off" : (errorPassive) ? "error passive" : "ok",
+				can_async_get_txerr(device), maxTxErrorCount, can_async_get_rxerr(device), maxRxErrorCount,
+				numErrorWarnings, numErrorPassive, numBusOff, numRxOverruns, maxTxQueueLevel);
+	{
+		TaskCriticalSectionLocker lock;
+		reply.lcatf("Messages received in %.1fs:", (double)((float)(millis() - whenLastReset) * 0.001));
+		for (size_t i = 0; i < numMessageTypes; ++i)
+		{
+			const MessageTypeStats& stats = messageTypes[i];
+			reply.catf(" %u: %" PRIu32 " (latency avg %.1fus max %.1fus)",
+						(unsigned int)stats.type, stats.count, (double)TicksToMicroseconds(stats.totalLatencyTicks/stats.count), (double)TicksToMicroseconds(stats.maxLatencyTicks));
+		}
+		if (numUnrecordedMessages != 0)
+		{
+			reply.catf(", %" PRIu32 " of other types", numUnrecordedMessages);
+		}
+	}
+	Reset();
+}
+
+#endif
+
+// End
@@ -0,0 +1,42 @@
+/*
+ * CanBusHealth.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Statistics about the health of the CAN bus as this board sees it, to find out whether timing problems on long buses are caused by bus errors or saturation.
+ *  - The CAN error interrupts count error warning, error passive and bus off events and messages lost because a receive FIFO was full.
+ *    We start bus off recovery straight away, so that the board rejoins the bus without being reset.
+ *  - The transmit and receive error counters are sampled by the async sender task and on each error interrupt, and we keep the highest values.
+ *  - We keep the highest number of messages waiting in the transmit FIFO after each send.
+ *  - For each type of message we receive, we count the messages and measure the latency from when the message started arriving,
+ *    according to the hardware receive timestamp, to when the receiver task took it from the FIFO.
+ *  The statistics are reported by M122 B# P4 and in the reply to a canBusHealthRequest message, and both reset them.
+ */
+
+#ifndef SRC_CAN_CANBUSHEALTH_H_
+#define SRC_CAN_CANBUSHEALTH_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_CAN_BUS_HEALTH
+
+#include <CanId.h>
+#include <Hardware/CanDriver.h>
+
+class CanMessageBuffer;
+
+namespace CanBusHealth
+{
+	void Init(can_async_descriptor *descr);
+	void RecordEvent(can_async_interrupt_type type);						// called from the CAN ISR
+	void RecordReceived(CanMessageType type, uint32_t latencyTicks);		// called by the CAN receiver task
+	void RecordTxQueueLevel();												// called after each message is queued for sending
+	uint32_t Spin();														// called by the async sender task, returns the maximum time in milliseconds before we want to be called again
+	void SendReport(CanMessageBuffer *buf);									// reply to a canBusHealthRequest message, reusing its buffer
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif
+
+#endif /* SRC_CAN_CANBUSHEALTH_H_ */
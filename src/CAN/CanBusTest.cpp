@@ -0,0 +1,203 @@
+/*
+ * CanBusTest.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "CanBusTest.h"
+
+#if SUPPORT_CAN_BUS_TEST
+
+#include "CanInterface.h"
+#include <CanMessageBuffer.h>
+#include <CanMessageGenericParser.h>
+#include <Movement/StepTimer.h>
+#include <RTOSIface/RTOSIface.h>
+
+namespace CanBusTest
+{
+	constexpr size_t FloodBatchSize = 8;						// how many flood frames we send each time we are called, so that input change messages still get through
+
+	// Ping statistics
+	static uint32_t numPings = 0;
+	static uint32_t totalTurnaroundTicks = 0, maxTurnaroundTicks = 0;
+
+	// Flood that we are sending, or have sent
+	static uint16_t txNumFrames = 0, txNextSeq = 0;
+	static uint8_t txPayloadLength = 0;
+	static uint32_t txStartTime, txElapsedTicks = 0, txBytes = 0, txFailed = 0;
+
+	// Flood that we are receiving, or have received
+	static bool rxActive = false;
+	static uint16_t rxExpectedSeq, rxNumFrames;
+	static uint32_t rxFrames = 0, rxLost = 0, rxBytes = 0, rxFirstTime, rxLastTime;
+
+	static float TicksToMicroseconds(uint32_t ticks)
+	{
+		return (float)ticks * (1000000.0/(float)StepTimer::StepClockRate);
+	}
+
+	// Return the throughput in kbytes/sec
+	static float Throughput(uint32_t bytes, uint32_t ticks)
+	{
+		return (ticks == 0) ? 0.0 : ((float)bytes * (float)StepTimer::StepClockRate)/((float)ticks * 1000.0);
+	}
+}
+
+// Reply to a ping, reusing its buffer
+void CanBusTest::ProcessPing(CanMessageBuffer *buf, uint32_t whenReceived)
+{
+	const CanAddress src = buf->id.Src();
+	const CanMessageCanPing ping = buf->msg.canPing;			// copy it because the echo overwrites it
+	const size_t headerLength = sizeof(CanMessageCanPing) - sizeof(ping.payload);
+	const size_t payloadLength = (buf->dataLength > headerLength) ? min<size_t>(buf->dataLength - headerLength, sizeof(CanMessageCanEcho::payload)) : 0;
+
+	CanMessageCanEcho * const echo = buf->SetupStatusMessage<CanMessageCanEcho>(CanInterface::GetCanAddress(), src);
+	echo->seq = ping.seq;
+	echo->spare = 0;
+	echo->timeSent = ping.timeSent;
+	echo->timeReceived = whenReceived;
+	memcpy(echo->payload, ping.payload, payloadLength);
+	buf->dataLength = echo->GetActualDataLength(payloadLength);
+	const uint32_t now = StepTimer::GetTimerTicks();
+	echo->timeReplied = now;
+	CanInterface::SendAndFree(buf);
+
+	const uint32_t turnaround = now - whenReceived;
+	++numPings;
+	totalTurnaroundTicks += turnaround;
+	if (turnaround > maxTurnaroundTicks)
+	{
+		maxTurnaroundTicks = turnaround;
+	}
+}
+
+// Count a flood frame from the main board. Sequence number zero starts a new flood.
+void CanBusTest::ProcessFloodFrame(CanMessageBuffer *buf, uint32_t whenReceived)
+{
+	const CanMessageCanFlood& frame = buf->msg.canFlood;
+	if (frame.seq == 0 || !rxActive)
+	{
+		rxActive = true;
+		rxFrames = rxBytes = 0;
+		rxLost = frame.seq;										// if we missed the start, count the frames we missed as lost
+		rxFirstTime = whenReceived;
+	}
+	else if (frame.seq != rxExpectedSeq)
+	{
+		rxLost += (uint16_t)(frame.seq - rxExpectedSeq);
+	}
+	rxExpectedSeq = frame.seq + 1;
+	rxNumFrames = frame.numFrames;
+	++rxFrames;
+	rxBytes += buf->dataLength;
+	rxLastTime = whenReceived;
+	CanInterface::FreeBuffer(buf);
+}
+
+GCodeResult CanBusTest::StartFlood(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, CanFloodRequestParams);
+	uint16_t numFrames;
+	if (!parser.GetUintParam('N', numFrames))
+	{
+		reply.copy("Missing N parameter");
+		return GCodeResult::error;
+	}
+	uint8_t payloadLength = 0;
+	(void)parser.GetUintParam('S', payloadLength);
+	if (payloadLength > sizeof(CanMessageCanFlood::payload))
+	{
+		reply.printf("Payload length must be no more than %u bytes", sizeof(CanMessageCanFlood::payload));
+		return GCodeResult::error;
+	}
+
+	{
+		TaskCriticalSectionLocker lock;
+		if (txNextSeq < txNumFrames)
+		{
+			reply.copy("Flood already in progress");
+			return GCodeResult::error;
+		}
+		txNumFrames = numFrames;
+		txPayloadLength = payloadLength;
+		txNextSeq = 0;
+		txElapsedTicks = txBytes = txFailed = 0;
+	}
+	CanInterface::WakeAsyncSender();
+	return GCodeResult::ok;
+}
+
+// Send the next batch of flood frames, if we are sending a flood
+uint32_t CanBusTest::Spin(CanMessageBuffer *buf)
+{
+	if (txNextSeq >= txNumFrames)
+	{
+		return TaskBase::TimeoutUnlimited;
+	}
+
+	if (txNextSeq == 0)
+	{
+		txStartTime = StepTimer::GetTimerTicks();
+	}
+
+	for (size_t i = 0; i < FloodBatchSize && txNextSeq < txNumFrames; ++i)
+	{
+		CanMessageCanFlood * const msg = buf->SetupStatusMessage<CanMessageCanFlood>(CanInterface::GetCanAddress(), CanId::MasterAddress);
+		msg->seq = txNextSeq;
+		msg->numFrames = txNumFrames;
+		msg->timeSent = StepTimer::GetTimerTicks();
+		memset(msg->payload, (uint8_t)txNextSeq, txPayloadLength);
+		buf->dataLength = msg->GetActualDataLength(txPayloadLength);
+		if (CanInterface::Send(buf))
+		{
+			txBytes += buf->dataLength;
+		}
+		else
+		{
+			++txFailed;
+		}
+		++txNextSeq;
+	}
+
+	if (txNextSeq < txNumFrames)
+	{
+		return 0;
+	}
+	txElapsedTicks = StepTimer::GetTimerTicks() - txStartTime;
+	return TaskBase::TimeoutUnlimited;
+}
+
+void CanBusTest::Diagnostics(const StringRef& reply)
+{
+	reply.lcatf("CAN pings %" PRIu32, numPings);
+	if (numPings != 0)
+	{
+		reply.catf(", turnaround avg %.1fus max %.1fus", (double)TicksToMicroseconds(totalTurnaroundTicks/numPings), (double)TicksToMicroseconds(maxTurnaroundTicks));
+	}
+	numPings = totalTurnaroundTicks = maxTurnaroundTicks = 0;
+
+	if (txNumFrames != 0)
+	{
+		if (txNextSeq < txNumFrames)
+		{
+			reply.lcatf("CAN flood sending, %u of %u frames sent", txNextSeq, txNumFrames);
+		}
+		else
+		{
+			reply.lcatf("CAN flood sent %u frames %" PRIu32 " bytes in %.1fms (%.1f kbytes/sec), failed %" PRIu32,
+						txNumFrames, txBytes, (double)(TicksToMicroseconds(txElapsedTicks) * 0.001), (double)Throughput(txBytes, txElapsedTicks), txFailed);
+		}
+	}
+
+	if (rxActive)
+	{
+		reply.lcatf("CAN flood received %" PRIu32 " of %u frames, lost %" PRIu32 ", %" PRIu32 " bytes (%.1f kbytes/sec)",
+					rxFrames, rxNumFrames, rxLost, rxBytes, (double)Throughput(rxBytes, rxLastTime - rxFirstTime));
+	}
+}
+
+#endif
+
+// End
@@ -0,0 +1,39 @@
+/*
+ * CanBusTest.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Our side of the CAN bus latency and throughput tests, which the main board runs to size segment rates and the number of boards per bus.
+ *  - We answer each canPing message with a canEcho message of the same size, holding the ping sequence number and send time, the step clock
+ *    time at which the ping started arriving according to the hardware receive timestamp, and the time we queued the reply.
+ *    So the main board can subtract our turnaround time from the round trip time.
+ *  - The canFloodRequest message asks us to send N canFlood frames with S bytes of payload to the main board as fast as the bus allows.
+ *  - We count the canFlood frames that the main board sends us, detecting lost frames from gaps in the sequence numbers.
+ *  The results from our side are reported in the bus diagnostics.
+ */
+
+#ifndef SRC_CAN_CANBUSTEST_H_
+#define SRC_CAN_CANBUSTEST_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_CAN_BUS_TEST
+
+#include <GCodes/GCodeResult.h>
+
+class CanMessageBuffer;
+struct CanMessageGeneric;
+
+namespace CanBusTest
+{
+	void ProcessPing(CanMessageBuffer *buf, uint32_t whenReceived);					// called by the CAN receiver task, frees or reuses the buffer
+	void ProcessFloodFrame(CanMessageBuffer *buf, uint32_t whenReceived);			// called by the CAN receiver task, frees the buffer
+	GCodeResult StartFlood(const CanMessageGeneric& msg, const StringRef& reply);	// process a canFloodRequest message
+	uint32_t Spin(CanMessageBuffer *buf);											// called by the async sender task, returns the maximum time in milliseconds before we want to be called again
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif
+
+#endif /* SRC_CAN_CANBUSTEST_H_ */
@@ -0,0 +1,144 @@
+/*
+ * CanEnumeration.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "CanEnumeration.h"
+
+#if SUPPORT_CAN_ENUMERATION
+
+#include "CanInterface.h"
+#include <CanMessageBuffer.h>
+#include <Platform.h>
+#include <RTOSIface/RTOSIface.h>
+
+namespace CanEnumeration
+{
+	constexpr uint16_t DefaultWindowMillis = 200;			// the reply window we use if the request doesn't give one
+
+	// The reply we have been asked to send. The receiver task sets it up and the async sender task sends it.
+	static volatile bool replyPending = false;
+	static uint16_t replySession;
+	static uint8_t replyRound;
+	static uint32_t whenReplyDue;
+
+	static bool haveAssignment = false;
+	static uint16_t assignedSession;						// the session in which we were given an address
+	static uint32_t numRequests = 0, numReplies = 0, numAssignments = 0, numNvmFailures = 0;
+
+	// Mix the bits of a word so that a small change to the input changes about half the bits of the output
+	static inline uint32_t Mix(uint32_t h)
+	{
+		h ^= h >> 16;
+		h *= 0x85EBCA6B;
+		h ^= h >> 13;
+		h *= 0xC2B2AE35;
+		h ^= h >> 16;
+		return h;
+	}
+
+	// Return the delay in milliseconds before we reply in this round. It depends on the unique ID so that boards with the same address reply at different times,
+	// and on the round so that boards whose replies collided in one round are unlikely to collide again in the next.
+	static uint32_t GetReplyDelay(uint16_t session, uint8_t round, uint16_t windowMillis)
+	{
+		const uint32_t * const uniqueId = Platform::GetUniqueId();
+		uint32_t h = ((uint32_t)session << 8) | round;
+		for (size_t i = 0; i < 4; ++i)
+		{
+			h = Mix(h ^ uniqueId[i]);
+		}
+		return h % windowMillis;
+	}
+
+	static bool MatchesUniqueId(const uint32_t *id)
+	{
+		const uint32_t * const uniqueId = Platform::GetUniqueId();
+		for (size_t i = 0; i < 4; ++i)
+		{
+			if (id[i] != uniqueId[i])
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+// Process an enumerateRequest message. We don't reply straight away, instead we ask the async sender task to do it after a delay.
+void CanEnumeration::ProcessRequest(const CanMessageEnumerateRequest& msg)
+{
+	++numRequests;
+	if (haveAssignment && msg.session == assignedSession)
+	{
+		return;												// the main board has already given us an address in this session
+	}
+
+	const uint16_t windowMillis = (msg.windowMillis == 0) ? DefaultWindowMillis : msg.windowMillis;
+	replyPending = false;									// in case we still had a reply pending from the previous round
+	replySession = msg.session;
+	replyRound = msg.round;
+	whenReplyDue = millis() + GetReplyDelay(msg.session, msg.round, windowMillis);
+	replyPending = true;
+	CanInterface::WakeAsyncSender();
+}
+
+// Process an assignAddress message, which is broadcast, so ignore it unless it holds our unique ID
+void CanEnumeration::ProcessAssignment(const CanMessageAssignAddress& msg)
+{
+	if (   MatchesUniqueId(msg.uniqueId)
+		&& msg.newAddress != 0 && msg.newAddress <= CanId::MaxCanAddress && msg.newAddress == (uint8_t)~msg.newAddressInverted
+	   )
+	{
+		replyPending = false;
+		haveAssignment = true;
+		assignedSession = msg.session;
+		++numAssignments;
+		if (!CanInterface::SetAddressNow(msg.newAddress))
+		{
+			++numNvmFailures;								// we use the new address until we are reset, but the main board will have to assign it again after that
+		}
+	}
+}
+
+// Send our reply if it is due
+uint32_t CanEnumeration::Spin(CanMessageBuffer *buf)
+{
+	if (!replyPending)
+	{
+		return TaskBase::TimeoutUnlimited;
+	}
+
+	const int32_t timeToWait = (int32_t)(whenReplyDue - millis());
+	if (timeToWait > 0)
+	{
+		return (uint32_t)timeToWait;
+	}
+
+	replyPending = false;
+	CanMessageEnumerateReply * const msg = buf->SetupStatusMessage<CanMessageEnumerateReply>(CanInterface::GetCanAddress(), CanId::MasterAddress);
+	msg->session = replySession;
+	msg->round = replyRound;
+	msg->currentAddress = CanInterface::GetCanAddress();
+	memcpy(msg->uniqueId, Platform::GetUniqueId(), sizeof(msg->uniqueId));
+	msg->numDrivers = NumDrivers;
+	msg->spare = 0;
+	strncpy(msg->boardType, BoardTypeName, sizeof(msg->boardType));
+	buf->dataLength = msg->GetActualDataLength();
+	if (CanInterface::Send(buf))
+	{
+		++numReplies;
+	}
+	return TaskBase::TimeoutUnlimited;
+}
+
+void CanEnumeration::Diagnostics(const StringRef& reply)
+{
+	reply.lcatf("CAN enumeration requests %" PRIu32 ", replies %" PRIu32 ", addresses assigned %" PRIu32 ", NVM write failures %" PRIu32,
+				numRequests, numReplies, numAssignments, numNvmFailures);
+}
+
+#endif
+
+// End
@@ -0,0 +1,38 @@
+/*
+ * CanEnumeration.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Our side of the protocol that lets the main board find the boards on the bus and give them addresses without using the address switches.
+ *  - The main board broadcasts an enumerateRequest message holding a session number, a round number and a reply window. We reply with our
+ *    unique ID, board type and current address after a delay within the window that is derived from our unique ID and the round number,
+ *    so that boards that still have the same default address almost never send their replies at the same time.
+ *  - The main board then broadcasts an assignAddress message for each unique ID it has heard. The board whose ID matches takes the new address
+ *    straight away and stores it in the NVM user area, and then announces itself from the new address. So no reset is needed.
+ *  - A board that has been given an address in a session doesn't reply to further rounds of it, so the main board repeats the rounds
+ *    until it hears no more replies. Each round gives different delays, so boards whose replies collided in one round are heard in a later one.
+ */
+
+#ifndef SRC_CAN_CANENUMERATION_H_
+#define SRC_CAN_CANENUMERATION_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_CAN_ENUMERATION
+
+class CanMessageBuffer;
+struct CanMessageEnumerateRequest;
+struct CanMessageAssignAddress;
+
+namespace CanEnumeration
+{
+	void ProcessRequest(const CanMessageEnumerateRequest& msg);			// called by the CAN receiver task
+	void ProcessAssignment(const CanMessageAssignAddress& msg);			// called by the CAN receiver task
+	uint32_t Spin(CanMessageBuffer *buf);								// called by the async sender task, returns the maximum time in milliseconds before we want to be called again
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif
+
+#endif /* SRC_CAN_CANENUMERATION_H_ */
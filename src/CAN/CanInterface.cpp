@@ -10,21 +10,58 @@
 #include <CanSettings.h>
 #include <CanMessageFormats.h>
 #include <CanMessageBuffer.h>
+#include <CanMessageGenericParser.h>
 #include <Platform.h>
 #include <Movement/StepTimer.h>
 #include <RTOSIface/RTOSIface.h>
 #include <InputMonitors/InputMonitor.h>
+#include <Heating/Heat.h>
 #include <Movement/Move.h>
 #include <Hardware/CanDriver.h>
+#include "CanBusHealth.h"
 #include <Version.h>
+#include <Tracer.h>
+#include <Tasks.h>
+#include <StackSizes.h>
+#include <StartupProfiler.h>
 #include <peripheral_clk_config.h>
-#include <hpl_user_area.h>
+#include <Hardware/NvmWriter.h>
+#include "RemoteConsole.h"
+#include "CanBusTest.h"
+#include "CompactMovement.h"
+#include "PositionReports.h"
+#include "CartesianMovement.h"
+#include "CanEnumeration.h"
+#include <InputMonitors/AnalogStream.h>
 
 const unsigned int NumCanBuffers = 40;
+const unsigned int NumCanBuffersReservedForReceiver = 8;			// other tasks and queued commands can't use these, so that we can always receive motion messages
+const uint32_t CanBufferWaitTimeout = 100;						// in case we miss a wakeup
+#if SUPPORT_SHORT_CAN_BUFFERS
+# if defined(SAME51)
+const unsigned int NumShortCanBuffers = 16;
+# else
+const unsigned int NumShortCanBuffers = 24;						// the SAMC21 is short of RAM, so we rely more on short buffers to queue bursts of small commands
+# endif
+constexpr size_t ShortCanBufferDataLength = 16;					// the longest message that fits in a short buffer, which is a valid CAN-FD data length
+#endif
+
+static volatile TaskHandle bufferWaitingTasks[(size_t)CanInterface::BufferUser::numUsers] = { nullptr };
+static unsigned int minFreeCanBuffers = NumCanBuffers;
+static unsigned int maxFreeCanBuffers = 0;
+static unsigned int numBufferAllocationFailures[(size_t)CanInterface::BufferUser::numUsers] = { 0 };
+static unsigned int numCommandReadsDeferred = 0;				// how many times the receiver left commands in the FIFO because only the reserved buffers were free
 
 static CanUserAreaData canConfigData;
 static CanAddress boardAddress;
 static bool enabled = false;
+static uint32_t canClocksPerBit;								// the nominal bit time, used to convert receive timestamps to step clocks
+
+constexpr uint32_t CanClocksPerStepClock = CanTiming::ClockFrequency/StepTimer::StepClockRate;
+static_assert(CanClocksPerStepClock * StepTimer::StepClockRate == CanTiming::ClockFrequency, "The step clock rate must divide the CAN clock frequency");
+#if defined(SAME51)
+static_assert(CONF_GCLK_CAN1_SRC == GclkTiming && CONF_GCLK_CAN1_FREQUENCY == TimingClockFrequency, "CAN must be clocked from the timing GCLK");
+#endif
 
 #if defined(SAME51)
 constexpr uint32_t CanUserAreaDataOffset = 512 - sizeof(CanUserAreaData);
@@ -32,15 +69,48 @@ constexpr uint32_t CanUserAreaDataOffset = 512 - sizeof(CanUserAreaData);
 constexpr uint32_t CanUserAreaDataOffset = 256 - sizeof(CanUserAreaData);
 #endif
 
+// The CAN FD data phase timing is stored in the NVM user area just below the normal CAN configuration data. It takes effect when we next start up.
+struct CanFastTimingUserAreaData
+{
+	static constexpr uint32_t ValidMarker = 0x46445431;			// "FDT1"
+
+	uint32_t marker;
+	CanTiming timing;
+
+	bool IsValid() const { return marker == ValidMarker; }
+};
+
+constexpr uint32_t CanFastTimingUserAreaDataOffset = CanUserAreaDataOffset - sizeof(CanFastTimingUserAreaData);
+constexpr uint32_t MinFastTimingPeriod = 8;						// the fastest data phase we support is 6Mbps
+
+static CanFastTimingUserAreaData canFastTimingData;
+
+// The group addresses that this board responds to as well as its own address, so that the main board can configure several identical boards with one message.
+// They are stored in the NVM user area below the CAN FD timing data. A group address of zero means the slot is not in use.
+struct CanGroupUserAreaData
+{
+	static constexpr uint32_t ValidMarker = 0x47525031;			// "GRP1"
+
+	uint32_t marker;
+	CanAddress groupAddresses[CanInterface::MaxCanGroups];
+
+	bool IsValid() const { return marker == ValidMarker; }
+};
+
+constexpr uint32_t CanGroupUserAreaDataOffset = CanFastTimingUserAreaDataOffset - sizeof(CanGroupUserAreaData);
+
+static CanGroupUserAreaData canGroupData;
+static CanAddress groupAddresses[CanInterface::MaxCanGroups] = { 0 };	// the group addresses in use since we started up
+
 // CanReceiver management task
-constexpr size_t CanReceiverTaskStackWords = 400;
-static Task<CanReceiverTaskStackWords> canReceiverTask;
+static Task<StackSizes::CanReceiverTaskWords> canReceiverTask;
 
 // Async sender task
-constexpr size_t CanAsyncSenderTaskStackWords = 400;
-static Task<CanAsyncSenderTaskStackWords> canAsyncSenderTask;
+static Task<StackSizes::CanAsyncSenderTaskWords> canAsyncSenderTask;
 
-static TaskHandle sendingTaskHandle = nullptr;
+static volatile TaskHandle sendingTaskHandle = nullptr;	// a task waiting for space in the transmit FIFO
+static unsigned int numTxFifoFullWaits = 0;
+constexpr uint32_t TxFifoFullTimeout = 2;					// how long we wait for space in the transmit FIFO each time, in milliseconds
 
 static bool mainBoardAcknowledgedAnnounce = false;	// true after the main board has acknowledged our announcement
 static bool isProgrammed = false;					// true after the main board has sent us any configuration commands
@@ -51,6 +121,11 @@ public:
 	CanMessageQueue();
 	void AddMessage(CanMessageBuffer *buf);
 	CanMessageBuffer *GetMessage();
+	bool IsEmpty() const { return pendingMessages == nullptr; }
+#if SUPPORT_SPEED_OVERRIDE
+	template<class F> void ForEach(F func);				// call a function on each message in the queue while stopping other tasks from taking them
+	bool PeekMoveTime(uint32_t& whenToExecute) const;
+#endif
 
 private:
 	CanMessageBuffer *pendingMessages;
@@ -77,6 +152,30 @@ void CanMessageQueue::AddMessage(CanMessageBuffer *buf)
 	}
 }
 
+#if SUPPORT_SPEED_OVERRIDE
+
+template<class F> void CanMessageQueue::ForEach(F func)
+{
+	TaskCriticalSectionLocker lock;
+	for (CanMessageBuffer *buf = pendingMessages; buf != nullptr; buf = buf->next)
+	{
+		func(buf);
+	}
+}
+
+bool CanMessageQueue::PeekMoveTime(uint32_t& whenToExecute) const
+{
+	TaskCriticalSectionLocker lock;
+	if (pendingMessages == nullptr)
+	{
+		return false;
+	}
+	whenToExecute = pendingMessages->msg.move.whenToExecute;
+	return true;
+}
+
+#endif
+
 // Fetch a message from the queue, or return nullptr if there are no messages
 CanMessageBuffer *CanMessageQueue::GetMessage()
 {
@@ -93,8 +192,328 @@ CanMessageBuffer *CanMessageQueue::GetMessage()
 	return buf;
 }
 
-static CanMessageQueue PendingMoves;
-static CanMessageQueue PendingCommands;
+static CanMessageQueue PendingMoves;						// moves that didn't fit in the move queue
+static unsigned int numMoveQueueOverflows = 0;
+
+// Moves that arrived before we had time sync, with their execution times still in master time
+constexpr unsigned int MaxUnsyncedMoves = 8;				// don't hold more than this, so that we can't run out of CAN buffers
+static CanMessageQueue UnsyncedMoves;
+static unsigned int numUnsyncedMoves = 0;
+static unsigned int numMovesDeferred = 0;					// how many moves we held until we had time sync
+static unsigned int numMovesAdmittedUnsynced = 0;			// how many moves we had to release without time sync
+static unsigned int numMovesAdmittedLate = 0;				// how many moves were due to start already when we admitted them
+static uint32_t maxAdmittedMoveLateness = 0;
+static volatile unsigned int numStopsProcessedInPlace = 0;	// how many stop messages we processed directly from the receive FIFO
+#if SUPPORT_SPEED_OVERRIDE
+constexpr float MinSpeedOverrideFactor = 0.1, MaxSpeedOverrideFactor = 10.0;	// the range of speed changes that we accept in one override
+static unsigned int numBadSpeedOverrides = 0;				// how many speed overrides we ignored because the factor was out of range
+#endif
+
+#if SUPPORT_SHORT_CAN_BUFFERS
+
+static CanMessageBuffer *AllocateBufferIfFree(bool isReceiver);
+
+// Every CanMessageBuffer is big enough for the largest CAN-FD message, but many of the commands that wait in the command queues are only a few bytes long.
+// We can't tell how long a message is until we have read it into a full buffer, so when we queue a command that fits we copy it into a short buffer
+// and give the full one back straight away. The main task copies it back into a full buffer when it takes the command, because it builds its reply there.
+struct ShortCanBuffer
+{
+	ShortCanBuffer *next;
+	CanId id;
+	uint16_t fullTicket;						// how many full buffers had been added to the queue when we added this one
+	uint8_t dataLength;
+	uint8_t data[ShortCanBufferDataLength];
+};
+
+static ShortCanBuffer shortCanBuffers[NumShortCanBuffers];
+static ShortCanBuffer *freeShortCanBuffers = nullptr;
+static unsigned int numFreeShortCanBuffers = 0;
+static unsigned int minFreeShortCanBuffers = NumShortCanBuffers;
+static unsigned int numCommandsInShortBuffers = 0;
+static volatile bool commandWaitingForBuffer = false;	// true if the main task couldn't take a command because it had no full buffer to copy it into
+
+static void InitShortCanBuffers()
+{
+	for (ShortCanBuffer& sb : shortCanBuffers)
+	{
+		sb.next = freeShortCanBuffers;
+		freeShortCanBuffers = &sb;
+	}
+	numFreeShortCanBuffers = minFreeShortCanBuffers = NumShortCanBuffers;
+}
+
+// A queue of commands that keeps the small ones in short buffers and gives all of them back in the order they were added.
+// Each short buffer records how many full buffers had been added before it, so we know when all of those have been taken.
+class CanCommandQueue
+{
+public:
+	CanCommandQueue();
+	void AddMessage(CanMessageBuffer *buf);		// called by the receiver task, which must not use the buffer afterwards
+	CanMessageBuffer *GetMessage();				// called by the main task, returns nullptr if it has no command or no full buffer to copy a short one into
+	bool IsEmpty() const { return shortMessages == nullptr && fullMessages.IsEmpty(); }
+
+private:
+	CanMessageQueue fullMessages;
+	ShortCanBuffer *shortMessages;
+	ShortCanBuffer *lastShortMessage;			// only valid when shortMessages != nullptr
+	uint16_t numFullAdded;
+	uint16_t numFullTaken;
+};
+
+CanCommandQueue::CanCommandQueue() : shortMessages(nullptr), numFullAdded(0), numFullTaken(0) { }
+
+void CanCommandQueue::AddMessage(CanMessageBuffer *buf)
+{
+	if (buf->dataLength <= ShortCanBufferDataLength)
+	{
+		ShortCanBuffer *sbuf;
+		{
+			TaskCriticalSectionLocker lock;
+
+			sbuf = freeShortCanBuffers;
+			if (sbuf != nullptr)
+			{
+				freeShortCanBuffers = sbuf->next;
+				--numFreeShortCanBuffers;
+				if (numFreeShortCanBuffers < minFreeShortCanBuffers)
+				{
+					minFreeShortCanBuffers = numFreeShortCanBuffers;
+				}
+			}
+		}
+
+		if (sbuf != nullptr)
+		{
+			sbuf->next = nullptr;
+			sbuf->id = buf->id;
+			sbuf->dataLength = (uint8_t)buf->dataLength;
+			memcpy(sbuf->data, buf->msg.raw, buf->dataLength);
+			CanInterface::FreeBuffer(buf);
+			{
+				TaskCriticalSectionLocker lock;
+
+				sbuf->fullTicket = numFullAdded;
+				if (shortMessages == nullptr)
+				{
+					shortMessages = sbuf;
+				}
+				else
+				{
+					lastShortMessage->next = sbuf;
+				}
+				lastShortMessage = sbuf;
+			}
+			++numCommandsInShortBuffers;
+			return;
+		}
+	}
+
+	TaskCriticalSectionLocker lock;
+	fullMessages.AddMessage(buf);
+	++numFullAdded;
+}
+
+CanMessageBuffer *CanCommandQueue::GetMessage()
+{
+	ShortCanBuffer *sbuf;
+	{
+		TaskCriticalSectionLocker lock;
+
+		sbuf = shortMessages;
+		if (sbuf == nullptr || sbuf->fullTicket != numFullTaken)
+		{
+			// The oldest command is in a full buffer, or there isn't one
+			CanMessageBuffer * const buf = fullMessages.GetMessage();
+			if (buf != nullptr)
+			{
+				++numFullTaken;
+			}
+			return buf;
+		}
+	}
+
+	// The oldest command is in a short buffer. Only this task removes commands, so it stays at the head of the queue while we get a full buffer for it.
+	CanMessageBuffer * const buf = AllocateBufferIfFree(false);
+	if (buf == nullptr)
+	{
+		commandWaitingForBuffer = true;			// so that FreeBuffer wakes us up
+		return nullptr;
+	}
+
+	buf->id = sbuf->id;
+	buf->dataLength = sbuf->dataLength;
+	memcpy(buf->msg.raw, sbuf->data, sbuf->dataLength);
+	{
+		TaskCriticalSectionLocker lock;
+
+		shortMessages = sbuf->next;
+		sbuf->next = freeShortCanBuffers;
+		freeShortCanBuffers = sbuf;
+		++numFreeShortCanBuffers;
+	}
+	return buf;
+}
+
+#else
+
+typedef CanMessageQueue CanCommandQueue;
+
+#endif
+
+// Commands that change the state of something that is already running are queued separately and processed first, so that they don't wait behind
+// slow commands such as configuration and diagnostics requests
+static CanCommandQueue PendingUrgentCommands;
+static CanCommandQueue PendingCommands;
+static unsigned int numUrgentCommandsPromoted = 0;			// how many urgent commands we processed ahead of other commands that were waiting
+
+static bool IsUrgentCommand(CanMessageType mt)
+{
+	switch (mt)
+	{
+	case CanMessageType::setDriverStates:
+	case CanMessageType::setMotorCurrents:
+	case CanMessageType::setStandstillCurrentFactor:
+	case CanMessageType::setPressureAdvance:
+	case CanMessageType::setFanSpeed:
+	case CanMessageType::setHeaterTemperature:
+	case CanMessageType::writeGpio:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+// Commands that we queue for the main task are checked for length and structure first, so that a misbehaving board can't fill the command queue
+// with messages that we would only reject later. Fixed length messages must be complete, generic messages must include the parameter map,
+// and messages of types not listed only need to include the request ID. Variable length messages are checked further by their handlers.
+struct CommandLengthCheck
+{
+	CanMessageType type;
+	uint8_t minLength;
+};
+
+constexpr size_t MinCommandLength = 2;						// every command starts with a 16-bit field holding the request ID
+constexpr size_t GenericCommandHeaderLength = offsetof(CanMessageGeneric, data);
+
+static constexpr CommandLengthCheck CommandLengthChecks[] =
+{
+	{ CanMessageType::returnInfo,					sizeof(CanMessageReturnInfo) },
+	{ CanMessageType::updateHeaterModel,			sizeof(CanMessageUpdateHeaterModel) },
+	{ CanMessageType::setHeaterTemperature,			sizeof(CanMessageSetHeaterTemperature) },
+	{ CanMessageType::writeGpio,					sizeof(CanMessageWriteGpio) },
+	{ CanMessageType::updateFirmware,				sizeof(CanMessageUpdateYourFirmware) },
+	{ CanMessageType::reset,						sizeof(CanMessageReset) },
+	{ CanMessageType::fanParameters,				sizeof(CanMessageFanParameters) },
+	{ CanMessageType::setFanSpeed,					sizeof(CanMessageSetFanSpeed) },
+	{ CanMessageType::setHeaterFaultDetection,		sizeof(CanMessageSetHeaterFaultDetectionParameters) },
+	{ CanMessageType::changeInputMonitor,			sizeof(CanMessageChangeInputMonitor) },
+	{ CanMessageType::setAddressAndNormalTiming,	sizeof(CanMessageSetAddressAndNormalTiming) },
+	{ CanMessageType::setFastTiming,				sizeof(CanMessageSetFastTiming) },
+	{ CanMessageType::diagnosticTest,				sizeof(CanMessageDiagnosticTest) },
+#if SUPPORT_READ_INPUTS
+	{ CanMessageType::readInputsRequest,			sizeof(CanMessageReadInputsRequest) },
+#endif
+
+	{ CanMessageType::m308,							GenericCommandHeaderLength },
+	{ CanMessageType::m309,							GenericCommandHeaderLength },
+	{ CanMessageType::m950Fan,						GenericCommandHeaderLength },
+	{ CanMessageType::m950Heater,					GenericCommandHeaderLength },
+	{ CanMessageType::m950Gpio,						GenericCommandHeaderLength },
+	{ CanMessageType::writeGpioBatch,				GenericCommandHeaderLength },
+	{ CanMessageType::m569,							GenericCommandHeaderLength },
+	{ CanMessageType::m915,							GenericCommandHeaderLength },
+	{ CanMessageType::statusReporting,				GenericCommandHeaderLength },
+	{ CanMessageType::heaterPowerBudget,			GenericCommandHeaderLength },
+	{ CanMessageType::setCanGroups,					GenericCommandHeaderLength },
+#if SUPPORT_HEATER_PROFILES
+	{ CanMessageType::heaterProfile,				GenericCommandHeaderLength },
+#endif
+#if SUPPORT_REMOTE_CONSOLE
+	{ CanMessageType::remoteConsole,				GenericCommandHeaderLength },
+#endif
+#if SUPPORT_CAN_BUS_TEST
+	{ CanMessageType::canFloodRequest,				GenericCommandHeaderLength },
+#endif
+#if SUPPORT_ACCELEROMETERS
+	{ CanMessageType::accelerometerConfig,			GenericCommandHeaderLength },
+	{ CanMessageType::startAccelerometer,			GenericCommandHeaderLength },
+#endif
+#if SUPPORT_POSITION_REPORTS
+	{ CanMessageType::positionReporting,			GenericCommandHeaderLength },
+#endif
+#if SUPPORT_ANALOG_STREAMING
+	{ CanMessageType::analogStream,					GenericCommandHeaderLength },
+#endif
+#if SUPPORT_LEADSCREW_CORRECTION
+	{ CanMessageType::leadscrewCorrection,			GenericCommandHeaderLength },
+#endif
+#if SUPPORT_LOCAL_KINEMATICS
+	{ CanMessageType::localKinematics,				GenericCommandHeaderLength },
+#endif
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+	{ CanMessageType::m572,							GenericCommandHeaderLength },
+#endif
+#if SUPPORT_INPUT_SHAPING
+	{ CanMessageType::m593,							GenericCommandHeaderLength },
+#endif
+#if SUPPORT_EXTRUDER_MIXING
+	{ CanMessageType::m567,							GenericCommandHeaderLength },
+#endif
+#if SUPPORT_FILAMENT_MONITORS
+	{ CanMessageType::m591,							GenericCommandHeaderLength },
+#endif
+};
+
+static unsigned int numMalformedCommands = 0;				// how many commands addressed to us we threw away because they failed the checks
+static CanMessageType lastMalformedCommandType;
+
+// Return true if the message is a multiple drives request. These hold one value for each bit set in the drivers bitmap.
+static bool IsMultipleDrivesRequest(CanMessageType mt)
+{
+	switch (mt)
+	{
+	case CanMessageType::setMotorCurrents:
+	case CanMessageType::setStandstillCurrentFactor:
+	case CanMessageType::setMicrostepping:
+	case CanMessageType::setDriverStates:
+	case CanMessageType::setPressureAdvance:
+#if SUPPORT_BABYSTEPPING
+	case CanMessageType::babyStepping:
+#endif
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+// Check that a command addressed to us is long enough for its type and, for multiple drives requests, that it only refers to drivers we have
+static bool IsValidCommand(const CanMessageBuffer *buf)
+{
+	const CanMessageType mt = buf->id.MsgType();
+	const size_t length = buf->dataLength;
+	if (IsMultipleDrivesRequest(mt))
+	{
+		const CanMessageMultipleDrivesRequest& msg = buf->msg.multipleDrivesRequest;
+		if (length < offsetof(CanMessageMultipleDrivesRequest, values))
+		{
+			return false;
+		}
+		const auto drivers = DriversBitmap::MakeFromRaw(msg.driversToUpdate);
+		return (msg.driversToUpdate & ~((1u << NumDrivers) - 1u)) == 0
+			&& length >= offsetof(CanMessageMultipleDrivesRequest, values) + drivers.CountSetBits() * sizeof(msg.values[0]);
+	}
+
+	for (const CommandLengthCheck& check : CommandLengthChecks)
+	{
+		if (check.type == mt)
+		{
+			return length >= check.minLength;
+		}
+	}
+	return length >= MinCommandLength;					// we pass unknown types on, so that the main board is told we don't support them
+}
 
 static can_async_descriptor CAN_0;
 
@@ -105,11 +524,11 @@ static can_async_descriptor CAN_0;
  *
  * Enables CAN peripheral, clocks and initializes CAN driver
  */
-static void CAN_0_init(const CanTiming& timing)
+static void CAN_0_init(const CanTiming& timing, const CanTiming *fastTiming)
 {
 	hri_mclk_set_AHBMASK_CAN1_bit(MCLK);
 	hri_gclk_write_PCHCTRL_reg(GCLK, CAN1_GCLK_ID, CONF_GCLK_CAN1_SRC | (1 << GCLK_PCHCTRL_CHEN_Pos));
-	can_async_init(&CAN_0, CAN1, timing);
+	can_async_init(&CAN_0, CAN1, timing, fastTiming);
 	gpio_set_pin_function(PB13, PINMUX_PB13H_CAN1_RX);
 	gpio_set_pin_function(PB12, PINMUX_PB12H_CAN1_TX);
 }
@@ -123,11 +542,11 @@ static void CAN_0_init(const CanTiming& timing)
  *
  * Enables CAN peripheral, clocks and initializes CAN driver
  */
-static void CAN_0_init(const CanTiming& timing)
+static void CAN_0_init(const CanTiming& timing, const CanTiming *fastTiming)
 {
 	hri_mclk_set_AHBMASK_CAN0_bit(MCLK);
 	hri_gclk_write_PCHCTRL_reg(GCLK, CAN0_GCLK_ID, CONF_GCLK_CAN0_SRC | (1 << GCLK_PCHCTRL_CHEN_Pos));
-	can_async_init(&CAN_0, CAN0, timing);
+	can_async_init(&CAN_0, CAN0, timing, fastTiming);
 	gpio_set_pin_function(PA25, PINMUX_PA25G_CAN0_RX);
 	gpio_set_pin_function(PA24, PINMUX_PA24G_CAN0_TX);
 }
@@ -136,7 +555,7 @@ static void CAN_0_init(const CanTiming& timing)
 
 namespace CanInterface
 {
-	void ProcessReceivedMessage(CanMessageBuffer *buf);
+	void ProcessReceivedMessage(CanMessageBuffer *buf, uint32_t whenReceived);
 }
 
 extern "C" void CAN_0_tx_callback(struct can_async_descriptor *const descr)
@@ -150,28 +569,117 @@ extern "C" void CAN_0_tx_callback(struct can_async_descriptor *const descr)
 	}
 }
 
+// Process a message that needs immediate action directly from the receive FIFO, without copying it into a buffer or waiting for the receiver task to be scheduled.
+// Called from the CAN ISR, or from the receiver task with interrupts disabled. Return true if the message was consumed.
+// Time sync and movement messages are left for the receiver task: time sync already uses the hardware receive timestamp so the task latency doesn't matter,
+// and adding moves to the queue isn't safe in an ISR. An emergency stop is left for the receiver task too, after we have stopped the motors,
+// because shutting down the rest of the board takes locks and waits.
+static bool ProcessMessageInPlace(const struct can_message *msg)
+{
+	if (!enabled)
+	{
+		return false;
+	}
+
+	CanId id;
+	id.SetReceivedId(msg->id);
+	switch (id.MsgType())
+	{
+	case CanMessageType::stopMovement:
+		if (moveInstance != nullptr)						// we announce ourselves before Move has been created
+		{
+			moveInstance->StopDrivers(reinterpret_cast<const CanMessageStopMovement*>(msg->data)->whichDrives);
+		}
+		++numStopsProcessedInPlace;
+		Platform::OnProcessingCanMessage();
+		return true;
+
+	case CanMessageType::emergencyStop:
+		Platform::EmergencyStopDrivers();
+		return false;								// leave it in the FIFO so that the receiver task calls EmergencyStop
+
+	default:
+		return false;
+	}
+}
+
 extern "C" void CAN_0_rx_callback(struct can_async_descriptor *const descr)
 {
-	canReceiverTask.GiveFromISR();
+	if (can_async_process_in_place(&CAN_0, ProcessMessageInPlace))
+	{
+		canReceiverTask.GiveFromISR();
+	}
 }
 
-extern "C" [[noreturn]] void CanReceiverLoop(void *)
+#if SUPPORT_CAN_BUS_HEALTH
+
+extern "C" void CAN_0_irq_callback(struct can_async_descriptor *const descr, enum can_async_interrupt_type type)
 {
-//	int32_t can_async_set_mode(struct can_async_descriptor *const descr, enum can_mode mode);
+	CanBusHealth::RecordEvent(type);
+}
+
+#endif
 
-	// Set up CAN receiver filtering
+// Message types that go in the high priority receive FIFO. We need two extended filters for each one, plus three for the board and broadcast addresses
+// and one for each group address; CONF_CANx_XIDFC_LSS must allow for them.
+static constexpr CanMessageType HighPriorityMessageTypes[] =
+{
+	CanMessageType::emergencyStop, CanMessageType::stopMovement, CanMessageType::timeSync, CanMessageType::movement,
+#if SUPPORT_COMPACT_MOVEMENT
+	CanMessageType::movementCompact,
+#endif
+#if SUPPORT_LOCAL_KINEMATICS
+	CanMessageType::movementCartesian,
+#endif
+#if SUPPORT_SPEED_OVERRIDE
+	CanMessageType::speedOverride,							// so that it is processed in order with the moves it applies to
+#endif
+};
+
+// Set up CAN receiver filtering. The filters are tried in order and the first one that matches decides which FIFO the message goes in.
+// The movement control messages go in FIFO 1, which we read first, so that they never queue behind configuration and diagnostic commands.
+// The filters are in the CAN message RAM, so we can change them while the CAN controller is running when our address changes.
+static void SetReceiveFilters()
+{
 	can_filter filter;
+	uint8_t filterIndex = 0;
+	filter.fifo = 1;
+	filter.mask = (CanId::MessageTypeMask << CanId::MessageTypeShift) | (CanId::BoardAddressMask << CanId::DstAddressShift);
+	for (CanMessageType mt : HighPriorityMessageTypes)
+	{
+		filter.id = ((uint32_t)mt << CanId::MessageTypeShift) | (boardAddress << CanId::DstAddressShift);
+		can_async_set_filter(&CAN_0, filterIndex++, CAN_FMT_EXTID, &filter);
+		filter.id = ((uint32_t)mt << CanId::MessageTypeShift) | ((uint32_t)CanId::BroadcastAddress << CanId::DstAddressShift);
+		can_async_set_filter(&CAN_0, filterIndex++, CAN_FMT_EXTID, &filter);
+	}
 
-	// First a filter for our own ID
+	// Everything else addressed to us goes in FIFO 0. First a filter for our own ID.
+	filter.fifo = 0;
 	filter.id = boardAddress << CanId::DstAddressShift;
 	filter.mask = CanId::BoardAddressMask << CanId::DstAddressShift;
-	can_async_set_filter(&CAN_0, 0, CAN_FMT_EXTID, &filter);
+	can_async_set_filter(&CAN_0, filterIndex++, CAN_FMT_EXTID, &filter);
 
 	// Now a filter for the broadcast ID
 	filter.id = (uint32_t)CanId::BroadcastAddress << CanId::DstAddressShift;
 	filter.mask = CanId::BoardAddressMask << CanId::DstAddressShift;
-	can_async_set_filter(&CAN_0, 1, CAN_FMT_EXTID, &filter);
+	can_async_set_filter(&CAN_0, filterIndex++, CAN_FMT_EXTID, &filter);
+
+	// Finally a filter for each group address. Group messages are configuration commands, so they go in FIFO 0.
+	for (CanAddress groupAddress : groupAddresses)
+	{
+		if (groupAddress != 0)
+		{
+			filter.id = (uint32_t)groupAddress << CanId::DstAddressShift;
+			can_async_set_filter(&CAN_0, filterIndex++, CAN_FMT_EXTID, &filter);
+		}
+	}
+}
+
+extern "C" [[noreturn]] void CanReceiverLoop(void *)
+{
+//	int32_t can_async_set_mode(struct can_async_descriptor *const descr, enum can_mode mode);
 
+	SetReceiveFilters();
 	can_async_enable(&CAN_0);
 	CanMessageBuffer *buf = nullptr;
 	for (;;)
@@ -179,48 +687,72 @@ extern "C" [[noreturn]] void CanReceiverLoop(void *)
 		// Get a buffer
 		if (buf == nullptr)
 		{
-			for (;;)
+			buf = CanInterface::AllocateBuffer(CanInterface::BufferUser::receiver);
+		}
+
+		// Commands from the low priority FIFO may wait in the command queue for a long time, so they mustn't use the buffers reserved for the receiver.
+		// If we have already used the other buffers, read only the movement control messages and leave the commands in the FIFO until a buffer is freed.
+		bool readCommands;
+		{
+			TaskCriticalSectionLocker lock;
+			readCommands = CanMessageBuffer::FreeBuffers() >= NumCanBuffersReservedForReceiver;
+			if (!readCommands)
 			{
-				buf = CanMessageBuffer::Allocate();
-				if (buf != nullptr)
-				{
-					break;
-				}
-				delay(1);
+				bufferWaitingTasks[(size_t)CanInterface::BufferUser::receiver] = RTOSIface::GetCurrentTask();	// so that FreeBuffer wakes us up
 			}
 		}
 
 		can_message msg;										// descriptor for the message
 		msg.data = reinterpret_cast<uint8_t*>(&(buf->msg));		// set up where we want the message data to be stored
-		const int32_t rslt = can_async_read(&CAN_0, &msg);		// fetch the message
+		int32_t rslt;
+		{
+			// The ISR may process messages at the head of the FIFO, so don't let it run while we read from it.
+			// A stop message may have arrived behind the one that the ISR declined, so give it another chance to process it first.
+			AtomicCriticalSectionLocker lock;
+			(void)can_async_process_in_place(&CAN_0, ProcessMessageInPlace);
+			rslt = can_async_read(&CAN_0, &msg, readCommands);	// fetch the message
+		}
 		if (rslt == ERR_NOT_FOUND)
 		{
-			TaskBase::Take();									// wait until we are woken up because a message is available
+			if (readCommands)
+			{
+				TaskBase::Take();								// wait until we are woken up because a message is available
+			}
+			else
+			{
+				++numCommandReadsDeferred;
+				TaskBase::Take(CanBufferWaitTimeout);			// wait until a message is available or a buffer is freed
+			}
 		}
 		else if (rslt == ERR_NONE)
 		{
 			if (enabled)
 			{
+				// The timestamp counter counts bit times, so work out when the message started arriving from how far it has counted since then
+				const uint32_t now = StepTimer::GetTimerTicks();
+				const uint16_t bitTimesSinceReceived = can_async_get_time_stamp_counter(&CAN_0) - msg.timeStamp;
+				const uint32_t whenReceived = now - ((uint32_t)bitTimesSinceReceived * canClocksPerBit)/CanClocksPerStepClock;
+
 				buf->dataLength = msg.len;
 				buf->id.SetReceivedId(msg.id);
-				CanInterface::ProcessReceivedMessage(buf);
+				Tracer::Record(Tracer::Event::canReceived, (uint16_t)buf->id.MsgType());
+#if SUPPORT_CAN_BUS_HEALTH
+				CanBusHealth::RecordReceived(buf->id.MsgType(), now - whenReceived);
+#endif
+				CanInterface::ProcessReceivedMessage(buf, whenReceived);
 				buf = nullptr;
 			}
 		}
 		else
 		{
-			debugPrintf("CAN read err %d\n", (int)rslt);
+			deferredPrintf("CAN read err %d\n", (int)rslt);
 		}
 	}
 }
 
 extern "C" [[noreturn]] void CanAsyncSenderLoop(void *)
 {
-	CanMessageBuffer *buf;
-	while ((buf = CanMessageBuffer::Allocate()) == nullptr)
-	{
-		delay(1);
-	}
+	CanMessageBuffer * const buf = CanInterface::AllocateBuffer(CanInterface::BufferUser::asyncSender);
 
 	for (;;)
 	{
@@ -229,12 +761,36 @@ extern "C" [[noreturn]] void CanAsyncSenderLoop(void *)
 		msg->states = 0;
 		msg->numHandles = 0;
 
-		const uint32_t timeToWait = InputMonitor::AddStateChanges(msg);
+		uint32_t timeToWait = InputMonitor::AddStateChanges(msg);
 		if (msg->numHandles != 0)
 		{
 			buf->dataLength = msg->GetActualDataLength();
 			CanInterface::SendAsync(buf);					// this doesn't free the buffer, so we can re-use it
 		}
+#if SUPPORT_CAN_BUS_HEALTH
+		timeToWait = min<uint32_t>(timeToWait, CanBusHealth::Spin());
+#endif
+#if SUPPORT_REMOTE_CONSOLE
+		timeToWait = min<uint32_t>(timeToWait, RemoteConsole::Spin(buf));
+#endif
+#if SUPPORT_CAN_BUS_TEST
+		timeToWait = min<uint32_t>(timeToWait, CanBusTest::Spin(buf));
+#endif
+#if SUPPORT_CAN_ENUMERATION
+		timeToWait = min<uint32_t>(timeToWait, CanEnumeration::Spin(buf));
+#endif
+#if SUPPORT_CONTROLLED_STOP
+		if (moveInstance != nullptr)
+		{
+			moveInstance->SendControlledStopReport(buf);
+		}
+#endif
+#if SUPPORT_POSITION_REPORTS
+		timeToWait = min<uint32_t>(timeToWait, PositionReports::Spin(buf));
+#endif
+#if SUPPORT_ANALOG_STREAMING
+		timeToWait = min<uint32_t>(timeToWait, AnalogStream::Spin(buf));		// this goes last because it has the lowest priority
+#endif
 		TaskBase::Take(timeToWait);						// wait until we are woken up because a message is available, or we time out
 	}
 }
@@ -246,15 +802,41 @@ void CanInterface::Init(CanAddress defaultBoardAddress)
 
 	CanTiming timing;
 	canConfigData.GetTiming(timing);
+	canClocksPerBit = timing.period;
+
+	// Read the CAN FD data phase timing, if it has been set
+	canFastTimingData = *reinterpret_cast<CanFastTimingUserAreaData*>(NVMCTRL_USER + CanFastTimingUserAreaDataOffset);
 
 	// Initialise the CAN hardware, using the timing data if it was valid
-	CAN_0_init(timing);
+	CAN_0_init(timing, (canFastTimingData.IsValid()) ? &canFastTimingData.timing : nullptr);
 
 	boardAddress = canConfigData.GetCanAddress(defaultBoardAddress);
+
+	// Read the group addresses. Ignore any that clash with our own address, because the main board may have reassigned addresses since it set up the groups.
+	canGroupData = *reinterpret_cast<CanGroupUserAreaData*>(NVMCTRL_USER + CanGroupUserAreaDataOffset);
+	if (canGroupData.IsValid())
+	{
+		for (size_t i = 0; i < MaxCanGroups; ++i)
+		{
+			const CanAddress groupAddress = canGroupData.groupAddresses[i];
+			if (IsValidGroupAddress(groupAddress))
+			{
+				groupAddresses[i] = groupAddress;
+			}
+		}
+	}
+
 	CanMessageBuffer::Init(NumCanBuffers);
+#if SUPPORT_SHORT_CAN_BUFFERS
+	InitShortCanBuffers();
+#endif
 
 	can_async_register_callback(&CAN_0, CAN_ASYNC_RX_CB, (FUNC_PTR)CAN_0_rx_callback);
 	can_async_register_callback(&CAN_0, CAN_ASYNC_TX_CB, (FUNC_PTR)CAN_0_tx_callback);
+#if SUPPORT_CAN_BUS_HEALTH
+	CanBusHealth::Init(&CAN_0);
+	can_async_register_callback(&CAN_0, CAN_ASYNC_IRQ_CB, (FUNC_PTR)CAN_0_irq_callback);
+#endif
 
 	enabled = true;
 
@@ -263,6 +845,12 @@ void CanInterface::Init(CanAddress defaultBoardAddress)
 
 	// Create the task that send endstop etc. updates
 	canAsyncSenderTask.Create(CanAsyncSenderLoop, "CanAsync", nullptr, TaskPriority::CanAsyncSenderPriority);
+
+	// Announce ourselves now instead of waiting for the heater task to start, so that the main board can acknowledge us while we finish initialising.
+	// Commands that arrive before then wait in the command queue until the main task starts processing them.
+	CanMessageBuffer * const buf = AllocateBuffer(BufferUser::main);
+	SendAnnounce(buf);
+	FreeBuffer(buf);
 }
 
 // Shutdown is called when we are asked to update the firmware.
@@ -277,6 +865,28 @@ CanAddress CanInterface::GetCanAddress()
 	return boardAddress;
 }
 
+// Return true if the address is one of the group addresses that we respond to
+bool CanInterface::IsGroupAddress(CanAddress addr)
+{
+	if (addr != 0)
+	{
+		for (CanAddress groupAddress : groupAddresses)
+		{
+			if (groupAddress == addr)
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Return true if the address can be used as a group address by this board
+bool CanInterface::IsValidGroupAddress(CanAddress addr)
+{
+	return addr != 0 && addr != CanId::MasterAddress && addr <= CanId::MaxCanAddress && addr != boardAddress;
+}
+
 // Send a message. On return the buffer is available to the caller to re-use or free.
 bool CanInterface::Send(CanMessageBuffer *buf)
 {
@@ -292,14 +902,28 @@ bool CanInterface::Send(CanMessageBuffer *buf)
 			TaskCriticalSectionLocker lock;
 			if (can_async_write(&CAN_0, &msg) == ERR_NONE)
 			{
+				Tracer::Record(Tracer::Event::canSent, (uint16_t)buf->id.MsgType());
+#if SUPPORT_CAN_BUS_HEALTH
+				CanBusHealth::RecordTxQueueLevel();
+#endif
 				return true;
 			}
+			sendingTaskHandle = RTOSIface::GetCurrentTask();
 		}
-		delay(2);
+
+		// The transmit FIFO is full. We are woken when the transmit event FIFO reaches its watermark, by which time half the FIFO will have been sent.
+		++numTxFifoFullWaits;
+		TaskBase::Take(TxFifoFullTimeout);
 	}
+	sendingTaskHandle = nullptr;
 	return false;
 }
 
+bool CanInterface::IsTxIdle()
+{
+	return can_async_is_tx_idle(&CAN_0);
+}
+
 bool CanInterface::SendAsync(CanMessageBuffer *buf)
 {
 	//TODO use a dedicated buffer to send these high-priority messages
@@ -309,7 +933,7 @@ bool CanInterface::SendAsync(CanMessageBuffer *buf)
 bool CanInterface::SendAndFree(CanMessageBuffer *buf)
 {
 	const bool ok = Send(buf);
-	CanMessageBuffer::Free(buf);
+	CanInterface::FreeBuffer(buf);
 	return ok;
 }
 
@@ -320,38 +944,277 @@ bool CanInterface::GetCanMove(CanMessageMovement& msg)
 	if (buf != nullptr)
 	{
 		msg = buf->msg.move;
-		CanMessageBuffer::Free(buf);
+		CanInterface::FreeBuffer(buf);
 		return true;
 	}
 	return false;
 }
 
+#if SUPPORT_SPEED_OVERRIDE
+
+bool CanInterface::PeekCanMoveTime(uint32_t& whenToExecute)
+{
+	return PendingMoves.PeekMoveTime(whenToExecute);
+}
+
+// Change the speed of the moves that the main board sent before this message and that we haven't prepared yet.
+// The moves held because we don't have time sync are still in master time, the others are in local time.
+static void ProcessSpeedOverride(const CanMessageSpeedOverride& msg)
+{
+	if (!(msg.speedFactor >= MinSpeedOverrideFactor && msg.speedFactor <= MaxSpeedOverrideFactor))
+	{
+		++numBadSpeedOverrides;
+		return;
+	}
+
+	UnsyncedMoves.ForEach([&msg](CanMessageBuffer *buf) { (void)Move::ApplySpeedOverride(buf->msg.move, msg.whenToApply, msg.speedFactor); });
+	if (moveInstance != nullptr)
+	{
+		const uint32_t localWhenToApply = StepTimer::ConvertToLocalTime(msg.whenToApply);
+		PendingMoves.ForEach([&msg, localWhenToApply](CanMessageBuffer *buf) { (void)Move::ApplySpeedOverride(buf->msg.move, localWhenToApply, msg.speedFactor); });
+		moveInstance->ApplySpeedOverride(localWhenToApply, msg.speedFactor);
+	}
+}
+
+#endif
+
 CanMessageBuffer *CanInterface::GetCanCommand()
 {
+	CanMessageBuffer *buf = PendingUrgentCommands.GetMessage();
+	if (buf != nullptr)
+	{
+		if (!PendingCommands.IsEmpty())
+		{
+			++numUrgentCommandsPromoted;
+		}
+		return buf;
+	}
 	return PendingCommands.GetMessage();
 }
 
+// Allocate a buffer if one is available, without waiting. Tasks other than the receiver can't take the buffers reserved for it.
+static CanMessageBuffer *AllocateBufferIfFree(bool isReceiver)
+{
+	TaskCriticalSectionLocker lock;
+
+	if (isReceiver || CanMessageBuffer::FreeBuffers() > NumCanBuffersReservedForReceiver)
+	{
+		CanMessageBuffer * const buf = CanMessageBuffer::Allocate();
+		if (buf != nullptr)
+		{
+			const unsigned int numFree = CanMessageBuffer::FreeBuffers();
+			if (numFree < minFreeCanBuffers)
+			{
+				minFreeCanBuffers = numFree;
+			}
+			return buf;
+		}
+	}
+	return nullptr;
+}
+
+// Allocate a buffer, waiting until one is available
+CanMessageBuffer *CanInterface::AllocateBuffer(BufferUser user)
+{
+	for (;;)
+	{
+		{
+			TaskCriticalSectionLocker lock;
+
+			CanMessageBuffer * const buf = AllocateBufferIfFree(user == BufferUser::receiver);
+			if (buf != nullptr)
+			{
+				return buf;
+			}
+			++numBufferAllocationFailures[(size_t)user];
+			bufferWaitingTasks[(size_t)user] = RTOSIface::GetCurrentTask();
+		}
+		TaskBase::Take(CanBufferWaitTimeout);					// wait until a buffer is freed
+	}
+}
+
+// Free a buffer and wake up any tasks that are waiting for one, the receiver first
+void CanInterface::FreeBuffer(CanMessageBuffer *buf)
+{
+	TaskHandle waitingTasks[(size_t)BufferUser::numUsers];
+	{
+		TaskCriticalSectionLocker lock;
+
+		CanMessageBuffer::Free(buf);
+		const unsigned int numFree = CanMessageBuffer::FreeBuffers();
+		if (numFree > maxFreeCanBuffers)
+		{
+			maxFreeCanBuffers = numFree;
+		}
+		for (size_t i = 0; i < (size_t)BufferUser::numUsers; ++i)
+		{
+			waitingTasks[i] = bufferWaitingTasks[i];
+			bufferWaitingTasks[i] = nullptr;
+		}
+	}
+
+	for (TaskHandle t : waitingTasks)
+	{
+		if (t != nullptr)
+		{
+			t->Give();
+		}
+	}
+
+#if SUPPORT_SHORT_CAN_BUFFERS
+	if (commandWaitingForBuffer)
+	{
+		commandWaitingForBuffer = false;
+		Tasks::WakeMainTask();
+	}
+#endif
+}
+
+// Convert the time of a move to local time and copy it into the move queue if there is room, otherwise add it to PendingMoves.
+// To keep the moves in order, once we have had to put any moves in PendingMoves we keep doing so until Move has taken all of them.
+static void AdmitMove(CanMessageBuffer *buf, uint32_t whenReceived)
+{
+	buf->msg.move.whenToExecute = StepTimer::ConvertToLocalTime(buf->msg.move.whenToExecute);
+	buf->msg.move.accelerationClocks = StepTimer::ConvertToLocalClocks(buf->msg.move.accelerationClocks);
+	buf->msg.move.steadyClocks = StepTimer::ConvertToLocalClocks(buf->msg.move.steadyClocks);
+	buf->msg.move.decelClocks = StepTimer::ConvertToLocalClocks(buf->msg.move.decelClocks);
+	const int32_t lateness = (int32_t)(StepTimer::GetTimerTicks() - buf->msg.move.whenToExecute);
+	if (lateness > 0)
+	{
+		++numMovesAdmittedLate;
+		if ((uint32_t)lateness > maxAdmittedMoveLateness)
+		{
+			maxAdmittedMoveLateness = (uint32_t)lateness;
+		}
+	}
+
+	if (PendingMoves.IsEmpty() && moveInstance != nullptr && moveInstance->QueueMove(buf->msg.move, whenReceived))
+	{
+		CanInterface::FreeBuffer(buf);
+	}
+	else
+	{
+		PendingMoves.AddMessage(buf);
+		++numMoveQueueOverflows;
+	}
+	Move::WakeMoveTask();
+}
+
+// Admit all the moves that we held because we didn't have time sync
+static void ReleaseUnsyncedMoves()
+{
+	CanMessageBuffer *buf;
+	while ((buf = UnsyncedMoves.GetMessage()) != nullptr)
+	{
+		--numUnsyncedMoves;
+		AdmitMove(buf, StepTimer::GetTimerTicks());
+	}
+}
+
+// Process a movement message. We can't convert the move time to local time until we have time sync, so hold the move until then.
+static void ProcessMovement(CanMessageBuffer *buf, uint32_t whenReceived)
+{
+	if (StepTimer::IsSynced())
+	{
+		ReleaseUnsyncedMoves();
+		AdmitMove(buf, whenReceived);
+	}
+	else
+	{
+		if (numUnsyncedMoves == MaxUnsyncedMoves)
+		{
+			// We can't hold any more, so let the oldest one go with the time offset that we have
+			--numUnsyncedMoves;
+			++numMovesAdmittedUnsynced;
+			AdmitMove(UnsyncedMoves.GetMessage(), whenReceived);
+		}
+		UnsyncedMoves.AddMessage(buf);
+		++numUnsyncedMoves;
+		++numMovesDeferred;
+	}
+}
+
 // Process a received message and (eventually) release the buffer that it arrived in
-void CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf)
+void CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf, uint32_t whenReceived)
 {
 	switch (buf->id.MsgType())
 	{
 	case CanMessageType::timeSync:
-		//TODO re-implement this as a PLL and use the CAN time stamps for greater accuracy
-		StepTimer::SetLocalTimeOffset(StepTimer::GetTimerTicks() - buf->msg.sync.timeSent);
-		CanMessageBuffer::Free(buf);
+		StepTimer::ProcessTimeSync(buf->msg.sync.timeSent, whenReceived);
+		CanInterface::FreeBuffer(buf);
+		ReleaseUnsyncedMoves();
 		break;
 
 	case CanMessageType::movement:
-		//TODO if we haven't established time sync yet then we should defer this
-		buf->msg.move.whenToExecute += StepTimer::GetLocalTimeOffset();
-		PendingMoves.AddMessage(buf);
+#if SUPPORT_COMPACT_MOVEMENT
+		CompactMovement::NoteFullMove(buf->msg.move);
+#endif
+#if SUPPORT_LOCAL_KINEMATICS
+		CartesianMovement::NoteFullMove(buf->msg.move);
+#endif
+		ProcessMovement(buf, whenReceived);
+		Platform::OnProcessingCanMessage();
+		break;
+
+#if SUPPORT_COMPACT_MOVEMENT
+	case CanMessageType::movementCompact:
+		{
+			// Expand the frame into a movement message for each move. The last move reuses the buffer that the frame arrived in.
+			CompactMovement::Decoder decoder(*buf);
+			if (!decoder.IsValid())
+			{
+				CanInterface::FreeBuffer(buf);
+				break;
+			}
+			while (decoder.MovesLeft() != 0)
+			{
+				CanMessageBuffer * const moveBuf = (decoder.MovesLeft() == 1) ? buf : CanInterface::AllocateBuffer(BufferUser::receiver);
+				decoder.GetNextMove(moveBuf->msg.move);
+#if SUPPORT_LOCAL_KINEMATICS
+				CartesianMovement::NoteFullMove(moveBuf->msg.move);
+#endif
+				moveBuf->dataLength = sizeof(CanMessageMovement);
+				ProcessMovement(moveBuf, whenReceived);
+			}
+		}
+		Platform::OnProcessingCanMessage();
+		break;
+#endif
+
+#if SUPPORT_LOCAL_KINEMATICS
+	case CanMessageType::movementCartesian:
+		{
+			// Convert the machine coordinates to steps, then reuse the buffer for the movement message
+			CanMessageMovement move;
+			if (CartesianMovement::ConvertMove(*buf, move))
+			{
+				buf->msg.move = move;
+				buf->dataLength = sizeof(CanMessageMovement);
+				ProcessMovement(buf, whenReceived);
+			}
+			else
+			{
+				CanInterface::FreeBuffer(buf);
+			}
+		}
 		Platform::OnProcessingCanMessage();
 		break;
+#endif
+
+#if SUPPORT_SPEED_OVERRIDE
+	case CanMessageType::speedOverride:
+		ProcessSpeedOverride(buf->msg.speedOverride);
+		CanInterface::FreeBuffer(buf);
+		Platform::OnProcessingCanMessage();
+		break;
+#endif
 
 	case CanMessageType::stopMovement:
-		moveInstance->StopDrivers(buf->msg.stopMovement.whichDrives);
-		CanMessageBuffer::Free(buf);
+		if (moveInstance != nullptr)
+		{
+			moveInstance->StopDrivers(buf->msg.stopMovement.whichDrives);
+		}
+		CanInterface::FreeBuffer(buf);
 		Platform::OnProcessingCanMessage();
 		break;
 
@@ -363,9 +1226,10 @@ void CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf)
 		if (buf->id.Src() == CanId::MasterAddress)
 		{
 			mainBoardAcknowledgedAnnounce = true;
+			StartupProfiler::RecordStage(StartupStage::announceAcknowledged);
 			Platform::OnProcessingCanMessage();
 		}
-		CanMessageBuffer::Free(buf);
+		CanInterface::FreeBuffer(buf);
 		break;
 
 	case CanMessageType::startup:
@@ -373,28 +1237,83 @@ void CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf)
 		{
 			Platform::EmergencyStop();
 		}
-		CanMessageBuffer::Free(buf);
+		CanInterface::FreeBuffer(buf);
 		Platform::OnProcessingCanMessage();
 		break;
 
+	case CanMessageType::sensorTemperaturesReport:
+		// Other boards broadcast their sensor temperatures, and we may have remote sensors that use them
+		if (buf->id.Src() != GetCanAddress())
+		{
+			Heat::ProcessRemoteSensorsReport(buf->id.Src(), buf->msg.sensorTemperaturesBroadcast);
+		}
+		CanInterface::FreeBuffer(buf);
+		break;
+
+#if SUPPORT_CAN_BUS_TEST
+	case CanMessageType::canPing:
+		// We reply from the receiver task so that the round trip time doesn't include waiting for the main task
+		CanBusTest::ProcessPing(buf, whenReceived);
+		break;
+
+	case CanMessageType::canFlood:
+		CanBusTest::ProcessFloodFrame(buf, whenReceived);
+		break;
+#endif
+
+#if SUPPORT_CAN_ENUMERATION
+	case CanMessageType::enumerateRequest:
+		if (buf->id.Src() == CanId::MasterAddress)
+		{
+			CanEnumeration::ProcessRequest(buf->msg.enumerateRequest);
+		}
+		CanInterface::FreeBuffer(buf);
+		break;
+
+	case CanMessageType::assignAddress:
+		if (buf->id.Src() == CanId::MasterAddress)
+		{
+			CanEnumeration::ProcessAssignment(buf->msg.assignAddress);	// this may change our address and the receive filters, so it must be done by this task
+		}
+		CanInterface::FreeBuffer(buf);
+		break;
+#endif
+
 	case CanMessageType::controlledStop:
-		debugPrintf("Unsupported CAN message type %u\n", (unsigned int)(buf->id.MsgType()));
-		CanMessageBuffer::Free(buf);
+#if SUPPORT_CONTROLLED_STOP
+		if (moveInstance != nullptr)
+		{
+			moveInstance->RequestControlledStop();
+		}
+#else
+		deferredPrintf("Unsupported CAN message type %u\n", (unsigned int)(buf->id.MsgType()));
+#endif
+		CanInterface::FreeBuffer(buf);
 		Platform::OnProcessingCanMessage();
 		break;
 
 	default:
-		if (buf->id.Dst() == GetCanAddress() && buf->id.IsRequest())
+		if ((buf->id.Dst() == GetCanAddress() || IsGroupAddress(buf->id.Dst())) && buf->id.IsRequest())
 		{
 			if (buf->id.Src() == CanId::MasterAddress)
 			{
 				isProgrammed = true;			// record that we've had a communication from the master since we started up
+				StartupProfiler::RecordStage(StartupStage::firstCommand);
+			}
+			if (!IsValidCommand(buf))
+			{
+				++numMalformedCommands;
+				lastMalformedCommandType = buf->id.MsgType();
+				CanInterface::FreeBuffer(buf);
+				break;
 			}
-			PendingCommands.AddMessage(buf);	// it's addressed to us, so queue it for processing
+			// It's addressed to us, so queue it for processing
+			((IsUrgentCommand(buf->id.MsgType())) ? PendingUrgentCommands : PendingCommands).AddMessage(buf);
+			Tasks::WakeMainTask();
 		}
 		else
 		{
-			CanMessageBuffer::Free(buf);		// it's a broadcast message that we don't want, or a response, so throw it away
+			CanInterface::FreeBuffer(buf);		// it's a broadcast message that we don't want, or a response, so throw it away
 		}
 		break;
 	}
@@ -405,6 +1324,86 @@ void CanInterface::Diagnostics(const StringRef& reply)
 	reply.lcatf("Free CAN buffers: %u", CanMessageBuffer::FreeBuffers());
 }
 
+// Append the CAN buffer, short buffer and command queue statistics to the reply and reset them, for M122 B# P13
+void CanInterface::BufferDiagnostics(const StringRef& reply)
+{
+	reply.printf("CAN buffers free %u min %u max %u (%u reserved), waits rx %u main %u async %u tlm %u",
+				CanMessageBuffer::FreeBuffers(), minFreeCanBuffers, maxFreeCanBuffers, NumCanBuffersReservedForReceiver,
+				numBufferAllocationFailures[(size_t)BufferUser::receiver], numBufferAllocationFailures[(size_t)BufferUser::main],
+				numBufferAllocationFailures[(size_t)BufferUser::asyncSender], numBufferAllocationFailures[(size_t)BufferUser::telemetry]);
+#if SUPPORT_ACCELEROMETERS
+	reply.catf(" acc %u", numBufferAllocationFailures[(size_t)BufferUser::accelerometer]);
+#endif
+	reply.catf(", reads deferred %u", numCommandReadsDeferred);
+	{
+		TaskCriticalSectionLocker lock;
+		minFreeCanBuffers = maxFreeCanBuffers = CanMessageBuffer::FreeBuffers();
+		for (unsigned int& n : numBufferAllocationFailures)
+		{
+			n = 0;
+		}
+		numCommandReadsDeferred = 0;
+	}
+#if SUPPORT_SHORT_CAN_BUFFERS
+	reply.lcatf("Short buffers free %u min %u, commands queued %u", numFreeShortCanBuffers, minFreeShortCanBuffers, numCommandsInShortBuffers);
+	{
+		TaskCriticalSectionLocker lock;
+		minFreeShortCanBuffers = numFreeShortCanBuffers;
+		numCommandsInShortBuffers = 0;
+	}
+#endif
+	reply.lcatf("Move queue overflows %u, stops in place %u, urgent promoted %u", numMoveQueueOverflows, numStopsProcessedInPlace, numUrgentCommandsPromoted);
+	numMoveQueueOverflows = numStopsProcessedInPlace = numUrgentCommandsPromoted = 0;
+	reply.lcatf("Malformed commands %u", numMalformedCommands);
+	if (numMalformedCommands != 0)
+	{
+		reply.catf(", last type %u", (unsigned int)lastMalformedCommandType);
+		numMalformedCommands = 0;
+	}
+}
+
+// Append the CAN transmit and move admission statistics to the reply and reset them, for M122 B# P14. StepTimer::Diagnostics adds the timer and clock sync statistics.
+void CanInterface::TimingDiagnostics(const StringRef& reply)
+{
+	uint32_t txMessages, txBatches;
+	can_async_get_and_clear_tx_stats(&CAN_0, txMessages, txBatches);
+	reply.printf("Messages sent %" PRIu32 " in %" PRIu32 " batches, FIFO full waits %u", txMessages, txBatches, numTxFifoFullWaits);
+	numTxFifoFullWaits = 0;
+	reply.lcatf("Moves held for sync %u, released unsynced %u, late %u (max %.1fms)",
+				numMovesDeferred, numMovesAdmittedUnsynced, numMovesAdmittedLate, (double)((float)maxAdmittedMoveLateness * StepTimer::StepClocksToMillis));
+	numMovesDeferred = numMovesAdmittedUnsynced = numMovesAdmittedLate = 0;
+	maxAdmittedMoveLateness = 0;
+}
+
+// Append the statistics of the movement messages that we convert or adjust locally to the reply and reset them, for M122 B# P15.
+// Move::LocalStopDiagnostics adds the moves that we stopped or slowed down ourselves.
+void CanInterface::MovementDiagnostics(const StringRef& reply)
+{
+	reply.copy("Movement messages:");
+#if SUPPORT_SPEED_OVERRIDE
+	reply.lcatf("Speed overrides ignored %u", numBadSpeedOverrides);
+	numBadSpeedOverrides = 0;
+#endif
+#if SUPPORT_COMPACT_MOVEMENT
+	CompactMovement::Diagnostics(reply);
+#endif
+#if SUPPORT_LOCAL_KINEMATICS
+	CartesianMovement::Diagnostics(reply);
+#endif
+}
+
+void CanInterface::GetDiagnostics(CanMessageDiagnosticsReply& msg)
+{
+	msg.freeCanBuffers = CanMessageBuffer::FreeBuffers();
+	msg.minFreeCanBuffers = minFreeCanBuffers;
+	unsigned int failures = 0;
+	for (unsigned int n : numBufferAllocationFailures)
+	{
+		failures += n;
+	}
+	msg.bufferAllocationFailures = min<unsigned int>(failures, 0xFFFF);
+}
+
 // Send an announcement message if we haven't had an announce acknowledgement form the main board. On return the buffer is available to use again.
 void CanInterface::SendAnnounce(CanMessageBuffer *buf)
 {
@@ -434,6 +1433,11 @@ void CanInterface::WakeAsyncSenderFromIsr()
 	canAsyncSenderTask.GiveFromISR();
 }
 
+void CanInterface::WakeAsyncSender()
+{
+	canAsyncSenderTask.Give();
+}
+
 GCodeResult CanInterface::ChangeAddressAndDataRate(const CanMessageSetAddressAndNormalTiming &msg, const StringRef &reply)
 {
 	if (msg.oldAddress == boardAddress)
@@ -456,10 +1460,9 @@ GCodeResult CanInterface::ChangeAddressAndDataRate(const CanMessageSetAddressAnd
 
 		if (seen)
 		{
-			const int32_t rc = _user_area_write(reinterpret_cast<void*>(NVMCTRL_USER), CanUserAreaDataOffset, reinterpret_cast<const uint8_t*>(&canConfigData), sizeof(canConfigData));
-			if (rc != 0)
+			if (!NvmWriter::QueueWrite(NvmArea::userArea, CanUserAreaDataOffset, &canConfigData, sizeof(canConfigData)))
 			{
-				reply.printf("Failed to write NVM user area, code %" PRIi32, rc);
+				reply.copy("Failed to queue NVM user area write");
 				return GCodeResult::error;
 			}
 		}
@@ -479,4 +1482,126 @@ GCodeResult CanInterface::ChangeAddressAndDataRate(const CanMessageSetAddressAnd
 	return GCodeResult::error;
 }
 
+#if SUPPORT_CAN_ENUMERATION
+
+// Change our address without a reset and store it in the NVM user area. Called by the CAN receiver task, because it changes the receive filters.
+// We announce ourselves again from the new address. Return false if we couldn't queue the NVM write.
+bool CanInterface::SetAddressNow(CanAddress newAddress)
+{
+	canConfigData.SetCanAddress(newAddress);
+	const bool stored = NvmWriter::QueueWrite(NvmArea::userArea, CanUserAreaDataOffset, &canConfigData, sizeof(canConfigData));
+	if (newAddress != boardAddress)
+	{
+		boardAddress = newAddress;
+		SetReceiveFilters();
+		mainBoardAcknowledgedAnnounce = false;				// the heater task keeps announcing us until the main board acknowledges
+	}
+	return stored;
+}
+
+#endif
+
+// Set the CAN FD data phase timing. We store it in the NVM user area and use it when we next start up, because the main board changes all the boards at the same time.
+// A period of zero disables bit rate switching.
+GCodeResult CanInterface::SetFastTiming(const CanMessageSetFastTiming& msg, const StringRef& reply)
+{
+	const CanTiming& timing = msg.fastTiming;
+	if (timing.period == 0)
+	{
+		canFastTimingData.marker = 0;
+	}
+	else if (   timing.period < MinFastTimingPeriod
+			 || timing.tseg1 < 2 || timing.tseg1 + 2 > timing.period
+			 || timing.jumpWidth == 0 || timing.jumpWidth > timing.period - timing.tseg1 - 1
+			)
+	{
+		reply.copy("Invalid CAN FD data phase timing");
+		return GCodeResult::error;
+	}
+	else
+	{
+		canFastTimingData.marker = CanFastTimingUserAreaData::ValidMarker;
+		canFastTimingData.timing = timing;
+	}
+
+	if (!NvmWriter::QueueWrite(NvmArea::userArea, CanFastTimingUserAreaDataOffset, &canFastTimingData, sizeof(canFastTimingData)))
+	{
+		reply.copy("Failed to queue NVM user area write");
+		return GCodeResult::error;
+	}
+
+	CanTiming currentTiming;
+	if (GetLocalCanFastTiming(&CAN_0, currentTiming))
+	{
+		reply.printf("CAN FD data phase %.1fkbps", (double)((float)CanTiming::ClockFrequency/(1000 * currentTiming.period)));
+	}
+	else
+	{
+		reply.copy("CAN FD bit rate switching off");
+	}
+	reply.cat(", new setting takes effect after reset");
+	return GCodeResult::ok;
+}
+
+// Set the group addresses that this board responds to. Parameter A sets the first group and B the second; a value of zero removes the board from that group.
+// We store them in the NVM user area and set up the receive filters when we next start up, like the CAN timing.
+GCodeResult CanInterface::SetGroupAddresses(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	static constexpr char GroupLetters[MaxCanGroups] = { 'A', 'B' };
+
+	CanMessageGenericParser parser(msg, CanGroupParams);
+	bool seen = false;
+	if (!canGroupData.IsValid())
+	{
+		canGroupData.marker = CanGroupUserAreaData::ValidMarker;
+		for (CanAddress& groupAddress : canGroupData.groupAddresses)
+		{
+			groupAddress = 0;
+		}
+	}
+
+	for (size_t i = 0; i < MaxCanGroups; ++i)
+	{
+		uint8_t newGroupAddress;
+		if (parser.GetUintParam(GroupLetters[i], newGroupAddress))
+		{
+			if (newGroupAddress != 0 && !IsValidGroupAddress(newGroupAddress))
+			{
+				reply.printf("Invalid CAN group address %u", newGroupAddress);
+				return GCodeResult::error;
+			}
+			seen = true;
+			canGroupData.groupAddresses[i] = newGroupAddress;
+		}
+	}
+
+	if (seen)
+	{
+		if (!NvmWriter::QueueWrite(NvmArea::userArea, CanGroupUserAreaDataOffset, &canGroupData, sizeof(canGroupData)))
+		{
+			reply.copy("Failed to queue NVM user area write");
+			return GCodeResult::error;
+		}
+		reply.copy("New CAN group addresses take effect after reset");
+	}
+	else
+	{
+		reply.printf("Board %u CAN group addresses:", boardAddress);
+		bool any = false;
+		for (CanAddress groupAddress : groupAddresses)
+		{
+			if (groupAddress != 0)
+			{
+				reply.catf(" %u", groupAddress);
+				any = true;
+			}
+		}
+		if (!any)
+		{
+			reply.cat(" none");
+		}
+	}
+	return GCodeResult::ok;
+}
+
 // End
@@ -18,22 +18,55 @@ class CanMessageBuffer;
 
 namespace CanInterface
 {
+	// The tasks that allocate CAN buffers. Only the receiver may use the buffers that are reserved for it.
+	enum class BufferUser : uint8_t
+	{
+		receiver = 0,
+		main,
+		asyncSender,
+		telemetry,
+#if SUPPORT_ACCELEROMETERS
+		accelerometer,
+#endif
+		numUsers
+	};
+
+	constexpr size_t MaxCanGroups = 2;							// the number of group addresses that a board can respond to
+
 	void Init(CanAddress defaultBoardAddress);
 	void Shutdown();
 	void Diagnostics(const StringRef& reply);
+	void BufferDiagnostics(const StringRef& reply);				// append the buffer and command queue statistics to the reply and reset them
+	void TimingDiagnostics(const StringRef& reply);				// append the transmit and move admission statistics to the reply and reset them
+	void MovementDiagnostics(const StringRef& reply);			// append the statistics of movement messages that we convert or adjust to the reply and reset them
+	void GetDiagnostics(CanMessageDiagnosticsReply& msg);		// fill in the CAN fields of a binary diagnostics report
 
 	CanAddress GetCanAddress();
+	bool IsGroupAddress(CanAddress addr);
+	bool IsValidGroupAddress(CanAddress addr);
 	GCodeResult ChangeAddressAndDataRate(const CanMessageSetAddressAndNormalTiming& msg, const StringRef& reply);
+	GCodeResult SetFastTiming(const CanMessageSetFastTiming& msg, const StringRef& reply);
+#if SUPPORT_CAN_ENUMERATION
+	bool SetAddressNow(CanAddress newAddress);					// change our address without a reset, returning false if we couldn't store it
+#endif
+	GCodeResult SetGroupAddresses(const CanMessageGeneric& msg, const StringRef& reply);
 	bool GetCanMove(CanMessageMovement& move);
+#if SUPPORT_SPEED_OVERRIDE
+	bool PeekCanMoveTime(uint32_t& whenToExecute);			// get the local start time of the next move in the overflow queue, returning false if it is empty
+#endif
 	bool Send(CanMessageBuffer *buf);
 	bool SendAsync(CanMessageBuffer *buf);
 	bool SendAndFree(CanMessageBuffer *buf);
+	bool IsTxIdle();											// return true if no messages are waiting to be sent
 	CanMessageBuffer *GetCanCommand();
+	CanMessageBuffer *AllocateBuffer(BufferUser user);			// allocate a buffer, waiting until one is available
+	void FreeBuffer(CanMessageBuffer *buf);
 
 	void SendAnnounce(CanMessageBuffer *buf);
 
 	void MoveStoppedByZProbe();
 	void WakeAsyncSenderFromIsr();
+	void WakeAsyncSender();
 }
 
 #endif /* SRC_CAN_CANINTERFACE_H_ */
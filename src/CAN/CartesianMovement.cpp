@@ -0,0 +1,243 @@
+/*
+ * CartesianMovement.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "CartesianMovement.h"
+
+#if SUPPORT_LOCAL_KINEMATICS
+
+#include <CanMessageBuffer.h>
+#include <CanMessageGenericParser.h>
+#include <Movement/Move.h>
+#include <RTOSIface/RTOSIface.h>
+
+namespace CartesianMovement
+{
+	static uint8_t logicalDrives[NumDrivers];					// the logical drive that each of our drivers moves
+	static float stepsPerMm[MaxCoordinates];					// indexed by logical drive, because that is what the kinematics expects
+	static int32_t motorPositions[NumDrivers] = { 0 };			// at the main board's microstepping
+	static bool configured = false, positionKnown = false;
+	static uint32_t numMovesConverted = 0, numMovesRejected = 0;
+
+	// Convert machine coordinates to the positions of our motors, returning false if the kinematics can't reach them
+	static bool CoordinatesToMotorSteps(const float coordinates[], size_t numVisibleAxes, size_t numCoordinates, int32_t positions[NumDrivers])
+	{
+		int32_t logicalPositions[MaxCoordinates];
+		if (!moveInstance->GetKinematics().CartesianToMotorSteps(coordinates, stepsPerMm, numVisibleAxes, numCoordinates, logicalPositions, true))
+		{
+			return false;
+		}
+
+		// The kinematics only converts the axes, so the extruders are linear
+		for (size_t ld = numVisibleAxes; ld < numCoordinates; ++ld)
+		{
+			logicalPositions[ld] = lrintf(coordinates[ld] * stepsPerMm[ld]);
+		}
+
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			if (logicalDrives[drive] != NoLogicalDrive)
+			{
+				if (logicalDrives[drive] >= numCoordinates)
+				{
+					return false;
+				}
+				positions[drive] = logicalPositions[logicalDrives[drive]];
+			}
+		}
+		return true;
+	}
+}
+
+GCodeResult CartesianMovement::Configure(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	if (moveInstance == nullptr)
+	{
+		reply.copy("Movement not initialised");
+		return GCodeResult::error;
+	}
+
+	CanMessageGenericParser parser(msg, LocalKinematicsParams);
+	bool seen = false;
+
+	uint8_t kinematicsType;
+	if (parser.GetUintParam('K', kinematicsType))
+	{
+		seen = true;
+		if (!moveInstance->SetKinematics((KinematicsType)kinematicsType))
+		{
+			reply.printf("Kinematics type %u is not supported", kinematicsType);
+			return GCodeResult::error;
+		}
+		configured = positionKnown = false;
+	}
+
+	size_t numDrives, numSteps;
+	const uint8_t *drives;
+	const float *steps;
+	const bool seenDrives = parser.GetUint8ArrayParam('D', numDrives, drives);
+	const bool seenSteps = parser.GetFloatArrayParam('S', numSteps, steps);
+	if (seenDrives || seenSteps)
+	{
+		seen = true;
+		if (!seenDrives || !seenSteps || numDrives != NumDrivers || numSteps != NumDrivers)
+		{
+			reply.printf("Expected logical drives and steps per mm for %u drivers", NumDrivers);
+			return GCodeResult::error;
+		}
+
+		float newStepsPerMm[MaxCoordinates];
+		for (float& spm : newStepsPerMm)
+		{
+			spm = 0.0;
+		}
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			const uint8_t ld = drives[drive];
+			if (ld == NoLogicalDrive)
+			{
+				continue;
+			}
+			if (ld >= MaxCoordinates || steps[drive] <= 0.0)
+			{
+				reply.printf("Bad logical drive or steps per mm for driver %u", drive);
+				return GCodeResult::error;
+			}
+			if (ld < XYZ_AXES && moveInstance->GetKinematics().GetMotionType(ld) != MotionType::linear)
+			{
+				reply.printf("%s kinematics needs the full movement message", moveInstance->GetKinematics().GetName());
+				return GCodeResult::error;
+			}
+			if (newStepsPerMm[ld] != 0.0 && newStepsPerMm[ld] != steps[drive])
+			{
+				reply.printf("Drivers that move logical drive %u must have the same steps per mm", ld);
+				return GCodeResult::error;
+			}
+			newStepsPerMm[ld] = steps[drive];
+		}
+
+		TaskCriticalSectionLocker lock;							// the receiver task uses these
+		memcpy(logicalDrives, drives, sizeof(logicalDrives));
+		memcpy(stepsPerMm, newStepsPerMm, sizeof(stepsPerMm));
+		configured = true;
+		positionKnown = false;
+	}
+
+	size_t numCoordinates;
+	const float *coordinates;
+	if (parser.GetFloatArrayParam('P', numCoordinates, coordinates))
+	{
+		seen = true;
+		if (!configured || numCoordinates > MaxCoordinates)
+		{
+			reply.copy((configured) ? "Too many coordinates" : "Local kinematics not configured");
+			return GCodeResult::error;
+		}
+
+		int32_t positions[NumDrivers];
+		memcpy(positions, motorPositions, sizeof(positions));
+		if (!CoordinatesToMotorSteps(coordinates, min<size_t>(numCoordinates, XYZ_AXES), numCoordinates, positions))
+		{
+			reply.copy("Position is unreachable");
+			return GCodeResult::error;
+		}
+
+		TaskCriticalSectionLocker lock;
+		memcpy(motorPositions, positions, sizeof(motorPositions));
+		positionKnown = true;
+	}
+
+	if (!seen)
+	{
+		reply.printf("Kinematics %s, ", moveInstance->GetKinematics().GetName());
+		if (configured)
+		{
+			reply.cat("logical drives");
+			for (size_t drive = 0; drive < NumDrivers; ++drive)
+			{
+				if (logicalDrives[drive] == NoLogicalDrive)
+				{
+					reply.cat(" -");
+				}
+				else
+				{
+					reply.catf(" %u:%.2f", logicalDrives[drive], (double)stepsPerMm[logicalDrives[drive]]);
+				}
+			}
+			reply.cat((positionKnown) ? ", position set" : ", position not set");
+		}
+		else
+		{
+			reply.cat("Cartesian moves not configured");
+		}
+	}
+	return GCodeResult::ok;
+}
+
+// Convert a Cartesian movement frame to a movement message. Called by the CAN receiver task.
+bool CartesianMovement::ConvertMove(const CanMessageBuffer& buf, CanMessageMovement& msg)
+{
+	CartesianMoveHeader header;
+	float coordinates[MaxCoordinates];
+	if (!positionKnown || buf.dataLength < sizeof(header))
+	{
+		++numMovesRejected;
+		return false;
+	}
+	memcpy(&header, buf.msg.raw, sizeof(header));
+	if (header.numCoordinates > MaxCoordinates || header.numVisibleAxes > header.numCoordinates || header.numVisibleAxes < XYZ_AXES
+		|| buf.dataLength < sizeof(header) + header.numCoordinates * sizeof(float))
+	{
+		++numMovesRejected;
+		return false;
+	}
+	memcpy(coordinates, buf.msg.raw + sizeof(header), header.numCoordinates * sizeof(float));
+
+	int32_t endPositions[NumDrivers];
+	memcpy(endPositions, motorPositions, sizeof(endPositions));
+	if (!CoordinatesToMotorSteps(coordinates, header.numVisibleAxes, header.numCoordinates, endPositions))
+	{
+		++numMovesRejected;
+		return false;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.whenToExecute = header.whenToExecute;
+	msg.accelerationClocks = header.accelerationClocks;
+	msg.steadyClocks = header.steadyClocks;
+	msg.decelClocks = header.decelClocks;
+	msg.initialSpeedFraction = header.initialSpeedFraction;
+	msg.finalSpeedFraction = header.finalSpeedFraction;
+	msg.pressureAdvanceDrives = header.pressureAdvanceDrives;
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		msg.perDrive[drive].steps = endPositions[drive] - motorPositions[drive];
+		motorPositions[drive] = endPositions[drive];
+	}
+	++numMovesConverted;
+	return true;
+}
+
+void CartesianMovement::NoteFullMove(const CanMessageMovement& msg)
+{
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		motorPositions[drive] += msg.perDrive[drive].steps;
+	}
+}
+
+void CartesianMovement::Diagnostics(const StringRef& reply)
+{
+	if (configured)
+	{
+		reply.lcatf("Cartesian moves converted %" PRIu32 ", rejected %" PRIu32, numMovesConverted, numMovesRejected);
+		numMovesConverted = numMovesRejected = 0;
+	}
+}
+
+#endif
+
+// End
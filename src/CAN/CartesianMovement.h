@@ -0,0 +1,63 @@
+/*
+ * CartesianMovement.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Support for movement messages that carry the machine coordinates at the end of the move instead of the steps of each driver,
+ *  so that we run the kinematics for our own motors and the main board doesn't have to calculate and send the steps of every motor on every board.
+ *  The main board configures us using the localKinematics message:
+ *  - K is the kinematics type, as in M669
+ *  - D is the logical drive (axis or extruder number) that each of our drivers moves, or 255 if it is only moved by full movement messages
+ *  - S is the steps per mm of each of our drivers at the main board's microstepping. Drivers that move the same axis must have the same steps per mm.
+ *  - P is the current machine position of each logical drive. It must be sent again whenever the position changes without a move,
+ *    e.g. after homing, G92 or a controlled stop, because we only track the motor positions from the moves we receive.
+ *  Kinematics that need segment-free delta motion still use the full movement message. The frame layout is:
+ *  - CartesianMoveHeader, 28 bytes
+ *  - the machine coordinate of each logical drive at the end of the move (float), axes first and then extruders
+ */
+
+#ifndef SRC_CAN_CARTESIANMOVEMENT_H_
+#define SRC_CAN_CARTESIANMOVEMENT_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_LOCAL_KINEMATICS
+
+#include <CanMessageFormats.h>
+#include <GCodes/GCodeResult.h>
+
+class CanMessageBuffer;
+
+namespace CartesianMovement
+{
+	constexpr size_t MaxFrameLength = 64;						// the largest CAN-FD frame
+
+	struct CartesianMoveHeader
+	{
+		uint32_t whenToExecute;						// in master time
+		uint32_t accelerationClocks;
+		uint32_t steadyClocks;
+		uint32_t decelClocks;
+		float initialSpeedFraction;
+		float finalSpeedFraction;
+		uint8_t numVisibleAxes;						// the number of logical drives that are axes, the remaining coordinates are extruders
+		uint8_t numCoordinates;
+		uint8_t pressureAdvanceDrives;
+		uint8_t spare;
+	};
+
+	static_assert(sizeof(CartesianMoveHeader) == 28, "Wrong Cartesian move header size");
+
+	constexpr size_t MaxCoordinates = (MaxFrameLength - sizeof(CartesianMoveHeader))/sizeof(float);
+	constexpr uint8_t NoLogicalDrive = 0xFF;
+
+	GCodeResult Configure(const CanMessageGeneric& msg, const StringRef& reply);	// process a localKinematics message
+	bool ConvertMove(const CanMessageBuffer& buf, CanMessageMovement& msg);			// convert a Cartesian movement frame to a movement message, returning false if we can't
+	void NoteFullMove(const CanMessageMovement& msg);								// add the steps of a move that the main board calculated to the motor positions
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif
+
+#endif /* SRC_CAN_CARTESIANMOVEMENT_H_ */
@@ -0,0 +1,103 @@
+/*
+ * CompactMovement.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "CompactMovement.h"
+
+#if SUPPORT_COMPACT_MOVEMENT
+
+#include <CanMessageBuffer.h>
+
+namespace CompactMovement
+{
+	static int32_t lastSteps[NumDrivers] = { 0 };		// the step counts of the last move we received, which the next compact message is relative to
+	static uint32_t numFrames = 0, numMoves = 0, numBadFrames = 0;
+}
+
+CompactMovement::Decoder::Decoder(const CanMessageBuffer& buf)
+	: nextMove(0), readIndex(0), valid(false)
+{
+	if (buf.dataLength < sizeof(header))
+	{
+		++numBadFrames;
+		return;
+	}
+
+	memcpy(&header, buf.msg.raw, sizeof(header));
+	const size_t entriesLength = min<size_t>(buf.dataLength - sizeof(header), sizeof(entries));
+	memcpy(entries, buf.msg.raw + sizeof(header), entriesLength);
+
+	const size_t entrySize = sizeof(uint16_t) + header.numDrivers * ((header.wideDeltas) ? sizeof(int16_t) : sizeof(int8_t));
+	if (header.numMoves == 0 || header.numDrivers > NumDrivers || header.numMoves * entrySize > entriesLength)
+	{
+		++numBadFrames;
+		return;
+	}
+
+	nextMoveTime = header.whenToExecute;
+	valid = true;
+	++numFrames;
+}
+
+// Expand the next move. Only call this if MovesLeft() is not zero.
+void CompactMovement::Decoder::GetNextMove(CanMessageMovement& msg)
+{
+	memset(&msg, 0, sizeof(msg));
+	const bool isFirst = (nextMove == 0);
+	const bool isLast = (nextMove + 1 == header.numMoves);
+
+	msg.whenToExecute = nextMoveTime;
+	msg.accelerationClocks = (isFirst) ? header.accelerationClocks : 0;
+	msg.steadyClocks = entries[readIndex] | ((uint32_t)entries[readIndex + 1] << 8);
+	msg.decelClocks = (isLast) ? header.decelClocks : 0;
+	msg.initialSpeedFraction = (isFirst) ? (float)header.initialSpeedFraction * (1.0/65535.0) : 1.0;
+	msg.finalSpeedFraction = (isLast) ? (float)header.finalSpeedFraction * (1.0/65535.0) : 1.0;
+	msg.pressureAdvanceDrives = header.pressureAdvanceDrives;
+	readIndex += sizeof(uint16_t);
+
+	for (size_t drive = 0; drive < header.numDrivers; ++drive)
+	{
+		int32_t delta;
+		if (header.wideDeltas)
+		{
+			delta = (int16_t)(entries[readIndex] | ((uint16_t)entries[readIndex + 1] << 8));
+			readIndex += sizeof(int16_t);
+		}
+		else
+		{
+			delta = (int8_t)entries[readIndex];
+			readIndex += sizeof(int8_t);
+		}
+		lastSteps[drive] += delta;
+		msg.perDrive[drive].steps = lastSteps[drive];
+	}
+	for (size_t drive = header.numDrivers; drive < NumDrivers; ++drive)
+	{
+		lastSteps[drive] = 0;
+	}
+
+	nextMoveTime += msg.accelerationClocks + msg.steadyClocks + msg.decelClocks;
+	++nextMove;
+	++numMoves;
+}
+
+void CompactMovement::NoteFullMove(const CanMessageMovement& msg)
+{
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		lastSteps[drive] = msg.perDrive[drive].steps;
+	}
+}
+
+void CompactMovement::Diagnostics(const StringRef& reply)
+{
+	reply.lcatf("Compact movement frames %" PRIu32 " with %" PRIu32 " moves, bad %" PRIu32, numFrames, numMoves, numBadFrames);
+	numFrames = numMoves = numBadFrames = 0;
+}
+
+#endif
+
+// End
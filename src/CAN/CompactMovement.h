@@ -0,0 +1,72 @@
+/*
+ * CompactMovement.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Decoder for the compact movement message, which carries a run of moves in one CAN-FD frame so that the main board can send more segments per second
+ *  on a bus shared by several motion boards. The moves follow on from each other with no gaps, only the first may accelerate and only the last may decelerate,
+ *  and the step counts are sent as differences from the previous move that we received. The frame layout is:
+ *  - CompactMovementHeader, 16 bytes
+ *  - for each move: steady clocks (uint16_t), then for each driver the difference in steps from the previous move (int8_t, or int16_t if wideDeltas is set)
+ *  Multi-byte fields are little endian. Delta moves and moves that stop at endstops still use the full movement message.
+ */
+
+#ifndef SRC_CAN_COMPACTMOVEMENT_H_
+#define SRC_CAN_COMPACTMOVEMENT_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_COMPACT_MOVEMENT
+
+#include <CanMessageFormats.h>
+
+class CanMessageBuffer;
+
+namespace CompactMovement
+{
+	constexpr size_t MaxFrameLength = 64;						// the largest CAN-FD frame
+
+	struct CompactMovementHeader
+	{
+		uint32_t whenToExecute;						// when the first move starts in master time, each following move starts when the previous one ends
+		uint16_t accelerationClocks;				// the acceleration phase at the start of the first move
+		uint16_t decelClocks;						// the deceleration phase at the end of the last move
+		uint16_t initialSpeedFraction;				// the initial speed of the first move as a fraction of its top speed, times 65535
+		uint16_t finalSpeedFraction;				// the final speed of the last move as a fraction of its top speed, times 65535
+		uint8_t numMoves;
+		uint8_t numDrivers : 4,
+				wideDeltas : 1,						// 1 if the step differences are int16_t instead of int8_t
+				zero : 3;
+		uint8_t pressureAdvanceDrives;
+		uint8_t spare;
+	};
+
+	static_assert(sizeof(CompactMovementHeader) == 16, "Wrong compact movement header size");
+
+	// Class to expand a compact movement frame into movement messages. It copies the frame so that the buffer can be reused for one of the moves.
+	class Decoder
+	{
+	public:
+		Decoder(const CanMessageBuffer& buf);
+
+		bool IsValid() const { return valid; }
+		size_t MovesLeft() const { return (valid) ? header.numMoves - nextMove : 0; }
+		void GetNextMove(CanMessageMovement& msg);
+
+	private:
+		CompactMovementHeader header;
+		uint8_t entries[MaxFrameLength - sizeof(CompactMovementHeader)];
+		size_t nextMove;
+		size_t readIndex;
+		uint32_t nextMoveTime;
+		bool valid;
+	};
+
+	void NoteFullMove(const CanMessageMovement& msg);			// record the step counts of a full movement message, which the next compact message is relative to
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif
+
+#endif /* SRC_CAN_COMPACTMOVEMENT_H_ */
@@ -0,0 +1,130 @@
+/*
+ * PositionReports.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "PositionReports.h"
+
+#if SUPPORT_POSITION_REPORTS
+
+#include "CanInterface.h"
+#include <CanMessageBuffer.h>
+#include <CanMessageGenericParser.h>
+#include <Movement/Move.h>
+#include <Movement/StepTimer.h>
+#include <RTOSIface/RTOSIface.h>
+
+namespace PositionReports
+{
+	constexpr uint16_t MinReportInterval = 2;						// the shortest interval in milliseconds that we allow
+	constexpr uint16_t MaxReportInterval = 60000;
+
+	static uint32_t reportInterval = 0;								// 0 if we are not sending reports
+	static uint32_t lastReportTime;
+	static int32_t lastPositions[NumDrivers];
+	static bool lastReportedMoving = false;
+	static uint32_t numReportsSent = 0;
+}
+
+GCodeResult PositionReports::Configure(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, PositionReportingParams);
+	uint16_t interval;
+	if (!parser.GetUintParam('I', interval))
+	{
+		if (reportInterval == 0)
+		{
+			reply.copy("Position reports are off");
+		}
+		else
+		{
+			reply.printf("Position reports every %" PRIu32 "ms, %" PRIu32 " sent", reportInterval, numReportsSent);
+		}
+		return GCodeResult::ok;
+	}
+
+	if (interval != 0 && (interval < MinReportInterval || interval > MaxReportInterval))
+	{
+		reply.printf("Interval must be 0 or between %u and %u milliseconds", MinReportInterval, MaxReportInterval);
+		return GCodeResult::error;
+	}
+
+	{
+		TaskCriticalSectionLocker lock;
+		reportInterval = interval;
+		lastReportTime = millis() - interval;						// send the first report straight away
+		lastReportedMoving = true;									// make sure that we send it even if nothing has moved
+	}
+	CanInterface::WakeAsyncSender();
+	return GCodeResult::ok;
+}
+
+// Send a position report if one is due and anything has changed
+uint32_t PositionReports::Spin(CanMessageBuffer *buf)
+{
+	if (reportInterval == 0 || moveInstance == nullptr)
+	{
+		return TaskBase::TimeoutUnlimited;
+	}
+
+	const uint32_t now = millis();
+	const uint32_t timeSinceReport = now - lastReportTime;
+	if (timeSinceReport < reportInterval)
+	{
+		return reportInterval - timeSinceReport;
+	}
+	lastReportTime = now;
+
+	int32_t positions[NumDrivers];
+	float stepsPerSecond[NumDrivers];
+	const uint32_t whenSampled = moveInstance->GetLivePositions(positions, stepsPerSecond);
+
+	bool changed = lastReportedMoving;
+	bool moving = false;
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		if (positions[drive] != lastPositions[drive])
+		{
+			changed = true;
+		}
+		if (stepsPerSecond[drive] != 0.0)
+		{
+			moving = true;
+		}
+	}
+
+	if (changed)
+	{
+		CanMessageMotorPositions * const msg = buf->SetupStatusMessage<CanMessageMotorPositions>(CanInterface::GetCanAddress(), CanId::MasterAddress);
+		msg->whenSampled = StepTimer::ConvertToMasterTime(whenSampled);
+		msg->numDrivers = NumDrivers;
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			msg->drivers[drive].position = positions[drive];
+			msg->drivers[drive].stepsPerSecond = stepsPerSecond[drive];
+			lastPositions[drive] = positions[drive];
+		}
+		buf->dataLength = msg->GetActualDataLength();
+		if (CanInterface::SendAsync(buf))
+		{
+			++numReportsSent;
+		}
+		lastReportedMoving = moving;
+	}
+	return reportInterval;
+}
+
+void PositionReports::Diagnostics(const StringRef& reply)
+{
+	if (reportInterval != 0)
+	{
+		reply.lcatf("Position reports every %" PRIu32 "ms, %" PRIu32 " sent", reportInterval, numReportsSent);
+		numReportsSent = 0;
+	}
+}
+
+#endif
+
+// End
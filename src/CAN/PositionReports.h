@@ -0,0 +1,34 @@
+/*
+ * PositionReports.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Periodic reports of the net step position and speed of each local driver, so that the main board can monitor the motors
+ *  and knows where they are when it pauses without having to ask us. The positions are at the microstepping that the main board uses,
+ *  the speeds are in steps per second, and the reports are timestamped in master time. We only send a report when a position has changed
+ *  or a motor that we reported as moving has stopped.
+ */
+
+#ifndef SRC_CAN_POSITIONREPORTS_H_
+#define SRC_CAN_POSITIONREPORTS_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_POSITION_REPORTS
+
+#include <GCodes/GCodeResult.h>
+
+class CanMessageBuffer;
+struct CanMessageGeneric;
+
+namespace PositionReports
+{
+	GCodeResult Configure(const CanMessageGeneric& msg, const StringRef& reply);	// process a positionReporting message, I parameter is the interval in milliseconds, 0 to stop
+	uint32_t Spin(CanMessageBuffer *buf);											// called by the async sender task, returns the maximum time in milliseconds before we want to be called again
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif
+
+#endif /* SRC_CAN_POSITIONREPORTS_H_ */
@@ -0,0 +1,209 @@
+/*
+ * RemoteConsole.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "RemoteConsole.h"
+
+#if SUPPORT_REMOTE_CONSOLE
+
+#include "CanInterface.h"
+#include <CanMessageBuffer.h>
+#include <CanMessageGenericParser.h>
+#include <RTOSIface/RTOSIface.h>
+#include <Tracer.h>
+
+namespace RemoteConsole
+{
+	// Values of the 'kind' field of consoleData messages, these must match the decoder on the main board
+	constexpr uint8_t KindText = 0;
+	constexpr uint8_t KindTrace = 1;
+
+#if defined(SAME51)
+	constexpr size_t TextBufferSize = 1024;						// must be a power of 2
+#else
+	constexpr size_t TextBufferSize = 256;						// must be a power of 2
+#endif
+	static_assert((TextBufferSize & (TextBufferSize - 1)) == 0, "TextBufferSize must be a power of 2");
+
+	constexpr uint32_t DefaultBytesPerSecond = 2000;
+	constexpr uint32_t MinBytesPerSecond = 100;
+	constexpr uint32_t BusRetryMillis = 2;						// how soon to try again if the bus was busy
+	constexpr uint32_t TracePollMillis = 100;					// how often to check for new trace records
+	constexpr size_t MaxTraceRecordsPerMessage = sizeof(CanMessageConsoleData::data)/(2 * sizeof(uint32_t));
+
+	static char textBuffer[TextBufferSize];
+	static uint32_t textWriteIndex = 0, textReadIndex = 0;		// these run freely and are masked to address the buffer
+	static uint32_t textBytesLost = 0;
+	static uint32_t nextTraceRecord = 0;
+	static uint32_t traceRecordsLost = 0;
+
+	static bool enabled = false;
+	static bool sendTrace = false;
+	static uint32_t bytesPerSecond = DefaultBytesPerSecond;
+	static uint32_t whenNextAllowed = 0;
+	static uint8_t sequenceNumber = 0;
+
+	static uint32_t numMessagesSent = 0, numBytesSent = 0, numBusBusy = 0;
+
+	// Set up and send a consoleData message with the data already in it, and work out when we may send the next one
+	static void SendMessage(CanMessageBuffer *buf, CanMessageConsoleData *msg, uint8_t kind, uint32_t lost, size_t length, uint32_t now)
+	{
+		msg->kind = kind;
+		msg->seq = sequenceNumber++;
+		msg->lost = (uint16_t)min<uint32_t>(lost, 0xFFFF);
+		buf->dataLength = msg->GetActualDataLength(length);
+		CanInterface::Send(buf);
+		++numMessagesSent;
+		numBytesSent += buf->dataLength;
+		whenNextAllowed = now + (buf->dataLength * 1000 + bytesPerSecond - 1)/bytesPerSecond;
+	}
+}
+
+GCodeResult RemoteConsole::Configure(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, RemoteConsoleParams);
+	bool seen = false;
+	bool enable;
+	if (parser.GetBoolParam('S', enable))
+	{
+		seen = true;
+		TaskCriticalSectionLocker lock;
+		if (enable && !enabled)
+		{
+			textWriteIndex = textReadIndex = 0;
+			textBytesLost = traceRecordsLost = 0;
+			// Start from the oldest trace record still in the buffer, so that the main board gets the events leading up to now
+			nextTraceRecord = 0;
+			uint32_t overwritten;
+			(void)Tracer::CopySince(nextTraceRecord, overwritten, nullptr, 0);
+		}
+		enabled = enable;
+	}
+
+	uint32_t rate;
+	if (parser.GetUintParam('R', rate))
+	{
+		seen = true;
+		bytesPerSecond = max<uint32_t>(rate, MinBytesPerSecond);
+	}
+
+	if (parser.GetBoolParam('T', sendTrace))
+	{
+		seen = true;
+	}
+
+	if (seen)
+	{
+		CanInterface::WakeAsyncSender();
+	}
+	else
+	{
+		reply.printf("Remote console is %s, max %" PRIu32 " bytes/sec%s", (enabled) ? "enabled" : "disabled", bytesPerSecond, (sendTrace) ? ", including trace records" : "");
+	}
+	return GCodeResult::ok;
+}
+
+// Queue text to send. If there isn't room for all of it, we discard the part that doesn't fit and count it.
+void RemoteConsole::Write(const char *text)
+{
+	if (!enabled)
+	{
+		return;
+	}
+
+	size_t length = strlen(text);
+	{
+		TaskCriticalSectionLocker lock;
+		const size_t space = TextBufferSize - (textWriteIndex - textReadIndex);
+		if (length > space)
+		{
+			textBytesLost += length - space;
+			length = space;
+		}
+		for (size_t i = 0; i < length; ++i)
+		{
+			textBuffer[(textWriteIndex + i) & (TextBufferSize - 1)] = text[i];
+		}
+		textWriteIndex += length;
+	}
+	if (length != 0)
+	{
+		CanInterface::WakeAsyncSender();
+	}
+}
+
+// Send one message if there is anything to send, we haven't exceeded the rate limit and the bus isn't busy with other messages
+uint32_t RemoteConsole::Spin(CanMessageBuffer *buf)
+{
+	if (!enabled)
+	{
+		return TaskBase::TimeoutUnlimited;
+	}
+
+	const uint32_t now = millis();
+	if ((int32_t)(now - whenNextAllowed) < 0)
+	{
+		return whenNextAllowed - now;
+	}
+
+	if (textReadIndex == textWriteIndex && !sendTrace)
+	{
+		return TaskBase::TimeoutUnlimited;
+	}
+
+	if (!CanInterface::IsTxIdle())
+	{
+		++numBusBusy;
+		return BusRetryMillis;
+	}
+
+	CanMessageConsoleData * const msg = buf->SetupStatusMessage<CanMessageConsoleData>(CanInterface::GetCanAddress(), CanId::MasterAddress);
+
+	// Send trace records in preference to text, because they get overwritten sooner
+	if (sendTrace)
+	{
+		uint32_t lost;
+		const size_t numRecords = Tracer::CopySince(nextTraceRecord, lost, reinterpret_cast<uint32_t *>(msg->data), MaxTraceRecordsPerMessage);
+		traceRecordsLost += lost;
+		if (numRecords != 0)
+		{
+			SendMessage(buf, msg, KindTrace, traceRecordsLost, numRecords * 2 * sizeof(uint32_t), now);
+			traceRecordsLost = 0;
+			return whenNextAllowed - now;
+		}
+	}
+
+	uint32_t length, lost;
+	{
+		TaskCriticalSectionLocker lock;
+		length = min<uint32_t>(textWriteIndex - textReadIndex, sizeof(msg->data));
+		for (size_t i = 0; i < length; ++i)
+		{
+			msg->data[i] = textBuffer[(textReadIndex + i) & (TextBufferSize - 1)];
+		}
+		textReadIndex += length;
+		lost = textBytesLost;
+		textBytesLost = 0;
+	}
+
+	if (length == 0)
+	{
+		return TracePollMillis;
+	}
+
+	SendMessage(buf, msg, KindText, lost, length, now);
+	return whenNextAllowed - now;
+}
+
+void RemoteConsole::Diagnostics(const StringRef& reply)
+{
+	reply.lcatf("Remote console %s, messages %" PRIu32 ", bytes %" PRIu32 ", bus busy %" PRIu32, (enabled) ? "on" : "off", numMessagesSent, numBytesSent, numBusBusy);
+	numMessagesSent = numBytesSent = numBusBusy = 0;
+}
+
+#endif
+
+// End
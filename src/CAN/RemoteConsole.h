@@ -0,0 +1,34 @@
+/*
+ * RemoteConsole.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Streams our debug text and trace records to the main board over CAN, so that we can capture logs from boards that have no UART connection.
+ *  The data is sent by the async sender task in consoleData messages, which have the lowest CAN priority, only when nothing else is waiting
+ *  to be sent and no faster than the configured rate. Text that can't be sent in time is discarded and the number of lost bytes is reported.
+ */
+
+#ifndef SRC_CAN_REMOTECONSOLE_H_
+#define SRC_CAN_REMOTECONSOLE_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_REMOTE_CONSOLE
+
+#include <GCodes/GCodeResult.h>
+
+class CanMessageBuffer;
+struct CanMessageGeneric;
+
+namespace RemoteConsole
+{
+	GCodeResult Configure(const CanMessageGeneric& msg, const StringRef& reply);	// process a remoteConsole message
+	void Write(const char *text);						// queue text to send, does nothing if the console is disabled
+	uint32_t Spin(CanMessageBuffer *buf);				// called by the async sender task, returns the maximum time in milliseconds before we want to be called again
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif
+
+#endif /* SRC_CAN_REMOTECONSOLE_H_ */
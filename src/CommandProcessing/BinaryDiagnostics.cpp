@@ -0,0 +1,60 @@
+/*
+ * BinaryDiagnostics.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "BinaryDiagnostics.h"
+
+#if SUPPORT_BINARY_DIAGNOSTICS
+
+#include <CanMessageBuffer.h>
+#include <CAN/CanInterface.h>
+#include <Platform.h>
+#include <Tasks.h>
+#include <Movement/Move.h>
+#include <Movement/StepTimer.h>
+#include <Heating/Heat.h>
+
+void BinaryDiagnostics::SendReport(CanMessageBuffer *buf)
+{
+	const CanRequestId requestId = buf->msg.diagnosticsRequest.requestId;
+	CanMessageDiagnosticsReply * const reply = buf->SetupResponseMessage<CanMessageDiagnosticsReply>(requestId, CanInterface::GetCanAddress(), buf->id.Src());
+	memset(reinterpret_cast<uint8_t*>(reply) + sizeof(reply->requestId), 0, sizeof(CanMessageDiagnosticsReply) - sizeof(reply->requestId));
+	reply->formatVersion = FormatVersion;
+
+	// System
+	reply->upTime = (uint32_t)(millis64()/1000u);
+	reply->neverUsedRam = Tasks::GetNeverUsedRam();
+	reply->stepIsrTicks = Tasks::isrTicks[(size_t)IsrId::stepTimer];
+	reply->canIsrTicks = Tasks::isrTicks[(size_t)IsrId::can];
+#if HAS_CPU_TEMP_SENSOR
+	{
+		float minMcuTemperature, maxMcuTemperature;
+		Platform::GetMcuTemperatures(minMcuTemperature, reply->mcuTemperature, maxMcuTemperature);
+	}
+#endif
+#if HAS_VOLTAGE_MONITOR
+	reply->vin = Platform::GetCurrentVinVoltage();
+#endif
+#if HAS_12V_MONITOR
+	reply->v12 = Platform::GetCurrentV12Voltage();
+#endif
+
+	// Subsystems
+	CanInterface::GetDiagnostics(*reply);
+	if (moveInstance != nullptr)
+	{
+		moveInstance->GetDiagnostics(*reply);
+	}
+	StepTimer::GetDiagnostics(*reply);
+	Heat::GetDiagnostics(*reply);
+
+	buf->dataLength = sizeof(CanMessageDiagnosticsReply);
+	CanInterface::SendAndFree(buf);
+}
+
+#endif
+
+// End
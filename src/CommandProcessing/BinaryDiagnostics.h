@@ -0,0 +1,31 @@
+/*
+ * BinaryDiagnostics.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  A binary diagnostics report that fits in one CAN-FD frame, for the main board to log or display and for monitoring systems to poll often.
+ *  Each field has a fixed type and offset given by CanMessageDiagnosticsReply, and the format version changes whenever the layout does.
+ *  Reading the report doesn't reset anything. The counters are the ones that the text diagnostics (M122) report, so they count from the last
+ *  M122 report or reset. The ISR times never reset, so the main board can calculate the interrupt load from the difference between two reports.
+ */
+
+#ifndef SRC_COMMANDPROCESSING_BINARYDIAGNOSTICS_H_
+#define SRC_COMMANDPROCESSING_BINARYDIAGNOSTICS_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_BINARY_DIAGNOSTICS
+
+class CanMessageBuffer;
+
+namespace BinaryDiagnostics
+{
+	constexpr uint8_t FormatVersion = 1;
+
+	void SendReport(CanMessageBuffer *buf);			// reply to a diagnosticsRequest message, reusing its buffer
+}
+
+#endif
+
+#endif /* SRC_COMMANDPROCESSING_BINARYDIAGNOSTICS_H_ */
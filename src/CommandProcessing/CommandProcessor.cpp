@@ -7,18 +7,44 @@
 
 #include "CommandProcessor.h"
 #include <CAN/CanInterface.h>
+#include <CAN/CanBusHealth.h>
 #include "CanMessageBuffer.h"
 #include "GCodes/GCodeResult.h"
 #include "Heating/Heat.h"
 #include "Fans/FansManager.h"
 #include "CanMessageGenericParser.h"
 #include <InputMonitors/InputMonitor.h>
+#include <InputMonitors/LoadCell.h>
+#include <Accelerometers/AccelerometerHandler.h>
+#include "CommandScheduler.h"
+#include "SelfTest.h"
+#include "BinaryDiagnostics.h"
 #include <GPIO/GpioPorts.h>
+#include <FilamentMonitors/FilamentMonitor.h>
 #include <Platform.h>
 #include <Movement/Move.h>
+#include <Movement/StepTimingKernel.h>
+#include <Movement/StepProfiler.h>
+#include <Hardware/AdcProfiler.h>
 #include <Tasks.h>
+#include <ObjectPool.h>
+#include <StartupProfiler.h>
+#include <WarmRestart.h>
+#include <SoftwareReset.h>
+#include <DeferredLog.h>
 #include <Version.h>
 #include <Hardware/AnalogIn.h>
+#include <Hardware/AdcCalibration.h>
+#include <Hardware/Flash.h>
+#include <Hardware/NvmWriter.h>
+#include <Hardware/SharedSpiDevice.h>
+#include <CAN/RemoteConsole.h>
+#include <CAN/CanBusTest.h>
+#include <CAN/CanEnumeration.h>
+#include <CAN/PositionReports.h>
+#include <InputMonitors/AnalogStream.h>
+#include <CAN/CartesianMovement.h>
+#include <Hardware/DmacManager.h>
 #include <hpl_user_area.h>
 #include <cctype>				// for tolower()
 
@@ -29,108 +55,114 @@
 # include "Movement/StepperDrivers/TMC51xx.h"
 #endif
 
-constexpr float MinVin = 11.0;
-constexpr float MaxVin = 32.0;
-constexpr float MinV12 = 10.0;
-constexpr float MaxV12 = 13.5;
-constexpr float MinTemp = -20.0;
-constexpr float MaxTemp = 55.0;
-
+// Generate the text report of the production self test
 static void GenerateTestReport(const StringRef& reply)
 {
-	bool testFailed = false;
+	SelfTest::Results results;
+	SelfTest::Run(results);
 
 #if HAS_CPU_TEMP_SENSOR
 	// Check the MCU temperature
+	if (results.mcuTemperature < SelfTest::MinTemp)
 	{
-		float minMcuTemperature, currentMcuTemperature, maxMcuTemperature;
-		Platform::GetMcuTemperatures(minMcuTemperature, currentMcuTemperature, maxMcuTemperature);
-		if (currentMcuTemperature < MinTemp)
-		{
-			reply.lcatf("MCU temperature %.1fC is lower than expected", (double)currentMcuTemperature);
-			testFailed = true;
-		}
-		else if (currentMcuTemperature > MaxTemp)
-		{
-			reply.lcatf("MCU temperature %.1fC is higher than expected", (double)currentMcuTemperature);
-			testFailed = true;
-		}
-		else
-		{
-			reply.lcatf("MCU temperature reading OK (%.1fC)", (double)currentMcuTemperature);
-		}
+		reply.lcatf("MCU temperature %.1fC is lower than expected", (double)results.mcuTemperature);
+	}
+	else if (results.mcuTemperature > SelfTest::MaxTemp)
+	{
+		reply.lcatf("MCU temperature %.1fC is higher than expected", (double)results.mcuTemperature);
+	}
+	else
+	{
+		reply.lcatf("MCU temperature reading OK (%.1fC)", (double)results.mcuTemperature);
 	}
 #endif
 
 #if HAS_VOLTAGE_MONITOR
 	// Check the supply voltage
+	if (results.vin < SelfTest::MinVin)
 	{
-		const float voltage = Platform::GetCurrentVinVoltage();
-		if (voltage < MinVin)
-		{
-			reply.lcatf("VIN voltage reading %.1f is lower than expected", (double)voltage);
-			testFailed = true;
-		}
-		else if (voltage > MaxVin)
-		{
-			reply.lcatf("VIN voltage reading %.1f is higher than expected", (double)voltage);
-			testFailed = true;
-		}
-		else
-		{
-			reply.lcatf("VIN voltage reading OK (%.1fV)", (double)voltage);
-		}
+		reply.lcatf("VIN voltage reading %.1f is lower than expected", (double)results.vin);
+	}
+	else if (results.vin > SelfTest::MaxVin)
+	{
+		reply.lcatf("VIN voltage reading %.1f is higher than expected", (double)results.vin);
+	}
+	else
+	{
+		reply.lcatf("VIN voltage reading OK (%.1fV)", (double)results.vin);
 	}
 #endif
 
 #if HAS_12V_MONITOR
 	// Check the 12V rail voltage
+	if (results.v12 < SelfTest::MinV12)
 	{
-		const float voltage = Platform::GetCurrentV12Voltage();
-		if (voltage < MinV12)
-		{
-			reply.lcatf("12V voltage reading %.1f is lower than expected", (double)voltage);
-			testFailed = true;
-		}
-		else if (voltage > MaxV12)
-		{
-			reply.lcatf("12V voltage reading %.1f is higher than expected", (double)voltage);
-			testFailed = true;
-		}
-		else
-		{
-			reply.lcatf("12V voltage reading OK (%.1fV)", (double)voltage);
-		}
+		reply.lcatf("12V voltage reading %.1f is lower than expected", (double)results.v12);
+	}
+	else if (results.v12 > SelfTest::MaxV12)
+	{
+		reply.lcatf("12V voltage reading %.1f is higher than expected", (double)results.v12);
+	}
+	else
+	{
+		reply.lcatf("12V voltage reading OK (%.1fV)", (double)results.v12);
+	}
+#endif
+
+#if HAS_VREF_MONITOR
+	if (results.NotReady(SelfTest::Check::adcReferences))
+	{
+		reply.lcat("ADC references not ready");
+	}
+	else
+	{
+		reply.lcatf("ADC references %s (VSSA %" PRIi32 ", VREF %" PRIi32 ")", (results.Failed(SelfTest::Check::adcReferences)) ? "out of range" : "OK", results.vssa, results.vref);
 	}
 #endif
 
 #if HAS_SMART_DRIVERS
 	// Check the stepper driver status
-	bool driversOK = true;
-	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	if (results.NotReady(SelfTest::Check::driversReady))
 	{
-		const uint32_t stat = SmartDrivers::GetAccumulatedStatus(driver, 0xFFFFFFFF);
-		if ((stat & (TMC_RR_OT || TMC_RR_OTPW)) != 0)
-		{
-			reply.lcatf("Driver %u reports over temperature", driver);
-			driversOK = false;
-		}
-		if ((stat & TMC_RR_S2G) != 0)
-		{
-			reply.lcatf("Driver %u reports short-to-ground", driver);
-			driversOK = false;
-		}
+		reply.lcat("Drivers not ready");
 	}
-	if (driversOK)
+	else if (results.Failed(SelfTest::Check::driversReady))
 	{
-		reply.lcatf("Driver status OK");
+		reply.lcat("Drivers failed to initialise");
 	}
 	else
 	{
-		testFailed = true;
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			if ((results.overTemperatureDrivers & (1u << driver)) != 0)
+			{
+				reply.lcatf("Driver %u reports over temperature", driver);
+			}
+			if ((results.shortedDrivers & (1u << driver)) != 0)
+			{
+				reply.lcatf("Driver %u reports short-to-ground", driver);
+			}
+		}
+		if (results.overTemperatureDrivers == 0 && results.shortedDrivers == 0)
+		{
+			reply.lcatf("Driver status OK");
+		}
 	}
 #endif
 
+	if (results.failedSensors != 0)
+	{
+		reply.lcat("Temperature sensors reporting errors:");
+		for (unsigned int sn = 0; sn < MaxSensors; ++sn)
+		{
+			if ((results.failedSensors & ((uint64_t)1u << sn)) != 0)
+			{
+				reply.catf(" %u", sn);
+			}
+		}
+	}
+
+	const bool testFailed = (results.failed != 0 || results.notReady != 0);
 	reply.lcatf((testFailed) ? "***** ONE OR MORE CHECKS FAILED *****" : "All checks passed");
 
 	if (!testFailed)
@@ -143,7 +175,7 @@ static void GenerateTestReport(const StringRef& reply)
 static GCodeResult SetMotorCurrents(const CanMessageMultipleDrivesRequest& msg, const StringRef& reply)
 {
 #if HAS_SMART_DRIVERS
-	//TODO check message is long enough for the number of drivers specified
+	// The CAN receiver has already checked that the message is long enough for the number of drivers specified
 	const auto drivers = DriversBitmap::MakeFromRaw(msg.driversToUpdate);
 	drivers.Iterate([msg](unsigned int driver, unsigned int count) -> void
 		{
@@ -159,7 +191,6 @@ static GCodeResult SetMotorCurrents(const CanMessageMultipleDrivesRequest& msg,
 static GCodeResult SetStandstillCurrentFactor(const CanMessageMultipleDrivesRequest& msg, const StringRef& reply)
 {
 #if HAS_SMART_DRIVERS
-	//TODO check message is long enough for the number of drivers specified
 	const auto drivers = DriversBitmap::MakeFromRaw(msg.driversToUpdate);
 	drivers.Iterate([msg](unsigned int driver, unsigned int count) -> void
 		{
@@ -174,7 +205,6 @@ static GCodeResult SetStandstillCurrentFactor(const CanMessageMultipleDrivesRequ
 
 static GCodeResult HandlePressureAdvance(const CanMessageMultipleDrivesRequest& msg, const StringRef& reply)
 {
-	//TODO check message is long enough for the number of drivers specified
 	const auto drivers = DriversBitmap::MakeFromRaw(msg.driversToUpdate);
 	drivers.Iterate([msg](unsigned int driver, unsigned int count) -> void
 		{
@@ -183,10 +213,78 @@ static GCodeResult HandlePressureAdvance(const CanMessageMultipleDrivesRequest&
 	return GCodeResult::ok;
 }
 
+#if SUPPORT_BABYSTEPPING
+
+// Add babystepping. The values are the signed numbers of steps to add to each driver at the configured microstepping.
+static GCodeResult HandleBabyStepping(const CanMessageMultipleDrivesRequest& msg, const StringRef& reply)
+{
+	const auto drivers = DriversBitmap::MakeFromRaw(msg.driversToUpdate);
+	drivers.Iterate([msg](unsigned int driver, unsigned int count) -> void
+		{
+			moveInstance->AddBabySteps(driver, (int16_t)msg.values[count]);
+		});
+	Move::WakeMoveTask();
+	return GCodeResult::ok;
+}
+
+#endif
+
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+
+// Process a M572 command relayed from the main board. P is the driver number, S the pressure advance in seconds and T the extruder velocity smoothing time in seconds.
+static GCodeResult ProcessM572(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, M572Params);
+	uint8_t drive;
+	if (!parser.GetUintParam('P', drive))
+	{
+		reply.copy("Missing P parameter in CAN message");
+		return GCodeResult::error;
+	}
+
+	if (drive >= NumDrivers)
+	{
+		reply.printf("Driver number %u.%u out of range", CanInterface::GetCanAddress(), drive);
+		return GCodeResult::error;
+	}
+
+	bool seen = false;
+	float advance;
+	if (parser.GetFloatParam('S', advance))
+	{
+		seen = true;
+		Platform::SetPressureAdvance(drive, max<float>(advance, 0.0));
+	}
+
+	float smoothingTime;
+	if (parser.GetFloatParam('T', smoothingTime))
+	{
+		if (smoothingTime < 0.0 || smoothingTime > MaxPressureAdvanceSmoothingTime)
+		{
+			reply.copy("Pressure advance smoothing time out of range");
+			return GCodeResult::error;
+		}
+		seen = true;
+		Platform::SetPressureAdvanceSmoothing(drive, smoothingTime);
+	}
+
+	if (!seen)
+	{
+		reply.printf("Driver %u.%u pressure advance %.3fs", CanInterface::GetCanAddress(), drive, (double)Platform::GetPressureAdvance(drive));
+		const float smoothing = Platform::GetPressureAdvanceSmoothing(drive);
+		if (smoothing > 0.0)
+		{
+			reply.catf(", smoothed over %.1fms", (double)(smoothing * 1000.0));
+		}
+	}
+	return GCodeResult::ok;
+}
+
+#endif
+
 static GCodeResult SetMicrostepping(const CanMessageMultipleDrivesRequest& msg, const StringRef& reply)
 {
 #if HAS_SMART_DRIVERS
-	//TODO check message is long enough for the number of drivers specified
 	const auto drivers = DriversBitmap::MakeFromRaw(msg.driversToUpdate);
 	GCodeResult rslt = GCodeResult::ok;
 	drivers.Iterate([msg, reply, &rslt](unsigned int driver, unsigned int count) -> void
@@ -203,6 +301,13 @@ static GCodeResult SetMicrostepping(const CanMessageMultipleDrivesRequest& msg,
 				}
 				rslt = GCodeResult::error;
 			}
+			else
+			{
+#if SUPPORT_DYNAMIC_MICROSTEPPING
+				moveInstance->MicrosteppingChanged(driver);
+#endif
+				Platform::UpdateSpeedThresholds(driver);		// the registers depend on the microstepping
+			}
 		}
 	);
 	return rslt;
@@ -301,6 +406,61 @@ static GCodeResult ProcessM569(const CanMessageGeneric& msg, const StringRef& re
 			}
 		}
 
+		// Set the stealthChop to spreadCycle changeover speed and the coolStep threshold speed in mm/sec, and the steps/mm we need to convert them.
+		// These override V and the stall detection minimum speed, and we recalculate the registers when the microstepping or steps/mm changes.
+		float fval;
+		if (parser.GetFloatParam('U', fval))		// set steps/mm
+		{
+			if (fval <= 0.0)
+			{
+				reply.printf("Bad steps/mm for driver %u", drive);
+				return GCodeResult::error;
+			}
+			seen = true;
+			Platform::SetDriveStepsPerUnit(drive, fval);
+		}
+
+		{
+			float stealthChopSpeed = Platform::GetStealthChopSpeed(drive);
+			float coolStepSpeed = Platform::GetCoolStepSpeed(drive);
+			bool speedSeen = false;
+			if (parser.GetFloatParam('A', fval))	// set stealthChop to spreadCycle changeover speed
+			{
+				speedSeen = true;
+				stealthChopSpeed = max<float>(fval, 0.0);
+			}
+			if (parser.GetFloatParam('K', fval))	// set coolStep and stall detection threshold speed
+			{
+				speedSeen = true;
+				coolStepSpeed = max<float>(fval, 0.0);
+			}
+			if (speedSeen)
+			{
+				seen = true;
+				Platform::SetChangeoverSpeeds(drive, stealthChopSpeed, coolStepSpeed);
+			}
+		}
+
+#if SUPPORT_DYNAMIC_MICROSTEPPING
+		if (parser.GetUintParam('M', val))		// set the step rate above which we reduce the microstepping
+		{
+			seen = true;
+			moveInstance->SetMaxStepRate(drive, val);
+		}
+#endif
+
+#if SUPPORT_ENCODERS
+		if (parser.GetFloatParam('E', fval))		// set encoder counts per full step, this also zeroes the encoder position
+		{
+			seen = true;
+			if (!SmartDrivers::SetEncoderCountsPerStep(drive, fval))
+			{
+				reply.printf("Bad encoder counts per step for driver %u", drive);
+				return GCodeResult::error;
+			}
+		}
+#endif
+
 #if SUPPORT_TMC51xx
 		if (parser.GetUintParam('H', val))		// set coolStep threshold
 		{
@@ -400,8 +560,7 @@ static GCodeResult ProcessM569(const CanMessageGeneric& msg, const StringRef& re
 		{
 			const uint32_t tpwmthrs = SmartDrivers::GetRegister(drive, SmartDriverRegister::tpwmthrs);
 			const uint32_t mstepPos = SmartDrivers::GetRegister(drive, SmartDriverRegister::mstepPos);
-			bool bdummy;
-			const float mmPerSec = (12000000.0 * SmartDrivers::GetMicrostepping(drive, bdummy))/(256 * tpwmthrs * Platform::DriveStepsPerUnit(drive));
+			const float mmPerSec = (12000000.0 * Platform::GetConfiguredMicrostepping(drive))/(256 * tpwmthrs * Platform::DriveStepsPerUnit(drive));
 			reply.catf(", pos %" PRIu32", tpwmthrs %" PRIu32 " (%.1f mm/sec)", mstepPos, tpwmthrs, (double)mmPerSec);
 		}
 # endif
@@ -409,11 +568,21 @@ static GCodeResult ProcessM569(const CanMessageGeneric& msg, const StringRef& re
 # if SUPPORT_TMC51xx
 		{
 			const uint32_t thigh = SmartDrivers::GetRegister(drive, SmartDriverRegister::thigh);
-			bool bdummy;
-			const float mmPerSec = (12000000.0 * SmartDrivers::GetMicrostepping(drive, bdummy))/(256 * thigh * Platform::DriveStepsPerUnit(drive));
+			const float mmPerSec = (12000000.0 * Platform::GetConfiguredMicrostepping(drive))/(256 * thigh * Platform::DriveStepsPerUnit(drive));
 			reply.catf(", thigh %" PRIu32 " (%.1f mm/sec)", thigh, (double)mmPerSec);
 		}
 # endif
+
+# if SUPPORT_DYNAMIC_MICROSTEPPING
+		if (moveInstance->GetMaxStepRate(drive) != 0)
+		{
+			reply.catf(", reduce microstepping above %" PRIu32 " steps/sec (now /%u)", moveInstance->GetMaxStepRate(drive), 1u << moveInstance->GetMicrostepReduction(drive));
+		}
+# endif
+
+# if SUPPORT_ENCODERS
+		SmartDrivers::AppendEncoderStatus(drive, reply);
+# endif
 #endif
 
 	}
@@ -422,7 +591,6 @@ static GCodeResult ProcessM569(const CanMessageGeneric& msg, const StringRef& re
 
 static GCodeResult HandleSetDriverStates(const CanMessageMultipleDrivesRequest& msg, const StringRef& reply)
 {
-	//TODO check message is long enough for the number of drivers specified
 	const auto drivers = DriversBitmap::MakeFromRaw(msg.driversToUpdate);
 	drivers.Iterate([msg](unsigned int driver, unsigned int count) -> void
 		{
@@ -486,6 +654,34 @@ static GCodeResult ProcessM915(const CanMessageGeneric& msg, const StringRef& re
 		}
 	}
 
+#if SUPPORT_TMC51xx
+	{
+		// Load-dependent current scaling: C is the minimum run current in percent (100 to disable), L and U are the SG_RESULT limits
+		uint8_t minCurrentPercent;
+		if (parser.GetUintParam('C', minCurrentPercent))
+		{
+			seen = true;
+			uint16_t sgLowerLimit = 0, sgUpperLimit = 0;					// zero means leave the limit unchanged
+			(void)parser.GetUintParam('L', sgLowerLimit);
+			(void)parser.GetUintParam('U', sgUpperLimit);
+			bool ok = true;
+			drivers.Iterate([minCurrentPercent, sgLowerLimit, sgUpperLimit, &ok](unsigned int drive, unsigned int) noexcept
+								{
+									if (!SmartDrivers::SetCurrentScaling(drive, minCurrentPercent, sgLowerLimit, sgUpperLimit))
+									{
+										ok = false;
+									}
+								}
+						   );
+			if (!ok)
+			{
+				reply.copy("Bad current scaling parameters");
+				return GCodeResult::error;
+			}
+		}
+	}
+#endif
+
 	if (!seen)
 	{
 		drivers.Iterate([&reply](unsigned int drive, unsigned int) noexcept
@@ -522,9 +718,82 @@ static GCodeResult InitiateReset(const CanMessageReset& msg, const StringRef& re
 	return GCodeResult::ok;
 }
 
+// The subsystems that we keep configuration digests for
+enum class ConfigSubsystem : uint8_t
+{
+	heat = 0,
+	fans,
+	inputs,
+	platform,
+	numSubsystems,
+	none = numSubsystems				// not a configuration command
+};
+
+static const char * const ConfigSubsystemNames[] = { "heat", "fans", "inputs", "platform" };
+static_assert(ARRAY_SIZE(ConfigSubsystemNames) == (size_t)ConfigSubsystem::numSubsystems, "Configuration subsystem names don't match the subsystems");
+
+// The digest of each subsystem covers the sequence of configuration commands that it has accepted since we started
+static uint32_t configDigests[(size_t)ConfigSubsystem::numSubsystems] = { 0 };
+
+// Return the subsystem that a command configures. We don't count commands that set temperatures, fan speeds or outputs, or that enable drivers,
+// because they change during normal operation.
+static ConfigSubsystem GetConfigSubsystem(CanMessageType type)
+{
+	switch (type)
+	{
+	case CanMessageType::updateHeaterModel:
+	case CanMessageType::m308:
+	case CanMessageType::m309:
+	case CanMessageType::m950Heater:
+	case CanMessageType::setHeaterFaultDetection:
+	case CanMessageType::setHeaterMonitors:
+	case CanMessageType::statusReporting:
+	case CanMessageType::heaterPowerBudget:
+		return ConfigSubsystem::heat;
+
+	case CanMessageType::m950Fan:
+	case CanMessageType::fanParameters:
+		return ConfigSubsystem::fans;
+
+	case CanMessageType::createInputMonitor:
+	case CanMessageType::changeInputMonitor:
+	case CanMessageType::m591:
+		return ConfigSubsystem::inputs;
+
+	case CanMessageType::m950Gpio:
+	case CanMessageType::setMotorCurrents:
+	case CanMessageType::m569:
+	case CanMessageType::setStandstillCurrentFactor:
+	case CanMessageType::setMicrostepping:
+	case CanMessageType::m915:
+	case CanMessageType::setPressureAdvance:
+	case CanMessageType::m572:
+	case CanMessageType::m593:
+		return ConfigSubsystem::platform;
+
+	default:
+		return ConfigSubsystem::none;
+	}
+}
+
+// Get the digest of a command. Every request message starts with the request ID, which changes each time the command is sent, so we leave it out.
+// Objects that are created by a command remember its digest, so that when they are sent an identical command they can skip re-creating themselves.
+static uint32_t GetCommandDigest(const CanMessageBuffer& buf)
+{
+	constexpr size_t RequestIdBytes = 2;
+	return (buf.dataLength > RequestIdBytes)
+			? Flash::CalculateCrc32(reinterpret_cast<uint32_t>(buf.msg.raw + RequestIdBytes), buf.dataLength - RequestIdBytes) ^ (uint32_t)buf.id.MsgType()
+				: (uint32_t)buf.id.MsgType();
+}
+
+bool CommandProcessor::IsConfigCommand(CanMessageType type)
+{
+	return GetConfigSubsystem(type) != ConfigSubsystem::none;
+}
+
 static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& reply, uint8_t& extra)
 {
-	static constexpr uint8_t LastDiagnosticsPart = 3;				// the last diagnostics part is typeDiagnosticsPart0 + 3
+	static constexpr uint8_t LastDiagnosticsPart = 8;				// the last diagnostics part is typeDiagnosticsPart0 + 8
 
 	switch (msg.type)
 	{
@@ -559,6 +828,80 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 		{
 			GenerateTestReport(reply);
 		}
+		else if (msg.param == 2)
+		{
+			StepTimingBenchmark(reply);
+		}
+#if SUPPORT_STEP_PROFILING
+		else if (msg.param == 3)
+		{
+			StepProfiler::Diagnostics(reply);
+		}
+#endif
+#if SUPPORT_CAN_BUS_HEALTH
+		else if (msg.param == 4)
+		{
+			CanBusHealth::Diagnostics(reply);
+		}
+#endif
+#if SUPPORT_ADC_PROFILING
+		else if (msg.param == 5)
+		{
+			AdcProfiler::Diagnostics(reply);
+		}
+#endif
+#if SUPPORT_TRACE_BUFFER
+		else if (msg.param == 6 || msg.param == 7)
+		{
+			Tracer::Diagnostics(reply, msg.param == 7);
+		}
+#endif
+#if SUPPORT_STACK_PROFILING
+		else if (msg.param == 8)
+		{
+			Tasks::StackDiagnostics(reply);
+		}
+#endif
+#if SUPPORT_CRITICAL_SECTION_PROFILING
+		else if (msg.param == 12)
+		{
+			CriticalSectionProfiler::Diagnostics(reply);
+		}
+#endif
+		else if (msg.param == 13)
+		{
+			CanInterface::BufferDiagnostics(reply);
+		}
+		else if (msg.param == 14)
+		{
+			CanInterface::TimingDiagnostics(reply);
+			StepTimer::Diagnostics(reply);
+		}
+		else if (msg.param == 15)
+		{
+			CanInterface::MovementDiagnostics(reply);
+			moveInstance->LocalStopDiagnostics(reply);
+		}
+		else if (msg.param == 16)
+		{
+			Heat::StatisticsDiagnostics(reply);
+		}
+		else if (msg.param == 17)
+		{
+			moveInstance->StatisticsDiagnostics(reply);
+		}
+		else if (msg.param >= 9 && msg.param < 9 + SoftwareResetData::NumReportParts)
+		{
+			SoftwareResetData srData;
+			if (SoftwareResetData::Load(srData))
+			{
+				srData.Report(reply, msg.param - 9);
+			}
+			else
+			{
+				reply.copy("No software reset data saved");
+			}
+		}
 		else
 		{
 			extra = LastDiagnosticsPart;
@@ -575,6 +918,9 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 			reply.lcatf("Driver %u:", driver);
 			SmartDrivers::AppendDriverStatus(driver, reply);
 		}
+# if SUPPORT_DRIVER_TEMPERATURE_ESTIMATION
+		Platform::AppendDriverTemperatures(reply);
+# endif
 #else
 		reply.copy("External motor driver(s)");			// to avoid a blank line in the M122 report
 #endif
@@ -585,8 +931,9 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 		{
 			float minTemp, currentTemp, maxTemp;
 			Platform::GetMcuTemperatures(minTemp, currentTemp, maxTemp);
-			reply.printf("Moves scheduled %" PRIu32 ", completed %" PRIu32 ", hiccups %" PRIu32,
-							moveInstance->GetScheduledMoves(), moveInstance->GetCompletedMoves(), moveInstance->GetAndClearHiccups());
+			reply.printf("Moves scheduled %" PRIu32 ", completed %" PRIu32 ", hiccups %" PRIu32 " (%.2fms)",
+							moveInstance->GetScheduledMoves(), moveInstance->GetCompletedMoves(), moveInstance->GetAndClearHiccups(),
+							(double)((float)moveInstance->GetAndClearHiccupClocks() * (1000.0f/(float)StepTimer::StepClockRate)));
 #if HAS_VOLTAGE_MONITOR && HAS_12V_MONITOR
 			reply.catf("\nVIN: %.1fV, V12: %.1fV", (double)Platform::GetCurrentVinVoltage(), (double)Platform::GetCurrentV12Voltage());
 #elif HAS_VOLTAGE_MONITOR
@@ -599,6 +946,13 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 			AnalogIn::GetDebugInfo(conversionsStarted, conversionsCompleted, conversionTimeouts);
 			reply.catf("\nTicks since heat task active %" PRIu32 ", ADC conversions started %" PRIu32 ", completed %" PRIu32 ", timed out %" PRIu32,
 						Platform::GetHeatTaskIdleTicks(), conversionsStarted, conversionsCompleted, conversionTimeouts);
+			AnalogIn::AppendChannelRates(reply);
+#if HAS_VREF_MONITOR
+			AdcCalibration::Diagnostics(reply);
+#endif
+#if SUPPORT_LOAD_CELL_PROBE
+			LoadCell::Diagnostics(reply);
+#endif
 		}
 		break;
 
@@ -620,6 +974,67 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 		}
 		break;
 
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 4:
+		extra = LastDiagnosticsPart;
+		moveInstance->Diagnostics(reply);
+		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 5:
+		extra = LastDiagnosticsPart;
+		RepRap::Diagnostics(reply);
+		ObjectPool::Diagnostics(reply);
+		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 6:
+		extra = LastDiagnosticsPart;
+		StartupProfiler::Diagnostics(reply);
+		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 7:
+		extra = LastDiagnosticsPart;
+		reply.copy("Config digests:");
+		for (size_t i = 0; i < (size_t)ConfigSubsystem::numSubsystems; ++i)
+		{
+			reply.catf(" %s %08" PRIx32, ConfigSubsystemNames[i], configDigests[i]);
+		}
+#if SUPPORT_WARM_RESTART
+		WarmRestart::Diagnostics(reply);
+#endif
+		NvmWriter::Diagnostics(reply);
+		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 8:
+		extra = LastDiagnosticsPart;
+		reply.copy("Buses:");
+#if SUPPORT_SPI_SENSORS
+		SharedSpiDevice::Diagnostics(reply);
+#endif
+#if SUPPORT_ACCELEROMETERS
+		AccelerometerHandler::Diagnostics(reply);
+#endif
+		DmacManager::Diagnostics(reply);
+		reply.lcatf("Debug messages dropped %" PRIu32, Platform::GetAndClearDroppedMessages());
+		DeferredLog::Diagnostics(reply);
+#if SUPPORT_REMOTE_CONSOLE
+		RemoteConsole::Diagnostics(reply);
+#endif
+#if SUPPORT_CAN_BUS_TEST
+		CanBusTest::Diagnostics(reply);
+#endif
+#if SUPPORT_CAN_ENUMERATION
+		CanEnumeration::Diagnostics(reply);
+#endif
+#if SUPPORT_SCHEDULED_COMMANDS
+		CommandScheduler::Diagnostics(reply);
+#endif
+#if SUPPORT_POSITION_REPORTS
+		PositionReports::Diagnostics(reply);
+#endif
+#if SUPPORT_ANALOG_STREAMING
+		AnalogStream::Diagnostics(reply);
+#endif
+		break;
+
 #if 1	//debug
 	case CanMessageReturnInfo::typePressureAdvance:
 		reply.copy("Pressure advance:");
@@ -633,158 +1048,514 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 	return GCodeResult::ok;
 }
 
+// Process a command and return the result, setting up the request ID to reply with and any extra information
+static GCodeResult ProcessCommand(CanMessageBuffer *buf, const StringRef& reply, CanRequestId& requestId, uint8_t& extra)
+{
+	const CanMessageType id = buf->id.MsgType();
+	GCodeResult rslt;
+	switch (id)
+	{
+	case CanMessageType::returnInfo:
+		requestId = buf->msg.getInfo.requestId;
+		rslt = GetInfo(buf->msg.getInfo, reply, extra);
+		break;
+
+	case CanMessageType::updateHeaterModel:
+		requestId = buf->msg.heaterModel.requestId;
+		rslt = Heat::ProcessM307(buf->msg.heaterModel, reply);
+		break;
+
+	case CanMessageType::setHeaterTemperature:
+		requestId = buf->msg.setTemp.requestId;
+		rslt = Heat::SetTemperature(buf->msg.setTemp, reply);
+		break;
+
+	case CanMessageType::m308:
+		requestId = buf->msg.generic.requestId;
+		rslt = Heat::ProcessM308(buf->msg.generic, GetCommandDigest(*buf), reply);
+		break;
+
+	case CanMessageType::m309:
+		requestId = buf->msg.generic.requestId;
+		rslt = Heat::ProcessM309(buf->msg.generic, reply);
+		break;
+
+	case CanMessageType::m950Fan:
+		requestId = buf->msg.generic.requestId;
+		rslt = FansManager::ConfigureFanPort(buf->msg.generic, GetCommandDigest(*buf), reply);
+		break;
+
+	case CanMessageType::m950Heater:
+		requestId = buf->msg.generic.requestId;
+		rslt = Heat::ConfigureHeater(buf->msg.generic, GetCommandDigest(*buf), reply);
+		break;
+
+	case CanMessageType::m950Gpio:
+		requestId = buf->msg.generic.requestId;
+		rslt = GpioPorts::HandleM950Gpio(buf->msg.generic, GetCommandDigest(*buf), reply);
+		break;
+
+	case CanMessageType::writeGpio:
+		requestId = buf->msg.writeGpio.requestId;
+		rslt = GpioPorts::HandleGpioWrite(buf->msg.writeGpio, reply);
+		break;
+
+	case CanMessageType::writeGpioBatch:
+		requestId = buf->msg.generic.requestId;
+		rslt = GpioPorts::HandleGpioWriteBatch(buf->msg.generic, reply);
+		break;
+
+#if SUPPORT_REMOTE_CONSOLE
+	case CanMessageType::remoteConsole:
+		requestId = buf->msg.generic.requestId;
+		rslt = RemoteConsole::Configure(buf->msg.generic, reply);
+		break;
+#endif
+
+#if SUPPORT_CAN_BUS_TEST
+	case CanMessageType::canFloodRequest:
+		requestId = buf->msg.generic.requestId;
+		rslt = CanBusTest::StartFlood(buf->msg.generic, reply);
+		break;
+#endif
+
+#if SUPPORT_ACCELEROMETERS
+	case CanMessageType::accelerometerConfig:
+		requestId = buf->msg.generic.requestId;
+		rslt = AccelerometerHandler::Configure(buf->msg.generic, reply);
+		break;
+
+	case CanMessageType::startAccelerometer:
+		requestId = buf->msg.generic.requestId;
+		rslt = AccelerometerHandler::Start(buf->msg.generic, reply);
+		break;
+#endif
+
+#if SUPPORT_SCHEDULED_COMMANDS
+	case CanMessageType::scheduledCommand:
+		requestId = buf->msg.scheduledCommand.requestId;
+		rslt = CommandScheduler::Schedule(buf->msg.scheduledCommand, buf->dataLength, buf->id.Src(), reply);
+		break;
+#endif
+
+#if SUPPORT_POSITION_REPORTS
+	case CanMessageType::positionReporting:
+		requestId = buf->msg.generic.requestId;
+		rslt = PositionReports::Configure(buf->msg.generic, reply);
+		break;
+#endif
+
+#if SUPPORT_ANALOG_STREAMING
+	case CanMessageType::analogStream:
+		requestId = buf->msg.generic.requestId;
+		rslt = AnalogStream::Configure(buf->msg.generic, reply);
+		break;
+#endif
+
+#if SUPPORT_LEADSCREW_CORRECTION
+	case CanMessageType::leadscrewCorrection:
+		requestId = buf->msg.generic.requestId;
+		rslt = moveInstance->GetKinematics().ConfigureLeadscrewCorrections(buf->msg.generic, reply);
+		break;
+#endif
+
+#if SUPPORT_LOCAL_KINEMATICS
+	case CanMessageType::localKinematics:
+		requestId = buf->msg.generic.requestId;
+		rslt = CartesianMovement::Configure(buf->msg.generic, reply);
+		break;
+#endif
+
+	case CanMessageType::setMotorCurrents:
+		requestId = buf->msg.multipleDrivesRequest.requestId;
+		rslt = SetMotorCurrents(buf->msg.multipleDrivesRequest, reply);
+		break;
+
+	case CanMessageType::m569:
+		requestId = buf->msg.generic.requestId;
+		rslt = ProcessM569(buf->msg.generic, reply);
+		break;
+
+	case CanMessageType::setStandstillCurrentFactor:
+		requestId = buf->msg.multipleDrivesRequest.requestId;
+		rslt = SetStandstillCurrentFactor(buf->msg.multipleDrivesRequest, reply);
+		break;
+
+	case CanMessageType::setMicrostepping:
+		requestId = buf->msg.multipleDrivesRequest.requestId;
+		rslt = SetMicrostepping(buf->msg.multipleDrivesRequest, reply);
+		break;
+
+	case CanMessageType::updateFirmware:
+		requestId = buf->msg.updateYourFirmware.requestId;
+		rslt = InitiateFirmwareUpdate(buf->msg.updateYourFirmware, reply);
+		break;
+
+	case CanMessageType::reset:
+		requestId = buf->msg.reset.requestId;
+		rslt = InitiateReset(buf->msg.reset, reply);
+		break;
+
+	case CanMessageType::fanParameters:
+		requestId = buf->msg.fanParameters.requestId;
+		rslt = FansManager::ConfigureFan(buf->msg.fanParameters, reply);
+		break;
+
+	case CanMessageType::setFanSpeed:
+		requestId = buf->msg.setFanSpeed.requestId;
+		rslt = FansManager::SetFanSpeed(buf->msg.setFanSpeed, reply);
+		break;
+
+	case CanMessageType::setHeaterFaultDetection:
+		requestId = buf->msg.setHeaterFaultDetection.requestId;
+		rslt = Heat::SetFaultDetection(buf->msg.setHeaterFaultDetection, reply);
+		break;
+
+	case CanMessageType::setHeaterMonitors:
+		requestId = buf->msg.setHeaterMonitors.requestId;
+		rslt = Heat::SetHeaterMonitors(buf->msg.setHeaterMonitors, reply);
+		break;
+
+	case CanMessageType::setDriverStates:
+		requestId = buf->msg.multipleDrivesRequest.requestId;
+		rslt = HandleSetDriverStates(buf->msg.multipleDrivesRequest, reply);
+		break;
+
+	case CanMessageType::m915:
+		requestId = buf->msg.generic.requestId;
+		rslt = ProcessM915(buf->msg.generic, reply);
+		break;
+
+	case CanMessageType::setPressureAdvance:
+		requestId = buf->msg.multipleDrivesRequest.requestId;
+		rslt = HandlePressureAdvance(buf->msg.multipleDrivesRequest, reply);
+		break;
+
+#if SUPPORT_BABYSTEPPING
+	case CanMessageType::babyStepping:
+		requestId = buf->msg.multipleDrivesRequest.requestId;
+		rslt = HandleBabyStepping(buf->msg.multipleDrivesRequest, reply);
+		break;
+#endif
+
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+	case CanMessageType::m572:
+		requestId = buf->msg.generic.requestId;
+		rslt = ProcessM572(buf->msg.generic, reply);
+		break;
+#endif
+
+#if SUPPORT_INPUT_SHAPING
+	case CanMessageType::m593:
+		requestId = buf->msg.generic.requestId;
+		rslt = moveInstance->GetShaper().Configure(buf->msg.generic, reply);
+		break;
+#endif
+
+#if SUPPORT_EXTRUDER_MIXING
+	case CanMessageType::m567:
+		requestId = buf->msg.generic.requestId;
+		rslt = moveInstance->GetMixer().Configure(buf->msg.generic, reply);
+		break;
+#endif
+
+#if SUPPORT_FILAMENT_MONITORS
+	case CanMessageType::m591:
+		requestId = buf->msg.generic.requestId;
+		rslt = FilamentMonitor::Configure(buf->msg.generic, reply);
+		break;
+#endif
+
+	case CanMessageType::statusReporting:
+		requestId = buf->msg.generic.requestId;
+		rslt = Heat::ConfigureStatusReporting(buf->msg.generic, reply);
+		break;
+
+	case CanMessageType::heaterPowerBudget:
+		requestId = buf->msg.generic.requestId;
+		rslt = Heat::ConfigurePowerBudget(buf->msg.generic, reply);
+		break;
+
+#if SUPPORT_HEATER_PROFILES
+	case CanMessageType::heaterProfile:
+		requestId = buf->msg.generic.requestId;
+		rslt = Heat::ConfigureHeaterProfile(buf->msg.generic, reply);
+		break;
+#endif
+
+	case CanMessageType::createInputMonitor:
+		requestId = buf->msg.createInputMonitor.requestId;
+		rslt = InputMonitor::Create(buf->msg.createInputMonitor, buf->dataLength, reply, extra);
+		break;
+
+	case CanMessageType::changeInputMonitor:
+		requestId = buf->msg.changeInputMonitor.requestId;
+		rslt = InputMonitor::Change(buf->msg.changeInputMonitor, reply, extra);
+		break;
+
+	case CanMessageType::setAddressAndNormalTiming:
+		requestId = buf->msg.setAddressAndNormalTiming.requestId;
+		rslt = CanInterface::ChangeAddressAndDataRate(buf->msg.setAddressAndNormalTiming, reply);
+		break;
+
+	case CanMessageType::setFastTiming:
+		requestId = buf->msg.setFastTiming.requestId;
+		rslt = CanInterface::SetFastTiming(buf->msg.setFastTiming, reply);
+		break;
+
+	case CanMessageType::diagnosticTest:
+		requestId = buf->msg.diagnosticTest.requestId;
+		rslt = Platform::DoDiagnosticTest(buf->msg.diagnosticTest, reply);
+		break;
+
+	case CanMessageType::setCanGroups:
+		requestId = buf->msg.generic.requestId;
+		rslt = CanInterface::SetGroupAddresses(buf->msg.generic, reply);
+		break;
+
+	default:
+		requestId = CanRequestIdAcceptAlways;
+		reply.printf("Board %u received unknown msg type %u", CanInterface::GetCanAddress(), (unsigned int)buf->id.MsgType());
+		rslt = GCodeResult::error;
+		break;
+	}
+
+	if (rslt == GCodeResult::ok)
+	{
+		const ConfigSubsystem subsystem = GetConfigSubsystem(id);
+		if (subsystem != ConfigSubsystem::none)
+		{
+			const uint32_t digests[2] = { configDigests[(size_t)subsystem], GetCommandDigest(*buf) };
+			configDigests[(size_t)subsystem] = Flash::CalculateCrc32(reinterpret_cast<uint32_t>(digests), sizeof(digests));
+		}
+	}
+	return rslt;
+}
+
+#if SUPPORT_WARM_RESTART
+
+// Get the target of a generic configuration command from its key parameter, and which of the other parameters it has.
+// Return false if it has no other parameters, because then it only asks for a report.
+static bool GetGenericConfigTarget(const CanMessageGeneric& msg, const ParamDescriptor *paramTable, char keyLetter, CommandProcessor::ConfigTarget& ct)
+{
+	CanMessageGenericParser parser(msg, paramTable);
+	if (keyLetter == 0 || !parser.GetUintParam(keyLetter, ct.target))
+	{
+		ct.target = CommandProcessor::ConfigTarget::NoTarget;
+	}
+
+	ct.upperCaseParams = ct.lowerCaseParams = 0;
+	for (unsigned int i = 0; i < 26; ++i)
+	{
+		if ('A' + i != keyLetter && parser.HasParameter('A' + i))
+		{
+			ct.upperCaseParams |= 1ul << i;
+		}
+		if ('a' + i != keyLetter && parser.HasParameter('a' + i))
+		{
+			ct.lowerCaseParams |= 1ul << i;
+		}
+	}
+	return (ct.upperCaseParams | ct.lowerCaseParams) != 0;
+}
+
+// Get what a configuration command configures. Commands that aren't generic messages always set all their fields.
+bool CommandProcessor::GetConfigTarget(const CanMessageBuffer& buf, ConfigTarget& ct)
+{
+	ct.upperCaseParams = ct.lowerCaseParams = 0xFFFFFFFF;
+	switch (buf.id.MsgType())
+	{
+	case CanMessageType::m308:					return GetGenericConfigTarget(buf.msg.generic, M308Params, 'S', ct);
+	case CanMessageType::m309:					return GetGenericConfigTarget(buf.msg.generic, M309Params, 'P', ct);
+	case CanMessageType::m950Heater:			return GetGenericConfigTarget(buf.msg.generic, M950HeaterParams, 'H', ct);
+	case CanMessageType::m950Fan:				return GetGenericConfigTarget(buf.msg.generic, M950FanParams, 'F', ct);
+	case CanMessageType::m950Gpio:				return GetGenericConfigTarget(buf.msg.generic, M950GpioParams, 'P', ct);
+	case CanMessageType::m569:					return GetGenericConfigTarget(buf.msg.generic, M569Params, 'P', ct);
+	case CanMessageType::m915:					return GetGenericConfigTarget(buf.msg.generic, M915Params, 'd', ct);
+	case CanMessageType::m572:					return GetGenericConfigTarget(buf.msg.generic, M572Params, 'P', ct);
+	case CanMessageType::m591:					return GetGenericConfigTarget(buf.msg.generic, M591Params, 'D', ct);
+	case CanMessageType::m593:					return GetGenericConfigTarget(buf.msg.generic, M593Params, 0, ct);
+	case CanMessageType::statusReporting:		return GetGenericConfigTarget(buf.msg.generic, StatusReportingParams, 0, ct);
+	case CanMessageType::heaterPowerBudget:		return GetGenericConfigTarget(buf.msg.generic, HeaterPowerBudgetParams, 'P', ct);
+
+	case CanMessageType::updateHeaterModel:
+		ct.target = buf.msg.heaterModel.heater;
+		return true;
+
+	case CanMessageType::setHeaterFaultDetection:
+		ct.target = buf.msg.setHeaterFaultDetection.heater;
+		return true;
+
+	case CanMessageType::setHeaterMonitors:
+		ct.target = buf.msg.setHeaterMonitors.heater;
+		return true;
+
+	case CanMessageType::fanParameters:
+		ct.target = buf.msg.fanParameters.fanNumber;
+		return true;
+
+	case CanMessageType::createInputMonitor:
+		ct.target = buf.msg.createInputMonitor.handle.u.all;
+		return true;
+
+	case CanMessageType::changeInputMonitor:
+		// Each action supersedes an earlier one of the same kind, except that starting and stopping monitoring supersede each other and deleting the monitor supersedes everything
+		ct.target = buf.msg.changeInputMonitor.handle.u.all;
+		switch (buf.msg.changeInputMonitor.action)
+		{
+		case CanMessageChangeInputMonitor::actionReturnPinName:
+			return false;
+
+		case CanMessageChangeInputMonitor::actionDelete:
+			return true;
+
+		case CanMessageChangeInputMonitor::actionDontMonitor:
+			ct.upperCaseParams = 1u << CanMessageChangeInputMonitor::actionDoMonitor;
+			ct.lowerCaseParams = 0;
+			return true;
+
+		default:
+			ct.upperCaseParams = 1u << buf.msg.changeInputMonitor.action;
+			ct.lowerCaseParams = 0;
+			return true;
+		}
+
+	case CanMessageType::setMotorCurrents:
+	case CanMessageType::setStandstillCurrentFactor:
+	case CanMessageType::setMicrostepping:
+	case CanMessageType::setPressureAdvance:
+		ct.target = buf.msg.multipleDrivesRequest.driversToUpdate;
+		return true;
+
+	default:
+		ct.target = ConfigTarget::NoTarget;
+		return true;
+	}
+}
+
+// Replay a command from the configuration journal. We discard the reply because there is nobody to send it to.
+GCodeResult CommandProcessor::ReplayCommand(CanMessageBuffer *buf)
+{
+	String<FormatStringLength> reply;
+	CanRequestId requestId;
+	uint8_t extra = 0;
+	const GCodeResult rslt = ProcessCommand(buf, reply.GetRef(), requestId, extra);
+	CanInterface::FreeBuffer(buf);
+	return rslt;
+}
+
+#endif
+
+#if SUPPORT_SCHEDULED_COMMANDS
+
+// Execute a command that was scheduled for this time. The main board had its reply when we scheduled it, so we report failures as messages instead.
+static void ExecuteScheduledCommand(const CommandScheduler::ScheduledCommand& cmd)
+{
+	String<FormatStringLength> reply;
+	GCodeResult rslt;
+	switch (cmd.type)
+	{
+	case CanMessageType::setFanSpeed:
+		rslt = FansManager::SetFanSpeed(cmd.msg.setFanSpeed, reply.GetRef());
+		break;
+
+	case CanMessageType::setHeaterTemperature:
+		rslt = Heat::SetTemperature(cmd.msg.setTemp, reply.GetRef());
+		break;
+
+	case CanMessageType::writeGpio:
+		rslt = GpioPorts::HandleGpioWrite(cmd.msg.writeGpio, reply.GetRef());
+		break;
+
+	case CanMessageType::setDriverStates:
+		rslt = HandleSetDriverStates(cmd.msg.multipleDrivesRequest, reply.GetRef());
+		break;
+
+	default:
+		rslt = GCodeResult::error;
+		break;
+	}
+
+	CommandScheduler::RecordResult(rslt);
+	if (rslt != GCodeResult::ok)
+	{
+		Platform::MessageF(ErrorMessage, "Board %u: scheduled command type %u from board %u failed: %s\n",
+							CanInterface::GetCanAddress(), (unsigned int)cmd.type, cmd.src, reply.c_str());
+	}
+}
+
+#endif
+
 void CommandProcessor::Spin()
 {
+#if SUPPORT_SCHEDULED_COMMANDS
+	// Execute any scheduled commands that are due before we process new commands, which may have been sent after them
+	{
+		CommandScheduler::ScheduledCommand cmd;
+		while (CommandScheduler::GetDueCommand(cmd))
+		{
+			ExecuteScheduledCommand(cmd);
+		}
+	}
+#endif
+
 	CanMessageBuffer *buf = CanInterface::GetCanCommand();
 	if (buf != nullptr)
 	{
+		Tasks::WakeMainTask();									// there may be more commands waiting, so don't sleep after this one
 		Platform::OnProcessingCanMessage();
+
+#if SUPPORT_READ_INPUTS
+		// The reply to a read inputs request carries the states in binary, so it isn't a standard reply
+		if (buf->id.MsgType() == CanMessageType::readInputsRequest)
+		{
+			InputMonitor::ReadInputs(buf);
+			return;
+		}
+#endif
+
+		// Likewise the reply to a self test request
+		if (buf->id.MsgType() == CanMessageType::selfTestRequest)
+		{
+			SelfTest::SendResults(buf);
+			return;
+		}
+
+#if SUPPORT_BINARY_DIAGNOSTICS
+		// And the binary diagnostics report
+		if (buf->id.MsgType() == CanMessageType::diagnosticsRequest)
+		{
+			BinaryDiagnostics::SendReport(buf);
+			return;
+		}
+#endif
+
+#if SUPPORT_CAN_BUS_HEALTH
+		// The reply to a CAN bus health request carries the statistics in binary, so it isn't a standard reply
+		if (buf->id.MsgType() == CanMessageType::canBusHealthRequest)
+		{
+			CanBusHealth::SendReport(buf);
+			return;
+		}
+#endif
+
 		String<FormatStringLength> reply;
-		const StringRef& replyRef = reply.GetRef();
-		const CanMessageType id = buf->id.MsgType();
-		GCodeResult rslt;
 		CanRequestId requestId;
 		uint8_t extra = 0;
+		const GCodeResult rslt = ProcessCommand(buf, reply.GetRef(), requestId, extra);
 
-		switch (id)
-		{
-		case CanMessageType::returnInfo:
-			requestId = buf->msg.getInfo.requestId;
-			rslt = GetInfo(buf->msg.getInfo, replyRef, extra);
-			break;
-
-		case CanMessageType::updateHeaterModel:
-			requestId = buf->msg.heaterModel.requestId;
-			rslt = Heat::ProcessM307(buf->msg.heaterModel, replyRef);
-			break;
-
-		case CanMessageType::setHeaterTemperature:
-			requestId = buf->msg.setTemp.requestId;
-			rslt = Heat::SetTemperature(buf->msg.setTemp, replyRef);
-			break;
-
-		case CanMessageType::m308:
-			requestId = buf->msg.generic.requestId;
-			rslt = Heat::ProcessM308(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::m950Fan:
-			requestId = buf->msg.generic.requestId;
-			rslt = FansManager::ConfigureFanPort(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::m950Heater:
-			requestId = buf->msg.generic.requestId;
-			rslt = Heat::ConfigureHeater(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::m950Gpio:
-			requestId = buf->msg.generic.requestId;
-			rslt = GpioPorts::HandleM950Gpio(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::writeGpio:
-			requestId = buf->msg.writeGpio.requestId;
-			rslt = GpioPorts::HandleGpioWrite(buf->msg.writeGpio, replyRef);
-			break;
-
-		case CanMessageType::setMotorCurrents:
-			requestId = buf->msg.multipleDrivesRequest.requestId;
-			rslt = SetMotorCurrents(buf->msg.multipleDrivesRequest, replyRef);
-			break;
-
-		case CanMessageType::m569:
-			requestId = buf->msg.generic.requestId;
-			rslt = ProcessM569(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::setStandstillCurrentFactor:
-			requestId = buf->msg.multipleDrivesRequest.requestId;
-			rslt = SetStandstillCurrentFactor(buf->msg.multipleDrivesRequest, replyRef);
-			break;
-
-		case CanMessageType::setMicrostepping:
-			requestId = buf->msg.multipleDrivesRequest.requestId;
-			rslt = SetMicrostepping(buf->msg.multipleDrivesRequest, replyRef);
-			break;
-
-		case CanMessageType::updateFirmware:
-			requestId = buf->msg.updateYourFirmware.requestId;
-			rslt = InitiateFirmwareUpdate(buf->msg.updateYourFirmware, replyRef);
-			break;
-
-		case CanMessageType::reset:
-			requestId = buf->msg.reset.requestId;
-			rslt = InitiateReset(buf->msg.reset, replyRef);
-			break;
-
-		case CanMessageType::fanParameters:
-			requestId = buf->msg.fanParameters.requestId;
-			rslt = FansManager::ConfigureFan(buf->msg.fanParameters, replyRef);
-			break;
-
-		case CanMessageType::setFanSpeed:
-			requestId = buf->msg.setFanSpeed.requestId;
-			rslt = FansManager::SetFanSpeed(buf->msg.setFanSpeed, replyRef);
-			break;
-
-		case CanMessageType::setHeaterFaultDetection:
-			requestId = buf->msg.setHeaterFaultDetection.requestId;
-			rslt = Heat::SetFaultDetection(buf->msg.setHeaterFaultDetection, replyRef);
-			break;
-
-		case CanMessageType::setHeaterMonitors:
-			requestId = buf->msg.setHeaterMonitors.requestId;
-			rslt = Heat::SetHeaterMonitors(buf->msg.setHeaterMonitors, replyRef);
-			break;
-
-		case CanMessageType::setDriverStates:
-			requestId = buf->msg.multipleDrivesRequest.requestId;
-			rslt = HandleSetDriverStates(buf->msg.multipleDrivesRequest, replyRef);
-			break;
-
-		case CanMessageType::m915:
-			requestId = buf->msg.generic.requestId;
-			rslt = ProcessM915(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::setPressureAdvance:
-			requestId = buf->msg.multipleDrivesRequest.requestId;
-			rslt = HandlePressureAdvance(buf->msg.multipleDrivesRequest, replyRef);
-			break;
-
-		case CanMessageType::createInputMonitor:
-			requestId = buf->msg.createInputMonitor.requestId;
-			rslt = InputMonitor::Create(buf->msg.createInputMonitor, buf->dataLength, replyRef, extra);
-			break;
-
-		case CanMessageType::changeInputMonitor:
-			requestId = buf->msg.changeInputMonitor.requestId;
-			rslt = InputMonitor::Change(buf->msg.changeInputMonitor, replyRef, extra);
-			break;
-
-		case CanMessageType::setAddressAndNormalTiming:
-			requestId = buf->msg.setAddressAndNormalTiming.requestId;
-			rslt = CanInterface::ChangeAddressAndDataRate(buf->msg.setAddressAndNormalTiming, replyRef);
-			break;
-
-#if 0
-		case CanMessageType::setFastTiming:
-			requestId = buf->msg.setFastTiming.requestId;
-			rslt = CanInterface::SetFastTiming(buf->msg.setFastTiming, replyRef);
-			break;
-#endif
-
-		case CanMessageType::diagnosticTest:
-			requestId = buf->msg.diagnosticTest.requestId;
-			rslt = Platform::DoDiagnosticTest(buf->msg.diagnosticTest, replyRef);
-			break;
+#if SUPPORT_WARM_RESTART
+		if (rslt == GCodeResult::ok)
+		{
+			WarmRestart::RecordCommand(*buf);
+		}
+#endif
 
-		default:
-			requestId = CanRequestIdAcceptAlways;
-			reply.printf("Board %u received unknown msg type %u", CanInterface::GetCanAddress(), (unsigned int)buf->id.MsgType());
-			rslt = GCodeResult::error;
-			break;
+		// A message sent to a group address goes to several boards, so to avoid flooding the bus we only reply if the command failed
+		if (buf->id.Dst() != CanInterface::GetCanAddress() && rslt == GCodeResult::ok)
+		{
+			CanInterface::FreeBuffer(buf);
+			return;
 		}
 
 		// Re-use the message buffer to send a standard reply
@@ -9,10 +9,35 @@
 #define SRC_COMMANDPROCESSING_COMMANDPROCESSOR_H_
 
 #include "RepRapFirmware.h"
+#include "GCodes/GCodeResult.h"
+#include <CanId.h>
+
+struct CanMessageBuffer;
 
 namespace CommandProcessor
 {
 	void Spin();
+	bool IsConfigCommand(CanMessageType type);				// return true if the command is part of the board configuration
+#if SUPPORT_WARM_RESTART
+	// What a configuration command configures, so that we can tell when a later command supersedes it
+	struct ConfigTarget
+	{
+		static constexpr uint32_t NoTarget = 0xFFFFFFFF;
+
+		uint32_t target;									// the heater, sensor, fan, port, input handle or drivers, or NoTarget if the command configures the whole board
+		uint32_t upperCaseParams;							// bitmap of the parameters that the command sets, bit 0 is A
+		uint32_t lowerCaseParams;							// bitmap of the parameters that the command sets, bit 0 is a
+
+		// Return true if this command sets everything that the other one did, given that they are commands of the same type
+		bool Supersedes(const ConfigTarget& other) const noexcept
+		{
+			return target == other.target && (other.upperCaseParams & ~upperCaseParams) == 0 && (other.lowerCaseParams & ~lowerCaseParams) == 0;
+		}
+	};
+
+	bool GetConfigTarget(const CanMessageBuffer& buf, ConfigTarget& ct);	// get what a configuration command configures, return false if it only asks for a report
+	GCodeResult ReplayCommand(CanMessageBuffer *buf);		// process a command without replying to it, then free the buffer
+#endif
 }
 
 #endif /* SRC_COMMANDPROCESSING_COMMANDPROCESSOR_H_ */
@@ -0,0 +1,174 @@
+/*
+ * CommandScheduler.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "CommandScheduler.h"
+
+#if SUPPORT_SCHEDULED_COMMANDS
+
+#include <CAN/CanInterface.h>
+#include <Movement/StepTimer.h>
+#include <Tasks.h>
+
+namespace CommandScheduler
+{
+#if defined(SAME51)
+	constexpr size_t MaxScheduledCommands = 16;
+#else
+	constexpr size_t MaxScheduledCommands = 6;
+#endif
+	static_assert(MaxScheduledCommands <= 32, "The bitmap of used entries has 32 bits");
+
+	constexpr uint32_t MaxScheduleAheadTicks = 60 * StepTimer::StepClockRate;		// a time further ahead than this is more likely to be a time in the past
+
+	// There are only a few entries, so we find the first one due by searching them rather than keeping them sorted
+	static ScheduledCommand commands[MaxScheduledCommands];
+	static uint32_t usedEntries = 0;
+	static StepTimer timer;
+
+	static uint32_t numScheduled = 0, numExecuted = 0, numFailed = 0, numRejected = 0, maxLateness = 0;
+
+	// Return the index of the entry that is due first, or MaxScheduledCommands if there are none. Must be called with the timer callback cancelled or from the main task.
+	static size_t FindFirstDue()
+	{
+		size_t first = MaxScheduledCommands;
+		for (uint32_t entries = usedEntries; entries != 0; )
+		{
+			const size_t i = LowestSetBit(entries);
+			entries &= ~(1u << i);
+			if (first == MaxScheduledCommands || (int32_t)(commands[i].whenDue - commands[first].whenDue) < 0)
+			{
+				first = i;
+			}
+		}
+		return first;
+	}
+
+	static void TimerCallback(CallbackParameter)
+	{
+		Tasks::WakeMainTaskFromIsr();
+	}
+
+	// Set the timer for the command that is due first, or wake the main task if it is already due
+	static void ScheduleWakeup()
+	{
+		const size_t first = FindFirstDue();
+		if (first == MaxScheduledCommands)
+		{
+			timer.CancelCallback();
+		}
+		else if (timer.ScheduleCallback(commands[first].whenDue))
+		{
+			Tasks::WakeMainTask();
+		}
+	}
+}
+
+bool CommandScheduler::IsSchedulable(CanMessageType type)
+{
+	switch (type)
+	{
+	case CanMessageType::setFanSpeed:
+	case CanMessageType::setHeaterTemperature:
+	case CanMessageType::writeGpio:
+	case CanMessageType::setDriverStates:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+GCodeResult CommandScheduler::Schedule(const CanMessageScheduledCommand& msg, size_t dataLength, CanAddress src, const StringRef& reply)
+{
+	const CanMessageType type = (CanMessageType)msg.commandType;
+	const size_t headerLength = sizeof(CanMessageScheduledCommand) - sizeof(msg.data);
+	if (!IsSchedulable(type) || dataLength <= headerLength)
+	{
+		++numRejected;
+		reply.printf("Board %u can't schedule command type %u", CanInterface::GetCanAddress(), (unsigned int)msg.commandType);
+		return GCodeResult::error;
+	}
+	if (!StepTimer::IsSynced())
+	{
+		++numRejected;
+		reply.printf("Board %u can't schedule commands because its clock is not synchronised", CanInterface::GetCanAddress());
+		return GCodeResult::error;
+	}
+	const uint32_t whenDue = StepTimer::ConvertToLocalTime(msg.whenToExecute);
+	if ((int32_t)(whenDue - StepTimer::GetTimerTicks()) > (int32_t)MaxScheduleAheadTicks)
+	{
+		++numRejected;
+		reply.printf("Board %u: scheduled time is too far ahead", CanInterface::GetCanAddress());
+		return GCodeResult::error;
+	}
+	if (usedEntries == (1ul << MaxScheduledCommands) - 1)
+	{
+		++numRejected;
+		reply.printf("Board %u has too many scheduled commands", CanInterface::GetCanAddress());
+		return GCodeResult::error;
+	}
+
+	if (usedEntries == 0)
+	{
+		timer.SetCallback(TimerCallback, CallbackParameter(nullptr));	// no callback is pending when there are no commands, so it is safe to do this here
+	}
+
+	// A command that is already due is executed the next time CommandProcessor::Spin runs, which is straight away
+	const size_t i = LowestSetBit(~usedEntries);
+	ScheduledCommand& cmd = commands[i];
+	cmd.whenDue = whenDue;
+	cmd.type = type;
+	cmd.src = src;
+	memset(&cmd.msg, 0, sizeof(cmd.msg));
+	memcpy(&cmd.msg, msg.data, min<size_t>(dataLength - headerLength, sizeof(msg.data)));
+	usedEntries |= 1u << i;
+	++numScheduled;
+	ScheduleWakeup();
+	return GCodeResult::ok;
+}
+
+bool CommandScheduler::GetDueCommand(ScheduledCommand& cmd)
+{
+	const size_t first = FindFirstDue();
+	if (first == MaxScheduledCommands)
+	{
+		return false;
+	}
+	const int32_t lateness = (int32_t)(StepTimer::GetTimerTicks() - commands[first].whenDue);
+	if (lateness < 0)
+	{
+		return false;
+	}
+	if ((uint32_t)lateness > maxLateness)
+	{
+		maxLateness = lateness;
+	}
+	cmd = commands[first];
+	usedEntries &= ~(1u << first);
+	ScheduleWakeup();
+	return true;
+}
+
+void CommandScheduler::RecordResult(GCodeResult rslt)
+{
+	++numExecuted;
+	if (rslt != GCodeResult::ok)
+	{
+		++numFailed;
+	}
+}
+
+void CommandScheduler::Diagnostics(const StringRef& reply)
+{
+	reply.lcatf("Scheduled commands pending %u, scheduled %" PRIu32 ", executed %" PRIu32 ", failed %" PRIu32 ", rejected %" PRIu32 ", max late %.2fms",
+				__builtin_popcount(usedEntries), numScheduled, numExecuted, numFailed, numRejected, (double)((float)maxLateness * StepTimer::StepClocksToMillis));
+	numScheduled = numExecuted = numFailed = numRejected = maxLateness = 0;
+}
+
+#endif
+
+// End
@@ -0,0 +1,42 @@
+/*
+ * CommandScheduler.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Holds commands that the main board wants executed at a particular master step clock time, so that fan, heater, GPIO and driver state changes
+ *  can be placed in the motion timeline instead of the main board having to wait for the moves to finish before sending them.
+ *  A step timer callback wakes the main task when the first command is due, and CommandProcessor::Spin executes it.
+ */
+
+#ifndef SRC_COMMANDPROCESSING_COMMANDSCHEDULER_H_
+#define SRC_COMMANDPROCESSING_COMMANDSCHEDULER_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_SCHEDULED_COMMANDS
+
+#include <CanId.h>
+#include <CanMessageFormats.h>
+#include <GCodes/GCodeResult.h>
+
+namespace CommandScheduler
+{
+	struct ScheduledCommand
+	{
+		uint32_t whenDue;										// local step clock
+		CanMessageType type;
+		CanAddress src;
+		CanMessage msg;
+	};
+
+	bool IsSchedulable(CanMessageType type);
+	GCodeResult Schedule(const CanMessageScheduledCommand& msg, size_t dataLength, CanAddress src, const StringRef& reply);
+	bool GetDueCommand(ScheduledCommand& cmd);					// if a command is due, copy it to 'cmd', remove it from the schedule and return true
+	void RecordResult(GCodeResult rslt);
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif
+
+#endif /* SRC_COMMANDPROCESSING_COMMANDSCHEDULER_H_ */
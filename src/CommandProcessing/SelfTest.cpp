@@ -0,0 +1,170 @@
+/*
+ * SelfTest.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "SelfTest.h"
+#include <Platform.h>
+#include <Heating/Heat.h>
+#include <Hardware/AdcCalibration.h>
+#include <CAN/CanInterface.h>
+#include <CanMessageBuffer.h>
+#include <GCodes/GCodeResult.h>
+
+#if SUPPORT_TMC22xx
+# include "Movement/StepperDrivers/TMC22xx.h"
+#endif
+#if SUPPORT_TMC51xx
+# include "Movement/StepperDrivers/TMC51xx.h"
+#endif
+
+namespace SelfTest
+{
+	constexpr uint32_t DriverInitialisationMillis = 2000;		// if VIN is good, the drivers should be ready this long after we start
+
+	static void Record(Results& results, Check c, bool ok)
+	{
+		const uint16_t bit = 1u << (unsigned int)c;
+		results.tested |= bit;
+		if (!ok)
+		{
+			results.failed |= bit;
+		}
+	}
+
+	static void RecordNotReady(Results& results, Check c)
+	{
+		const uint16_t bit = 1u << (unsigned int)c;
+		results.tested |= bit;
+		results.notReady |= bit;
+	}
+}
+
+void SelfTest::Run(Results& results)
+{
+	results.tested = results.failed = results.notReady = 0;
+	results.mcuTemperature = results.vin = results.v12 = 0.0;
+	results.vssa = results.vref = 0;
+	results.overTemperatureDrivers = results.shortedDrivers = 0;
+	results.failedSensors = 0;
+
+#if HAS_CPU_TEMP_SENSOR
+	{
+		float minMcuTemperature, maxMcuTemperature;
+		Platform::GetMcuTemperatures(minMcuTemperature, results.mcuTemperature, maxMcuTemperature);
+		Record(results, Check::mcuTemperature, results.mcuTemperature >= MinTemp && results.mcuTemperature <= MaxTemp);
+	}
+#endif
+
+#if HAS_VOLTAGE_MONITOR
+	results.vin = Platform::GetCurrentVinVoltage();
+	Record(results, Check::vin, results.vin >= MinVin && results.vin <= MaxVin);
+#endif
+
+#if HAS_12V_MONITOR
+	results.v12 = Platform::GetCurrentV12Voltage();
+	Record(results, Check::v12, results.v12 >= MinV12 && results.v12 <= MaxV12);
+#endif
+
+#if HAS_VREF_MONITOR
+	// VSSA should read near the bottom of the range and VREF near the top
+	{
+		AdcCalibration::References refs;
+		if (AdcCalibration::GetReferences(0, refs))
+		{
+			constexpr int32_t FullScale = 1 << (AnalogIn::AdcBits + AdcCalibration::OversampleBits);
+			results.vssa = refs.vssa;
+			results.vref = refs.vref;
+			Record(results, Check::adcReferences, refs.vssa < FullScale/16 && refs.vref > FullScale - FullScale/16);
+		}
+		else
+		{
+			RecordNotReady(results, Check::adcReferences);
+		}
+	}
+#endif
+
+#if HAS_SMART_DRIVERS
+	// The driver task reads the driver status over SPI or UART in the background. If the drivers are not ready, either they have no power or we can't talk to them.
+	if (SmartDrivers::AreDriversReady())
+	{
+		Record(results, Check::driversReady, true);
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			const uint32_t stat = SmartDrivers::GetAccumulatedStatus(driver, 0xFFFFFFFF);
+			if ((stat & (TMC_RR_OT | TMC_RR_OTPW)) != 0)
+			{
+				results.overTemperatureDrivers |= 1u << driver;
+			}
+			if ((stat & TMC_RR_S2G) != 0)
+			{
+				results.shortedDrivers |= 1u << driver;
+			}
+		}
+		Record(results, Check::driverOverTemperature, results.overTemperatureDrivers == 0);
+		Record(results, Check::driverShortToGround, results.shortedDrivers == 0);
+	}
+	else
+	{
+# if HAS_VOLTAGE_MONITOR
+		// If VIN is good then the drivers should have initialised by now, unless we only just powered up
+		if (results.vin >= MinVin && millis() > DriverInitialisationMillis)
+		{
+			Record(results, Check::driversReady, false);
+		}
+		else
+# endif
+		{
+			RecordNotReady(results, Check::driversReady);
+		}
+		RecordNotReady(results, Check::driverOverTemperature);
+		RecordNotReady(results, Check::driverShortToGround);
+	}
+#endif
+
+	// Check that every configured temperature sensor gives a reading. The heater task polls them, so this reads the latest values.
+	for (unsigned int sn = 0; sn < MaxSensors; ++sn)
+	{
+		const auto sensor = Heat::FindSensorAtOrAbove(sn);
+		if (sensor.IsNull())
+		{
+			break;
+		}
+		sn = sensor->GetSensorNumber();
+		TemperatureError err;
+		(void)Heat::GetSensorTemperature(sn, err);
+		if (err != TemperatureError::success)
+		{
+			results.failedSensors |= (uint64_t)1u << sn;
+		}
+	}
+	Record(results, Check::sensors, results.failedSensors == 0);
+}
+
+// Run the test and send the results in binary, reusing the request buffer
+void SelfTest::SendResults(CanMessageBuffer *buf)
+{
+	const CanRequestId requestId = buf->msg.selfTestRequest.requestId;
+	Results results;
+	Run(results);
+
+	CanMessageSelfTestReply * const reply = buf->SetupResponseMessage<CanMessageSelfTestReply>(requestId, CanInterface::GetCanAddress(), buf->id.Src());
+	reply->resultCode = (uint8_t)((results.failed != 0) ? GCodeResult::error : (results.notReady != 0) ? GCodeResult::notFinished : GCodeResult::ok);
+	reply->tested = results.tested;
+	reply->failed = results.failed;
+	reply->notReady = results.notReady;
+	reply->mcuTemperature = results.mcuTemperature;
+	reply->vin = results.vin;
+	reply->v12 = results.v12;
+	reply->vssa = results.vssa;
+	reply->vref = results.vref;
+	reply->overTemperatureDrivers = results.overTemperatureDrivers;
+	reply->shortedDrivers = results.shortedDrivers;
+	reply->failedSensors = results.failedSensors;
+	buf->dataLength = sizeof(CanMessageSelfTestReply);
+	CanInterface::SendAndFree(buf);
+}
+
+// End
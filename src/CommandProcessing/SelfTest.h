@@ -0,0 +1,67 @@
+/*
+ * SelfTest.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Production self test. The ADC, the driver task and the heater task keep their readings up to date in the background, so all the checks
+ *  run together from the latest readings and the test takes no time of its own. A check whose readings are not available yet is flagged as
+ *  not ready instead of failed, so the tester can ask again a few milliseconds later rather than waiting a fixed time after power up.
+ *  The results go to the main board either in binary or as the text of M122 P1.
+ */
+
+#ifndef SRC_COMMANDPROCESSING_SELFTEST_H_
+#define SRC_COMMANDPROCESSING_SELFTEST_H_
+
+#include <RepRapFirmware.h>
+
+class CanMessageBuffer;
+
+namespace SelfTest
+{
+	// The limits of the readings that pass
+	constexpr float MinVin = 11.0;
+	constexpr float MaxVin = 32.0;
+	constexpr float MinV12 = 10.0;
+	constexpr float MaxV12 = 13.5;
+	constexpr float MinTemp = -20.0;
+	constexpr float MaxTemp = 55.0;
+
+	// The bit numbers of the checks in the result bitmaps
+	enum class Check : uint8_t
+	{
+		mcuTemperature = 0,
+		vin,
+		v12,
+		adcReferences,
+		driversReady,
+		driverOverTemperature,
+		driverShortToGround,
+		sensors,
+		numChecks
+	};
+
+	struct Results
+	{
+		uint16_t tested;										// the checks that this board has
+		uint16_t failed;										// the checks that failed
+		uint16_t notReady;										// the checks whose readings are not available yet
+		float mcuTemperature;
+		float vin;
+		float v12;
+		int32_t vssa;											// the ADC reference readings, including the oversampling bits
+		int32_t vref;
+		uint16_t overTemperatureDrivers;						// bitmaps of the drivers that failed the driver checks
+		uint16_t shortedDrivers;
+		uint64_t failedSensors;									// bitmap of the configured temperature sensors that report an error
+
+		bool Failed(Check c) const { return (failed & (1u << (unsigned int)c)) != 0; }
+		bool Tested(Check c) const { return (tested & (1u << (unsigned int)c)) != 0; }
+		bool NotReady(Check c) const { return (notReady & (1u << (unsigned int)c)) != 0; }
+	};
+
+	void Run(Results& results);
+	void SendResults(CanMessageBuffer *buf);					// run the test and send the results in binary, reusing the request buffer
+}
+
+#endif /* SRC_COMMANDPROCESSING_SELFTEST_H_ */
@@ -33,6 +33,62 @@ constexpr const char* BoardTypeName = "EXP3HC";
 #define SUPPORT_SLOW_DRIVERS	0
 #define SUPPORT_DELTA_MOVEMENT	1
 #define USE_EVEN_STEPS			0
+#define USE_STEP_TIME_TABLES	1		// 1 to precompute piecewise-linear step time tables for the acceleration and deceleration phases
+#define SUPPORT_STEP_BURSTS		0
+#define SUPPORT_STEP_PULSE_TIMER	0
+#define USE_STEP_QUEUES			1		// 1 to calculate step times in the Move task and queue them for the step ISR
+#define USE_FPU_STEP_TIMING		1		// 1 to use the FPU to speed up step time calculations, 0 to use integer arithmetic only
+#define USE_RAM_STEP_PATH		1		// 1 to run the step ISR and the step time calculations from RAM, so that flash wait states don't make their timing vary
+#define STEP_CLOCK_SHIFT		0		// the step clock is 750kHz shifted left by this, 0 for 750kHz, 2 for 3MHz or 3 for 6MHz
+#define SUPPORT_STEP_PROFILING	0		// 1 to measure the CPU time spent in the step ISR, reported by M122 P3
+#define SUPPORT_ADC_PROFILING	1		// 1 to measure the ADC round time and AIN task callback times, reported by M122 P5
+#define SUPPORT_CRITICAL_SECTION_PROFILING	0	// 1 to time every critical section that disables interrupts and report the worst call sites, reported by M122 P12
+#define USE_DELTA_SEGMENTS		1		// 1 to approximate the delta tower equation by piecewise quadratics, to avoid a square root per step
+#define USE_SORTED_DM_ARRAY		1		// 1 to keep the active drives in a sorted array instead of a linked list, so that steps for several drives can be processed together
+#define SUPPORT_INPUT_SHAPING	1		// 1 to shape the acceleration and deceleration of Cartesian axes and extruders to reduce ringing
+#define SUPPORT_SMOOTHED_PRESSURE_ADVANCE	1	// 1 to support pressure advance with a smoothed extruder velocity and no reversals
+#define SUPPORT_CAN_BUS_HEALTH	1	// 1 to monitor the CAN error counters and error events, transmit queue level and receive latency of each message type
+#define SUPPORT_DYNAMIC_MICROSTEPPING	1	// 1 to reduce the microstepping of a drive automatically when it would otherwise step too fast
+#define SUPPORT_ENCODERS		1	// 1 to read encoders connected to the TMC5160 ENCA/ENCB inputs and report the motor position error
+#define SUPPORT_PHASE_STEPPING	1	// 1 to let TMC5160 drivers in direct mode take their coil currents from the move profile instead of step pulses, needs SUPPORT_ENCODERS
+#define SUPPORT_HEATER_MODEL_ESTIMATION	1	// 1 to refine the heater process models during normal operation and report when they drift
+#define SUPPORT_FILAMENT_MONITORS	1	// 1 to measure filament movement from pulse or duty cycle sensors and compare it with the local extruder steps
+#define SUPPORT_HARDWARE_FAST_STOP	1	// 1 to let an input monitor disable the drivers through the event system without waiting for software
+#define SUPPORT_TRACE_BUFFER	1	// 1 to record timing events in a RAM ring buffer, reported by M122 P6 and (on the SAME51) P7 after a reset
+#define SUPPORT_DEFERRED_DEBUG	1	// 1 to make deferredPrintf store the format string and arguments in a RAM ring buffer and format them later in the main task
+#define SUPPORT_REMOTE_CONSOLE	1	// 1 to let the main board ask us to stream our debug text and trace records to it over CAN
+#define SUPPORT_CAN_BUS_TEST	1	// 1 to answer CAN ping messages and send and count CAN flood frames, so that the main board can measure bus latency and throughput
+#define SUPPORT_HEATER_SIMULATION	1	// 1 to provide a simulated heater plant as a temperature sensor type, for testing heater control without real hardware
+#define SUPPORT_BABYSTEPPING	1	// 1 to add babystepping requested by the main board to the next moves we prepare, instead of waiting for the main board's queue to drain
+#define SUPPORT_MOVE_MERGING	1	// 1 to merge queued moves that continue in a straight line at the same speed into one DDA
+#define SUPPORT_COMPACT_MOVEMENT	1	// 1 to accept compact movement messages that carry several delta-encoded moves in one CAN-FD frame
+#define SUPPORT_CONTROLLED_STOP	1	// 1 to process controlled stop messages by discarding queued moves and decelerating to a stop after the current one
+#define SUPPORT_POSITION_REPORTS	1	// 1 to send the main board periodic reports of the motor positions and speeds when they change
+#define SUPPORT_LOCAL_KINEMATICS	1	// 1 to accept movement messages in machine coordinates and convert them to motor steps using our own kinematics
+#define SUPPORT_PROBE_SLOWDOWN		1	// 1 to slow down the current move when an analog Z probe input approaches its threshold
+#define SUPPORT_SPEED_OVERRIDE		1	// 1 to apply speed factor changes from the main board to the moves that we have queued
+#define SUPPORT_STRICT_MOVE_START	1	// 1 to keep a late move on its scheduled timeline if it can catch up, so that boards sharing a move stay in step
+#define SUPPORT_SCHEDULED_COMMANDS	1	// 1 to support executing fan, heater, GPIO and driver state commands at a master step clock time
+#define SUPPORT_ACCELEROMETERS		1	// 1 to support an LIS3DH accelerometer on the shared SPI bus for measuring resonances
+#define SUPPORT_LOAD_CELL_PROBE		0	// needs the SAMC21 SDADC
+#define SUPPORT_JUNCTION_REPLANNING	1	// 1 to raise the speed at junctions between queued moves that continue in a straight line, keeping the timing of each move, needs SUPPORT_MOVE_MERGING
+#define SUPPORT_REDUNDANT_HEATER_SENSORS	1	// 1 to let a heater use a secondary sensor, combining the readings and failing over to one sensor when the other one fails
+#define SUPPORT_READ_INPUTS		1	// 1 to reply to requests for the states of several input monitors and the readings of the analog ones in one message
+#define SUPPORT_CAN_ENUMERATION	1	// 1 to reply to CAN enumeration requests with our unique ID and accept an address assigned to that ID without a reset
+#define SUPPORT_BINARY_DIAGNOSTICS	1	// 1 to reply to requests for a binary diagnostics report with fixed fields that fits in one CAN-FD frame
+#define SUPPORT_EXTRUDER_MIXING	1	// 1 to split the extruder steps of the first mixing driver across several local drivers in a mix ratio set by the main board
+#define SUPPORT_DRIVER_TEMPERATURE_ESTIMATION	1	// 1 to estimate the driver temperatures from the motor currents and the live warning flags, so that driver cooling fans can start before the warning temperature
+#define SUPPORT_HEATER_PROFILES	1	// 1 to ramp heater setpoints and switch between standby and active temperatures or preheat by a given time when the main board asks
+#define SUPPORT_LEADSCREW_CORRECTION	1	// 1 to blend Z leadscrew levelling corrections sent by the main board into our Z moves instead of needing separate correction moves
+#define SUPPORT_PWM_SEQUENCES	1	// 1 to run fan blips and PWM ramps from a table of compare values that DMA copies into the TCC on each PWM period
+#define SUPPORT_ANALOG_STREAMING	1	// 1 to stream the readings of an analog input to the main board in timestamped blocks when it asks
+#define SUPPORT_SHORT_CAN_BUFFERS	1	// 1 to queue small commands in short buffers so that they don't tie up the full-size CAN buffers
+#define SUPPORT_STEP_ERROR_CORRECTION	1	// 1 to add the steps that a drive missed because of a step error to its next moves, so that the error doesn't leave the position wrong
+#define SUPPORT_SERVO_OUTPUTS	1	// 1 to keep servo pulse widths right whatever timer drives them, and to queue several timed GPIO batches
+#define SUPPORT_MOVE_REPLAY		1	// 1 to record the movement messages we receive in flash memory and replay them with the drivers disabled to benchmark the firmware
+#define SUPPORT_STACK_PROFILING	0	// 1 to make the task stacks half as big again and report how much of them each task used, reported by M122 P8
+#define SUPPORT_WARM_RESTART	1	// 1 to keep the configuration commands in backup RAM and restore them after a fault or watchdog reset
+#define USE_STAGGERED_PWM		1	// 1 to stagger the PWM edges of heaters and fans so that they don't all switch on at the same time
 #define SUPPORT_DHT_SENSOR		0	//TEMP!!!
 #define SUPPORT_SPI_SENSORS		1
 
@@ -43,6 +99,11 @@ constexpr size_t NumDrivers = 3;
 constexpr size_t MaxSmartDrivers = 3;
 constexpr float MaxTmc5160Current = 6300.0;			// The maximum current we allow the TMC5160/5161 drivers to be set to
 
+// The DDA ring is sized at startup from the free RAM, within these limits
+constexpr unsigned int MinDdaRingLength = 20;
+constexpr unsigned int MaxDdaRingLength = 40;
+constexpr uint32_t RamReservedAfterDdaRing = 32 * 1024;		// RAM to leave free for the handler stack and for objects created when the main board configures us
+
 constexpr size_t NumThermistorInputs = 3;
 constexpr size_t NumAddressBits = 4;
 constexpr size_t NumBoardTypeBits = 3;
@@ -53,6 +114,11 @@ constexpr float MinVrefLoadR = (DefaultThermistorSeriesR / NumThermistorInputs)
 constexpr Pin GlobalTmc51xxEnablePin = PortBPin(23);
 constexpr Pin GlobalTmc51xxCSPin = PortBPin(22);
 
+// Hardware fast stop. The EIC event from the input is routed through this event channel to a PORT event input that sets the drivers enable pin to its disabled level.
+constexpr Pin FastStopEnablePin = GlobalTmc51xxEnablePin;
+constexpr uint8_t FastStopEventChannel = 2;
+constexpr uint8_t FastStopPortEventInput = 2;				// PORT event inputs 0 and 1 are used by the step burst generator on boards that have one
+
 #define TMC51xx_USES_SERCOM	1
 Sercom * const SERCOM_TMC51xx = SERCOM0;
 constexpr uint8_t SERCOM_TMC51xx_NUMBER = 0;
@@ -231,13 +297,18 @@ constexpr DmaChannel Adc0TxDmaChannel = 2;
 // Next channel is used by ADC0 for receive
 constexpr DmaChannel Adc1TxDmaChannel = 4;
 // Next channel is used by ADC1 for receive
+constexpr DmaChannel FirstDynamicDmaChannel = 6;			// channels from here up to NumDmaChannelsUsed are allocated at run time by DmacManager::AllocateChannel
 
-constexpr unsigned int NumDmaChannelsUsed = 6;			// must be at least the number of channels used, may be larger. Max 32 on the SAME51.
+constexpr unsigned int NumDmaChannelsUsed = 10;			// must be at least the number of channels used, may be larger. Max 32 on the SAME51.
 
 constexpr uint8_t TmcTxDmaPriority = 0;
 constexpr uint8_t TmcRxDmaPriority = 3;
 constexpr uint8_t AdcTxDmaPriority = 0;
 constexpr uint8_t AdcRxDmaPriority = 2;
+constexpr uint8_t SspiTxDmaPriority = 0;
+constexpr uint8_t SspiRxDmaPriority = 1;
+constexpr uint8_t UartTxDmaPriority = 0;
+constexpr uint8_t PwmSequenceDmaPriority = 0;
 
 // Interrupt priorities, lower means higher priority. 0-2 can't make RTOS calls.
 const uint32_t NvicPriorityStep = 2;					// step interrupt is next highest, it can preempt most other interrupts
@@ -193,12 +193,14 @@ constexpr DmaChannel TmcTxDmaChannel = 0;
 constexpr DmaChannel TmcRxDmaChannel = 1;
 constexpr DmaChannel Adc0RxDmaChannel = 2;
 constexpr DmaChannel SdAdcRxDmaChannel = 3;
+constexpr DmaChannel FirstDynamicDmaChannel = 4;			// channels from here up to NumDmaChannelsUsed are allocated at run time by DmacManager::AllocateChannel
 
-constexpr unsigned int NumDmaChannelsUsed = 4;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
+constexpr unsigned int NumDmaChannelsUsed = 5;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
 
 constexpr uint8_t TmcTxDmaPriority = 0;
 constexpr uint8_t TmcRxDmaPriority = 3;
 constexpr uint8_t AdcRxDmaPriority = 2;
+constexpr uint8_t UartTxDmaPriority = 0;
 
 // Interrupt priorities, lower means higher priority. 0 can't make RTOS calls.
 const uint32_t NvicPriorityStep = 1;					// step interrupt is next highest, it can preempt most other interrupts
@@ -35,6 +35,11 @@ constexpr const char* BoardTypeName = "TOOL1LC";
 constexpr size_t NumDrivers = 1;
 constexpr size_t MaxSmartDrivers = 1;
 
+// The DDA ring is sized at startup from the free RAM, within these limits
+constexpr unsigned int MinDdaRingLength = 20;
+constexpr unsigned int MaxDdaRingLength = 24;
+constexpr uint32_t RamReservedAfterDdaRing = 8 * 1024;		// RAM to leave free for the handler stack and for objects created when the main board configures us
+
 #define TMC22xx_USES_SERCOM				1
 #define TMC22xx_HAS_MUX					0
 #define TMC22xx_SINGLE_DRIVER			1
@@ -43,6 +48,11 @@ constexpr size_t MaxSmartDrivers = 1;
 
 constexpr Pin GlobalTmc22xxEnablePin = PortBPin(2);
 
+// Hardware fast stop. The EIC event from the input is routed through this event channel to a PORT event input that sets the drivers enable pin to its disabled level.
+constexpr Pin FastStopEnablePin = GlobalTmc22xxEnablePin;
+constexpr uint8_t FastStopEventChannel = 2;
+constexpr uint8_t FastStopPortEventInput = 2;				// PORT event inputs 0 and 1 are used by the step burst generator on boards that have one
+
 constexpr uint8_t TMC22xxSercomNumber = 3;
 Sercom * const SERCOM_TMC22xx = SERCOM3;
 
@@ -70,6 +80,60 @@ constexpr Pin DriverDiagPins[NumDrivers] = { PortBPin(3) };
 #define SUPPORT_SLOW_DRIVERS	0
 #define SUPPORT_DELTA_MOVEMENT	0
 #define USE_EVEN_STEPS			0
+#define USE_STEP_TIME_TABLES	0		// 1 to precompute piecewise-linear step time tables for the acceleration and deceleration phases
+#define SUPPORT_STEP_BURSTS		1		// 1 to generate bursts of step pulses in hardware using a TC, the event system and DMA
+#define SUPPORT_STEP_PULSE_TIMER	0		// 1 to end the step pulses of slow external drivers in hardware using a TC and the event system
+#define USE_STEP_QUEUES			0
+#define USE_FPU_STEP_TIMING		0		// 1 to use the FPU to speed up step time calculations, 0 to use integer arithmetic only
+#define USE_RAM_STEP_PATH		1		// 1 to run the step ISR and the step time calculations from RAM, so that flash wait states don't make their timing vary
+#define SUPPORT_STEP_PROFILING	0		// 1 to measure the CPU time spent in the step ISR, reported by M122 P3
+#define SUPPORT_ADC_PROFILING	1		// 1 to measure the ADC round time and AIN task callback times, reported by M122 P5
+#define SUPPORT_CRITICAL_SECTION_PROFILING	0	// 1 to time every critical section that disables interrupts and report the worst call sites, reported by M122 P12
+#define USE_DELTA_SEGMENTS		0
+#define USE_SORTED_DM_ARRAY		0
+#define SUPPORT_INPUT_SHAPING	0
+#define SUPPORT_SMOOTHED_PRESSURE_ADVANCE	1	// 1 to support pressure advance with a smoothed extruder velocity and no reversals
+#define SUPPORT_CAN_BUS_HEALTH	1	// 1 to monitor the CAN error counters and error events, transmit queue level and receive latency of each message type
+#define SUPPORT_DYNAMIC_MICROSTEPPING	1	// 1 to reduce the microstepping of a drive automatically when it would otherwise step too fast
+#define SUPPORT_ENCODERS		0	// needs TMC51xx drivers
+#define SUPPORT_PHASE_STEPPING	0	// needs TMC51xx drivers
+#define SUPPORT_HEATER_MODEL_ESTIMATION	1	// 1 to refine the heater process models during normal operation and report when they drift
+#define SUPPORT_FILAMENT_MONITORS	1	// 1 to measure filament movement from pulse or duty cycle sensors and compare it with the local extruder steps
+#define SUPPORT_HARDWARE_FAST_STOP	1	// 1 to let an input monitor disable the drivers through the event system without waiting for software
+#define SUPPORT_TRACE_BUFFER	1	// 1 to record timing events in a RAM ring buffer, reported by M122 P6 and (on the SAME51) P7 after a reset
+#define SUPPORT_DEFERRED_DEBUG	1	// 1 to make deferredPrintf store the format string and arguments in a RAM ring buffer and format them later in the main task
+#define SUPPORT_REMOTE_CONSOLE	1	// 1 to let the main board ask us to stream our debug text and trace records to it over CAN
+#define SUPPORT_CAN_BUS_TEST	1	// 1 to answer CAN ping messages and send and count CAN flood frames, so that the main board can measure bus latency and throughput
+#define SUPPORT_HEATER_SIMULATION	1	// 1 to provide a simulated heater plant as a temperature sensor type, for testing heater control without real hardware
+#define SUPPORT_BABYSTEPPING	1	// 1 to add babystepping requested by the main board to the next moves we prepare, instead of waiting for the main board's queue to drain
+#define SUPPORT_MOVE_MERGING	1	// 1 to merge queued moves that continue in a straight line at the same speed into one DDA
+#define SUPPORT_COMPACT_MOVEMENT	1	// 1 to accept compact movement messages that carry several delta-encoded moves in one CAN-FD frame
+#define SUPPORT_CONTROLLED_STOP	1	// 1 to process controlled stop messages by discarding queued moves and decelerating to a stop after the current one
+#define SUPPORT_POSITION_REPORTS	1	// 1 to send the main board periodic reports of the motor positions and speeds when they change
+#define SUPPORT_LOCAL_KINEMATICS	1	// 1 to accept movement messages in machine coordinates and convert them to motor steps using our own kinematics
+#define SUPPORT_PROBE_SLOWDOWN		1	// 1 to slow down the current move when an analog Z probe input approaches its threshold
+#define SUPPORT_SPEED_OVERRIDE		1	// 1 to apply speed factor changes from the main board to the moves that we have queued
+#define SUPPORT_STRICT_MOVE_START	1	// 1 to keep a late move on its scheduled timeline if it can catch up, so that boards sharing a move stay in step
+#define SUPPORT_SCHEDULED_COMMANDS	1	// 1 to support executing fan, heater, GPIO and driver state commands at a master step clock time
+#define SUPPORT_ACCELEROMETERS		0	// needs a shared SPI bus
+#define SUPPORT_LOAD_CELL_PROBE		1	// 1 to support a load cell amplifier on temp0, read by the SDADC, as a nozzle contact probe
+#define SUPPORT_JUNCTION_REPLANNING	1	// 1 to raise the speed at junctions between queued moves that continue in a straight line, keeping the timing of each move, needs SUPPORT_MOVE_MERGING
+#define SUPPORT_REDUNDANT_HEATER_SENSORS	1	// 1 to let a heater use a secondary sensor, combining the readings and failing over to one sensor when the other one fails
+#define SUPPORT_READ_INPUTS		1	// 1 to reply to requests for the states of several input monitors and the readings of the analog ones in one message
+#define SUPPORT_CAN_ENUMERATION	1	// 1 to reply to CAN enumeration requests with our unique ID and accept an address assigned to that ID without a reset
+#define SUPPORT_BINARY_DIAGNOSTICS	1	// 1 to reply to requests for a binary diagnostics report with fixed fields that fits in one CAN-FD frame
+#define SUPPORT_EXTRUDER_MIXING	0	// only one driver
+#define SUPPORT_DRIVER_TEMPERATURE_ESTIMATION	1	// 1 to estimate the driver temperatures from the motor currents and the live warning flags, so that driver cooling fans can start before the warning temperature
+#define SUPPORT_HEATER_PROFILES	1	// 1 to ramp heater setpoints and switch between standby and active temperatures or preheat by a given time when the main board asks
+#define SUPPORT_LEADSCREW_CORRECTION	0	// tool boards don't drive Z leadscrews
+#define SUPPORT_PWM_SEQUENCES	1	// 1 to run fan blips and PWM ramps from a table of compare values that DMA copies into the TCC on each PWM period
+#define SUPPORT_ANALOG_STREAMING	1	// 1 to stream the readings of an analog input to the main board in timestamped blocks when it asks
+#define SUPPORT_SHORT_CAN_BUFFERS	1	// 1 to queue small commands in short buffers so that they don't tie up the full-size CAN buffers
+#define SUPPORT_STEP_ERROR_CORRECTION	1	// 1 to add the steps that a drive missed because of a step error to its next moves, so that the error doesn't leave the position wrong
+#define SUPPORT_SERVO_OUTPUTS	1	// 1 to keep servo pulse widths right whatever timer drives them, and to queue several timed GPIO batches
+#define SUPPORT_STACK_PROFILING	0	// 1 to make the task stacks half as big again and report how much of them each task used, reported by M122 P8
+#define SUPPORT_WARM_RESTART	0	// the SAMC21 has no backup RAM to keep the configuration in through a reset
+#define USE_STAGGERED_PWM		1	// 1 to stagger the PWM edges of heaters and fans so that they don't all switch on at the same time
 #define SUPPORT_SPI_SENSORS		0
 #define SUPPORT_DHT_SENSOR		0
 
@@ -174,6 +238,12 @@ constexpr unsigned int StepTcClockId = TC2_GCLK_ID;
 constexpr unsigned int StepTcNumber = 2;
 #define STEP_TC_HANDLER		TC2_Handler
 
+// Timer/counter used to generate bursts of step pulses. Its overflow and compare events drive the step pin via the event system.
+TcCount16 * const StepBurstTc = &(TC0->COUNT16);
+constexpr unsigned int StepBurstTcNumber = 0;
+constexpr uint8_t StepBurstSetEventChannel = 0;			// event system channel used to set the step pin
+constexpr uint8_t StepBurstClearEventChannel = 1;		// event system channel used to clear the step pin
+
 // Diagnostic LED
 constexpr Pin DiagLedPin = PortAPin(0);
 constexpr Pin DiagLed1Pin = PortAPin(1);
@@ -186,12 +256,17 @@ constexpr DmaChannel TmcTxDmaChannel = 0;
 constexpr DmaChannel TmcRxDmaChannel = 1;
 constexpr DmaChannel Adc0RxDmaChannel = 2;
 constexpr DmaChannel SdAdcRxDmaChannel = 3;
+constexpr DmaChannel StepBurstDmaChannel = 4;
+constexpr DmaChannel FirstDynamicDmaChannel = 5;			// channels from here up to NumDmaChannelsUsed are allocated at run time by DmacManager::AllocateChannel
 
-constexpr unsigned int NumDmaChannelsUsed = 4;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
+constexpr unsigned int NumDmaChannelsUsed = 7;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
 
 constexpr uint8_t TmcTxDmaPriority = 0;
 constexpr uint8_t TmcRxDmaPriority = 3;
 constexpr uint8_t AdcRxDmaPriority = 2;
+constexpr uint8_t StepBurstDmaPriority = 3;
+constexpr uint8_t UartTxDmaPriority = 0;
+constexpr uint8_t PwmSequenceDmaPriority = 0;
 
 // Interrupt priorities, lower means higher priority. 0 can't make RTOS calls.
 const uint32_t NvicPriorityStep = 1;					// step interrupt is next highest, it can preempt most other interrupts
@@ -50,7 +50,10 @@ constexpr unsigned int AUX2_BAUD_RATE = 115200;			// Ditto - for second auxiliar
 constexpr uint32_t SERIAL_MAIN_TIMEOUT = 1000;			// timeout in ms for sending data to the main serial/USB port
 
 // Heater values
-constexpr uint32_t HeatSampleIntervalMillis = 250;		// interval between taking temperature samples
+constexpr uint32_t HeatSampleIntervalMillis = 250;		// interval between taking temperature samples and between sensor and heater status reports
+constexpr uint32_t MinHeatSampleIntervalMillis = 50;	// the heater task runs at this interval, so sensors that are quick to read and their heaters can be sampled this often
+constexpr uint32_t MaxHeatControlIntervalMillis = 2000;	// the longest interval between runs of a heater control loop that the user may configure
+static_assert(HeatSampleIntervalMillis % MinHeatSampleIntervalMillis == 0, "HeatSampleIntervalMillis must be a multiple of MinHeatSampleIntervalMillis");
 constexpr float HeatPwmAverageTime = 5.0;				// Seconds
 
 constexpr float TEMPERATURE_CLOSE_ENOUGH = 1.0;			// Celsius
@@ -65,7 +68,9 @@ constexpr float DefaultBedTemperatureLimit = 125.0;		// Celsius
 constexpr float DefaultAllowedOverTemperature = 5.0;
 constexpr float DefaultHotEndFanTemperature = 45.0;		// Temperature at which a thermostatic hot end fan comes on
 constexpr float ThermostatHysteresis = 1.0;				// How much hysteresis we use to prevent noise turning fans on/off too often
+constexpr float DefaultFanProportionalGain = 0.1;		// PWM per degree C above the target for closed loop fans, so full speed at 10C above it
 constexpr float BadErrorTemperature = 2000.0;			// Must exceed any reasonable 5temperature limit including DEFAULT_TEMPERATURE_LIMIT
+constexpr float DefaultMaxSensorDisagreement = 10.0;	// Celsius - how far the two sensors of a heater may disagree before we treat the readings as bad
 constexpr uint32_t DefaultHeaterFaultTimeout = 10 * 60 * 1000;	// How long we wait (in milliseconds) for user intervention after a heater fault before shutting down
 
 // Default thermistor parameters
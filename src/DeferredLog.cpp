@@ -0,0 +1,163 @@
+/*
+ * DeferredLog.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "DeferredLog.h"
+
+#if SUPPORT_DEFERRED_DEBUG
+
+#include "Platform.h"
+
+namespace DeferredLog
+{
+	struct LogRecord
+	{
+		const char *format;
+		uint32_t numWords;
+		uint32_t words[MaxArgWords];
+	};
+
+#if defined(SAME51)
+	constexpr size_t NumRecords = 32;		// must be a power of 2
+#else
+	constexpr size_t NumRecords = 8;		// must be a power of 2
+#endif
+	static_assert((NumRecords & (NumRecords - 1)) == 0, "NumRecords must be a power of 2");
+
+	constexpr size_t MaxSpecLength = 16;	// the longest conversion specification we handle, e.g. "%-08.3llx"
+
+	static LogRecord records[NumRecords];
+	static uint32_t writeIndex = 0;			// these run freely and are masked to address the records
+	static uint32_t readIndex = 0;
+	static uint32_t numRecorded = 0, numLost = 0;
+
+	// Format a record. We don't have a va_list for the arguments, so we pass them to catf one conversion specification at a time.
+	static void Format(const StringRef& reply, const LogRecord& r)
+	{
+		const char *p = r.format;
+		size_t wordIndex = 0;
+		while (*p != 0)
+		{
+			if (*p != '%' || p[1] == '%')
+			{
+				reply.cat(*p);
+				p += (*p == '%') ? 2 : 1;
+				continue;
+			}
+
+			// Copy the conversion specification up to and including the conversion character, noting the number of 'l' and 'j' length modifiers
+			char spec[MaxSpecLength + 1];
+			size_t specLength = 0;
+			unsigned int numLongs = 0;
+			char conversion = 0;
+			while (*p != 0 && specLength < MaxSpecLength)
+			{
+				const char c = *p++;
+				spec[specLength++] = c;
+				if (c == 'l')
+				{
+					++numLongs;
+				}
+				else if (c == 'j')
+				{
+					numLongs = 2;
+				}
+				else if (specLength > 1 && strchr("diouxXcsfFeEgGaAp", c) != nullptr)
+				{
+					conversion = c;
+					break;
+				}
+			}
+			spec[specLength] = 0;
+			if (conversion == 0 || wordIndex >= r.numWords)
+			{
+				reply.cat(spec);								// bad or unsupported conversion, or not enough arguments
+				continue;
+			}
+
+			const uint32_t word = r.words[wordIndex++];
+			if (strchr("fFeEgGaA", conversion) != nullptr)
+			{
+				float f;
+				memcpy(&f, &word, sizeof(f));
+				reply.catf(spec, (double)f);
+			}
+			else if (conversion == 's')
+			{
+				reply.catf(spec, reinterpret_cast<const char *>(word));
+			}
+			else if (conversion == 'p')
+			{
+				reply.catf(spec, reinterpret_cast<const void *>(word));
+			}
+			else if (numLongs >= 2 && wordIndex < r.numWords)
+			{
+				const uint64_t val = ((uint64_t)r.words[wordIndex++] << 32) | word;
+				reply.catf(spec, val);
+			}
+			else
+			{
+				reply.catf(spec, word);
+			}
+		}
+	}
+}
+
+void DeferredLog::Init()
+{
+	writeIndex = readIndex = 0;
+	numRecorded = numLost = 0;
+}
+
+// Store a record, discarding it if the buffer is full. May be called from any task or ISR.
+void DeferredLog::RecordWords(const char *fmt, const uint32_t *words, size_t numWords)
+{
+	AtomicCriticalSectionLocker lock;
+	if (writeIndex - readIndex >= NumRecords)
+	{
+		++numLost;
+		return;
+	}
+	LogRecord& r = records[writeIndex & (NumRecords - 1)];
+	r.format = fmt;
+	r.numWords = numWords;
+	memcpy(r.words, words, numWords * sizeof(uint32_t));
+	++writeIndex;
+	++numRecorded;
+}
+
+void DeferredLog::Spin()
+{
+	while (readIndex != writeIndex)
+	{
+		// Copy the record so that we can release its slot before we format it, which may take a while
+		const LogRecord r = records[readIndex & (NumRecords - 1)];
+		{
+			AtomicCriticalSectionLocker lock;
+			++readIndex;
+		}
+
+		String<FormatStringLength> message;
+		Format(message.GetRef(), r);
+		Platform::Message(DebugMessage, message.c_str());
+	}
+}
+
+void DeferredLog::Diagnostics(const StringRef& reply)
+{
+	uint32_t recorded, lost;
+	{
+		AtomicCriticalSectionLocker lock;
+		recorded = numRecorded;
+		lost = numLost;
+		numRecorded = numLost = 0;
+	}
+	reply.lcatf("Deferred debug messages %" PRIu32 ", lost %" PRIu32, recorded, lost);
+}
+
+#endif
+
+// End
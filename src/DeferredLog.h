@@ -0,0 +1,117 @@
+/*
+ * DeferredLog.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Deferred debug messages. deferredPrintf stores a pointer to the format string and the raw argument values in a RAM ring buffer,
+ *  which takes a few cycles, and the main task formats and sends them later. Use it in place of debugPrintf in time-critical code.
+ *  The format string must be a string literal. The arguments are checked against it at compile time in the same way as for debugPrintf.
+ *  Floating point arguments are stored as float, 64-bit integers take two of the argument words, and %s arguments must point to strings
+ *  that will still exist when the message is formatted, such as string literals. The '*' width and precision specifiers are not supported.
+ */
+
+#ifndef SRC_DEFERREDLOG_H_
+#define SRC_DEFERREDLOG_H_
+
+#include "RepRapFirmware.h"
+#include <type_traits>
+
+namespace DeferredLog
+{
+	constexpr size_t MaxArgWords = 8;
+
+#if SUPPORT_DEFERRED_DEBUG
+	void Init();
+	void Spin();												// format and send the pending messages, called from the main task
+	void RecordWords(const char *fmt, const uint32_t *words, size_t numWords);
+	void Diagnostics(const StringRef& reply);
+
+	// Never called, used to get the compiler to check the arguments against the format string
+	inline void CheckFormat(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+	inline void CheckFormat(const char *fmt, ...) { }
+
+	// The number of argument words needed to store the values of the argument types
+	template<class... Args> struct ArgWords;
+	template<> struct ArgWords<> { static constexpr size_t value = 0; };
+	template<class T, class... Rest> struct ArgWords<T, Rest...>
+	{
+		static constexpr size_t value = ((sizeof(T) == 8 && (std::is_integral<T>::value || std::is_enum<T>::value)) ? 2 : 1) + ArgWords<Rest...>::value;
+	};
+
+	// Store the argument values. These are declared first so that each overload can call the others.
+	inline void StoreArgs(uint32_t *p) { }
+	template<class... Rest> inline void StoreArgs(uint32_t *p, float f, Rest... rest);
+	template<class... Rest> inline void StoreArgs(uint32_t *p, double d, Rest... rest);
+	template<class... Rest> inline void StoreArgs(uint32_t *p, const char *s, Rest... rest);
+	template<class U, class... Rest> inline void StoreArgs(uint32_t *p, U *v, Rest... rest);
+	template<class T, class... Rest> inline void StoreArgs(uint32_t *p, T val, Rest... rest);
+
+	template<class... Rest> inline void StoreArgs(uint32_t *p, float f, Rest... rest)
+	{
+		memcpy(p, &f, sizeof(uint32_t));
+		StoreArgs(p + 1, rest...);
+	}
+
+	template<class... Rest> inline void StoreArgs(uint32_t *p, double d, Rest... rest)
+	{
+		StoreArgs(p, (float)d, rest...);
+	}
+
+	template<class... Rest> inline void StoreArgs(uint32_t *p, const char *s, Rest... rest)
+	{
+		*p = reinterpret_cast<uint32_t>(s);
+		StoreArgs(p + 1, rest...);
+	}
+
+	template<class U, class... Rest> inline void StoreArgs(uint32_t *p, U *v, Rest... rest)
+	{
+		*p = reinterpret_cast<uint32_t>(v);
+		StoreArgs(p + 1, rest...);
+	}
+
+	template<class T, class... Rest> inline void StoreArgs(uint32_t *p, T val, Rest... rest)
+	{
+		static_assert(std::is_integral<T>::value || std::is_enum<T>::value, "Unsupported deferredPrintf argument type");
+		static_assert(sizeof(T) <= 8, "Unsupported deferredPrintf argument size");
+		const uint64_t v = (uint64_t)val;
+		p[0] = (uint32_t)v;
+		if (sizeof(T) == 8)
+		{
+			p[1] = (uint32_t)(v >> 32);
+			StoreArgs(p + 2, rest...);
+		}
+		else
+		{
+			StoreArgs(p + 1, rest...);
+		}
+	}
+
+	template<class... Args> inline void Record(const char *fmt, Args... args)
+	{
+		constexpr size_t NumWords = ArgWords<Args...>::value;
+		static_assert(NumWords <= MaxArgWords, "Too many deferredPrintf arguments, split the message");
+		uint32_t words[(NumWords == 0) ? 1 : NumWords];
+		StoreArgs(words, args...);
+		RecordWords(fmt, words, NumWords);
+	}
+#else
+	inline void Init() { }
+	inline void Spin() { }
+	inline void Diagnostics(const StringRef& reply) { }
+#endif
+}
+
+#if SUPPORT_DEFERRED_DEBUG
+// The empty strings make the compiler reject a format string that isn't a literal
+# define deferredPrintf(_fmt, ...)															\
+	do																						\
+	{																						\
+		if (false) { DeferredLog::CheckFormat("" _fmt "", ##__VA_ARGS__); }					\
+		DeferredLog::Record("" _fmt "", ##__VA_ARGS__);										\
+	} while (false)
+#else
+# define deferredPrintf(_fmt, ...)	debugPrintf(_fmt, ##__VA_ARGS__)
+#endif
+
+#endif /* SRC_DEFERREDLOG_H_ */
@@ -8,6 +8,9 @@
 #include "Fan.h"
 
 #include "CanMessageFormats.h"
+#include "CanMessageGenericParser.h"
+
+ObjectPool Fan::pool("fans");
 
 Fan::Fan(unsigned int fanNum)
 	: fanNumber(fanNum),
@@ -15,14 +18,18 @@ Fan::Fan(unsigned int fanNum)
 	  minVal(DefaultMinFanPwm),
 	  maxVal(1.0),										// 100% maximum fan speed
 	  blipTime(DefaultFanBlipTime),
-	  isConfigured(false)
+	  controlTarget(0.0), rampRate(0.0), integralTerm(0.0), lastControlTemperature(0.0), whenLastControlled(0), haveLastControlTemperature(false),
+	  isConfigured(false), configDigest(0)
 {
 	triggerTemperatures[0] = triggerTemperatures[1] = DefaultHotEndFanTemperature;
+	controlGains[0] = DefaultFanProportionalGain;
+	controlGains[1] = controlGains[2] = 0.0;
 }
 
 // Set the parameters for this fan
 GCodeResult Fan::Configure(const CanMessageFanParameters& msg, const StringRef& reply)
 {
+	configDigest = 0;
 	triggerTemperatures[0] = msg.triggerTemperatures[0];
 	triggerTemperatures[1] = msg.triggerTemperatures[1];
 	blipTime = msg.blipTime;
@@ -35,6 +42,86 @@ GCodeResult Fan::Configure(const CanMessageFanParameters& msg, const StringRef&
 	return GCodeResult::ok;
 }
 
+// Process the closed loop control parameters of a M950 command for an existing fan. T is the target temperature (0 to use the trigger temperatures),
+// K is the proportional, integral and derivative gains and R is the maximum rate of change of PWM per second (0 for no limit).
+GCodeResult Fan::ConfigureControl(const CanMessageGenericParser& parser, const StringRef& reply, bool& seen)
+{
+	float newTarget;
+	if (parser.GetFloatParam('T', newTarget))
+	{
+		if (newTarget < 0.0)
+		{
+			reply.copy("Fan target temperature must not be negative");
+			return GCodeResult::error;
+		}
+		seen = true;
+		controlTarget = newTarget;
+		integralTerm = 0.0;
+		haveLastControlTemperature = false;
+	}
+
+	size_t numGains;
+	const float *newGains;
+	if (parser.GetFloatArrayParam('K', numGains, newGains))
+	{
+		if (numGains > ARRAY_SIZE(controlGains))
+		{
+			reply.copy("Too many fan control gains");
+			return GCodeResult::error;
+		}
+		for (size_t i = 0; i < numGains; ++i)
+		{
+			if (newGains[i] < 0.0)
+			{
+				reply.copy("Fan control gains must not be negative");
+				return GCodeResult::error;
+			}
+		}
+		seen = true;
+		for (size_t i = 0; i < ARRAY_SIZE(controlGains); ++i)
+		{
+			controlGains[i] = (i < numGains) ? newGains[i] : 0.0;
+		}
+		integralTerm = 0.0;
+	}
+
+	float newRampRate;
+	if (parser.GetFloatParam('R', newRampRate))
+	{
+		if (newRampRate < 0.0)
+		{
+			reply.copy("Fan PWM ramp rate must not be negative");
+			return GCodeResult::error;
+		}
+		seen = true;
+		rampRate = newRampRate;
+	}
+	return GCodeResult::ok;
+}
+
+void Fan::AppendControlDetails(const StringRef& reply) const
+{
+	if (controlTarget > 0.0)
+	{
+		reply.catf(", closed loop target %.1fC gains %.3f %.4f %.3f", (double)controlTarget, (double)controlGains[0], (double)controlGains[1], (double)controlGains[2]);
+	}
+	if (rampRate > 0.0)
+	{
+		reply.catf(", PWM ramp rate %.2f/sec", (double)rampRate);
+	}
+}
+
+// Return true if the fan speed should be re-evaluated from its sensors. Other fans are evaluated on the periodic check, but closed loop fans are evaluated whenever
+// one of their sensors has a new reading. They are also evaluated on the periodic check if they haven't been recently, in case their sensors have stopped updating.
+bool Fan::ShouldCheckSensors(bool periodicCheck, uint64_t updatedSensors) const
+{
+	if (!IsClosedLoop())
+	{
+		return periodicCheck;
+	}
+	return (sensorsMonitored.GetRaw() & updatedSensors) != 0 || (periodicCheck && millis() - whenLastControlled >= FanCheckInterval);
+}
+
 // Set the PWM. 'speed' is in the interval 0.0..1.0.
 void Fan::SetPwm(float speed)
 {
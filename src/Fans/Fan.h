@@ -11,9 +11,11 @@
 #include "RepRapFirmware.h"
 #include "Hardware/IoPorts.h"
 #include "GCodes/GCodeResult.h"
+#include "ObjectPool.h"
 
 class GCodeBuffer;
 class CanMessageFanParameters;
+class CanMessageGenericParser;
 
 class Fan
 {
@@ -25,9 +27,19 @@ public:
 	virtual bool IsEnabled() const = 0;
 	virtual int32_t GetRPM() = 0;
 	virtual void ReportPortDetails(const StringRef& str) const = 0;
+	virtual bool CheckSpeed() = 0;							// check for a stalled or slow fan, returning true if that status has changed
 	virtual ~Fan() { }
 
+	// Fans are allocated from a pool so that reconfiguring them doesn't fragment the heap
+	void* operator new(size_t sz) { return pool.Allocate(sz); }
+	void operator delete(void* p, size_t sz) { pool.Release(p, sz); }
+
+
 	unsigned int GetNumber() const { return fanNumber; }
+
+	// The digest of the command that created this fan, or 0 if the fan has been configured further since then
+	uint32_t GetConfigDigest() const { return configDigest; }
+	void SetConfigDigest(uint32_t digest) { configDigest = digest; }
 	float GetLastVal() const noexcept { return lastVal; }
 
 	// Set or report the parameters for this fan
@@ -43,6 +55,13 @@ public:
 	void SetPwm(float speed);
 	bool HasMonitoredSensors() const { return !sensorsMonitored.IsEmpty(); }
 
+	// Closed loop control of a thermostatic fan. Instead of setting the speed from the trigger temperatures, a PID loop holds the hottest monitored sensor at the target temperature.
+	// Closed loop fans are updated when their sensors have new readings, not just at the fan check interval.
+	GCodeResult ConfigureControl(const CanMessageGenericParser& parser, const StringRef& reply, bool& seen);
+	void AppendControlDetails(const StringRef& reply) const;
+	bool IsClosedLoop() const { return controlTarget > 0.0 && HasMonitoredSensors(); }
+	bool ShouldCheckSensors(bool periodicCheck, uint64_t updatedSensors) const;
+
 protected:
 	virtual void Refresh(bool checkSensors) = 0;
 	virtual bool UpdateFanConfiguration(const StringRef& reply) = 0;
@@ -58,7 +77,20 @@ protected:
 	uint32_t blipTime;										// in milliseconds
 	SensorsBitmap sensorsMonitored;
 
+	// Variables used for closed loop control and ramping
+	float controlTarget;									// the temperature that closed loop control aims for, or 0 to use the trigger temperatures
+	float controlGains[3];									// proportional gain in PWM/C, integral gain in PWM/(C*sec), derivative gain in PWM/(C/sec)
+	float rampRate;											// the maximum rate of change of PWM per second, or 0 for no limit
+	float integralTerm;
+	float lastControlTemperature;
+	uint32_t whenLastControlled;							// in milliseconds
+	bool haveLastControlTemperature;
+
 	bool isConfigured;
+	uint32_t configDigest;									// the digest of the command that created this fan, or 0 if it has been configured further since
+
+private:
+	static ObjectPool pool;
 };
 
 #endif /* SRC_FAN_H_ */
@@ -16,6 +16,8 @@
 
 static ReadWriteLock fansLock;
 static Fan *fans[MaxFans] = { 0 };
+static volatile uint64_t updatedSensors = 0;				// bitmap of sensors that have new readings since we last checked the fans
+static volatile bool speedFaultChanged = false;				// set when a fan starts or stops being stalled or too slow, so that the heater task reports the fans at once
 
 // Retrieve the pointer to a fan, or nullptr if it doesn't exist.
 // Lock the fan system before calling this, so that the fan can't be deleted while we are accessing it.
@@ -41,20 +43,41 @@ static LocalFan *CreateLocalFan(uint32_t fanNum, const char *pinNames, PwmFreque
 // Check and if necessary update all fans. Return true if a thermostatic fan is running.
 bool FansManager::CheckFans(bool checkSensors)
 {
+	uint64_t sensorsJustUpdated;
+	{
+		AtomicCriticalSectionLocker lock;
+		sensorsJustUpdated = updatedSensors;
+		updatedSensors = 0;
+	}
+
 	ReadLocker lock(fansLock);
 	bool thermostaticFanRunning = false;
 	for (Fan* fan : fans)
 	{
-		if (fan != nullptr && fan->Check(checkSensors))
+		if (fan != nullptr)
 		{
-			thermostaticFanRunning = true;
+			if (fan->Check(fan->ShouldCheckSensors(checkSensors, sensorsJustUpdated)))
+			{
+				thermostaticFanRunning = true;
+			}
+			if (fan->CheckSpeed())
+			{
+				speedFaultChanged = true;
+			}
 		}
 	}
 	return thermostaticFanRunning;
 }
 
+// Record that some sensors have new readings. This is called by the heater task and the CAN receiver task, so it must be quick.
+void FansManager::SensorsUpdated(uint64_t whichSensors)
+{
+	AtomicCriticalSectionLocker lock;
+	updatedSensors |= whichSensors;
+}
+
 // This is called by M950 to create a fan or change its PWM frequency or report its port
-GCodeResult FansManager::ConfigureFanPort(const CanMessageGeneric& msg, const StringRef& reply)
+GCodeResult FansManager::ConfigureFanPort(const CanMessageGeneric& msg, uint32_t configDigest, const StringRef& reply)
 {
 	CanMessageGenericParser parser(msg, M950FanParams);
 	uint16_t fanNum;
@@ -78,12 +101,28 @@ GCodeResult FansManager::ConfigureFanPort(const CanMessageGeneric& msg, const St
 	{
 		WriteLocker lock(fansLock);
 
+		// If the main board sent the command that created this fan again, there is nothing to do
+		if (fans[fanNum] != nullptr && fans[fanNum]->GetConfigDigest() == configDigest)
+		{
+			return GCodeResult::ok;
+		}
+
 		Fan *oldFan = nullptr;
 		std::swap(oldFan, fans[fanNum]);
 		delete oldFan;
 
 		fans[fanNum] = CreateLocalFan(fanNum, pinNames.c_str(), freq, reply);
-		return (fans[fanNum] == nullptr) ? GCodeResult::error : GCodeResult::ok;
+		if (fans[fanNum] == nullptr)
+		{
+			return GCodeResult::error;
+		}
+		bool dummySeen;
+		const GCodeResult rslt = fans[fanNum]->ConfigureControl(parser, reply, dummySeen);
+		if (rslt == GCodeResult::ok)
+		{
+			fans[fanNum]->SetConfigDigest(configDigest);
+		}
+		return rslt;
 	}
 
 	const auto fan = FindFan(fanNum);
@@ -93,13 +132,25 @@ GCodeResult FansManager::ConfigureFanPort(const CanMessageGeneric& msg, const St
 		return GCodeResult::error;
 	}
 
+	bool seenControl = false;
+	const GCodeResult rslt = fan->ConfigureControl(parser, reply, seenControl);
+	if (seenFreq || seenControl)
+	{
+		fan->SetConfigDigest(0);
+	}
+	if (rslt != GCodeResult::ok)
+	{
+		return rslt;
+	}
+
 	if (seenFreq)
 	{
 		fan->SetPwmFrequency(freq);
 	}
-	else
+	else if (!seenControl)
 	{
 		fan->ReportPortDetails(reply);
+		fan->AppendControlDetails(reply);
 	}
 	return GCodeResult::ok;
 }
@@ -156,6 +207,16 @@ void FansManager::Init()
 	}
 }
 
+bool FansManager::TakeSpeedFaultChange()
+{
+	const bool ret = speedFaultChanged;
+	if (ret)
+	{
+		speedFaultChanged = false;
+	}
+	return ret;
+}
+
 // Construct a fan RPM report message. Returns the number of fans reported in it.
 unsigned int FansManager::PopulateFansReport(CanMessageFansReport& msg)
 {
@@ -22,10 +22,12 @@ namespace FansManager
 {
 	void Init();
 	bool CheckFans(bool checkSensors);
-	GCodeResult ConfigureFanPort(const CanMessageGeneric& msg, const StringRef& reply);
+	void SensorsUpdated(uint64_t whichSensors);				// called when sensors have new readings, so that closed loop fans can respond to them
+	GCodeResult ConfigureFanPort(const CanMessageGeneric& msg, uint32_t configDigest, const StringRef& reply);
 	GCodeResult ConfigureFan(const CanMessageFanParameters& gb, const StringRef& reply);
 	GCodeResult SetFanSpeed(const CanMessageSetFanSpeed& msg, const StringRef& reply);
 	unsigned int PopulateFansReport(CanMessageFansReport& msg);
+	bool TakeSpeedFaultChange();							// return true if a fan has stalled, slowed down or recovered since we last asked
 #if 0
 	void SetFanValue(uint32_t fanNum, float speed);
 #endif
@@ -12,16 +12,19 @@
 #include "Heating/Heat.h"
 #include "Heating/Sensors/TemperatureSensor.h"
 
-void FanInterrupt(CallbackParameter cb)
-{
-	static_cast<LocalFan *>(cb.vp)->Interrupt();
-}
-
 LocalFan::LocalFan(unsigned int fanNum)
 	: Fan(fanNum),
-	  fanInterruptCount(0), fanLastResetTime(0), fanInterval(0),
-	  blipping(false)
+	  tachoTimer(fanMaxInterruptCount),
+	  whenLastRefreshed(0), rampTarget(0.0), blipping(false),
+	  whenPwmChanged(0), settledPwm(0.0), speedFault(SpeedFault::none)
+#if SUPPORT_PWM_SEQUENCES
+	  , sequenceRunning(false)
+#endif
 {
+	for (uint16_t& rpm : learnedRpm)
+	{
+		rpm = 0;
+	}
 }
 
 LocalFan::~LocalFan()
@@ -39,6 +42,10 @@ void LocalFan::ReportPortDetails(const StringRef& str) const
 	{
 		str.cat(" tacho");
 		tachoPort.AppendDetails(str);
+		if (speedFault != SpeedFault::none)
+		{
+			str.cat((speedFault == SpeedFault::stalled) ? ", stalled" : ", running too slowly");
+		}
 	}
 }
 
@@ -64,7 +71,11 @@ void LocalFan::Refresh(bool checkSensors)
 	}
 	else if (!checkSensors)
 	{
-		reqVal = lastVal;
+		reqVal = rampTarget;
+	}
+	else if (IsClosedLoop())
+	{
+		reqVal = ClosedLoopPwm();
 	}
 	else
 	{
@@ -109,9 +120,23 @@ void LocalFan::Refresh(bool checkSensors)
 		);
 	}
 
+	rampTarget = reqVal;
+	const uint32_t now = millis();
 	if (reqVal > 0.0)
 	{
 		reqVal = max<float>(reqVal * maxVal, minVal);		// scale the requested PWM by the maximum, enforce the minimum
+#if SUPPORT_PWM_SEQUENCES
+		if (RefreshPwmSequence(reqVal, now))
+		{
+			return;
+		}
+#endif
+		if (rampRate > 0.0 && lastVal > 0.0)
+		{
+			// Limit the rate of change so that the fan speed changes smoothly. We only ramp between speeds, we start and stop the fan at once.
+			const float maxChange = rampRate * (float)(now - whenLastRefreshed) * MillisToSeconds;
+			reqVal = constrain<float>(reqVal, lastVal - maxChange, lastVal + maxChange);
+		}
 		if (lastVal == 0.0)
 		{
 			// We are turning this fan on
@@ -136,6 +161,9 @@ void LocalFan::Refresh(bool checkSensors)
 	else
 	{
 		blipping = false;
+#if SUPPORT_PWM_SEQUENCES
+		sequenceRunning = false;							// writing zero PWM stops the sequence
+#endif
 #if 0 //TODO HAS_SMART_DRIVERS
 		if (driverChannelsMonitored != 0 && lastVal != 0.0)
 		{
@@ -144,10 +172,134 @@ void LocalFan::Refresh(bool checkSensors)
 #endif
 	}
 
+	if (fabsf(reqVal - settledPwm) >= PwmChangeTolerance || (reqVal == 0.0) != (settledPwm == 0.0))
+	{
+		settledPwm = reqVal;
+		whenPwmChanged = now;
+	}
 	lastVal = reqVal;
+	whenLastRefreshed = now;
 	SetHardwarePwm((blipping) ? 1.0 : reqVal);
 }
 
+#if SUPPORT_PWM_SEQUENCES
+
+// Get the PWM that the hardware sequence has reached
+float LocalFan::GetSequencePwm(uint32_t now) const
+{
+	const uint32_t elapsed = now - sequenceStartTime;
+	return (elapsed < sequenceHoldTime) ? sequenceStartPwm
+			: (elapsed - sequenceHoldTime >= sequenceRampTime) ? sequenceEndPwm
+				: sequenceStartPwm + (sequenceEndPwm - sequenceStartPwm) * (float)(elapsed - sequenceHoldTime)/(float)sequenceRampTime;
+}
+
+// Blip or ramp the fan to the requested non-zero PWM using a sequence that the PWM hardware runs by itself, so that we don't need to write the
+// intermediate values. Return true if the hardware is handling it, false if the caller must set the PWM in the usual way.
+bool LocalFan::RefreshPwmSequence(float reqVal, uint32_t now)
+{
+	if (sequenceRunning)
+	{
+		if (now - sequenceStartTime >= sequenceHoldTime + sequenceRampTime)
+		{
+			sequenceRunning = false;
+			blipping = false;
+			whenPwmChanged = now;							// the speed only starts to settle when the sequence has finished
+		}
+		else if (reqVal == sequenceEndPwm)
+		{
+			whenLastRefreshed = now;
+			return true;
+		}
+	}
+
+	// If a sequence is still running then the requested PWM has changed, so start a new one from where it has got to
+	const float currentPwm = (sequenceRunning) ? GetSequencePwm(now) : lastVal;
+	float startPwm = currentPwm;
+	uint32_t holdTime = 0, rampTime = 0;
+	if (currentPwm == 0.0)
+	{
+		if (reqVal >= 1.0 || blipTime == 0)
+		{
+			return false;
+		}
+		startPwm = 1.0;										// starting the fan from standstill, so blip it
+		holdTime = blipTime;
+	}
+	else if (rampRate > 0.0 && reqVal != currentPwm)
+	{
+		rampTime = (uint32_t)lrintf(fabsf(reqVal - currentPwm) * SecondsToMillis/rampRate);
+	}
+
+	if ((holdTime == 0 && rampTime == 0) || !port.WriteSequence(startPwm, holdTime, reqVal, rampTime))
+	{
+		sequenceRunning = false;							// if a sequence was running, writing the new PWM in the usual way stops it
+		return false;
+	}
+
+	sequenceRunning = true;
+	sequenceStartPwm = startPwm;
+	sequenceEndPwm = reqVal;
+	sequenceStartTime = now;
+	sequenceHoldTime = holdTime;
+	sequenceRampTime = rampTime;
+	blipping = (holdTime != 0);
+	blipStartTime = now;
+	settledPwm = reqVal;
+	whenPwmChanged = now;
+	lastVal = reqVal;
+	whenLastRefreshed = now;
+	return true;
+}
+
+#endif
+
+// Do one step of the closed loop control and return the requested PWM before scaling. If any sensor has an error we run the fan at full speed.
+float LocalFan::ClosedLoopPwm()
+{
+	float temperature = BadLowTemperature;
+	bool sensorError = false;
+	sensorsMonitored.Iterate
+	([&temperature, &sensorError](unsigned int sensorNum, unsigned int) noexcept
+		{
+			const auto sensor = Heat::FindSensor(sensorNum);
+			if (sensor.IsNotNull())
+			{
+				float t;
+				if (sensor->GetLatestTemperature(t) != TemperatureError::success || t < BadLowTemperature)
+				{
+					sensorError = true;
+				}
+				else if (t > temperature)
+				{
+					temperature = t;
+				}
+			}
+		}
+	);
+
+	const uint32_t now = millis();
+	const float dt = (float)(now - whenLastControlled) * MillisToSeconds;
+	whenLastControlled = now;
+	if (sensorError)
+	{
+		integralTerm = 0.0;
+		haveLastControlTemperature = false;
+		return 1.0;
+	}
+
+	// Positive errors mean that the sensor is too hot, so we need more cooling
+	const float error = temperature - controlTarget;
+	float derivative = 0.0;
+	if (haveLastControlTemperature && dt > 0.0)
+	{
+		derivative = (temperature - lastControlTemperature)/dt;
+		integralTerm = constrain<float>(integralTerm + controlGains[1] * error * dt, 0.0, 1.0);		// limit the integral term to avoid windup
+	}
+	lastControlTemperature = temperature;
+	haveLastControlTemperature = true;
+	return constrain<float>(controlGains[0] * error + integralTerm + controlGains[2] * derivative, 0.0, 1.0);
+}
+
 bool LocalFan::UpdateFanConfiguration(const StringRef& reply)
 {
 	Refresh(true);
@@ -157,6 +309,13 @@ bool LocalFan::UpdateFanConfiguration(const StringRef& reply)
 // Update the fan if necessary. Return true if it is a thermostatic fan and is running.
 bool LocalFan::Check(bool checkSensors)
 {
+	// Start a new tacho measurement if it is time
+	if (tachoTimer.suspended && StepTimer::GetTimerTicks() - tachoTimer.whenCompleted >= TachoMeasurementInterval)
+	{
+		tachoTimer.suspended = false;
+		tachoPort.ResumeInterrupt();
+	}
+
 	Refresh(checkSensors);
 	return !sensorsMonitored.IsEmpty() && lastVal != 0.0;
 }
@@ -177,7 +336,7 @@ bool LocalFan::AssignPorts(const char *pinNames, const StringRef& reply)
 	// Tacho initialisation
 	if (tachoPort.IsValid())
 	{
-		tachoPort.AttachInterrupt(FanInterrupt, InterruptMode::falling, this);
+		tachoPort.AttachPulseTimer(InterruptMode::falling, &tachoTimer);
 	}
 
 	Refresh(true);
@@ -187,26 +346,55 @@ bool LocalFan::AssignPorts(const char *pinNames, const StringRef& reply)
 // Tacho support
 int32_t LocalFan::GetRPM()
 {
-	// The ISR sets fanInterval to the number of step interrupt clocks it took to get fanMaxInterruptCount interrupts.
+	// The ISR sets the interval to the number of step interrupt clocks it took to get fanMaxInterruptCount interrupts after the first one of a measurement.
 	// We get 2 tacho pulses per revolution, hence 2 interrupts per revolution.
-	// When the fan stops, we get no interrupts and fanInterval stops getting updated. We must recognise this and return zero.
+	// When the fan stops, we get no interrupts and the interval stops getting updated. We must recognise this and return zero.
+	const uint32_t interval = tachoTimer.interval;
 	return (!tachoPort.IsValid())
 			? -1																			// we return -1 if there is no tacho configured
-			: (fanInterval != 0 && StepTimer::GetTimerTicks() - fanLastResetTime < 3 * StepTimer::StepClockRate)	// if we have a reading and it is less than 3 seconds old
-			  ? (StepTimer::StepClockRate * fanMaxInterruptCount * (60/2))/fanInterval		// then calculate RPM assuming 2 interrupts per rev
+			: (interval != 0 && StepTimer::GetTimerTicks() - tachoTimer.whenCompleted < 3 * StepTimer::StepClockRate)	// if we have a reading and it is less than 3 seconds old
+			  ? (StepTimer::StepClockRate * fanMaxInterruptCount * (60/2))/interval			// then calculate RPM assuming 2 interrupts per rev
 			  : 0;																			// else assume fan is off or tacho not connected
 }
 
-void LocalFan::Interrupt()
+// Check whether the fan has stalled or is running too slowly, and learn its normal speed if it is neither. Return true if the fault status has changed.
+// We only check once the PWM has been steady for long enough for the speed to settle, by which time GetRPM returns zero if there have been no tacho pulses.
+bool LocalFan::CheckSpeed()
 {
-	++fanInterruptCount;
-	if (fanInterruptCount == fanMaxInterruptCount)
+	if (!tachoPort.IsValid())
+	{
+		return false;
+	}
+
+	SpeedFault newFault = SpeedFault::none;
+	if (lastVal > 0.0 && !blipping && !IsSequenceRunning() && millis() - whenPwmChanged >= FanSettleTime)
+	{
+		const int32_t rpm = GetRPM();
+		uint16_t& expectedRpm = learnedRpm[min<size_t>((size_t)(lastVal * NumRpmBands), NumRpmBands - 1)];
+		if (rpm <= 0)
+		{
+			newFault = SpeedFault::stalled;
+		}
+		else if (expectedRpm != 0 && (float)rpm < (float)expectedRpm * UnderSpeedFraction)
+		{
+			newFault = SpeedFault::underSpeed;
+		}
+		else
+		{
+			expectedRpm = (expectedRpm == 0) ? (uint16_t)min<int32_t>(rpm, 65535) : (uint16_t)min<int32_t>((3 * (int32_t)expectedRpm + rpm)/4, 65535);
+		}
+	}
+	else if (lastVal > 0.0)
+	{
+		newFault = speedFault;									// the speed hasn't settled yet, so keep the old status
+	}
+
+	if (newFault != speedFault)
 	{
-		const uint32_t now = StepTimer::GetTimerTicks();
-		fanInterval = now - fanLastResetTime;
-		fanLastResetTime = now;
-		fanInterruptCount = 0;
+		speedFault = newFault;
+		return true;
 	}
+	return false;
 }
 
 // End
@@ -9,6 +9,7 @@
 #define SRC_FANS_LOCALFAN_H_
 
 #include "Fan.h"
+#include "Movement/StepTimer.h"
 
 class LocalFan : public Fan
 {
@@ -21,29 +22,63 @@ public:
 	void SetPwmFrequency(PwmFrequency freq) override { port.SetFrequency(freq); }
 	int32_t GetRPM() override;
 	void ReportPortDetails(const StringRef& str) const override;
+	bool CheckSpeed() override;
 
 	bool AssignPorts(const char *pinNames, const StringRef& reply);
 
-	void Interrupt();
-
 protected:
 	void Refresh(bool checkSensors) override;
 	bool UpdateFanConfiguration(const StringRef& reply) override;
 
 private:
 	void SetHardwarePwm(float pwmVal);
+#if SUPPORT_PWM_SEQUENCES
+	bool RefreshPwmSequence(float reqVal, uint32_t now);
+	float GetSequencePwm(uint32_t now) const;
+#endif
+	bool IsSequenceRunning() const
+	{
+#if SUPPORT_PWM_SEQUENCES
+		return sequenceRunning;
+#else
+		return false;
+#endif
+	}
 
 	PwmPort port;											// port used to control the fan
 	IoPort tachoPort;										// port used to read the tacho
 
-	// Variables used to read the tacho
+	// Variables used to read the tacho. We time a burst of fanMaxInterruptCount interrupts and then suspend the interrupt until the next measurement is due,
+	// so that a fast fan doesn't generate thousands of interrupts per second that compete with the step interrupt.
 	static constexpr uint32_t fanMaxInterruptCount = 32;	// number of fan interrupts that we average over
-	uint32_t fanInterruptCount;								// accessed only in ISR, so no need to declare it volatile
-	volatile uint32_t fanLastResetTime;						// time (in step clocks) at which we last reset the interrupt count, accessed inside and outside ISR
-	volatile uint32_t fanInterval;							// written by ISR, read outside the ISR
+	static constexpr uint32_t TachoMeasurementInterval = StepTimer::StepClockRate/4;	// how often we start a new measurement, in step clocks
+	// The EIC interrupt handler does the timing itself, so that the tacho pulses don't go through the general callback mechanism.
+	PulseTimer tachoTimer;
+
+	float ClosedLoopPwm();
+
+	// Stall and under-speed detection. We learn the speed that the fan normally runs at for each band of PWM, and report a fault if it runs much slower.
+	enum class SpeedFault : uint8_t { none, underSpeed, stalled };
+	static constexpr size_t NumRpmBands = 10;
+	static constexpr uint32_t FanSettleTime = 3000;			// how long in milliseconds the PWM must be steady before we check the speed
+	static constexpr float PwmChangeTolerance = 0.02;		// PWM changes smaller than this don't count as changes
+	static constexpr float UnderSpeedFraction = 0.5;		// the fraction of the learned speed below which the fan is running too slowly
+	uint16_t learnedRpm[NumRpmBands];						// the learned speed for each band of PWM, 0 if not yet learned
+	uint32_t whenPwmChanged;								// in milliseconds
+	float settledPwm;										// the PWM when it last changed
+	SpeedFault speedFault;
 
 	uint32_t blipStartTime;
+	uint32_t whenLastRefreshed;								// in milliseconds, for ramping
+	float rampTarget;										// the PWM that we are ramping towards
 	bool blipping;
+
+#if SUPPORT_PWM_SEQUENCES
+	// The blip or ramp that the PWM hardware is running, so that we don't have to keep writing new values
+	float sequenceStartPwm, sequenceEndPwm;
+	uint32_t sequenceStartTime, sequenceHoldTime, sequenceRampTime;		// in milliseconds
+	bool sequenceRunning;
+#endif
 };
 
 #endif /* SRC_FANS_LOCALFAN_H_ */
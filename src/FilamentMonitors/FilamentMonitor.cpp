@@ -0,0 +1,358 @@
+/*
+ * FilamentMonitor.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "FilamentMonitor.h"
+
+#if SUPPORT_FILAMENT_MONITORS
+
+#include <CanMessageFormats.h>
+#include <CanMessageGenericParser.h>
+#include <CAN/CanInterface.h>
+#include <Movement/Move.h>
+#include <Platform.h>
+
+static const char * const StatusNames[] = { "no data received", "ok", "too little movement", "too much movement", "sensor error" };
+
+FilamentMonitor *FilamentMonitor::monitors[NumDrivers] = { 0 };
+ReadWriteLock FilamentMonitor::monitorsLock;
+
+// Start a new comparison and forget any previous measurements
+void FilamentMonitor::Reset()
+{
+	status = FilamentStatus::noDataReceived;
+	lastPulseCount = pulseCount;
+	lastNumEdges = numEdges;
+	haveLastAngle = false;
+	measuredSinceStart = 0.0;
+	lastMeasuredFraction = 0.0;
+	extruderStartPosition = moveInstance->GetExtruderPosition(driver);
+}
+
+bool FilamentMonitor::Activate(const StringRef& reply)
+{
+	const irqflags_t flags = cpu_irq_save();
+	pulseCount = 0;
+	numEdges = 0;
+	highTicks = periodTicks = 0;
+	lastRiseTicks = StepTimer::GetTimerTicks();
+	const bool ok = port.AttachInterrupt(CommonInterrupt, (type == FilamentMonitorType::pulse) ? InterruptMode::rising : InterruptMode::change, CallbackParameter(this));
+	cpu_irq_restore(flags);
+	if (!ok)
+	{
+		reply.copy("Failed to set filament monitor pin interrupt");
+	}
+	Reset();
+	return ok;
+}
+
+void FilamentMonitor::Deactivate()
+{
+	port.DetachInterrupt();
+	type = FilamentMonitorType::none;
+}
+
+// This is called from the pin change ISR
+void FilamentMonitor::Interrupt()
+{
+	const uint32_t now = StepTimer::GetTimerTicks();
+	if (type == FilamentMonitorType::pulse)
+	{
+		++pulseCount;
+	}
+	else if (port.Read())
+	{
+		periodTicks = now - lastRiseTicks;
+		lastRiseTicks = now;
+		++numEdges;
+	}
+	else
+	{
+		highTicks = now - lastRiseTicks;
+	}
+}
+
+/*static*/ void FilamentMonitor::CommonInterrupt(CallbackParameter cbp)
+{
+	static_cast<FilamentMonitor*>(cbp.vp)->Interrupt();
+}
+
+// Get the filament movement measured since we were last called. Return false if the sensor isn't working.
+bool FilamentMonitor::GetSensorMovement(float& movement)
+{
+	if (type == FilamentMonitorType::pulse)
+	{
+		const uint32_t count = pulseCount;
+		movement = (float)(count - lastPulseCount) * mmPerUnit;		// pulse sensors can't tell the direction, so we treat all movement as forwards
+		lastPulseCount = count;
+		return true;
+	}
+
+	uint32_t edges, high, period;
+	{
+		AtomicCriticalSectionLocker lock;
+		edges = numEdges;
+		high = highTicks;
+		period = periodTicks;
+	}
+
+	movement = 0.0;
+	if (edges == lastNumEdges || period == 0 || period > MaxDutyCyclePeriod)
+	{
+		return false;												// the sensor has stopped sending PWM
+	}
+	lastNumEdges = edges;
+
+	const float dutyCycle = (float)high/(float)period;
+	if (dutyCycle < MinDutyCycle || dutyCycle > MaxDutyCycle)
+	{
+		haveLastAngle = false;
+		return false;
+	}
+
+	const float angle = constrain<float>((dutyCycle - DutyCycleOffset)/DutyCycleSpan, 0.0, 1.0);
+	if (haveLastAngle)
+	{
+		// Assume that the magnet has turned less than half a revolution since the last reading
+		float change = angle - lastAngle;
+		if (change > 0.5)
+		{
+			change -= 1.0;
+		}
+		else if (change < -0.5)
+		{
+			change += 1.0;
+		}
+		movement = change * mmPerUnit;
+	}
+	lastAngle = angle;
+	haveLastAngle = true;
+	return true;
+}
+
+// Add the new measurements and compare them with the extruder movement when enough filament has been commanded
+void FilamentMonitor::Check()
+{
+	float movement;
+	const bool sensorOk = GetSensorMovement(movement);
+	const int32_t extruderPosition = moveInstance->GetExtruderPosition(driver);
+	FilamentStatus newStatus = status;
+	if (!sensorOk)
+	{
+		newStatus = FilamentStatus::sensorError;
+		measuredSinceStart = 0.0;
+		extruderStartPosition = extruderPosition;
+	}
+	else
+	{
+		measuredSinceStart += movement;
+
+		// The extruder position only includes moves that the Move task has recycled, so it lags slightly behind the filament. The comparison length must be long enough to hide this.
+		const float commanded = (float)(extruderPosition - extruderStartPosition)/stepsPerMm;
+		if (commanded >= comparisonLength)
+		{
+			lastMeasuredFraction = measuredSinceStart/commanded;
+			newStatus = (lastMeasuredFraction < minMovementFraction) ? FilamentStatus::tooLittleMovement
+						: (lastMeasuredFraction > maxMovementFraction) ? FilamentStatus::tooMuchMovement
+							: FilamentStatus::ok;
+			measuredSinceStart = 0.0;
+			extruderStartPosition = extruderPosition;
+		}
+		else if (commanded < 0.0)
+		{
+			// The filament has been retracted, so start again when it is extruded
+			measuredSinceStart = 0.0;
+			extruderStartPosition = extruderPosition;
+		}
+		else if (status == FilamentStatus::sensorError)
+		{
+			newStatus = FilamentStatus::noDataReceived;
+		}
+	}
+
+	if (newStatus != status)
+	{
+		status = newStatus;
+		ReportStatus();
+	}
+}
+
+// Tell the main board that the status has changed. We only do this when it changes, so the main board doesn't need to process a stream of sensor data.
+void FilamentMonitor::ReportStatus() const
+{
+	if (status == FilamentStatus::tooLittleMovement || status == FilamentStatus::tooMuchMovement)
+	{
+		Platform::MessageF(WarningMessage, "Filament monitor on board %u driver %u: %s, measured %.0f%% of commanded movement\n",
+							CanInterface::GetCanAddress(), driver, StatusNames[(size_t)status], (double)(lastMeasuredFraction * 100.0));
+	}
+	else if (status != FilamentStatus::noDataReceived)
+	{
+		Platform::MessageF((status == FilamentStatus::ok) ? GenericMessage : WarningMessage, "Filament monitor on board %u driver %u: %s\n",
+							CanInterface::GetCanAddress(), driver, StatusNames[(size_t)status]);
+	}
+}
+
+void FilamentMonitor::AppendDetails(const StringRef& reply) const
+{
+	reply.printf("Driver %u filament monitor: %s sensor on pin ", driver, (type == FilamentMonitorType::pulse) ? "pulse" : "duty cycle");
+	port.AppendPinName(reply);
+	reply.catf(", %.3fmm per %s, %.1f steps/mm, comparison length %.1fmm, allowed movement %.0f%% to %.0f%%, status %s",
+				(double)mmPerUnit, (type == FilamentMonitorType::pulse) ? "pulse" : "rev", (double)stepsPerMm, (double)comparisonLength,
+				(double)(minMovementFraction * 100.0), (double)(maxMovementFraction * 100.0), StatusNames[(size_t)status]);
+	if (status == FilamentStatus::ok || status == FilamentStatus::tooLittleMovement || status == FilamentStatus::tooMuchMovement)
+	{
+		reply.catf(", last measured %.0f%%", (double)(lastMeasuredFraction * 100.0));
+	}
+}
+
+// Process a M591 command relayed from the main board.
+// D is the local extruder driver, P the sensor type, C the pin, L the mm of filament per pulse or per revolution, S the extruder steps per mm,
+// E the comparison length in mm and R the minimum and maximum allowed movement in percent.
+/*static*/ GCodeResult FilamentMonitor::Configure(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, M591Params);
+	uint8_t drv;
+	if (!parser.GetUintParam('D', drv))
+	{
+		reply.copy("Missing driver number");
+		return GCodeResult::error;
+	}
+	if (drv >= NumDrivers)
+	{
+		reply.printf("Board %u does not have driver %u", CanInterface::GetCanAddress(), drv);
+		return GCodeResult::error;
+	}
+
+	WriteLocker lock(monitorsLock);
+
+	FilamentMonitor *fm = monitors[drv];
+	uint8_t newType;
+	if (parser.GetUintParam('P', newType))
+	{
+		if (newType > (uint8_t)FilamentMonitorType::dutyCycle)
+		{
+			reply.printf("Unknown filament monitor type %u", newType);
+			return GCodeResult::error;
+		}
+
+		if (fm != nullptr && fm->type != FilamentMonitorType::none)
+		{
+			fm->Deactivate();
+			fm->port.Release();
+		}
+		if (newType == (uint8_t)FilamentMonitorType::none)
+		{
+			return GCodeResult::ok;
+		}
+
+		String<StringLength50> pinName;
+		if (!parser.GetStringParam('C', pinName.GetRef()))
+		{
+			reply.copy("Missing filament monitor pin name");
+			return GCodeResult::error;
+		}
+		if (fm == nullptr)
+		{
+			fm = new FilamentMonitor(drv);
+			monitors[drv] = fm;
+		}
+		if (!fm->port.AssignPort(pinName.c_str(), reply, PinUsedBy::filamentMonitor, PinAccess::read))
+		{
+			return GCodeResult::error;
+		}
+
+		fm->mmPerUnit = (newType == (uint8_t)FilamentMonitorType::pulse) ? DefaultMmPerPulse : DefaultMmPerRev;
+		fm->stepsPerMm = DefaultStepsPerMm;
+		fm->comparisonLength = DefaultComparisonLength;
+		fm->minMovementFraction = DefaultMinMovementFraction;
+		fm->maxMovementFraction = DefaultMaxMovementFraction;
+		fm->type = (FilamentMonitorType)newType;
+	}
+	else if (fm == nullptr || fm->type == FilamentMonitorType::none)
+	{
+		reply.printf("Driver %u has no filament monitor", drv);
+		return GCodeResult::ok;
+	}
+
+	bool seen = false;
+	float fval;
+	if (parser.GetFloatParam('L', fval))
+	{
+		if (fval <= 0.0)
+		{
+			reply.copy("Filament monitor L parameter must be greater than zero");
+			return GCodeResult::error;
+		}
+		fm->mmPerUnit = fval;
+		seen = true;
+	}
+	if (parser.GetFloatParam('S', fval))
+	{
+		if (fval <= 0.0)
+		{
+			reply.copy("Extruder steps/mm must be greater than zero");
+			return GCodeResult::error;
+		}
+		fm->stepsPerMm = fval;
+		seen = true;
+	}
+	if (parser.GetFloatParam('E', fval))
+	{
+		if (fval <= 0.0)
+		{
+			reply.copy("Filament monitor comparison length must be greater than zero");
+			return GCodeResult::error;
+		}
+		fm->comparisonLength = fval;
+		seen = true;
+	}
+
+	size_t numValues;
+	const float *values;
+	if (parser.GetFloatArrayParam('R', numValues, values))
+	{
+		if (numValues != 2 || values[0] < 0.0 || values[1] <= values[0])
+		{
+			reply.copy("Filament monitor R parameter must be minimum and maximum percentages");
+			return GCodeResult::error;
+		}
+		fm->minMovementFraction = values[0] * 0.01;
+		fm->maxMovementFraction = values[1] * 0.01;
+		seen = true;
+	}
+
+	if (parser.HasParameter('P'))
+	{
+		return (fm->Activate(reply)) ? GCodeResult::ok : GCodeResult::error;
+	}
+
+	if (seen)
+	{
+		fm->Reset();
+	}
+	else
+	{
+		fm->AppendDetails(reply);
+	}
+	return GCodeResult::ok;
+}
+
+// Check all the filament monitors. Called by the Heat task at the standard sample interval.
+/*static*/ void FilamentMonitor::Spin()
+{
+	ReadLocker lock(monitorsLock);
+	for (FilamentMonitor *fm : monitors)
+	{
+		if (fm != nullptr && fm->type != FilamentMonitorType::none)
+		{
+			fm->Check();
+		}
+	}
+}
+
+#endif
+
+// End
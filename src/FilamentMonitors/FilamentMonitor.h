@@ -0,0 +1,107 @@
+/*
+ * FilamentMonitor.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  Filament monitors attached to this board, each associated with a local extruder drive.
+ *  A pulse sensor produces a fixed number of pulses per mm of filament, which we count in the pin interrupt.
+ *  A duty cycle sensor is a rotating magnet sensor that outputs a PWM signal whose duty cycle is proportional to the angle of the magnet, which we time in the pin interrupt.
+ *  We compare the measured filament movement with the net steps of the extruder over a configured length of extrusion, so the main board doesn't need to see the raw sensor data.
+ *  We only tell the main board when the filament movement goes outside, or comes back within, the allowed range.
+ */
+
+#ifndef SRC_FILAMENTMONITORS_FILAMENTMONITOR_H_
+#define SRC_FILAMENTMONITORS_FILAMENTMONITOR_H_
+
+#include "RepRapFirmware.h"
+
+#if SUPPORT_FILAMENT_MONITORS
+
+#include <Hardware/IoPorts.h>
+#include <GCodes/GCodeResult.h>
+#include <RTOSIface/RTOSIface.h>
+#include <Movement/StepTimer.h>
+
+struct CanMessageGeneric;
+
+enum class FilamentMonitorType : uint8_t
+{
+	none = 0,
+	pulse,							// counts pulses, each one representing a fixed length of filament
+	dutyCycle						// measures the duty cycle of a PWM signal proportional to the angle of a rotating magnet
+};
+
+enum class FilamentStatus : uint8_t
+{
+	noDataReceived = 0,
+	ok,
+	tooLittleMovement,
+	tooMuchMovement,
+	sensorError
+};
+
+class FilamentMonitor
+{
+public:
+	static GCodeResult Configure(const CanMessageGeneric& msg, const StringRef& reply);		// process a M591 command relayed from the main board
+	static void Spin();																		// called by the Heat task at the standard sample interval
+
+private:
+	FilamentMonitor(size_t p_driver) : type(FilamentMonitorType::none), driver(p_driver), pulseCount(0), numEdges(0) { Reset(); }
+
+	void Reset();
+	bool Activate(const StringRef& reply);
+	void Deactivate();
+	void Check();
+	bool GetSensorMovement(float& movement);
+	void ReportStatus() const;
+	void AppendDetails(const StringRef& reply) const;
+	void Interrupt();
+
+	static void CommonInterrupt(CallbackParameter cbp);
+
+	static constexpr float DefaultComparisonLength = 3.0;			// mm of commanded extrusion over which we compare
+	static constexpr float DefaultMmPerPulse = 1.0;
+	static constexpr float DefaultMmPerRev = 28.8;					// typical for a magnet on a 9mm diameter drive wheel
+	static constexpr float DefaultStepsPerMm = 420.0;				// typical for a geared extruder at x16 microstepping
+	static constexpr float DefaultMinMovementFraction = 0.7;
+	static constexpr float DefaultMaxMovementFraction = 1.3;
+	static constexpr uint32_t MaxDutyCyclePeriod = StepTimer::StepClockRate/50;	// PWM periods longer than this (20ms) mean that the sensor isn't working
+	static constexpr float MinDutyCycle = 0.02;						// duty cycles outside 2% to 98% mean that the magnet is missing or the sensor has failed
+	static constexpr float MaxDutyCycle = 0.98;
+	static constexpr float DutyCycleOffset = 128.0/4351.0;			// the AS5600 PWM frame is 128 clocks high, then 4096 clocks encoding the angle, then 127 clocks low
+	static constexpr float DutyCycleSpan = 4096.0/4351.0;
+
+	IoPort port;
+	FilamentMonitorType type;
+	FilamentStatus status;
+	uint8_t driver;													// the local extruder drive whose steps we compare with
+	float mmPerUnit;												// mm of filament per pulse, or per revolution of the magnet
+	float stepsPerMm;												// extruder steps per mm at the main board's microstepping
+	float comparisonLength;
+	float minMovementFraction, maxMovementFraction;
+
+	// Measurement state, written by the ISR
+	volatile uint32_t pulseCount;
+	volatile uint32_t lastRiseTicks;
+	volatile uint32_t highTicks;
+	volatile uint32_t periodTicks;
+	volatile uint32_t numEdges;
+
+	// Comparison state, used by the Heat task only
+	uint32_t lastPulseCount;
+	uint32_t lastNumEdges;
+	float lastAngle;												// the last angle measured by a duty cycle sensor, in revolutions
+	float measuredSinceStart;										// mm of filament measured since the start of the comparison
+	int32_t extruderStartPosition;									// the extruder position at the start of the comparison
+	float lastMeasuredFraction;										// the measured movement as a fraction of the commanded movement in the last complete comparison
+	bool haveLastAngle;
+
+	static FilamentMonitor *monitors[NumDrivers];
+	static ReadWriteLock monitorsLock;
+};
+
+#endif
+
+#endif /* SRC_FILAMENTMONITORS_FILAMENTMONITOR_H_ */
@@ -8,10 +8,188 @@
 #include "GpioPorts.h"
 #include <CAN/CanInterface.h>
 #include <CanMessageGenericParser.h>
+#include <Hardware/AnalogOut.h>
+#include <Movement/StepTimer.h>
+#include <Movement/Move.h>
 
 static PwmPort ports[MaxGpOutPorts];
 
-GCodeResult GpioPorts::HandleM950Gpio(const CanMessageGeneric &msg, const StringRef &reply)
+// Motion synchronised outputs, for lasers and spindles. While a move is executing, the output of such a port is its commanded value scaled by the current speed
+// as a fraction of the top speed of the move, so that the energy delivered per unit distance stays constant during acceleration and deceleration. Between moves it is off.
+// We update these ports from a step timer callback, so they track the motion without any CAN latency.
+static_assert(MaxGpOutPorts <= 32, "Motion sync bitmap too small");
+constexpr uint32_t MotionSyncInterval = StepTimer::StepClockRate/2000;		// how often we update the motion synchronised outputs, 500us
+static volatile uint32_t motionSyncPorts = 0;								// bitmap of the ports that follow the motion
+static float commandedValues[MaxGpOutPorts];								// the values most recently commanded for the motion synchronised ports
+static float outputValues[MaxGpOutPorts];									// the values we most recently wrote to them
+static uint32_t portConfigDigests[MaxGpOutPorts] = { 0 };					// the digests of the commands that created the ports, or 0 if they have been changed since
+static StepTimer motionSyncTimer;
+
+static void MotionSyncCallback(CallbackParameter)
+{
+	const uint32_t now = StepTimer::GetTimerTicks();
+	const DDA * const cdda = moveInstance->GetCurrentDDA();
+	const float speedFraction = (cdda != nullptr && cdda->GetState() == DDA::executing) ? cdda->GetSpeedFraction(now) : 0.0;
+	const uint32_t syncPorts = motionSyncPorts;
+	for (size_t i = 0; i < MaxGpOutPorts; ++i)
+	{
+		if ((syncPorts & (1u << i)) != 0)
+		{
+			const float val = commandedValues[i] * speedFraction;
+			if (val != outputValues[i])
+			{
+				outputValues[i] = val;
+				ports[i].WriteAnalog(val);
+			}
+		}
+	}
+	if (syncPorts != 0)
+	{
+		(void)motionSyncTimer.ScheduleCallbackFromIsr(now + MotionSyncInterval);
+	}
+}
+
+// Make a port follow the motion or stop doing so
+static void SetMotionSync(size_t portNumber, bool follow)
+{
+	const uint32_t oldPorts = motionSyncPorts;
+	if (follow)
+	{
+		commandedValues[portNumber] = 0.0;
+		outputValues[portNumber] = -1.0;									// make sure that the callback writes the port first time
+		motionSyncPorts = oldPorts | (1u << portNumber);
+		if (oldPorts == 0)
+		{
+			motionSyncTimer.SetCallback(MotionSyncCallback, CallbackParameter());
+			(void)motionSyncTimer.ScheduleCallback(StepTimer::GetTimerTicks() + MotionSyncInterval);
+		}
+	}
+	else
+	{
+		motionSyncPorts = oldPorts & ~(1u << portNumber);					// the callback stops rescheduling itself when there are no ports left
+	}
+}
+
+// Set the value of a port. If the port follows the motion, this sets the value that the step timer callback scales by the speed.
+static void WritePort(size_t portNumber, float val)
+{
+	if ((motionSyncPorts & (1u << portNumber)) != 0)
+	{
+		commandedValues[portNumber] = val;
+	}
+	else
+	{
+		ports[portNumber].WriteAnalog(val);
+	}
+}
+
+// Batched writes. A batch sets several ports together, either at once or at a specified master time.
+// Several timed batches can be pending, so that the main board can schedule a sequence of tool changer actions to overlap the moves before them.
+// We keep them in order of time and the step timer executes the earliest.
+constexpr size_t MaxBatchedWrites = 16;
+#if !SUPPORT_SERVO_OUTPUTS
+constexpr size_t MaxTimedBatches = 1;
+#elif defined(SAME51)
+constexpr size_t MaxTimedBatches = 4;
+#else
+constexpr size_t MaxTimedBatches = 3;
+#endif
+
+struct TimedBatch
+{
+	uint32_t whenDue;															// the local step clock time at which to execute the batch
+	size_t length;
+	uint8_t portNumbers[MaxBatchedWrites];
+	float values[MaxBatchedWrites];
+};
+
+static TimedBatch timedBatches[MaxTimedBatches];
+static uint8_t batchOrder[MaxTimedBatches];										// the indices of the pending batches in order of time
+static volatile size_t numBatchesPending = 0;
+static StepTimer batchTimer;
+
+// Write the values in a batch to the ports. The PWM updates are locked while we do it, so all the outputs driven by one TC or TCC change at the start of the same PWM period.
+static void ExecuteBatch(size_t length, const uint8_t *portNumbers, const float *values)
+{
+	const irqflags_t flags = cpu_irq_save();
+	AnalogOut::LockUpdates();
+	for (size_t i = 0; i < length; ++i)
+	{
+		WritePort(portNumbers[i], values[i]);
+	}
+	AnalogOut::UnlockUpdates();
+	cpu_irq_restore(flags);
+}
+
+// Step timer callback for the timed batches. Execute the ones that are due and schedule the next one. Also called with interrupts disabled when the earliest batch changes.
+static void BatchTimerCallback(CallbackParameter)
+{
+	size_t numPending = numBatchesPending;
+	while (numPending != 0)
+	{
+		const TimedBatch& batch = timedBatches[batchOrder[0]];
+		if (!batchTimer.ScheduleCallbackFromIsr(batch.whenDue))
+		{
+			break;																// the timer will call us again when this batch is due
+		}
+		ExecuteBatch(batch.length, batch.portNumbers, batch.values);
+		--numPending;
+		memmove(batchOrder, batchOrder + 1, numPending * sizeof(batchOrder[0]));
+	}
+	numBatchesPending = numPending;
+}
+
+// Add a batch to the pending ones, returning false if there is no room for it
+static bool AddTimedBatch(uint32_t whenDue, size_t length, const uint8_t *portNumbers, const float *values)
+{
+	AtomicCriticalSectionLocker lock;
+	size_t numPending = numBatchesPending;
+	if (numPending == MaxTimedBatches)
+	{
+		return false;
+	}
+
+	// Find a free slot, which is one that isn't in the order list
+	size_t slot = 0;
+	for (size_t i = 0; i < numPending; )
+	{
+		if (batchOrder[i] == slot)
+		{
+			++slot;
+			i = 0;
+		}
+		else
+		{
+			++i;
+		}
+	}
+
+	TimedBatch& batch = timedBatches[slot];
+	batch.whenDue = whenDue;
+	batch.length = length;
+	memcpy(batch.portNumbers, portNumbers, length * sizeof(portNumbers[0]));
+	memcpy(batch.values, values, length * sizeof(values[0]));
+
+	// Insert it after the pending batches that are due at or before the same time, so that batches due at the same time are executed in the order we received them
+	size_t pos = numPending;
+	while (pos != 0 && (int32_t)(timedBatches[batchOrder[pos - 1]].whenDue - whenDue) > 0)
+	{
+		batchOrder[pos] = batchOrder[pos - 1];
+		--pos;
+	}
+	batchOrder[pos] = slot;
+	numBatchesPending = numPending + 1;
+
+	if (pos == 0)
+	{
+		// The new batch is now the earliest, so reschedule the timer for it. This executes it now if it is already due.
+		batchTimer.CancelCallbackFromIsr();
+		BatchTimerCallback(CallbackParameter());
+	}
+	return true;
+}
+
+GCodeResult GpioPorts::HandleM950Gpio(const CanMessageGeneric &msg, uint32_t configDigest, const StringRef &reply)
 {
 	// Get and validate the port number
 	CanMessageGenericParser parser(msg, M950GpioParams);
@@ -40,15 +218,33 @@ GCodeResult GpioPorts::HandleM950Gpio(const CanMessageGeneric &msg, const String
 		freq = (isServo) ? ServoRefreshFrequency : DefaultPinWritePwmFreq;
 	}
 
+	bool followMotion;
+	const bool seenFollow = parser.GetBoolParam('L', followMotion);
+
 	PwmPort& port = ports[gpioNumber];
 	String<StringLength50> pinName;
 	if (parser.GetStringParam('C', pinName.GetRef()))
 	{
-		// Creating or destroying a port
+		// Creating or destroying a port. If the main board sent the command that created this port again, there is nothing to do.
+		if (port.IsValid() && portConfigDigests[gpioNumber] == configDigest)
+		{
+			return GCodeResult::ok;
+		}
+
+		SetMotionSync(gpioNumber, false);
 		const bool ok = port.AssignPort(pinName.c_str(), reply, PinUsedBy::gpout, (isServo) ? PinAccess::servo : PinAccess::pwm);
+		portConfigDigests[gpioNumber] = 0;
 		if (ok && port.IsValid())
 		{
 			port.SetFrequency(freq);
+#if SUPPORT_SERVO_OUTPUTS
+			port.SetServo(isServo);
+#endif
+			if (seenFollow && followMotion && !isServo)
+			{
+				SetMotionSync(gpioNumber, true);
+			}
+			portConfigDigests[gpioNumber] = configDigest;
 		}
 		return (ok) ? GCodeResult::ok : GCodeResult::error;
 	}
@@ -61,14 +257,26 @@ GCodeResult GpioPorts::HandleM950Gpio(const CanMessageGeneric &msg, const String
 			return GCodeResult::error;
 		}
 
+		if (seenFreq || seenFollow)
+		{
+			portConfigDigests[gpioNumber] = 0;
+		}
 		if (seenFreq)
 		{
 			port.SetFrequency(freq);
 		}
-		else
+		if (seenFollow)
+		{
+			SetMotionSync(gpioNumber, followMotion);
+		}
+		if (!seenFreq && !seenFollow)
 		{
 			reply.printf("GPIO/servo port %u", gpioNumber);
 			port.AppendDetails(reply);
+			if ((motionSyncPorts & (1u << gpioNumber)) != 0)
+			{
+				reply.cat(", follows motion");
+			}
 		}
 		return GCodeResult::ok;
 	}
@@ -82,7 +290,48 @@ GCodeResult GpioPorts::HandleGpioWrite(const CanMessageWriteGpio &msg, const Str
 		return GCodeResult::error;
 	}
 
-	ports[msg.portNumber].WriteAnalog(msg.pwm);
+	WritePort(msg.portNumber, msg.pwm);
+	return GCodeResult::ok;
+}
+
+// Set several ports together. P is the list of port numbers and S is the list of values. If T is present, it is the master step clock time at which to set them.
+GCodeResult GpioPorts::HandleGpioWriteBatch(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, GpioBatchParams);
+	size_t numPorts, numValues;
+	const uint8_t *portNumbers;
+	const float *values;
+	if (!parser.GetUint8ArrayParam('P', numPorts, portNumbers) || !parser.GetFloatArrayParam('S', numValues, values))
+	{
+		reply.copy("Missing port numbers or values in GPIO batch message");
+		return GCodeResult::error;
+	}
+	if (numPorts != numValues || numPorts > MaxBatchedWrites)
+	{
+		reply.copy("Bad number of port numbers or values in GPIO batch message");
+		return GCodeResult::error;
+	}
+	for (size_t i = 0; i < numPorts; ++i)
+	{
+		if (portNumbers[i] >= MaxGpOutPorts || !ports[portNumbers[i]].IsValid())
+		{
+			reply.printf("Board %u does not have GPIO/servo port %u", CanInterface::GetCanAddress(), portNumbers[i]);
+			return GCodeResult::error;
+		}
+	}
+	uint32_t whenMasterTime;
+	if (parser.GetUintParam('T', whenMasterTime))
+	{
+		batchTimer.SetCallback(BatchTimerCallback, CallbackParameter());
+		if (!AddTimedBatch(StepTimer::ConvertToLocalTime(whenMasterTime), numPorts, portNumbers, values))
+		{
+			reply.printf("Too many timed GPIO batches pending, the limit is %u", MaxTimedBatches);
+			return GCodeResult::error;
+		}
+		return GCodeResult::ok;					// the timer will execute the batch, or we already have if its time has come
+	}
+
+	ExecuteBatch(numPorts, portNumbers, values);
 	return GCodeResult::ok;
 }
 
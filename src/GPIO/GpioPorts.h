@@ -15,8 +15,9 @@
 
 namespace GpioPorts
 {
-	GCodeResult HandleM950Gpio(const CanMessageGeneric& msg, const StringRef& reply);
+	GCodeResult HandleM950Gpio(const CanMessageGeneric& msg, uint32_t configDigest, const StringRef& reply);
 	GCodeResult HandleGpioWrite(const CanMessageWriteGpio& msg, const StringRef& reply);
+	GCodeResult HandleGpioWriteBatch(const CanMessageGeneric& msg, const StringRef& reply);
 }
 
 #endif /* SRC_GPIO_GPODEVICE_H_ */
@@ -0,0 +1,133 @@
+/*
+ * AdcCalibration.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "AdcCalibration.h"
+
+#if HAS_VREF_MONITOR
+
+#include <Platform.h>
+
+namespace AdcCalibration
+{
+	constexpr uint32_t TimeConstantMillis = 2000;			// the time constant of the smoothing
+	constexpr uint32_t MaxUpdateIntervalMillis = 500;		// if we haven't been called for longer than this, we don't weight the new reading any more heavily
+	constexpr float MaxStep = (float)(1u << (AnalogIn::AdcBits + OversampleBits - 8));	// a change bigger than 1/256 of the range is a fault or a change of configuration, not drift
+
+	// The reference filters that we track
+	constexpr size_t ReferenceFilters[] =
+	{
+		VssaFilterIndex,
+		VrefFilterIndex,
+#ifdef SAMC21
+		SdAdcVrefFilterIndex,
+#endif
+	};
+
+	static const char * const ReferenceNames[] =
+	{
+		"VSSA",
+		"VREF",
+#ifdef SAMC21
+		"SDADC VREF",
+#endif
+	};
+
+	constexpr size_t NumReferences = ARRAY_SIZE(ReferenceFilters);
+	static_assert(ARRAY_SIZE(ReferenceNames) == NumReferences);
+
+	static float estimates[NumReferences];
+	static volatile int32_t readings[NumReferences];		// the estimates rounded, which is what other tasks read
+	static volatile bool valid[NumReferences] = { false };
+	static uint32_t whenLastUpdated = 0;
+	static uint32_t numRestarts = 0;
+
+	static bool GetReference(size_t index, int32_t& reading)
+	{
+		if (!valid[index])
+		{
+			return false;
+		}
+		reading = readings[index];
+		return true;
+	}
+}
+
+void AdcCalibration::Spin()
+{
+	const uint32_t now = millis();
+	const uint32_t interval = now - whenLastUpdated;
+	if (interval < MinHeatSampleIntervalMillis)
+	{
+		return;
+	}
+	whenLastUpdated = now;
+
+	const float weight = (float)min<uint32_t>(interval, MaxUpdateIntervalMillis)/(float)TimeConstantMillis;
+	for (size_t i = 0; i < NumReferences; ++i)
+	{
+		const volatile ThermistorAveragingFilter& filter = *Platform::GetAdcFilter(ReferenceFilters[i]);
+		uint32_t sum;
+		if (filter.GetSnapshot(sum))
+		{
+			const float reading = (float)(sum/(filter.NumAveraged() >> OversampleBits));
+			if (!valid[i] || fabsf(reading - estimates[i]) > MaxStep)
+			{
+				if (valid[i])
+				{
+					++numRestarts;
+				}
+				estimates[i] = reading;
+			}
+			else
+			{
+				estimates[i] += (reading - estimates[i]) * weight;
+			}
+			readings[i] = lrintf(estimates[i]);
+			valid[i] = true;
+		}
+		else
+		{
+			valid[i] = false;
+		}
+	}
+}
+
+// Get the references that apply to a thermistor filter
+bool AdcCalibration::GetReferences(unsigned int filterNumber, References& refs)
+{
+#ifdef SAMC21
+	// The SDADC channel has its own VREF input and INN connected to VSSA
+	if (filterNumber == SdAdcTemp0FilterIndex)
+	{
+		refs.vssa = 0;
+		return GetReference(2, refs.vref);
+	}
+#endif
+	return GetReference(0, refs.vssa) && GetReference(1, refs.vref);
+}
+
+void AdcCalibration::Diagnostics(const StringRef& reply)
+{
+	reply.lcatf("ADC references:");
+	for (size_t i = 0; i < NumReferences; ++i)
+	{
+		if (valid[i])
+		{
+			reply.catf(" %s %.1f", ReferenceNames[i], (double)estimates[i]);
+		}
+		else
+		{
+			reply.catf(" %s n/a", ReferenceNames[i]);
+		}
+	}
+	reply.catf(", restarts %" PRIu32, numRestarts);
+	numRestarts = 0;
+}
+
+#endif
+
+// End
@@ -0,0 +1,37 @@
+/*
+ * AdcCalibration.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Estimates the ADC readings of VSSA and VREF in the background, so that ratiometric analog inputs can use a low noise value for each end of the range.
+ *  The references change much more slowly than the signals we measure against them, so we smooth their readings over a much longer time than the
+ *  thermistor averaging filters do. A step larger than any drift restarts the estimate, so that a failed reference is still reported straight away.
+ */
+
+#ifndef SRC_HARDWARE_ADCCALIBRATION_H_
+#define SRC_HARDWARE_ADCCALIBRATION_H_
+
+#include "RepRapFirmware.h"
+
+#if HAS_VREF_MONITOR
+
+namespace AdcCalibration
+{
+	constexpr unsigned int OversampleBits = 2;				// the references are reported with this many bits of oversampling, the same as the thermistor readings
+
+	// The estimated readings of the two ends of the range of an averaging filter, including the oversampling bits
+	struct References
+	{
+		int32_t vssa;
+		int32_t vref;
+	};
+
+	void Spin();											// update the estimates from the reference filters, called from Platform::Spin
+	bool GetReferences(unsigned int filterNumber, References& refs);	// get the references for the thermistor filter, returning false if they are not ready yet
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif
+
+#endif /* SRC_HARDWARE_ADCCALIBRATION_H_ */
@@ -0,0 +1,111 @@
+/*
+ * AdcProfiler.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "AdcProfiler.h"
+
+#if SUPPORT_ADC_PROFILING
+
+#include <Movement/StepTimer.h>
+
+namespace AdcProfiler
+{
+	struct Statistics
+	{
+		uint32_t numCalls;
+		uint32_t minTicks;
+		uint32_t maxTicks;
+		uint64_t totalTicks;
+		uint32_t histogram[NumHistogramBuckets];
+
+		void Clear()
+		{
+			numCalls = 0;
+			minTicks = 0xFFFFFFFF;
+			maxTicks = 0;
+			totalTicks = 0;
+			for (uint32_t& h : histogram)
+			{
+				h = 0;
+			}
+		}
+	};
+
+	static Statistics stats[(size_t)Point::numPoints];
+	static volatile bool resetRequested = true;
+
+	static const char * const PointNames[] = { "Round", "Callbacks", "Latency" };
+	static_assert(ARRAY_SIZE(PointNames) == (size_t)Point::numPoints, "Wrong number of profile point names");
+
+	constexpr uint32_t FirstBucketTicks = (FirstBucketMicroseconds * (uint64_t)StepTimer::StepClockRate)/1000000;
+
+	static inline uint32_t TicksToMicroseconds(uint32_t ticks)
+	{
+		return (uint32_t)(((uint64_t)ticks * 1000000u)/StepTimer::StepClockRate);
+	}
+}
+
+// Record one measurement. Called only from the AIN task.
+void AdcProfiler::Record(Point p, uint32_t ticks)
+{
+	if (resetRequested)
+	{
+		for (Statistics& s : stats)
+		{
+			s.Clear();
+		}
+		resetRequested = false;
+	}
+
+	Statistics& s = stats[(size_t)p];
+	++s.numCalls;
+	s.totalTicks += ticks;
+	if (ticks < s.minTicks)
+	{
+		s.minTicks = ticks;
+	}
+	if (ticks > s.maxTicks)
+	{
+		s.maxTicks = ticks;
+	}
+
+	size_t bucket = 0;
+	uint32_t limit = FirstBucketTicks;
+	while (ticks >= limit && bucket + 1 < NumHistogramBuckets)
+	{
+		++bucket;
+		limit <<= 1;
+	}
+	++s.histogram[bucket];
+}
+
+// Append the statistics to the reply and then reset them. The reply is limited in length, so keep it compact.
+void AdcProfiler::Diagnostics(const StringRef& reply)
+{
+	reply.lcatf("ADC times us count,min/avg/max,hist <%u:", FirstBucketMicroseconds);
+	for (size_t i = 0; i < (size_t)Point::numPoints; ++i)
+	{
+		const Statistics& s = stats[i];
+		if (!resetRequested && s.numCalls != 0)
+		{
+			reply.lcatf("%s %" PRIu32 ",%" PRIu32 "/%" PRIu32 "/%" PRIu32 ",",
+						PointNames[i], s.numCalls, TicksToMicroseconds(s.minTicks), TicksToMicroseconds((uint32_t)(s.totalTicks/s.numCalls)), TicksToMicroseconds(s.maxTicks));
+			for (size_t j = 0; j < NumHistogramBuckets; ++j)
+			{
+				reply.catf("%c%" PRIu32, (j == 0) ? ' ' : '/', s.histogram[j]);
+			}
+		}
+		else
+		{
+			reply.lcatf("%s 0", PointNames[i]);
+		}
+	}
+	resetRequested = true;
+}
+
+#endif
+
+// End
@@ -0,0 +1,38 @@
+/*
+ * AdcProfiler.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  Instrumentation to measure how long the ADCs and the AIN task take, so that we can tune the number of channels and check that the AIN task isn't starving other tasks.
+ *  Times are measured with the step clock. The statistics are only ever written by the AIN task, so no locking is needed. When the diagnostics are read
+ *  we ask the AIN task to reset them on its next update, so a report may occasionally include a partial update.
+ */
+
+#ifndef SRC_HARDWARE_ADCPROFILER_H_
+#define SRC_HARDWARE_ADCPROFILER_H_
+
+#include "RepRapFirmware.h"
+
+#if SUPPORT_ADC_PROFILING
+
+namespace AdcProfiler
+{
+	enum class Point : uint8_t
+	{
+		round = 0,							// from starting a round of conversions to the DMA completing it
+		callbacks,							// executing the callbacks for a round in ExecuteCallbacks
+		latency,							// from the DMA completing a round to the last filter being updated
+		numPoints
+	};
+
+	constexpr size_t NumHistogramBuckets = 8;
+	constexpr unsigned int FirstBucketMicroseconds = 64;	// the first bucket counts times less than this, each subsequent one doubles
+
+	void Record(Point p, uint32_t ticks);					// record a time in step clocks, called only by the AIN task
+	void Diagnostics(const StringRef& reply);				// append the statistics to the reply and reset them
+}
+
+#endif
+
+#endif /* SRC_HARDWARE_ADCPROFILER_H_ */
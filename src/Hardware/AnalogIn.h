@@ -25,15 +25,19 @@ namespace AnalogIn
 	void Init();
 
 	// Enable analog input on a pin.
-	// Readings will be taken and about every 'ticksPerCall' milliseconds the callback function will be called with the specified parameter and ADC reading.
-	// Set ticksPerCall to 0 to get a callback on every reading.
+	// The channel will be converted about every 'ticksPerCall' milliseconds and the callback function will be called with the specified parameter and ADC reading.
+	// Set ticksPerCall to 0 to convert the channel on every round of conversions. Channels that are not due are left out of the round, so slow channels don't slow down fast ones.
 	// Warning! there is nothing to stop you enabling a channel twice, in which case in the SAME51 configuration, it will be read twice in the sequence.
 	bool EnableChannel(Pin pin, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t ticksPerCall, bool useAlternateAdc);
 
-	// Readings will be taken and about every 'ticksPerCall' milliseconds the callback function will be called with the specified parameter and ADC reading.
-	// Set ticksPerCall to 0 to get a callback on every reading.
+	// Change the callback and conversion interval of an enabled channel.
 	bool SetCallback(Pin pin, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t ticksPerCall, bool useAlternateAdc);
 
+	// Call the function from the ADC interrupt as soon as a conversion of the pin crosses the threshold, as well as at the end of the round of conversions.
+	// The pin must already be enabled. Only one pin per ADC can be monitored, and not all ADCs support it, so the caller must not rely on this succeeding.
+	bool EnableWindowMonitor(Pin pin, uint16_t threshold, AnalogInCallbackFunction fn, CallbackParameter param, bool useAlternateAdc);
+	void DisableWindowMonitor(Pin pin, bool useAlternateAdc);
+
 	// Return whether or not the channel is enabled
 	bool IsChannelEnabled(Pin pin, bool useAlternateAdc = false);
 
@@ -43,9 +47,15 @@ namespace AnalogIn
 	// Get the latest result from a channel. the channel must have been enabled first.
 	uint16_t ReadChannel(AdcInput adcin);
 
+	// Get the ADC input that a pin is converted on. On the SAME51 this may be on the other ADC from the one in the pin table, if EnableChannel moved it to balance the ADCs.
+	AdcInput PinToAdcInput(Pin pin, bool useAlternateAdc);
+
 	// Get the number of conversions that were started
 	void GetDebugInfo(uint32_t &convsStarted, uint32_t &convsCompleted, uint32_t &convTimeouts);
 
+	// Append the conversion rate achieved by each channel since the last call
+	void AppendChannelRates(const StringRef& reply);
+
 #ifdef SAME51
 	// Enable an on-chip MCU temperature sensor. We don't use this on the SAMC21 because that chip has a separate TSENS peripheral.
 	bool EnableTemperatureSensor(unsigned int sensorNumber, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t ticksPerCall, unsigned int adcnum);
@@ -53,6 +63,21 @@ namespace AnalogIn
 
 #ifdef SAMC21
 	void EnableTemperatureSensor(AnalogInCallbackFunction fn, CallbackParameter param, uint32_t ticksPerCall);
+
+	// Set the oversampling ratio of the SDADC, which applies to all its inputs. Higher ratios give lower noise but fewer conversions per second.
+	// Return false if the ratio is not one that the SDADC supports.
+	bool SetSdAdcOversamplingRatio(unsigned int ratio);
+	unsigned int GetSdAdcOversamplingRatio();
+
+	// Set the decimation ratio of the SDADC. Zero converts each SDADC input once per round of conversions.
+	// From 1 to 16, the SDADC runs continuously and each reading passed to the averaging filter is the mean of that many conversions.
+	// Return false if the ratio is out of range.
+	bool SetSdAdcDecimation(unsigned int decimation);
+	unsigned int GetSdAdcDecimation();
+
+	// In continuous mode, return the step clock when the SDADC finished the block of conversions that the callbacks are being passed.
+	// Only meaningful when called from an SDADC callback.
+	uint32_t GetSdAdcBlockTicks();
 #endif
 }
 
@@ -13,10 +13,15 @@
 #include "RTOSIface/RTOSIface.h"
 #include "Hardware/DmacManager.h"
 #include "Hardware/IoPorts.h"
+#include "Hardware/AdcProfiler.h"
+#include "Tracer.h"
+#include "StackSizes.h"
+#include <Movement/StepTimer.h>
 
 #define ADC_INPUTCTRL_MUXNEG_GND   (0x18 << ADC_INPUTCTRL_MUXNEG_Pos)			// this definition is missing from file adc.h for the SAMC21
 
 constexpr uint32_t AdcConversionTimeout = 5;		// milliseconds
+constexpr uint32_t SdAdcContinuousTimeout = 100;	// milliseconds without a block of results before we restart the SDADC in continuous mode
 
 static uint32_t conversionsStarted = 0;
 static uint32_t conversionsCompleted = 0;
@@ -52,9 +57,14 @@ public:
 
 	void EnableTemperatureSensor();
 
-	void ResultReadyCallback(DmaCallbackReason reason);
+	virtual void ResultReadyCallback(DmaCallbackReason reason);
+	void AppendChannelRates(const StringRef& reply, unsigned int adcNumber, uint32_t interval);
 
 protected:
+	uint32_t GetChannelsDue() const;
+#if SUPPORT_ADC_PROFILING
+	void RecordTimes(uint32_t callbacksStartedTicks) const;
+#endif
 	virtual bool InternalEnableChannel(unsigned int chan, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t p_ticksPerCall) = 0;
 
 	static void DmaCompleteCallback(CallbackParameter cp, DmaCallbackReason reason);
@@ -77,8 +87,13 @@ protected:
 	CallbackParameter callbackParams[NumAdcChannels];
 	uint32_t ticksPerCall[NumAdcChannels];
 	uint32_t ticksAtLastCall[NumAdcChannels];
+	uint32_t conversionCounts[NumAdcChannels];			// how many times each channel has been converted since we last reported the rates
 	volatile uint16_t results[MaxSequenceLength];
 	volatile uint16_t resultsByChannel[NumAdcChannels];
+#if SUPPORT_ADC_PROFILING
+	uint32_t whenRoundStartedTicks;
+	volatile uint32_t whenRoundFinishedTicks;
+#endif
 };
 
 AdcBase::AdcBase(IRQn p_irqn, DmaChannel p_dmaChan, DmaTrigSource p_trigSrc)
@@ -90,6 +105,7 @@ AdcBase::AdcBase(IRQn p_irqn, DmaChannel p_dmaChan, DmaTrigSource p_trigSrc)
 		callbackFunctions[i] = nullptr;
 		callbackParams[i].u32 = 0;
 		resultsByChannel[i] = 0;
+		conversionCounts[i] = 0;
 	}
 }
 
@@ -126,9 +142,60 @@ bool AdcBase::IsChannelEnabled(unsigned int chan) const
 	return (channelsEnabled & (1ul << chan)) != 0;
 }
 
+// Return the set of enabled channels that are due to be converted, so that each channel is converted at the rate requested when it was enabled
+uint32_t AdcBase::GetChannelsDue() const
+{
+	const uint32_t enabled = channelsEnabled;			// capture volatile variable to ensure we use a consistent value
+	const uint32_t now = millis();
+	uint32_t due = 0;
+	for (size_t i = 0; i < NumAdcChannels; ++i)
+	{
+		if ((enabled & (1ul << i)) != 0 && now - ticksAtLastCall[i] >= ticksPerCall[i])
+		{
+			due |= 1ul << i;
+		}
+	}
+	return due;
+}
+
+// Append the achieved conversion rate of each channel over the last 'interval' milliseconds, and reset the counts
+void AdcBase::AppendChannelRates(const StringRef& reply, unsigned int adcNumber, uint32_t interval)
+{
+	TaskCriticalSectionLocker lock;
+	const uint32_t enabled = channelsEnabled;
+	if (enabled != 0)
+	{
+		reply.catf("\n%s conversions/sec:", (adcNumber == 0) ? "ADC" : "SDADC");
+		for (size_t i = 0; i < NumAdcChannels; ++i)
+		{
+			if ((enabled & (1ul << i)) != 0)
+			{
+				reply.catf(" %u:%" PRIu32, (unsigned int)i, (conversionCounts[i] * 1000)/interval);
+				conversionCounts[i] = 0;
+			}
+		}
+	}
+}
+
+#if SUPPORT_ADC_PROFILING
+
+// Record the round time, the time taken by the callbacks, and the time from the end of the round to the last callback completing
+void AdcBase::RecordTimes(uint32_t callbacksStartedTicks) const
+{
+	const uint32_t callbacksFinishedTicks = StepTimer::GetTimerTicks();
+	AdcProfiler::Record(AdcProfiler::Point::round, whenRoundFinishedTicks - whenRoundStartedTicks);
+	AdcProfiler::Record(AdcProfiler::Point::callbacks, callbacksFinishedTicks - callbacksStartedTicks);
+	AdcProfiler::Record(AdcProfiler::Point::latency, callbacksFinishedTicks - whenRoundFinishedTicks);
+}
+
+#endif
+
 // Indirect callback from the DMA controller ISR
 void AdcBase::ResultReadyCallback(DmaCallbackReason reason)
 {
+#if SUPPORT_ADC_PROFILING
+	whenRoundFinishedTicks = StepTimer::GetTimerTicks();
+#endif
 	dmaFinishedReason = reason;
 	state = State::ready;
 	++conversionsCompleted;
@@ -255,15 +322,10 @@ bool AdcClass::InternalEnableChannel(unsigned int chan, AnalogInCallbackFunction
 	return false;
 }
 
-// Start a conversion if we are not already doing one and have channels to convert, or timeout an existing conversion
+// Start a conversion of the channels that are due if we are not already doing one, or timeout an existing conversion
 bool AdcClass::StartConversion(TaskBase *p_taskToWake)
 {
-	const size_t numChannelsConverting = numChannelsEnabled;			// capture volatile variable to ensure we use a consistent value
-	if (numChannelsConverting == 0)
-	{
-		return false;
-	}
-
+	uint32_t channelsToConvert;
 	if (state == State::converting)
 	{
 		if (millis() - whenLastConversionStarted < AdcConversionTimeout)
@@ -272,21 +334,34 @@ bool AdcClass::StartConversion(TaskBase *p_taskToWake)
 		}
 		++conversionTimeouts;
 		//TODO should we reset the ADC here?
+		channelsToConvert = device->SEQCTRL.reg;			// retry the same sequence
+	}
+	else
+	{
+		channelsToConvert = GetChannelsDue();
+	}
+
+	if (channelsToConvert == 0)
+	{
+		return false;
 	}
 
 	taskToWake = p_taskToWake;
 	(void)device->RESULT.reg;			// make sure no result pending
-	device->SEQCTRL.reg = channelsEnabled;
+	device->SEQCTRL.reg = channelsToConvert;
 
 	// Set up DMA to read the results our of the ADC into the results array
 	DmacManager::SetDestinationAddress(dmaChan, results);
-	DmacManager::SetDataLength(dmaChan, numChannelsConverting);
+	DmacManager::SetDataLength(dmaChan, __builtin_popcount(channelsToConvert));
 
 	dmaFinishedReason = DmaCallbackReason::none;
 	DmacManager::EnableCompletedInterrupt(dmaChan);
 
 	DmacManager::EnableChannel(dmaChan, AdcRxDmaPriority);
 
+#if SUPPORT_ADC_PROFILING
+	whenRoundStartedTicks = StepTimer::GetTimerTicks();
+#endif
 	state = State::converting;
 	device->SWTRIG.reg = ADC_SWTRIG_START;
 	++conversionsStarted;
@@ -297,7 +372,9 @@ bool AdcClass::StartConversion(TaskBase *p_taskToWake)
 void AdcClass::ExecuteCallbacks()
 {
 	TaskCriticalSectionLocker lock;
-
+#if SUPPORT_ADC_PROFILING
+	const uint32_t callbacksStartedTicks = StepTimer::GetTimerTicks();
+#endif
 	const uint32_t now = millis();
 	const volatile uint16_t *p = results;
 	const uint32_t channelsPreviouslyEnabled = device->SEQCTRL.reg;
@@ -307,17 +384,19 @@ void AdcClass::ExecuteCallbacks()
 		{
 			const uint16_t currentResult = *p++;
 			resultsByChannel[i] = currentResult;
-			if (now - ticksAtLastCall[i] >= ticksPerCall[i])
+			ticksAtLastCall[i] = now;
+			++conversionCounts[i];
+			const AnalogInCallbackFunction fn = callbackFunctions[i];
+			if (fn != nullptr)
 			{
-				ticksAtLastCall[i] = now;
-				const AnalogInCallbackFunction fn = callbackFunctions[i];
-				if (fn != nullptr)
-				{
-					fn(callbackParams[i], currentResult);
-				}
+				fn(callbackParams[i], currentResult);
 			}
 		}
 	}
+
+#if SUPPORT_ADC_PROFILING
+	RecordTimes(callbacksStartedTicks);
+#endif
 }
 
 class SdAdcClass : public AdcBase
@@ -327,31 +406,91 @@ public:
 
 	bool StartConversion(TaskBase *p_taskToWake) override;
 	void ExecuteCallbacks() override;
+	void ResultReadyCallback(DmaCallbackReason reason) override;
+
+	void SetOversamplingRatio(uint8_t p_osr);
+	unsigned int GetOversamplingRatio() const { return 64u << osr; }
+	void SetDecimation(unsigned int p_decimation);
+	unsigned int GetDecimation() const { return decimation; }
+	uint32_t GetBlockTicks() const { return processingBlockTicks; }
+
+	static constexpr unsigned int MaxDecimation = 16;
 
 protected:
 	bool InternalEnableChannel(unsigned int chan, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t p_ticksPerCall) override;
 
 private:
 	static constexpr size_t NumSdAdcChannels = 2;
+	static constexpr size_t MaxBlockLength = NumSdAdcChannels * MaxDecimation;
+
+	bool StartContinuousConversion(TaskBase *p_taskToWake);
+	void ExecuteContinuousCallbacks();
+	void StartBlock(size_t half);
+	void Restart();
+
+	// Min SDADC clock is 1MHz, max is 6MHz. GCLK0 is 48MHz, divided by prescaler 8 is 6MHz
+	uint16_t GetCtrlB() const { return SDADC_CTRLB_PRESCALER(8/2 - 1) | SDADC_CTRLB_OSR(osr) | SDADC_CTRLB_SKPCNT(4); }
 
 	Sdadc * const device;
+	uint8_t osr;										// the value of the OSR field in CTRLB
+	uint8_t decimation;									// 0 for one conversion per channel per round, else continuous mode averaging this many conversions per reading
+	uint8_t blockLength;								// in continuous mode, the number of results in each half of the buffer
+	volatile uint8_t readyHalf;							// in continuous mode, which half of the buffer was filled most recently
+	uint8_t fillingHalf;								// in continuous mode, which half of the buffer the DMA is filling
+	volatile uint32_t blockFinishedTicks[2];			// in continuous mode, the step clock when each half of the buffer was filled
+	uint32_t processingBlockTicks;						// the step clock when the block we are passing to the callbacks was filled
+	volatile uint16_t continuousResults[2 * MaxBlockLength];
 };
 
 SdAdcClass::SdAdcClass(
 	Sdadc * const p_device, IRQn p_irqn, DmaChannel p_dmaChan, DmaTrigSource p_trigSrc)
-	: AdcBase(p_irqn, p_dmaChan, p_trigSrc), device(p_device)
+	: AdcBase(p_irqn, p_dmaChan, p_trigSrc), device(p_device), osr(SDADC_CTRLB_OSR_OSR256_Val), decimation(0), blockLength(0), readyHalf(0), fillingHalf(0), processingBlockTicks(0)
+{
+}
+
+// Disable and re-enable the SDADC so that the new settings take effect, which also resets the sequence. CTRLB and CTRLC are enable-protected.
+// Any conversion in progress is lost, so we return to the idle state and the AIN task starts another one. Call this with the task scheduler suspended.
+void SdAdcClass::Restart()
 {
+	if (hri_sdadc_get_CTRLA_reg(device, SDADC_CTRLA_ENABLE))
+	{
+		DmacManager::DisableChannel(dmaChan);
+		hri_sdadc_clear_CTRLA_ENABLE_bit(device);
+		hri_sdadc_wait_for_sync(device, SDADC_SYNCBUSY_ENABLE);
+		hri_sdadc_write_CTRLB_reg(device, GetCtrlB());
+		hri_sdadc_write_CTRLC_reg(device, (decimation != 0) ? SDADC_CTRLC_FREERUN : 0);
+		hri_sdadc_set_CTRLA_ENABLE_bit(device);
+		state = State::idle;
+	}
 }
 
-// Start a conversion if we are not already doing one and have channels to convert, or timeout an existing conversion
+// Change the oversampling ratio
+void SdAdcClass::SetOversamplingRatio(uint8_t p_osr)
+{
+	TaskCriticalSectionLocker lock;
+	osr = p_osr;
+	Restart();
+}
+
+// Set the decimation ratio. Zero means convert each channel once per round of conversions, like the ADC.
+// Otherwise the SDADC runs continuously and the DMA stores the results alternately in the two halves of a buffer, so that no results are lost while we process the other half.
+// Each reading passed to the callback is the average of 'decimation' consecutive conversions.
+void SdAdcClass::SetDecimation(unsigned int p_decimation)
+{
+	TaskCriticalSectionLocker lock;
+	decimation = p_decimation;
+	Restart();
+}
+
+// Start a conversion of the channels that are due if we are not already doing one, or timeout an existing conversion
 bool SdAdcClass::StartConversion(TaskBase *p_taskToWake)
 {
-	const size_t numChannelsConverting = numChannelsEnabled;			// capture volatile variable to ensure we use a consistent value
-	if (numChannelsConverting == 0)
+	if (decimation != 0)
 	{
-		return false;
+		return StartContinuousConversion(p_taskToWake);
 	}
 
+	uint32_t channelsToConvert;
 	if (state == State::converting)
 	{
 		if (millis() - whenLastConversionStarted < AdcConversionTimeout)
@@ -360,21 +499,34 @@ bool SdAdcClass::StartConversion(TaskBase *p_taskToWake)
 		}
 		++conversionTimeouts;
 		//TODO should we reset the SDADC here?
+		channelsToConvert = device->SEQCTRL.reg;			// retry the same sequence
+	}
+	else
+	{
+		channelsToConvert = GetChannelsDue();
+	}
+
+	if (channelsToConvert == 0)
+	{
+		return false;
 	}
 
 	taskToWake = p_taskToWake;
 	(void)device->RESULT.reg;			// make sure no result pending
-	device->SEQCTRL.reg = channelsEnabled;
+	device->SEQCTRL.reg = channelsToConvert;
 
 	// Set up DMA to read the results our of the ADC into the results array
 	DmacManager::SetDestinationAddress(dmaChan, results);
-	DmacManager::SetDataLength(dmaChan, numChannelsConverting);
+	DmacManager::SetDataLength(dmaChan, __builtin_popcount(channelsToConvert));
 
 	dmaFinishedReason = DmaCallbackReason::none;
 	DmacManager::EnableCompletedInterrupt(dmaChan);
 
 	DmacManager::EnableChannel(dmaChan, AdcRxDmaPriority);
 
+#if SUPPORT_ADC_PROFILING
+	whenRoundStartedTicks = StepTimer::GetTimerTicks();
+#endif
 	state = State::converting;
 	device->SWTRIG.reg = SDADC_SWTRIG_START;
 	++conversionsStarted;
@@ -382,9 +534,135 @@ bool SdAdcClass::StartConversion(TaskBase *p_taskToWake)
 	return true;
 }
 
+// Set up the DMA to fill one half of the buffer
+void SdAdcClass::StartBlock(size_t half)
+{
+	fillingHalf = half;
+	DmacManager::SetDestinationAddress(dmaChan, continuousResults + half * MaxBlockLength);
+	DmacManager::SetDataLength(dmaChan, blockLength);
+	DmacManager::EnableCompletedInterrupt(dmaChan);
+	DmacManager::EnableChannel(dmaChan, AdcRxDmaPriority);
+}
+
+// Start continuous conversion if it isn't running, or restart it if we haven't had any results for too long
+bool SdAdcClass::StartContinuousConversion(TaskBase *p_taskToWake)
+{
+	if (state == State::converting || state == State::ready)
+	{
+		if (millis() - whenLastConversionStarted < SdAdcContinuousTimeout)
+		{
+			return false;
+		}
+		++conversionTimeouts;
+		TaskCriticalSectionLocker lock;
+		Restart();
+	}
+
+	const uint32_t channelsToConvert = channelsEnabled;
+	if (channelsToConvert == 0)
+	{
+		return false;
+	}
+
+	taskToWake = p_taskToWake;
+	DmacManager::DisableChannel(dmaChan);
+	device->SEQCTRL.reg = channelsToConvert;
+	blockLength = __builtin_popcount(channelsToConvert) * decimation;
+	(void)device->RESULT.reg;			// make sure no result pending
+	dmaFinishedReason = DmaCallbackReason::none;
+	StartBlock(0);
+
+#if SUPPORT_ADC_PROFILING
+	whenRoundStartedTicks = StepTimer::GetTimerTicks();
+#endif
+	state = State::converting;
+	device->SWTRIG.reg = SDADC_SWTRIG_START;			// in free running mode this starts the first sequence and the others follow without further triggers
+	++conversionsStarted;
+	whenLastConversionStarted = millis();
+	return true;
+}
+
+// DMA complete callback. In continuous mode we must restart the DMA on the other half of the buffer before the next result is ready, otherwise we lose track of which channel each result belongs to.
+void SdAdcClass::ResultReadyCallback(DmaCallbackReason reason)
+{
+	if (decimation == 0)
+	{
+		AdcBase::ResultReadyCallback(reason);
+		return;
+	}
+
+	const uint32_t now = StepTimer::GetTimerTicks();
+#if SUPPORT_ADC_PROFILING
+	whenRoundFinishedTicks = now;
+#endif
+	dmaFinishedReason = reason;
+	blockFinishedTicks[fillingHalf] = now;
+	readyHalf = fillingHalf;
+	StartBlock(fillingHalf ^ 1u);
+	state = State::ready;
+	++conversionsCompleted;
+	if (taskToWake != nullptr)
+	{
+		taskToWake->GiveFromISR();
+	}
+}
+
+// Average the conversions of each channel in the half buffer that has just been filled and pass the results to the callbacks
+void SdAdcClass::ExecuteContinuousCallbacks()
+{
+	TaskCriticalSectionLocker lock;
+	state = State::converting;							// do this first, so that if another block completes while we process this one, we process that one too
+#if SUPPORT_ADC_PROFILING
+	const uint32_t callbacksStartedTicks = StepTimer::GetTimerTicks();
+#endif
+	const uint32_t now = millis();
+	whenLastConversionStarted = now;
+
+	const uint32_t channelsConverted = device->SEQCTRL.reg;
+	const size_t numChannelsConverted = __builtin_popcount(channelsConverted);
+	const volatile uint16_t *const block = continuousResults + readyHalf * MaxBlockLength;
+	processingBlockTicks = blockFinishedTicks[readyHalf];
+	size_t index = 0;
+	for (size_t i = 0; i < NumSdAdcChannels; ++i)
+	{
+		if ((channelsConverted & (1ul << i)) != 0)
+		{
+			uint32_t sum = 0;
+			for (size_t j = index; j < blockLength; j += numChannelsConverted)
+			{
+				sum += block[j];
+			}
+			++index;
+			const uint16_t currentResult = sum/decimation;
+			resultsByChannel[i] = currentResult;
+			ticksAtLastCall[i] = now;
+			conversionCounts[i] += decimation;
+			const AnalogInCallbackFunction fn = callbackFunctions[i];
+			if (fn != nullptr)
+			{
+				fn(callbackParams[i], currentResult);
+			}
+		}
+	}
+
+#if SUPPORT_ADC_PROFILING
+	RecordTimes(callbacksStartedTicks);
+	whenRoundStartedTicks = whenRoundFinishedTicks;		// the next block started when this one finished
+#endif
+}
+
 void SdAdcClass::ExecuteCallbacks()
 {
+	if (decimation != 0)
+	{
+		ExecuteContinuousCallbacks();
+		return;
+	}
+
 	TaskCriticalSectionLocker lock;
+#if SUPPORT_ADC_PROFILING
+	const uint32_t callbacksStartedTicks = StepTimer::GetTimerTicks();
+#endif
 	const uint32_t now = millis();
 	const volatile uint16_t *p = results;
 	const uint32_t channelsPreviouslyEnabled = device->SEQCTRL.reg;
@@ -394,17 +672,19 @@ void SdAdcClass::ExecuteCallbacks()
 		{
 			const uint16_t currentResult = *p++;
 			resultsByChannel[i] = currentResult;
-			if (now - ticksAtLastCall[i] >= ticksPerCall[i])
+			ticksAtLastCall[i] = now;
+			++conversionCounts[i];
+			const AnalogInCallbackFunction fn = callbackFunctions[i];
+			if (fn != nullptr)
 			{
-				ticksAtLastCall[i] = now;
-				const AnalogInCallbackFunction fn = callbackFunctions[i];
-				if (fn != nullptr)
-				{
-					fn(callbackParams[i], currentResult);
-				}
+				fn(callbackParams[i], currentResult);
 			}
 		}
 	}
+
+#if SUPPORT_ADC_PROFILING
+	RecordTimes(callbacksStartedTicks);
+#endif
 }
 
 bool SdAdcClass::InternalEnableChannel(unsigned int chan, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t p_ticksPerCall)
@@ -439,9 +719,8 @@ bool SdAdcClass::InternalEnableChannel(unsigned int chan, AnalogInCallbackFuncti
 				}
 				hri_sdadc_wait_for_sync(device, SDADC_SYNCBUSY_SWRST);
 
-				// Min SDADC clock is 1MHz, max is 6MHz. GCLK0 is 48MHz, divided by prescaler 8 is 6MHz
-				static constexpr uint16_t SDADC_OSR_256 = 0x02;
-				hri_sdadc_write_CTRLB_reg(device, SDADC_CTRLB_PRESCALER(8/2 - 1) | SDADC_CTRLB_OSR(SDADC_OSR_256) | SDADC_CTRLB_SKPCNT(4));
+				hri_sdadc_write_CTRLB_reg(device, GetCtrlB());
+				hri_sdadc_write_CTRLC_reg(device, (decimation != 0) ? SDADC_CTRLC_FREERUN : 0);
 				hri_sdadc_write_REFCTRL_reg(device, SDADC_REFCTRL_REFSEL_INTVCC | SDADC_REFCTRL_REFRANGE(0x3));
 				hri_sdadc_write_EVCTRL_reg(device, SDADC_EVCTRL_RESRDYEO);
 				hri_sdadc_write_WINLT_reg(device, 0);
@@ -477,8 +756,7 @@ static AdcBase *adcs[2];
 namespace AnalogIn
 {
 	// Analog input management task
-	constexpr size_t AnalogInTaskStackWords = 200;
-	static Task<AnalogInTaskStackWords> analogInTask;
+	static Task<StackSizes::AnalogInTaskWords> analogInTask;
 
 	// Main loop executed by the AIN task
 	extern "C" void AinLoop(void *)
@@ -492,6 +770,7 @@ namespace AnalogIn
 			{
 				if (adc->GetState() == AdcClass::State::ready)
 				{
+					Tracer::Record(Tracer::Event::adcRound, (uint16_t)(&adc - adcs));
 					adc->ExecuteCallbacks();
 				}
 				if (adc->StartConversion(&analogInTask))
@@ -523,8 +802,8 @@ namespace AnalogIn
 			}
 			else
 			{
-				// No ADCs enabled yet, or all converting
-				delay(10);
+				// No ADCs enabled yet, all converting, or no channels due yet
+				delay(2);
 			}
 		}
 	}
@@ -539,18 +818,18 @@ void AnalogIn::Init()
 
 	// Enable ADC clocks. SAMC21 has 2 ADCs but we use only the first one
 	hri_mclk_set_APBCMASK_ADC0_bit(MCLK);
-	hri_gclk_write_PCHCTRL_reg(GCLK, ADC0_GCLK_ID, GCLK_PCHCTRL_GEN_GCLK0_Val | (1 << GCLK_PCHCTRL_CHEN_Pos));
+	hri_gclk_write_PCHCTRL_reg(GCLK, ADC0_GCLK_ID, GclkTiming | (1 << GCLK_PCHCTRL_CHEN_Pos));
 
 	// SAMC21 also has a SDADC
 	hri_mclk_set_APBCMASK_SDADC_bit(MCLK);
-	hri_gclk_write_PCHCTRL_reg(GCLK, SDADC_GCLK_ID, GCLK_PCHCTRL_GEN_GCLK0_Val | (1 << GCLK_PCHCTRL_CHEN_Pos));
+	hri_gclk_write_PCHCTRL_reg(GCLK, SDADC_GCLK_ID, GclkTiming | (1 << GCLK_PCHCTRL_CHEN_Pos));
 
 	analogInTask.Create(AinLoop, "AIN", nullptr, TaskPriority::AinPriority);
 }
 
 // Enable analog input on a pin.
-// Readings will be taken and about every 'ticksPerCall' milliseconds the callback function will be called with the specified parameter and ADC reading.
-// Set ticksPerCall to 0 to get a callback on every reading.
+// The channel will be converted about every 'ticksPerCall' milliseconds and the callback function will be called with the specified parameter and ADC reading.
+// Set ticksPerCall to 0 to convert the channel on every round of conversions.
 bool AnalogIn::EnableChannel(Pin pin, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t ticksPerCall, bool useAlternateAdc)
 {
 	if (pin < ARRAY_SIZE(PinTable))
@@ -565,8 +844,7 @@ bool AnalogIn::EnableChannel(Pin pin, AnalogInCallbackFunction fn, CallbackParam
 	return false;
 }
 
-// Readings will be taken and about every 'ticksPerCall' milliseconds the callback function will be called with the specified parameter and ADC reading.
-// Set ticksPerCall to 0 to get a callback on every reading.
+// Change the callback and conversion interval of an enabled channel
 bool AnalogIn::SetCallback(Pin pin, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t ticksPerCall, bool useAlternateAdc)
 {
 	if (pin < ARRAY_SIZE(PinTable))
@@ -581,6 +859,16 @@ bool AnalogIn::SetCallback(Pin pin, AnalogInCallbackFunction fn, CallbackParamet
 	return false;
 }
 
+// The SAMC21 ADC has a single window mode for the whole sequence, so we can't monitor one channel with it. The callback at the end of each round still works.
+bool AnalogIn::EnableWindowMonitor(Pin pin, uint16_t threshold, AnalogInCallbackFunction fn, CallbackParameter param, bool useAlternateAdc)
+{
+	return false;
+}
+
+void AnalogIn::DisableWindowMonitor(Pin pin, bool useAlternateAdc)
+{
+}
+
 // Return whether or not the channel is enabled
 bool AnalogIn::IsChannelEnabled(Pin pin, bool useAlternateAdc)
 {
@@ -604,6 +892,49 @@ bool AnalogIn::DisableChannel(Pin pin)
 }
 #endif
 
+bool AnalogIn::SetSdAdcOversamplingRatio(unsigned int ratio)
+{
+	for (uint8_t osr = SDADC_CTRLB_OSR_OSR64_Val; osr <= SDADC_CTRLB_OSR_OSR1024_Val; ++osr)
+	{
+		if (ratio == 64u << osr)
+		{
+			static_cast<SdAdcClass*>(adcs[1])->SetOversamplingRatio(osr);
+			return true;
+		}
+	}
+	return false;
+}
+
+unsigned int AnalogIn::GetSdAdcOversamplingRatio()
+{
+	return static_cast<SdAdcClass*>(adcs[1])->GetOversamplingRatio();
+}
+
+bool AnalogIn::SetSdAdcDecimation(unsigned int decimation)
+{
+	if (decimation > SdAdcClass::MaxDecimation)
+	{
+		return false;
+	}
+	static_cast<SdAdcClass*>(adcs[1])->SetDecimation(decimation);
+	return true;
+}
+
+unsigned int AnalogIn::GetSdAdcDecimation()
+{
+	return static_cast<SdAdcClass*>(adcs[1])->GetDecimation();
+}
+
+uint32_t AnalogIn::GetSdAdcBlockTicks()
+{
+	return static_cast<SdAdcClass*>(adcs[1])->GetBlockTicks();
+}
+
+AdcInput AnalogIn::PinToAdcInput(Pin pin, bool useAlternateAdc)
+{
+	return IoPort::PinToAdcInput(pin, useAlternateAdc);
+}
+
 uint16_t AnalogIn::ReadChannel(AdcInput adcin)
 {
 	return (adcin != AdcInput::none) ? adcs[GetDeviceNumber(adcin)]->ReadChannel(GetInputNumber(adcin)) : 0;
@@ -645,6 +976,19 @@ void AnalogIn::GetDebugInfo(uint32_t &convsStarted, uint32_t &convsCompleted, ui
 	convTimeouts = conversionTimeouts;
 }
 
+// Append the conversion rate achieved by each channel since the last call
+void AnalogIn::AppendChannelRates(const StringRef& reply)
+{
+	static uint32_t whenLastReported = 0;
+	const uint32_t now = millis();
+	const uint32_t interval = max<uint32_t>(now - whenLastReported, 1);
+	whenLastReported = now;
+	for (size_t i = 0; i < ARRAY_SIZE(adcs); ++i)
+	{
+		adcs[i]->AppendChannelRates(reply, i, interval);
+	}
+}
+
 #endif
 
 // End
@@ -14,6 +14,14 @@
 #include "DmacManager.h"
 #include "IoPorts.h"
 #include "Interrupts.h"
+#include "AdcProfiler.h"
+#include <Tasks.h>
+#include <Tracer.h>
+#include <StackSizes.h>
+
+#if SUPPORT_ADC_PROFILING
+# include <Movement/StepTimer.h>
+#endif
 
 constexpr uint32_t AdcConversionTimeout = 5;		// milliseconds
 
@@ -21,14 +29,19 @@ static uint32_t conversionsStarted = 0;
 static uint32_t conversionsCompleted = 0;
 static uint32_t conversionTimeouts = 0;
 
+// Both ADCs are started together, and we wake the AIN task only when the last of them has finished.
+// This means that there is one task wakeup per round of conversions, and the task always finds all the results ready.
+static volatile unsigned int numAdcsConverting = 0;
+
 // Constants that control the DMA sequencing
 // The SAME5x errata doc from mIcrochip say that order to use averaging, we need to include the AVGCTRL register in the sequence even if it doesn't change,
 // and that the prescaler must be <= 8 when we use DMA sequencing.
 
 // In order to use averaging, we need to include the AVGCTRL register in the sequence even if it doesn't change (see the SAME5x errata doc from Microchip).
 // We have to set the AUTOSTART bit in DmaSeqVal, otherwise the ADC requires one trigger per channel converted.
+// We update CTRLB as well so that the window monitor can be enabled for just one slot. It shares the first dword with INPUTCTRL, so it doesn't lengthen the sequence.
 constexpr size_t DmaDwordsPerChannel = 2;		// the number of DMA registers we write for each channel that we sample
-constexpr uint32_t DmaSeqVal = ADC_DSEQCTRL_INPUTCTRL | ADC_DSEQCTRL_AVGCTRL | ADC_DSEQCTRL_AUTOSTART;
+constexpr uint32_t DmaSeqVal = ADC_DSEQCTRL_INPUTCTRL | ADC_DSEQCTRL_CTRLB | ADC_DSEQCTRL_AVGCTRL | ADC_DSEQCTRL_AUTOSTART;
 
 // Register values we send. These are constant except for INPUTCTRL which changes to select the required ADC channel
 constexpr uint32_t CtrlB = ADC_CTRLB_RESSEL_16BIT;
@@ -51,6 +64,7 @@ public:
 	AdcClass(Adc * const p_device, IRQn p_irqn, DmaChannel p_dmaChan, DmaTrigSource p_trigSrc);
 
 	State GetState() const { return state; }
+	size_t GetNumChannelsEnabled() const { return numChannelsEnabled; }
 	bool EnableChannel(unsigned int chan, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t p_ticksPerCall);
 	bool SetCallback(unsigned int chan, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t p_ticksPerCall);
 	bool IsChannelEnabled(unsigned int chan) const;
@@ -58,12 +72,18 @@ public:
 	uint16_t ReadChannel(unsigned int chan) const { return resultsByChannel[chan]; }
 	bool EnableTemperatureSensor(unsigned int sensorNumber, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t ticksPerCall);
 
+	bool EnableWindowMonitor(unsigned int chan, uint16_t threshold, AnalogInCallbackFunction fn, CallbackParameter param);
+	void DisableWindowMonitor(unsigned int chan);
+
 	void ResultReadyCallback(DmaCallbackReason reason);
+	void WindowMonitorInterrupt();
 	void ExecuteCallbacks();
+	void AppendChannelRates(const StringRef& reply, unsigned int adcNumber, uint32_t interval);
 
 private:
 	bool InternalEnableChannel(unsigned int chan, uint8_t ctrlB, uint8_t refCtrl, uint8_t avgCtrl, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t p_ticksPerCall);
 	size_t GetChannel(size_t slot) { return inputRegisters[DmaDwordsPerChannel * slot] & 0x1F; }
+	void SetWindowMode(uint16_t reading);
 
 	static void DmaCompleteCallback(CallbackParameter cp, DmaCallbackReason reason);
 
@@ -85,19 +105,32 @@ private:
 	CallbackParameter callbackParams[MaxSequenceLength];
 	uint32_t ticksPerCall[MaxSequenceLength];
 	uint32_t ticksAtLastCall[MaxSequenceLength];
+	uint32_t conversionCounts[MaxSequenceLength];			// how many times each slot has been converted since we last reported the rates
 	uint32_t inputRegisters[MaxSequenceLength * DmaDwordsPerChannel];
+	uint32_t sequenceRegisters[MaxSequenceLength * DmaDwordsPerChannel];	// the input registers of the slots that are due in the current round, which is what the DMA sends
+	uint8_t slotsConverting[MaxSequenceLength];				// the slots that are being converted in the current round
+	AnalogInCallbackFunction windowMonitorFunction;			// called from the ISR when the monitored slot crosses the threshold
+	CallbackParameter windowMonitorParam;
+	uint16_t windowThreshold;
+	volatile size_t windowMonitorSlot;						// the slot that has the window monitor, or MaxSequenceLength if none
+#if SUPPORT_ADC_PROFILING
+	uint32_t whenRoundStartedTicks;
+	volatile uint32_t whenRoundFinishedTicks;
+#endif
 	volatile uint16_t results[MaxSequenceLength];
 	volatile uint16_t resultsByChannel[NumAdcChannels];		// must be large enough to handle PTAT and CTAT temperature sensor inputs
 };
 
 AdcClass::AdcClass(Adc * const p_device, IRQn p_irqn, DmaChannel p_dmaChan, DmaTrigSource p_trigSrc)
 	: device(p_device), irqn(p_irqn), dmaChan(p_dmaChan), trigSrc(p_trigSrc),
-	  numChannelsEnabled(0), numChannelsConverting(0), channelsEnabled(0), taskToWake(nullptr), whenLastConversionStarted(0), state(State::noChannels)
+	  numChannelsEnabled(0), numChannelsConverting(0), channelsEnabled(0), taskToWake(nullptr), whenLastConversionStarted(0), state(State::noChannels),
+	  windowMonitorFunction(nullptr), windowThreshold(0), windowMonitorSlot(MaxSequenceLength)
 {
 	for (size_t i = 0; i < MaxSequenceLength; ++i)
 	{
 		callbackFunctions[i] = nullptr;
 		callbackParams[i].u32 = 0;
+		conversionCounts[i] = 0;
 	}
 	for (volatile uint16_t& r : resultsByChannel)
 	{
@@ -141,6 +174,89 @@ bool AdcClass::IsChannelEnabled(unsigned int chan) const
 	return (channelsEnabled & (1ul << chan)) != 0;
 }
 
+// Use the window monitor to call the function from the ISR as soon as a conversion of the channel crosses the threshold, instead of when the round of conversions is complete.
+// There is only one window monitor per ADC, so this fails if it is in use for another channel.
+bool AdcClass::EnableWindowMonitor(unsigned int chan, uint16_t threshold, AnalogInCallbackFunction fn, CallbackParameter param)
+{
+	if (threshold == 0)
+	{
+		return false;
+	}
+
+	for (size_t slot = 0; slot < numChannelsEnabled; ++slot)
+	{
+		if (GetChannel(slot) == chan)
+		{
+			if (windowMonitorSlot != MaxSequenceLength && windowMonitorSlot != slot)
+			{
+				return false;
+			}
+
+			// Mode 1 triggers when RESULT > WINLT so it detects a rising reading, mode 2 triggers when RESULT < WINUT so it detects a falling reading
+			hri_adc_write_WINLT_reg(device, threshold - 1);
+			hri_adc_write_WINUT_reg(device, threshold);
+
+			const irqflags_t flags = cpu_irq_save();
+			windowMonitorFunction = fn;
+			windowMonitorParam = param;
+			windowThreshold = threshold;
+			windowMonitorSlot = slot;
+			SetWindowMode(resultsByChannel[chan]);
+			cpu_irq_restore(flags);
+
+			hri_adc_clear_INTFLAG_reg(device, ADC_INTFLAG_WINMON);
+			hri_adc_set_INTEN_WINMON_bit(device);
+			NVIC_ClearPendingIRQ(irqn);
+			NVIC_SetPriority(irqn, NvicPriorityPins);					// it does the same job as a pin change interrupt
+			NVIC_EnableIRQ(irqn);
+			return true;
+		}
+	}
+	return false;
+}
+
+void AdcClass::DisableWindowMonitor(unsigned int chan)
+{
+	const size_t slot = windowMonitorSlot;
+	if (slot < numChannelsEnabled && GetChannel(slot) == chan)
+	{
+		hri_adc_clear_INTEN_WINMON_bit(device);
+		const irqflags_t flags = cpu_irq_save();
+		windowMonitorSlot = MaxSequenceLength;
+		inputRegisters[slot * DmaDwordsPerChannel] = (inputRegisters[slot * DmaDwordsPerChannel] & 0x0000FFFF) | (CtrlB << 16);
+		cpu_irq_restore(flags);
+	}
+}
+
+// Set the window mode of the monitored slot so that the next conversion that crosses the threshold in the other direction triggers the monitor.
+// The sequence for each round is built from inputRegisters, so this takes effect from the next round. Call this with interrupts disabled.
+void AdcClass::SetWindowMode(uint16_t reading)
+{
+	const size_t slot = windowMonitorSlot;
+	if (slot < MaxSequenceLength)
+	{
+		const uint32_t ctrlB = CtrlB | ((reading >= windowThreshold) ? ADC_CTRLB_WINMODE_MODE2 : ADC_CTRLB_WINMODE_MODE1);
+		inputRegisters[slot * DmaDwordsPerChannel] = (inputRegisters[slot * DmaDwordsPerChannel] & 0x0000FFFF) | (ctrlB << 16);
+	}
+}
+
+// Window monitor interrupt. Only the monitored slot has the window monitor enabled, so the result that triggered it must belong to that slot.
+// The DMA has already read RESULT but the register keeps its value, and the next conversion takes much longer than our interrupt latency.
+void AdcClass::WindowMonitorInterrupt()
+{
+	hri_adc_clear_INTFLAG_reg(device, ADC_INTFLAG_WINMON);
+	const size_t slot = windowMonitorSlot;
+	if (slot < MaxSequenceLength)
+	{
+		const uint16_t reading = device->RESULT.reg;
+		SetWindowMode(reading);
+		if (windowMonitorFunction != nullptr)
+		{
+			windowMonitorFunction(windowMonitorParam, reading);
+		}
+	}
+}
+
 bool AdcClass::EnableTemperatureSensor(unsigned int sensorNumber, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t p_ticksPerCall)
 {
 	if (numChannelsEnabled == MaxSequenceLength || sensorNumber >= 2)
@@ -196,7 +312,7 @@ bool AdcClass::InternalEnableChannel(unsigned int chan, uint8_t ctrlB, uint8_t r
 			//  does not produce the expected channel sequence.
 			// Workaround
 			//  Add the AVGCTRL register in the register update list (DSEQCTRL.AVGCTRL=1) and set the desired value in this list.
-			hri_adc_write_CTRLA_reg(device, ADC_CTRLA_PRESCALER_DIV8);			// GCLK1 is 60MHz, divided by 8 is 7.5MHz
+			hri_adc_write_CTRLA_reg(device, ADC_CTRLA_PRESCALER_DIV8);			// the timing GCLK is 48MHz, divided by 8 is 6MHz
 			hri_adc_write_CTRLB_reg(device, ctrlB);
 			hri_adc_write_REFCTRL_reg(device,  refCtrl);
 			hri_adc_write_EVCTRL_reg(device, ADC_EVCTRL_RESRDYEO);
@@ -262,15 +378,10 @@ bool AdcClass::InternalEnableChannel(unsigned int chan, uint8_t ctrlB, uint8_t r
 	return false;
 }
 
-// If no conversion is already in progress and there are channels to convert, start a conversion and return true; else return false
+// If no conversion is already in progress and there are channels due to be converted, start a conversion and return true; else return false
+// Each channel is converted at the rate requested when it was enabled, so we build the sequence from the channels that are due.
 bool AdcClass::StartConversion(TaskBase *p_taskToWake)
 {
-	numChannelsConverting = numChannelsEnabled;			// capture volatile variable to ensure we use a consistent value
-	if (numChannelsConverting == 0)
-	{
-		return false;
-	}
-
 	if (state == State::converting)
 	{
 		if (millis() - whenLastConversionStarted < AdcConversionTimeout)
@@ -279,6 +390,30 @@ bool AdcClass::StartConversion(TaskBase *p_taskToWake)
 		}
 		++conversionTimeouts;
 		//TODO should we reset the ADC here?
+		// Retry the same sequence
+	}
+	else
+	{
+		const size_t numSlots = numChannelsEnabled;			// capture volatile variable to ensure we use a consistent value
+		const uint32_t now = millis();
+		numChannelsConverting = 0;
+		for (size_t slot = 0; slot < numSlots; ++slot)
+		{
+			if (now - ticksAtLastCall[slot] >= ticksPerCall[slot])
+			{
+				slotsConverting[numChannelsConverting] = slot;
+				for (size_t i = 0; i < DmaDwordsPerChannel; ++i)
+				{
+					sequenceRegisters[numChannelsConverting * DmaDwordsPerChannel + i] = inputRegisters[slot * DmaDwordsPerChannel + i];
+				}
+				++numChannelsConverting;
+			}
+		}
+	}
+
+	if (numChannelsConverting == 0)
+	{
+		return false;
 	}
 
 	taskToWake = p_taskToWake;
@@ -292,7 +427,7 @@ bool AdcClass::StartConversion(TaskBase *p_taskToWake)
 	DmacManager::SetDestinationAddress(dmaChan + 1, results);
 	DmacManager::SetDataLength(dmaChan + 1, numChannelsConverting);
 
-	DmacManager::SetSourceAddress(dmaChan, inputRegisters);
+	DmacManager::SetSourceAddress(dmaChan, sequenceRegisters);
 	DmacManager::SetDataLength(dmaChan, numChannelsConverting * DmaDwordsPerChannel);
 
 	{
@@ -304,6 +439,13 @@ bool AdcClass::StartConversion(TaskBase *p_taskToWake)
 		DmacManager::EnableChannel(dmaChan + 1, AdcRxDmaPriority);
 		DmacManager::EnableChannel(dmaChan, AdcTxDmaPriority);
 
+		if (state != State::converting)					// if we are restarting a conversion that timed out, it is already counted
+		{
+			++numAdcsConverting;
+		}
+#if SUPPORT_ADC_PROFILING
+		whenRoundStartedTicks = StepTimer::GetTimerTicks();
+#endif
 		state = State::converting;
 		++conversionsStarted;
 	}
@@ -315,18 +457,48 @@ bool AdcClass::StartConversion(TaskBase *p_taskToWake)
 void AdcClass::ExecuteCallbacks()
 {
 	TaskCriticalSectionLocker lock;
+#if SUPPORT_ADC_PROFILING
+	const uint32_t callbacksStartedTicks = StepTimer::GetTimerTicks();
+#endif
 	const uint32_t now = millis();
 	for (size_t i = 0; i < numChannelsConverting; ++i)
 	{
+		const size_t slot = slotsConverting[i];
 		const uint16_t currentResult = results[i];
-		resultsByChannel[GetChannel(i)] = currentResult;
-		if (now - ticksAtLastCall[i] >= ticksPerCall[i])
+		resultsByChannel[GetChannel(slot)] = currentResult;
+		ticksAtLastCall[slot] = now;
+		++conversionCounts[slot];
+		if (slot == windowMonitorSlot)
 		{
-			ticksAtLastCall[i] = now;
-			if (callbackFunctions[i] != nullptr)
-			{
-				callbackFunctions[i](callbackParams[i], currentResult);
-			}
+			InterruptCriticalSectionLocker lock2;
+			SetWindowMode(currentResult);					// in case we missed a window monitor interrupt
+		}
+		if (callbackFunctions[slot] != nullptr)
+		{
+			callbackFunctions[slot](callbackParams[slot], currentResult);
+		}
+	}
+
+#if SUPPORT_ADC_PROFILING
+	const uint32_t callbacksFinishedTicks = StepTimer::GetTimerTicks();
+	AdcProfiler::Record(AdcProfiler::Point::round, whenRoundFinishedTicks - whenRoundStartedTicks);
+	AdcProfiler::Record(AdcProfiler::Point::callbacks, callbacksFinishedTicks - callbacksStartedTicks);
+	AdcProfiler::Record(AdcProfiler::Point::latency, callbacksFinishedTicks - whenRoundFinishedTicks);
+#endif
+}
+
+// Append the achieved conversion rate of each channel over the last 'interval' milliseconds, and reset the counts
+void AdcClass::AppendChannelRates(const StringRef& reply, unsigned int adcNumber, uint32_t interval)
+{
+	TaskCriticalSectionLocker lock;
+	const size_t numSlots = numChannelsEnabled;
+	if (numSlots != 0)
+	{
+		reply.catf("\nADC%u conversions/sec:", adcNumber);
+		for (size_t slot = 0; slot < numSlots; ++slot)
+		{
+			reply.catf(" %u:%" PRIu32, (unsigned int)GetChannel(slot), (conversionCounts[slot] * 1000)/interval);
+			conversionCounts[slot] = 0;
 		}
 	}
 }
@@ -334,12 +506,19 @@ void AdcClass::ExecuteCallbacks()
 // Indirect callback from the DMA controller ISR
 void AdcClass::ResultReadyCallback(DmaCallbackReason reason)
 {
+#if SUPPORT_ADC_PROFILING
+	whenRoundFinishedTicks = StepTimer::GetTimerTicks();
+#endif
 	dmaFinishedReason = reason;
 	state = State::ready;
 	++conversionsCompleted;
 	DmacManager::DisableChannel(dmaChan);			// disable the sequencer DMA, just in case it is out of sync
 	DmacManager::DisableChannel(dmaChan + 1);		// disable the reader DMA too
-	if (taskToWake != nullptr)
+	if (numAdcsConverting != 0)
+	{
+		--numAdcsConverting;
+	}
+	if (numAdcsConverting == 0 && taskToWake != nullptr)
 	{
 		taskToWake->GiveFromISR();
 	}
@@ -358,11 +537,52 @@ static AdcClass Adcs[] =
 	AdcClass(ADC1, ADC1_0_IRQn, Adc1TxDmaChannel, DmaTrigSource::adc1_resrdy)
 };
 
+// Window monitor interrupt handlers
+extern "C" void ADC0_0_Handler()
+{
+	IsrTimer timer(IsrId::adc);
+	Adcs[0].WindowMonitorInterrupt();
+}
+
+extern "C" void ADC1_0_Handler()
+{
+	IsrTimer timer(IsrId::adc);
+	Adcs[1].WindowMonitorInterrupt();
+}
+
 namespace AnalogIn
 {
 	// Analog input management task
-	constexpr size_t AnalogInTaskStackWords = 200;
-	static Task<AnalogInTaskStackWords> analogInTask;
+	static Task<StackSizes::AnalogInTaskWords> analogInTask;
+
+	// Pins that are connected to an input of both ADCs. The pin table lists just one of them, but we convert each of these pins on whichever ADC has fewer
+	// channels enabled when the pin is enabled. Both ADCs convert their sequences at the same time, so this shortens the round and the results are fresher.
+	struct DualAdcPin
+	{
+		Pin pin;
+		AdcInput inputs[2];							// the input on ADC0 and the input on ADC1
+	};
+
+	static constexpr DualAdcPin DualAdcPins[] =
+	{
+		{ PortBPin(8), { AdcInput::adc0_2, AdcInput::adc1_0 } },
+		{ PortBPin(9), { AdcInput::adc0_3, AdcInput::adc1_1 } },
+	};
+
+	static AdcInput dualAdcPinInputs[ARRAY_SIZE(DualAdcPins)] = { AdcInput::none, AdcInput::none };	// the input we chose for each dual ADC pin, or none if it isn't enabled
+
+	// Return the index of the pin in DualAdcPins, or -1 if it isn't there
+	static int FindDualAdcPin(Pin pin)
+	{
+		for (size_t i = 0; i < ARRAY_SIZE(DualAdcPins); ++i)
+		{
+			if (DualAdcPins[i].pin == pin)
+			{
+				return (int)i;
+			}
+		}
+		return -1;
+	}
 
 	// Main loop executed by the AIN task
 	extern "C" void AinLoop(void *)
@@ -376,6 +596,7 @@ namespace AnalogIn
 			{
 				if (adc.GetState() == AdcClass::State::ready)
 				{
+					Tracer::Record(Tracer::Event::adcRound, (uint16_t)(&adc - Adcs));
 					adc.ExecuteCallbacks();
 				}
 
@@ -395,8 +616,8 @@ namespace AnalogIn
 			}
 			else
 			{
-				// No ADCs enabled yet, or all converting
-				delay(10);
+				// No ADCs enabled yet, all converting, or no channels due yet
+				delay(2);
 			}
 		}
 	}
@@ -407,9 +628,9 @@ void AnalogIn::Init()
 {
 	// Enable ADC clocks
 	hri_mclk_set_APBDMASK_ADC0_bit(MCLK);
-	hri_gclk_write_PCHCTRL_reg(GCLK, ADC0_GCLK_ID, GCLK_PCHCTRL_GEN_GCLK1_Val | (1 << GCLK_PCHCTRL_CHEN_Pos));
+	hri_gclk_write_PCHCTRL_reg(GCLK, ADC0_GCLK_ID, GclkTiming | (1 << GCLK_PCHCTRL_CHEN_Pos));
 	hri_mclk_set_APBDMASK_ADC1_bit(MCLK);
-	hri_gclk_write_PCHCTRL_reg(GCLK, ADC1_GCLK_ID, GCLK_PCHCTRL_GEN_GCLK1_Val | (1 << GCLK_PCHCTRL_CHEN_Pos));
+	hri_gclk_write_PCHCTRL_reg(GCLK, ADC1_GCLK_ID, GclkTiming | (1 << GCLK_PCHCTRL_CHEN_Pos));
 
 #if 0
 	// Set the supply controller to on-demand mode so that we can get at both temperature sensors
@@ -422,13 +643,21 @@ void AnalogIn::Init()
 }
 
 // Enable analog input on a pin.
-// Readings will be taken and about every 'ticksPerCall' milliseconds the callback function will be called with the specified parameter and ADC reading.
-// Set ticksPerCall to 0 to get a callback on every reading.
+// The channel will be converted about every 'ticksPerCall' milliseconds and the callback function will be called with the specified parameter and ADC reading.
+// Set ticksPerCall to 0 to convert the channel on every round of conversions.
+// If the pin is connected to both ADCs, it is converted on the one that has fewer channels enabled.
 bool AnalogIn::EnableChannel(Pin pin, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t ticksPerCall, bool useAlternateAdc)
 {
 	if (pin < ARRAY_SIZE(PinTable))
 	{
-		const AdcInput adcin = IoPort::PinToAdcInput(pin, useAlternateAdc);
+		const int dualIndex = FindDualAdcPin(pin);
+		if (dualIndex >= 0 && dualAdcPinInputs[dualIndex] == AdcInput::none)
+		{
+			const size_t adcNumber = (Adcs[1].GetNumChannelsEnabled() < Adcs[0].GetNumChannelsEnabled()) ? 1 : 0;
+			dualAdcPinInputs[dualIndex] = DualAdcPins[dualIndex].inputs[adcNumber];
+		}
+
+		const AdcInput adcin = PinToAdcInput(pin, useAlternateAdc);
 		if (adcin != AdcInput::none)
 		{
 			IoPort::SetPinMode(pin, AIN);
@@ -438,13 +667,12 @@ bool AnalogIn::EnableChannel(Pin pin, AnalogInCallbackFunction fn, CallbackParam
 	return false;
 }
 
-// Readings will be taken and about every 'ticksPerCall' milliseconds the callback function will be called with the specified parameter and ADC reading.
-// Set ticksPerCall to 0 to get a callback on every reading.
+// Change the callback and conversion interval of an enabled channel
 bool AnalogIn::SetCallback(Pin pin, AnalogInCallbackFunction fn, CallbackParameter param, uint32_t ticksPerCall, bool useAlternateAdc)
 {
 	if (pin < ARRAY_SIZE(PinTable))
 	{
-		const AdcInput adcin = IoPort::PinToAdcInput(pin, useAlternateAdc);
+		const AdcInput adcin = PinToAdcInput(pin, useAlternateAdc);
 		if (adcin != AdcInput::none)
 		{
 			IoPort::SetPinMode(pin, AIN);
@@ -454,12 +682,37 @@ bool AnalogIn::SetCallback(Pin pin, AnalogInCallbackFunction fn, CallbackParamet
 	return false;
 }
 
+bool AnalogIn::EnableWindowMonitor(Pin pin, uint16_t threshold, AnalogInCallbackFunction fn, CallbackParameter param, bool useAlternateAdc)
+{
+	if (pin < ARRAY_SIZE(PinTable))
+	{
+		const AdcInput adcin = PinToAdcInput(pin, useAlternateAdc);
+		if (adcin != AdcInput::none)
+		{
+			return Adcs[GetDeviceNumber(adcin)].EnableWindowMonitor(GetInputNumber(adcin), threshold, fn, param);
+		}
+	}
+	return false;
+}
+
+void AnalogIn::DisableWindowMonitor(Pin pin, bool useAlternateAdc)
+{
+	if (pin < ARRAY_SIZE(PinTable))
+	{
+		const AdcInput adcin = PinToAdcInput(pin, useAlternateAdc);
+		if (adcin != AdcInput::none)
+		{
+			Adcs[GetDeviceNumber(adcin)].DisableWindowMonitor(GetInputNumber(adcin));
+		}
+	}
+}
+
 // Return whether or not the channel is enabled
 bool AnalogIn::IsChannelEnabled(Pin pin, bool useAlternateAdc)
 {
 	if (pin < ARRAY_SIZE(PinTable))
 	{
-		const AdcInput adcin = IoPort::PinToAdcInput(pin, useAlternateAdc);
+		const AdcInput adcin = PinToAdcInput(pin, useAlternateAdc);
 		if (adcin != AdcInput::none)
 		{
 			return Adcs[GetDeviceNumber(adcin)].IsChannelEnabled(GetInputNumber(adcin));
@@ -477,6 +730,13 @@ bool AnalogIn::DisableChannel(Pin pin)
 }
 #endif
 
+// Get the ADC input that a pin is converted on
+AdcInput AnalogIn::PinToAdcInput(Pin pin, bool useAlternateAdc)
+{
+	const int dualIndex = FindDualAdcPin(pin);
+	return (dualIndex >= 0 && dualAdcPinInputs[dualIndex] != AdcInput::none) ? dualAdcPinInputs[dualIndex] : IoPort::PinToAdcInput(pin, useAlternateAdc);
+}
+
 uint16_t AnalogIn::ReadChannel(AdcInput adcin)
 {
 	return (adcin != AdcInput::none) ? Adcs[GetDeviceNumber(adcin)].ReadChannel(GetInputNumber(adcin)) : 0;
@@ -500,6 +760,19 @@ void AnalogIn::GetDebugInfo(uint32_t &convsStarted, uint32_t &convsCompleted, ui
 	convTimeouts = conversionTimeouts;
 }
 
+// Append the conversion rate achieved by each channel since the last call
+void AnalogIn::AppendChannelRates(const StringRef& reply)
+{
+	static uint32_t whenLastReported = 0;
+	const uint32_t now = millis();
+	const uint32_t interval = max<uint32_t>(now - whenLastReported, 1);
+	whenLastReported = now;
+	for (size_t i = 0; i < ARRAY_SIZE(Adcs); ++i)
+	{
+		Adcs[i].AppendChannelRates(reply, i, interval);
+	}
+}
+
 #endif
 
 // End
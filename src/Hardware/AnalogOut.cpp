@@ -8,6 +8,10 @@
 #include "AnalogOut.h"
 #include "IoPorts.h"
 
+#if SUPPORT_PWM_SEQUENCES
+# include "DmacManager.h"
+#endif
+
 #if defined(SAME51)
 # include "hri_tc_e51.h"
 # include "hri_tcc_e51.h"
@@ -31,13 +35,47 @@ namespace AnalogOut
 		return lrintf(f * (float)(top + 1));
 	}
 
+#if USE_STAGGERED_PWM
+	// High current outputs that all switch on at the same time cause ripple on VIN and noise on the thermistor readings, so we stagger them.
+	// Odd-numbered TCC outputs have inverted polarity and compare values, so their pulses come at the end of each period instead of the start.
+	// Each TC or TCC that we start also begins at a different point in its period. They all use the same clock, so this phase difference persists
+	// between devices running at the same frequency.
+	constexpr uint32_t TccInvertedOutputs = 0b101010;
+	constexpr unsigned int NumPwmPhases = 4;
+	static unsigned int numPwmDevicesStarted = 0;
+
+	static inline bool IsTccOutputInverted(unsigned int output)
+	{
+		return (TccInvertedOutputs & (1u << output)) != 0;
+	}
+
+	// Return the count to start a TC or TCC at, so that it is out of phase with the previous ones we started
+	static uint32_t GetStartingCount(uint32_t top)
+	{
+		return ((top + 1)/NumPwmPhases) * (numPwmDevicesStarted++ % NumPwmPhases);
+	}
+#endif
+
+	// Return the compare value for a TCC output, allowing for inverted polarity
+	static inline uint32_t GetTccCompareValue(unsigned int output, float val, uint32_t top)
+	{
+#if USE_STAGGERED_PWM
+		if (IsTccOutputInverted(output))
+		{
+			return min<uint32_t>(ConvertRange(1.0 - val, top), top);		// the output is low until the counter reaches the compare value
+		}
+#endif
+		return ConvertRange(val, top);
+	}
+
+	static constexpr unsigned int PrescalerShifts[] = { 0, 1, 2, 3, 4, 6, 8, 10 };		// available prescalers are 1 2 4 8 16 64 256 1024
+
 	// Choose the most appropriate prescaler for the PWM frequency we want.
-	// Some TCs share a clock selection, so we always use GCLK1 as the clock
+	// Some TCs share a clock selection, so we always use the peripheral GCLK as the clock
 	// 'counterBits' is either 16 or 8
 	// Return the prescaler register value
 	static uint32_t ChoosePrescaler(uint16_t freq, unsigned int counterBits, uint32_t& top)
 	{
-		static const unsigned int PrescalerShifts[] = { 0, 1, 2, 3, 4, 6, 8, 10 };		// available prescalers are 1 2 4 8 16 64 256 1024
 		for (uint32_t i = 0; i < ARRAY_SIZE(PrescalerShifts); ++i)
 		{
 			if ((SystemPeripheralClock >> (PrescalerShifts[i] + counterBits)) <= (uint32_t)freq)
@@ -50,19 +88,105 @@ namespace AnalogOut
 		return ARRAY_SIZE(PrescalerShifts) - 1;
 	}
 
-	// Write PWM to the specified TC device. 'output' may be 0 or 1.
-	static bool AnalogWriteTc(Pin pin, unsigned int device, unsigned int output, float val, PwmFrequency freq)
+#if SUPPORT_SERVO_OUTPUTS
+	// Convert a servo pulse width, given as a fraction of the period at the servo frequency, to a fraction of the period of the device that generates it.
+	// A servo only cares about the pulse width, so this lets it share a device running at a lower frequency, or use TC output 0 which can't set the period.
+	static float ConvertServoPulse(float val, PwmFrequency servoFreq, bool invert, unsigned int prescaler, uint32_t top)
 	{
-		static volatile Tc* const TcDevices[] =
-		{
-			TC0, TC1, TC2, TC3, TC4,
+		const float deviceVal = min<float>(val * (float)(SystemPeripheralClock >> PrescalerShifts[prescaler])/((float)servoFreq * (float)(top + 1)), 1.0);
+		return (invert) ? 1.0 - deviceVal : deviceVal;
+	}
+#endif
+
+	static volatile Tc* const TcDevices[] =
+	{
+		TC0, TC1, TC2, TC3, TC4,
+#ifdef SAME51
+		TC5		// TC6 and TC7 exist but are reserved for the step clock
+#endif
+	};
+	static uint16_t tcFreq[ARRAY_SIZE(TcDevices)] = { 0 };
+	static uint32_t tcTop[ARRAY_SIZE(TcDevices)] = { 0 };
+
+	static volatile Tcc* const TccDevices[] =
+	{
+		TCC0, TCC1, TCC2,
+#ifdef SAME51
+		TCC3, TCC4
+#endif
+	};
+	static constexpr unsigned int TccCounterBits[ARRAY_SIZE(TccDevices)] =
+	{
+		24, 24, 16,
 #ifdef SAME51
-			TC5		// TC6 and TC7 exist but are reserved for the step clock
+		16, 16
 #endif
-		};
-		static uint16_t tcFreq[ARRAY_SIZE(TcDevices)] = { 0 };
-		static uint32_t tcTop[ARRAY_SIZE(TcDevices)] = { 0 };
+	};
+	static uint16_t tccFreq[ARRAY_SIZE(TccDevices)] = { 0 };
+	static uint32_t tccTop[ARRAY_SIZE(TccDevices)] = { 0 };
 
+	// All the outputs of a TC or TCC run at the same frequency, so we keep track of which outputs are in use. A pin that asks for a frequency
+	// that a device shared with other pins isn't running at gets its other device if it has one, otherwise it has to share the existing frequency.
+	enum class PwmDevice : uint8_t { none = 0, tc, tcc };
+	static PwmDevice pinDevices[ARRAY_SIZE(PinTable)] = { };		// the device that generates PWM on each pin
+	static uint8_t tcOutputsUsed[ARRAY_SIZE(TcDevices)] = { 0 };	// bitmap of the outputs of each TC that are assigned to pins
+	static uint8_t tccOutputsUsed[ARRAY_SIZE(TccDevices)] = { 0 };	// bitmap of the outputs of each TCC that are assigned to pins
+
+	static inline bool HaveTc(Pin pin) { return PinTable[pin].tc != TcOutput::none && GetDeviceNumber(PinTable[pin].tc) < ARRAY_SIZE(TcDevices); }
+	static inline bool HaveTcc(Pin pin) { return PinTable[pin].tcc != TccOutput::none && GetDeviceNumber(PinTable[pin].tcc) < ARRAY_SIZE(TccDevices); }
+
+	// Return true if other outputs of the device are in use and it is running at a different frequency, so we mustn't change its frequency
+	static inline bool IsShared(uint16_t deviceFreq, uint8_t outputsUsed, unsigned int output, PwmFrequency freq)
+	{
+		return (outputsUsed & ~(1u << output)) != 0 && deviceFreq != 0 && deviceFreq != freq;
+	}
+
+	static void ReleaseDevice(Pin pin)
+	{
+		switch (pinDevices[pin])
+		{
+		case PwmDevice::tc:
+			tcOutputsUsed[GetDeviceNumber(PinTable[pin].tc)] &= ~(1u << GetOutputNumber(PinTable[pin].tc));
+			break;
+
+		case PwmDevice::tcc:
+			tccOutputsUsed[GetDeviceNumber(PinTable[pin].tcc)] &= ~(1u << GetOutputNumber(PinTable[pin].tcc));
+			break;
+
+		default:
+			break;
+		}
+		pinDevices[pin] = PwmDevice::none;
+	}
+
+	// Choose the device to generate PWM on a pin at the requested frequency. We prefer a TCC because it has a period register and more resolution.
+	static PwmDevice AssignDevice(Pin pin, PwmFrequency freq)
+	{
+		ReleaseDevice(pin);
+		const bool haveTcc = HaveTcc(pin);
+		const bool haveTc = HaveTc(pin);
+		const TccOutput tcc = PinTable[pin].tcc;
+		const TcOutput tc = PinTable[pin].tc;
+		const PwmDevice dev = (haveTcc && !IsShared(tccFreq[GetDeviceNumber(tcc)], tccOutputsUsed[GetDeviceNumber(tcc)], GetOutputNumber(tcc), freq)) ? PwmDevice::tcc
+							: (haveTc && !IsShared(tcFreq[GetDeviceNumber(tc)], tcOutputsUsed[GetDeviceNumber(tc)], GetOutputNumber(tc), freq)) ? PwmDevice::tc
+								: (haveTcc) ? PwmDevice::tcc					// no device is free to run at the requested frequency, so share one at its existing frequency
+									: (haveTc) ? PwmDevice::tc
+										: PwmDevice::none;
+		if (dev == PwmDevice::tcc)
+		{
+			tccOutputsUsed[GetDeviceNumber(tcc)] |= 1u << GetOutputNumber(tcc);
+		}
+		else if (dev == PwmDevice::tc)
+		{
+			tcOutputsUsed[GetDeviceNumber(tc)] |= 1u << GetOutputNumber(tc);
+		}
+		pinDevices[pin] = dev;
+		return dev;
+	}
+
+	// Write PWM to the specified TC device. 'output' may be 0 or 1. If 'servoFreq' is not zero then 'val' is a servo pulse width at that frequency.
+	static bool AnalogWriteTc(Pin pin, unsigned int device, unsigned int output, float val, PwmFrequency freq, PwmFrequency servoFreq = 0, bool servoInvert = false)
+	{
 		if (device < ARRAY_SIZE(TcDevices))
 		{
 			if (freq == 0)
@@ -82,17 +206,17 @@ namespace AnalogOut
 					tcTop[device] = 0xFFFF;
 				}
 
+#if SUPPORT_SERVO_OUTPUTS
+				if (servoFreq != 0)
+				{
+					val = ConvertServoPulse(val, servoFreq, servoInvert, prescaler, tcTop[device]);
+				}
+#endif
 				const uint32_t cc = ConvertRange(val, tcTop[device]);
 
 				if (tcFreq[device] == 0)
 				{
-					EnableTcClock(device,
-#if defined(SAME51)
-						GCLK_PCHCTRL_GEN_GCLK1_Val
-#elif defined(SAMC21)
-						GCLK_PCHCTRL_GEN_GCLK0_Val
-#endif
-						);
+					EnableTcClock(device, GclkPeripheral);
 
 					// Initialise the TC
 					hri_tc_clear_CTRLA_ENABLE_bit(tcdev);
@@ -120,12 +244,22 @@ namespace AnalogOut
 				tcdev->COUNT16.CC[output].bit.CC = cc;
 				tcdev->COUNT16.CCBUF[output].bit.CCBUF = cc;
 				hri_tc_set_CTRLA_ENABLE_bit(tcdev);
+#if USE_STAGGERED_PWM
+				hri_tccount16_write_COUNT_COUNT_bf(tcdev, GetStartingCount(tcTop[device]));
+#else
 				hri_tccount16_write_COUNT_COUNT_bf(tcdev, 0);
+#endif
 				tcFreq[device] = freq;
 			}
 			else
 			{
 				// Just update the compare register
+#if SUPPORT_SERVO_OUTPUTS
+				if (servoFreq != 0)
+				{
+					val = ConvertServoPulse(val, servoFreq, servoInvert, tcdev->COUNT16.CTRLA.bit.PRESCALER, tcTop[device]);
+				}
+#endif
 				const uint16_t cc = ConvertRange(val, tcTop[device]);
 				hri_tccount16_write_CCBUF_CCBUF_bf(tcdev, output, cc);
 			}
@@ -136,26 +270,9 @@ namespace AnalogOut
 		return false;
 	}
 
-	// Write PWM to the specified TCC device. 'output' may be 0..5.
-	static bool AnalogWriteTcc(Pin pin, unsigned int device, unsigned int output, unsigned int peri, float val, PwmFrequency freq)
+	// Write PWM to the specified TCC device. 'output' may be 0..5. If 'servoFreq' is not zero then 'val' is a servo pulse width at that frequency.
+	static bool AnalogWriteTcc(Pin pin, unsigned int device, unsigned int output, unsigned int peri, float val, PwmFrequency freq, PwmFrequency servoFreq = 0, bool servoInvert = false)
 	{
-		static volatile Tcc* const TccDevices[] =
-		{
-			TCC0, TCC1, TCC2,
-#ifdef SAME51
-			TCC3, TCC4
-#endif
-		};
-		static constexpr unsigned int TccCounterBits[ARRAY_SIZE(TccDevices)] =
-		{
-			24, 24, 16,
-#ifdef SAME51
-			16, 16
-#endif
-		};
-		static uint16_t tccFreq[ARRAY_SIZE(TccDevices)] = { 0 };
-		static uint32_t tccTop[ARRAY_SIZE(TccDevices)] = { 0 };
-
 		if (device < ARRAY_SIZE(TccDevices))
 		{
 			if (freq == 0)
@@ -168,24 +285,28 @@ namespace AnalogOut
 			if (freq != tccFreq[device])
 			{
 				const uint32_t prescaler = ChoosePrescaler(freq, TccCounterBits[device], tccTop[device]);
-				const uint32_t cc = ConvertRange(val, tccTop[device]);
+#if SUPPORT_SERVO_OUTPUTS
+				if (servoFreq != 0)
+				{
+					val = ConvertServoPulse(val, servoFreq, servoInvert, prescaler, tccTop[device]);
+				}
+#endif
+				const uint32_t cc = GetTccCompareValue(output, val, tccTop[device]);
 
 				if (tccFreq[device] == 0)
 				{
-					EnableTccClock(device,
-#if defined(SAME51)
-						GCLK_PCHCTRL_GEN_GCLK1_Val
-#elif defined(SAMC21)
-						GCLK_PCHCTRL_GEN_GCLK0_Val
-#endif
-						);
+					EnableTccClock(device, GclkPeripheral);
 
 					// Initialise the TCC
 					hri_tcc_clear_CTRLA_ENABLE_bit(tccdev);
 					hri_tcc_set_CTRLA_SWRST_bit(tccdev);
 					tccdev->CTRLA.bit.PRESCALER = prescaler;
 					tccdev->CTRLA.bit.RESOLUTION = 0;
+#if USE_STAGGERED_PWM
+					hri_tcc_write_WAVE_reg(tccdev, TCC_WAVE_WAVEGEN_NPWM | TCC_WAVE_POL(TccInvertedOutputs));
+#else
 					hri_tcc_write_WAVE_WAVEGEN_bf(tccdev, TCC_WAVE_WAVEGEN_NPWM_Val);
+#endif
 				}
 				else
 				{
@@ -198,14 +319,24 @@ namespace AnalogOut
 				tccdev->CCBUF[output].bit.CCBUF = cc;
 				tccdev->CC[output].bit.CC = cc;
 				hri_tcc_set_CTRLA_ENABLE_bit(tccdev);
+#if USE_STAGGERED_PWM
+				hri_tcc_write_COUNT_reg(tccdev, GetStartingCount(tccTop[device]));
+#else
 				hri_tcc_write_COUNT_reg(tccdev, 0);
+#endif
 
 				tccFreq[device] = freq;
 			}
 			else
 			{
 				// Just update the compare register
-				const uint32_t cc = ConvertRange(val, tccTop[device]);
+#if SUPPORT_SERVO_OUTPUTS
+				if (servoFreq != 0)
+				{
+					val = ConvertServoPulse(val, servoFreq, servoInvert, tccdev->CTRLA.bit.PRESCALER, tccTop[device]);
+				}
+#endif
+				const uint32_t cc = GetTccCompareValue(output, val, tccTop[device]);
 				hri_tcc_write_CCBUF_CCBUF_bf(tccdev, output, cc);
 			}
 
@@ -214,52 +345,368 @@ namespace AnalogOut
 		}
 		return false;
 	}
+
+#if SUPPORT_PWM_SEQUENCES
+	// A PWM sequence is run by a DMA channel that is triggered by the overflow of the TCC. The channel descriptor holds the first compare value for the hold time
+	// and each linked descriptor holds one step of the ramp for its share of the ramp time. The descriptors don't increment the source address, so holding
+	// a value for many PWM periods only needs one table entry.
+	constexpr size_t NumRampSteps = 16;
+	constexpr uint32_t MaxPeriodsPerDescriptor = 65535;				// the block transfer count is 16 bits
+# if defined(SAME51)
+	constexpr size_t NumPwmSequences = 4;
+# else
+	constexpr size_t NumPwmSequences = 2;
+# endif
+
+	struct PwmSequence
+	{
+		uint32_t compareValues[NumRampSteps + 1];					// the value to hold followed by the ramp steps
+		Pin pin;													// NoPin if this slot is free
+		DmaChannel channel;
+	};
+
+	COMPILER_ALIGNED(16) static DmacDescriptor sequenceDescriptors[NumPwmSequences][NumRampSteps];
+	static PwmSequence sequences[NumPwmSequences];
+
+	static constexpr DmaTrigSource TccOverflowTriggers[ARRAY_SIZE(TccDevices)] =
+	{
+		DmaTrigSource::tcc0_ovf, DmaTrigSource::tcc1_ovf, DmaTrigSource::tcc2_ovf,
+# ifdef SAME51
+		DmaTrigSource::tcc3_ovf, DmaTrigSource::tcc4_ovf
+# endif
+	};
+
+	static void StopSequence(size_t slot)
+	{
+		DmacManager::ReleaseChannel(sequences[slot].channel);
+		sequences[slot].pin = NoPin;
+		sequences[slot].channel = NoDmaChannel;
+	}
+
+	// Stop any sequence running on a pin. The compare value that it wrote last stays in effect.
+	static void StopSequence(Pin pin)
+	{
+		for (size_t i = 0; i < NumPwmSequences; ++i)
+		{
+			if (sequences[i].pin == pin)
+			{
+				StopSequence(i);
+			}
+		}
+	}
+
+	// Find a free sequence slot, reclaiming the slots of sequences that have finished. The last descriptor of each sequence sets the transfer complete flag.
+	static int FindFreeSequence()
+	{
+		int freeSlot = -1;
+		for (size_t i = 0; i < NumPwmSequences; ++i)
+		{
+			if (sequences[i].pin != NoPin && (DmacManager::GetChannelStatus(sequences[i].channel) & DMAC_CHINTFLAG_TCMPL) != 0)
+			{
+				StopSequence(i);
+			}
+			if (sequences[i].pin == NoPin && freeSlot < 0)
+			{
+				freeSlot = i;
+			}
+		}
+		return freeSlot;
+	}
+
+	static bool IsSequenceRunning(Pin pin)
+	{
+		for (const PwmSequence& seq : sequences)
+		{
+			if (seq.pin == pin)
+			{
+				return (DmacManager::GetChannelStatus(seq.channel) & DMAC_CHINTFLAG_TCMPL) == 0;
+			}
+		}
+		return false;
+	}
+#endif
+
+	// Analog write to DAC, PWM, TC or plain output pin. If 'servoFreq' is not zero then 'val' is a servo pulse width at that frequency.
+	// Setting the frequency of a TC or PWM pin to zero resets it so that the next call to AnalogOut with a non-zero frequency
+	// will re-initialise it. The pinMode function relies on this.
+	static void WritePwm(Pin pin, float val, PwmFrequency freq, PwmFrequency servoFreq, bool servoInvert)
+	{
+		if (pin >= ARRAY_SIZE(PinTable) || std::isnan(val))
+		{
+			return;
+		}
+
+#if SUPPORT_PWM_SEQUENCES
+		StopSequence(pin);								// the new value replaces any sequence that is running
+#endif
+
+		// if writing 0 or 1, do plain digital output for faster response
+		if (val > 0.0 && val < 1.0)
+		{
+			// The common case is that the pin already has a device running at the requested frequency
+			PwmDevice dev = pinDevices[pin];
+			if (   dev == PwmDevice::none
+				|| (dev == PwmDevice::tcc && tccFreq[GetDeviceNumber(PinTable[pin].tcc)] != freq)
+				|| (dev == PwmDevice::tc && tcFreq[GetDeviceNumber(PinTable[pin].tc)] != freq)
+			   )
+			{
+				dev = AssignDevice(pin, freq);
+			}
+
+			if (dev == PwmDevice::tcc)
+			{
+				const TccOutput tcc = PinTable[pin].tcc;
+				const unsigned int device = GetDeviceNumber(tcc);
+				const unsigned int output = GetOutputNumber(tcc);
+				const PwmFrequency f = (IsShared(tccFreq[device], tccOutputsUsed[device], output, freq)) ? tccFreq[device] : freq;
+				if (AnalogWriteTcc(pin, device, output, GetPeriNumber(tcc), val, f, servoFreq, servoInvert))
+				{
+					return;
+				}
+			}
+			else if (dev == PwmDevice::tc)
+			{
+				const TcOutput tc = PinTable[pin].tc;
+				const unsigned int device = GetDeviceNumber(tc);
+				const unsigned int output = GetOutputNumber(tc);
+				const PwmFrequency f = (IsShared(tcFreq[device], tcOutputsUsed[device], output, freq)) ? tcFreq[device] : freq;
+				if (AnalogWriteTc(pin, device, output, val, f, servoFreq, servoInvert))
+				{
+					return;
+				}
+			}
+		}
+
+		// Fall back to digital write
+		IoPort::SetPinMode(pin, ((val < 0.5) != servoInvert) ? OUTPUT_LOW : OUTPUT_HIGH);
+	}
 }
 
 // Initialise this module
 void AnalogOut::Init()
 {
-	// Nothing to do yet
+#if SUPPORT_PWM_SEQUENCES
+	for (PwmSequence& seq : sequences)
+	{
+		seq.pin = NoPin;
+		seq.channel = NoDmaChannel;
+	}
+#endif
+}
+
+// Stop the TCs and TCCs that are generating PWM from copying new compare values from their buffers, so that several outputs can be changed together.
+// Each device then updates all its outputs in one go at the start of the first PWM period after UnlockUpdates is called.
+void AnalogOut::LockUpdates()
+{
+	for (size_t i = 0; i < ARRAY_SIZE(TcDevices); ++i)
+	{
+		if (tcFreq[i] != 0)
+		{
+			TcDevices[i]->COUNT16.CTRLBSET.reg = TC_CTRLBSET_LUPD;
+			while (TcDevices[i]->COUNT16.SYNCBUSY.bit.CTRLB) { }
+		}
+	}
+	for (size_t i = 0; i < ARRAY_SIZE(TccDevices); ++i)
+	{
+		if (tccFreq[i] != 0)
+		{
+			TccDevices[i]->CTRLBSET.reg = TCC_CTRLBSET_LUPD;
+			while (TccDevices[i]->SYNCBUSY.bit.CTRLB) { }
+		}
+	}
+}
+
+void AnalogOut::UnlockUpdates()
+{
+	for (size_t i = 0; i < ARRAY_SIZE(TcDevices); ++i)
+	{
+		if (tcFreq[i] != 0)
+		{
+			TcDevices[i]->COUNT16.CTRLBCLR.reg = TC_CTRLBCLR_LUPD;
+			while (TcDevices[i]->COUNT16.SYNCBUSY.bit.CTRLB) { }
+		}
+	}
+	for (size_t i = 0; i < ARRAY_SIZE(TccDevices); ++i)
+	{
+		if (tccFreq[i] != 0)
+		{
+			TccDevices[i]->CTRLBCLR.reg = TCC_CTRLBCLR_LUPD;
+			while (TccDevices[i]->SYNCBUSY.bit.CTRLB) { }
+		}
+	}
 }
 
-// Analog write to DAC, PWM, TC or plain output pin
-// Setting the frequency of a TC or PWM pin to zero resets it so that the next call to AnalogOut with a non-zero frequency
-// will re-initialise it. The pinMode function relies on this.
 void AnalogOut::Write(Pin pin, float val, PwmFrequency freq)
 {
-	if (pin >= ARRAY_SIZE(PinTable) || std::isnan(val))
+	WritePwm(pin, val, freq, 0, false);
+}
+
+#if SUPPORT_SERVO_OUTPUTS
+
+void AnalogOut::WriteServo(Pin pin, float val, PwmFrequency freq, bool invert)
+{
+	WritePwm(pin, val, freq, freq, invert);
+}
+
+#endif
+
+void AnalogOut::Release(Pin pin)
+{
+	if (pin < ARRAY_SIZE(PinTable))
+	{
+#if SUPPORT_PWM_SEQUENCES
+		StopSequence(pin);
+#endif
+		ReleaseDevice(pin);
+	}
+}
+
+void AnalogOut::AppendPwmDetails(Pin pin, PwmFrequency requestedFreq, const StringRef& reply)
+{
+	if (pin >= ARRAY_SIZE(PinTable))
 	{
 		return;
 	}
 
-	// if writing 0 or 1, do plain digital output for faster response
-	if (val > 0.0 && val < 1.0)
+	unsigned int device, output, prescaler;
+	uint32_t top;
+	uint16_t deviceFreq;
+	uint8_t outputsUsed;
+	switch (pinDevices[pin])
 	{
+	case PwmDevice::tc:
+		device = GetDeviceNumber(PinTable[pin].tc);
+		output = GetOutputNumber(PinTable[pin].tc);
+		deviceFreq = tcFreq[device];
+		outputsUsed = tcOutputsUsed[device];
+		top = tcTop[device];
+		prescaler = TcDevices[device]->COUNT16.CTRLA.bit.PRESCALER;
+		reply.catf(", TC%u.%u", device, output);
+		break;
+
+	case PwmDevice::tcc:
+		device = GetDeviceNumber(PinTable[pin].tcc);
+		output = GetOutputNumber(PinTable[pin].tcc);
+		deviceFreq = tccFreq[device];
+		outputsUsed = tccOutputsUsed[device];
+		top = tccTop[device];
+		prescaler = TccDevices[device]->CTRLA.bit.PRESCALER;
+		reply.catf(", TCC%u.%u", device, output);
+		break;
+
+	default:
+		reply.cat((HaveTc(pin) || HaveTcc(pin)) ? ", no timer assigned yet" : ", no PWM timer");
+		return;
+	}
+
+	if (deviceFreq != 0)
+	{
+		// Report the actual frequency, because TC output 0 can't set the period and low frequencies may be out of range of the prescaler
+		reply.catf(" running at %" PRIu32 "Hz", (SystemPeripheralClock >> PrescalerShifts[prescaler])/(top + 1));
+		const unsigned int numOthers = Bitmap<uint8_t>::MakeFromRaw(outputsUsed & ~(1u << output)).CountSetBits();
+		if (numOthers != 0)
 		{
-			const TcOutput tc = PinTable[pin].tc;
-			if (tc != TcOutput::none)
+			reply.catf(" shared with %u other output%s", numOthers, (numOthers == 1) ? "" : "s");
+			if (deviceFreq != requestedFreq)
 			{
-				if (AnalogWriteTc(pin, GetDeviceNumber(tc), GetOutputNumber(tc), val, freq))
-				{
-					return;
-				}
+				reply.catf(" that set %uHz", deviceFreq);
 			}
 		}
-
+#if SUPPORT_PWM_SEQUENCES
+		if (IsSequenceRunning(pin))
 		{
-			const TccOutput tcc = PinTable[pin].tcc;
-			if (tcc != TccOutput::none)
-			{
-				if (AnalogWriteTcc(pin, GetDeviceNumber(tcc), GetOutputNumber(tcc), GetPeriNumber(tcc), val, freq))
-				{
-					return;
-				}
-			}
+			reply.cat(", sequence running");
 		}
+#endif
+	}
+}
+
+#if SUPPORT_PWM_SEQUENCES
+
+// Start a PWM sequence on a pin
+bool AnalogOut::WriteSequence(Pin pin, float startVal, uint32_t holdMillis, float endVal, uint32_t rampMillis, PwmFrequency freq)
+{
+	if (pin >= ARRAY_SIZE(PinTable) || std::isnan(startVal) || std::isnan(endVal) || freq == 0 || !HaveTcc(pin))
+	{
+		return false;
 	}
 
-	// Fall back to digital write
-	IoPort::SetPinMode(pin, (val < 0.5) ? OUTPUT_LOW : OUTPUT_HIGH);
+	StopSequence(pin);
+	PwmDevice dev = pinDevices[pin];
+	if (dev != PwmDevice::tcc || tccFreq[GetDeviceNumber(PinTable[pin].tcc)] != freq)
+	{
+		dev = AssignDevice(pin, freq);
+	}
+	if (dev != PwmDevice::tcc)
+	{
+		return false;
+	}
+
+	const TccOutput tcc = PinTable[pin].tcc;
+	const unsigned int device = GetDeviceNumber(tcc);
+	const unsigned int output = GetOutputNumber(tcc);
+	const PwmFrequency f = (IsShared(tccFreq[device], tccOutputsUsed[device], output, freq)) ? tccFreq[device] : freq;
+
+	// Work out how many PWM periods each part of the sequence lasts. If there is no ramp we still need one step to write the end value.
+	const uint32_t holdPeriods = (holdMillis * f)/1000;
+	const uint32_t rampPeriods = (rampMillis * f)/1000;
+	const size_t numSteps = constrain<uint32_t>(rampPeriods, 1, NumRampSteps);
+	const uint32_t periodsPerStep = max<uint32_t>(rampPeriods/numSteps, 1);
+	if (holdPeriods > MaxPeriodsPerDescriptor || periodsPerStep > MaxPeriodsPerDescriptor)
+	{
+		return false;
+	}
+
+	const int slot = FindFreeSequence();
+	if (slot < 0)
+	{
+		return false;
+	}
+	const DmaChannel channel = DmacManager::AllocateChannel();
+	if (channel == NoDmaChannel)
+	{
+		return false;
+	}
+
+	startVal = constrain<float>(startVal, 0.0, 1.0);
+	endVal = constrain<float>(endVal, 0.0, 1.0);
+	if (!AnalogWriteTcc(pin, device, output, GetPeriNumber(tcc), startVal, f))
+	{
+		DmacManager::ReleaseChannel(channel);
+		return false;
+	}
+
+	PwmSequence& seq = sequences[slot];
+	seq.pin = pin;
+	seq.channel = channel;
+	for (size_t i = 0; i <= numSteps; ++i)
+	{
+		seq.compareValues[i] = GetTccCompareValue(output, startVal + (endVal - startVal) * (float)i/(float)numSteps, tccTop[device]);
+	}
+
+	// Build the chain of ramp steps backwards so that each descriptor can link to the next one. The first part of the sequence goes in the channel descriptor.
+	const uint16_t btctrl = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_WORD | DMAC_BTCTRL_BLOCKACT_NOACT;
+	const uint16_t lastBtctrl = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_WORD | DMAC_BTCTRL_BLOCKACT_INT;
+	volatile void * const dst = &(TccDevices[device]->CCBUF[output].reg);
+	const size_t firstLinkedStep = (holdPeriods != 0) ? 1 : 2;
+	const DmacDescriptor *next = nullptr;
+	for (size_t i = numSteps; i >= firstLinkedStep; --i)
+	{
+		DmacDescriptor& desc = sequenceDescriptors[slot][i - 1];
+		DmacManager::InitLinkedDescriptor(desc, (next == nullptr) ? lastBtctrl : btctrl, &seq.compareValues[i], dst, periodsPerStep, next);
+		next = &desc;
+	}
+
+	DmacManager::SetBtctrl(channel, (next == nullptr) ? lastBtctrl : btctrl);
+	DmacManager::SetSourceAddress(channel, &seq.compareValues[(holdPeriods != 0) ? 0 : 1]);
+	DmacManager::SetDestinationAddress(channel, dst);
+	DmacManager::SetDataLength(channel, (holdPeriods != 0) ? holdPeriods : periodsPerStep);
+	DmacManager::SetNextDescriptor(channel, next);
+	DmacManager::SetTriggerSource(channel, TccOverflowTriggers[device]);
+	DmacManager::EnableChannel(channel, PwmSequenceDmaPriority);
+	return true;
 }
 
+#endif
+
 // End
@@ -17,6 +17,29 @@ namespace AnalogOut
 
 	// Write a PWM value to the specified pin. 'val' will be constrained to be between 0.0 and 1.0 in this module.
 	extern void Write(Pin pin, float val, PwmFrequency freq = 500);
+
+#if SUPPORT_SERVO_OUTPUTS
+	// Write a servo pulse to the specified pin. 'val' is the pulse width as a fraction of the period at 'freq', and is inverted after it has been
+	// converted to the period of the TC or TCC that drives the pin, so the pulse width stays right if that device has to run at another frequency.
+	extern void WriteServo(Pin pin, float val, PwmFrequency freq, bool invert);
+#endif
+
+	// Forget the TC or TCC that was assigned to a pin, so that another pin can have it at a different frequency
+	extern void Release(Pin pin);
+
+	// Append the TC or TCC that generates PWM on a pin and the frequency it is running at
+	extern void AppendPwmDetails(Pin pin, PwmFrequency requestedFreq, const StringRef& reply);
+
+	// Hold back and then release PWM changes, so that changes to several outputs driven by one TC or TCC take effect together
+	extern void LockUpdates();
+	extern void UnlockUpdates();
+
+#if SUPPORT_PWM_SEQUENCES
+	// Start a PWM sequence on a pin that can be driven by a TCC: hold 'startVal' for 'holdMillis', then ramp in steps to 'endVal' over 'rampMillis'.
+	// DMA copies the compare values into the TCC at the end of each PWM period, so the sequence needs no CPU time and 'endVal' stays in effect when it ends.
+	// A later call to Write or Release for the pin stops the sequence. Return false if the sequence can't be run in hardware, in which case nothing has been written.
+	extern bool WriteSequence(Pin pin, float startVal, uint32_t holdMillis, float endVal, uint32_t rampMillis, PwmFrequency freq);
+#endif
 }
 
 #endif /* SRC_HARDWARE_ANALOGOUT_H_ */
@@ -35,6 +35,8 @@
 
 #include <Hardware/Peripherals.h>
 #include <hpl_can_config.h>
+#include <hal_atomic.h>
+#include <Tasks.h>
 #include <cstring>
 
 /**
@@ -45,12 +47,14 @@
 // DC: these buffers must be within the first 64kB of RAM. So we now declare them all "static". Otherwise they end up in the COMMON segment at the end of RAM.
 #ifdef CONF_CAN0_ENABLED
 alignas(4) static uint8_t can0_rx_fifo[CONF_CAN0_F0DS * CONF_CAN0_RXF0C_F0S];
+alignas(4) static uint8_t can0_rx_fifo1[CONF_CAN0_F1DS * CONF_CAN0_RXF1C_F1S];
 alignas(4) static uint8_t can0_tx_fifo[CONF_CAN0_TBDS * CONF_CAN0_TXBC_TFQS];
 alignas(4) static struct _can_tx_event_entry can0_tx_event_fifo[CONF_CAN0_TXEFC_EFS];
 alignas(4) static struct _can_standard_message_filter_element can0_rx_std_filter[CONF_CAN0_SIDFC_LSS];
 alignas(4) static struct _can_extended_message_filter_element can0_rx_ext_filter[CONF_CAN0_XIDFC_LSS];
 
 struct _can_context              _can0_context = {.rx_fifo       = can0_rx_fifo,
+                                     .rx_fifo1      = can0_rx_fifo1,
                                      .tx_fifo       = can0_tx_fifo,
                                      .tx_event      = can0_tx_event_fifo,
                                      .rx_std_filter = can0_rx_std_filter,
@@ -61,12 +65,14 @@ static _can_async_device *_can0_dev = nullptr; /*!< Pointer to hpl device */
 
 #ifdef CONF_CAN1_ENABLED
 alignas(4) static uint8_t can1_rx_fifo[CONF_CAN1_F0DS * CONF_CAN1_RXF0C_F0S];
+alignas(4) static uint8_t can1_rx_fifo1[CONF_CAN1_F1DS * CONF_CAN1_RXF1C_F1S];
 alignas(4) static uint8_t can1_tx_fifo[CONF_CAN1_TBDS * CONF_CAN1_TXBC_TFQS];
 alignas(4) static struct _can_tx_event_entry can1_tx_event_fifo[CONF_CAN1_TXEFC_EFS];
 alignas(4) static struct _can_standard_message_filter_element can1_rx_std_filter[CONF_CAN1_SIDFC_LSS];
 alignas(4) static struct _can_extended_message_filter_element can1_rx_ext_filter[CONF_CAN1_XIDFC_LSS];
 
 struct _can_context              _can1_context = {.rx_fifo       = can1_rx_fifo,
+                                     .rx_fifo1      = can1_rx_fifo1,
                                      .tx_fifo       = can1_tx_fifo,
                                      .tx_event      = can1_tx_event_fifo,
                                      .rx_std_filter = can1_rx_std_filter,
@@ -78,9 +84,43 @@ static _can_async_device *_can1_dev = nullptr; /*!< Pointer to hpl device */
 /**
  * \brief Initialize CAN.
  */
-static int32_t _can_async_init(_can_async_device *const dev, Can *const hw, const CanTiming& timing)
+// Set up the CAN FD data phase bit timing and enable bit rate switching. Must be called with CCCR.CCE set.
+static void _can_async_set_fast_timing(_can_async_device *const dev, const CanTiming& fastTiming)
+{
+	uint32_t period = fastTiming.period;
+	uint32_t tseg1 = fastTiming.tseg1;
+	uint32_t jumpWidth = fastTiming.jumpWidth;
+	uint32_t prescaler = 1;
+	uint32_t tseg2;
+
+	for (;;)
+	{
+		tseg2 = period - tseg1 - 1;
+		if ((tseg1 <= 32 && tseg2 <= 16 && jumpWidth <= 16) || prescaler == 32)
+		{
+			break;
+		}
+		prescaler <<= 1;
+		period >>= 1;
+		tseg1 >>= 1;
+		jumpWidth >>= 1;
+	}
+
+	// Above 1Mbps the transceiver loop delay is a significant part of the bit time, so we need transceiver delay compensation.
+	// The secondary sample point is at the normal sample point position, measured in CAN clocks from the start of the bit.
+	const bool useTdc = (CanTiming::ClockFrequency/fastTiming.period > 1000000);
+	hri_can_write_DBTP_reg(dev->hw, ((useTdc) ? CAN_DBTP_TDC : 0) | CAN_DBTP_DBRP(prescaler - 1) | CAN_DBTP_DTSEG1(tseg1 - 1) | CAN_DBTP_DTSEG2(tseg2 - 1) | CAN_DBTP_DSJW(jumpWidth - 1));
+	if (useTdc)
+	{
+		hri_can_write_TDCR_reg(dev->hw, CAN_TDCR_TDCO((fastTiming.tseg1 < 127) ? fastTiming.tseg1 : 127));
+	}
+	hri_can_set_CCCR_BRSE_bit(dev->hw);
+}
+
+static int32_t _can_async_init(_can_async_device *const dev, Can *const hw, const CanTiming& timing, const CanTiming *fastTiming)
 {
 	dev->hw = hw;
+	dev->txMessagesCompleted = dev->txBatchesCompleted = 0;
 	hri_can_set_CCCR_INIT_bit(dev->hw);
 	while (hri_can_get_CCCR_INIT_bit(dev->hw) == 0) { }
 	hri_can_set_CCCR_CCE_bit(dev->hw);
@@ -116,6 +156,7 @@ static int32_t _can_async_init(_can_async_device *const dev, Can *const hw, cons
 		hri_can_write_NBTP_reg(dev->hw, nbtp);
 		hri_can_write_DBTP_reg(dev->hw, CONF_CAN0_DBTP_REG);
 		hri_can_write_RXF0C_reg(dev->hw, CONF_CAN0_RXF0C_REG | CAN_RXF0C_F0SA((uint32_t)can0_rx_fifo));
+		hri_can_write_RXF1C_reg(dev->hw, CONF_CAN0_RXF1C_REG | CAN_RXF1C_F1SA((uint32_t)can0_rx_fifo1));
 		hri_can_write_RXESC_reg(dev->hw, CONF_CAN0_RXESC_REG);
 		hri_can_write_TXESC_reg(dev->hw, CONF_CAN0_TXESC_REG);
 		hri_can_write_TXBC_reg(dev->hw, CONF_CAN0_TXBC_REG | CAN_TXBC_TBSA((uint32_t)can0_tx_fifo));
@@ -141,6 +182,7 @@ static int32_t _can_async_init(_can_async_device *const dev, Can *const hw, cons
 		hri_can_write_NBTP_reg(dev->hw, nbtp);
 		hri_can_write_DBTP_reg(dev->hw, CONF_CAN1_DBTP_REG);
 		hri_can_write_RXF0C_reg(dev->hw, CONF_CAN1_RXF0C_REG | CAN_RXF0C_F0SA((uint32_t)can1_rx_fifo));
+		hri_can_write_RXF1C_reg(dev->hw, CONF_CAN1_RXF1C_REG | CAN_RXF1C_F1SA((uint32_t)can1_rx_fifo1));
 		hri_can_write_RXESC_reg(dev->hw, CONF_CAN1_RXESC_REG);
 		hri_can_write_TXESC_reg(dev->hw, CONF_CAN1_TXESC_REG);
 		hri_can_write_TXBC_reg(dev->hw, CONF_CAN1_TXBC_REG | CAN_TXBC_TBSA((uint32_t)can1_tx_fifo));
@@ -157,6 +199,14 @@ static int32_t _can_async_init(_can_async_device *const dev, Can *const hw, cons
 	}
 #endif
 
+	// Count bit times in the timestamp counter, so that we can tell when received messages actually arrived
+	hri_can_write_TSCC_reg(dev->hw, CAN_TSCC_TSS_INC | CAN_TSCC_TCP(0));
+
+	if (fastTiming != nullptr)
+	{
+		_can_async_set_fast_timing(dev, *fastTiming);
+	}
+
 	/* Disable CCE to prevent Configuration Change */
 	hri_can_clear_CCCR_CCE_bit(dev->hw);
 	hri_can_clear_CCCR_INIT_bit(dev->hw);
@@ -194,31 +244,77 @@ static int32_t _can_async_disable(_can_async_device *const dev)
 }
 
 /**
- * \brief Read a CAN message
+ * \brief Get the receive FIFO element at the given index
  */
-static int32_t _can_async_read(_can_async_device *const dev, struct can_message *msg)
+static struct _can_rx_fifo_entry *_can_get_rx_fifo_entry(_can_async_device *const dev, unsigned int fifoNumber, uint32_t index)
 {
-	if (!hri_can_read_RXF0S_F0FL_bf(dev->hw))
-	{
-		return ERR_NOT_FOUND;
-	}
-
-	hri_can_rxf0s_reg_t get_index = hri_can_read_RXF0S_F0GI_bf(dev->hw);
-	struct _can_rx_fifo_entry *f = nullptr;
-
 #ifdef CONF_CAN0_ENABLED
 	if (dev->hw == CAN0)
 	{
-		f = (struct _can_rx_fifo_entry *)(can0_rx_fifo + get_index * CONF_CAN0_F0DS);
+		return (fifoNumber == 0) ? (struct _can_rx_fifo_entry *)(can0_rx_fifo + index * CONF_CAN0_F0DS)
+					: (struct _can_rx_fifo_entry *)(can0_rx_fifo1 + index * CONF_CAN0_F1DS);
 	}
 #endif
 #ifdef CONF_CAN1_ENABLED
 	if (dev->hw == CAN1)
 	{
-		f = (struct _can_rx_fifo_entry *)(can1_rx_fifo + get_index * CONF_CAN1_F0DS);
+		return (fifoNumber == 0) ? (struct _can_rx_fifo_entry *)(can1_rx_fifo + index * CONF_CAN1_F0DS)
+					: (struct _can_rx_fifo_entry *)(can1_rx_fifo1 + index * CONF_CAN1_F1DS);
 	}
 #endif
+	return nullptr;
+}
 
+/**
+ * \brief Return the fill level of a receive FIFO
+ */
+static inline uint32_t _can_get_rx_fifo_fill_level(_can_async_device *const dev, unsigned int fifoNumber)
+{
+	return (fifoNumber == 0) ? hri_can_read_RXF0S_F0FL_bf(dev->hw) : hri_can_read_RXF1S_F1FL_bf(dev->hw);
+}
+
+/**
+ * \brief Return the get index of a receive FIFO
+ */
+static inline uint32_t _can_get_rx_fifo_get_index(_can_async_device *const dev, unsigned int fifoNumber)
+{
+	return (fifoNumber == 0) ? hri_can_read_RXF0S_F0GI_bf(dev->hw) : hri_can_read_RXF1S_F1GI_bf(dev->hw);
+}
+
+/**
+ * \brief Tell the controller that we have finished with the receive FIFO elements up to and including the given one
+ */
+static inline void _can_acknowledge_rx_fifo(_can_async_device *const dev, unsigned int fifoNumber, uint32_t index)
+{
+	if (fifoNumber == 0)
+	{
+		hri_can_write_RXF0A_F0AI_bf(dev->hw, index);
+	}
+	else
+	{
+		hri_can_write_RXF1A_F1AI_bf(dev->hw, index);
+	}
+}
+
+static constexpr uint8_t dlc2len[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+/**
+ * \brief Read a CAN message, taking it from the high priority FIFO if there is one there
+ */
+static int32_t _can_async_read(_can_async_device *const dev, struct can_message *msg, bool includeLowPriority)
+{
+	unsigned int fifoNumber = 1;
+	if (_can_get_rx_fifo_fill_level(dev, fifoNumber) == 0)
+	{
+		fifoNumber = 0;
+		if (!includeLowPriority || _can_get_rx_fifo_fill_level(dev, fifoNumber) == 0)
+		{
+			return ERR_NOT_FOUND;
+		}
+	}
+
+	const uint32_t get_index = _can_get_rx_fifo_get_index(dev, fifoNumber);
+	struct _can_rx_fifo_entry *f = _can_get_rx_fifo_entry(dev, fifoNumber, get_index);
 	if (f == nullptr)
 	{
 		return ERR_NO_RESOURCE;
@@ -240,16 +336,56 @@ static int32_t _can_async_read(_can_async_device *const dev, struct can_message
 		msg->type = CAN_TYPE_REMOTE;
 	}
 
-	static constexpr uint8_t dlc2len[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
 	msg->len = dlc2len[f->R1.bit.DLC];
+	msg->timeStamp = f->R1.bit.RXTS;
 
 	memcpy(msg->data, f->data, msg->len);
 
-	hri_can_write_RXF0A_F0AI_bf(dev->hw, get_index);
+	_can_acknowledge_rx_fifo(dev, fifoNumber, get_index);
 
 	return ERR_NONE;
 }
 
+/**
+ * \brief Pass messages at the head of one receive FIFO to the callback without copying them, until it declines one
+ */
+static bool _can_async_process_fifo_in_place(_can_async_device *const dev, unsigned int fifoNumber, can_rx_in_place_cb_t cb)
+{
+	while (_can_get_rx_fifo_fill_level(dev, fifoNumber) != 0)
+	{
+		const uint32_t get_index = _can_get_rx_fifo_get_index(dev, fifoNumber);
+		struct _can_rx_fifo_entry *f = _can_get_rx_fifo_entry(dev, fifoNumber, get_index);
+		if (f == nullptr || f->R0.bit.XTD == 0 || f->R0.bit.RTR == 1)
+		{
+			return true;									// we only process extended data frames in place
+		}
+
+		struct can_message msg;
+		msg.id = f->R0.bit.ID;
+		msg.fmt = CAN_FMT_EXTID;
+		msg.type = CAN_TYPE_DATA;
+		msg.data = f->data;
+		msg.len = dlc2len[f->R1.bit.DLC];
+		msg.timeStamp = f->R1.bit.RXTS;
+		if (!cb(&msg))
+		{
+			return true;
+		}
+		_can_acknowledge_rx_fifo(dev, fifoNumber, get_index);
+	}
+	return false;
+}
+
+/**
+ * \brief Pass messages at the heads of the receive FIFOs to the callback without copying them, high priority FIFO first
+ */
+static bool _can_async_process_in_place(_can_async_device *const dev, can_rx_in_place_cb_t cb)
+{
+	const bool highPriorityRemaining = _can_async_process_fifo_in_place(dev, 1, cb);
+	const bool lowPriorityRemaining = _can_async_process_fifo_in_place(dev, 0, cb);
+	return highPriorityRemaining || lowPriorityRemaining;
+}
+
 /**
  * \brief Write a CAN message
  */
@@ -311,6 +447,8 @@ static int32_t _can_async_write(_can_async_device *const dev, struct can_message
 
 	f->T1.bit.FDF = hri_can_get_CCCR_FDOE_bit(dev->hw);
 	f->T1.bit.BRS = hri_can_get_CCCR_BRSE_bit(dev->hw);
+	f->T1.bit.EFC = 1;									// record an event when it has been sent, so that we can retire completed messages in batches
+	f->T1.bit.MM = put_index;
 
 	memcpy(f->data, msg->data, msg->len);
 
@@ -322,6 +460,23 @@ static int32_t _can_async_write(_can_async_device *const dev, struct can_message
 	return ERR_NONE;
 }
 
+/**
+ * \brief Retire all the entries in the transmit event FIFO, returning how many there were
+ */
+static uint32_t _can_retire_tx_events(_can_async_device *const dev)
+{
+	const uint32_t numEvents = hri_can_read_TXEFS_EFFL_bf(dev->hw);
+	if (numEvents != 0)
+	{
+		// Acknowledging the last one releases all of them
+		const uint32_t lastIndex = (hri_can_read_TXEFS_EFGI_bf(dev->hw) + numEvents - 1) % (hri_can_read_TXEFC_EFS_bf(dev->hw));
+		hri_can_write_TXEFA_EFAI_bf(dev->hw, lastIndex);
+		dev->txMessagesCompleted += numEvents;
+		++dev->txBatchesCompleted;
+	}
+	return numEvents;
+}
+
 /**
  * \brief Set CAN Interrupt State
  */
@@ -330,16 +485,19 @@ static void _can_async_set_irq_state(_can_async_device *const dev, enum can_asyn
 	if (type == CAN_ASYNC_RX_CB)
 	{
 		hri_can_write_IE_RF0NE_bit(dev->hw, state);
+		hri_can_write_IE_RF1NE_bit(dev->hw, state);
 	}
 	else if (type == CAN_ASYNC_TX_CB)
 	{
-		hri_can_write_IE_TCE_bit(dev->hw, state);
-		hri_can_write_TXBTIE_reg(dev->hw, CAN_TXBTIE_MASK);
+		// We get one interrupt when the transmit event FIFO reaches its watermark, instead of one for every message sent
+		hri_can_write_IE_TEFWE_bit(dev->hw, state);
+		hri_can_write_IE_TEFLE_bit(dev->hw, state);
 	}
 	else if (type == CAN_ASYNC_IRQ_CB)
 	{
-		const uint32_t ie = hri_can_get_IE_reg(dev->hw, CAN_IE_RF0NE | CAN_IE_TCE);
-		hri_can_write_IE_reg(dev->hw, ie | CONF_CAN0_IE_REG);
+		// The configured interrupts only include message lost in receive FIFO 0, so add FIFO 1 which holds the movement messages
+		const uint32_t ie = hri_can_get_IE_reg(dev->hw, CAN_IE_RF0NE | CAN_IE_RF1NE | CAN_IE_TEFWE | CAN_IE_TEFLE);
+		hri_can_write_IE_reg(dev->hw, ie | ((state) ? CONF_CAN0_IE_REG | CAN_IE_RF1LE : 0));
 	}
 }
 
@@ -403,7 +561,7 @@ static int32_t _can_async_set_filter(_can_async_device *const dev, uint8_t index
 		sf->S0.val       = filter->mask;
 		sf->S0.bit.SFID1 = filter->id;
 		sf->S0.bit.SFT   = _CAN_SFT_CLASSIC;
-		sf->S0.bit.SFEC  = _CAN_SFEC_STF0M;
+		sf->S0.bit.SFEC  = (filter->fifo == 0) ? _CAN_SFEC_STF0M : _CAN_SFEC_STF1M;
 	}
 	else if (fmt == CAN_FMT_EXTID)
 	{
@@ -413,7 +571,7 @@ static int32_t _can_async_set_filter(_can_async_device *const dev, uint8_t index
 			return ERR_NONE;
 		}
 		ef->F0.val      = filter->id;
-		ef->F0.bit.EFEC = _CAN_EFEC_STF0M;
+		ef->F0.bit.EFEC = (filter->fifo == 0) ? _CAN_EFEC_STF0M : _CAN_EFEC_STF1M;
 		ef->F1.val      = filter->mask;
 		ef->F1.bit.EFT  = _CAN_EFT_CLASSIC;
 	}
@@ -429,22 +587,23 @@ static int32_t _can_async_set_filter(_can_async_device *const dev, uint8_t index
 
 void CAN0_Handler(void)
 {
+	IsrTimer timer(IsrId::can);
 	struct _can_async_device *dev = _can0_dev;
 	uint32_t                  ir;
 #if 1	//dc42
-	while (((ir = hri_can_read_IR_reg(dev->hw)) & (CAN_IR_RF0N | CAN_IR_TC | CAN_IR_BO | CAN_IR_EW | CAN_IR_EP | CAN_IR_RF0L)) != 0)
+	while (((ir = hri_can_read_IR_reg(dev->hw)) & (CAN_IR_RF0N | CAN_IR_RF1N | CAN_IR_TEFW | CAN_IR_TEFL | CAN_IR_BO | CAN_IR_EW | CAN_IR_EP | CAN_IR_RF0L | CAN_IR_RF1L)) != 0)
 	{
 		hri_can_write_IR_reg(dev->hw, ir);
 #else
 	ir = hri_can_read_IR_reg(dev->hw);
 #endif
 
-		if (ir & CAN_IR_RF0N)
+		if (ir & (CAN_IR_RF0N | CAN_IR_RF1N))
 		{
 			dev->cb.rx_done(dev);
 		}
 
-		if (ir & CAN_IR_TC)
+		if ((ir & (CAN_IR_TEFW | CAN_IR_TEFL)) && _can_retire_tx_events(dev) != 0)
 		{
 			dev->cb.tx_done(dev);
 		}
@@ -464,7 +623,7 @@ void CAN0_Handler(void)
 			dev->cb.irq_handler(dev, hri_can_get_PSR_EP_bit(dev->hw) ? CAN_IRQ_EP : CAN_IRQ_EA);
 		}
 
-		if (ir & CAN_IR_RF0L)
+		if (ir & (CAN_IR_RF0L | CAN_IR_RF1L))
 		{
 			dev->cb.irq_handler(dev, CAN_IRQ_DO);
 		}
@@ -482,21 +641,22 @@ void CAN0_Handler(void)
 
 void CAN1_Handler(void)
 {
+	IsrTimer timer(IsrId::can);
 	struct _can_async_device *dev = _can1_dev;
 	uint32_t                  ir;
 #if 1	//dc42
-	while (((ir = hri_can_read_IR_reg(dev->hw)) & (CAN_IR_RF0N | CAN_IR_TC | CAN_IR_BO | CAN_IR_EW | CAN_IR_EP | CAN_IR_RF0L)) != 0)
+	while (((ir = hri_can_read_IR_reg(dev->hw)) & (CAN_IR_RF0N | CAN_IR_RF1N | CAN_IR_TEFW | CAN_IR_TEFL | CAN_IR_BO | CAN_IR_EW | CAN_IR_EP | CAN_IR_RF0L | CAN_IR_RF1L)) != 0)
 	{
 		hri_can_write_IR_reg(dev->hw, ir);
 #else
 	ir = hri_can_read_IR_reg(dev->hw);
 #endif
 
-	if (ir & CAN_IR_RF0N) {
+	if (ir & (CAN_IR_RF0N | CAN_IR_RF1N)) {
 		dev->cb.rx_done(dev);
 	}
 
-	if (ir & CAN_IR_TC) {
+	if ((ir & (CAN_IR_TEFW | CAN_IR_TEFL)) && _can_retire_tx_events(dev) != 0) {
 		dev->cb.tx_done(dev);
 	}
 
@@ -512,7 +672,7 @@ void CAN1_Handler(void)
 		dev->cb.irq_handler(dev, hri_can_get_PSR_EP_bit(dev->hw) ? CAN_IRQ_EP : CAN_IRQ_EA);
 	}
 
-	if (ir & CAN_IR_RF0L) {
+	if (ir & (CAN_IR_RF0L | CAN_IR_RF1L)) {
 		dev->cb.irq_handler(dev, CAN_IRQ_DO);
 	}
 
@@ -550,9 +710,9 @@ static void can_irq_handler(_can_async_device *dev, enum can_async_interrupt_typ
 /**
  * \brief Initialize CAN.
  */
-int32_t can_async_init(can_async_descriptor *const descr, Can *const hw, const CanTiming& timing)
+int32_t can_async_init(can_async_descriptor *const descr, Can *const hw, const CanTiming& timing, const CanTiming *fastTiming)
 {
-	const int32_t rc = _can_async_init(&descr->dev, hw, timing);
+	const int32_t rc = _can_async_init(&descr->dev, hw, timing, fastTiming);
 	if (rc)
 	{
 		return rc;
@@ -591,9 +751,37 @@ int32_t can_async_disable(can_async_descriptor *const descr)
 /**
  * \brief Read a CAN message
  */
-int32_t can_async_read(can_async_descriptor *const descr, struct can_message *msg)
+int32_t can_async_read(can_async_descriptor *const descr, struct can_message *msg, bool includeLowPriority)
+{
+	return _can_async_read(&descr->dev, msg, includeLowPriority);
+}
+
+void can_async_get_and_clear_tx_stats(can_async_descriptor *const descr, uint32_t& messages, uint32_t& batches)
+{
+	hal_atomic_t flags;
+	atomic_enter_critical(&flags);
+	messages = descr->dev.txMessagesCompleted;
+	batches = descr->dev.txBatchesCompleted;
+	descr->dev.txMessagesCompleted = descr->dev.txBatchesCompleted = 0;
+	atomic_leave_critical(&flags);
+}
+
+bool can_async_is_tx_idle(can_async_descriptor *const descr)
+{
+	return hri_can_read_TXBRP_reg(descr->dev.hw) == 0;
+}
+
+bool can_async_process_in_place(can_async_descriptor *const descr, can_rx_in_place_cb_t cb)
+{
+	return _can_async_process_in_place(&descr->dev, cb);
+}
+
+/**
+ * \brief Read the timestamp counter
+ */
+uint16_t can_async_get_time_stamp_counter(can_async_descriptor *const descr)
 {
-	return _can_async_read(&descr->dev, msg);
+	return (uint16_t)hri_can_read_TSCV_TSC_bf(descr->dev.hw);
 }
 
 /**
@@ -645,6 +833,22 @@ uint8_t can_async_get_txerr(can_async_descriptor *const descr)
 	return _can_async_get_txerr(&descr->dev);
 }
 
+uint8_t can_async_get_tx_queue_level(can_async_descriptor *const descr)
+{
+	return hri_can_read_TXBC_TFQS_bf(descr->dev.hw) - hri_can_read_TXFQS_TFFL_bf(descr->dev.hw);
+}
+
+bool can_async_get_error_state(can_async_descriptor *const descr, bool& errorPassive)
+{
+	errorPassive = hri_can_get_PSR_EP_bit(descr->dev.hw);
+	return hri_can_get_PSR_BO_bit(descr->dev.hw);
+}
+
+void can_async_start_bus_off_recovery(can_async_descriptor *const descr)
+{
+	hri_can_clear_CCCR_INIT_bit(descr->dev.hw);
+}
+
 /**
  * \brief Set CAN to the specified mode
  */
@@ -681,6 +885,23 @@ void GetLocalCanTiming(const can_async_descriptor *descr, CanTiming& timing)
 	timing.jumpWidth = (jw + 1) * (brp + 1);
 }
 
+bool GetLocalCanFastTiming(const can_async_descriptor *descr, CanTiming& timing)
+{
+	if (!hri_can_get_CCCR_BRSE_bit(descr->dev.hw))
+	{
+		return false;
+	}
+	const uint32_t dbtp = descr->dev.hw->DBTP.reg;
+	const uint32_t tseg1 = (dbtp & CAN_DBTP_DTSEG1_Msk) >> CAN_DBTP_DTSEG1_Pos;
+	const uint32_t tseg2 = (dbtp & CAN_DBTP_DTSEG2_Msk) >> CAN_DBTP_DTSEG2_Pos;
+	const uint32_t jw = (dbtp & CAN_DBTP_DSJW_Msk) >> CAN_DBTP_DSJW_Pos;
+	const uint32_t brp = (dbtp & CAN_DBTP_DBRP_Msk) >> CAN_DBTP_DBRP_Pos;
+	timing.period = (tseg1 + tseg2 + 3) * (brp + 1);
+	timing.tseg1 = (tseg1 + 1) * (brp + 1);
+	timing.jumpWidth = (jw + 1) * (brp + 1);
+	return true;
+}
+
 /**
  * \internal Callback of CAN Message Write finished
  */
@@ -86,6 +86,7 @@ struct can_message {
 	uint8_t *       data; /* Pointer to Message Data */
 	uint8_t         len;  /* Message Length */
 	enum can_format fmt;  /* Identifier format, CAN_STD, CAN_EXT */
+	uint16_t        timeStamp; /* Value of the timestamp counter when the message started, received messages only */
 };
 
 /**
@@ -94,6 +95,7 @@ struct can_message {
 struct can_filter {
 	uint32_t id;   /* Message identifier */
 	uint32_t mask; /* The mask applied to the id */
+	uint8_t  fifo; /* The receive FIFO that matching messages are stored in, 0 or 1. FIFO 1 is read first. */
 };
 
 /**@}*/
@@ -245,6 +247,7 @@ struct _can_extended_message_filter_element {
 
 struct _can_context {
 	uint8_t *                   rx_fifo;  /*!< receive message fifo */
+	uint8_t *                   rx_fifo1; /*!< receive message fifo for high priority messages */
 	uint8_t *                   tx_fifo;  /*!< transfer message fifo */
 	struct _can_tx_event_entry *tx_event; /*!< transfer event fifo */
 	/* Standard filter List */
@@ -313,6 +316,8 @@ struct _can_async_device {
 	struct _can_async_callback cb;      /*!< CAN interrupt handler */
 	struct _irq_descriptor     irq;     /*!< Interrupt descriptor */
 	void *                     context; /*!< CAN hardware context */
+	uint32_t                   txMessagesCompleted; /*!< Number of sent messages retired from the transmit event FIFO */
+	uint32_t                   txBatchesCompleted;  /*!< Number of times we retired sent messages */
 };
 
 /**
@@ -349,12 +354,14 @@ struct can_async_descriptor {
  *
  * This function initializes the given CAN descriptor.
  *
- * \param[in, out] descr A CAN descriptor to initialize.
- * \param[in]      hw    The pointer to hardware instance.
+ * \param[in, out] descr      A CAN descriptor to initialize.
+ * \param[in]      hw         The pointer to hardware instance.
+ * \param[in]      timing     The nominal bit timing.
+ * \param[in]      fastTiming The CAN FD data phase bit timing, or nullptr if we don't use bit rate switching.
  *
  * \return Initialization status.
  */
-int32_t can_async_init(can_async_descriptor *const descr, Can *const hw, const CanTiming& timing);
+int32_t can_async_init(can_async_descriptor *const descr, Can *const hw, const CanTiming& timing, const CanTiming *fastTiming);
 
 /**
  * \brief Deinitialize CAN.
@@ -392,12 +399,61 @@ int32_t can_async_disable(can_async_descriptor *const descr);
 /**
  * \brief Read a CAN message
  *
- * \param[in] descr The CAN descriptor to read message.
- * \param[in] msg   The CAN message to read to.
+ * \param[in] descr              The CAN descriptor to read message.
+ * \param[in] msg                The CAN message to read to.
+ * \param[in] includeLowPriority False to read from the high priority FIFO only
  *
  * \return The status of read message.
  */
-int32_t can_async_read(can_async_descriptor *const descr, struct can_message *msg);
+int32_t can_async_read(can_async_descriptor *const descr, struct can_message *msg, bool includeLowPriority);
+
+/**
+ * \brief Read the timestamp counter, which counts CAN bit times
+ *
+ * \param[in] descr The CAN descriptor.
+ *
+ * \return The current value of the counter.
+ */
+uint16_t can_async_get_time_stamp_counter(can_async_descriptor *const descr);
+
+/**
+ * \brief Get the number of sent messages and the number of batches in which they were retired, then clear them
+ *
+ * \param[in]  descr      The CAN descriptor.
+ * \param[out] messages   The number of messages retired.
+ * \param[out] batches    The number of batches.
+ */
+void can_async_get_and_clear_tx_stats(can_async_descriptor *const descr, uint32_t& messages, uint32_t& batches);
+
+/**
+ * \brief Check whether any messages are waiting to be sent
+ *
+ * \param[in] descr The CAN descriptor.
+ *
+ * \return True if no transmission requests are pending.
+ */
+bool can_async_is_tx_idle(can_async_descriptor *const descr);
+
+/**
+ * \brief Callback to process a received message in place
+ *
+ * The message data points into the receive FIFO and is only valid during the call.
+ * Return true if the message has been consumed, false to leave it in the FIFO for can_async_read.
+ */
+typedef bool (*can_rx_in_place_cb_t)(const struct can_message *msg);
+
+/**
+ * \brief Process messages at the head of the receive FIFO without copying them
+ *
+ * Messages are passed to the callback in order, stopping at the first one that it does not consume.
+ * Must not be called while can_async_read is in progress.
+ *
+ * \param[in] descr The CAN descriptor.
+ * \param[in] cb    The callback.
+ *
+ * \return True if there are messages left in the FIFO.
+ */
+bool can_async_process_in_place(can_async_descriptor *const descr, can_rx_in_place_cb_t cb);
 
 /**
  * \brief Write a CAN message
@@ -443,6 +499,35 @@ uint8_t can_async_get_rxerr(can_async_descriptor *const descr);
  */
 uint8_t can_async_get_txerr(can_async_descriptor *const descr);
 
+/**
+ * \brief Return the number of messages waiting in the transmit FIFO
+ *
+ * \param[in] descr The CAN descriptor pointer
+ *
+ * \return The number of messages that have been queued but not yet sent.
+ */
+uint8_t can_async_get_tx_queue_level(can_async_descriptor *const descr);
+
+/**
+ * \brief Return whether the CAN is in the error passive or bus off state
+ *
+ * \param[in]  descr        The CAN descriptor pointer
+ * \param[out] errorPassive True if the CAN is error passive
+ *
+ * \return True if the CAN is bus off.
+ */
+bool can_async_get_error_state(can_async_descriptor *const descr, bool& errorPassive);
+
+/**
+ * \brief Start the bus off recovery sequence
+ *
+ * The CAN stops taking part in bus activity when it goes bus off. This lets it rejoin the bus
+ * once it has seen 128 occurrences of 11 recessive bits. Safe to call from the CAN interrupt.
+ *
+ * \param[in] descr The CAN descriptor pointer
+ */
+void can_async_start_bus_off_recovery(can_async_descriptor *const descr);
+
 /**
  * \brief Set CAN to the specified mode
  *
@@ -477,5 +562,6 @@ int32_t can_async_set_filter(can_async_descriptor *const descr, uint8_t index, e
 uint32_t can_async_get_version(void);
 
 void GetLocalCanTiming(const can_async_descriptor *descr, CanTiming& timing);
+bool GetLocalCanFastTiming(const can_async_descriptor *descr, CanTiming& timing);		// returns false if bit rate switching is not enabled
 
 #endif /* SRC_CAN_CANDRIVER_H_ */
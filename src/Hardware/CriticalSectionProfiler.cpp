@@ -0,0 +1,173 @@
+/*
+ * CriticalSectionProfiler.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Instrumentation to find the critical sections that hold off interrupts for longest, so that we know which ones to shorten.
+ *  When SUPPORT_CRITICAL_SECTION_PROFILING is set, RepRapFirmware.h redirects cpu_irq_save and cpu_irq_restore to the functions here,
+ *  and AtomicCriticalSectionLocker passes the file and line of the code that constructs it. Times are measured with the step clock.
+ *  The statistics are only changed with interrupts disabled, so no other locking is needed.
+ */
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_CRITICAL_SECTION_PROFILING
+
+#include <Movement/StepTimer.h>
+
+namespace CriticalSectionProfiler
+{
+	constexpr size_t MaxSites = 32;						// the number of call sites we keep statistics for
+	constexpr size_t NumSitesReported = 8;				// the number of worst call sites that M122 reports
+
+	struct Site
+	{
+		const char *file;
+		uint32_t line;
+		uint32_t count;
+		uint32_t maxTicks;
+		uint64_t totalTicks;
+	};
+
+	static Site sites[MaxSites];
+	static size_t numSites = 0;
+	static uint32_t numUnrecorded = 0;					// sections we didn't record because the site table was full
+	static uint32_t worstUnrecordedTicks = 0;
+
+	// The outermost section in progress. There can only be one at a time because interrupts are disabled for the whole of it.
+	static const char *currentFile;
+	static uint32_t currentLine;
+	static uint32_t currentStartTicks;
+
+	static inline float TicksToMicroseconds(uint32_t ticks)
+	{
+		return (float)ticks * (1000000.0/(float)StepTimer::StepClockRate);
+	}
+
+	// Return the file name without the path, which can be long
+	static const char *BaseName(const char *file)
+	{
+		const char * const slash = strrchr(file, '/');
+		return (slash == nullptr) ? file : slash + 1;
+	}
+
+	// Record the duration of a section. Called with interrupts disabled.
+	static void Record(uint32_t ticks)
+	{
+		Site *site = nullptr;
+		for (size_t i = 0; i < numSites; ++i)
+		{
+			// Compare the pointers, not the strings. Each translation unit may have its own copy of a file name, but then the line numbers differ.
+			if (sites[i].line == currentLine && sites[i].file == currentFile)
+			{
+				site = &sites[i];
+				break;
+			}
+		}
+
+		if (site == nullptr)
+		{
+			if (numSites == MaxSites)
+			{
+				++numUnrecorded;
+				if (ticks > worstUnrecordedTicks)
+				{
+					worstUnrecordedTicks = ticks;
+				}
+				return;
+			}
+			site = &sites[numSites++];
+			site->file = currentFile;
+			site->line = currentLine;
+			site->count = 0;
+			site->maxTicks = 0;
+			site->totalTicks = 0;
+		}
+
+		++site->count;
+		site->totalTicks += ticks;
+		if (ticks > site->maxTicks)
+		{
+			site->maxTicks = ticks;
+		}
+	}
+}
+
+// Disable interrupts and start timing the section if this is the outermost one
+irqflags_t CriticalSectionProfiler::Save(const char *file, unsigned int line)
+{
+	const irqflags_t flags = (cpu_irq_save)();			// the parentheses stop the macro in RepRapFirmware.h being expanded
+	if (cpu_irq_is_enabled_flags(flags))
+	{
+		currentFile = file;
+		currentLine = line;
+		currentStartTicks = StepTimer::GetTimerTicks();
+	}
+	return flags;
+}
+
+// Stop timing the section if we are about to enable interrupts, then restore them. We read the clock before recording so that the time doesn't include our own overhead.
+void CriticalSectionProfiler::Restore(irqflags_t flags)
+{
+	if (cpu_irq_is_enabled_flags(flags))
+	{
+		Record(StepTimer::GetTimerTicks() - currentStartTicks);
+	}
+	(cpu_irq_restore)(flags);
+}
+
+// Append the call sites that held off interrupts for longest to the reply, then reset the statistics
+void CriticalSectionProfiler::Diagnostics(const StringRef& reply)
+{
+	// Take a copy of the worst sites and reset the statistics, then report them with interrupts enabled
+	Site worst[NumSitesReported];
+	size_t numWorst = 0, numSitesSeen;
+	uint32_t unrecorded, worstUnrecorded;
+	{
+		const irqflags_t flags = (cpu_irq_save)();		// don't profile this section, because we reset the statistics in it
+		numSitesSeen = numSites;
+		for (size_t i = 0; i < numSites; ++i)
+		{
+			// Insertion sort into the list of worst sites, ordered by maximum time
+			size_t j = numWorst;
+			while (j != 0 && worst[j - 1].maxTicks < sites[i].maxTicks)
+			{
+				if (j < NumSitesReported)
+				{
+					worst[j] = worst[j - 1];
+				}
+				--j;
+			}
+			if (j < NumSitesReported)
+			{
+				worst[j] = sites[i];
+				if (numWorst < NumSitesReported)
+				{
+					++numWorst;
+				}
+			}
+		}
+		unrecorded = numUnrecorded;
+		worstUnrecorded = worstUnrecordedTicks;
+		numSites = 0;
+		numUnrecorded = worstUnrecordedTicks = 0;
+		(cpu_irq_restore)(flags);
+	}
+
+	reply.printf("Critical sections with interrupts disabled, %u call sites", numSitesSeen);
+	for (size_t i = 0; i < numWorst; ++i)
+	{
+		const Site& s = worst[i];
+		reply.lcatf("%s(%" PRIu32 "): max %.1fus avg %.1fus count %" PRIu32,
+						BaseName(s.file), s.line, (double)TicksToMicroseconds(s.maxTicks), (double)TicksToMicroseconds(s.totalTicks/s.count), s.count);
+	}
+	if (unrecorded != 0)
+	{
+		reply.lcatf("Site table full, %" PRIu32 " sections not recorded, max %.1fus", unrecorded, (double)TicksToMicroseconds(worstUnrecorded));
+	}
+}
+
+#endif
+
+// End
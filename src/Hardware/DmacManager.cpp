@@ -18,6 +18,7 @@
 
 #include <Hardware/DmacManager.h>
 #include <RTOSIface/RTOSIface.h>
+#include <Tasks.h>
 
 // Descriptors for all used DMAC channels
 COMPILER_ALIGNED(16)
@@ -30,6 +31,17 @@ static DmacDescriptor write_back_section[NumDmaChannelsUsed];
 static DmaCallbackFunction dmaChannelCallbackFunctions[NumDmaChannelsUsed];
 static CallbackParameter callbackParams[NumDmaChannelsUsed];
 
+static_assert(FirstDynamicDmaChannel <= NumDmaChannelsUsed && NumDmaChannelsUsed <= 32, "Bad DMA channel configuration");
+
+// Bitmap of the dynamic channels that have been allocated
+static uint32_t allocatedChannels = 0;
+
+// Statistics, only collected for channels that have the completed interrupt enabled
+static uint32_t numTransfers[NumDmaChannelsUsed];
+static uint32_t numErrors[NumDmaChannelsUsed];
+static uint32_t busyTicks[NumDmaChannelsUsed];
+static uint32_t startTicks[NumDmaChannelsUsed];
+
 // Initialize the DMA controller
 void DmacManager::Init()
 {
@@ -81,11 +93,61 @@ void DmacManager::Init()
 	hri_dmac_set_CTRL_DMAENABLE_bit(DMAC);
 }
 
+// Allocate a DMA channel that is not assigned in the board configuration, returning NoDmaChannel if they are all in use
+DmaChannel DmacManager::AllocateChannel()
+{
+	AtomicCriticalSectionLocker lock;
+	for (unsigned int channel = FirstDynamicDmaChannel; channel < NumDmaChannelsUsed; ++channel)
+	{
+		if ((allocatedChannels & (1ul << channel)) == 0)
+		{
+			allocatedChannels |= 1ul << channel;
+			return (DmaChannel)channel;
+		}
+	}
+	return NoDmaChannel;
+}
+
+// Release a channel obtained from AllocateChannel. The channel is disabled and its callback removed.
+void DmacManager::ReleaseChannel(DmaChannel channel)
+{
+	if (channel >= FirstDynamicDmaChannel && channel < NumDmaChannelsUsed)
+	{
+		DisableChannel(channel);
+		AtomicCriticalSectionLocker lock;
+		dmaChannelCallbackFunctions[channel] = nullptr;
+		hri_dmacdescriptor_write_DESCADDR_reg(&descriptor_section[channel], 0);
+		allocatedChannels &= ~(1ul << channel);
+	}
+}
+
+void DmacManager::InitLinkedDescriptor(DmacDescriptor& desc, uint16_t btctrl, const volatile void *src, volatile void *dst, uint32_t amount, const DmacDescriptor *next)
+{
+	// The DMAC expects the source and destination addresses of incrementing transfers to be the end addresses, as for SetDataLength
+	const uint32_t bytes = amount * (1u << ((btctrl & DMAC_BTCTRL_BEATSIZE_Msk) >> DMAC_BTCTRL_BEATSIZE_Pos));
+	hri_dmacdescriptor_write_BTCTRL_reg(&desc, btctrl);
+	hri_dmacdescriptor_write_BTCNT_reg(&desc, amount);
+	hri_dmacdescriptor_write_SRCADDR_reg(&desc, reinterpret_cast<uint32_t>(src) + (((btctrl & DMAC_BTCTRL_SRCINC) != 0) ? bytes : 0));
+	hri_dmacdescriptor_write_DSTADDR_reg(&desc, reinterpret_cast<uint32_t>(dst) + (((btctrl & DMAC_BTCTRL_DSTINC) != 0) ? bytes : 0));
+	hri_dmacdescriptor_write_DESCADDR_reg(&desc, reinterpret_cast<uint32_t>(next));
+}
+
+void DmacManager::SetCircular(const uint8_t channel, bool circular)
+{
+	SetNextDescriptor(channel, (circular) ? &descriptor_section[channel] : nullptr);
+}
+
 void DmacManager::SetBtctrl(const uint8_t channel, const uint16_t val)
 {
 	hri_dmacdescriptor_write_BTCTRL_reg(&descriptor_section[channel], val);
 }
 
+// Link another descriptor to be executed when the transfer described by the channel descriptor has completed, or pass nullptr for no further transfer
+void DmacManager::SetNextDescriptor(const uint8_t channel, const DmacDescriptor *next)
+{
+	hri_dmacdescriptor_write_DESCADDR_reg(&descriptor_section[channel], reinterpret_cast<uint32_t>(next));
+}
+
 void DmacManager::SetDestinationAddress(const uint8_t channel, volatile void *const dst)
 {
 	hri_dmacdescriptor_write_DSTADDR_reg(&descriptor_section[channel], reinterpret_cast<uint32_t>(dst));
@@ -176,6 +238,7 @@ void DmacManager::SetArbitrationLevel(uint8_t channel, uint8_t level)
 void DmacManager::EnableChannel(const uint8_t channel, uint8_t priority)
 {
 	hri_dmacdescriptor_set_BTCTRL_VALID_bit(&descriptor_section[channel]);
+	startTicks[channel] = StepTimer::GetTimerTicks();
 #if defined(SAME51)
 	DMAC->Channel[channel].CHPRILVL.reg = priority;
 	DMAC->Channel[channel].CHCTRLA.bit.ENABLE = 1;
@@ -195,6 +258,7 @@ void DmacManager::DisableChannel(const uint8_t channel)
 #if defined(SAME51)
 	DMAC->Channel[channel].CHCTRLA.bit.ENABLE = 0;
 	DMAC->Channel[channel].CHINTENCLR.reg = DMAC_CHINTENCLR_TCMPL | DMAC_CHINTENCLR_TERR | DMAC_CHINTENCLR_SUSP;
+	DMAC->Channel[channel].CHINTFLAG.reg = DMAC_CHINTENCLR_TCMPL | DMAC_CHINTENCLR_TERR | DMAC_CHINTENCLR_SUSP;
 #elif defined(SAMC21)
 	AtomicCriticalSectionLocker lock;
 	DMAC->CHID.reg = channel;
@@ -258,6 +322,50 @@ uint16_t DmacManager::GetBytesTransferred(uint8_t channel)
 	return descriptor_section[channel].BTCNT.reg - write_back_section[channel].BTCNT.reg;
 }
 
+// Report the statistics of the channels that have been used since the last call, then clear them
+void DmacManager::Diagnostics(const StringRef& reply)
+{
+	reply.lcatf("DMA channels allocated %u of %u", __builtin_popcount(allocatedChannels), NumDmaChannelsUsed - FirstDynamicDmaChannel);
+	for (size_t channel = 0; channel < NumDmaChannelsUsed; ++channel)
+	{
+		uint32_t transfers, errors, ticks;
+		{
+			AtomicCriticalSectionLocker lock;
+			transfers = numTransfers[channel];
+			errors = numErrors[channel];
+			ticks = busyTicks[channel];
+			numTransfers[channel] = numErrors[channel] = busyTicks[channel] = 0;
+		}
+		if (transfers != 0 || errors != 0)
+		{
+			reply.lcatf("DMA %u: transfers %" PRIu32 ", errors %" PRIu32 ", busy %.2fms",
+						channel, transfers, errors, (double)((float)ticks * (1000.0f/(float)StepTimer::StepClockRate)));
+		}
+	}
+}
+
+// Update the statistics for a channel and call its callback. Called from the DMAC interrupt.
+static inline void ChannelInterrupt(size_t channel, uint8_t intflag)
+{
+	const uint32_t now = StepTimer::GetTimerTicks();
+	busyTicks[channel] += now - startTicks[channel];
+	startTicks[channel] = now;								// so that circular transfers are timed per block
+	if (intflag & DMAC_CHINTFLAG_TERR)
+	{
+		++numErrors[channel];
+	}
+	else
+	{
+		++numTransfers[channel];
+	}
+
+	const DmaCallbackFunction fn = dmaChannelCallbackFunctions[channel];
+	if (fn != nullptr)
+	{
+		fn(callbackParams[channel], (DmaCallbackReason)intflag);
+	}
+}
+
 #if defined(SAME51)
 
 // Internal DMAC interrupt handler
@@ -267,36 +375,37 @@ static inline void CommonDmacHandler(uint8_t channel)
 	if (intflag != 0)					// should always be true
 	{
 		DMAC->Channel[channel].CHINTFLAG.reg = intflag;
-		const DmaCallbackFunction fn = dmaChannelCallbackFunctions[channel];
-		if (fn != nullptr)
-		{
-			fn(callbackParams[channel], (DmaCallbackReason)intflag);
-		}
+		ChannelInterrupt(channel, intflag);
 	}
 }
 
 extern "C" void DMAC_0_Handler()
 {
+	IsrTimer timer(IsrId::dma);
 	CommonDmacHandler(0);
 }
 
 extern "C" void DMAC_1_Handler()
 {
+	IsrTimer timer(IsrId::dma);
 	CommonDmacHandler(1);
 }
 
 extern "C" void DMAC_2_Handler()
 {
+	IsrTimer timer(IsrId::dma);
 	CommonDmacHandler(2);
 }
 
 extern "C" void DMAC_3_Handler()
 {
+	IsrTimer timer(IsrId::dma);
 	CommonDmacHandler(3);
 }
 
 extern "C" void DMAC_4_Handler()
 {
+	IsrTimer timer(IsrId::dma);
 	hri_dmac_intpend_reg_t intPend;
 	while ((intPend = DMAC->INTPEND.reg & DMAC_INTPEND_ID_Msk) > 3)
 	{
@@ -308,6 +417,7 @@ extern "C" void DMAC_4_Handler()
 
 extern "C" void DMAC_Handler()
 {
+	IsrTimer timer(IsrId::dma);
 	hri_dmac_intpend_reg_t intPend;
 	while (((intPend = DMAC->INTPEND.reg) & (DMAC_INTPEND_SUSP | DMAC_INTPEND_TCMPL | DMAC_INTPEND_TERR)) != 0)
 	{
@@ -317,11 +427,7 @@ extern "C" void DMAC_Handler()
 		if (intflag != 0)					// should always be true
 		{
 			DMAC->CHINTFLAG.reg = intflag;
-			const DmaCallbackFunction fn = dmaChannelCallbackFunctions[channel];
-			if (fn != nullptr)
-			{
-				fn(callbackParams[channel], (DmaCallbackReason)intflag);
-			}
+			ChannelInterrupt(channel, intflag);
 		}
 	}
 }
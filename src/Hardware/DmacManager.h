@@ -193,13 +193,28 @@ static inline uint8_t GetSercomRxTrigSource(uint8_t sercomNumber)
 	return (uint8_t)DmaTrigSource::sercom0_rx + (sercomNumber * 2);
 }
 
+constexpr DmaChannel NoDmaChannel = 0xFF;			// returned by AllocateChannel when no channel is free
+
 namespace DmacManager
 {
 	void Init();
+
+	// Dynamic channel allocation. Channels below FirstDynamicDmaChannel are assigned in the board configuration file; the rest are handed out here.
+	DmaChannel AllocateChannel();
+	void ReleaseChannel(DmaChannel channel);
+
+	// Initialise a descriptor that is not one of the channel descriptors, so that it can be linked to a channel descriptor or to another linked descriptor.
+	// Linked descriptors must be 16-byte aligned and must remain valid until the transfer has completed. Pass nullptr as 'next' to end the chain.
+	void InitLinkedDescriptor(DmacDescriptor& desc, uint16_t btctrl, const volatile void *src, volatile void *dst, uint32_t amount, const DmacDescriptor *next);
+
+	// Make the channel descriptor link back to itself, so that the transfer repeats until the channel is disabled. Use BLOCKACT_INT to get a callback per block.
+	void SetCircular(uint8_t channel, bool circular);
+
 	void SetDestinationAddress(uint8_t channel, volatile void *const dst);
 	void SetSourceAddress(uint8_t channel, const volatile void *const src);
 	void SetDataLength(uint8_t channel, uint32_t amount);
 	void SetBtctrl(uint8_t channel, uint16_t val);
+	void SetNextDescriptor(uint8_t channel, const DmacDescriptor *next);
 	void SetTriggerSource(uint8_t channel, DmaTrigSource source);
 	void SetTriggerSourceSercomTx(uint8_t channel, uint8_t sercomNumber);
 	void SetTriggerSourceSercomRx(uint8_t channel, uint8_t sercomNumber);
@@ -211,6 +226,7 @@ namespace DmacManager
 	void DisableCompletedInterrupt(uint8_t channel);
 	uint8_t GetChannelStatus(uint8_t channel);
 	uint16_t GetBytesTransferred(uint8_t channel);
+	void Diagnostics(const StringRef& reply);
 }
 
 #endif /* SRC_HARDWARE_DMACMANAGER_H_ */
@@ -0,0 +1,155 @@
+/*
+ * FastStop.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "FastStop.h"
+
+#if SUPPORT_HARDWARE_FAST_STOP
+
+#include "Interrupts.h"
+#include "IoPorts.h"
+#include "Peripherals.h"
+#include <Platform.h>
+
+#if HAS_SMART_DRIVERS
+# if SUPPORT_TMC51xx
+#  include <Movement/StepperDrivers/TMC51xx.h>
+# endif
+# if SUPPORT_TMC22xx
+#  include <Movement/StepperDrivers/TMC22xx.h>
+# endif
+#endif
+
+#if defined(SAME51)
+# include <hri_mclk_e51.h>
+#elif defined(SAMC21)
+# include <hri_mclk_c21.h>
+#else
+# error Undefined processor
+#endif
+
+namespace FastStop
+{
+	static Pin fastStopPin = NoPin;					// the input that triggers the fast stop, or NoPin if there isn't one
+	static uint8_t channelUser = 0;					// the value to write to the EVSYS user register to connect the route
+	static bool disableHigh = true;					// true if the drivers are disabled by driving the enable pin high
+	static volatile bool armed = false;
+	static volatile bool stopped = false;			// true if we have stopped the drivers and not yet enabled them again
+	static uint32_t numStops = 0;
+
+	static PortGroup *GetEnablePortGroup() { return &(PORT->Group[FastStopEnablePin >> 5]); }
+}
+
+// Make an input the fast stop input. Only one input can be used, so this replaces any previous one. The caller must arm it when the input is inactive.
+bool FastStop::Attach(Pin inputPin)
+{
+#if !HAS_SMART_DRIVERS
+	const int8_t enableValue = Platform::GetEnableValue(0);
+	if (enableValue < 0)
+	{
+		return false;								// the driver has no enable pin
+	}
+	disableHigh = (enableValue == 0);
+#endif
+
+	if (fastStopPin != NoPin && fastStopPin != inputPin)
+	{
+		Detach(fastStopPin);
+	}
+
+	const int exintNumber = SetPinEventOutput(inputPin, true);
+	if (exintNumber < 0)
+	{
+		return false;
+	}
+
+	fastStopPin = inputPin;
+	channelUser = EVSYS_USER_CHANNEL(FastStopEventChannel + 1);
+
+#if defined(SAME51)
+	hri_mclk_set_APBBMASK_EVSYS_bit(MCLK);
+	EVSYS->Channel[FastStopEventChannel].CHANNEL.reg = EVSYS_CHANNEL_EVGEN(EVSYS_ID_GEN_EIC_EXTINT_0 + exintNumber) | EVSYS_CHANNEL_PATH_ASYNCHRONOUS;
+#elif defined(SAMC21)
+	hri_mclk_set_APBCMASK_EVSYS_bit(MCLK);
+	EVSYS->CHANNEL[FastStopEventChannel].reg = EVSYS_CHANNEL_EVGEN(EVSYS_ID_GEN_EIC_EXTINT_0 + exintNumber) | EVSYS_CHANNEL_PATH_ASYNCHRONOUS;
+#endif
+
+	// Set up the PORT event input, keeping the settings of the other event inputs
+	constexpr unsigned int shift = FastStopPortEventInput * 8;
+	PortGroup * const group = GetEnablePortGroup();
+	const uint32_t evctrl = PORT_EVCTRL_PID0(FastStopEnablePin & 31) | ((disableHigh) ? PORT_EVCTRL_EVACT0_SET : PORT_EVCTRL_EVACT0_CLR) | PORT_EVCTRL_PORTEI0;
+	group->EVCTRL.reg = (group->EVCTRL.reg & ~(0xFFu << shift)) | (evctrl << shift);
+	return true;
+}
+
+void FastStop::Detach(Pin inputPin)
+{
+	if (inputPin == fastStopPin && inputPin != NoPin)
+	{
+		Disarm();
+		(void)SetPinEventOutput(inputPin, false);
+		constexpr unsigned int shift = FastStopPortEventInput * 8;
+		GetEnablePortGroup()->EVCTRL.reg &= ~(0xFFu << shift);
+		fastStopPin = NoPin;
+	}
+}
+
+// Connect the route from the input to the enable pin. Call this only when the input is inactive, because the EIC also generates an event when the input becomes inactive.
+void FastStop::Arm()
+{
+	if (fastStopPin != NoPin)
+	{
+		EVSYS->USER[EVSYS_ID_USER_PORT_EV_0 + FastStopPortEventInput].reg = channelUser;
+		armed = true;
+	}
+}
+
+// Disconnect the route
+void FastStop::Disarm()
+{
+	EVSYS->USER[EVSYS_ID_USER_PORT_EV_0 + FastStopPortEventInput].reg = 0;
+	armed = false;
+}
+
+// Disconnect the route and record the stop. Called from the input ISR when the input becomes active, by which time the hardware has already disabled the drivers.
+void FastStop::InputTriggered()
+{
+	if (armed)
+	{
+		Disarm();
+		stopped = true;
+		++numStops;
+	}
+}
+
+// Enable the drivers again. Called from the input ISR after it has stopped the moves, so that the motors hold their positions.
+void FastStop::RestoreDriversEnable()
+{
+	if (stopped)
+	{
+		stopped = false;
+#if HAS_SMART_DRIVERS
+		if (SmartDrivers::AreDriversReady())
+		{
+			fastDigitalWriteLow(FastStopEnablePin);
+		}
+#else
+		if (Platform::IsDriverEnabled(0))
+		{
+			digitalWrite(FastStopEnablePin, !disableHigh);
+		}
+#endif
+	}
+}
+
+uint32_t FastStop::GetNumStops()
+{
+	return numStops;
+}
+
+#endif
+
+// End
@@ -0,0 +1,34 @@
+/*
+ * FastStop.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  Hardware fast stop for crash protection and homing. When it is armed, the EIC event from one input is routed through the event system
+ *  to a PORT event input that drives the drivers enable pin to its disabled level, so the motors stop within a few clocks of the input edge
+ *  however busy the CPU is. The input monitor's ISR then disarms it, stops the moves of the drivers concerned and enables the drivers again.
+ *  The EIC generates events on both edges of an input monitor, so the route is disconnected from the trigger until the input becomes inactive again.
+ *  All the drivers on the board share the enable pin, so all of them are disabled until the software has stopped the moves.
+ */
+
+#ifndef SRC_HARDWARE_FASTSTOP_H_
+#define SRC_HARDWARE_FASTSTOP_H_
+
+#include "RepRapFirmware.h"
+
+#if SUPPORT_HARDWARE_FAST_STOP
+
+namespace FastStop
+{
+	bool Attach(Pin inputPin);				// make this input the fast stop input, returning false if the pin can't generate events
+	void Detach(Pin inputPin);				// stop using this input for fast stop
+	void Arm();								// connect the event route, called when the input is inactive
+	void Disarm();							// disconnect the event route
+	void InputTriggered();					// called from the ISR when the input becomes active, by which time the hardware has disabled the drivers if we were armed
+	void RestoreDriversEnable();			// enable the drivers again after the moves have been stopped, if they were enabled when the stop happened
+	uint32_t GetNumStops();
+}
+
+#endif
+
+#endif /* SRC_HARDWARE_FASTSTOP_H_ */
@@ -8,10 +8,59 @@
 #include "Flash.h"
 
 #include <hal/include/hal_flash.h>
+#include <RTOSIface/RTOSIface.h>
 
 namespace Flash
 {
 	static flash_descriptor flash;
+
+	constexpr uint32_t MinHardwareCrcLength = 64;			// below this it is quicker to calculate the CRC in software than to set up the DSU
+	constexpr uint32_t MaxHardwareCrcChunk = 4096;			// other tasks are locked out while the DSU is busy, so we give it no more than this many bytes at a time
+
+	static bool dsuUnprotected = false;
+
+	// Update a CRC32 using a small table that processes 4 bits at a time. The CRC is not inverted at the start or end.
+	static uint32_t SoftwareCrc32(uint32_t crc, const uint8_t *p, uint32_t length)
+	{
+		static constexpr uint32_t CrcNibbleTable[16] =
+		{
+			0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+			0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+		};
+
+		while (length != 0)
+		{
+			crc ^= *p++;
+			crc = (crc >> 4) ^ CrcNibbleTable[crc & 0x0F];
+			crc = (crc >> 4) ^ CrcNibbleTable[crc & 0x0F];
+			--length;
+		}
+		return crc;
+	}
+
+	// Update a CRC32 using the CRC engine in the Device Service Unit, which uses the same polynomial and bit order as the software version.
+	// The start address and length must be multiples of 4. Return false if the DSU couldn't read the memory.
+	static bool HardwareCrc32(uint32_t& crc, uint32_t start, uint32_t length)
+	{
+		TaskCriticalSectionLocker lock;						// the DSU can only do one calculation at a time
+		if (!dsuUnprotected)
+		{
+			PAC->WRCTRL.reg = PAC_WRCTRL_PERID(ID_DSU) | PAC_WRCTRL_KEY_CLR;	// the DSU is write protected after reset
+			dsuUnprotected = true;
+		}
+		DSU->STATUSA.reg = DSU_STATUSA_DONE | DSU_STATUSA_BERR;	// clear the flags left by the previous calculation
+		DSU->DATA.reg = crc;
+		DSU->ADDR.reg = start;
+		DSU->LENGTH.reg = length;
+		DSU->CTRL.reg = DSU_CTRL_CRC;
+		while ((DSU->STATUSA.reg & DSU_STATUSA_DONE) == 0) { }
+		if ((DSU->STATUSA.reg & DSU_STATUSA_BERR) != 0)
+		{
+			return false;
+		}
+		crc = DSU->DATA.reg;
+		return true;
+	}
 }
 
 bool Flash::Init()
@@ -81,4 +130,37 @@ bool Flash::Write(uint32_t start, uint32_t length, uint8_t *data)
 	return ok;
 }
 
+// Calculate the CRC32 of part of the flash memory or RAM, using the same algorithm that appends the CRC to the firmware binary.
+// The DSU does the word aligned middle part of a large block and we do any bytes before and after it in software.
+uint32_t Flash::CalculateCrc32(uint32_t start, uint32_t length)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	if (length >= MinHardwareCrcLength)
+	{
+		const uint32_t leadingBytes = (0u - start) & 3u;
+		crc = SoftwareCrc32(crc, reinterpret_cast<const uint8_t*>(start), leadingBytes);
+		start += leadingBytes;
+		length -= leadingBytes;
+		while (length >= 4)
+		{
+			const uint32_t chunk = min<uint32_t>(length & ~3u, MaxHardwareCrcChunk);
+			if (!HardwareCrc32(crc, start, chunk))
+			{
+				break;										// the DSU can't read this memory, so do the rest in software
+			}
+			start += chunk;
+			length -= chunk;
+		}
+	}
+	return ~SoftwareCrc32(crc, reinterpret_cast<const uint8_t*>(start), length);
+}
+
+// This is defined by the linker script. The CRC is appended to the firmware binary at _firmware_crc.
+extern "C" uint32_t _firmware_crc;
+
+uint32_t Flash::GetFirmwareEnd()
+{
+	return reinterpret_cast<uint32_t>(&_firmware_crc) + sizeof(_firmware_crc);
+}
+
 // End
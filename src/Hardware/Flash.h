@@ -26,6 +26,9 @@ namespace Flash
 	bool Erase(uint32_t start, uint32_t length);
 	bool Lock(uint32_t start, uint32_t length);
 	bool Write(uint32_t start, uint32_t length, uint8_t *data);
+
+	uint32_t CalculateCrc32(uint32_t start, uint32_t length);		// calculate the standard CRC32 of part of the flash memory or RAM, using the DSU where we can
+	uint32_t GetFirmwareEnd();										// return the address of the first byte of flash memory after the firmware binary and its CRC
 }
 
 #endif /* SRC_HARDWARE_FLASH_H_ */
@@ -7,6 +7,8 @@
 
 #include "Interrupts.h"
 #include "Peripherals.h"
+#include <Movement/StepTimer.h>
+#include <Tasks.h>
 
 struct InterruptCallback
 {
@@ -20,6 +22,63 @@ struct InterruptCallback
 // Therefore we will have a clash if we try to attach an interrupt to two pins that use the same EXINT.
 // The pin table ensures that only one pin is flagged as able to use each EXINT.
 static InterruptCallback exintCallbacks[16];
+static PulseTimer *exintPulseTimers[16] = { 0 };		// if a pulse timer is attached, the handler times the pulses itself instead of calling the callback
+
+#if defined(SAME51)
+
+constexpr uint32_t DebounceClockFrequency = 32768;		// we use CLK_ULP32K so that the debounce times don't depend on the CPU clock
+static uint32_t debounceRequests[16] = { 0 };			// the debounce time in microseconds that each EXINT asked for, or 0 if it isn't debounced
+
+// Return the debounce time for a prescaler setting and number of states
+static inline uint32_t DebounceMicroseconds(unsigned int prescaler, bool sevenStates)
+{
+	return ((sevenStates) ? 7 : 3) * (2u << prescaler) * 1000000u/DebounceClockFrequency;
+}
+
+// Set the debounce prescaler of a group of 8 EXINTs to give the longest debounce time that doesn't exceed the shortest time requested in the group. The EIC must be disabled.
+static void SetDebouncePrescaler(unsigned int group)
+{
+	uint32_t shortest = 0xFFFFFFFF;
+	for (size_t i = group * 8; i < group * 8 + 8; ++i)
+	{
+		if (debounceRequests[i] != 0 && debounceRequests[i] < shortest)
+		{
+			shortest = debounceRequests[i];
+		}
+	}
+	if (shortest == 0xFFFFFFFF)
+	{
+		return;
+	}
+
+	unsigned int bestPrescaler = 0;
+	bool bestSevenStates = false;
+	for (unsigned int prescaler = 0; prescaler < 8; ++prescaler)
+	{
+		for (bool sevenStates : { false, true })
+		{
+			const uint32_t t = DebounceMicroseconds(prescaler, sevenStates);
+			if (t <= shortest && t > DebounceMicroseconds(bestPrescaler, bestSevenStates))
+			{
+				bestPrescaler = prescaler;
+				bestSevenStates = sevenStates;
+			}
+		}
+	}
+
+	uint32_t reg = EIC->DPRESCALER.reg | EIC_DPRESCALER_TICKON;
+	if (group == 0)
+	{
+		reg = (reg & ~(EIC_DPRESCALER_PRESCALER0_Msk | EIC_DPRESCALER_STATES0)) | EIC_DPRESCALER_PRESCALER0(bestPrescaler) | ((bestSevenStates) ? EIC_DPRESCALER_STATES0 : 0);
+	}
+	else
+	{
+		reg = (reg & ~(EIC_DPRESCALER_PRESCALER1_Msk | EIC_DPRESCALER_STATES1)) | EIC_DPRESCALER_PRESCALER1(bestPrescaler) | ((bestSevenStates) ? EIC_DPRESCALER_STATES1 : 0);
+	}
+	EIC->DPRESCALER.reg = reg;
+}
+
+#endif
 
 void InitialisePinChangeInterrupts()
 {
@@ -65,7 +124,7 @@ void InitialisePinChangeInterrupts()
 }
 
 // Attach an interrupt to the specified pin returning true if successful
-bool AttachInterrupt(Pin pin, StandardCallbackFunction callback, InterruptMode mode, CallbackParameter param)
+bool AttachInterrupt(Pin pin, StandardCallbackFunction callback, InterruptMode mode, CallbackParameter param, InterruptFilter filter, uint32_t debounceMicroseconds)
 {
 	if (pin >= ARRAY_SIZE(PinTable))
 	{
@@ -82,17 +141,32 @@ bool AttachInterrupt(Pin pin, StandardCallbackFunction callback, InterruptMode m
 	uint32_t modeWord;
 	switch (mode)
 	{
-	case InterruptMode::low:		modeWord = EIC_CONFIG_SENSE0_LOW_Val  | EIC_CONFIG_FILTEN0; break;
-	case InterruptMode::high:		modeWord = EIC_CONFIG_SENSE0_HIGH_Val | EIC_CONFIG_FILTEN0; break;
-	case InterruptMode::falling:	modeWord = EIC_CONFIG_SENSE0_FALL_Val | EIC_CONFIG_FILTEN0; break;
-	case InterruptMode::rising:		modeWord = EIC_CONFIG_SENSE0_RISE_Val | EIC_CONFIG_FILTEN0; break;
-	case InterruptMode::change:		modeWord = EIC_CONFIG_SENSE0_BOTH_Val | EIC_CONFIG_FILTEN0; break;
+	case InterruptMode::low:		modeWord = EIC_CONFIG_SENSE0_LOW_Val; break;
+	case InterruptMode::high:		modeWord = EIC_CONFIG_SENSE0_HIGH_Val; break;
+	case InterruptMode::falling:	modeWord = EIC_CONFIG_SENSE0_FALL_Val; break;
+	case InterruptMode::rising:		modeWord = EIC_CONFIG_SENSE0_RISE_Val; break;
+	case InterruptMode::change:		modeWord = EIC_CONFIG_SENSE0_BOTH_Val; break;
 	default:						modeWord = EIC_CONFIG_SENSE0_NONE_Val; break;
 	}
 
+#if defined(SAME51)
+	const bool debounce = (filter == InterruptFilter::debounce && debounceMicroseconds != 0);
+#else
+	const bool debounce = false;						// the SAMC21G has no debouncer, so use the majority filter instead
+	if (filter == InterruptFilter::debounce)
+	{
+		filter = InterruptFilter::majority;
+	}
+#endif
+	if (filter == InterruptFilter::majority && mode != InterruptMode::none)
+	{
+		modeWord |= EIC_CONFIG_FILTEN0;
+	}
+
 	const irqflags_t flags = cpu_irq_save();
 	exintCallbacks[exintNumber].func = callback;
 	exintCallbacks[exintNumber].param = param;
+	exintPulseTimers[exintNumber] = nullptr;
 
 	// Switch the pin into EIC mode
 	gpio_set_pin_function(pin, GPIO_PIN_FUNCTION_A);		// EIC is always on peripheral A
@@ -112,6 +186,22 @@ bool AttachInterrupt(Pin pin, StandardCallbackFunction callback, InterruptMode m
 		EIC->CONFIG[1].reg = (EIC->CONFIG[1].reg & mask) | (modeWord << shift);
 	}
 
+#if defined(SAME51)
+	// The debounce registers are enable-protected, so we set them while the EIC is disabled
+	debounceRequests[exintNumber] = (debounce) ? debounceMicroseconds : 0;
+	if (debounce)
+	{
+		EIC->DEBOUNCEN.reg |= 1ul << exintNumber;
+		SetDebouncePrescaler(exintNumber >> 3);
+	}
+	else
+	{
+		EIC->DEBOUNCEN.reg &= ~(1ul << exintNumber);
+	}
+#else
+	(void)debounce;
+#endif
+
 	hri_eic_set_CTRLA_ENABLE_bit(EIC);
 
 	// Enable interrupt
@@ -129,6 +219,22 @@ bool AttachInterrupt(Pin pin, StandardCallbackFunction callback, InterruptMode m
 	return true;
 }
 
+// Attach a pulse timer to the specified pin returning true if successful. The pulse timer takes precedence over any callback.
+bool AttachPulseTimer(Pin pin, InterruptMode mode, PulseTimer *timer)
+{
+	if (!AttachInterrupt(pin, nullptr, mode, CallbackParameter()))
+	{
+		return false;
+	}
+	const unsigned int exintNumber = PinTable[pin].exintNumber;
+	const irqflags_t flags = cpu_irq_save();
+	timer->count = 0;
+	timer->suspended = false;
+	exintPulseTimers[exintNumber] = timer;
+	cpu_irq_restore(flags);
+	return true;
+}
+
 void DetachInterrupt(Pin pin)
 {
 	if (pin <= ARRAY_SIZE(PinTable))
@@ -150,6 +256,10 @@ void DetachInterrupt(Pin pin)
 			{
 				EIC->CONFIG[1].reg &= mask;
 			}
+#if defined(SAME51)
+			EIC->DEBOUNCEN.reg &= ~(1ul << exintNumber);
+			debounceRequests[exintNumber] = 0;
+#endif
 
 			hri_eic_set_CTRLA_ENABLE_bit(EIC);
 
@@ -161,16 +271,121 @@ void DetachInterrupt(Pin pin)
 			gpio_set_pin_function(pin, GPIO_PIN_FUNCTION_OFF);
 
 			exintCallbacks[exintNumber].func = nullptr;
+			exintPulseTimers[exintNumber] = nullptr;
+		}
+	}
+}
+
+// Get the debounce time that an input actually has, which may be shorter than it asked for if it shares the debounce prescaler with another input
+uint32_t GetDebounceMicroseconds(Pin pin)
+{
+#if defined(SAME51)
+	if (pin < ARRAY_SIZE(PinTable))
+	{
+		const unsigned int exintNumber = PinTable[pin].exintNumber;
+		if (exintNumber < 16 && (EIC->DEBOUNCEN.reg & (1ul << exintNumber)) != 0)
+		{
+			const uint32_t reg = EIC->DPRESCALER.reg;
+			return (exintNumber < 8)
+					? DebounceMicroseconds((reg & EIC_DPRESCALER_PRESCALER0_Msk) >> EIC_DPRESCALER_PRESCALER0_Pos, (reg & EIC_DPRESCALER_STATES0) != 0)
+						: DebounceMicroseconds((reg & EIC_DPRESCALER_PRESCALER1_Msk) >> EIC_DPRESCALER_PRESCALER1_Pos, (reg & EIC_DPRESCALER_STATES1) != 0);
+		}
+	}
+#endif
+	return 0;
+}
+
+// Enable or disable the EIC event output for a pin, so that the event system can act on its edges without the CPU. Return the EXINT number, or -1 if the pin has none.
+// The event is generated on the edges that the interrupt is configured for.
+int SetPinEventOutput(Pin pin, bool enable)
+{
+	if (pin >= ARRAY_SIZE(PinTable))
+	{
+		return -1;
+	}
+
+	const unsigned int exintNumber = PinTable[pin].exintNumber;
+	if (exintNumber >= 16)
+	{
+		return -1;
+	}
+
+	const irqflags_t flags = cpu_irq_save();
+	hri_eic_clear_CTRLA_ENABLE_bit(EIC);				// EVCTRL is enable-protected
+	hri_eic_wait_for_sync(EIC, EIC_SYNCBUSY_ENABLE);
+	if (enable)
+	{
+		EIC->EVCTRL.reg |= 1ul << exintNumber;
+	}
+	else
+	{
+		EIC->EVCTRL.reg &= ~(1ul << exintNumber);
+	}
+	hri_eic_set_CTRLA_ENABLE_bit(EIC);
+	cpu_irq_restore(flags);
+	return (int)exintNumber;
+}
+
+// Stop an attached interrupt from being taken, without changing the EIC configuration. This may be called from the ISR of that interrupt.
+void SuspendInterrupt(Pin pin)
+{
+	if (pin < ARRAY_SIZE(PinTable))
+	{
+		const unsigned int exintNumber = PinTable[pin].exintNumber;
+		if (exintNumber < 16)
+		{
+			hri_eic_clear_INTEN_reg(EIC, 1ul << exintNumber);
+		}
+	}
+}
+
+// Allow a suspended interrupt to be taken again. Any edge that happened while it was suspended is discarded.
+void ResumeInterrupt(Pin pin)
+{
+	if (pin < ARRAY_SIZE(PinTable))
+	{
+		const unsigned int exintNumber = PinTable[pin].exintNumber;
+		if (exintNumber < 16)
+		{
+			hri_eic_clear_INTFLAG_reg(EIC, 1ul << exintNumber);
+			hri_eic_set_INTEN_reg(EIC, 1ul << exintNumber);
 		}
 	}
 }
 
+// Time a pulse. The first edge after the interrupt is resumed starts the timing, because edges that happened while it was suspended were discarded.
+static inline __attribute__((always_inline)) void TimePulse(PulseTimer& pt, size_t exintNumber)
+{
+	const uint32_t now = StepTimer::GetTimerTicks();
+	if (pt.count == 0)
+	{
+		pt.startTime = now;
+	}
+	else if (pt.count == pt.numIntervals)
+	{
+		pt.interval = now - pt.startTime;
+		pt.whenCompleted = now;
+		pt.count = 0;
+		pt.suspended = true;
+		EIC->INTENCLR.reg = 1ul << exintNumber;
+		return;
+	}
+	++pt.count;
+}
+
 #if defined(SAME51)
 
-// Common EXINT handler
-static inline void CommonExintHandler(size_t exintNumber)
+// Common EXINT handler. Each EIC_n_Handler calls it with a constant exintNumber, so the compiler generates a separate handler for each with the table addresses fixed.
+static inline __attribute__((always_inline)) void CommonExintHandler(size_t exintNumber)
 {
+	IsrTimer timer(IsrId::eic);
 	EIC->INTFLAG.reg = 1ul << exintNumber;				// clear the interrupt
+	PulseTimer * const pt = exintPulseTimers[exintNumber];
+	if (pt != nullptr)
+	{
+		TimePulse(*pt, exintNumber);
+		return;
+	}
 	const InterruptCallback& cb = exintCallbacks[exintNumber];
 	if (cb.func != nullptr)
 	{
@@ -262,6 +477,7 @@ extern "C" void EIC_15_Handler(void)
 
 extern "C" void EIC_Handler(void)
 {
+	IsrTimer timer(IsrId::eic);
 	uint16_t intflag;
 	while ((intflag = EIC->INTFLAG.reg) != 0)
 	{
@@ -272,10 +488,18 @@ extern "C" void EIC_Handler(void)
 			if ((intflag & mask) != 0)
 			{
 				EIC->INTFLAG.reg = mask;
-				const InterruptCallback& cb = exintCallbacks[exintNumber];
-				if (cb.func != nullptr)
+				PulseTimer * const pt = exintPulseTimers[exintNumber];
+				if (pt != nullptr)
+				{
+					TimePulse(*pt, exintNumber);
+				}
+				else
 				{
-					cb.func(cb.param);
+					const InterruptCallback& cb = exintCallbacks[exintNumber];
+					if (cb.func != nullptr)
+					{
+						cb.func(cb.param);
+					}
 				}
 				intflag &= ~mask;
 			}
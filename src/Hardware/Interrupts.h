@@ -35,11 +35,41 @@ enum class InterruptMode : uint8_t
 	rising
 };
 
+// Filtering applied by the EIC before it raises an interrupt. The majority filter takes 3 samples of GCLK_EIC and rejects glitches shorter than about 2 clocks.
+// Hardware debouncing needs the input to be stable for 3 or 7 ticks of a prescaled 32kHz clock, and is only available on the SAME5x.
+// The debounce prescaler is shared by EXINTs 0-7 and by EXINTs 8-15, so the inputs in each group get the shortest debounce time that any of them asked for.
+enum class InterruptFilter : uint8_t
+{
+	none = 0,
+	majority,
+	debounce
+};
+
 typedef void (*StandardCallbackFunction)(CallbackParameter);
 
+// Burst timing of pulses, done in the EIC interrupt handler itself for inputs such as fan tachos that pulse at kHz rates, so that each pulse costs no function calls.
+// After the first edge the handler times numIntervals more edges, then suspends the interrupt. The owner restarts it by clearing 'suspended' and calling ResumeInterrupt.
+struct PulseTimer
+{
+	uint32_t numIntervals;						// set by the owner before it attaches the timer
+	uint32_t count;								// accessed only by the interrupt handler
+	uint32_t startTime;							// the step clock at the first edge of the current burst, accessed only by the interrupt handler
+	volatile uint32_t interval;					// the step clocks taken by the last complete burst
+	volatile uint32_t whenCompleted;			// the step clock when the last burst completed
+	volatile bool suspended;					// true if the handler has suspended the interrupt because it has completed a burst
+
+	PulseTimer(uint32_t n) : numIntervals(n), count(0), startTime(0), interval(0), whenCompleted(0), suspended(false) { }
+};
+
 void InitialisePinChangeInterrupts();
-bool AttachInterrupt(Pin pin, StandardCallbackFunction callback, InterruptMode mode, CallbackParameter param);
+bool AttachInterrupt(Pin pin, StandardCallbackFunction callback, InterruptMode mode, CallbackParameter param,
+						InterruptFilter filter = InterruptFilter::majority, uint32_t debounceMicroseconds = 0);
+bool AttachPulseTimer(Pin pin, InterruptMode mode, PulseTimer *timer);
 void DetachInterrupt(Pin pin);
+uint32_t GetDebounceMicroseconds(Pin pin);			// get the actual debounce time of an input, or 0 if it isn't debounced
+int SetPinEventOutput(Pin pin, bool enable);		// enable or disable the EIC event output of a pin, returning its EXINT number or -1 if it has none
+void SuspendInterrupt(Pin pin);
+void ResumeInterrupt(Pin pin);
 
 // Return true if we are in any interrupt service routine
 static inline bool inInterrupt()
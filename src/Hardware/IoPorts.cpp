@@ -88,36 +88,20 @@ void IoPort::Release()
 	if (IsValid() && !isSharedInput)
 	{
 		::DetachInterrupt(pin);
+		AnalogOut::Release(pin);
 		portUsedBy[pin] = PinUsedBy::unused;
 		logicalPinModes[pin] = PIN_MODE_NOT_CONFIGURED;
 	}
 	pin = NoPin;
 	hardwareInvert = totalInvert = false;
-}
-
-void IoPort::WriteDigital(bool high) const
-{
-	if (IsValid())
-	{
-		WriteDigital(pin, (totalInvert) ? !high : high);
-	}
-}
-
-bool IoPort::Read() const
-{
-	if (IsValid())
-	{
-		const bool b = ReadPin(pin);
-		return (totalInvert) ? !b : b;
-	}
-	return false;
+	fastPort.Clear();
 }
 
 uint16_t IoPort::ReadAnalog() const
 {
 	if (IsValid())
 	{
-		AdcInput chan = PinTable[pin].adc;
+		const AdcInput chan = AnalogIn::PinToAdcInput(pin, false);
 		if (chan != AdcInput::none)
 		{
 			const uint16_t val = AnalogIn::ReadChannel(chan);
@@ -128,9 +112,19 @@ uint16_t IoPort::ReadAnalog() const
 }
 
 // Attach an interrupt to the pin. Nor permitted if we allocated the pin in shared input mode.
-bool IoPort::AttachInterrupt(StandardCallbackFunction callback, InterruptMode mode, CallbackParameter param) const
+bool IoPort::AttachInterrupt(StandardCallbackFunction callback, InterruptMode mode, CallbackParameter param, InterruptFilter filter, uint32_t debounceMicroseconds) const
 {
-	return IsValid() && !isSharedInput && ::AttachInterrupt(pin, callback, mode, param);
+	return IsValid() && !isSharedInput && ::AttachInterrupt(pin, callback, mode, param, filter, debounceMicroseconds);
+}
+
+bool IoPort::AttachPulseTimer(InterruptMode mode, PulseTimer *timer) const
+{
+	return IsValid() && !isSharedInput && ::AttachPulseTimer(pin, mode, timer);
+}
+
+uint32_t IoPort::GetDebounceMicroseconds() const
+{
+	return (IsValid() && !isSharedInput) ? ::GetDebounceMicroseconds(pin) : 0;
 }
 
 void IoPort::DetachInterrupt() const
@@ -141,11 +135,42 @@ void IoPort::DetachInterrupt() const
 	}
 }
 
+// Temporarily stop taking the interrupt attached to this pin. This may be called from the ISR.
+void IoPort::SuspendInterrupt() const
+{
+	if (IsValid() && !isSharedInput)
+	{
+		::SuspendInterrupt(pin);
+	}
+}
+
+void IoPort::ResumeInterrupt() const
+{
+	if (IsValid() && !isSharedInput)
+	{
+		::ResumeInterrupt(pin);
+	}
+}
+
 bool IoPort::SetAnalogCallback(AnalogInCallbackFunction fn, CallbackParameter cbp, uint32_t ticksPerCall)
 {
 	return AnalogIn::SetCallback(pin, fn, cbp, ticksPerCall, false);
 }
 
+// Ask the ADC to call the function as soon as a reading crosses the threshold. The window monitor works on the raw reading, so we can't use it if the port is inverted.
+bool IoPort::EnableAnalogWindowMonitor(uint16_t threshold, AnalogInCallbackFunction fn, CallbackParameter cbp)
+{
+	return IsValid() && !totalInvert && AnalogIn::EnableWindowMonitor(pin, threshold, fn, cbp, false);
+}
+
+void IoPort::DisableAnalogWindowMonitor()
+{
+	if (IsValid())
+	{
+		AnalogIn::DisableWindowMonitor(pin, false);
+	}
+}
+
 // Try to assign ports, returning the number of ports successfully assigned
 /*static*/ size_t IoPort::AssignPorts(const char* pinNames, const StringRef& reply, PinUsedBy neededFor, size_t numPorts, IoPort* const ports[], const PinAccess access[])
 {
@@ -275,6 +300,10 @@ bool IoPort::GetInvert() const
 void IoPort::SetInvert(bool pInvert)
 {
 	totalInvert = (hardwareInvert) ? !pInvert : pInvert;
+	if (IsValid())
+	{
+		fastPort.Set(pin, totalInvert);
+	}
 }
 
 void IoPort::ToggleInvert(bool pInvert)
@@ -282,6 +311,10 @@ void IoPort::ToggleInvert(bool pInvert)
 	if (pInvert)
 	{
 		totalInvert = !totalInvert;
+		if (IsValid())
+		{
+			fastPort.Set(pin, totalInvert);
+		}
 	}
 }
 
@@ -567,6 +600,9 @@ void IoPort::AppendPinName(const StringRef& str) const
 PwmPort::PwmPort()
 {
 	frequency = DefaultPinWritePwmFreq;
+#if SUPPORT_SERVO_OUTPUTS
+	isServo = false;
+#endif
 }
 
 void PwmPort::AppendDetails(const StringRef& str) const
@@ -575,6 +611,13 @@ void PwmPort::AppendDetails(const StringRef& str) const
 	if (IsValid())
 	{
 		str.catf(" frequency %uHz", frequency);
+#if SUPPORT_SERVO_OUTPUTS
+		if (isServo)
+		{
+			str.cat(" servo");
+		}
+#endif
+		AnalogOut::AppendPwmDetails(pin, frequency, str);
 	}
 }
 
@@ -582,8 +625,26 @@ void PwmPort::WriteAnalog(float pwm) const
 {
 	if (pin != NoPin)
 	{
+#if SUPPORT_SERVO_OUTPUTS
+		if (isServo)
+		{
+			AnalogOut::WriteServo(pin, pwm, frequency, totalInvert);
+			return;
+		}
+#endif
 		IoPort::WriteAnalog(pin, ((totalInvert) ? 1.0 - pwm : pwm), frequency);
 	}
 }
 
+#if SUPPORT_PWM_SEQUENCES
+
+// Start a PWM sequence that runs in hardware, returning false if this port can't do that
+bool PwmPort::WriteSequence(float startPwm, uint32_t holdMillis, float endPwm, uint32_t rampMillis) const
+{
+	return pin != NoPin
+		&& AnalogOut::WriteSequence(pin, ((totalInvert) ? 1.0 - startPwm : startPwm), holdMillis, ((totalInvert) ? 1.0 - endPwm : endPwm), rampMillis, frequency);
+}
+
+#endif
+
 // End
@@ -59,6 +59,41 @@ enum PinMode
 	OUTPUT_PWM_OPEN_DRAIN			// used in SX1509B expansion driver to put the pin in PWM output mode
 };
 
+// Handle for fast digital access to a port in ISRs and other hot paths. The owning IoPort sets up the port group, bit mask and inversion when the pin is allocated,
+// so each access is a single register read or write with no pin table lookup. A default-constructed handle reads as inactive and ignores writes.
+class FastPort
+{
+public:
+	FastPort() : group(nullptr), mask(0), invert(false) { }
+
+	bool IsValid() const { return group != nullptr; }
+	bool Read() const { return IsValid() && ((group->IN.reg & mask) != 0) != invert; }
+	void WriteDigital(bool high) const
+	{
+		if (IsValid())
+		{
+			if (high != invert)
+			{
+				group->OUTSET.reg = mask;
+			}
+			else
+			{
+				group->OUTCLR.reg = mask;
+			}
+		}
+	}
+
+private:
+	friend class IoPort;
+
+	void Set(Pin p, bool inv) { group = &(PORT->Group[p >> 5]); mask = 1ul << (p & 31); invert = inv; }
+	void Clear() { group = nullptr; mask = 0; invert = false; }
+
+	PortGroup *group;
+	uint32_t mask;
+	bool invert;
+};
+
 // Class to represent a port
 class IoPort
 {
@@ -80,13 +115,21 @@ public:
 	void ToggleInvert(bool pInvert);
 	bool UseAlternateConfig() const { return alternateConfig; }
 
-	void WriteDigital(bool high) const;
-	bool Read() const;
+	void WriteDigital(bool high) const { fastPort.WriteDigital(high); }
+	bool Read() const { return fastPort.Read(); }
 	uint16_t ReadAnalog() const;
+	const FastPort& GetFastPort() const { return fastPort; }	// owners may keep a copy of this for use in ISRs, but must refresh it if they reassign the port or change the inversion
 
-	bool AttachInterrupt(StandardCallbackFunction callback, InterruptMode mode, CallbackParameter param) const;
+	bool AttachInterrupt(StandardCallbackFunction callback, InterruptMode mode, CallbackParameter param,
+							InterruptFilter filter = InterruptFilter::majority, uint32_t debounceMicroseconds = 0) const;
+	bool AttachPulseTimer(InterruptMode mode, PulseTimer *timer) const;
+	uint32_t GetDebounceMicroseconds() const;
 	void DetachInterrupt() const;
+	void SuspendInterrupt() const;
+	void ResumeInterrupt() const;
 	bool SetAnalogCallback(AnalogInCallbackFunction fn, CallbackParameter cbp, uint32_t ticksPerCall);
+	bool EnableAnalogWindowMonitor(uint16_t threshold, AnalogInCallbackFunction fn, CallbackParameter cbp);
+	void DisableAnalogWindowMonitor();
 
 	// Initialise static data
 	static void Init();
@@ -116,6 +159,7 @@ protected:
 	static const char* TranslatePinAccess(PinAccess access);
 
 	Pin pin;
+	FastPort fastPort;										// cached port register, mask and inversion for fast digital access
 	uint8_t hardwareInvert : 1,								// true if the hardware includes inversion
 			totalInvert : 1,								// true if the value should be inverted when reading/writing the pin
 			isSharedInput : 1,								// true if we are using this pin as a shared input
@@ -135,10 +179,20 @@ public:
 
 	void AppendDetails(const StringRef& str) const;			// hides the version in IoPort
 	void SetFrequency(PwmFrequency freq) { frequency = freq; }
+	PwmFrequency GetFrequency() const { return frequency; }
+#if SUPPORT_SERVO_OUTPUTS
+	void SetServo(bool b) { isServo = b; }
+#endif
 	void WriteAnalog(float pwm) const;
+#if SUPPORT_PWM_SEQUENCES
+	bool WriteSequence(float startPwm, uint32_t holdMillis, float endPwm, uint32_t rampMillis) const;
+#endif
 
 private:
 	PwmFrequency frequency;
+#if SUPPORT_SERVO_OUTPUTS
+	bool isServo;											// true if the values we write are servo pulse widths
+#endif
 };
 
 inline bool digitalRead(Pin p)
@@ -0,0 +1,210 @@
+/*
+ * NvmWriter.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "NvmWriter.h"
+#include "EEPROM.h"
+#include <Movement/Move.h>
+#include <RTOSIface/RTOSIface.h>
+#include <hpl_user_area.h>
+
+namespace NvmWriter
+{
+	struct QueuedWrite
+	{
+		CompletionCallback callback;
+		CallbackParameter cbParam;
+		uint16_t offset;
+		uint8_t length;
+		NvmArea area;
+		uint8_t data[MaxWriteLength];
+	};
+
+	constexpr size_t MaxQueuedWrites = 4;
+	constexpr size_t MaxCombinedUserAreaBytes = 128;			// the most bytes of the user area we combine into one write
+
+	static QueuedWrite queue[MaxQueuedWrites];
+	static size_t numQueued = 0;
+	static uint32_t whenFirstQueued;
+	static uint32_t longestWait = 0;
+	static unsigned int numWrites = 0, numUnchanged = 0, numFailed = 0;
+
+	// Write the queued user area data, combining the writes into one if we can. Return true if all the writes succeeded.
+	static bool WriteUserArea(const QueuedWrite *writes, size_t count)
+	{
+		uint32_t start = UINT32_MAX, end = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (writes[i].area == NvmArea::userArea)
+			{
+				start = min<uint32_t>(start, writes[i].offset);
+				end = max<uint32_t>(end, writes[i].offset + writes[i].length);
+			}
+		}
+		if (start >= end)
+		{
+			return true;										// no user area writes
+		}
+
+		if (end - start <= MaxCombinedUserAreaBytes)
+		{
+			alignas(4) uint8_t combined[MaxCombinedUserAreaBytes];
+			memcpy(combined, reinterpret_cast<const uint8_t*>(NVMCTRL_USER + start), end - start);
+			for (size_t i = 0; i < count; ++i)
+			{
+				if (writes[i].area == NvmArea::userArea)
+				{
+					memcpy(combined + (writes[i].offset - start), writes[i].data, writes[i].length);
+				}
+			}
+			if (memcmp(combined, reinterpret_cast<const uint8_t*>(NVMCTRL_USER + start), end - start) == 0)
+			{
+				++numUnchanged;
+				return true;
+			}
+			++numWrites;
+			return _user_area_write(reinterpret_cast<void*>(NVMCTRL_USER), start, combined, end - start) == 0;
+		}
+
+		// The writes are too far apart to combine, so do them one at a time
+		bool ok = true;
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (writes[i].area == NvmArea::userArea)
+			{
+				if (memcmp(writes[i].data, reinterpret_cast<const uint8_t*>(NVMCTRL_USER + writes[i].offset), writes[i].length) == 0)
+				{
+					++numUnchanged;
+				}
+				else
+				{
+					++numWrites;
+					if (_user_area_write(reinterpret_cast<void*>(NVMCTRL_USER), writes[i].offset, writes[i].data, writes[i].length) != 0)
+					{
+						ok = false;
+					}
+				}
+			}
+		}
+		return ok;
+	}
+
+	// Do all the queued writes and call their completion callbacks
+	static void DoWrites()
+	{
+		QueuedWrite writes[MaxQueuedWrites];
+		size_t count;
+		{
+			TaskCriticalSectionLocker lock;
+			count = numQueued;
+			memcpy(writes, queue, count * sizeof(QueuedWrite));
+			numQueued = 0;
+		}
+		if (count == 0)
+		{
+			return;
+		}
+
+		const uint32_t waited = millis() - whenFirstQueued;
+		if (waited > longestWait)
+		{
+			longestWait = waited;
+		}
+
+		const bool userAreaOk = WriteUserArea(writes, count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			bool ok = userAreaOk;
+			if (writes[i].area == NvmArea::eeprom)
+			{
+				char current[MaxWriteLength];
+				if (EEPROM::Read(current, writes[i].offset, writes[i].length) && memcmp(current, writes[i].data, writes[i].length) == 0)
+				{
+					++numUnchanged;
+					ok = true;
+				}
+				else
+				{
+					++numWrites;
+					ok = EEPROM::Write(reinterpret_cast<const char*>(writes[i].data), writes[i].offset, writes[i].length);
+				}
+			}
+			if (!ok)
+			{
+				++numFailed;
+			}
+			if (writes[i].callback != nullptr)
+			{
+				writes[i].callback(writes[i].cbParam, ok);
+			}
+		}
+	}
+}
+
+bool NvmWriter::QueueWrite(NvmArea area, uint32_t offset, const void *data, size_t length, CompletionCallback callback, CallbackParameter cp)
+{
+	if (length > MaxWriteLength)
+	{
+		return false;
+	}
+
+	TaskCriticalSectionLocker lock;
+
+	// If there is already a write queued to the same place, replace it
+	QueuedWrite *qw = nullptr;
+	for (size_t i = 0; i < numQueued; ++i)
+	{
+		if (queue[i].area == area && queue[i].offset == offset && queue[i].length == length)
+		{
+			qw = &queue[i];
+			break;
+		}
+	}
+
+	if (qw == nullptr)
+	{
+		if (numQueued == MaxQueuedWrites)
+		{
+			return false;
+		}
+		if (numQueued == 0)
+		{
+			whenFirstQueued = millis();
+		}
+		qw = &queue[numQueued++];
+	}
+
+	qw->area = area;
+	qw->offset = offset;
+	qw->length = length;
+	memcpy(qw->data, data, length);
+	qw->callback = callback;
+	qw->cbParam = cp;
+	return true;
+}
+
+// Do the queued writes if no moves are running, because the step interrupt can't run while the flash is busy
+void NvmWriter::Spin()
+{
+	if (numQueued != 0 && (moveInstance == nullptr || moveInstance->NoLiveMovement()))
+	{
+		DoWrites();
+	}
+}
+
+void NvmWriter::Flush()
+{
+	DoWrites();
+}
+
+void NvmWriter::Diagnostics(const StringRef& reply)
+{
+	reply.lcatf("NVM writes %u, unchanged %u, failed %u, pending %u, longest wait %" PRIu32 "ms", numWrites, numUnchanged, numFailed, (unsigned int)numQueued, longestWait);
+	numWrites = numUnchanged = numFailed = 0;
+	longestWait = 0;
+}
+
+// End
@@ -0,0 +1,37 @@
+/*
+ * NvmWriter.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  Deferred writes to the NVM user area and the EEPROM. Erasing and writing the user area stalls every access to the flash memory,
+ *  including the step interrupt, for several milliseconds. So instead of writing straight away, commands queue their writes here and we do them
+ *  from the main task when no moves are running. Queued writes to the user area are combined so that the page is only erased once,
+ *  and writes that would not change anything are skipped so that they don't wear the flash.
+ */
+
+#ifndef SRC_HARDWARE_NVMWRITER_H_
+#define SRC_HARDWARE_NVMWRITER_H_
+
+#include "RepRapFirmware.h"
+
+enum class NvmArea : uint8_t
+{
+	userArea = 0,				// the NVM user area, offsets are from the start of it
+	eeprom,						// the SmartEEPROM on the SAME51 or the RWW EEPROM on the SAMC21
+};
+
+namespace NvmWriter
+{
+	typedef void (*CompletionCallback)(CallbackParameter cp, bool ok);
+
+	constexpr size_t MaxWriteLength = 32;
+
+	// Queue a write, returning false if the data is too long or the queue is full. A queued write to the same place as an earlier one replaces it, including its callback.
+	bool QueueWrite(NvmArea area, uint32_t offset, const void *data, size_t length, CompletionCallback callback = nullptr, CallbackParameter cp = CallbackParameter());
+	void Spin();				// do the queued writes if no moves are running
+	void Flush();				// do the queued writes straight away, called before we reset
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif /* SRC_HARDWARE_NVMWRITER_H_ */
@@ -51,6 +51,18 @@ static inline constexpr unsigned int GetOutputNumber(TcOutput tc) { return (uint
 void EnableTcClock(unsigned int tcNumber, uint32_t gclkVal);
 void EnableTccClock(unsigned int tccNumber, uint32_t gclkVal);
 
+// Generic clock generators. The step clock, CAN bit timing and ADC conversion times are derived from a 48MHz clock, so those peripherals use the timing GCLK.
+// On the SAME51 the CPU runs at 120MHz from DPLL0, the peripherals whose rates we calculate from SystemPeripheralClock use half that, and the timing GCLK
+// has its own DPLL so that the CPU clock can be changed without changing any timing constant. On the SAMC21 everything runs from the 48MHz GCLK0.
+constexpr uint32_t TimingClockFrequency = 48000000;
+#if defined(SAME51)
+constexpr uint32_t GclkPeripheral = GCLK_PCHCTRL_GEN_GCLK1_Val;
+constexpr uint32_t GclkTiming = GCLK_PCHCTRL_GEN_GCLK2_Val;
+#elif defined(SAMC21)
+constexpr uint32_t GclkPeripheral = GCLK_PCHCTRL_GEN_GCLK0_Val;
+constexpr uint32_t GclkTiming = GCLK_PCHCTRL_GEN_GCLK0_Val;
+#endif
+
 enum class TccOutput : uint8_t
 {
 #ifdef SAME51
@@ -176,16 +176,35 @@ void Serial::Disable(uint8_t sercomNumber)
 }
 
 Uart::Uart(uint8_t sercomNum, IRQn irqnum)
-	: sercom(Serial::GetSercom(sercomNum)), txWaitingTask(nullptr), irqNumber(irqnum), sercomNumber(sercomNum)
+	: sercom(Serial::GetSercom(sercomNum)), txWaitingTask(nullptr), irqNumber(irqnum), sercomNumber(sercomNum),
+	  txDmaBuffer(nullptr), txDmaBufferSize(0), txDmaReserveIndex(0), txDmaCommitIndex(0), txDmaReadIndex(0), txDmaTransferLength(0), txDmaActiveWriters(0),
+	  droppedMessages(0), txDmaChannel(NoDmaChannel)
 {
 }
 
 // Initialise the UART. numRxSlots may be zero if we don't wish to receive.
-void Uart::Init(size_t numTxSlots, size_t numRxSlots, uint32_t baudRate, uint8_t rxPad)
+void Uart::Init(size_t numTxSlots, size_t numRxSlots, uint32_t baudRate, uint8_t rxPad, bool txDma)
 {
-	txBuffer.Init(numTxSlots);
+	if (txDma)
+	{
+		txDmaChannel = DmacManager::AllocateChannel();
+	}
+	if (IsTxDmaEnabled())
+	{
+		txDmaBuffer = new char[numTxSlots];
+		txDmaBufferSize = numTxSlots;
+		txBuffer.Init(0);
+	}
+	else
+	{
+		txBuffer.Init(numTxSlots);
+	}
 	rxBuffer.Init(numRxSlots);
 	Serial::InitUart(sercomNumber, baudRate, rxPad);
+	if (IsTxDmaEnabled())
+	{
+		DmacManager::SetInterruptCallback(txDmaChannel, TxDmaCompleteCallback, this);
+	}
 	errors.all = 0;
 	sercom->USART.INTENSET.reg = (numRxSlots > 1) ? SERCOM_USART_INTENSET_RXC | SERCOM_USART_INTENSET_ERROR : 0;
 	NVIC_EnableIRQ(irqNumber);
@@ -203,10 +222,14 @@ char Uart::GetChar()
 	return (rxBuffer.GetItem(c)) ? c : 0;
 }
 
-// Write single character, blocking
+// Write single character, blocking unless we are using DMA
 void Uart::PutChar(char c)
 {
-	if (txBuffer.IsEmpty() && sercom->USART.INTFLAG.bit.DRE)
+	if (IsTxDmaEnabled())
+	{
+		(void)TryPutMessage(&c, 1);
+	}
+	else if (txBuffer.IsEmpty() && sercom->USART.INTFLAG.bit.DRE)
 	{
 		sercom->USART.DATA.reg = c;
 	}
@@ -229,14 +252,24 @@ void Uart::PutChar(char c)
 // Nonblocking write block
 size_t Uart::TryPutBlock(const char* buffer, size_t buflen)
 {
+	if (IsTxDmaEnabled())
+	{
+		return (TryPutMessage(buffer, buflen)) ? buflen : 0;
+	}
 	const size_t written = txBuffer.PutBlock(buffer, buflen);
 	sercom->USART.INTENSET.reg = SERCOM_USART_INTENSET_DRE;
 	return written;
 }
 
-// Blocking write block
+// Blocking write block, or non-blocking if we are using DMA
 void Uart::PutBlock(const char* buffer, size_t buflen)
 {
+	if (IsTxDmaEnabled())
+	{
+		(void)TryPutMessage(buffer, buflen);
+		return;
+	}
+
 	for (;;)
 	{
 		buflen -= txBuffer.PutBlock(buffer, buflen);
@@ -257,6 +290,110 @@ void Uart::PutString(const char *str)
 	PutBlock(str, strlen(str));
 }
 
+// Reserve space for a message in the DMA transmit buffer, returning false if there isn't enough
+bool Uart::ReserveTxDmaSpace(size_t len, uint32_t& start)
+{
+	AtomicCriticalSectionLocker lock;
+	if (len > txDmaBufferSize - (txDmaReserveIndex - txDmaReadIndex))
+	{
+		++droppedMessages;
+		return false;
+	}
+	start = txDmaReserveIndex;
+	txDmaReserveIndex = start + len;
+	++txDmaActiveWriters;
+	return true;
+}
+
+// Copy data into space that we reserved, with interrupts enabled, wrapping round at the end of the buffer. Return the next index.
+uint32_t Uart::CopyToTxDmaBuffer(uint32_t start, const char *data, size_t len)
+{
+	const size_t offset = start & (txDmaBufferSize - 1);
+	const size_t firstPart = min<size_t>(len, txDmaBufferSize - offset);
+	memcpy(txDmaBuffer + offset, data, firstPart);
+	memcpy(txDmaBuffer, data + firstPart, len - firstPart);
+	return start + len;
+}
+
+// Commit the data if no other writer is still copying into space reserved before ours
+void Uart::CommitTxDma()
+{
+	AtomicCriticalSectionLocker lock;
+	if (--txDmaActiveWriters == 0)
+	{
+		txDmaCommitIndex = txDmaReserveIndex;
+		StartTxDma();
+	}
+}
+
+// Non-blocking write of a complete message when using DMA
+bool Uart::TryPutMessage(const char *msg, size_t len)
+{
+	uint32_t start;
+	if (!IsTxDmaEnabled() || !ReserveTxDmaSpace(len, start))
+	{
+		return false;
+	}
+	(void)CopyToTxDmaBuffer(start, msg, len);
+	CommitTxDma();
+	return true;
+}
+
+// Non-blocking write of a message made up of three null-terminated strings, which are queued together so that messages from other tasks can't get between them
+bool Uart::TryPutMessage(const char *prefix, const char *msg, const char *suffix)
+{
+	const size_t prefixLength = strlen(prefix), msgLength = strlen(msg), suffixLength = strlen(suffix);
+	uint32_t start;
+	if (!IsTxDmaEnabled() || !ReserveTxDmaSpace(prefixLength + msgLength + suffixLength, start))
+	{
+		return false;
+	}
+	start = CopyToTxDmaBuffer(start, prefix, prefixLength);
+	start = CopyToTxDmaBuffer(start, msg, msgLength);
+	(void)CopyToTxDmaBuffer(start, suffix, suffixLength);
+	CommitTxDma();
+	return true;
+}
+
+uint32_t Uart::GetAndClearDroppedMessages()
+{
+	AtomicCriticalSectionLocker lock;
+	const uint32_t ret = droppedMessages;
+	droppedMessages = 0;
+	return ret;
+}
+
+// Start sending committed data if we are not already doing so. Called with interrupts disabled or from the DMA complete interrupt.
+void Uart::StartTxDma()
+{
+	if (txDmaTransferLength == 0 && txDmaReadIndex != txDmaCommitIndex)
+	{
+		// Send up to the end of the committed data or the end of the buffer, whichever comes first
+		const size_t offset = txDmaReadIndex & (txDmaBufferSize - 1);
+		const size_t len = min<size_t>(txDmaCommitIndex - txDmaReadIndex, txDmaBufferSize - offset);
+		txDmaTransferLength = len;
+
+		DmacManager::DisableChannel(txDmaChannel);
+		DmacManager::SetTriggerSourceSercomTx(txDmaChannel, sercomNumber);
+		DmacManager::SetBtctrl(txDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
+											| DMAC_BTCTRL_SRCINC | DMAC_BTCTRL_STEPSEL_SRC | DMAC_BTCTRL_STEPSIZE_X1);
+		DmacManager::SetSourceAddress(txDmaChannel, txDmaBuffer + offset);
+		DmacManager::SetDestinationAddress(txDmaChannel, &(sercom->USART.DATA.reg));
+		DmacManager::SetDataLength(txDmaChannel, len);						// this also adjusts the source address
+		DmacManager::EnableCompletedInterrupt(txDmaChannel);
+		DmacManager::EnableChannel(txDmaChannel, UartTxDmaPriority);
+	}
+}
+
+// DMA complete callback. If the transfer failed then the data is lost, but we carry on with the next data.
+/*static*/ void Uart::TxDmaCompleteCallback(CallbackParameter cp, DmaCallbackReason reason)
+{
+	Uart * const u = static_cast<Uart *>(cp.vp);
+	u->txDmaReadIndex += u->txDmaTransferLength;
+	u->txDmaTransferLength = 0;
+	u->StartTxDma();
+}
+
 // Get and clear the errors
 Uart::ErrorFlags Uart::GetAndClearErrors()
 {
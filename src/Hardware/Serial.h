@@ -11,6 +11,7 @@
 #include "RepRapFirmware.h"
 #include <General/RingBuffer.h>
 #include <RTOSIface/RTOSIface.h>
+#include "DmacManager.h"
 
 namespace Serial
 {
@@ -41,7 +42,16 @@ public:
 	Uart(uint8_t sercomNum, IRQn irqnum);
 
 	// Initialise. numTxSlots and numRxSlots must be power of 2.
-	void Init(size_t numTxSlots, size_t numRxSlots, uint32_t baudRate, uint8_t rxPad);
+	// If txDma is true and a DMA channel is available, transmission uses DMA from a buffer of numTxSlots bytes instead of the DRE interrupt.
+	void Init(size_t numTxSlots, size_t numRxSlots, uint32_t baudRate, uint8_t rxPad, bool txDma = false);
+
+	bool IsTxDmaEnabled() const { return txDmaChannel != NoDmaChannel; }
+
+	// Non-blocking write of a whole message, which is either queued completely or discarded and counted. Only available when transmitting using DMA.
+	// It may be called from any task or ISR without holding a mutex, because space in the buffer is reserved atomically.
+	bool TryPutMessage(const char *msg, size_t len);
+	bool TryPutMessage(const char *prefix, const char *msg, const char *suffix);
+	uint32_t GetAndClearDroppedMessages();
 
 	// Non-blocking read, returns 0 if no char available.
 	char GetChar();
@@ -65,6 +75,12 @@ public:
 	ErrorFlags GetAndClearErrors();
 
 private:
+	static void TxDmaCompleteCallback(CallbackParameter cp, DmaCallbackReason reason);
+	bool ReserveTxDmaSpace(size_t len, uint32_t& start);
+	uint32_t CopyToTxDmaBuffer(uint32_t start, const char *data, size_t len);
+	void CommitTxDma();
+	void StartTxDma();
+
 	RingBuffer<char> txBuffer;
 	RingBuffer<char> rxBuffer;
 	Sercom * const sercom;
@@ -72,6 +88,19 @@ private:
 	const IRQn irqNumber;
 	const uint8_t sercomNumber;
 	ErrorFlags errors;
+
+	// DMA transmission. The indices run freely and are masked with (txDmaBufferSize - 1) to address the buffer.
+	// Writers reserve space by advancing txDmaReserveIndex and copy their data outside the critical section. When the last writer has finished copying,
+	// txDmaCommitIndex is advanced to txDmaReserveIndex, so the DMA only ever sends data that has been completely written.
+	char *txDmaBuffer;
+	size_t txDmaBufferSize;
+	volatile uint32_t txDmaReserveIndex;
+	volatile uint32_t txDmaCommitIndex;
+	volatile uint32_t txDmaReadIndex;
+	volatile uint32_t txDmaTransferLength;					// length of the transfer in progress, zero if none
+	volatile unsigned int txDmaActiveWriters;
+	uint32_t droppedMessages;
+	DmaChannel txDmaChannel;
 };
 
 #endif /* SRC_SERIAL_H_ */
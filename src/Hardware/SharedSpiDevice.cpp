@@ -13,9 +13,47 @@
 #include "DmacManager.h"
 #include "Serial.h"
 #include "peripheral_clk_config.h"
+#include <RTOSIface/RTOSIface.h>
 
 constexpr uint32_t DefaultSharedSpiClockFrequency = 2000000;
 constexpr uint32_t SpiTimeout = 10000;
+constexpr uint32_t SpiDmaTimeoutMillis = 10;							// our transfers are at most a few bytes, but we may have to wait for other queued transactions first
+
+// The transaction queue. The transaction in progress has been removed from the queue.
+static SpiTransaction *queueHead = nullptr;
+static SpiTransaction *queueTail = nullptr;
+static SpiTransaction * volatile currentTransaction = nullptr;
+static unsigned int numTransactions = 0, numFailed = 0, numCancelled = 0, queueDepth = 0, maxQueueDepth = 0;
+
+static DmaChannel sspiTxDmaChannel = NoDmaChannel, sspiRxDmaChannel = NoDmaChannel;
+
+static const uint8_t dummyTxData = 0xFF;									// what we send if the caller doesn't provide any data
+static uint8_t dummyRxData;													// where we store received data if the caller doesn't want it
+
+static void StartNextTransaction();
+
+// DMA complete callback. Finish the current transaction and start the next one.
+static void RxDmaCompleteCallback(CallbackParameter param, DmaCallbackReason reason)
+{
+	DmacManager::DisableChannel(sspiTxDmaChannel);
+	DmacManager::DisableChannel(sspiRxDmaChannel);
+	SpiTransaction * const t = currentTransaction;
+	if (t != nullptr)
+	{
+		t->device->Deselect();
+		currentTransaction = nullptr;
+		const bool ok = (reason == DmaCallbackReason::complete);
+		if (!ok)
+		{
+			++numFailed;
+		}
+		if (t->callback != nullptr)
+		{
+			t->callback(t->cbParam, ok);								// this may queue another transaction
+		}
+	}
+	StartNextTransaction();
+}
 
 static void InitSpi()
 {
@@ -49,23 +87,13 @@ static void InitSpi()
 	hri_sercomusart_write_BAUD_reg(SERCOM_SSPI, SERCOM_SPI_BAUD_BAUD(SystemPeripheralClock/(2 * DefaultSharedSpiClockFrequency) - 1));
 	hri_sercomusart_write_DBGCTRL_reg(SERCOM_SSPI, SERCOM_I2CM_DBGCTRL_DBGSTOP);			// baud rate generator is stopped when CPU halted by debugger
 
-#if 0	// if using DMA
-	// Set up the DMA descriptors
-	// We use separate write-back descriptors, so we only need to set this up once, but it must be in SRAM
-	DmacSetBtctrl(SspiRxDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
-								| DMAC_BTCTRL_DSTINC | DMAC_BTCTRL_STEPSEL_DST | DMAC_BTCTRL_STEPSIZE_X1);
-	DmacSetSourceAddress(SspiRxDmaChannel, &(SERCOM_SSPI->SPI.DATA.reg));
-	DmacSetDestinationAddress(SspiRxDmaChannel, rcvData);
-	DmacSetDataLength(SspiRxDmaChannel, ARRAY_SIZE(rcvData));
-
-	DmacSetBtctrl(SspiTxDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
-								| DMAC_BTCTRL_SRCINC | DMAC_BTCTRL_STEPSEL_SRC | DMAC_BTCTRL_STEPSIZE_X1);
-	DmacSetSourceAddress(SspiTxDmaChannel, sendData);
-	DmacSetDestinationAddress(SspiTxDmaChannel, &(SERCOM_SSPI->SPI.DATA.reg));
-	DmacSetDataLength(SspiTxDmaChannel, ARRAY_SIZE(sendData));
-
-	DmacSetInterruptCallbacks(SspiRxDmaChannel, RxDmaCompleteCallback, nullptr, 0U);
-#endif
+	// The DMA addresses and lengths depend on the transfer, so we only allocate the channels and set up the callback here
+	sspiTxDmaChannel = DmacManager::AllocateChannel();
+	sspiRxDmaChannel = DmacManager::AllocateChannel();
+	if (sspiRxDmaChannel != NoDmaChannel)
+	{
+		DmacManager::SetInterruptCallback(sspiRxDmaChannel, RxDmaCompleteCallback, 0U);
+	}
 
 	SERCOM_SSPI->SPI.CTRLB.bit.RXEN = 1;
 }
@@ -208,6 +236,167 @@ bool SharedSpiDevice::TransceivePacket(const uint8_t* tx_data, uint8_t* rx_data,
 	return true;	// success
 }
 
+// Start the DMA transfer for a transaction. The device must already be selected.
+static void StartDma(const uint8_t *tx_data, uint8_t *rx_data, size_t len)
+{
+	DmacManager::DisableChannel(sspiRxDmaChannel);
+	DmacManager::DisableChannel(sspiTxDmaChannel);
+	DmacManager::SetTriggerSourceSercomRx(sspiRxDmaChannel, SERCOM_SSPI_NUMBER);
+	DmacManager::SetTriggerSourceSercomTx(sspiTxDmaChannel, SERCOM_SSPI_NUMBER);
+
+	// If the caller didn't provide a buffer, send or receive the same dummy byte repeatedly
+	DmacManager::SetBtctrl(sspiRxDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
+								| ((rx_data == nullptr) ? 0 : DMAC_BTCTRL_DSTINC | DMAC_BTCTRL_STEPSEL_DST | DMAC_BTCTRL_STEPSIZE_X1));
+	DmacManager::SetSourceAddress(sspiRxDmaChannel, &(SERCOM_SSPI->SPI.DATA.reg));
+	DmacManager::SetDestinationAddress(sspiRxDmaChannel, (rx_data == nullptr) ? &dummyRxData : rx_data);
+	DmacManager::SetDataLength(sspiRxDmaChannel, len);						// this also adjusts the destination address
+
+	DmacManager::SetBtctrl(sspiTxDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_NOACT | DMAC_BTCTRL_BEATSIZE_BYTE
+								| ((tx_data == nullptr) ? 0 : DMAC_BTCTRL_SRCINC | DMAC_BTCTRL_STEPSEL_SRC | DMAC_BTCTRL_STEPSIZE_X1));
+	DmacManager::SetSourceAddress(sspiTxDmaChannel, (tx_data == nullptr) ? &dummyTxData : tx_data);
+	DmacManager::SetDestinationAddress(sspiTxDmaChannel, &(SERCOM_SSPI->SPI.DATA.reg));
+	DmacManager::SetDataLength(sspiTxDmaChannel, len);						// this also adjusts the source address
+
+	// As for the TMC51xx drivers, disable SPI while we enable DMA, so that the transmit trigger doesn't arrive before the receive channel is ready.
+	// Discard any stale received data first. We complete on the receive channel, because that is when the last byte has been clocked in.
+	DisableSpi();
+	while (SERCOM_SSPI->SPI.INTFLAG.bit.RXC)
+	{
+		(void)SERCOM_SSPI->SPI.DATA.reg;
+	}
+	DmacManager::EnableCompletedInterrupt(sspiRxDmaChannel);
+	DmacManager::EnableChannel(sspiRxDmaChannel, SspiRxDmaPriority);
+	DmacManager::EnableChannel(sspiTxDmaChannel, SspiTxDmaPriority);
+	EnableSpi();
+}
+
+// Start the transaction at the head of the queue if there is one and no transaction is in progress. Called with interrupts disabled or from the DMA interrupt.
+static void StartNextTransaction()
+{
+	if (currentTransaction == nullptr && queueHead != nullptr)
+	{
+		SpiTransaction * const t = queueHead;
+		queueHead = t->next;
+		if (queueHead == nullptr)
+		{
+			queueTail = nullptr;
+		}
+		--queueDepth;
+		++numTransactions;
+		currentTransaction = t;
+		t->device->Select();
+		delayMicroseconds(1);												// allow for the chip select setup time of the slowest devices
+		StartDma(t->txData, t->rxData, t->length);
+	}
+}
+
+/*static*/ bool SharedSpiDevice::QueueTransaction(SpiTransaction& t)
+{
+	if (t.length == 0 || sspiTxDmaChannel == NoDmaChannel || sspiRxDmaChannel == NoDmaChannel)
+	{
+		return false;
+	}
+
+	t.next = nullptr;
+	AtomicCriticalSectionLocker lock;
+	if (queueTail == nullptr)
+	{
+		queueHead = &t;
+	}
+	else
+	{
+		queueTail->next = &t;
+	}
+	queueTail = &t;
+	++queueDepth;
+	if (queueDepth > maxQueueDepth)
+	{
+		maxQueueDepth = queueDepth;
+	}
+	StartNextTransaction();
+	return true;
+}
+
+/*static*/ void SharedSpiDevice::CancelTransaction(SpiTransaction& t)
+{
+	AtomicCriticalSectionLocker lock;
+	if (currentTransaction == &t)
+	{
+		DmacManager::DisableChannel(sspiTxDmaChannel);
+		DmacManager::DisableChannel(sspiRxDmaChannel);
+		t.device->Deselect();
+		currentTransaction = nullptr;
+		++numCancelled;
+		StartNextTransaction();
+	}
+	else
+	{
+		SpiTransaction *prev = nullptr;
+		for (SpiTransaction *p = queueHead; p != nullptr; p = p->next)
+		{
+			if (p == &t)
+			{
+				if (prev == nullptr)
+				{
+					queueHead = p->next;
+				}
+				else
+				{
+					prev->next = p->next;
+				}
+				if (queueTail == p)
+				{
+					queueTail = prev;
+				}
+				--queueDepth;
+				++numCancelled;
+				break;
+			}
+			prev = p;
+		}
+	}
+}
+
+/*static*/ void SharedSpiDevice::Diagnostics(const StringRef& reply)
+{
+	reply.lcatf("SPI transactions %u, failed %u, cancelled %u, max queued %u", numTransactions, numFailed, numCancelled, maxQueueDepth);
+	numTransactions = numFailed = numCancelled = maxQueueDepth = 0;
+}
+
+// Callback used by TransceivePacketDma to wake up the waiting task
+static void WakeWaitingTask(CallbackParameter cp, bool ok)
+{
+	if (ok)
+	{
+		TaskBase::GiveFromISR(static_cast<TaskHandle>(cp.vp));
+	}
+}
+
+bool SharedSpiDevice::TransceivePacketDma(const uint8_t *tx_data, uint8_t *rx_data, size_t len) const
+{
+	SpiTransaction t;
+	t.device = this;
+	t.txData = tx_data;
+	t.rxData = rx_data;
+	t.length = len;
+	t.callback = WakeWaitingTask;
+	t.cbParam = RTOSIface::GetCurrentTask();
+
+	(void)TaskBase::Take(0);												// clear any stale notification
+	if (!QueueTransaction(t))
+	{
+		return false;
+	}
+	if (TaskBase::Take(SpiDmaTimeoutMillis))
+	{
+		return true;
+	}
+
+	// The transfer failed or timed out, so make sure it is stopped or dequeued before the caller reuses the buffers and we lose the descriptor
+	CancelTransaction(t);
+	return false;
+}
+
 #endif
 
 // End
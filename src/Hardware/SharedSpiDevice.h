@@ -17,6 +17,22 @@ enum class SpiMode : uint8_t
 	mode0 = 0, mode1, mode2, mode3
 };
 
+typedef void (*SpiCallbackFunction)(CallbackParameter cp, bool ok);	// called from the DMA interrupt when an asynchronous transfer completes
+
+class SharedSpiDevice;
+
+// Descriptor of a queued SPI transaction. The client owns it and must not change or reuse it until its callback has been called or it has been cancelled.
+struct SpiTransaction
+{
+	const SharedSpiDevice *device;				// the device to select, which determines the chip select pin, clock frequency and SPI mode
+	const uint8_t *txData;						// the data to send, or null to send 0xFF bytes
+	uint8_t *rxData;							// where to put the received data, or null to discard it
+	size_t length;								// the number of bytes to transfer
+	SpiCallbackFunction callback;				// called from the DMA interrupt when the transaction completes, may be null
+	CallbackParameter cbParam;
+	SpiTransaction *next;						// used by the queue
+};
+
 class SharedSpiDevice
 {
 public:
@@ -25,9 +41,21 @@ public:
 	void InitMaster();
 	void Select() const;
 	void Deselect() const;
+
+	// Polled transfer. The device must be selected and the caller must own the SPI mutex, and the transaction queue must not be in use meanwhile.
 	bool TransceivePacket(const uint8_t *tx_data, uint8_t *rx_data, size_t len) const;
+
+	// Queue a transaction and do it using DMA, then block the calling task until it completes, leaving the CPU free for other tasks meanwhile.
+	// The device is selected and deselected by the queue, so the caller must not select it or take the SPI mutex.
+	bool TransceivePacketDma(const uint8_t *tx_data, uint8_t *rx_data, size_t len) const;
 	void SetCsPin(Pin p) { csPin = p; }
 
+	// Transactions are done back to back in the order they were queued, from the DMA complete interrupt, selecting each device and switching the SPI mode as needed.
+	// QueueTransaction returns false if the transaction has zero length. It may be called from any task or ISR, including from the callback of another transaction.
+	static bool QueueTransaction(SpiTransaction& t);
+	static void CancelTransaction(SpiTransaction& t);			// remove a transaction from the queue, or stop it if it is in progress
+	static void Diagnostics(const StringRef& reply);
+
 private:
 	uint32_t clockFrequency;
 	Pin csPin;
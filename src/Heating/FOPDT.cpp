@@ -11,6 +11,7 @@
 // Set up sensible defaults here in case the user enables the heater without specifying values for all the parameters.
 FopDt::FopDt()
 	: gain(DefaultHotEndHeaterGain), timeConstant(DefaultHotEndHeaterTimeConstant), deadTime(DefaultHotEndHeaterDeadTime), maxPwm(1.0), standardVoltage(0.0),
+	  recipGain(1.0/DefaultHotEndHeaterGain), recipTimeConstant(1.0/DefaultHotEndHeaterTimeConstant), extrusionCoefficient(0.0),
 	  enabled(false), usePid(true), inverted(false), pidParametersOverridden(false)
 {
 }
@@ -30,7 +31,9 @@ bool FopDt::SetParameters(float pg, float ptc, float pdt, float pMaxPwm, float t
 	if (pg > 10.0 && pg <= maxGain && pdt > 0.099 && ptc >= 2 * pdt && pMaxPwm > 0.0099 && pMaxPwm <= 1.0)
 	{
 		gain = pg;
+		recipGain = 1.0/pg;
 		timeConstant = ptc;
+		recipTimeConstant = 1.0/ptc;
 		deadTime = pdt;
 		maxPwm = pMaxPwm;
 		standardVoltage = pVoltage;
@@ -72,6 +75,33 @@ void FopDt::SetRawPidParameters(float p_kP, float p_recipTi, float p_tD)
 	pidParametersOverridden = true;
 }
 
+// Evaluate the PID controller and return the PWM, updating the integral accumulator.
+// If the P and D terms together demand that the heater is full on or full off, we disregard the I term. If presetIntegral is true and the heater is
+// full on because the temperature is rising towards the target, we preset the I term to the expected PWM at this temperature, ready for the switch over to PID.
+float FopDt::CalcPidPwm(float temperature, float error, float derivative, float feedForward, bool inLoadMode, bool presetIntegral, uint32_t sampleInterval, float& iAccumulator) const
+{
+	const PidParameters& params = GetPidParameters(inLoadMode);
+	const float errorMinusDterm = error - (params.tD * derivative);
+	const float pPlusD = params.kP * errorMinusDterm;
+	const float expectedPwm = constrain<float>((temperature - NormalAmbientTemperature) * recipGain + feedForward, 0.0, maxPwm);
+	if (pPlusD + expectedPwm > maxPwm)
+	{
+		if (presetIntegral && error > 0.0 && derivative > 0.0)
+		{
+			iAccumulator = max<float>(expectedPwm - feedForward, 0.0);
+		}
+		return maxPwm;
+	}
+
+	if (pPlusD + expectedPwm < 0.0)
+	{
+		return 0.0;
+	}
+
+	iAccumulator = constrain<float>(iAccumulator + (error * params.kP * params.recipTi * sampleInterval * MillisToSeconds), 0.0, maxPwm);
+	return constrain<float>(pPlusD + iAccumulator + feedForward, 0.0, maxPwm);
+}
+
 /* Re-calculate the PID parameters.
  * For some possible formulas, see "Comparison of some well-known PID tuning formulas", Computers and Chemical Engineering 30 (2006) 14161423,
  * available at http://www.ece.ualberta.ca/~marquez/journal_publications_files/papers/tan_cce_06.pdf
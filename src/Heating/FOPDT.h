@@ -38,7 +38,9 @@ public:
 	bool SetParameters(float pg, float ptc, float pdt, float pMaxPwm, float temperatureLimit, float pVoltage, bool pUsePid, bool pInverted);
 
 	float GetGain() const { return gain; }
+	float GetRecipGain() const { return recipGain; }
 	float GetTimeConstant() const { return timeConstant; }
+	float GetRecipTimeConstant() const { return recipTimeConstant; }
 	float GetDeadTime() const { return deadTime; }
 	float GetMaxPwm() const { return maxPwm; }
 	float GetVoltage() const { return standardVoltage; }
@@ -46,6 +48,8 @@ public:
 	bool IsInverted() const { return inverted; }
 	bool IsEnabled() const { return enabled; }
 	bool ArePidParametersOverridden() const { return pidParametersOverridden; }
+	float GetExtrusionCoefficient() const { return extrusionCoefficient; }
+	void SetExtrusionCoefficient(float c) { extrusionCoefficient = c; }
 	M301PidParameters GetM301PidParameters(bool forLoadChange) const;
 	void SetM301PidParameters(const M301PidParameters& params);
 	void SetRawPidParameters(float p_kP, float p_recipTi, float p_tD);
@@ -55,6 +59,8 @@ public:
 		return (forLoadChange) ? loadChangeParams : setpointChangeParams;
 	}
 
+	float CalcPidPwm(float temperature, float error, float derivative, float feedForward, bool inLoadMode, bool presetIntegral, uint32_t sampleInterval, float& iAccumulator) const;
+
 private:
 	void CalcPidConstants();
 
@@ -63,6 +69,9 @@ private:
 	float deadTime;
 	float maxPwm;
 	float standardVoltage;					// power voltage reading at which tuning was done, or 0 if unknown
+	float recipGain;						// reciprocals of the gain and time constant, because the SAMC21 has no FPU and division is slow
+	float recipTimeConstant;
+	float extrusionCoefficient;				// the extra PWM needed to melt filament extruded at 1mm/sec, or 0 for no extrusion feedforward
 	bool enabled;
 	bool usePid;
 	bool inverted;
@@ -0,0 +1,156 @@
+/*
+ * FopDtEstimator.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "FopDtEstimator.h"
+
+#if SUPPORT_HEATER_MODEL_ESTIMATION
+
+void FopDtEstimator::Candidate::Init(float pa, float pb, size_t pDelay)
+{
+	a = pa;
+	b = pb;
+	p11 = InitialGainCovariance;
+	p12 = 0.0;
+	p22 = InitialPwmCovariance;
+	meanSquareError = 0.0;
+	delay = pDelay;
+}
+
+// Do one step of recursive least squares. x is the previous temperature above ambient, u is the delayed PWM and y is the new temperature above ambient.
+void FopDtEstimator::Candidate::Update(float x, float u, float y)
+{
+	const float error = y - (a * x + b * u);
+	meanSquareError += (fsquare(error) - meanSquareError) * ErrorAveragingFactor;
+	if (fabsf(error) < MinPredictionError)
+	{
+		return;
+	}
+
+	const float pPhi1 = p11 * x + p12 * u;
+	const float pPhi2 = p12 * x + p22 * u;
+	const float denominator = ForgettingFactor + x * pPhi1 + u * pPhi2;
+	const float k1 = pPhi1/denominator;
+	const float k2 = pPhi2/denominator;
+	a += k1 * error;
+	b += k2 * error;
+	p11 = min<float>((p11 - k1 * pPhi1)/ForgettingFactor, MaxCovariance);
+	p12 = (p12 - k1 * pPhi2)/ForgettingFactor;
+	p22 = min<float>((p22 - k2 * pPhi2)/ForgettingFactor, MaxCovariance);
+}
+
+FopDtEstimator::FopDtEstimator()
+{
+	Reset(FopDt());
+}
+
+// Start again, using the configured model as the initial estimate and to choose the dead times to try
+void FopDtEstimator::Reset(const FopDt& model)
+{
+	const float a = expf(-SampleIntervalSeconds/model.GetTimeConstant());
+	const float b = model.GetGain() * (1.0 - a);
+	const float deadTimeSamples = model.GetDeadTime()/SampleIntervalSeconds;
+	for (size_t i = 0; i < NumCandidates; ++i)
+	{
+		// Try 0.5, 1.0 and 1.5 times the configured dead time
+		const size_t delay = constrain<long>(lrintf(deadTimeSamples * (float)(i + 1) * 0.5), 0, MaxDelaySamples - 1);
+		candidates[i].Init(a, b, delay);
+	}
+	for (float& pwm : pwmHistory)
+	{
+		pwm = 0.0;
+	}
+	pwmAccumulator = 0.0;
+	timeAccumulated = 0;
+	historyIndex = 0;
+	numSamples = 0;
+	haveLastTemperature = false;
+}
+
+void FopDtEstimator::Update(float temperature, float pwm, uint32_t sampleInterval)
+{
+	// The PWM was applied during the interval that ended with this reading
+	pwmAccumulator += pwm * (float)sampleInterval;
+	timeAccumulated += sampleInterval;
+	if (timeAccumulated < SampleIntervalMillis)
+	{
+		return;
+	}
+
+	pwmHistory[historyIndex] = pwmAccumulator/(float)timeAccumulated;
+	historyIndex = (historyIndex + 1) % MaxDelaySamples;
+	pwmAccumulator = 0.0;
+	timeAccumulated = 0;
+
+	if (haveLastTemperature)
+	{
+		const float x = lastTemperature - NormalAmbientTemperature;
+		const float y = temperature - NormalAmbientTemperature;
+		for (Candidate& c : candidates)
+		{
+			// The most recent average PWM is at historyIndex - 1, so the one 'delay' samples earlier is at historyIndex - 1 - delay
+			const float u = pwmHistory[(historyIndex + MaxDelaySamples - 1 - c.delay) % MaxDelaySamples];
+			c.Update(x, u, y);
+		}
+		if (numSamples < MinSamples)
+		{
+			++numSamples;
+		}
+	}
+	lastTemperature = temperature;
+	haveLastTemperature = true;
+}
+
+const FopDtEstimator::Candidate& FopDtEstimator::BestCandidate() const
+{
+	const Candidate *best = &candidates[0];
+	for (const Candidate& c : candidates)
+	{
+		if (c.IsValid() && (!best->IsValid() || c.meanSquareError < best->meanSquareError))
+		{
+			best = &c;
+		}
+	}
+	return *best;
+}
+
+bool FopDtEstimator::HaveEstimate() const
+{
+	return numSamples >= MinSamples && BestCandidate().IsValid();
+}
+
+float FopDtEstimator::GetGain() const
+{
+	const Candidate& c = BestCandidate();
+	return c.b/(1.0 - c.a);
+}
+
+float FopDtEstimator::GetTimeConstant() const
+{
+	return -SampleIntervalSeconds/logf(BestCandidate().a);
+}
+
+float FopDtEstimator::GetDeadTime() const
+{
+	return (float)BestCandidate().delay * SampleIntervalSeconds;
+}
+
+float FopDtEstimator::GetDrift(const FopDt& model) const
+{
+	return max<float>(fabsf(GetGain()/model.GetGain() - 1.0), fabsf(GetTimeConstant()/model.GetTimeConstant() - 1.0));
+}
+
+void FopDtEstimator::AppendDetails(const StringRef& reply) const
+{
+	if (HaveEstimate())
+	{
+		reply.catf(", estimated model gain %.1f time constant %.1f dead time %.1f", (double)GetGain(), (double)GetTimeConstant(), (double)GetDeadTime());
+	}
+}
+
+#endif
+
+// End
@@ -0,0 +1,78 @@
+/*
+ * FopDtEstimator.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  Online estimation of the process model of a heater from the temperature readings and PWM during normal operation.
+ *  We fit the discrete first order model T[k] - Tamb = a * (T[k-1] - Tamb) + b * u[k-1-d] by recursive least squares with a forgetting factor,
+ *  where u is the PWM and d is the dead time in samples. The dead time doesn't appear linearly, so we run one estimator for each of a few
+ *  dead times around the one in the configured model and use the one that predicts the temperature best.
+ *  Updates are skipped when the prediction error is within the sensor noise, so that the estimates don't wander while the heater is idle or stable.
+ */
+
+#ifndef SRC_HEATING_FOPDTESTIMATOR_H_
+#define SRC_HEATING_FOPDTESTIMATOR_H_
+
+#include "RepRapFirmware.h"
+
+#if SUPPORT_HEATER_MODEL_ESTIMATION
+
+#include "FOPDT.h"
+
+class FopDtEstimator
+{
+public:
+	FopDtEstimator();
+
+	void Reset(const FopDt& model);										// start again from the configured model
+	void Interrupt() { haveLastTemperature = false; }					// call this when there is a gap in the readings
+	void Update(float temperature, float pwm, uint32_t sampleInterval);	// call this on every good temperature reading when the heater is not being tuned
+
+	bool HaveEstimate() const;
+	float GetGain() const;
+	float GetTimeConstant() const;
+	float GetDeadTime() const;
+	float GetDrift(const FopDt& model) const;							// get the largest fractional difference between the estimate and the model
+	void AppendDetails(const StringRef& reply) const;
+
+private:
+	static constexpr uint32_t SampleIntervalMillis = 500;				// we average the PWM over this interval and take one sample at the end of it
+	static constexpr float SampleIntervalSeconds = (float)SampleIntervalMillis * MillisToSeconds;
+	static constexpr size_t MaxDelaySamples = 32;						// so the longest dead time we can estimate is 15.5 seconds
+	static constexpr size_t NumCandidates = 3;							// the number of dead times we try
+	static constexpr float ForgettingFactor = 0.998;					// at 2 samples per second, old samples have half the weight after about 3 minutes
+	static constexpr float MinPredictionError = 0.05;					// prediction errors below this in C are treated as sensor noise
+	static constexpr float InitialGainCovariance = 1.0e-4;				// initial uncertainty in 'a'
+	static constexpr float InitialPwmCovariance = 1.0;					// initial uncertainty in 'b'
+	static constexpr float MaxCovariance = 1.0e3;						// limit on how large the covariances may grow
+	static constexpr float ErrorAveragingFactor = 0.01;					// for the running average of the squared prediction error
+	static constexpr unsigned int MinSamples = 120;						// we don't report an estimate until we have had at least this many samples
+
+	struct Candidate
+	{
+		float a, b;														// the model coefficients
+		float p11, p12, p22;											// the covariance matrix, which is symmetric
+		float meanSquareError;											// running average of the squared prediction error
+		size_t delay;													// the dead time in samples
+
+		void Init(float pa, float pb, size_t pDelay);
+		void Update(float x, float u, float y);
+		bool IsValid() const { return a > 0.0 && a < 1.0 && b > 0.0; }
+	};
+
+	const Candidate& BestCandidate() const;
+
+	Candidate candidates[NumCandidates];
+	float pwmHistory[MaxDelaySamples];									// the average PWM in each of the last few sample intervals
+	float lastTemperature;
+	float pwmAccumulator;												// the sum of PWM * time in milliseconds in the current sample interval
+	uint32_t timeAccumulated;											// how many milliseconds of the current sample interval have elapsed
+	size_t historyIndex;												// where we store the next average PWM
+	unsigned int numSamples;											// how many samples we have fed to the estimators since the last reset
+	bool haveLastTemperature;
+};
+
+#endif
+
+#endif /* SRC_HEATING_FOPDTESTIMATOR_H_ */
@@ -26,15 +26,23 @@ Licence: GPL
 #include <CanMessageBuffer.h>
 #include "CAN/CanInterface.h"
 #include "Fans/FansManager.h"
+#include <InputMonitors/InputMonitor.h>
+#include <FilamentMonitors/FilamentMonitor.h>
+#include "Telemetry.h"
 
-#if SUPPORT_DHT_SENSOR
-# include "Sensors/DhtSensor.h"
+#if SUPPORT_TMC51xx
+# include "Movement/StepperDrivers/TMC51xx.h"
 #endif
+#if SUPPORT_TMC22xx
+# include "Movement/StepperDrivers/TMC22xx.h"
+#endif
+
 
 #include "Tasks.h"
+#include "Tracer.h"
+#include "StackSizes.h"
 
-constexpr uint32_t HeaterTaskStackWords = 400;			// task stack size in dwords, must be large enough for auto tuning
-static Task<HeaterTaskStackWords> heaterTask;
+static Task<StackSizes::HeaterTaskWords> heaterTask;
 
 extern "C" [[noreturn]] void HeaterTask(void * pvParameters)
 {
@@ -46,13 +54,11 @@ namespace Heat
 	// Private members
 	static Heater* heaters[MaxHeaters];							// A PID controller for each heater
 
-	static TemperatureSensor *sensorsRoot = nullptr;			// The sensor list. Only the Heat task is allowed to modify the linkeage.
+	static TemperatureSensor *sensors[MaxSensors];				// The sensors, indexed by sensor number. Only the Heat task is allowed to modify this.
 
 	static float extrusionMinTemp;								// Minimum temperature to allow regular extrusion
 	static float retractionMinTemp;								// Minimum temperature to allow regular retraction
 	static bool coldExtrude;									// Is cold extrusion allowed?
-	static int8_t heaterBeingTuned;								// which PID is currently being tuned
-	static int8_t lastHeaterTuned;								// which PID we last finished tuning
 
 	static ReadWriteLock heatersLock;
 	static ReadWriteLock sensorsLock;
@@ -61,66 +67,233 @@ namespace Heat
 	static uint32_t lastSensorsBroadcastWhen = 0;				// for diagnostics
 	static unsigned int lastSensorsFound = 0;					// for diagnostics
 
-	static ReadLockedPointer<Heater> FindHeater(int heater)
-	{
-		ReadLocker locker(heatersLock);
-		return ReadLockedPointer<Heater>(locker, (heater < 0 || heater >= (int)MaxHeaters) ? nullptr : heaters[heater]);
-	}
+	// Change-driven status reporting. This is off until the main board enables it, so main boards that don't know about it always get full reports.
+	// When it is on we only report sensors and heaters whose status has changed by more than the deadband, plus a full report every few cycles.
+	constexpr unsigned int MaxKeyframeInterval = 8;				// the main board times out remote sensors if we don't report them for too long
+	static bool changeDrivenReporting = false;
+	static float reportingDeadband = 0.1;						// in degrees C
+	static unsigned int keyframeInterval = 4;					// number of heater task cycles between full reports
+	static unsigned int cyclesToNextKeyframe = 0;
+	static float lastReportedSensorTemperatures[MaxSensors];
+	static uint8_t lastReportedSensorErrors[MaxSensors];
+	static float lastReportedHeaterTemperatures[MaxHeaters];
+	static uint8_t lastReportedHeaterModes[MaxHeaters];
+	static uint8_t lastReportedHeaterPwms[MaxHeaters];
+	static unsigned int numReportsSuppressed = 0;				// for diagnostics
+	static volatile bool immediateReportRequested = false;		// set when a heater monitor triggers, so that we report the heaters without waiting for the next report cycle
+
+#if HAS_SMART_DRIVERS
+	// Periodic driver status reports, so that the main board can monitor driver faults and motor load without sending us M122 requests
+	constexpr unsigned int MaxDriverReportInterval = 40;		// 10 seconds
+	static unsigned int driverReportInterval = 0;				// number of heater task cycles between driver status reports, 0 to disable them
+	static unsigned int cyclesToNextDriverReport = 0;
+#endif
 
-	// Delete a sensor, if there is one. Must write-lock the sensors lock before calling this.
-	static void DeleteSensor(unsigned int sn)
+	// The poll interval of each sensor as at the last time we polled the sensors, so that we can run each heater at the rate of its sensor without locking the sensors
+	static uint16_t sensorPollIntervals[MaxSensors];
+
+	// Power budgeting, so that several large heaters on one board don't overload the supply. The budget is the total PWM that the heaters may use, e.g. 2.0 means the
+	// equivalent of two heaters fully on. Heaters get their demanded PWM in order of priority until the budget runs out, and heaters of equal priority share what is left.
+	// The staggered PWM edges mean that heaters sharing the budget take turns within each PWM period instead of all switching on together.
+	// If the VIN voltage falls below the minimum we reduce the budget until it recovers.
+	constexpr float MinPowerBudgetScale = 0.25;					// the most we reduce the budget by when VIN is low
+	static float powerBudget = 0.0;								// 0 means no limit
+	static float minPowerBudgetVoltage = 0.0;					// 0 means don't reduce the budget when VIN is low
+	static float powerBudgetScale = 1.0;
+	static uint8_t heaterPriorities[MaxHeaters] = { 0 };		// higher numbers get power first
+	static unsigned int numPowerBudgetLimits = 0;				// the number of heater task cycles in which we had to limit the power, for diagnostics
+#if HAS_VOLTAGE_MONITOR
+	static bool heatersSuspendedForPowerFail = false;			// true if we have suspended the heaters because the power is failing
+#endif
+
+	// Share out the power budget between the heaters. This is called with heatersLock held.
+	static void AllocatePowerBudget()
 	{
-		TemperatureSensor *currentSensor = sensorsRoot;
-		TemperatureSensor *lastSensor = nullptr;
+#if HAS_VOLTAGE_MONITOR
+		if (minPowerBudgetVoltage > 0.0)
+		{
+			powerBudgetScale = (Platform::GetCurrentVinVoltage() < minPowerBudgetVoltage)
+								? max<float>(powerBudgetScale * 0.8, MinPowerBudgetScale)
+									: min<float>(powerBudgetScale + 0.05, 1.0);
+		}
+		else
+#endif
+		{
+			powerBudgetScale = 1.0;
+		}
 
-		while (currentSensor != nullptr)
+		// Heaters that are being tuned always get what they ask for, so that the tuning results are valid
+		float totalDemand = 0.0;
+		float tuningDemand = 0.0;
+		for (const Heater *h : heaters)
 		{
-			if (currentSensor->GetSensorNumber() == sn)
+			if (h != nullptr)
 			{
-				TemperatureSensor *sensorToDelete = currentSensor;
-				currentSensor = currentSensor->GetNext();
-				if (lastSensor == nullptr)
+				totalDemand += h->GetDemandedPwm();
+				if (h->IsTuning())
 				{
-					sensorsRoot = currentSensor;
+					tuningDemand += h->GetDemandedPwm();
 				}
-				else
+			}
+		}
+
+		float available = ((powerBudget > 0.0) ? powerBudget : totalDemand) * powerBudgetScale - tuningDemand;
+		if (available >= totalDemand - tuningDemand)
+		{
+			for (Heater *h : heaters)
+			{
+				if (h != nullptr)
+				{
+					h->SetPowerLimit(1.0);
+				}
+			}
+			return;
+		}
+
+		++numPowerBudgetLimits;
+		uint32_t allocated = 0;									// bitmap of heaters we have dealt with
+		for (;;)
+		{
+			// Find the highest priority among the heaters we haven't dealt with yet, and their total demand
+			int priority = -1;
+			float demand = 0.0;
+			for (size_t i = 0; i < MaxHeaters; ++i)
+			{
+				const Heater * const h = heaters[i];
+				if (h != nullptr && (allocated & (1u << i)) == 0 && !h->IsTuning())
 				{
-					lastSensor->SetNext(currentSensor);
+					if ((int)heaterPriorities[i] > priority)
+					{
+						priority = heaterPriorities[i];
+						demand = 0.0;
+					}
+					if ((int)heaterPriorities[i] == priority)
+					{
+						demand += h->GetDemandedPwm();
+					}
 				}
-				delete sensorToDelete;
+			}
+			if (priority < 0)
+			{
 				break;
 			}
 
-			lastSensor = currentSensor;
-			currentSensor = currentSensor->GetNext();
+			const float fraction = (demand <= available) ? 1.0 : max<float>(available, 0.0)/demand;
+			available -= demand;
+			for (size_t i = 0; i < MaxHeaters; ++i)
+			{
+				Heater * const h = heaters[i];
+				if (h != nullptr && (allocated & (1u << i)) == 0 && !h->IsTuning() && heaterPriorities[i] == priority)
+				{
+					h->SetPowerLimit(fraction);
+					allocated |= 1u << i;
+				}
+			}
 		}
 	}
 
-	// Insert a sensor. Must write-lock the sensors lock before calling this.
-	static void InsertSensor(TemperatureSensor *newSensor)
+	// Return true if something that happens every 'interval' milliseconds is due in this cycle of the heater task
+	// Fan RPM reports. Fan speeds don't change quickly, so we report them less often than temperatures, except that we report at once when a fan stalls, slows down or recovers.
+	constexpr unsigned int FansReportInterval = 4;				// number of heater task cycles between fan reports
+	static unsigned int cyclesToNextFansReport = 0;
+
+	static inline bool IsDue(uint32_t cycleNumber, uint32_t interval)
 	{
-		TemperatureSensor *prev = nullptr;
-		TemperatureSensor *ts = sensorsRoot;
-		for (;;)
+		return cycleNumber % max<uint32_t>(interval/MinHeatSampleIntervalMillis, 1) == 0;
+	}
+
+	// Return true if a value has changed by enough to be worth reporting
+	static inline bool TemperatureChanged(float newTemperature, float oldTemperature)
+	{
+		return fabsf(newTemperature - oldTemperature) > reportingDeadband;
+	}
+
+	// Report our fan RPMs. If the last report hasn't been sent yet, report them in the next cycle instead.
+	static void SendFansReport()
+	{
+		CanMessageFansReport * const msg = Telemetry::GetFansReportSnapshot();
+		if (msg == nullptr)
+		{
+			cyclesToNextFansReport = 0;
+			return;
+		}
+		Telemetry::PostFansReport(FansManager::PopulateFansReport(*msg));
+		cyclesToNextFansReport = FansReportInterval - 1;
+	}
+
+	// Report our heater statuses. If fullReport is false, only report heaters whose status has changed.
+	// Return false if we couldn't because the last report hasn't been sent yet, in which case we haven't recorded anything as reported.
+	static bool SendHeatersStatus(bool fullReport)
+	{
+		CanMessageHeatersStatus * const msg = Telemetry::GetHeatersStatusSnapshot();
+		if (msg == nullptr)
 		{
-			if (ts == nullptr || ts->GetSensorNumber() > newSensor->GetSensorNumber())
+			return false;
+		}
+		msg->whichHeaters = 0;
+		unsigned int heatersFound = 0;
+
+		{
+			ReadLocker lock(heatersLock);
+
+			for (size_t heater = 0; heater < MaxHeaters; ++heater)
 			{
-				newSensor->SetNext(ts);
-				if (prev == nullptr)
+				Heater * const h = heaters[heater];
+				if (h != nullptr)
 				{
-					sensorsRoot = newSensor;
-				}
-				else
-				{
-					prev->SetNext(newSensor);
+					const uint8_t mode = h->GetModeByte();
+					const uint8_t averagePwm = (uint8_t)(h->GetAveragePWM() * 255.0);
+					const float temperature = h->GetTemperature();
+					if (   fullReport
+						|| mode != lastReportedHeaterModes[heater]
+						|| averagePwm != lastReportedHeaterPwms[heater]
+						|| TemperatureChanged(temperature, lastReportedHeaterTemperatures[heater])
+					   )
+					{
+						msg->whichHeaters |= (uint64_t)1u << heater;
+						msg->reports[heatersFound].mode = mode;
+						msg->reports[heatersFound].averagePwm = averagePwm;
+						msg->reports[heatersFound].temperature = temperature;
+						lastReportedHeaterModes[heater] = mode;
+						lastReportedHeaterPwms[heater] = averagePwm;
+						lastReportedHeaterTemperatures[heater] = temperature;
+						++heatersFound;
+					}
+					else
+					{
+						++numReportsSuppressed;
+					}
 				}
-				break;
 			}
-			prev = ts;
-			ts = ts->GetNext();
+		}
+
+		Telemetry::PostHeatersStatus(heatersFound);
+		return true;
+	}
+
+	static ReadLockedPointer<Heater> FindHeater(int heater)
+	{
+		ReadLocker locker(heatersLock);
+		return ReadLockedPointer<Heater>(locker, (heater < 0 || heater >= (int)MaxHeaters) ? nullptr : heaters[heater]);
+	}
+
+	// Delete a sensor, if there is one. Must write-lock the sensors lock before calling this.
+	static void DeleteSensor(unsigned int sn)
+	{
+		if (sn < MaxSensors)
+		{
+			TemperatureSensor * const sensorToDelete = sensors[sn];
+			sensors[sn] = nullptr;
+			delete sensorToDelete;
 		}
 	}
 
+	// Insert a sensor. Must write-lock the sensors lock before calling this.
+	static void InsertSensor(TemperatureSensor *newSensor)
+	{
+		sensors[newSensor->GetSensorNumber()] = newSensor;
+	}
+
 	static GCodeResult UnknownHeater(unsigned int heater, const StringRef& reply) noexcept
 	{
 		reply.printf("Board %u does not have heater %u", CanInterface::GetCanAddress(), heater);
@@ -150,8 +323,6 @@ void Heat::ResetHeaterModels()
 void Heat::Init()
 {
 	coldExtrude = false;
-	heaterBeingTuned = -1;
-	lastHeaterTuned = -1;
 
 	for (Heater *& h : heaters)
 	{
@@ -159,17 +330,16 @@ void Heat::Init()
 	}
 
 	// Set up the temperature (and other) sensors
-	sensorsRoot = nullptr;
-
-#if SUPPORT_DHT_SENSOR
-	// Initialise static fields of the DHT sensor
-	DhtSensorHardwareInterface::InitStatic();
-#endif
+	for (TemperatureSensor *& s : sensors)
+	{
+		s = nullptr;
+	}
 
 	extrusionMinTemp = HOT_ENOUGH_TO_EXTRUDE;
 	retractionMinTemp = HOT_ENOUGH_TO_RETRACT;
 	coldExtrude = false;
 
+	Telemetry::Init();
 	heaterTask.Create(HeaterTask, "HEAT", nullptr, TaskPriority::HeatPriority);
 }
 
@@ -186,68 +356,131 @@ void Heat::Exit()
 	heaterTask.Suspend();
 }
 
+// The heater task. It posts its reports to the telemetry task instead of sending them itself, so that its timing doesn't depend on how busy the CAN bus is.
 [[noreturn]] void Heat::Task()
 {
-	// Get a message buffer. We use the same one all the time and never release it.
-	CanMessageBuffer *buf = nullptr;
-	for (;;)
-	{
-		buf = CanMessageBuffer::Allocate();
-		if (buf != nullptr)
-		{
-			break;
-		}
-		delay(5);
-	}
-
 	uint32_t lastWakeTime = xTaskGetTickCount();
+	uint32_t cycleNumber = 0;
 	for (;;)
 	{
+		// Poll the sensors that are due. Sensors that are slow to read or need time for a conversion have longer poll intervals.
 		{
-			// Walk the sensor list and poll all sensors
-			// Also prepare to broadcast our sensor temperatures
-			CanMessageSensorTemperatures * const sensorTempsMsg = buf->SetupBroadcastMessage<CanMessageSensorTemperatures>(CanInterface::GetCanAddress());
-			sensorTempsMsg->whichSensors = 0;
-			unsigned int sensorsFound = 0;
+			uint64_t sensorsPolled = 0;
+			ReadLocker lock(sensorsLock);
+			for (TemperatureSensor *currentSensor : sensors)
 			{
-				ReadLocker lock(sensorsLock);
-				for (TemperatureSensor *currentSensor = sensorsRoot; currentSensor != nullptr; currentSensor = currentSensor->GetNext())
+				if (currentSensor == nullptr)
+				{
+					continue;
+				}
+				const uint32_t pollInterval = currentSensor->GetPollInterval();
+				sensorPollIntervals[currentSensor->GetSensorNumber()] = pollInterval;
+				if (IsDue(cycleNumber, pollInterval))
 				{
 					currentSensor->Poll();
-					if (currentSensor->GetBoardAddress() == CanInterface::GetCanAddress() && sensorsFound < ARRAY_SIZE(sensorTempsMsg->temperatureReports))
-					{
-						sensorTempsMsg->whichSensors |= (uint64_t)1u << currentSensor->GetSensorNumber();
-						float temperature;
-						sensorTempsMsg->temperatureReports[sensorsFound].errorCode = (uint8_t)(currentSensor->GetLatestTemperature(temperature));
-						sensorTempsMsg->temperatureReports[sensorsFound].temperature = temperature;
-						++sensorsFound;
-					}
+					sensorsPolled |= (uint64_t)1u << currentSensor->GetSensorNumber();
 				}
 			}
+			if (sensorsPolled != 0)
+			{
+				FansManager::SensorsUpdated(sensorsPolled);		// let closed loop fans respond to the new readings
+			}
+		}
 
-			// Spin the heaters
+		// Spin the heaters that are due, each at the poll interval of its sensor or at its configured control interval if that is longer
+		{
+			ReadLocker lock(heatersLock);
+#if HAS_VOLTAGE_MONITOR
+			// If a power fail monitor says that VIN is failing, switch the heaters off to take the load off the supply, and switch them on again when it recovers
+			const bool powerFailing = Platform::IsPowerFailing();
+			if (powerFailing != heatersSuspendedForPowerFail)
 			{
-				ReadLocker lock(heatersLock);
-				for (Heater *h : heaters)
+				heatersSuspendedForPowerFail = powerFailing;
+				SuspendHeaters(powerFailing);
+			}
+#endif
+			for (Heater *h : heaters)
+			{
+				if (h != nullptr)
 				{
-					if (h != nullptr)
+					const int sensorNumber = h->GetSensorNumber();
+					const uint32_t sampleInterval = h->GetControlInterval((sensorNumber >= 0 && sensorNumber < (int)MaxSensors && sensorPollIntervals[sensorNumber] != 0)
+																			? sensorPollIntervals[sensorNumber] : HeatSampleIntervalMillis);
+					if (IsDue(cycleNumber, sampleInterval))
 					{
-						h->Spin();
+						Tracer::Record(Tracer::Event::heaterSpin, h->GetHeaterNumber());
+#if SUPPORT_HEATER_PROFILES
+						h->UpdateProfile();
+#endif
+						h->Spin(sampleInterval);
 					}
+					h->PollOutput();
 				}
 			}
+			AllocatePowerBudget();								// this takes effect the next time each heater spins
+		}
 
-			// Announce ourselves to the main board
-			CanInterface::SendAnnounce(buf);
+		// Everything else happens at the standard interval, so the main board sees the same reports however fast we sample
+		if (!IsDue(cycleNumber++, HeatSampleIntervalMillis))
+		{
+			if (immediateReportRequested)
+			{
+				// A heater monitor has triggered, so tell the main board straight away, or as soon as the last report has been sent
+				immediateReportRequested = !SendHeatersStatus(true);
+			}
+			if (FansManager::TakeSpeedFaultChange())
+			{
+				SendFansReport();
+			}
+			Platform::KickHeatTaskWatchdog();
+			vTaskDelayUntil(&lastWakeTime, MinHeatSampleIntervalMillis);
+			continue;
+		}
+
+		immediateReportRequested = false;
+		const bool fullReport = !changeDrivenReporting || cyclesToNextKeyframe == 0;
+		cyclesToNextKeyframe = (fullReport) ? keyframeInterval - 1 : cyclesToNextKeyframe - 1;
+		bool reportDeferred = false;
+
+		// Announce ourselves to the main board
+		Telemetry::PostAnnounce();
 
-			// See if we have finished tuning a PID
-			if (heaterBeingTuned != -1)
+		CanMessageSensorTemperatures * const sensorTempsMsg = Telemetry::GetSensorTemperaturesSnapshot();
+		if (sensorTempsMsg == nullptr)
+		{
+			reportDeferred = true;
+		}
+		else
+		{
+			// Walk the sensor list and prepare to broadcast our sensor temperatures
+			sensorTempsMsg->whichSensors = 0;
+			unsigned int sensorsFound = 0;
 			{
-				const auto h = FindHeater(heaterBeingTuned);
-				if (h.IsNull() || !h->IsTuning())
+				ReadLocker lock(sensorsLock);
+				for (TemperatureSensor *currentSensor : sensors)
 				{
-					lastHeaterTuned = heaterBeingTuned;
-					heaterBeingTuned = -1;
+					if (currentSensor != nullptr && currentSensor->GetBoardAddress() == CanInterface::GetCanAddress() && sensorsFound < ARRAY_SIZE(sensorTempsMsg->temperatureReports))
+					{
+						const unsigned int sensorNumber = currentSensor->GetSensorNumber();
+						float temperature;
+						const uint8_t errorCode = (uint8_t)(currentSensor->GetLatestTemperature(temperature));
+						if (   fullReport
+							|| errorCode != lastReportedSensorErrors[sensorNumber]
+							|| TemperatureChanged(temperature, lastReportedSensorTemperatures[sensorNumber])
+						   )
+						{
+							sensorTempsMsg->whichSensors |= (uint64_t)1u << sensorNumber;
+							sensorTempsMsg->temperatureReports[sensorsFound].errorCode = errorCode;
+							sensorTempsMsg->temperatureReports[sensorsFound].temperature = temperature;
+							lastReportedSensorErrors[sensorNumber] = errorCode;
+							lastReportedSensorTemperatures[sensorNumber] = temperature;
+							++sensorsFound;
+						}
+						else
+						{
+							++numReportsSuppressed;
+						}
+					}
 				}
 			}
 
@@ -255,62 +488,67 @@ void Heat::Exit()
 			lastSensorsBroadcastWhich = sensorTempsMsg->whichSensors;	// for diagnostics
 			lastSensorsBroadcastWhen = millis();						// for diagnostics
 			lastSensorsFound = sensorsFound;
-			if (sensorsFound != 0)
-			{
-				buf->dataLength = sensorTempsMsg->GetActualDataLength(sensorsFound);
-				CanInterface::Send(buf);
-			}
+			Telemetry::PostSensorTemperatures(sensorsFound);
 		}
 
 		// Broadcast our heater statuses
+		if (!SendHeatersStatus(fullReport))
 		{
-			CanMessageHeatersStatus * const msg = buf->SetupStatusMessage<CanMessageHeatersStatus>(CanInterface::GetCanAddress(), CanId::MasterAddress);
-			msg->whichHeaters = 0;
-			unsigned int heatersFound = 0;
+			reportDeferred = true;
+		}
+		if (reportDeferred && fullReport)
+		{
+			cyclesToNextKeyframe = 0;									// the main board times out sensors that we don't report, so make the next report a full one
+		}
 
-			{
-				ReadLocker lock(heatersLock);
+		// Broadcast our fan RPMs if they are due or a fan has a new fault
+		if (FansManager::TakeSpeedFaultChange() || cyclesToNextFansReport == 0)
+		{
+			SendFansReport();
+		}
+		else
+		{
+			--cyclesToNextFansReport;
+		}
+
+#if SUPPORT_FILAMENT_MONITORS
+		// Compare the filament movement with the extruder movement
+		FilamentMonitor::Spin();
+#endif
 
-				for (size_t heater = 0; heater < MaxHeaters; ++heater)
+#if HAS_SMART_DRIVERS
+		// Send the status, load and current scale of all our drivers in a single message
+		if (driverReportInterval != 0)
+		{
+			if (cyclesToNextDriverReport == 0)
+			{
+				CanMessageDriversStatus * const msg = Telemetry::GetDriversStatusSnapshot();
+				if (msg != nullptr)									// if the last report hasn't been sent yet, try again in the next cycle
 				{
-					Heater * const h = heaters[heater];
-					if (h != nullptr)
+					cyclesToNextDriverReport = driverReportInterval - 1;
+					msg->SetStandardFields(NumDrivers);
+					for (size_t driver = 0; driver < NumDrivers; ++driver)
 					{
-						msg->whichHeaters |= (uint64_t)1u << heater;
-						msg->reports[heatersFound].mode = h->GetModeByte();
-						msg->reports[heatersFound].averagePwm = (uint8_t)(h->GetAveragePWM() * 255.0);
-						msg->reports[heatersFound].temperature = h->GetTemperature();
-						++heatersFound;
+						msg->data[driver] = SmartDrivers::GetCompactStatus(driver);
 					}
+					Telemetry::PostDriversStatus();
 				}
 			}
-
-			if (heatersFound != 0)
-			{
-				buf->dataLength = msg->GetActualDataLength(heatersFound);
-				CanInterface::Send(buf);
-			}
-		}
-
-		// Broadcast our fan RPMs
-		{
-			CanMessageFansReport * const msg = buf->SetupStatusMessage<CanMessageFansReport>(CanInterface::GetCanAddress(), CanId::MasterAddress);
-			const unsigned int numReported = FansManager::PopulateFansReport(*msg);
-			if (numReported != 0)
+			else
 			{
-				buf->dataLength = msg->GetActualDataLength(numReported);
-				CanInterface::Send(buf);
+				--cyclesToNextDriverReport;
 			}
 		}
+#endif
 
 		Platform::KickHeatTaskWatchdog();
 
 		// Delay until it is time again
-		vTaskDelayUntil(&lastWakeTime, HeatSampleIntervalMillis);
+		vTaskDelayUntil(&lastWakeTime, MinHeatSampleIntervalMillis);
 	}
 }
 
-GCodeResult Heat::ConfigureHeater(const CanMessageGeneric& msg, const StringRef& reply)
+GCodeResult Heat::ConfigureHeater(const CanMessageGeneric& msg, uint32_t configDigest, const StringRef& reply)
 {
 	CanMessageGenericParser parser(msg, M950HeaterParams);
 	uint16_t heater;
@@ -328,6 +566,9 @@ GCodeResult Heat::ConfigureHeater(const CanMessageGeneric& msg, const StringRef&
 	PwmFrequency freq = DefaultFanPwmFreq;
 	const bool seenFreq = parser.GetUintParam('Q', freq);
 
+	uint16_t controlInterval;
+	const bool seenInterval = parser.GetUintParam('I', controlInterval);
+
 	String<StringLength50> pinName;
 	if (parser.GetStringParam('C', pinName.GetRef()))
 	{
@@ -340,14 +581,52 @@ GCodeResult Heat::ConfigureHeater(const CanMessageGeneric& msg, const StringRef&
 
 		WriteLocker lock(heatersLock);
 
+		// If the main board sent the command that created this heater again, there is nothing to do
+		if (heaters[heater] != nullptr && heaters[heater]->GetConfigDigest() == configDigest)
+		{
+			return GCodeResult::ok;
+		}
+
 		Heater *oldHeater = nullptr;
 		std::swap(oldHeater, heaters[heater]);
 		delete oldHeater;
 
 		Heater *newHeater = new LocalHeater(heater);
-		const GCodeResult rslt = newHeater->ConfigurePortAndSensor(pinName.c_str(), freq, sensorNumber, reply);
+		GCodeResult rslt = (seenInterval) ? newHeater->SetControlInterval(controlInterval, reply) : GCodeResult::ok;
+		if (rslt == GCodeResult::ok)
+		{
+			rslt = newHeater->ConfigurePortAndSensor(pinName.c_str(), freq, sensorNumber, reply);
+		}
+#if SUPPORT_REDUNDANT_HEATER_SENSORS
+		uint16_t secondarySensorNumber;
+		if ((rslt == GCodeResult::ok || rslt == GCodeResult::warning) && parser.GetUintParam('U', secondarySensorNumber))
+		{
+			uint8_t fusion = (uint8_t)Heater::SensorFusion::failover;
+			(void)parser.GetUintParam('F', fusion);
+			float maxDisagreement = DefaultMaxSensorDisagreement;
+			(void)parser.GetFloatParam('D', maxDisagreement);
+			if (fusion > (uint8_t)Heater::SensorFusion::highest)
+			{
+				reply.copy("Sensor fusion mode must be 0 to 3");
+				rslt = GCodeResult::error;
+			}
+			else
+			{
+				const GCodeResult secondaryRslt = newHeater->ConfigureSecondarySensor(secondarySensorNumber, (Heater::SensorFusion)fusion, maxDisagreement, reply);
+				if (secondaryRslt != GCodeResult::ok)
+				{
+					rslt = secondaryRslt;
+				}
+			}
+		}
+#endif
 		if (rslt == GCodeResult::ok || rslt == GCodeResult::warning)
 		{
+			newHeater->RestoreSavedModel();
+		}
+		if (rslt == GCodeResult::ok || rslt == GCodeResult::warning)
+		{
+			newHeater->SetConfigDigest((rslt == GCodeResult::ok) ? configDigest : 0);
 			heaters[heater] = newHeater;
 		}
 		else
@@ -363,8 +642,18 @@ GCodeResult Heat::ConfigureHeater(const CanMessageGeneric& msg, const StringRef&
 		return UnknownHeater(heater, reply);
 	}
 
+	if (seenInterval)
+	{
+		const GCodeResult rslt = h->SetControlInterval(controlInterval, reply);
+		if (rslt != GCodeResult::ok || !seenFreq)
+		{
+			return rslt;
+		}
+	}
+
 	if (seenFreq)
 	{
+		h->SetConfigDigest(0);
 		return h->SetPwmFrequency(freq, reply);
 	}
 
@@ -377,7 +666,35 @@ GCodeResult Heat::ProcessM307(const CanMessageUpdateHeaterModel& msg, const Stri
 	return (h.IsNotNull()) ? h->SetOrReportModel(msg.heater, msg, reply) : UnknownHeater(msg.heater, reply);
 }
 
-GCodeResult Heat::ProcessM308(const CanMessageGeneric& msg, const StringRef& reply)
+GCodeResult Heat::ProcessM309(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, M309Params);
+	uint16_t heater;
+	if (!parser.GetUintParam('P', heater))
+	{
+		return GCodeResult::remoteInternalError;
+	}
+	const auto h = FindHeater(heater);
+	return (h.IsNotNull()) ? h->SetOrReportFeedForward(msg, reply) : UnknownHeater(heater, reply);
+}
+
+#if SUPPORT_HEATER_PROFILES
+
+GCodeResult Heat::ConfigureHeaterProfile(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, HeaterProfileParams);
+	uint16_t heater;
+	if (!parser.GetUintParam('P', heater))
+	{
+		return GCodeResult::remoteInternalError;
+	}
+	const auto h = FindHeater(heater);
+	return (h.IsNotNull()) ? h->SetOrReportProfile(msg, reply) : UnknownHeater(heater, reply);
+}
+
+#endif
+
+GCodeResult Heat::ProcessM308(const CanMessageGeneric& msg, uint32_t configDigest, const StringRef& reply)
 {
 	CanMessageGenericParser parser(msg, M308Params);
 	uint16_t sensorNum;
@@ -388,6 +705,15 @@ GCodeResult Heat::ProcessM308(const CanMessageGeneric& msg, const StringRef& rep
 			String<StringLength20> sensorTypeName;
 			if (parser.GetStringParam('Y', sensorTypeName.GetRef()))
 			{
+				{
+					// If the main board sent the command that created this sensor again, there is nothing to do
+					const auto existingSensor = FindSensor(sensorNum);
+					if (existingSensor.IsNotNull() && existingSensor->GetConfigDigest() == configDigest)
+					{
+						return GCodeResult::ok;
+					}
+				}
+
 				WriteLocker lock(sensorsLock);
 
 				DeleteSensor(sensorNum);
@@ -401,6 +727,7 @@ GCodeResult Heat::ProcessM308(const CanMessageGeneric& msg, const StringRef& rep
 				const GCodeResult rslt = newSensor->Configure(parser, reply);
 				if (rslt == GCodeResult::ok || rslt == GCodeResult::warning)
 				{
+					newSensor->SetConfigDigest((rslt == GCodeResult::ok) ? configDigest : 0);
 					InsertSensor(newSensor);
 				}
 				else
@@ -416,6 +743,7 @@ GCodeResult Heat::ProcessM308(const CanMessageGeneric& msg, const StringRef& rep
 				reply.printf("Sensor %u does not exist", sensorNum);
 				return GCodeResult::error;
 			}
+			sensor->SetConfigDigest(0);
 			return sensor->Configure(parser, reply);
 		}
 		else
@@ -457,16 +785,24 @@ float Heat::GetLowestTemperatureLimit(int heater) noexcept
 
 // Get the temperature of a sensor
 float Heat::GetSensorTemperature(int sensorNum, TemperatureError& err)
+{
+	uint32_t whenRead;
+	return GetSensorTemperature(sensorNum, err, whenRead);
+}
+
+float Heat::GetSensorTemperature(int sensorNum, TemperatureError& err, uint32_t& whenRead)
 {
 	const auto sensor = FindSensor(sensorNum);
 	if (sensor.IsNotNull())
 	{
 		float temp;
 		err = sensor->GetLatestTemperature(temp);
+		whenRead = sensor->GetLastReadingTime();
 		return temp;
 	}
 
 	err = TemperatureError::unknownSensor;
+	whenRead = 0;
 	return BadErrorTemperature;
 }
 
@@ -514,34 +850,56 @@ float Heat::GetAveragePWM(size_t heater)
 	return (h.IsNull()) ? 0.0 : h->GetAveragePWM();
 }
 
+float Heat::GetAppliedPwm(size_t heater)
+{
+	const auto h = FindHeater(heater);
+	return (h.IsNull()) ? 0.0 : h->GetAppliedPwm();
+}
+
 // Get a pointer to the temperature sensor entry, or nullptr if the heater number is bad
 ReadLockedPointer<TemperatureSensor> Heat::FindSensor(int sn)
+{
+	ReadLocker locker(sensorsLock);
+	return ReadLockedPointer<TemperatureSensor>(locker, (sn < 0 || sn >= (int)MaxSensors) ? nullptr : sensors[sn]);
+}
+
+// Get a pointer to the first temperature sensor with the specified or higher number
+ReadLockedPointer<TemperatureSensor> Heat::FindSensorAtOrAbove(unsigned int sn)
 {
 	ReadLocker locker(sensorsLock);
 
-	for (TemperatureSensor *sensor = sensorsRoot; sensor != nullptr; sensor = sensor->GetNext())
+	for (; sn < MaxSensors; ++sn)
 	{
-		if ((int)sensor->GetSensorNumber() == sn)
+		if (sensors[sn] != nullptr)
 		{
-			return ReadLockedPointer<TemperatureSensor>(locker, sensor);
+			return ReadLockedPointer<TemperatureSensor>(locker, sensors[sn]);
 		}
 	}
 	return ReadLockedPointer<TemperatureSensor>(locker, nullptr);
 }
 
-// Get a pointer to the first temperature sensor with the specified or higher number
-ReadLockedPointer<TemperatureSensor> Heat::FindSensorAtOrAbove(unsigned int sn)
+// Update any remote sensors that we have from a sensor temperatures broadcast by another board. This is called from the CAN receiver task.
+// The reports are in sensor number order, one for each bit set in whichSensors.
+void Heat::ProcessRemoteSensorsReport(CanAddress src, const CanMessageSensorTemperatures& msg)
 {
 	ReadLocker locker(sensorsLock);
 
-	for (TemperatureSensor *sensor = sensorsRoot; sensor != nullptr; sensor = sensor->GetNext())
+	uint64_t which = msg.whichSensors;
+	size_t index = 0;
+	for (unsigned int sn = 0; which != 0 && sn < MaxSensors && index < ARRAY_SIZE(msg.temperatureReports); ++sn)
 	{
-		if (sensor->GetSensorNumber() >= sn)
+		if ((which & 1u) != 0)
 		{
-			return ReadLockedPointer<TemperatureSensor>(locker, sensor);
+			TemperatureSensor * const sensor = sensors[sn];
+			if (sensor != nullptr)
+			{
+				sensor->UpdateRemoteTemperature(src, msg.temperatureReports[index]);
+			}
+			++index;
 		}
+		which >>= 1;
 	}
-	return ReadLockedPointer<TemperatureSensor>(locker, nullptr);
+	FansManager::SensorsUpdated(msg.whichSensors);
 }
 
 // Suspend the heaters to conserve power or while doing Z probing
@@ -556,9 +914,208 @@ void Heat::SuspendHeaters(bool sus)
 	}
 }
 
+// Configure change-driven status reporting. The main board sends this only if it knows how to handle partial reports.
+// S1 enables it and S0 disables it, D is the temperature deadband and K is the number of heater task cycles between full reports.
+// L is how long in milliseconds we may hold non-urgent input monitor changes so that they can be sent together.
+// V is the number of heater task cycles between driver status reports, or 0 to stop sending them.
+// Configure the power budget. S is the total PWM that the heaters may use (0 for no limit), V is the VIN voltage below which we reduce it (0 to disable),
+// and P and R set the priority of a heater.
+GCodeResult Heat::ConfigurePowerBudget(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, HeaterPowerBudgetParams);
+	bool seen = false;
+
+	float newBudget;
+	if (parser.GetFloatParam('S', newBudget))
+	{
+		if (newBudget < 0.0 || newBudget > (float)MaxHeaters)
+		{
+			reply.copy("Heater power budget out of range");
+			return GCodeResult::error;
+		}
+		seen = true;
+		powerBudget = newBudget;
+	}
+
+	float newMinVoltage;
+	if (parser.GetFloatParam('V', newMinVoltage))
+	{
+		seen = true;
+		minPowerBudgetVoltage = max<float>(newMinVoltage, 0.0);
+	}
+
+	uint16_t heater;
+	if (parser.GetUintParam('P', heater))
+	{
+		if (heater >= MaxHeaters)
+		{
+			reply.copy("Heater number out of range");
+			return GCodeResult::error;
+		}
+		uint8_t priority;
+		if (parser.GetUintParam('R', priority))
+		{
+			seen = true;
+			heaterPriorities[heater] = priority;
+		}
+		else
+		{
+			reply.printf("Heater %u power priority %u", heater, heaterPriorities[heater]);
+			return GCodeResult::ok;
+		}
+	}
+
+	if (!seen)
+	{
+		if (powerBudget > 0.0)
+		{
+			reply.printf("Heater power budget %.2f", (double)powerBudget);
+		}
+		else
+		{
+			reply.copy("No heater power budget");
+		}
+		if (minPowerBudgetVoltage > 0.0)
+		{
+			reply.catf(", reduced below %.1fV, currently %.0f%%", (double)minPowerBudgetVoltage, (double)(powerBudgetScale * 100.0));
+		}
+	}
+	return GCodeResult::ok;
+}
+
+GCodeResult Heat::ConfigureStatusReporting(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, StatusReportingParams);
+	bool seen = false;
+
+	float newDeadband;
+	if (parser.GetFloatParam('D', newDeadband))
+	{
+		if (newDeadband < 0.0)
+		{
+			reply.copy("Deadband must not be negative");
+			return GCodeResult::error;
+		}
+		seen = true;
+		reportingDeadband = newDeadband;
+	}
+
+	uint8_t newKeyframeInterval;
+	if (parser.GetUintParam('K', newKeyframeInterval))
+	{
+		if (newKeyframeInterval == 0 || newKeyframeInterval > MaxKeyframeInterval)
+		{
+			reply.printf("Full report interval must be between 1 and %u cycles", MaxKeyframeInterval);
+			return GCodeResult::error;
+		}
+		seen = true;
+		keyframeInterval = newKeyframeInterval;
+	}
+
+	uint16_t newCoalescingLatency;
+	if (parser.GetUintParam('L', newCoalescingLatency))
+	{
+		seen = true;
+		InputMonitor::SetCoalescingLatency(newCoalescingLatency);
+	}
+
+#if HAS_SMART_DRIVERS
+	uint8_t newDriverReportInterval;
+	if (parser.GetUintParam('V', newDriverReportInterval))
+	{
+		if (newDriverReportInterval > MaxDriverReportInterval)
+		{
+			reply.printf("Driver report interval must be between 0 and %u cycles", MaxDriverReportInterval);
+			return GCodeResult::error;
+		}
+		seen = true;
+		driverReportInterval = newDriverReportInterval;
+		cyclesToNextDriverReport = 0;
+	}
+#endif
+
+	uint8_t enable;
+	if (parser.GetUintParam('S', enable))
+	{
+		seen = true;
+		changeDrivenReporting = (enable != 0);
+	}
+
+	if (seen)
+	{
+		cyclesToNextKeyframe = 0;								// send a full report next time
+	}
+	else if (changeDrivenReporting)
+	{
+		reply.printf("Change-driven status reporting, deadband %.2fC, full report every %u cycles", (double)reportingDeadband, keyframeInterval);
+	}
+	else
+	{
+		reply.copy("Full status reporting");
+	}
+	if (!seen)
+	{
+		reply.catf(", input changes coalesced for up to %" PRIu32 "ms", InputMonitor::GetCoalescingLatency());
+#if HAS_SMART_DRIVERS
+		if (driverReportInterval != 0)
+		{
+			reply.catf(", driver status every %u cycles", driverReportInterval);
+		}
+#endif
+	}
+	return GCodeResult::ok;
+}
+
+void Heat::RequestImmediateReport()
+{
+	immediateReportRequested = true;
+}
+
+void Heat::GetDiagnostics(CanMessageDiagnosticsReply& msg)
+{
+	ReadLocker lock(heatersLock);
+	for (size_t i = 0; i < MaxHeaters && i < 16; ++i)
+	{
+		const Heater * const h = heaters[i];
+		if (h != nullptr && h->IsFaulted())
+		{
+			msg.faultedHeaters |= 1u << i;
+		}
+	}
+}
+
 void Heat::Diagnostics(const StringRef& reply)
 {
 	reply.lcatf("Last sensors broadcast %08" PRIu64 " found %u %" PRIu32 " ticks ago", lastSensorsBroadcastWhich, lastSensorsFound, millis() - lastSensorsBroadcastWhen);
+
+	unsigned int numTuning = 0;
+	{
+		ReadLocker lock(heatersLock);
+		for (const Heater *h : heaters)
+		{
+			if (h != nullptr && h->IsTuning())
+			{
+				++numTuning;
+			}
+		}
+	}
+	if (numTuning != 0)
+	{
+		reply.lcatf("Heaters being tuned %u", numTuning);
+	}
+}
+
+// Append the heater reporting, power budget and telemetry task statistics to the reply and reset them, for M122 B# P16
+void Heat::StatisticsDiagnostics(const StringRef& reply)
+{
+	reply.printf("Status reports %s, suppressed %u", (changeDrivenReporting) ? "on change" : "periodic", numReportsSuppressed);
+	numReportsSuppressed = 0;
+	if (powerBudget > 0.0 || minPowerBudgetVoltage > 0.0)
+	{
+		reply.lcatf("Power budget limited heaters in %u cycles", numPowerBudgetLimits);
+	}
+	numPowerBudgetLimits = 0;
+	Telemetry::Diagnostics(reply);
 }
 
 // End
@@ -30,19 +30,26 @@ namespace Heat
 	void Exit();												// Shut everything down
 	void ResetHeaterModels();									// Reset all active heater models to defaults
 
-	GCodeResult ConfigureHeater(const CanMessageGeneric& msg, const StringRef& reply);
+	GCodeResult ConfigureHeater(const CanMessageGeneric& msg, uint32_t configDigest, const StringRef& reply);
 	GCodeResult ProcessM307(const CanMessageUpdateHeaterModel& msg, const StringRef& reply);
-	GCodeResult ProcessM308(const CanMessageGeneric& msg, const StringRef& reply);
+	GCodeResult ProcessM308(const CanMessageGeneric& msg, uint32_t configDigest, const StringRef& reply);
+	GCodeResult ProcessM309(const CanMessageGeneric& msg, const StringRef& reply);
 	GCodeResult TuneHeater(const CanMessageGeneric& msg, const StringRef& reply);
 	GCodeResult SetPidParameters(const CanMessageGeneric& msg, const StringRef& reply);
 	GCodeResult SetFaultDetection(const CanMessageSetHeaterFaultDetectionParameters& msg, const StringRef& reply);
 	GCodeResult SetHeaterMonitors(const CanMessageSetHeaterMonitors& msg, const StringRef& reply);
+	GCodeResult ConfigureStatusReporting(const CanMessageGeneric& msg, const StringRef& reply);
+	GCodeResult ConfigurePowerBudget(const CanMessageGeneric& msg, const StringRef& reply);
+#if SUPPORT_HEATER_PROFILES
+	GCodeResult ConfigureHeaterProfile(const CanMessageGeneric& msg, const StringRef& reply);
+#endif
 
 	void SwitchOffAll();										// Turn all heaters off
 	void ResetFault(int heater);								// Reset a heater fault - only call this if you know what you are doing
 
 	// Methods that relate to sensors
 	float GetSensorTemperature(int sensorNum, TemperatureError& err); // Result is in degrees Celsius
+	float GetSensorTemperature(int sensorNum, TemperatureError& err, uint32_t& whenRead); // Also return the step clock time of the reading
 
 	// Methods that relate to a particular heater
 	float GetHighestTemperatureLimit(int heater) noexcept;
@@ -53,6 +60,9 @@ namespace Heat
 	float GetAveragePWM(size_t heater)							// Return the running average PWM to the heater as a fraction in [0, 1].
 	pre(heater < NumTotalHeaters);
 
+	float GetAppliedPwm(size_t heater)							// Return the PWM currently applied to the heater as a fraction in [0, 1].
+	pre(heater < NumTotalHeaters);
+
 	bool IsHeaterEnabled(size_t heater)							// Is this heater enabled?
 	pre(heater < NumTotalHeaters);
 
@@ -64,10 +74,14 @@ namespace Heat
 
 	ReadLockedPointer<TemperatureSensor> FindSensor(int sn);	// Get a pointer to the temperature sensor entry
 	ReadLockedPointer<TemperatureSensor> FindSensorAtOrAbove(unsigned int sn);	// Get a pointer to the first temperature sensor with the specified or higher number
+	void ProcessRemoteSensorsReport(CanAddress src, const CanMessageSensorTemperatures& msg);	// Update our remote sensors from a sensor temperatures broadcast
 
 	inline bool IsBedOrChamberHeater(int heater) { return false; }
 
+	void RequestImmediateReport();								// Send the sensor and heater status at the next heater task cycle instead of waiting for the next report
 	void Diagnostics(const StringRef& reply);
+	void StatisticsDiagnostics(const StringRef& reply);			// append the reporting, power budget and telemetry statistics to the reply and reset them
+	void GetDiagnostics(CanMessageDiagnosticsReply& msg);		// fill in the heater fields of a binary diagnostics report
 };
 
 #endif /* SRC_HEATING_HEAT_H_ */
@@ -9,11 +9,22 @@
 #include "Platform.h"
 #include "Heat.h"
 #include "Sensors/TemperatureSensor.h"
+#include "Movement/Move.h"
+#include "CAN/CanInterface.h"
+#include "CanMessageGenericParser.h"
+#include "PersistentSettings.h"
+#include "Movement/StepTimer.h"
+
+ObjectPool Heater::pool("heaters");
 
 Heater::Heater(unsigned int num)
 	: heaterNumber(num), sensorNumber(-1), requestedTemperature(0.0),
-	  maxTempExcursion(DefaultMaxTempExcursion), maxHeatingFaultTime(DefaultMaxHeatingFaultTime)
+	  maxTempExcursion(DefaultMaxTempExcursion), maxHeatingFaultTime(DefaultMaxHeatingFaultTime), powerLimit(1.0), configDigest(0), feedForwardDriver(-1), controlInterval(0)
+#if SUPPORT_HEATER_PROFILES
+	  , rampRate(0.0), standbyTemperature(0.0), activeTemperature(0.0), profileTarget(0.0), whenLastRamped(0), preheatDueTime(0), profileState(ProfileState::idle)
+#endif
 {
+	numActiveMonitors = 0;
 }
 
 Heater::~Heater()
@@ -23,6 +34,7 @@ Heater::~Heater()
 // Set the process model returning true if successful
 GCodeResult Heater::SetModel(float gain, float tc, float td, float maxPwm, float voltage, bool usePid, bool inverted, const StringRef& reply)
 {
+	configDigest = 0;
 	const float temperatureLimit = GetHighestTemperatureLimit();
 	const bool rslt = model.SetParameters(gain, tc, td, maxPwm, temperatureLimit, voltage, usePid, inverted);
 	if (rslt)
@@ -53,8 +65,87 @@ GCodeResult Heater::SetModel(float gain, float tc, float td, float maxPwm, float
 	return GCodeResult::error;
 }
 
+// Set the interval at which the control loop runs. Zero means run it at the poll interval of the sensor.
+GCodeResult Heater::SetControlInterval(uint32_t interval, const StringRef& reply)
+{
+	configDigest = 0;
+	if (interval != 0 && (interval % MinHeatSampleIntervalMillis != 0 || interval > MaxHeatControlIntervalMillis))
+	{
+		reply.printf("Heater control interval must be 0 or a multiple of %" PRIu32 "ms up to %" PRIu32 "ms", MinHeatSampleIntervalMillis, MaxHeatControlIntervalMillis);
+		return GCodeResult::error;
+	}
+	controlInterval = (uint16_t)interval;
+	return GCodeResult::ok;
+}
+
+// Get the interval at which to run the control loop. There is no point in running it faster than we get new readings from the sensor.
+uint32_t Heater::GetControlInterval(uint32_t sensorPollInterval) const
+{
+	return max<uint32_t>(controlInterval, sensorPollInterval);
+}
+
+// Process a M309 command relayed from the main board. S is the extra PWM needed per mm/sec of filament extruded and E is the local driver of the extruder that this heater melts filament for.
+GCodeResult Heater::SetOrReportFeedForward(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	configDigest = 0;
+	CanMessageGenericParser parser(msg, M309Params);
+	bool seen = false;
+
+	uint8_t driver;
+	if (parser.GetUintParam('E', driver))
+	{
+		if (driver >= NumDrivers)
+		{
+			reply.printf("Driver number %u.%u out of range", CanInterface::GetCanAddress(), driver);
+			return GCodeResult::error;
+		}
+		seen = true;
+		feedForwardDriver = (int8_t)driver;
+	}
+
+	float coefficient;
+	if (parser.GetFloatParam('S', coefficient))
+	{
+		if (coefficient < 0.0 || coefficient > 1.0)
+		{
+			reply.copy("Extrusion feedforward coefficient out of range");
+			return GCodeResult::error;
+		}
+		seen = true;
+		model.SetExtrusionCoefficient(coefficient);
+	}
+
+	if (!seen)
+	{
+		if (feedForwardDriver >= 0 && model.GetExtrusionCoefficient() > 0.0)
+		{
+			reply.printf("Heater %u extrusion feedforward %.4f per mm/sec from driver %u.%u",
+							GetHeaterNumber(), (double)model.GetExtrusionCoefficient(), CanInterface::GetCanAddress(), feedForwardDriver);
+		}
+		else
+		{
+			reply.printf("Heater %u has no extrusion feedforward", GetHeaterNumber());
+		}
+	}
+	return GCodeResult::ok;
+}
+
+// Get the extra PWM needed to melt the filament at the average extrusion rate of the moves in the queue.
+// The main board sends us moves up to a couple of seconds ahead, which is about the dead time of a typical hot end, so this raises the power before the flow increases.
+float Heater::GetExtrusionFeedForward() const noexcept
+{
+	const float coefficient = model.GetExtrusionCoefficient();
+	if (feedForwardDriver < 0 || coefficient <= 0.0)
+	{
+		return 0.0;
+	}
+	const float extrusionSpeed = moveInstance->GetUpcomingStepRate(feedForwardDriver)/Platform::DriveStepsPerUnit(feedForwardDriver);
+	return (extrusionSpeed > 0.0) ? extrusionSpeed * coefficient : 0.0;		// we don't reduce the power when retracting
+}
+
 GCodeResult Heater::SetFaultDetectionParameters(float pMaxTempExcursion, float pMaxFaultTime)
 {
+	configDigest = 0;
 	maxTempExcursion = pMaxTempExcursion;
 	maxHeatingFaultTime = pMaxFaultTime;
 	return GCodeResult::ok;
@@ -62,13 +153,38 @@ GCodeResult Heater::SetFaultDetectionParameters(float pMaxTempExcursion, float p
 
 GCodeResult Heater::SetHeaterMonitors(const CanMessageSetHeaterMonitors& msg, const StringRef& reply)
 {
+	configDigest = 0;
 	for (size_t i = 0; i < min<size_t>(msg.numMonitors, MaxMonitorsPerHeater); ++i)
 	{
 		monitors[i].Set(msg.monitors[i].sensor, msg.monitors[i].limit, (HeaterMonitorAction)msg.monitors[i].action, (HeaterMonitorTrigger)msg.monitors[i].trigger);
 	}
+	CompileMonitors();
 	return GCodeResult::ok;
 }
 
+// Build the table of enabled monitors that the control loop checks, so that disabled ones cost nothing and each supervisory sensor is read only once
+void Heater::CompileMonitors() noexcept
+{
+	size_t numActive = 0;
+	for (size_t i = 0; i < MaxMonitorsPerHeater; ++i)
+	{
+		const HeaterMonitor& prot = monitors[i];
+		if (prot.GetTrigger() != HeaterMonitorTrigger::Disabled && prot.GetSensorNumber() >= 0)
+		{
+			// Insertion sort by sensor number
+			size_t j = numActive;
+			while (j != 0 && monitors[activeMonitors[j - 1]].GetSensorNumber() > prot.GetSensorNumber())
+			{
+				activeMonitors[j] = activeMonitors[j - 1];
+				--j;
+			}
+			activeMonitors[j] = (uint8_t)i;
+			++numActive;
+		}
+	}
+	numActiveMonitors = (uint8_t)numActive;					// we don't need a lock because the heater task is the only one that reads this and it is only a byte
+}
+
 GCodeResult Heater::SetOrReportModel(unsigned int heater, const CanMessageUpdateHeaterModel& msg, const StringRef& reply) noexcept
 {
 	const GCodeResult rslt = SetModel(msg.gain, msg.timeConstant, msg.deadTime, msg.maxPwm, msg.standardVoltage, msg.usePid, msg.inverted, reply);
@@ -76,11 +192,32 @@ GCodeResult Heater::SetOrReportModel(unsigned int heater, const CanMessageUpdate
 	{
 		SetRawPidParameters(msg.kP, msg.recipTi, msg.tD);
 	}
+	if (rslt == GCodeResult::ok)
+	{
+		PersistentSettings::SaveHeaterModel(heater, model);
+	}
 	return rslt;
 }
 
+// Use the model that we saved for this heater number, if there is one. Called when the heater is created, before the main board sends us its model.
+void Heater::RestoreSavedModel() noexcept
+{
+	PersistentSettings::HeaterModel saved;
+	if (PersistentSettings::LoadHeaterModel(heaterNumber, saved))
+	{
+		String<1> dummy;
+		(void)SetModel(saved.gain, saved.timeConstant, saved.deadTime, saved.maxPwm, saved.standardVoltage, saved.usePid, saved.inverted, dummy.GetRef());
+	}
+}
+
 GCodeResult Heater::SetTemperature(const CanMessageSetHeaterTemperature& msg, const StringRef& reply)
 {
+#if SUPPORT_HEATER_PROFILES
+	if (msg.command != CanMessageSetHeaterTemperature::commandSuspend)
+	{
+		profileState = ProfileState::idle;					// a setpoint from the main board replaces any profile in progress
+	}
+#endif
 	switch (msg.command)
 	{
 	case CanMessageSetHeaterTemperature::commandNone:
@@ -119,6 +256,176 @@ GCodeResult Heater::SetTemperature(const CanMessageSetHeaterTemperature& msg, co
 	return GCodeResult::ok;
 }
 
+#if SUPPORT_HEATER_PROFILES
+
+// Configure or trigger the setpoint profile. R is the ramp rate in C/sec, S the standby temperature and A the active temperature.
+// C is the action: 1 to go to the standby temperature, 2 to go to the active temperature, 3 to reach the active temperature at master time T.
+GCodeResult Heater::SetOrReportProfile(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, HeaterProfileParams);
+	bool seen = false;
+
+	float rate;
+	if (parser.GetFloatParam('R', rate))
+	{
+		if (rate < 0.0)
+		{
+			reply.copy("Ramp rate must not be negative");
+			return GCodeResult::error;
+		}
+		seen = true;
+		rampRate = rate;
+	}
+	if (parser.GetFloatParam('S', standbyTemperature))
+	{
+		seen = true;
+	}
+	if (parser.GetFloatParam('A', activeTemperature))
+	{
+		seen = true;
+	}
+
+	uint8_t action;
+	if (parser.GetUintParam('C', action))
+	{
+		seen = true;
+		switch ((ProfileAction)action)
+		{
+		case ProfileAction::none:
+			break;
+
+		case ProfileAction::standby:
+			StartRamp(standbyTemperature);
+			break;
+
+		case ProfileAction::active:
+			StartRamp(activeTemperature);
+			break;
+
+		case ProfileAction::preheat:
+			if (!parser.GetUintParam('T', preheatDueTime))
+			{
+				reply.copy("Missing preheat time");
+				return GCodeResult::error;
+			}
+			profileState = ProfileState::preheatPending;
+			break;
+
+		default:
+			reply.printf("Unknown profile action %u for heater %u", action, heaterNumber);
+			return GCodeResult::error;
+		}
+	}
+
+	if (!seen)
+	{
+		reply.printf("Heater %u standby %.1fC, active %.1fC, ", heaterNumber, (double)standbyTemperature, (double)activeTemperature);
+		if (rampRate > 0.0)
+		{
+			reply.catf("ramp %.1fC/sec", (double)rampRate);
+		}
+		else
+		{
+			reply.cat("no ramp");
+		}
+		switch (profileState)
+		{
+		case ProfileState::ramping:
+			reply.catf(", ramping to %.1fC", (double)profileTarget);
+			break;
+
+		case ProfileState::preheatPending:
+			reply.catf(", preheat due in %.1fs", (double)((float)(int32_t)(preheatDueTime - StepTimer::GetMasterTime()) * (1.0/(float)StepTimer::StepClockRate)));
+			break;
+
+		default:
+			break;
+		}
+	}
+	return GCodeResult::ok;
+}
+
+// Start moving the setpoint to a new target and switch the heater on
+void Heater::StartRamp(float target)
+{
+	profileTarget = target;
+	whenLastRamped = millis();
+	if (rampRate > 0.0)
+	{
+		profileState = ProfileState::ramping;
+	}
+	else
+	{
+		requestedTemperature = target;
+		profileState = ProfileState::idle;
+	}
+	SwitchOn();
+}
+
+// Estimate how many seconds we need to reach a temperature. We use the ramp rate if it is slower than the heater, and assume full power otherwise.
+float Heater::GetHeatingTime(float target) const
+{
+	const float current = GetTemperature();
+	if (current >= target)
+	{
+		return 0.0;
+	}
+
+	const float rampSeconds = (rampRate > 0.0) ? (target - current)/rampRate : 0.0;
+	const float maxTemperature = NormalAmbientTemperature + model.GetGain() * model.GetMaxPwm();
+	const float heatingSeconds = (maxTemperature > target)
+									? model.GetDeadTime() + model.GetTimeConstant() * logf((maxTemperature - current)/(maxTemperature - target))
+										: MaxPreheatSeconds;
+	return min<float>(max<float>(rampSeconds, heatingSeconds), MaxPreheatSeconds);
+}
+
+// Move the setpoint along the profile. Called by the heater task before each run of the control loop.
+void Heater::UpdateProfile()
+{
+	switch (profileState)
+	{
+	case ProfileState::preheatPending:
+		// If we aren't synced to the master clock we don't know when the preheat is due, so start it now
+		if (   !StepTimer::IsSynced()
+			|| (int32_t)(preheatDueTime - StepTimer::GetMasterTime()) <= (int32_t)(GetHeatingTime(activeTemperature) * (float)StepTimer::StepClockRate)
+		   )
+		{
+			StartRamp(activeTemperature);
+		}
+		break;
+
+	case ProfileState::ramping:
+		{
+			const uint32_t now = millis();
+			const float maxChange = rampRate * (float)(now - whenLastRamped) * MillisToSeconds;
+			whenLastRamped = now;
+			const float change = profileTarget - requestedTemperature;
+			if (fabsf(change) <= maxChange)
+			{
+				requestedTemperature = profileTarget;
+				profileState = ProfileState::idle;
+			}
+			else
+			{
+				requestedTemperature += (change > 0.0) ? maxChange : -maxChange;
+			}
+
+			// Don't switch the heater on again if the main board has switched it off or it is being tuned
+			const HeaterMode mode = GetMode();
+			if (mode >= HeaterMode::heating && !IsTuning())
+			{
+				SwitchOn();
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+#endif
+
 float Heater::GetHighestTemperatureLimit() const noexcept
 {
 	float limit = BadErrorTemperature;
@@ -155,6 +462,7 @@ float Heater::GetLowestTemperatureLimit() const noexcept
 
 void Heater::SetModelDefaults() noexcept
 {
+	configDigest = 0;
 	model.SetParameters(DefaultHotEndHeaterGain, DefaultHotEndHeaterTimeConstant, DefaultHotEndHeaterDeadTime, 1.0, DefaultHotEndTemperatureLimit, 0.0, true, false);
 }
 
@@ -12,6 +12,7 @@
 #include "HeaterMonitor.h"
 #include "FOPDT.h"
 #include <GCodes/GCodeResult.h>
+#include <ObjectPool.h>
 
 #include <CanId.h>
 
@@ -20,6 +21,7 @@ class CanMessageGenericParser;
 class CanMessageSetHeaterTemperature;
 class CanMessageUpdateHeaterModel;
 class CanMessageSetHeaterMonitors;
+class CanMessageGeneric;
 
 class Heater
 {
@@ -27,24 +29,57 @@ public:
 	Heater(unsigned int num);
 	virtual ~Heater();
 
+	// Heaters are allocated from a pool so that reconfiguring them doesn't fragment the heap
+	void* operator new(size_t sz) { return pool.Allocate(sz); }
+	void operator delete(void* p, size_t sz) { pool.Release(p, sz); }
+
+
 	// Configuration methods
 	virtual GCodeResult ConfigurePortAndSensor(const char *portName, PwmFrequency freq, unsigned int sensorNumber, const StringRef& reply) = 0;
 	virtual GCodeResult SetPwmFrequency(PwmFrequency freq, const StringRef& reply) = 0;
 	virtual GCodeResult ReportDetails(const StringRef& reply) const = 0;
+#if SUPPORT_REDUNDANT_HEATER_SENSORS
+	// How we combine the readings of the primary and secondary sensors when both are good
+	enum class SensorFusion : uint8_t
+	{
+		failover = 0,							// use the primary sensor, and the secondary one only when the primary one fails
+		average,
+		lowest,
+		highest
+	};
+	virtual GCodeResult ConfigureSecondarySensor(unsigned int sensorNumber, SensorFusion fusion, float maxDisagreement, const StringRef& reply) = 0;
+#endif
 
 	virtual float GetTemperature() const = 0;					// Get the current temperature
 	virtual float GetAveragePWM() const = 0;					// Return the running average PWM to the heater. Answer is a fraction in [0, 1].
+	virtual float GetDemandedPwm() const = 0;					// Return the PWM that the control loop wants, before applying the power budget
+	virtual float GetAppliedPwm() const = 0;					// Return the PWM that we are currently applying to the heater
 	virtual void ResetFault() = 0;								// Reset a fault condition - only call this if you know what you are doing
 	virtual void SwitchOff() = 0;
-	virtual void Spin() = 0;
+	virtual void Spin(uint32_t sampleInterval) = 0;				// Called every sampleInterval milliseconds to read the temperature and run the control loop
+	virtual void PollOutput() { }								// Called on every heater task cycle, for heaters that need to update their output faster than their control loop runs
 	virtual void StartAutoTune(float targetTemp, float maxPwm, const StringRef& reply) = 0;	// Start an auto tune cycle for this PID
 	virtual void GetAutoTuneStatus(const StringRef& reply) const = 0;	// Get the auto tune status or last result
 	virtual void Suspend(bool sus) = 0;							// Suspend the heater to conserve power or while doing Z probing
 	virtual float GetAccumulator() const = 0;					// get the inertial term accumulator
 
 	GCodeResult SetTemperature(const CanMessageSetHeaterTemperature& msg, const StringRef& reply);
+#if SUPPORT_HEATER_PROFILES
+	GCodeResult SetOrReportProfile(const CanMessageGeneric& msg, const StringRef& reply);
+	void UpdateProfile();										// Called by the heater task before each run of the control loop
+#endif
+
+	// The digest of the command that created this heater, or 0 if the heater has been configured further since then
+	uint32_t GetConfigDigest() const noexcept { return configDigest; }
+	void SetConfigDigest(uint32_t digest) noexcept { configDigest = digest; }
 
 	unsigned int GetHeaterNumber() const { return heaterNumber; }
+	int GetSensorNumber() const noexcept { return sensorNumber; }
+
+	GCodeResult SetControlInterval(uint32_t interval, const StringRef& reply);
+	GCodeResult SetOrReportFeedForward(const CanMessageGeneric& msg, const StringRef& reply);
+	void SetPowerLimit(float fraction) { powerLimit = fraction; }	// Set the fraction of the demanded PWM that we may use
+	uint32_t GetControlInterval(uint32_t sensorPollInterval) const;	// Get the interval at which to run the control loop, given the poll interval of our sensor
 
 	void GetFaultDetectionParameters(float& pMaxTempExcursion, float& pMaxFaultTime) const
 		{ pMaxTempExcursion = maxTempExcursion; pMaxFaultTime = maxHeatingFaultTime; }
@@ -59,6 +94,7 @@ public:
 	const FopDt& GetModel() const { return model; }				// Get the process model
 	GCodeResult SetOrReportModel(unsigned int heater, const CanMessageUpdateHeaterModel& msg, const StringRef& reply) noexcept;
 	void SetModelDefaults() noexcept;
+	void RestoreSavedModel() noexcept;
 
 	bool IsHeaterEnabled() const								// Is this heater enabled?
 		{ return model.IsEnabled(); }
@@ -67,6 +103,7 @@ public:
 		{ model.SetRawPidParameters(p_kP, p_recipTi, p_tD); }
 
 	bool IsTuning() const { return GetMode() >= HeaterMode::tuning0; }
+	bool IsFaulted() const { return GetMode() == HeaterMode::fault; }
 	uint8_t GetModeByte() const { return (uint8_t)GetMode(); }
 
 protected:
@@ -94,16 +131,28 @@ protected:
 	virtual void SwitchOn() noexcept = 0;
 	virtual GCodeResult UpdateModel(const StringRef& reply) noexcept = 0;
 
-	int GetSensorNumber() const noexcept { return sensorNumber; }
 	void SetSensorNumber(int sn) noexcept { sensorNumber = sn; }
+	uint32_t GetRequestedControlInterval() const noexcept { return controlInterval; }
+	float GetExtrusionFeedForward() const noexcept;
+	float GetPowerLimit() const noexcept { return powerLimit; }	// Get the extra PWM needed for the extrusion rate of the moves that are queued
 	float GetMaxTemperatureExcursion() const noexcept { return maxTempExcursion; }
 	float GetMaxHeatingFaultTime() const noexcept { return maxHeatingFaultTime; }
 	float GetTargetTemperature() const noexcept { return requestedTemperature; }
 	GCodeResult SetModel(float gain, float tc, float td, float maxPwm, float voltage, bool usePid, bool inverted, const StringRef& reply) noexcept;	// Set the process model
 
+	void CompileMonitors() noexcept;				// Rebuild the table of active monitors, call this whenever a monitor is changed
+#if SUPPORT_HEATER_PROFILES
+	void StartRamp(float target);
+	float GetHeatingTime(float target) const;		// Estimate how many seconds we need to reach a temperature from the current one
+#endif
+
 	HeaterMonitor monitors[MaxMonitorsPerHeater];	// embedding them in the Heater uses less memory than dynamic allocation
+	uint8_t activeMonitors[MaxMonitorsPerHeater];	// the indices of the enabled monitors, ordered by sensor number so that monitors sharing a sensor are adjacent
+	uint8_t numActiveMonitors;
 
 private:
+	static ObjectPool pool;
+
 	FopDt model;
 
 	unsigned int heaterNumber;
@@ -111,6 +160,40 @@ private:
 	float requestedTemperature;						// The required temperature
 	float maxTempExcursion;							// The maximum temperature excursion permitted while maintaining the setpoint
 	float maxHeatingFaultTime;						// How long a heater fault is permitted to persist before a heater fault is raised
+	float powerLimit;								// The fraction of the demanded PWM that the power budget allows us
+	uint32_t configDigest;							// The digest of the command that created this heater, or 0 if we have changed its configuration since
+	int8_t feedForwardDriver;						// The local driver whose extrusion rate we anticipate, or -1 if none
+	uint16_t controlInterval;						// The requested interval in milliseconds between runs of the control loop, or 0 to run it at the poll interval of the sensor
+
+#if SUPPORT_HEATER_PROFILES
+	// The setpoint profile. The main board sets the standby and active temperatures and the ramp rate, then triggers a change to one of them
+	// with a single message, and we move the setpoint ourselves. A preheat starts heating towards the active temperature early enough to reach it
+	// at the requested master time.
+	enum class ProfileAction : uint8_t
+	{
+		none = 0,
+		standby,
+		active,
+		preheat
+	};
+
+	enum class ProfileState : uint8_t
+	{
+		idle,
+		ramping,
+		preheatPending
+	};
+
+	static constexpr float MaxPreheatSeconds = 1000.0;	// the longest heating time we allow for, so that the lead time in step clocks can't overflow
+
+	float rampRate;									// The maximum rate of change of the setpoint in C/sec, or 0 to change it in one step
+	float standbyTemperature;
+	float activeTemperature;
+	float profileTarget;							// The setpoint we are ramping towards
+	uint32_t whenLastRamped;						// The millis() time at which we last moved the setpoint
+	uint32_t preheatDueTime;						// The master step clock time by which a pending preheat must reach the active temperature
+	volatile ProfileState profileState;
+#endif
 };
 
 #endif /* SRC_HEATING_HEATER_H_ */
@@ -11,42 +11,47 @@
 #include "Heat.h"
 
 HeaterMonitor::HeaterMonitor() noexcept
-	: sensorNumber(-1), trigger(HeaterMonitorTrigger::Disabled), badTemperatureCount(0)
+	: sensorNumber(-1), trigger(HeaterMonitorTrigger::Disabled), badTemperatureCount(0), triggered(false)
 {
 }
 
-// Check if any action needs to be taken. Returns true if everything is OK
-bool HeaterMonitor::Check() noexcept
+// Check if any action needs to be taken, given the temperature and error code read from our sensor. Returns true if everything is OK.
+// The caller reads the sensor so that monitors that share a sensor only read it once.
+bool HeaterMonitor::Check(float temperature, TemperatureError err) noexcept
 {
 	if (sensorNumber >= 0 && trigger != HeaterMonitorTrigger::Disabled)
 	{
-		TemperatureError err;
-		const float temperature = Heat::GetSensorTemperature(sensorNumber, err);
-
 		if (err != TemperatureError::success)
 		{
 			badTemperatureCount++;
 			if (badTemperatureCount > MaxBadTemperatureCount)
 			{
-				Platform::MessageF(ErrorMessage, "Temperature reading error on sensor %d\n", sensorNumber);
-				return false;
+				if (!triggered)
+				{
+					Platform::MessageF(ErrorMessage, "Temperature reading error on sensor %d\n", sensorNumber);
+				}
+				triggered = true;
 			}
 		}
 		else
 		{
 			badTemperatureCount = 0;
+			const float margin = (triggered) ? Hysteresis : 0.0;
 			switch (trigger)
 			{
 			case HeaterMonitorTrigger::TemperatureExceeded:
-				return (temperature <= limit);
+				triggered = (temperature > limit - margin);
+				break;
 
 			case HeaterMonitorTrigger::TemperatureTooLow:
-				return (temperature >= limit);
+				triggered = (temperature < limit + margin);
+				break;
 
 			default:
 				break;
 			}
 		}
+		return !triggered;
 	}
 	return true;
 }
@@ -10,6 +10,7 @@
 
 #include <RepRapFirmware.h>
 #include <General/FreelistManager.h>
+#include "TemperatureError.h"
 
 // Condition of a heater monitor event
 enum class HeaterMonitorTrigger : int8_t
@@ -47,7 +48,8 @@ public:
 
 	void Set(int sn, float lim, HeaterMonitorAction act, HeaterMonitorTrigger trig) noexcept;
 	void Disable() noexcept;
-	bool Check() noexcept;												// Check if any action needs to be taken
+	bool Check(float temperature, TemperatureError err) noexcept;		// Check the reading from our sensor and return false if action needs to be taken
+	bool IsTriggered() const noexcept { return triggered; }
 
 	int GetSensorNumber() const noexcept { return sensorNumber; }		// Get the supervisory sensor number
 	void SetSensorNumber(int sn) noexcept;								// Set the supervisory sensor number
@@ -61,12 +63,15 @@ public:
 	HeaterMonitorTrigger GetTrigger() const noexcept { return trigger; }	// Get the condition for a temperature event
 	void SetTrigger(HeaterMonitorTrigger newTrigger) noexcept;			// Set the condition for a temperature event
 
+	static constexpr float Hysteresis = 1.0;							// once triggered, the temperature must come back this far inside the limit before we are happy again
+
 private:
 	float limit;														// temperature limit
 	int8_t sensorNumber;												// the sensor that we use to monitor the heater
 	HeaterMonitorAction action;											// what action we take of we detect a fault
 	HeaterMonitorTrigger trigger;										// what is treated a fault
 	uint8_t badTemperatureCount;										// how many consecutive sensor reading faults we have had
+	bool triggered;														// true if the limit has been exceeded and the temperature hasn't come back inside the hysteresis band
 };
 
 inline void HeaterMonitor::Set(int sn, float lim, HeaterMonitorAction act, HeaterMonitorTrigger trig) noexcept
@@ -76,11 +81,13 @@ inline void HeaterMonitor::Set(int sn, float lim, HeaterMonitorAction act, Heate
 	action = act;
 	trigger = trig;
 	badTemperatureCount = 0;
+	triggered = false;
 }
 
 inline void HeaterMonitor::Disable() noexcept
 {
 	trigger = HeaterMonitorTrigger::Disabled;
+	triggered = false;
 }
 
 inline void HeaterMonitor::SetSensorNumber(int sn) noexcept
@@ -102,6 +109,7 @@ inline void HeaterMonitor::SetAction(HeaterMonitorAction newAction) noexcept
 inline void HeaterMonitor::SetTrigger(HeaterMonitorTrigger newTrigger) noexcept
 {
 	trigger = newTrigger;
+	triggered = false;
 }
 
 #endif
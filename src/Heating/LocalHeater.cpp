@@ -9,35 +9,25 @@
 #include "Heat.h"
 #include "Platform.h"
 #include "CanMessageGenericParser.h"
+#include "PersistentSettings.h"
+#include "Movement/StepTimer.h"
 
 // Private constants
 const uint32_t InitialTuningReadingInterval = 250;	// the initial reading interval in milliseconds
 const uint32_t TempSettleTimeout = 20000;	// how long we allow the initial temperature to settle
 
-// Static class variables
-
-float *LocalHeater::tuningTempReadings = nullptr;	// the readings from the heater being tuned
-float LocalHeater::tuningStartTemp;					// the temperature when we turned on the heater
-float LocalHeater::tuningPwm;						// the PWM to use
-float LocalHeater::tuningTargetTemp;				// the maximum temperature we are allowed to reach
-uint32_t LocalHeater::tuningBeginTime;				// when we started the tuning process
-uint32_t LocalHeater::tuningPhaseStartTime;			// when we started the current tuning phase
-uint32_t LocalHeater::tuningReadingInterval;		// how often we are sampling
-size_t LocalHeater::tuningReadingsTaken;			// how many samples we have taken
-
-float LocalHeater::tuningHeaterOffTemp;				// the temperature when we turned the heater off
-float LocalHeater::tuningPeakTemperature;			// the peak temperature reached, averaged over 3 readings (so slightly less than the true peak)
-uint32_t LocalHeater::tuningHeatingTime;			// how long we had the heating on for
-uint32_t LocalHeater::tuningPeakDelay;				// how many milliseconds the temperature continues to rise after turning the heater off
-
-#if HAS_VOLTAGE_MONITOR
-unsigned int voltageSamplesTaken;			// how many readings we accumulated
-float tuningVoltageAccumulator;				// sum of the voltage readings we take during the heating phase
-#endif
+static ObjectPool tuningPool("tuning");				// the tuning state of each heater being tuned is allocated from this
 
 // Member functions and constructors
 
-LocalHeater::LocalHeater(unsigned int heaterNum) : Heater(heaterNum), mode(HeaterMode::off)
+LocalHeater::LocalHeater(unsigned int heaterNum) : Heater(heaterNum), mode(HeaterMode::off), tuning(nullptr)
+#if SUPPORT_HEATER_MODEL_ESTIMATION
+	, modelDriftReported(false)
+#endif
+#if SUPPORT_REDUNDANT_HEATER_SENSORS
+	, secondarySensorNumber(-1), failedSensorNumber(-1), sensorFusion(SensorFusion::failover), maxSensorDisagreement(DefaultMaxSensorDisagreement),
+	  numSensorFailovers(0), numSensorDisagreements(0)
+#endif
 {
 	ResetHeater();
 	SetHeater(0.0);							// set up the pin even if the heater is not enabled (for PCCB)
@@ -63,20 +53,53 @@ float LocalHeater::GetAccumulator() const
 	return iAccumulator;
 }
 
-inline void LocalHeater::SetHeater(float power) const
+void LocalHeater::SetHeater(float power)
 {
-	port.WriteAnalog(power);
+	if (IsBurstFire())
+	{
+		// PollOutput turns the output on and off. We switch it off straight away if we are asked for no power, because that may be for safety reasons.
+		burstFireDemand = power;
+		if (power <= 0.0)
+		{
+			burstFireAccumulator = 0.0;
+			port.WriteAnalog(0.0);
+		}
+	}
+	else
+	{
+		port.WriteAnalog(power);
+	}
+}
+
+// Generate the burst fire output using a first order sigma-delta modulator clocked by the heater task.
+// Each on or off period lasts a whole number of heater task cycles, which is several mains cycles. A zero crossing SSR only switches at the next zero crossing,
+// so the load sees whole half cycles and the average power matches the demand to within one cycle over the modulator period.
+void LocalHeater::PollOutput()
+{
+	if (IsBurstFire() && burstFireDemand > 0.0)
+	{
+		burstFireAccumulator += burstFireDemand;
+		const bool on = (burstFireAccumulator >= 0.5);
+		if (on)
+		{
+			burstFireAccumulator -= 1.0;
+		}
+		port.WriteAnalog((on) ? 1.0 : 0.0);
+	}
 }
 
 void LocalHeater::ResetHeater()
 {
+	ReleaseTuningState();
 	mode = HeaterMode::off;
 	previousTemperaturesGood = 0;
 	previousTemperatureIndex = 0;
 	iAccumulator = 0.0;
 	badTemperatureCount = 0;
 	tuned = false;
-	averagePWM = lastPwm = 0.0;
+	averagePWM = lastPwm = appliedPwm = 0.0;
+	appliedVoltageCompensation = 1.0;
+	burstFireDemand = burstFireAccumulator = 0.0;
 	heatingFaultCount = 0;
 	temperature = BadErrorTemperature;
 }
@@ -101,13 +124,51 @@ GCodeResult LocalHeater::ConfigurePortAndSensor(const char *portName, PwmFrequen
 	{
 		// Set up a default monitor
 		monitors[0].Set(sensorNumber, DefaultHotEndTemperatureLimit, HeaterMonitorAction::GenerateFault, HeaterMonitorTrigger::TemperatureExceeded);
+		CompileMonitors();
+	}
+	return GCodeResult::ok;
+}
+
+#if SUPPORT_REDUNDANT_HEATER_SENSORS
+
+// Configure a second sensor for this heater, so that a single failed or flaky sensor doesn't stop the heater
+GCodeResult LocalHeater::ConfigureSecondarySensor(unsigned int sensorNumber, SensorFusion fusion, float maxDisagreement, const StringRef& reply)
+{
+	if ((int)sensorNumber == GetSensorNumber())
+	{
+		reply.copy("Secondary sensor must be different from the primary sensor");
+		return GCodeResult::error;
+	}
+	if (sensorNumber >= MaxSensors)
+	{
+		reply.copy("Sensor number out of range");
+		return GCodeResult::error;
+	}
+	if (maxDisagreement <= 0.0)
+	{
+		reply.copy("Maximum sensor disagreement must be greater than zero");
+		return GCodeResult::error;
+	}
+
+	secondarySensorNumber = (int8_t)sensorNumber;
+	sensorFusion = fusion;
+	maxSensorDisagreement = maxDisagreement;
+	failedSensorNumber = -1;
+	if (Heat::FindSensor(sensorNumber).IsNull())
+	{
+		reply.printf("Sensor number %u has not been defined", sensorNumber);
+		return GCodeResult::warning;
 	}
 	return GCodeResult::ok;
 }
 
+#endif
+
 GCodeResult LocalHeater::SetPwmFrequency(PwmFrequency freq, const StringRef& reply)
 {
 	port.SetFrequency(freq);
+	burstFireAccumulator = 0.0;
+	SetHeater(appliedPwm);								// switch to the new output mode straight away
 	return GCodeResult::ok;
 }
 
@@ -115,6 +176,10 @@ GCodeResult LocalHeater::ReportDetails(const StringRef& reply) const
 {
 	reply.printf("Heater %u", GetHeaterNumber());
 	port.AppendDetails(reply);
+	if (IsBurstFire())
+	{
+		reply.catf(" (burst fire, %ums per cycle)", (unsigned int)MinHeatSampleIntervalMillis);
+	}
 	if (GetSensorNumber() >= 0)
 	{
 		reply.catf(", sensor %d", GetSensorNumber());
@@ -123,6 +188,25 @@ GCodeResult LocalHeater::ReportDetails(const StringRef& reply) const
 	{
 		reply.cat(", no sensor");
 	}
+#if SUPPORT_REDUNDANT_HEATER_SENSORS
+	if (secondarySensorNumber >= 0)
+	{
+		static const char * const FusionNames[] = { "failover", "average", "lowest", "highest" };
+		reply.catf(" and %d (%s, max difference %.1fC), failovers %" PRIu32 ", disagreements %" PRIu32,
+					secondarySensorNumber, FusionNames[(unsigned int)sensorFusion], (double)maxSensorDisagreement, numSensorFailovers, numSensorDisagreements);
+		if (failedSensorNumber >= 0)
+		{
+			reply.catf(", running without sensor %d", failedSensorNumber);
+		}
+	}
+#endif
+	if (GetRequestedControlInterval() != 0)
+	{
+		reply.catf(", control interval %" PRIu32 "ms", GetRequestedControlInterval());
+	}
+#if SUPPORT_HEATER_MODEL_ESTIMATION
+	estimator.AppendDetails(reply);
+#endif
 	return GCodeResult::ok;
 }
 
@@ -130,10 +214,98 @@ GCodeResult LocalHeater::ReportDetails(const StringRef& reply) const
 TemperatureError LocalHeater::ReadTemperature()
 {
 	TemperatureError err;
-	temperature = Heat::GetSensorTemperature(GetSensorNumber(), err);		// in the event of an error, err is set and BAD_ERROR_TEMPERATURE is returned
+	temperature = Heat::GetSensorTemperature(GetSensorNumber(), err, whenTemperatureRead);		// in the event of an error, err is set and BAD_ERROR_TEMPERATURE is returned
+#if SUPPORT_REDUNDANT_HEATER_SENSORS
+	if (secondarySensorNumber >= 0)
+	{
+		FuseSecondaryReading(err);
+	}
+#endif
 	return err;
 }
 
+#if SUPPORT_REDUNDANT_HEATER_SENSORS
+
+// Combine the reading of the secondary sensor with the one we just took from the primary sensor.
+// If only one sensor gives a good reading then we use it, so that one bad sensor doesn't fault the heater. If both give good readings but they disagree
+// by more than the limit then we can't tell which one is right, so we report a bad reading and the heater faults if that persists.
+void LocalHeater::FuseSecondaryReading(TemperatureError& err)
+{
+	TemperatureError secondaryErr;
+	uint32_t whenSecondaryRead;
+	const float secondaryTemperature = Heat::GetSensorTemperature(secondarySensorNumber, secondaryErr, whenSecondaryRead);
+
+	int8_t newFailedSensor = failedSensorNumber;				// if both sensors fail then we leave the heater to fault
+	if (err == TemperatureError::success && secondaryErr == TemperatureError::success)
+	{
+		newFailedSensor = -1;
+		if (fabsf(temperature - secondaryTemperature) > maxSensorDisagreement)
+		{
+			++numSensorDisagreements;
+			temperature = BadErrorTemperature;
+			err = TemperatureError::sensorsDisagree;
+		}
+		else
+		{
+			switch (sensorFusion)
+			{
+			case SensorFusion::average:
+				temperature = 0.5 * (temperature + secondaryTemperature);
+				break;
+
+			case SensorFusion::lowest:
+				if (secondaryTemperature < temperature)
+				{
+					temperature = secondaryTemperature;
+					whenTemperatureRead = whenSecondaryRead;
+				}
+				break;
+
+			case SensorFusion::highest:
+				if (secondaryTemperature > temperature)
+				{
+					temperature = secondaryTemperature;
+					whenTemperatureRead = whenSecondaryRead;
+				}
+				break;
+
+			case SensorFusion::failover:
+			default:
+				break;
+			}
+		}
+	}
+	else if (secondaryErr == TemperatureError::success)
+	{
+		newFailedSensor = (int8_t)GetSensorNumber();
+		temperature = secondaryTemperature;
+		whenTemperatureRead = whenSecondaryRead;
+		err = TemperatureError::success;
+	}
+	else if (err == TemperatureError::success)
+	{
+		newFailedSensor = secondarySensorNumber;
+	}
+
+	// Tell the user the first time we run on one sensor, because the heater is no longer protected against a second failure.
+	// A flaky sensor may fail over many times, so we only count the later ones.
+	if (newFailedSensor != failedSensorNumber)
+	{
+		if (newFailedSensor >= 0)
+		{
+			if (numSensorFailovers == 0)
+			{
+				Platform::MessageF(WarningMessage, "Heater %u is using sensor %d only, sensor %d has a fault\n",
+									GetHeaterNumber(), (newFailedSensor == secondarySensorNumber) ? GetSensorNumber() : (int)secondarySensorNumber, newFailedSensor);
+			}
+			++numSensorFailovers;
+		}
+		failedSensorNumber = newFailedSensor;
+	}
+}
+
+#endif
+
 // This must be called whenever the heater is turned on, and any time the heater is active and the target temperature is changed
 void LocalHeater::SwitchOn()
 {
@@ -162,18 +334,24 @@ void LocalHeater::SwitchOn()
 	}
 }
 
-// Switch off the specified heater. If in tuning mode, delete the array used to store tuning temperature readings.
+// Return the tuning state to the pool
+void LocalHeater::ReleaseTuningState()
+{
+	if (tuning != nullptr)
+	{
+		tuningPool.Release(tuning, sizeof(TuningState));
+		tuning = nullptr;
+	}
+}
+
+// Switch off the specified heater. If in tuning mode, release the tuning state.
 void LocalHeater::SwitchOff()
 {
 	lastPwm = 0.0;
 	if (GetModel().IsEnabled())
 	{
 		SetHeater(0.0);
-		if (mode >= HeaterMode::tuning0)
-		{
-			delete tuningTempReadings;
-			tuningTempReadings = nullptr;
-		}
+		ReleaseTuningState();
 		if (mode > HeaterMode::off)
 		{
 			mode = HeaterMode::off;
@@ -184,19 +362,70 @@ void LocalHeater::SwitchOff()
 // This is called when the heater model has been updated. Returns true if successful.
 GCodeResult LocalHeater::UpdateModel(const StringRef& reply)
 {
+#if SUPPORT_HEATER_MODEL_ESTIMATION
+	estimator.Reset(GetModel());
+	modelDriftReported = false;
+#endif
 	return GCodeResult::ok;
 }
 
-// This is the main heater control loop function
-void LocalHeater::Spin()
+#if SUPPORT_HEATER_MODEL_ESTIMATION
+
+// Warn once if the estimated model has drifted from the configured one, for example because a heater cartridge or thermistor is failing or has come loose.
+// We don't warn again until the estimate has come back to within half the limit.
+void LocalHeater::CheckModelDrift()
+{
+	constexpr float MaxModelDrift = 0.25;
+	if (estimator.HaveEstimate())
+	{
+		const float drift = estimator.GetDrift(GetModel());
+		if (!modelDriftReported && drift > MaxModelDrift)
+		{
+			modelDriftReported = true;
+			Platform::MessageF(WarningMessage, "Heater %u model has drifted, estimated gain %.1f time constant %.1f dead time %.1f\n",
+								GetHeaterNumber(), (double)estimator.GetGain(), (double)estimator.GetTimeConstant(), (double)estimator.GetDeadTime());
+		}
+		else if (modelDriftReported && drift < 0.5 * MaxModelDrift)
+		{
+			modelDriftReported = false;
+		}
+	}
+}
+
+#endif
+
+// Return the square of the ratio of the voltage at which the heater model was measured to the current supply voltage.
+// We multiply the PWM by this to get the same heater power as the model predicts. Bed and chamber heaters are often powered from a different supply, so we don't compensate them.
+float LocalHeater::GetVoltageCompensation() const
+{
+#if HAS_VOLTAGE_MONITOR
+	const float modelVoltage = GetModel().GetVoltage();
+	if (modelVoltage >= 10.0 && !Heat::IsBedOrChamberHeater(GetHeaterNumber()))	// if we know the voltage we tuned the heater at
+	{
+		const float currentVoltage = Platform::GetCurrentVinVoltage();
+		if (currentVoltage >= 10.0)													// if we have a sensible reading
+		{
+			return fsquare(modelVoltage/currentVoltage);
+		}
+	}
+#endif
+	return 1.0;
+}
+
+// This is the main heater control loop function. It is called at the poll interval of our temperature sensor, so heaters with fast sensors run their control loop faster.
+void LocalHeater::Spin(uint32_t sampleInterval)
 {
 	// Read the temperature even if the heater is suspended or the model is not enabled
 	const TemperatureError err = ReadTemperature();
+	const float voltageCompensation = GetVoltageCompensation();		// the VIN reading is averaged, so we read it once per control step
 
 	// Handle any temperature reading error and calculate the temperature rate of change, if possible
 	if (err != TemperatureError::success)
 	{
 		previousTemperaturesGood <<= 1;				// this reading isn't a good one
+#if SUPPORT_HEATER_MODEL_ESTIMATION
+		estimator.Interrupt();
+#endif
 		if (mode > HeaterMode::suspended)			// don't worry about errors when reading heaters that are switched off or flagged as having faults
 		{
 			// Error may be a temporary error and may correct itself after a few additional reads
@@ -205,11 +434,7 @@ void LocalHeater::Spin()
 			{
 				lastPwm = 0.0;
 				SetHeater(0.0);						// do this here just to be sure, in case the call to platform.Message causes a delay
-				if (mode >= HeaterMode::tuning0)
-				{
-					delete tuningTempReadings;
-					tuningTempReadings = nullptr;
-				}
+				ReleaseTuningState();
 				mode = HeaterMode::fault;
 				Platform::HandleHeaterFault(GetHeaterNumber());
 				Platform::MessageF(ErrorMessage, "Temperature reading fault on heater %u: %s\n", GetHeaterNumber(), TemperatureErrorString(err));
@@ -223,18 +448,26 @@ void LocalHeater::Spin()
 		float derivative = 0.0;
 		bool gotDerivative = false;
 		badTemperatureCount = 0;
-		if ((previousTemperaturesGood & (1 << (NumPreviousTemperatures - 1))) != 0)
+		// Take the derivative over the same time whatever the sample interval, so that faster sampling doesn't make it noisier.
+		// Use the times at which the sensor took the readings rather than the nominal sample interval, because the Heat task and the sensors don't run like clockwork.
+		const size_t numDerivativeSamples = constrain<size_t>(DerivativeIntervalMillis/sampleInterval, 1, NumPreviousTemperatures);
+		if ((previousTemperaturesGood & (1u << (numDerivativeSamples - 1))) != 0)
 		{
-			const float tentativeDerivative = ((float)SecondsToMillis/HeatSampleIntervalMillis) * (temperature - previousTemperatures[previousTemperatureIndex])
-							/ (float)(NumPreviousTemperatures);
-			// Some sensors give occasional temperature spikes. We don't expect the temperature to increase by more than 10C/second.
-			if (fabsf(tentativeDerivative) <= 10.0)
+			const size_t oldestIndex = (previousTemperatureIndex + NumPreviousTemperatures - numDerivativeSamples) % NumPreviousTemperatures;
+			const uint32_t ticksElapsed = whenTemperatureRead - previousTemperatureTimes[oldestIndex];
+			if (ticksElapsed != 0)			// if the sensor hasn't taken a new reading since the oldest one, we can't calculate the derivative
 			{
-				derivative = tentativeDerivative;
-				gotDerivative = true;
+				const float tentativeDerivative = (temperature - previousTemperatures[oldestIndex]) * (float)StepTimer::StepClockRate/(float)ticksElapsed;
+				// Some sensors give occasional temperature spikes. We don't expect the temperature to increase by more than 10C/second.
+				if (fabsf(tentativeDerivative) <= 10.0)
+				{
+					derivative = tentativeDerivative;
+					gotDerivative = true;
+				}
 			}
 		}
 		previousTemperatures[previousTemperatureIndex] = temperature;
+		previousTemperatureTimes[previousTemperatureIndex] = whenTemperatureRead;
 		previousTemperaturesGood = (previousTemperaturesGood << 1) | 1;
 
 		if (GetModel().IsEnabled())
@@ -260,7 +493,7 @@ void LocalHeater::Spin()
 							&& (float)(millis() - timeSetHeating) > GetModel().GetDeadTime() * SecondsToMillis * 2)
 						{
 							++heatingFaultCount;
-							if (heatingFaultCount * HeatSampleIntervalMillis > GetMaxHeatingFaultTime() * SecondsToMillis)
+							if (heatingFaultCount * sampleInterval > GetMaxHeatingFaultTime() * SecondsToMillis)
 							{
 								SetHeater(0.0);					// do this here just to be sure
 								mode = HeaterMode::fault;
@@ -285,7 +518,7 @@ void LocalHeater::Spin()
 				if (fabsf(error) > GetMaxTemperatureExcursion() && temperature > MaxAmbientTemperature)
 				{
 					++heatingFaultCount;
-					if (heatingFaultCount * HeatSampleIntervalMillis > GetMaxHeatingFaultTime() * SecondsToMillis)
+					if (heatingFaultCount * sampleInterval > GetMaxHeatingFaultTime() * SecondsToMillis)
 					{
 						SetHeater(0.0);					// do this here just to be sure
 						mode = HeaterMode::fault;
@@ -330,47 +563,9 @@ void LocalHeater::Spin()
 				{
 					// Using PID mode. Determine the PID parameters to use.
 					const bool inLoadMode = (mode == HeaterMode::stable) || fabsf(error) < 3.0;		// use standard PID when maintaining temperature
-					const PidParameters& params = GetModel().GetPidParameters(inLoadMode);
-
-					// If the P and D terms together demand that the heater is full on or full off, disregard the I term
-					const float errorMinusDterm = error - (params.tD * derivative);
-					const float pPlusD = params.kP * errorMinusDterm;
-					const float expectedPwm = constrain<float>((temperature - NormalAmbientTemperature)/GetModel().GetGain(), 0.0, GetModel().GetMaxPwm());
-					if (pPlusD + expectedPwm > GetModel().GetMaxPwm())
-					{
-						lastPwm = GetModel().GetMaxPwm();
-						// If we are heating up, preset the I term to the expected PWM at this temperature, ready for the switch over to PID
-						if (mode == HeaterMode::heating && error > 0.0 && derivative > 0.0)
-						{
-							iAccumulator = expectedPwm;
-						}
-					}
-					else if (pPlusD + expectedPwm < 0.0)
-					{
-						lastPwm = 0.0;
-					}
-					else
-					{
-						const float errorToUse = error;
-						iAccumulator = constrain<float>
-										(iAccumulator + (errorToUse * params.kP * params.recipTi * HeatSampleIntervalMillis * MillisToSeconds),
-											0.0, GetModel().GetMaxPwm());
-						lastPwm = constrain<float>(pPlusD + iAccumulator, 0.0, GetModel().GetMaxPwm());
-					}
-#if HAS_VOLTAGE_MONITOR
-					// Scale the PID based on the current voltage vs. the calibration voltage
-					if (lastPwm < 1.0 && GetModel().GetVoltage() >= 10.0)				// if heater is not fully on and we know the voltage we tuned the heater at
-					{
-						if (!Heat::IsBedOrChamberHeater(GetHeaterNumber()))
-						{
-							const float currentVoltage = Platform::GetCurrentVinVoltage();
-							if (currentVoltage >= 10.0)				// if we have a sensible reading
-							{
-								lastPwm = min<float>(lastPwm * fsquare(GetModel().GetVoltage()/currentVoltage), 1.0);	// adjust the PWM by the square of the voltage ratio
-							}
-						}
-					}
-#endif
+					lastPwm = GetModel().CalcPidPwm(temperature, error, derivative, GetExtrusionFeedForward(), inLoadMode, mode == HeaterMode::heating, sampleInterval, iAccumulator);
+					// Scale the PWM by the square of the ratio of the calibration voltage to the current voltage, so that the heater power doesn't change when VIN sags
+					lastPwm = min<float>(lastPwm * voltageCompensation, 1.0);
 				}
 				else
 				{
@@ -384,28 +579,51 @@ void LocalHeater::Spin()
 					lastPwm = GetModel().GetMaxPwm() - lastPwm;
 				}
 
-				// Verify that everything is operating in the required temperature range
-				for (HeaterMonitor& prot : monitors)
+				// Verify that everything is operating in the required temperature range. Monitors that share a sensor are adjacent in the table, so we read each sensor once.
+				int monitorSensor = -1;
+				float monitorTemperature = 0.0;
+				TemperatureError monitorErr = TemperatureError::success;
+				for (size_t i = 0; i < numActiveMonitors; ++i)
 				{
-					if (!prot.Check())
+					HeaterMonitor& prot = monitors[activeMonitors[i]];
+					if (prot.GetSensorNumber() != monitorSensor)
+					{
+						monitorSensor = prot.GetSensorNumber();
+#if SUPPORT_REDUNDANT_HEATER_SENSORS
+						// A monitor on a sensor that we are running without checks the temperature from our other sensor instead
+						if (monitorSensor == failedSensorNumber)
+						{
+							monitorTemperature = temperature;
+							monitorErr = TemperatureError::success;
+						}
+						else
+#endif
+						{
+							monitorTemperature = Heat::GetSensorTemperature(monitorSensor, monitorErr);
+						}
+					}
+
+					const bool wasTriggered = prot.IsTriggered();
+					if (!prot.Check(monitorTemperature, monitorErr))
 					{
 						lastPwm = 0.0;
-						switch (prot.GetAction())
+						if (!wasTriggered)
+						{
+							Heat::RequestImmediateReport();		// tell the main board now instead of waiting for the next status report
+						}
+						if (prot.GetAction() == HeaterMonitorAction::GenerateFault)
 						{
-						case HeaterMonitorAction::GenerateFault:
 							mode = HeaterMode::fault;
 							Platform::HandleHeaterFault(GetHeaterNumber());
 							Platform::MessageF(ErrorMessage, "Heating fault on heater %u\n", GetHeaterNumber());
-							break;
-
-						case HeaterMonitorAction::TemporarySwitchOff:
-							// Do nothing, the PWM value has already been set above
-							break;
-
-						case HeaterMonitorAction::PermanentSwitchOff:
+							break;						// the heater is off now, so there is no point in checking the other monitors
+						}
+						if (prot.GetAction() == HeaterMonitorAction::PermanentSwitchOff)
+						{
 							SwitchOff();
 							break;
 						}
+						// For TemporarySwitchOff there is nothing more to do, the PWM value has already been set above
 					}
 				}
 			}
@@ -419,9 +637,27 @@ void LocalHeater::Spin()
 			lastPwm = 0.0;
 		}
 
-		// Set the heater power and update the average PWM
-		SetHeater(lastPwm);
-		averagePWM = averagePWM * (1.0 - HeatSampleIntervalMillis/(HeatPwmAverageTime * SecondsToMillis)) + lastPwm;
+#if SUPPORT_HEATER_MODEL_ESTIMATION
+		// Feed the estimator, except while tuning because the tuning algorithm measures the model itself, and when we don't know what power the heater is getting
+		if (mode < HeaterMode::tuning0 && mode != HeaterMode::fault && GetModel().IsEnabled() && !GetModel().IsInverted())
+		{
+			// appliedPwm is still the PWM we used during the last sample interval. Refer it to the model voltage so that VIN changes don't look like gain changes.
+			estimator.Update(temperature, appliedPwm/appliedVoltageCompensation, sampleInterval);
+			CheckModelDrift();
+		}
+		else
+		{
+			estimator.Interrupt();
+		}
+#endif
+
+		// Set the heater power, limited to our share of the power budget unless we are tuning, and update the average PWM
+		appliedPwm = (mode >= HeaterMode::tuning0) ? lastPwm : lastPwm * GetPowerLimit();
+		appliedVoltageCompensation = voltageCompensation;
+		SetHeater(appliedPwm);
+		constexpr float RecipPwmAverageTimeMillis = 1.0/(HeatPwmAverageTime * SecondsToMillis);
+		const float averagingFraction = (float)sampleInterval * RecipPwmAverageTimeMillis;
+		averagePWM = averagePWM * (1.0 - averagingFraction) + appliedPwm * averagingFraction;
 		previousTemperatureIndex = (previousTemperatureIndex + 1) % NumPreviousTemperatures;
 
 		// For temperature sensors which do not require frequent sampling and averaging,
@@ -448,7 +684,19 @@ void LocalHeater::ResetFault()
 
 float LocalHeater::GetAveragePWM() const
 {
-	return averagePWM * HeatSampleIntervalMillis/(HeatPwmAverageTime * SecondsToMillis);
+	return averagePWM;
+}
+
+// Return the PWM that the control loop wants, before applying the power budget
+float LocalHeater::GetDemandedPwm() const
+{
+	return (mode > HeaterMode::suspended) ? lastPwm : 0.0;
+}
+
+// Return the PWM that we are currently applying to the heater
+float LocalHeater::GetAppliedPwm() const
+{
+	return (mode > HeaterMode::suspended) ? appliedPwm : 0.0;
 }
 
 // Get a conservative estimate of the expected heating rate at the current temperature and average PWM. The result may be negative.
@@ -456,9 +704,9 @@ float LocalHeater::GetExpectedHeatingRate() const
 {
 	// In the following we allow for the gain being only 75% of what we think it should be, to avoid false alarms
 	const float maxTemperatureRise = 0.75 * GetModel().GetGain() * GetAveragePWM();		// this is the highest temperature above ambient we expect the heater can reach at this PWM
-	const float initialHeatingRate = maxTemperatureRise/GetModel().GetTimeConstant();	// this is the expected heating rate at ambient temperature
+	// The expected heating rate at ambient temperature is maxTemperatureRise/timeConstant and it falls in proportion to the remaining temperature rise
 	return (maxTemperatureRise >= 20.0)
-			? (maxTemperatureRise + NormalAmbientTemperature - temperature) * initialHeatingRate/maxTemperatureRise
+			? (maxTemperatureRise + NormalAmbientTemperature - temperature) * GetModel().GetRecipTimeConstant()
 			: 0.0;
 }
 
@@ -483,17 +731,20 @@ void LocalHeater::StartAutoTune(float targetTemp, float maxPwm, const StringRef&
 		}
 		else
 		{
+			// We don't normally allow dynamic memory allocation when running. However, auto tuning is rarely done and it
+			// would be wasteful to allocate permanent tuning state for every heater just in case we are going to tune it, so we make an exception here.
+			// The state comes from a pool, so tuning repeatedly re-uses the same memory, and tuning several heaters at once uses one block per heater.
+			if (tuning == nullptr)
+			{
+				tuning = static_cast<TuningState*>(tuningPool.Allocate(sizeof(TuningState)));
+			}
 			mode = HeaterMode::tuning0;
-			tuningReadingsTaken = 0;
+			tuning->readingsTaken = 0;
 			tuned = false;					// assume failure
-
-			// We don't normally allow dynamic memory allocation when running. However, auto tuning is rarely done and it
-			// would be wasteful to allocate a permanent array just in case we are going to run it, so we make an exception here.
-			tuningTempReadings = new float[MaxTuningTempReadings];
-			tuningTempReadings[0] = temperature;
-			tuningReadingInterval = HeatSampleIntervalMillis;
-			tuningPwm = maxPwm;
-			tuningTargetTemp = targetTemp;
+			tuning->tempReadings[0] = temperature;
+			tuning->readingInterval = HeatSampleIntervalMillis;
+			tuning->pwm = maxPwm;
+			tuning->targetTemp = targetTemp;
 			reply.printf("Auto tuning heater %u using target temperature %.1f" DEGREE_SYMBOL "C and PWM %.2f - do not leave printer unattended",
 							GetHeaterNumber(), (double)targetTemp, (double)maxPwm);
 		}
@@ -570,33 +821,33 @@ void LocalHeater::GetAutoTuneStatus(const StringRef& reply) const
 void LocalHeater::DoTuningStep()
 {
 	// See if another sample is due
-	if (tuningReadingsTaken == 0)
+	if (tuning->readingsTaken == 0)
 	{
-		tuningPhaseStartTime = millis();
+		tuning->phaseStartTime = millis();
 		if (mode == HeaterMode::tuning0)
 		{
-			tuningBeginTime = tuningPhaseStartTime;
+			tuning->beginTime = tuning->phaseStartTime;
 		}
 	}
-	else if (millis() - tuningPhaseStartTime < tuningReadingsTaken * tuningReadingInterval)
+	else if (millis() - tuning->phaseStartTime < tuning->readingsTaken * tuning->readingInterval)
 	{
 		return;		// not due yet
 	}
 
 	// See if we have room to store the new reading, and if not, double the sample interval
-	if (tuningReadingsTaken == MaxTuningTempReadings)
+	if (tuning->readingsTaken == MaxTuningTempReadings)
 	{
 		// Double the sample interval
-		tuningReadingsTaken /= 2;
-		for (size_t i = 1; i < tuningReadingsTaken; ++i)
+		tuning->readingsTaken /= 2;
+		for (size_t i = 1; i < tuning->readingsTaken; ++i)
 		{
-			tuningTempReadings[i] = tuningTempReadings[i * 2];
+			tuning->tempReadings[i] = tuning->tempReadings[i * 2];
 		}
-		tuningReadingInterval *= 2;
+		tuning->readingInterval *= 2;
 	}
 
-	tuningTempReadings[tuningReadingsTaken] = temperature;
-	++tuningReadingsTaken;
+	tuning->tempReadings[tuning->readingsTaken] = temperature;
+	++tuning->readingsTaken;
 
 	switch(mode)
 	{
@@ -605,20 +856,20 @@ void LocalHeater::DoTuningStep()
 		if (ReadingsStable(6000/HeatSampleIntervalMillis, 2.0))			// expect temperature to be stable within a 2C band for 6 seconds
 		{
 			// Starting temperature is stable, so move on
-			tuningReadingsTaken = 1;
+			tuning->readingsTaken = 1;
 #if HAS_VOLTAGE_MONITOR
-			tuningVoltageAccumulator = 0.0;
-			voltageSamplesTaken = 0;
+			tuning->voltageAccumulator = 0.0;
+			tuning->voltageSamplesTaken = 0;
 #endif
-			tuningTempReadings[0] = tuningStartTemp = temperature;
-			timeSetHeating = tuningPhaseStartTime = millis();
-			lastPwm = tuningPwm;										// turn on heater at specified power
-			tuningReadingInterval = HeatSampleIntervalMillis;			// reset sampling interval
+			tuning->tempReadings[0] = tuning->startTemp = temperature;
+			timeSetHeating = tuning->phaseStartTime = millis();
+			lastPwm = tuning->pwm;										// turn on heater at specified power
+			tuning->readingInterval = HeatSampleIntervalMillis;			// reset sampling interval
 			mode = HeaterMode::tuning1;
 			Platform::Message(GenericMessage, "Auto tune phase 1, heater on\n");
 			return;
 		}
-		if (millis() - tuningPhaseStartTime < 20000)
+		if (millis() - tuning->phaseStartTime < 20000)
 		{
 			// Allow up to 20 seconds for starting temperature to settle
 			return;
@@ -630,9 +881,9 @@ void LocalHeater::DoTuningStep()
 		// Heating up
 		{
 			const bool isBedOrChamberHeater = Heat::IsBedOrChamberHeater(GetHeaterNumber());
-			const uint32_t heatingTime = millis() - tuningPhaseStartTime;
+			const uint32_t heatingTime = millis() - tuning->phaseStartTime;
 			const float extraTimeAllowed = (isBedOrChamberHeater) ? 60.0 : 30.0;
-			if (heatingTime > (uint32_t)((GetModel().GetDeadTime() + extraTimeAllowed) * SecondsToMillis) && (temperature - tuningStartTemp) < 3.0)
+			if (heatingTime > (uint32_t)((GetModel().GetDeadTime() + extraTimeAllowed) * SecondsToMillis) && (temperature - tuning->startTemp) < 3.0)
 			{
 				Platform::Message(GenericMessage, "Auto tune cancelled because temperature is not increasing\n");
 				break;
@@ -646,18 +897,18 @@ void LocalHeater::DoTuningStep()
 			}
 
 #if HAS_VOLTAGE_MONITOR
-			tuningVoltageAccumulator += Platform::GetCurrentVinVoltage();
-			++voltageSamplesTaken;
+			tuning->voltageAccumulator += Platform::GetCurrentVinVoltage();
+			++tuning->voltageSamplesTaken;
 #endif
-			if (temperature >= tuningTargetTemp)							// if reached target
+			if (temperature >= tuning->targetTemp)							// if reached target
 			{
-				tuningHeatingTime = heatingTime;
+				tuning->heatingTime = heatingTime;
 
 				// Move on to next phase
-				tuningReadingsTaken = 1;
-				tuningHeaterOffTemp = tuningTempReadings[0] = temperature;
-				tuningPhaseStartTime = millis();
-				tuningReadingInterval = HeatSampleIntervalMillis;			// reset sampling interval
+				tuning->readingsTaken = 1;
+				tuning->heaterOffTemp = tuning->tempReadings[0] = temperature;
+				tuning->phaseStartTime = millis();
+				tuning->readingInterval = HeatSampleIntervalMillis;			// reset sampling interval
 				mode = HeaterMode::tuning2;
 				lastPwm = 0.0;
 				SetHeater(0.0);
@@ -672,7 +923,7 @@ void LocalHeater::DoTuningStep()
 			const int peakIndex = GetPeakTempIndex();
 			if (peakIndex < 0)
 			{
-				if (millis() - tuningPhaseStartTime < 60 * 1000)			// allow 1 minute for the bed temperature reach peak temperature
+				if (millis() - tuning->phaseStartTime < 60 * 1000)			// allow 1 minute for the bed temperature reach peak temperature
 				{
 					return;			// still waiting for peak temperature
 				}
@@ -684,16 +935,16 @@ void LocalHeater::DoTuningStep()
 			}
 			else
 			{
-				tuningPeakTemperature = tuningTempReadings[peakIndex];
-				tuningPeakDelay = peakIndex * tuningReadingInterval;
+				tuning->peakTemperature = tuning->tempReadings[peakIndex];
+				tuning->peakDelay = peakIndex * tuning->readingInterval;
 
 				// Move on to next phase
-				tuningReadingsTaken = 1;
-				tuningTempReadings[0] = temperature;
-				tuningPhaseStartTime = millis();
-				tuningReadingInterval = HeatSampleIntervalMillis;			// reset sampling interval
+				tuning->readingsTaken = 1;
+				tuning->tempReadings[0] = temperature;
+				tuning->phaseStartTime = millis();
+				tuning->readingInterval = HeatSampleIntervalMillis;			// reset sampling interval
 				mode = HeaterMode::tuning3;
-				Platform::MessageF(GenericMessage, "Auto tune phase 3, peak temperature was %.1f\n", (double)tuningPeakTemperature);
+				Platform::MessageF(GenericMessage, "Auto tune phase 3, peak temperature was %.1f\n", (double)tuning->peakTemperature);
 				return;
 			}
 		}
@@ -705,7 +956,7 @@ void LocalHeater::DoTuningStep()
 			// In the case of a bed that shows a reservoir effect, the choice of how far we wait for it to cool down will effect the result.
 			// If we wait for it to cool down by 50% then we get a short time constant and a low gain, which causes overshoot. So try a bit more.
 			const float coolDownProportion = 0.6;
-			if (temperature > (tuningTempReadings[0] * (1.0 - coolDownProportion)) + (tuningStartTemp * coolDownProportion))
+			if (temperature > (tuning->tempReadings[0] * (1.0 - coolDownProportion)) + (tuning->startTemp * coolDownProportion))
 			{
 				return;
 			}
@@ -719,22 +970,22 @@ void LocalHeater::DoTuningStep()
 	}
 
 	// If we get here, we have finished
-	SwitchOff();								// sets mode and lastPWM, also deletes tuningTempReadings
+	SwitchOff();								// sets mode and lastPWM, also releases the tuning state
 }
 
 // Return true if the last 'numReadings' readings are stable
-/*static*/ bool LocalHeater::ReadingsStable(size_t numReadings, float maxDiff)
+bool LocalHeater::ReadingsStable(size_t numReadings, float maxDiff) const
 {
-	if (tuningTempReadings == nullptr || tuningReadingsTaken < numReadings)
+	if (tuning == nullptr || tuning->readingsTaken < numReadings)
 	{
 		return false;
 	}
 
-	float minReading = tuningTempReadings[tuningReadingsTaken - numReadings];
+	float minReading = tuning->tempReadings[tuning->readingsTaken - numReadings];
 	float maxReading = minReading;
-	for (size_t i = tuningReadingsTaken - numReadings + 1; i < tuningReadingsTaken; ++i)
+	for (size_t i = tuning->readingsTaken - numReadings + 1; i < tuning->readingsTaken; ++i)
 	{
-		const float t = tuningTempReadings[i];
+		const float t = tuning->tempReadings[i];
 		if (t < minReading) { minReading = t; }
 		if (t > maxReading) { maxReading = t; }
 	}
@@ -745,10 +996,10 @@ void LocalHeater::DoTuningStep()
 // Calculate which reading gave us the peak temperature.
 // Return -1 if peak not identified yet, 0 if we are never going to find a peak, else the index of the peak
 // If the readings show a continuous decrease then we return 1, because zero dead time would lead to infinities
-/*static*/ int LocalHeater::GetPeakTempIndex()
+int LocalHeater::GetPeakTempIndex() const
 {
 	// Check we have enough readings to look for the peak
-	if (tuningReadingsTaken < 15)
+	if (tuning->readingsTaken < 15)
 	{
 		return -1;							// too few readings
 	}
@@ -773,22 +1024,22 @@ void LocalHeater::DoTuningStep()
 	}
 
 	// If we have found one peak and it's not too near the end of the readings, return it
-	return ((size_t)peakIndex + 3 < tuningReadingsTaken) ? max<int>(peakIndex, 1) : -1;
+	return ((size_t)peakIndex + 3 < tuning->readingsTaken) ? max<int>(peakIndex, 1) : -1;
 }
 
 // See if there is exactly one peak in the readings.
 // Return -1 if more than one peak, else the index of the peak. The so-called peak may be right at the end, in which case it isn't really a peak.
 // With a well-insulated bed heater the temperature may not start dropping appreciably within the 120 second time limit allowed.
-/*static*/ int LocalHeater::IdentifyPeak(size_t numToAverage)
+int LocalHeater::IdentifyPeak(size_t numToAverage) const
 {
 	int firstPeakIndex = -1, lastSameIndex = -1;
 	float peakTempTimesN = -999.0;
-	for (size_t i = 0; i + numToAverage <= tuningReadingsTaken; ++i)
+	for (size_t i = 0; i + numToAverage <= tuning->readingsTaken; ++i)
 	{
 		float peak = 0.0;
 		for (size_t j = 0; j < numToAverage; ++j)
 		{
-			peak += tuningTempReadings[i + j];
+			peak += tuning->tempReadings[i + j];
 		}
 		if (peak > peakTempTimesN)
 		{
@@ -813,32 +1064,33 @@ void LocalHeater::DoTuningStep()
 // Calculate the heater model from the accumulated heater parameters
 void LocalHeater::CalculateModel()
 {
-	const float tc = (float)((tuningReadingsTaken - 1) * tuningReadingInterval)
-						/(1000.0 * logf((tuningTempReadings[0] - tuningStartTemp)/(tuningTempReadings[tuningReadingsTaken - 1] - tuningStartTemp)));
-	const float heatingTime = (tuningHeatingTime - tuningPeakDelay) * 0.001;
-	const float gain = (tuningHeaterOffTemp - tuningStartTemp)/(1.0 - expf(-heatingTime/tc));
+	const float tc = (float)((tuning->readingsTaken - 1) * tuning->readingInterval)
+						/(1000.0 * logf((tuning->tempReadings[0] - tuning->startTemp)/(tuning->tempReadings[tuning->readingsTaken - 1] - tuning->startTemp)));
+	const float heatingTime = (tuning->heatingTime - tuning->peakDelay) * 0.001;
+	const float gain = (tuning->heaterOffTemp - tuning->startTemp)/(1.0 - expf(-heatingTime/tc));
 
 	// There are two ways of calculating the dead time:
 	// 1. Based on the delay to peak temperature after we turned the heater off. Adding 0.5sec and then taking 65% of the result is about right.
 	// 2. Based on the peak temperature compared to the temperature at which we turned the heater off.
 	// Try #2 because it is easier to identify the peak temperature than the delay to peak temperature. It can be slightly to aggressive, so add 30%.
-	//const float td = (float)(tuningPeakDelay + 500) * 0.00065;		// take the dead time as 65% of the delay to peak rounded up to a half second
-	const float td = tc * logf((gain + tuningStartTemp - tuningHeaterOffTemp)/(gain + tuningStartTemp - tuningPeakTemperature)) * 1.3;
+	//const float td = (float)(tuning->peakDelay + 500) * 0.00065;		// take the dead time as 65% of the delay to peak rounded up to a half second
+	const float td = tc * logf((gain + tuning->startTemp - tuning->heaterOffTemp)/(gain + tuning->startTemp - tuning->peakTemperature)) * 1.3;
 
 	String<1> dummy;
-	const GCodeResult rslt = SetModel(gain, tc, td, tuningPwm,
+	const GCodeResult rslt = SetModel(gain, tc, td, tuning->pwm,
 #if HAS_VOLTAGE_MONITOR
-										tuningVoltageAccumulator/voltageSamplesTaken,
+										tuning->voltageAccumulator/tuning->voltageSamplesTaken,
 #else
 										0.0,
 #endif
 										true, false, dummy.GetRef());
 	if (rslt == GCodeResult::ok || rslt == GCodeResult::warning)
 	{
+		PersistentSettings::SaveHeaterModel(GetHeaterNumber(), GetModel());
 		Platform::MessageF(LoggedGenericMessage,
 				"Auto tune heater %u completed in %" PRIu32 " sec\n"
 				"Use M307 H%u to see the result, or M500 to save the result in config-override.g\n",
-				GetHeaterNumber(), (millis() - tuningBeginTime)/(uint32_t)SecondsToMillis, GetHeaterNumber());
+				GetHeaterNumber(), (millis() - tuning->beginTime)/(uint32_t)SecondsToMillis, GetHeaterNumber());
 	}
 	else
 	{
@@ -14,13 +14,15 @@
 
 #include "Heater.h"
 #include "FOPDT.h"
+#include "FopDtEstimator.h"
 #include "TemperatureError.h"
 #include "Hardware/IoPorts.h"
 #include "GCodes/GCodeResult.h"
 
 class LocalHeater : public Heater
 {
-	static const size_t NumPreviousTemperatures = 4; // How many samples we average the temperature derivative over
+	static const uint32_t DerivativeIntervalMillis = 1000;	// The time over which we average the temperature derivative, whatever the sample interval
+	static const size_t NumPreviousTemperatures = DerivativeIntervalMillis/MinHeatSampleIntervalMillis; // How many previous samples we need to store at the fastest sample rate
 
 public:
 	LocalHeater(unsigned int heaterNum);
@@ -29,12 +31,18 @@ public:
 	GCodeResult ConfigurePortAndSensor(const char *portName, PwmFrequency freq, unsigned int sensorNumber, const StringRef& reply) override;
 	GCodeResult SetPwmFrequency(PwmFrequency freq, const StringRef& reply) override;
 	GCodeResult ReportDetails(const StringRef& reply) const override;
+#if SUPPORT_REDUNDANT_HEATER_SENSORS
+	GCodeResult ConfigureSecondarySensor(unsigned int sensorNumber, SensorFusion fusion, float maxDisagreement, const StringRef& reply) override;
+#endif
 
-	void Spin() override;									// Called in a tight loop to keep things running
+	void Spin(uint32_t sampleInterval) override;			// Called every sampleInterval milliseconds to keep things running
+	void PollOutput() override;						// Called on every heater task cycle to generate the burst fire output
 	void SwitchOff() override;						// Not even standby - all heater power off
 	void ResetFault() override;						// Reset a fault condition - only call this if you know what you are doing
 	float GetTemperature() const override;			// Get the current temperature
 	float GetAveragePWM() const override;			// Return the running average PWM to the heater. Answer is a fraction in [0, 1].
+	float GetDemandedPwm() const override;			// Return the PWM that the control loop wants, before applying the power budget
+	float GetAppliedPwm() const override;			// Return the PWM that we are currently applying to the heater
 	float GetAccumulator() const override;			// Return the integral accumulator
 	void StartAutoTune(float targetTemp, float maxPwm, const StringRef& reply) override;	// Start an auto tune cycle for this PID
 	void GetAutoTuneStatus(const StringRef& reply) const override;	// Get the auto tune status or last result
@@ -47,51 +55,89 @@ protected:
 	GCodeResult UpdateModel(const StringRef& reply) noexcept override;	// Called when the heater model has been changed
 
 private:
-	void SetHeater(float power) const;				// Power is a fraction in [0,1]
+	void SetHeater(float power);					// Power is a fraction in [0,1]
+	bool IsBurstFire() const { return port.GetFrequency() == 0; }	// True if the heater is driven by whole mains cycles via a SSR instead of PWM
 	TemperatureError ReadTemperature();				// Read and store the temperature of this heater
+#if SUPPORT_REDUNDANT_HEATER_SENSORS
+	void FuseSecondaryReading(TemperatureError& err);	// Combine the reading of the secondary sensor with the one we just took from the primary sensor
+#endif
 	void DoTuningStep();							// Called on each temperature sample when auto tuning
-	static bool ReadingsStable(size_t numReadings, float maxDiff)
+	bool ReadingsStable(size_t numReadings, float maxDiff) const
 		pre(numReadings >= 2; numReadings <= MaxTuningTempReadings);
-	static int GetPeakTempIndex();					// Auto tune helper function
-	static int IdentifyPeak(size_t numToAverage);	// Auto tune helper function
+	int GetPeakTempIndex() const;					// Auto tune helper function
+	int IdentifyPeak(size_t numToAverage) const;	// Auto tune helper function
+	void ReleaseTuningState();						// Return the tuning state to the pool if we have one
 	void CalculateModel();							// Calculate G, td and tc from the accumulated readings
 	void DisplayBuffer(const char *intro);			// Debug helper
 	float GetExpectedHeatingRate() const;			// Get the minimum heating rate we expect
+	float GetVoltageCompensation() const;			// Get the factor by which the heater power is reduced because the supply voltage differs from the model voltage
+#if SUPPORT_HEATER_MODEL_ESTIMATION
+	void CheckModelDrift();							// Warn if the estimated process model has drifted from the configured one
+#endif
 
 	PwmPort port;									// The port that drives the heater
 	float temperature;								// The current temperature
 	float previousTemperatures[NumPreviousTemperatures]; // The temperatures of the previous NumDerivativeSamples measurements, used for calculating the derivative
+	uint32_t previousTemperatureTimes[NumPreviousTemperatures]; // The step clock times at which those temperatures were read
+	uint32_t whenTemperatureRead;					// The step clock time at which the current temperature was read
 	size_t previousTemperatureIndex;				// Which slot in previousTemperature we fill in next
 	float iAccumulator;								// The integral LocalHeater component
 	float lastPwm;									// The last PWM value we output, before scaling by kS
-	float averagePWM;								// The running average of the PWM, after scaling.
+	float appliedPwm;								// The last PWM value we output after applying the power limit
+	float appliedVoltageCompensation;				// The voltage compensation factor that was in force when we output appliedPwm
+	float burstFireDemand;							// The power we want from the burst fire output
+	float burstFireAccumulator;						// The sigma-delta error accumulator of the burst fire output
+	float averagePWM;								// The running average of the PWM as a fraction in [0, 1], after scaling.
 	uint32_t timeSetHeating;						// When we turned on the heater
 	uint32_t lastSampleTime;						// Time when the temperature was last sampled by Spin()
+#if SUPPORT_HEATER_MODEL_ESTIMATION
+	FopDtEstimator estimator;						// Refines the process model from the readings we take during normal operation
+#endif
 
 	uint16_t heatingFaultCount;						// Count of questionable heating behaviours
 
-	uint8_t previousTemperaturesGood;				// Bitmap indicating which previous temperature were good readings
+	uint32_t previousTemperaturesGood;				// Bitmap indicating which previous temperature were good readings
 	HeaterMode mode;								// Current state of the heater
 	bool tuned;										// True if tuning was successful
 	uint8_t badTemperatureCount;					// Count of sequential dud readings
+#if SUPPORT_HEATER_MODEL_ESTIMATION
+	bool modelDriftReported;						// True if we have warned that the estimated model differs from the configured one
+#endif
+#if SUPPORT_REDUNDANT_HEATER_SENSORS
+	int8_t secondarySensorNumber;					// The second sensor used by this heater, or -1 if it has only one
+	int8_t failedSensorNumber;						// The sensor that we are running without because its readings are bad, or -1 if both are good
+	SensorFusion sensorFusion;						// How we combine the readings of the two sensors
+	float maxSensorDisagreement;					// The largest difference between the two readings that we accept
+	uint32_t numSensorFailovers;					// How many times we started running on one sensor because the other one failed
+	uint32_t numSensorDisagreements;				// How many pairs of readings we rejected because they were too far apart
+#endif
 
 	static_assert(sizeof(previousTemperaturesGood) * 8 >= NumPreviousTemperatures, "too few bits in previousTemperaturesGood");
 
-	// Variables used during heater tuning
+	// Variables used during heater tuning. Each heater being tuned has its own set, so that several heaters can be tuned at the same time.
 	static const size_t MaxTuningTempReadings = 128; // The maximum number of readings we keep. Must be an even number.
 
-	static float *tuningTempReadings;				// the readings from the heater being tuned
-	static float tuningStartTemp;					// the temperature when we turned on the heater
-	static float tuningPwm;							// the PWM to use, 0..1
-	static float tuningTargetTemp;						// the maximum temperature we are allowed to reach
-	static uint32_t tuningBeginTime;				// when we started the tuning process
-	static uint32_t tuningPhaseStartTime;			// when we started the current tuning phase
-	static uint32_t tuningReadingInterval;			// how often we are sampling, in milliseconds
-	static size_t tuningReadingsTaken;				// how many temperature samples we have taken
-	static float tuningHeaterOffTemp;				// the temperature when we turned the heater off
-	static float tuningPeakTemperature;				// the peak temperature reached, averaged over 3 readings (so slightly less than the true peak)
-	static uint32_t tuningHeatingTime;				// how long we had the heating on for
-	static uint32_t tuningPeakDelay;				// how many milliseconds the temperature continues to rise after turning the heater off
+	struct TuningState
+	{
+		float tempReadings[MaxTuningTempReadings];	// the readings from the heater being tuned
+		float startTemp;							// the temperature when we turned on the heater
+		float pwm;									// the PWM to use, 0..1
+		float targetTemp;							// the maximum temperature we are allowed to reach
+		uint32_t beginTime;							// when we started the tuning process
+		uint32_t phaseStartTime;					// when we started the current tuning phase
+		uint32_t readingInterval;					// how often we are sampling, in milliseconds
+		size_t readingsTaken;						// how many temperature samples we have taken
+		float heaterOffTemp;						// the temperature when we turned the heater off
+		float peakTemperature;						// the peak temperature reached, averaged over 3 readings (so slightly less than the true peak)
+		uint32_t heatingTime;						// how long we had the heating on for
+		uint32_t peakDelay;							// how many milliseconds the temperature continues to rise after turning the heater off
+#if HAS_VOLTAGE_MONITOR
+		float voltageAccumulator;					// sum of the voltage readings we take during the heating phase
+		unsigned int voltageSamplesTaken;			// how many readings we accumulated
+#endif
+	};
+
+	TuningState *tuning;							// the tuning state, allocated from the tuning pool only while we are tuning this heater
 };
 
 #endif /* SRC_LOCALHEATER_H_ */
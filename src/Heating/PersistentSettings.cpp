@@ -0,0 +1,126 @@
+/*
+ * PersistentSettings.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "PersistentSettings.h"
+#include "FOPDT.h"
+#include <Hardware/EEPROM.h>
+#include <Hardware/NvmWriter.h>
+#include <SoftwareReset.h>
+
+namespace PersistentSettings
+{
+	constexpr uint8_t LayoutVersion = 1;						// increment this whenever the layout of the records changes
+
+	struct HeaterModelRecord
+	{
+		static constexpr uint16_t ValidMarker = 0x4800 | LayoutVersion;
+
+		uint16_t marker;
+		uint8_t flags;
+		uint8_t checksum;
+		float gain;
+		float timeConstant;
+		float deadTime;
+		float maxPwm;
+		float standardVoltage;
+
+		static constexpr uint8_t UsePidFlag = 0x01, InvertedFlag = 0x02;
+	};
+
+	struct ThermistorOffsetsRecord
+	{
+		static constexpr uint16_t ValidMarker = 0x5400 | LayoutVersion;
+
+		uint16_t marker;
+		int8_t lowOffset;
+		int8_t highOffset;
+	};
+
+	constexpr uint32_t HeaterModelsOffset = 0;
+	constexpr uint32_t ThermistorOffsetsOffset = HeaterModelsOffset + MaxHeaters * sizeof(HeaterModelRecord);
+	static_assert(sizeof(HeaterModelRecord) <= NvmWriter::MaxWriteLength, "Heater model record too long to queue");
+	static_assert(ThermistorOffsetsOffset + MaxSensors * sizeof(ThermistorOffsetsRecord) <= SoftwareResetDataEepromOffset, "Persistent settings overlap the software reset data in the EEPROM");
+
+	// The checksum makes the sum of the bytes of the floats and flags 0xFF, so that a record that was partly written isn't used
+	static uint8_t CalcChecksum(const HeaterModelRecord& rec)
+	{
+		const uint8_t *p = reinterpret_cast<const uint8_t*>(&rec.gain);
+		uint8_t sum = rec.flags;
+		for (size_t i = 0; i < 5 * sizeof(float); ++i)
+		{
+			sum += p[i];
+		}
+		return 0xFF - sum;
+	}
+}
+
+void PersistentSettings::SaveHeaterModel(unsigned int heater, const FopDt& model)
+{
+	if (heater < MaxHeaters)
+	{
+		HeaterModelRecord rec;
+		rec.marker = HeaterModelRecord::ValidMarker;
+		rec.flags = ((model.UsePid()) ? HeaterModelRecord::UsePidFlag : 0) | ((model.IsInverted()) ? HeaterModelRecord::InvertedFlag : 0);
+		rec.gain = model.GetGain();
+		rec.timeConstant = model.GetTimeConstant();
+		rec.deadTime = model.GetDeadTime();
+		rec.maxPwm = model.GetMaxPwm();
+		rec.standardVoltage = model.GetVoltage();
+		rec.checksum = CalcChecksum(rec);
+		(void)NvmWriter::QueueWrite(NvmArea::eeprom, HeaterModelsOffset + heater * sizeof(HeaterModelRecord), &rec, sizeof(rec));
+	}
+}
+
+bool PersistentSettings::LoadHeaterModel(unsigned int heater, HeaterModel& model)
+{
+	HeaterModelRecord rec;
+	if (   heater < MaxHeaters
+		&& EEPROM::Read(reinterpret_cast<char*>(&rec), HeaterModelsOffset + heater * sizeof(HeaterModelRecord), sizeof(rec))
+		&& rec.marker == HeaterModelRecord::ValidMarker
+		&& rec.checksum == CalcChecksum(rec)
+	   )
+	{
+		model.gain = rec.gain;
+		model.timeConstant = rec.timeConstant;
+		model.deadTime = rec.deadTime;
+		model.maxPwm = rec.maxPwm;
+		model.standardVoltage = rec.standardVoltage;
+		model.usePid = (rec.flags & HeaterModelRecord::UsePidFlag) != 0;
+		model.inverted = (rec.flags & HeaterModelRecord::InvertedFlag) != 0;
+		return true;
+	}
+	return false;
+}
+
+void PersistentSettings::SaveThermistorOffsets(unsigned int sensor, int8_t lowOffset, int8_t highOffset)
+{
+	if (sensor < MaxSensors)
+	{
+		ThermistorOffsetsRecord rec;
+		rec.marker = ThermistorOffsetsRecord::ValidMarker;
+		rec.lowOffset = lowOffset;
+		rec.highOffset = highOffset;
+		(void)NvmWriter::QueueWrite(NvmArea::eeprom, ThermistorOffsetsOffset + sensor * sizeof(ThermistorOffsetsRecord), &rec, sizeof(rec));
+	}
+}
+
+bool PersistentSettings::LoadThermistorOffsets(unsigned int sensor, int8_t& lowOffset, int8_t& highOffset)
+{
+	ThermistorOffsetsRecord rec;
+	if (   sensor < MaxSensors
+		&& EEPROM::Read(reinterpret_cast<char*>(&rec), ThermistorOffsetsOffset + sensor * sizeof(ThermistorOffsetsRecord), sizeof(rec))
+		&& rec.marker == ThermistorOffsetsRecord::ValidMarker
+	   )
+	{
+		lowOffset = rec.lowOffset;
+		highOffset = rec.highOffset;
+		return true;
+	}
+	return false;
+}
+
+// End
@@ -0,0 +1,38 @@
+/*
+ * PersistentSettings.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  Heater models and thermistor ADC offsets that we keep in EEPROM, so that a board is well tuned as soon as its heaters and sensors are created,
+ *  without waiting for the main board to send the parameters. Each record carries a marker that includes the layout version and a checksum,
+ *  so records written by other firmware versions or never written are ignored. Writes go through the NvmWriter queue, so they wait until no moves are running.
+ */
+
+#ifndef SRC_HEATING_PERSISTENTSETTINGS_H_
+#define SRC_HEATING_PERSISTENTSETTINGS_H_
+
+#include "RepRapFirmware.h"
+
+class FopDt;
+
+namespace PersistentSettings
+{
+	struct HeaterModel
+	{
+		float gain;
+		float timeConstant;
+		float deadTime;
+		float maxPwm;
+		float standardVoltage;
+		bool usePid;
+		bool inverted;
+	};
+
+	void SaveHeaterModel(unsigned int heater, const FopDt& model);
+	bool LoadHeaterModel(unsigned int heater, HeaterModel& model);
+	void SaveThermistorOffsets(unsigned int sensor, int8_t lowOffset, int8_t highOffset);
+	bool LoadThermistorOffsets(unsigned int sensor, int8_t& lowOffset, int8_t& highOffset);
+}
+
+#endif /* SRC_HEATING_PERSISTENTSETTINGS_H_ */
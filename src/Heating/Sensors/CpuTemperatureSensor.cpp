@@ -7,13 +7,27 @@
 
 #include "CpuTemperatureSensor.h"
 #include "Platform.h"
+#include "CanMessageGenericParser.h"
 
 #if HAS_CPU_TEMP_SENSOR
 
-CpuTemperatureSensor::CpuTemperatureSensor(unsigned int sensorNum) : TemperatureSensor(sensorNum, "MCU embedded temperature sensor")
+CpuTemperatureSensor::CpuTemperatureSensor(unsigned int sensorNum)
+	: TemperatureSensor(sensorNum, "MCU embedded temperature sensor"), pollInterval(HeatSampleIntervalMillis)
 {
 }
 
+GCodeResult CpuTemperatureSensor::Configure(const CanMessageGenericParser& parser, const StringRef& reply)
+{
+	if (!GetPollIntervalParam(parser, pollInterval) && !parser.HasParameter('Y'))
+	{
+		float minT, currentT, maxT;
+		Platform::GetMcuTemperatures(minT, currentT, maxT);
+		CopyBasicDetails(reply);
+		reply.catf(", min %.1f max %.1f, interval %" PRIu32 "ms", (double)minT, (double)maxT, pollInterval);
+	}
+	return GCodeResult::ok;
+}
+
 void CpuTemperatureSensor::Poll()
 {
 	float minT, currentT, maxT;
@@ -17,9 +17,15 @@ class CpuTemperatureSensor : public TemperatureSensor
 public:
 	CpuTemperatureSensor(unsigned int sensorNum);
 
+	GCodeResult Configure(const CanMessageGenericParser& parser, const StringRef& reply) override;
+
 	static constexpr const char *TypeName = "mcutemp";
 
 	void Poll() override;
+	uint32_t GetPollInterval() const override { return pollInterval; }
+
+private:
+	uint32_t pollInterval;
 };
 
 #endif
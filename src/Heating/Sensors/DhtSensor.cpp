@@ -10,67 +10,66 @@
 #if SUPPORT_DHT_SENSOR
 
 #include "Movement/StepTimer.h"
-#include "Hardware/IoPorts.h"
-#include "Hardware/Peripherals.h"		// for delayMicroseconds
-#include "Hardware/Interrupts.h"
-#include "CanMessageFormats.h"
+#include "CanMessageGenericParser.h"
 
-constexpr uint32_t MinimumReadInterval = 2000;		// ms
 constexpr uint32_t MaximumReadTime = 20;			// ms
 constexpr uint32_t MinimumOneBitLength = 50;		// microseconds
 constexpr uint32_t MinimumOneBitStepClocks = (StepTimer::StepClockRate * MinimumOneBitLength)/1000000;
 
-# include "Tasks.h"
+// The readings take more than one poll, so make sure that the sensor has finished sending before we look at them
+static_assert(MaximumReadTime <= MinHeatSampleIntervalMillis, "DHT readings must complete within one poll interval");
 
-// Static data members of class DhtSensorHardwareInterface
-Mutex DhtSensorHardwareInterface::dhtMutex;
-Task<DhtSensorHardwareInterface::DhtTaskStackWords> *DhtSensorHardwareInterface::dhtTask = nullptr;
-DhtSensorHardwareInterface *DhtSensorHardwareInterface::activeSensors[MaxSpiTempSensors] = { 0 };
+// Static data members of class DhtTemperatureSensor
+DhtTemperatureSensor *DhtTemperatureSensor::activeSensors = nullptr;
 
-extern "C" [[noreturn]] void DhtTaskStart(void * pvParameters)
-{
-	DhtSensorHardwareInterface::SensorTask();
-}
-
-// Pulse ISR
-extern "C" void DhtDataTransition(CallbackParameter cp)
+// Class DhtTemperatureSensor members
+DhtTemperatureSensor::DhtTemperatureSensor(unsigned int sensorNum)
+	: SensorWithPort(sensorNum, "DHT temperature"), whenLastReadingStarted(0),
+	  lastTemperature(BadErrorTemperature), lastHumidity(BadErrorTemperature), lastReadingResult(TemperatureError::notInitialised),
+	  badTemperatureCount(0), type(DhtSensorType::none), state(ReadingState::idle)
 {
-	static_cast<DhtSensorHardwareInterface*>(cp.vp)->Interrupt();
+	next = activeSensors;
+	activeSensors = this;
 }
 
-DhtSensorHardwareInterface::DhtSensorHardwareInterface(Pin p_pin)
-	: sensorPin(p_pin), type(DhtSensorType::none), lastResult(TemperatureError::notInitialised),
-	  lastTemperature(BadErrorTemperature), lastHumidity(BadErrorTemperature), badTemperatureCount(0)
+DhtTemperatureSensor::~DhtTemperatureSensor()
 {
-	IoPort::SetPinMode(sensorPin, INPUT_PULLUP);
+	port.DetachInterrupt();
+	for (DhtTemperatureSensor **pp = &activeSensors; *pp != nullptr; pp = &(*pp)->next)
+	{
+		if (*pp == this)
+		{
+			*pp = next;
+			break;
+		}
+	}
 }
 
-TemperatureError DhtSensorHardwareInterface::GetTemperatureOrHumidity(float& t, bool wantHumidity) const
+/*static*/ const DhtTemperatureSensor *DhtTemperatureSensor::Find(unsigned int sensorNum)
 {
-	t = (wantHumidity) ? lastHumidity : lastTemperature;
-	return lastResult;
+	for (const DhtTemperatureSensor *s = activeSensors; s != nullptr; s = s->next)
+	{
+		if (s->GetSensorNumber() == sensorNum)
+		{
+			return s;
+		}
+	}
+	return nullptr;
 }
 
-/*static*/ GCodeResult DhtSensorHardwareInterface::Configure(TemperatureSensor *ts, unsigned int relativeChannel, unsigned int heater, const CanMessageM305& msg, const StringRef& reply)
+GCodeResult DhtTemperatureSensor::Configure(const CanMessageGenericParser& parser, const StringRef& reply)
 {
-	MutexLocker lock(dhtMutex);
-
-	if (relativeChannel >= MaxSpiTempSensors || activeSensors[relativeChannel] == nullptr)
+	bool seen = false;
+	if (!ConfigurePort(parser, reply, PinAccess::read, seen))
 	{
-		reply.copy("invalid channel");
 		return GCodeResult::error;
 	}
 
-	return activeSensors[relativeChannel]->ConfigureType(msg, reply);
-}
-
-GCodeResult DhtSensorHardwareInterface::ConfigureType(const CanMessageM305& msg, const StringRef& reply)
-{
-	GCodeResult rslt = GCodeResult::ok;
-	if (msg.GotParamT())
+	float dhtType;
+	if (parser.GetFloatParam('T', dhtType))
 	{
-		const int dhtType = msg.paramT;
-		switch (dhtType)
+		seen = true;
+		switch (lrintf(dhtType))
 		{
 		case 11:
 			type = DhtSensorType::Dht11;
@@ -83,67 +82,44 @@ GCodeResult DhtSensorHardwareInterface::ConfigureType(const CanMessageM305& msg,
 			break;
 		default:
 			reply.copy("Invalid DHT sensor type");
-			rslt = GCodeResult::error;
-			break;
+			return GCodeResult::error;
 		}
 	}
-	return rslt;
-}
 
-// Create a hardware interface object for the specified channel if there isn't already
-DhtSensorHardwareInterface *DhtSensorHardwareInterface::Create(unsigned int relativeChannel)
-{
-	if (relativeChannel >= MaxSpiTempSensors)
-	{
-		return nullptr;
-	}
-
-	MutexLocker lock(dhtMutex);
-
-	if (activeSensors[relativeChannel] == nullptr)
+	if (seen)
 	{
-		activeSensors[relativeChannel] = new DhtSensorHardwareInterface(SpiCSPins[relativeChannel]);
+		port.DetachInterrupt();
+		IoPort::SetPinMode(port.GetPin(), INPUT_PULLUP);
+		state = ReadingState::idle;
+		badTemperatureCount = 0;
+		lastReadingResult = TemperatureError::notInitialised;
 	}
-
-	if (dhtTask == nullptr)
+	else
 	{
-		dhtTask = new Task<DhtTaskStackWords>;
-		dhtTask->Create(DhtTaskStart, "DHTSENSOR", nullptr, TaskPriority::DhtPriority);
+		CopyBasicDetails(reply);
+		reply.catf(", DHT type %s", (type == DhtSensorType::Dht11) ? "11" : (type == DhtSensorType::Dht21) ? "21" : (type == DhtSensorType::Dht22) ? "22" : "not set");
 	}
-
-	return activeSensors[relativeChannel];
+	return GCodeResult::ok;
 }
 
-/*static*/ void DhtSensorHardwareInterface::InitStatic()
+TemperatureError DhtTemperatureSensor::GetHumidity(float& h) const
 {
-	dhtMutex.Create("DHT");
+	h = lastHumidity;
+	return lastReadingResult;
 }
 
-/*static*/ TemperatureError DhtSensorHardwareInterface::GetTemperatureOrHumidity(unsigned int relativeChannel, float& t, bool wantHumidity)
+/*static*/ void DhtTemperatureSensor::DataTransitionInterrupt(CallbackParameter cp)
 {
-	if (relativeChannel >= MaxSpiTempSensors)
-	{
-		t = BadErrorTemperature;
-		return TemperatureError::unknownChannel;
-	}
-
-	MutexLocker lock(dhtMutex);
-
-	if (activeSensors[relativeChannel] == nullptr)
-	{
-		t = BadErrorTemperature;
-		return TemperatureError::notInitialised;
-	}
-
-	return activeSensors[relativeChannel]->GetTemperatureOrHumidity(t, wantHumidity);
+	static_cast<DhtTemperatureSensor*>(cp.vp)->Interrupt();
 }
 
-void DhtSensorHardwareInterface::Interrupt()
+// Pulse ISR
+void DhtTemperatureSensor::Interrupt()
 {
 	if (numPulses < ARRAY_SIZE(pulses))
 	{
 		const uint32_t now = StepTimer::GetInterruptClocks();
-		if (IoPort::ReadPin(sensorPin))
+		if (port.Read())
 		{
 			lastPulseTime = now;
 		}
@@ -154,84 +130,97 @@ void DhtSensorHardwareInterface::Interrupt()
 	}
 }
 
-void DhtSensorHardwareInterface::TakeReading()
+// Each reading is spread over several polls so that we never block the Heat task for long:
+// 1. Send the start signal. For the DHT21 and DHT22 it is short enough to send immediately; for the DHT11 we leave the line low until the next poll.
+// 2. Release the line and have the ISR time the pulses. The sensor sends its data in typically 4 to 5ms.
+// 3. On the next poll, decode the pulses.
+void DhtTemperatureSensor::Poll()
 {
-	if (type != DhtSensorType::none)			// if sensor has been configured
+	switch (state)
 	{
-		// Send the start bit. This must be at least 18ms for the DHT11, 0.8ms for the DHT21, and 1ms long for the DHT22.
-		IoPort::SetPinMode(sensorPin, OUTPUT_LOW);
-		delay(20);
-
+	case ReadingState::idle:
+		if (type != DhtSensorType::none && millis() - whenLastReadingStarted >= MinimumReadInterval)
 		{
-			TaskCriticalSectionLocker lock;		// make sure the Heat task doesn't interrupt the sequence
-
-			// End the start signal by setting data line high. the sensor will respond with the start bit in 20 to 40us.
-			// We need only force the data line high long enough to charge the line capacitance, after that the pullup resistor keeps it high.
-			IoPort::WriteDigital(sensorPin, true);		// this will generate an interrupt, but we will ignore it
-			delayMicroseconds(3);
-
-			// Now start reading the data line to get the value from the DHT sensor
-			IoPort::SetPinMode(sensorPin, INPUT_PULLUP);
-
-			// It appears that switching the pin to an output disables the interrupt, so we need to call attachInterrupt here
-			// We are likely to get an immediate interrupt at this point corresponding to the low-to-high transition. We must ignore this.
-			numPulses = ARRAY_SIZE(pulses);		// tell the ISR not to collect data yet
-			AttachInterrupt(sensorPin, DhtDataTransition, InterruptMode::change, this);
-			lastPulseTime = 0;
-			numPulses = 0;						// tell the ISR to collect data
+			whenLastReadingStarted = millis();
+			IoPort::SetPinMode(port.GetPin(), OUTPUT_LOW);
+			if (type == DhtSensorType::Dht11)
+			{
+				state = ReadingState::sendingStartSignal;
+			}
+			else
+			{
+				delayMicroseconds(Dht2xStartSignalMicroseconds);
+				StartReceiving();
+			}
 		}
+		break;
 
-		// Wait for the incoming signal to be read by the ISR (1 start bit + 40 data bits), or until timeout.
-		// We don't have the ISR wake the process up, because that would require the priority of the pin change interrupt to be reduced.
-		// So we just delay for long enough for the data to have been sent. It takes typically 4 to 5ms.
-		delay(MaximumReadTime);
+	case ReadingState::sendingStartSignal:
+		StartReceiving();
+		break;
 
-		DetachInterrupt(sensorPin);
-
-		// Attempt to convert the signal into temp+RH values
-		const TemperatureError rslt = ProcessReadings();
-		if (rslt == TemperatureError::success)
-		{
-			lastResult = rslt;
-			badTemperatureCount = 0;
-		}
-		else if (badTemperatureCount < MaxBadTemperatureCount)
-		{
-			badTemperatureCount++;
-		}
-		else
-		{
-			lastResult = rslt;
-			lastTemperature = BadErrorTemperature;
-			lastHumidity = BadErrorTemperature;
-		}
+	case ReadingState::receiving:
+		FinishReading();
+		break;
 	}
+
+	// Readings are taken less often than we are polled, so keep reporting the last one
+	SetResult(lastTemperature, lastReadingResult);
 }
 
-// Code executed by the DHT sensor task.
-// This is run at the same priority as the Heat task, so it must not sit in any spin loops.
-/*static*/ [[noreturn]] void DhtSensorHardwareInterface::SensorTask()
+void DhtTemperatureSensor::StartReceiving()
 {
-	for (;;)
 	{
-		for (DhtSensorHardwareInterface *&sensor : activeSensors)
-		{
-			{
-				MutexLocker lock(dhtMutex);
+		AtomicCriticalSectionLocker lock;		// the timing of this sequence is critical
 
-				if (sensor != nullptr)
-				{
-					sensor->TakeReading();
-				}
-			}
-			delay(MinimumReadInterval/MaxSpiTempSensors);
-		}
+		// End the start signal by setting data line high. the sensor will respond with the start bit in 20 to 40us.
+		// We need only force the data line high long enough to charge the line capacitance, after that the pullup resistor keeps it high.
+		IoPort::WriteDigital(port.GetPin(), true);
+		delayMicroseconds(3);
+
+		// Now start reading the data line to get the value from the DHT sensor
+		IoPort::SetPinMode(port.GetPin(), INPUT_PULLUP);
+	}
+
+	// It appears that switching the pin to an output disables the interrupt, so we need to attach it here.
+	// We are likely to get an immediate interrupt at this point corresponding to the low-to-high transition. We must ignore this.
+	numPulses = ARRAY_SIZE(pulses);		// tell the ISR not to collect data yet
+	port.AttachInterrupt(DataTransitionInterrupt, InterruptMode::change, this);
+	lastPulseTime = 0;
+	numPulses = 0;						// tell the ISR to collect data
+	state = ReadingState::receiving;
+}
+
+void DhtTemperatureSensor::FinishReading()
+{
+	port.DetachInterrupt();
+	state = ReadingState::idle;
+
+	// Attempt to convert the signal into temp+RH values
+	float t, h;
+	const TemperatureError rslt = ProcessReadings(t, h);
+	if (rslt == TemperatureError::success)
+	{
+		lastTemperature = t;
+		lastHumidity = h;
+		lastReadingResult = rslt;
+		badTemperatureCount = 0;
+	}
+	else if (badTemperatureCount < MaxBadTemperatureCount)
+	{
+		badTemperatureCount++;
+	}
+	else
+	{
+		lastReadingResult = rslt;
+		lastTemperature = BadErrorTemperature;
+		lastHumidity = BadErrorTemperature;
 	}
 }
 
-// Process a reading. If success then update the temperature and humidity and return TemperatureError::success.
-// Else return the TemperatureError code but do not update the readings.
-TemperatureError DhtSensorHardwareInterface::ProcessReadings()
+// Process a reading. If success then return the temperature and humidity and TemperatureError::success.
+// Else return the TemperatureError code and leave t and h undefined.
+TemperatureError DhtTemperatureSensor::ProcessReadings(float& t, float& h) const
 {
 	// Check enough bits received and check start bit
 	if (numPulses != ARRAY_SIZE(pulses) || pulses[0] < MinimumOneBitStepClocks)
@@ -265,17 +254,17 @@ TemperatureError DhtSensorHardwareInterface::ProcessReadings()
 	switch (type)
 	{
 	case DhtSensorType::Dht11:
-		lastHumidity = data[0];
-		lastTemperature = data[2];
+		h = data[0];
+		t = data[2];
 		return TemperatureError::success;
 
 	case DhtSensorType::Dht21:
 	case DhtSensorType::Dht22:
-		lastHumidity = ((data[0] * 256) + data[1]) * 0.1;
-		lastTemperature = (((data[2] & 0x7F) * 256) + data[3]) * 0.1;
+		h = ((data[0] * 256) + data[1]) * 0.1;
+		t = (((data[2] & 0x7F) * 256) + data[3]) * 0.1;
 		if (data[2] & 0x80)
 		{
-			lastTemperature *= -1.0;
+			t *= -1.0;
 		}
 		return TemperatureError::success;
 
@@ -284,54 +273,63 @@ TemperatureError DhtSensorHardwareInterface::ProcessReadings()
 	}
 }
 
-// Class DhtTemperatureSensor members
-DhtTemperatureSensor::DhtTemperatureSensor(unsigned int channel) : TemperatureSensor(channel)
-{
-}
-
-void DhtTemperatureSensor::Init()
-{
-	DhtSensorHardwareInterface::Create();
-}
-
-GCodeResult DhtTemperatureSensor::Configure(unsigned int heater, const CanMessageM305& msg, const StringRef& reply)
-{
-	return DhtSensorHardwareInterface::Configure(this, heater, msg, reply);
-}
-
-DhtTemperatureSensor::~DhtTemperatureSensor()
-{
-	// We don't delete the hardware interface object because the humidity channel may still be using it
-}
-
-TemperatureError DhtTemperatureSensor::TryGetTemperature(float& t)
-{
-	return DhtSensorHardwareInterface::GetTemperatureOrHumidity(t, false);
-}
-
 // Class DhtHumiditySensor members
-DhtHumiditySensor::DhtHumiditySensor(unsigned int channel) : TemperatureSensor(channel)
+DhtHumiditySensor::DhtHumiditySensor(unsigned int sensorNum)
+	: TemperatureSensor(sensorNum, "DHT humidity"), temperatureSensorNumber(MaxSensors)
 {
 }
 
-void DhtHumiditySensor::Init()
+// The P parameter is the number of the DHT temperature sensor that takes the readings, optionally preceded by 'S'
+GCodeResult DhtHumiditySensor::Configure(const CanMessageGenericParser& parser, const StringRef& reply)
 {
-	DhtSensorHardwareInterface::Create();
-}
-
-GCodeResult DhtHumiditySensor::Configure(unsigned int heater, const CanMessageM305& msg, const StringRef& reply)
-{
-	return DhtSensorHardwareInterface::Configure(this, heater, msg, reply);
-}
-
-DhtHumiditySensor::~DhtHumiditySensor()
-{
-	// We don't delete the hardware interface object because the temperature channel may still be using it
+	String<StringLength20> sensorName;
+	if (parser.GetStringParam('P', sensorName.GetRef()))
+	{
+		const char *p = sensorName.c_str();
+		if (*p == 'S' || *p == 's')
+		{
+			++p;
+		}
+		const char * const start = p;
+		unsigned int sn = 0;
+		while (isdigit(*p) && sn < MaxSensors)
+		{
+			sn = (sn * 10) + (unsigned int)(*p - '0');
+			++p;
+		}
+		if (p == start || *p != 0 || sn >= MaxSensors)
+		{
+			reply.copy("Bad DHT temperature sensor number");
+			return GCodeResult::error;
+		}
+		temperatureSensorNumber = sn;
+	}
+	else if (temperatureSensorNumber >= MaxSensors)
+	{
+		reply.copy("Missing DHT temperature sensor number");
+		return GCodeResult::error;
+	}
+	else
+	{
+		CopyBasicDetails(reply);
+		reply.catf(", using readings from sensor %u", temperatureSensorNumber);
+	}
+	return GCodeResult::ok;
 }
 
-TemperatureError DhtHumiditySensor::TryGetTemperature(float& t)
+void DhtHumiditySensor::Poll()
 {
-	return DhtSensorHardwareInterface::GetTemperatureOrHumidity(t, true);
+	const DhtTemperatureSensor * const ts = DhtTemperatureSensor::Find(temperatureSensorNumber);
+	if (ts == nullptr)
+	{
+		SetResult(TemperatureError::notInitialised);
+	}
+	else
+	{
+		float h;
+		const TemperatureError rslt = ts->GetHumidity(h);
+		SetResult(h, rslt);
+	}
 }
 
 #endif
@@ -12,14 +12,9 @@
 
 #if SUPPORT_DHT_SENSOR
 
-#ifndef RTOS
-# error DHT sensors are only supported in RTOS builds
-#endif
-
-# include "TemperatureSensor.h"
-# include "RTOSIface/RTOSIface.h"
+#include "SensorWithPort.h"
 
-enum class DhtSensorType
+enum class DhtSensorType : uint8_t
 {
 	none,
 	Dht11,
@@ -27,70 +22,71 @@ enum class DhtSensorType
 	Dht22
 };
 
-// This class represents a DHT sensor attached to a particular SPI CS pin
-class DhtSensorHardwareInterface
+// This class represents a DHT temperature sensor. It owns the port and takes the readings, which also provide the humidity.
+// There is no separate task: each reading is a sequence of steps performed on successive polls from the Heat task, so the only interrupts are the data line transitions during the 5ms or so that the sensor takes to send its data.
+class DhtTemperatureSensor : public SensorWithPort
 {
 public:
-	static GCodeResult Configure(TemperatureSensor *ts, unsigned int relativeChannel, unsigned int heater, const CanMessageM305& msg, const StringRef& reply);
-	void Interrupt();
+	DhtTemperatureSensor(unsigned int sensorNum);
+	~DhtTemperatureSensor();
+
+	GCodeResult Configure(const CanMessageGenericParser& parser, const StringRef& reply) override;
+	void Poll() override;
+	uint32_t GetPollInterval() const override { return MinHeatSampleIntervalMillis; }
 
-	static DhtSensorHardwareInterface *Create(unsigned int relativeChannel);
-	static TemperatureError GetTemperatureOrHumidity(unsigned int relativeChannel, float& t, bool wantHumidity);
-	static void InitStatic();
-	static void SensorTask();
+	// Get the humidity from the most recent reading. The caller must hold a read lock on the sensors.
+	TemperatureError GetHumidity(float& h) const;
+
+	// Find the DHT temperature sensor with the specified sensor number. The caller must hold a read lock on the sensors.
+	static const DhtTemperatureSensor *Find(unsigned int sensorNum);
+
+	static constexpr const char *TypeName = "dhttemp";
 
 private:
-	DhtSensorHardwareInterface(Pin p_pin);
+	enum class ReadingState : uint8_t
+	{
+		idle,						// waiting until it is time to take the next reading
+		sendingStartSignal,			// holding the data line low to request a reading
+		receiving					// the ISR is collecting the pulses
+	};
+
+	static void DataTransitionInterrupt(CallbackParameter cp);
+	void Interrupt();
+	void StartReceiving();
+	void FinishReading();
+	TemperatureError ProcessReadings(float& t, float& h) const;
 
-	GCodeResult ConfigureType(const CanMessageM305& msg, const StringRef& reply);
-	TemperatureError GetTemperatureOrHumidity(float& t, bool wantHumidity) const;
-	void TakeReading();
-	TemperatureError ProcessReadings();
+	static constexpr uint32_t MinimumReadInterval = 2000;		// ms
+	static constexpr uint32_t Dht2xStartSignalMicroseconds = 1000;	// the DHT21 and DHT22 need at least 0.8ms and 1ms, and at most 20ms. The DHT11 needs at least 18ms, which we get by holding the line low until the next poll.
 
-	static constexpr unsigned int DhtTaskStackWords = 100;		// task stack size in dwords. 80 was not enough. Use 300 if debugging is enabled.
-	static Mutex dhtMutex;
-	static Task<DhtTaskStackWords> *dhtTask;
-	static DhtSensorHardwareInterface *activeSensors[MaxSpiTempSensors];
+	static DhtTemperatureSensor *activeSensors;					// linked list of DHT temperature sensors, modified only while the sensors are write-locked
 
-	Pin sensorPin;
-	DhtSensorType type;
-	TemperatureError lastResult;
+	DhtTemperatureSensor *next;
+	uint32_t whenLastReadingStarted;
 	float lastTemperature, lastHumidity;
-	size_t badTemperatureCount;
+	TemperatureError lastReadingResult;
+	uint8_t badTemperatureCount;
+	DhtSensorType type;
+	ReadingState state;
 
 	volatile uint32_t lastPulseTime;
 	volatile size_t numPulses;
 	uint16_t pulses[41];			// 1 start bit + 40 data bits
 };
 
-// This class represents a DHT temperature sensor
-class DhtTemperatureSensor : public TemperatureSensor
-{
-public:
-	DhtTemperatureSensor(unsigned int sensorNum);
-	~DhtTemperatureSensor();
-
-	GCodeResult Configure(unsigned int heater, const CanMessageM305& msg, const StringRef& reply) override;
-	void Init() override;
-
-	static constexpr const char *TypeName = "dhttemp";
-
-	TemperatureError Poll() override;
-};
-
-// This class represents a DHT humidity sensor
+// This class represents a DHT humidity sensor. It reports the humidity from the readings taken by a DHT temperature sensor.
 class DhtHumiditySensor : public TemperatureSensor
 {
 public:
 	DhtHumiditySensor(unsigned int sensorNum);
-	~DhtHumiditySensor();
 
-	GCodeResult Configure(unsigned int heater, const CanMessageM305& msg, const StringRef& reply) override;
-	void Init() override;
+	GCodeResult Configure(const CanMessageGenericParser& parser, const StringRef& reply) override;
+	void Poll() override;
 
 	static constexpr const char *TypeName = "dhthumidity";
 
-	TemperatureError Poll() override;
+private:
+	unsigned int temperatureSensorNumber;
 };
 
 #endif
@@ -36,37 +36,58 @@ GCodeResult LinearAnalogSensor::Configure(const CanMessageGenericParser& parser,
 		seen = true;
 	}
 
+#ifdef SAMC21
+	if (!ConfigureSdAdc(parser, reply, seen))
+	{
+		return GCodeResult::error;
+	}
+#endif
+
 	if (seen)
 	{
 		CalcDerivedParameters();
-		if (adcFilterChannel >= 0)
+		adcFilterChannel = Platform::GetAveragingFilterIndex(port);
+		if (adcFilterChannel < 0)
 		{
-			Platform::GetAdcFilter(adcFilterChannel)->Init(0);
+			reply.copy("Port is not a temperature sensor input");
+			return GCodeResult::error;
 		}
+		Platform::GetAdcFilter(adcFilterChannel)->Init(0);
 	}
 	else
 	{
 		CopyBasicDetails(reply);
 		reply.catf(", %sfiltered, range %.1f to %.1f", (filtered) ? "" : "un", (double)lowTemp, (double)highTemp);
+#ifdef SAMC21
+		AppendSdAdcDetails(reply);
+#endif
 	}
 	return GCodeResult::ok;
 }
 
 void LinearAnalogSensor::Poll()
 {
-	const volatile ThermistorAveragingFilter *tempFilter = Platform::GetAdcFilter(thermistorInputChannel);
+	if (adcFilterChannel < 0)
+	{
+		SetResult(TemperatureError::notInitialised);
+		return;
+	}
+
+	const volatile ThermistorAveragingFilter *tempFilter = Platform::GetAdcFilter(adcFilterChannel);
 	int32_t tempReading;
 	if (filtered)
 	{
-		if (!tempFilter->IsValid())
+		uint32_t tempSum;
+		if (!tempFilter->GetSnapshot(tempSum))
 		{
 			SetResult(TemperatureError::notReady);
+			return;
 		}
-		tempReading = tempFilter->GetSum()/(tempFilter->NumAveraged() >> AdcOversampleBits);
+		tempReading = tempSum/(tempFilter->NumAveraged() >> AdcOversampleBits);
 	}
 	else
 	{
-		tempReading = tempFilter->GetLastReading() << AdcOversampleBits;
+		tempReading = tempFilter->GetLastReading();
 	}
 
 	SetResult((tempReading * linearIncreasePerCount) + lowTemp, TemperatureError::success);
@@ -9,7 +9,9 @@
 #define SRC_HEATING_SENSORS_LINEARANALOGSENSOR_H_
 
 #include "SensorWithPort.h"
+#include <Hardware/AnalogIn.h>
 
+// On the SAMC21 the sensor can use the 16-bit SDADC instead of the ADC by prefixing the port name with '*'. This gives higher resolution for 4-20mA transmitters and other process sensors.
 class LinearAnalogSensor : public SensorWithPort
 {
 public:
@@ -20,12 +22,12 @@ public:
 	static constexpr const char *TypeName = "linearanalog";
 
 	void Poll() override;
+	uint32_t GetPollInterval() const override { return MinHeatSampleIntervalMillis; }
 
 private:
 	void CalcDerivedParameters();
 
 	// Configurable parameters
-	unsigned int thermistorInputChannel;
 	float lowTemp, highTemp;
 	bool filtered;
 
@@ -37,10 +39,9 @@ private:
 	static constexpr float DefaultHighTemp = 100.0;
 
 	// ADC resolution
-	static constexpr unsigned int AdcBits = 12;										// the ADCs in the SAM processors are 12-bit
-	static constexpr int32_t UnfilteredAdcRange = 1 << AdcBits;						// The readings we pass in should be in range 0..(AdcRange - 1)
-	static constexpr unsigned int AdcOversampleBits = 2;							// we use 2-bit oversampling
-	static constexpr int32_t FilteredAdcRange = 1 << (AdcBits + AdcOversampleBits);	// The readings we pass in should be in range 0..(AdcRange - 1)
+	static constexpr int32_t UnfilteredAdcRange = 1 << AnalogIn::AdcBits;						// The readings we pass in should be in range 0..(AdcRange - 1)
+	static constexpr unsigned int AdcOversampleBits = 2;										// we use 2-bit oversampling
+	static constexpr int32_t FilteredAdcRange = 1 << (AnalogIn::AdcBits + AdcOversampleBits);	// The readings we pass in should be in range 0..(AdcRange - 1)
 };
 
 #endif /* SRC_HEATING_SENSORS_LINEARANALOGSENSOR_H_ */
@@ -0,0 +1,70 @@
+/*
+ * RemoteSensor.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "RemoteSensor.h"
+#include "CanMessageGenericParser.h"
+#include "CanMessageFormats.h"
+#include "CAN/CanInterface.h"
+
+RemoteSensor::RemoteSensor(unsigned int sensorNum) : TemperatureSensor(sensorNum, "remote sensor"), boardAddress(CanId::MasterAddress)
+{
+}
+
+// Configure the sensor. The P parameter is the address of the board that has the sensor, optionally followed by a full stop and the port name used on that board, which we ignore.
+GCodeResult RemoteSensor::Configure(const CanMessageGenericParser& parser, const StringRef& reply)
+{
+	String<StringLength20> portName;
+	if (parser.GetStringParam('P', portName.GetRef()))
+	{
+		const char *p = portName.c_str();
+		unsigned int address = 0;
+		bool seenDigit = false;
+		while (isdigit(*p))
+		{
+			address = (10 * address) + (unsigned int)(*p - '0');
+			seenDigit = true;
+			++p;
+		}
+		if (!seenDigit || (*p != 0 && *p != '.') || address > CanId::MaxCanAddress || address == CanInterface::GetCanAddress())
+		{
+			reply.copy("Remote sensor port name must start with the address of another board");
+			return GCodeResult::error;
+		}
+		boardAddress = (CanAddress)address;
+		SetResult(TemperatureError::notReady);
+	}
+	else if (parser.HasParameter('Y'))
+	{
+		reply.copy("Missing port name parameter");
+		return GCodeResult::error;
+	}
+	else
+	{
+		CopyBasicDetails(reply);
+		reply.catf(", on board %u", boardAddress);
+	}
+	return GCodeResult::ok;
+}
+
+// Update the temperature from a broadcast sensor report. This is called from the CAN receiver task.
+void RemoteSensor::UpdateRemoteTemperature(CanAddress src, const CanTemperatureReport& report)
+{
+	if (src == boardAddress)
+	{
+		const TemperatureError err = (TemperatureError)report.errorCode;
+		if (err == TemperatureError::success)
+		{
+			SetResult(report.temperature, err);
+		}
+		else
+		{
+			SetResult(err);
+		}
+	}
+}
+
+// End
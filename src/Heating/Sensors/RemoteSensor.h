@@ -0,0 +1,32 @@
+/*
+ * RemoteSensor.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  A sensor on another expansion board or the main board, so that a heater on this board can be controlled from it without routing the temperature via the main board.
+ *  Every board broadcasts its sensor temperatures, so all we need to know is which board the sensor is on. The sensor number is the same on all boards.
+ */
+
+#ifndef SRC_HEATING_SENSORS_REMOTESENSOR_H_
+#define SRC_HEATING_SENSORS_REMOTESENSOR_H_
+
+#include "TemperatureSensor.h"
+
+class RemoteSensor : public TemperatureSensor
+{
+public:
+	RemoteSensor(unsigned int sensorNum);
+
+	static constexpr const char *TypeName = "remote";
+
+	GCodeResult Configure(const CanMessageGenericParser& parser, const StringRef& reply) override;
+	CanAddress GetBoardAddress() const override { return boardAddress; }
+	void UpdateRemoteTemperature(CanAddress src, const CanTemperatureReport& report) override;
+	void Poll() override { }							// nothing to do here, the readings arrive in broadcast messages and time out if they stop
+
+private:
+	CanAddress boardAddress;
+};
+
+#endif /* SRC_HEATING_SENSORS_REMOTESENSOR_H_ */
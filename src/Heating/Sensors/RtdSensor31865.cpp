@@ -47,7 +47,7 @@ RtdSensor31865::RtdSensor31865(unsigned int sensorNum)
 GCodeResult RtdSensor31865::Configure(const CanMessageGenericParser& parser, const StringRef& reply)
 {
 	bool seen = false;
-	if (!ConfigurePort(parser, reply, seen))
+	if (!ConfigurePortWithDataReady(parser, reply, seen))
 	{
 		return GCodeResult::error;
 	}
@@ -115,6 +115,7 @@ GCodeResult RtdSensor31865::Configure(const CanMessageGenericParser& parser, con
 	{
 		CopyBasicDetails(reply);
 		reply.catf(", %s wires, reject %dHz, reference resistor %u ohms", (cr0 & 0x10) ? "3" : "2/4", (cr0 & 0x01) ? 50 : 60, (unsigned int)rref);
+		AppendDataReadyDetails(reply);
 	}
 	return GCodeResult::ok;
 }
@@ -142,8 +143,15 @@ TemperatureError RtdSensor31865::TryInitRtd() const
 	return sts;
 }
 
+// The chip converts continuously. If we have a data ready pin then we only read the result when there is a new one, and the reading times out if the pin stops signalling.
+// The fault bit is in the result, so we only read the fault status register when it is set.
 void RtdSensor31865::Poll()
 {
+	if (!IsNewDataAvailable())
+	{
+		return;
+	}
+
 	static const uint8_t dataOut[4] = {0, 0x55, 0x55, 0x55};			// read registers 0 (control), 1 (MSB) and 2 (LSB)
 	uint32_t rawVal;
 	TemperatureError sts = DoSpiTransaction(dataOut, ARRAY_SIZE(dataOut), rawVal);
@@ -8,6 +8,10 @@
 #include "SensorWithPort.h"
 #include "CanMessageGenericParser.h"
 
+#ifdef SAMC21
+# include <Hardware/AnalogIn.h>
+#endif
+
 SensorWithPort::SensorWithPort(unsigned int sensorNum, const char *type)
 	: TemperatureSensor(sensorNum, type)
 {
@@ -35,6 +39,62 @@ bool SensorWithPort::ConfigurePort(const CanMessageGenericParser& parser, const
 	return false;
 }
 
+#ifdef SAMC21
+
+// Process the O (oversampling ratio) and D (decimation ratio) parameters. These apply to all SDADC inputs, so they can only be set when using the SDADC.
+// Return true if successful, else return false and set the error message in 'reply'. Set 'seen' if we saw either parameter.
+bool SensorWithPort::ConfigureSdAdc(const CanMessageGenericParser& parser, const StringRef& reply, bool& seen)
+{
+	const bool seenO = parser.HasParameter('O'), seenD = parser.HasParameter('D');
+	if (!seenO && !seenD)
+	{
+		return true;
+	}
+	if (!port.UseAlternateConfig())
+	{
+		reply.copy("Oversampling and decimation ratios can only be set when using the SDADC");
+		return false;
+	}
+
+	uint16_t oversamplingRatio;
+	if (parser.GetUintParam('O', oversamplingRatio))
+	{
+		if (!AnalogIn::SetSdAdcOversamplingRatio(oversamplingRatio))
+		{
+			reply.copy("SDADC oversampling ratio must be 64, 128, 256, 512 or 1024");
+			return false;
+		}
+		seen = true;
+	}
+
+	uint16_t decimation;
+	if (parser.GetUintParam('D', decimation))
+	{
+		if (!AnalogIn::SetSdAdcDecimation(decimation))
+		{
+			reply.copy("SDADC decimation ratio must be between 0 and 16");
+			return false;
+		}
+		seen = true;
+	}
+	return true;
+}
+
+void SensorWithPort::AppendSdAdcDetails(const StringRef& reply) const
+{
+	if (port.UseAlternateConfig())
+	{
+		reply.catf(", SDADC oversampling ratio %u", AnalogIn::GetSdAdcOversamplingRatio());
+		const unsigned int decimation = AnalogIn::GetSdAdcDecimation();
+		if (decimation != 0)
+		{
+			reply.catf(", continuous with decimation ratio %u", decimation);
+		}
+	}
+}
+
+#endif
+
 // Copy the basic details to the reply buffer. This hides the version in the base class.
 void SensorWithPort::CopyBasicDetails(const StringRef& reply) const
 {
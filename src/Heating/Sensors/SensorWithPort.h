@@ -19,6 +19,12 @@ protected:
 	// Try to configure the port
 	bool ConfigurePort(const CanMessageGenericParser& parser, const StringRef& reply, PinAccess access, bool& seen);
 
+#ifdef SAMC21
+	// Process the parameters that set up the SDADC, which are shared by all SDADC inputs
+	bool ConfigureSdAdc(const CanMessageGenericParser& parser, const StringRef& reply, bool& seen);
+	void AppendSdAdcDetails(const StringRef& reply) const;
+#endif
+
 	// Copy the basic details to the reply buffer. This hides the version in the base class.
 	void CopyBasicDetails(const StringRef& reply) const;
 
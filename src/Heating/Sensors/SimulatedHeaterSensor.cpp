@@ -0,0 +1,153 @@
+/*
+ * SimulatedHeaterSensor.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "SimulatedHeaterSensor.h"
+
+#if SUPPORT_HEATER_SIMULATION
+
+#include "Heating/Heat.h"
+#include "CanMessageGenericParser.h"
+
+SimulatedHeaterSensor::SimulatedHeaterSensor(unsigned int sensorNum)
+	: TemperatureSensor(sensorNum, "Simulated heater"), pollInterval(HeatSampleIntervalMillis), lastPollTime(millis()), noiseSeed(sensorNum + 1),
+	  heater(-1), gain(340.0), timeConstant(140.0), deadTime(5.5), ambientTemperature(25.0), noiseAmplitude(0.0), extraLoss(0.0),
+	  speedFactor(1), injectedError(TemperatureError::success), plantTemperature(25.0), historyIndex(0)
+{
+	for (float& pwm : pwmHistory)
+	{
+		pwm = 0.0;
+	}
+}
+
+GCodeResult SimulatedHeaterSensor::Configure(const CanMessageGenericParser& parser, const StringRef& reply)
+{
+	bool seen = GetPollIntervalParam(parser, pollInterval);
+	if (parser.GetIntParam('H', heater))
+	{
+		seen = true;
+	}
+
+	float temp;
+	if (parser.GetFloatParam('B', temp))
+	{
+		if (temp <= 0.0)
+		{
+			reply.copy("Gain must be greater than zero");
+			return GCodeResult::error;
+		}
+		gain = temp;
+		seen = true;
+	}
+	if (parser.GetFloatParam('C', temp))
+	{
+		if (temp <= 0.0)
+		{
+			reply.copy("Time constant must be greater than zero");
+			return GCodeResult::error;
+		}
+		timeConstant = temp;
+		seen = true;
+	}
+	if (parser.GetFloatParam('T', temp))
+	{
+		deadTime = max<float>(temp, 0.0);
+		seen = true;
+	}
+	if (parser.GetFloatParam('R', temp))
+	{
+		// Changing the ambient temperature restarts the simulation from cold
+		ambientTemperature = plantTemperature = temp;
+		seen = true;
+	}
+
+	uint16_t paramO;
+	if (parser.GetUintParam('O', paramO))
+	{
+		noiseAmplitude = (float)paramO * 0.01;
+		seen = true;
+	}
+	uint16_t paramF;
+	if (parser.GetUintParam('F', paramF))
+	{
+		speedFactor = max<uint16_t>(paramF, 1);
+		seen = true;
+	}
+	int32_t paramL;
+	if (parser.GetIntParam('L', paramL))
+	{
+		extraLoss = (float)max<int32_t>(paramL, 0) * 0.01;
+		seen = true;
+	}
+
+	char paramK;
+	if (parser.GetCharParam('K', paramK))
+	{
+		switch (toupper(paramK))
+		{
+		case 'N':	injectedError = TemperatureError::success; break;
+		case 'O':	injectedError = TemperatureError::openCircuit; break;
+		case 'S':	injectedError = TemperatureError::shortCircuit; break;
+		default:
+			reply.copy("Fault type must be N, O or S");
+			return GCodeResult::error;
+		}
+		seen = true;
+	}
+
+	if (!seen && !parser.HasParameter('Y'))
+	{
+		CopyBasicDetails(reply);
+		reply.catf(", heater %d, gain %.1f, time constant %.1fs, dead time %.1fs, ambient %.1fC, noise %.2fC, speed x%u, extra loss %.0f%%, plant temperature %.1fC",
+					heater, (double)gain, (double)timeConstant, (double)deadTime, (double)ambientTemperature, (double)noiseAmplitude, speedFactor,
+					(double)(extraLoss * 100.0), (double)plantTemperature);
+		if (injectedError != TemperatureError::success)
+		{
+			reply.catf(", injected fault: %s", TemperatureErrorString(injectedError));
+		}
+	}
+	return GCodeResult::ok;
+}
+
+// Return a pseudo random number uniformly distributed between -noiseAmplitude and +noiseAmplitude
+float SimulatedHeaterSensor::NextNoise()
+{
+	noiseSeed = noiseSeed * 1664525u + 1013904223u;
+	return noiseAmplitude * ((float)(noiseSeed >> 8) * (2.0/(float)(1u << 24)) - 1.0);
+}
+
+void SimulatedHeaterSensor::Poll()
+{
+	// Advance the plant by the real time elapsed since the last poll multiplied by the speed factor
+	const uint32_t now = millis();
+	const float plantStep = (float)(now - lastPollTime) * 0.001 * (float)speedFactor;
+	lastPollTime = now;
+
+	// Record the PWM that the heater is applying now, and fetch the PWM that it was applying one dead time ago
+	historyIndex = (historyIndex + 1) % DeadTimeSlots;
+	pwmHistory[historyIndex] = (heater >= 0) ? Heat::GetAppliedPwm(heater) : 0.0;
+	const float slotTime = (float)pollInterval * 0.001 * (float)speedFactor;
+	const size_t delaySlots = min<size_t>(lrintf(deadTime/slotTime), DeadTimeSlots - 1);
+	const float delayedPwm = pwmHistory[(historyIndex + DeadTimeSlots - delaySlots) % DeadTimeSlots];
+
+	// The exact solution of the first order model for constant PWM over the step. The extra heat loss reduces both the gain and the time constant.
+	const float lossFactor = 1.0 + extraLoss;
+	const float steadyTemperature = ambientTemperature + gain * delayedPwm/lossFactor;
+	plantTemperature = steadyTemperature + (plantTemperature - steadyTemperature) * expf(-plantStep * lossFactor/timeConstant);
+
+	if (injectedError != TemperatureError::success)
+	{
+		SetResult(injectedError);
+	}
+	else
+	{
+		SetResult(plantTemperature + NextNoise(), TemperatureError::success);
+	}
+}
+
+#endif
+
+// End
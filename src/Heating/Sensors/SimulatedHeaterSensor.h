@@ -0,0 +1,58 @@
+/*
+ * SimulatedHeaterSensor.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  A temperature sensor that reports the temperature of a simulated heater, so that heater control, tuning and fault detection can be
+ *  exercised on a real board without a real heater. The heater should be configured with port "nil" and this sensor.
+ *  The plant is a first order process with dead time, driven by the PWM that the heater is applying, plus optional noise,
+ *  a step change in heat loss to simulate a fan turning on, and injected sensor faults.
+ *  Parameters (using the M308 parameter letters that the main board already sends to us):
+ *  H heater number, B gain (C rise at full power), C time constant (sec), T dead time (sec), R ambient temperature (C),
+ *  O noise amplitude (hundredths of a degree), F speed factor, L extra heat loss (percent), K fault to inject ('O' open circuit, 'S' short circuit, 'N' none)
+ */
+
+#ifndef SRC_HEATING_SENSORS_SIMULATEDHEATERSENSOR_H_
+#define SRC_HEATING_SENSORS_SIMULATEDHEATERSENSOR_H_
+
+#include "TemperatureSensor.h"
+
+#if SUPPORT_HEATER_SIMULATION
+
+class SimulatedHeaterSensor : public TemperatureSensor
+{
+public:
+	SimulatedHeaterSensor(unsigned int sensorNum);
+
+	GCodeResult Configure(const CanMessageGenericParser& parser, const StringRef& reply) override;
+
+	static constexpr const char *TypeName = "simulated";
+
+	void Poll() override;
+	uint32_t GetPollInterval() const override { return pollInterval; }
+
+private:
+	static constexpr size_t DeadTimeSlots = 32;			// the maximum dead time is this many poll intervals of plant time
+
+	float NextNoise();
+
+	uint32_t pollInterval;
+	uint32_t lastPollTime;
+	uint32_t noiseSeed;
+
+	// Configurable parameters
+	int heater;
+	float gain, timeConstant, deadTime, ambientTemperature, noiseAmplitude, extraLoss;
+	uint16_t speedFactor;
+	TemperatureError injectedError;
+
+	// Plant state
+	float plantTemperature;
+	float pwmHistory[DeadTimeSlots];					// the PWM at each of the last few polls, most recent at index historyIndex
+	size_t historyIndex;
+};
+
+#endif
+
+#endif /* SRC_HEATING_SENSORS_SIMULATEDHEATERSENSOR_H_ */
@@ -9,13 +9,19 @@
 
 #if SUPPORT_SPI_SENSORS
 
-#include "Tasks.h"
+#include "CanMessageGenericParser.h"
 
 SpiTemperatureSensor::SpiTemperatureSensor(unsigned int sensorNum, const char *name, SpiMode spiMode, uint32_t clockFreq)
-	: SensorWithPort(sensorNum, name), device(clockFreq, spiMode, false)
+	: SensorWithPort(sensorNum, name), device(clockFreq, spiMode, false), newDataReady(false)
 {
 }
 
+SpiTemperatureSensor::~SpiTemperatureSensor()
+{
+	drdyPort.DetachInterrupt();
+	drdyPort.Release();
+}
+
 bool SpiTemperatureSensor::ConfigurePort(const CanMessageGenericParser& parser, const StringRef& reply, bool& seen)
 {
 	const bool ret = SensorWithPort::ConfigurePort(parser, reply, PinAccess::write1, seen);
@@ -23,34 +29,80 @@ bool SpiTemperatureSensor::ConfigurePort(const CanMessageGenericParser& parser,
 	return ret;
 }
 
-void SpiTemperatureSensor::InitSpi()
-{
-	device.InitMaster();
-}
-
-// Send and receive 1 to 8 bytes of data and return the result as a single 32-bit word
-TemperatureError SpiTemperatureSensor::DoSpiTransaction(const uint8_t dataOut[], size_t nbytes, uint32_t& rslt) const
+// Configure the CS port and optionally a data ready port. Return true if the CS port is valid at the end, else return false and set the error message in 'reply'.
+bool SpiTemperatureSensor::ConfigurePortWithDataReady(const CanMessageGenericParser& parser, const StringRef& reply, bool& seen)
 {
-	uint8_t rawBytes[8];
-	bool ok;
+	String<StringLength50> portNames;
+	if (parser.GetStringParam('P', portNames.GetRef()))
 	{
-		MutexLocker lock(Tasks::GetSpiMutex(), 10);
-		if (!lock)
+		seen = true;
+		drdyPort.DetachInterrupt();
+		IoPort* const ports[] = { &port, &drdyPort };
+		const PinAccess access[] = { PinAccess::write1, PinAccess::read };
+		if (IoPort::AssignPorts(portNames.c_str(), reply, PinUsedBy::sensor, 2, ports, access) == 0)
 		{
-			return TemperatureError::busBusy;
+			return false;
 		}
+		device.SetCsPin(port.GetPin());
 
-		device.Select();
-		delayMicroseconds(1);
+		// The data ready pin goes low when a conversion completes and high again when we read the result
+		newDataReady = false;
+		if (drdyPort.IsValid() && !drdyPort.AttachInterrupt(DataReadyInterrupt, InterruptMode::falling, this))
+		{
+			reply.copy("Data ready pin does not support interrupts");
+			drdyPort.Release();
+			return false;
+		}
+		return true;
+	}
+	if (port.IsValid())
+	{
+		return true;
+	}
+	reply.copy("Missing port name parameter");
+	return false;
+}
 
-		ok = device.TransceivePacket(dataOut, rawBytes, nbytes);
+void SpiTemperatureSensor::AppendDataReadyDetails(const StringRef& reply) const
+{
+	if (drdyPort.IsValid())
+	{
+		reply.cat(", data ready pin ");
+		drdyPort.AppendPinName(reply);
+	}
+}
 
-		delayMicroseconds(1);
-		device.Deselect();
-		delayMicroseconds(1);
+// Return true if there is a new result to read. We also check the pin in case we attached the interrupt when it was already low, because we would never get another falling edge.
+bool SpiTemperatureSensor::IsNewDataAvailable()
+{
+	if (!drdyPort.IsValid())
+	{
+		return true;
+	}
+	if (newDataReady || !drdyPort.Read())
+	{
+		newDataReady = false;						// clear it before we read the sensor, so that we don't miss the next conversion
+		return true;
 	}
+	return false;
+}
+
+/*static*/ void SpiTemperatureSensor::DataReadyInterrupt(CallbackParameter p)
+{
+	static_cast<SpiTemperatureSensor*>(p.vp)->newDataReady = true;
+}
 
-	if (!ok)
+void SpiTemperatureSensor::InitSpi()
+{
+	device.InitMaster();
+}
+
+// Send and receive 1 to 8 bytes of data and return the result as a single 32-bit word
+TemperatureError SpiTemperatureSensor::DoSpiTransaction(const uint8_t dataOut[], size_t nbytes, uint32_t& rslt) const
+{
+	// The SPI transaction queue selects and deselects the device, and other SPI devices may use the bus while we wait
+	uint8_t rawBytes[8];
+	if (!device.TransceivePacketDma(dataOut, rawBytes, nbytes))
 	{
 		return TemperatureError::timeout;
 	}
@@ -16,14 +16,29 @@
 
 class SpiTemperatureSensor : public SensorWithPort
 {
+public:
+	// If we have a data ready pin then we poll often but only read the sensor when it has a new result, otherwise we read it at the standard interval
+	uint32_t GetPollInterval() const override { return (drdyPort.IsValid()) ? MinHeatSampleIntervalMillis : HeatSampleIntervalMillis; }
+
 protected:
 	SpiTemperatureSensor(unsigned int sensorNum, const char *name, SpiMode spiMode, uint32_t clockFrequency);
+	~SpiTemperatureSensor();
+
 	bool ConfigurePort(const CanMessageGenericParser& parser, const StringRef& reply, bool& seen);
+	bool ConfigurePortWithDataReady(const CanMessageGenericParser& parser, const StringRef& reply, bool& seen);	// the port name may be followed by '+' and the name of an active-low data ready pin
+	void AppendDataReadyDetails(const StringRef& reply) const;
+	bool IsNewDataAvailable();										// return true if we don't have a data ready pin or there is a new result to read
 	void InitSpi();
 	TemperatureError DoSpiTransaction(const uint8_t dataOut[], size_t nbytes, uint32_t& rslt) const
 		pre(nbytes <= 8);
 
 	SharedSpiDevice device;
+
+private:
+	static void DataReadyInterrupt(CallbackParameter p);
+
+	IoPort drdyPort;
+	volatile bool newDataReady;
 };
 
 #endif
@@ -5,25 +5,37 @@
 #include "RtdSensor31865.h"
 #include "CurrentLoopTemperatureSensor.h"
 #include "LinearAnalogSensor.h"
+#include "RemoteSensor.h"
 #include "CanMessageGenericParser.h"
 
 #if HAS_CPU_TEMP_SENSOR
 #include "CpuTemperatureSensor.h"
 #endif
 
+#if HAS_VOLTAGE_MONITOR
+#include "VoltageSensor.h"
+#endif
+
 #if SUPPORT_DHT_SENSOR
 #include "DhtSensor.h"
 #endif
 
+#if SUPPORT_HEATER_SIMULATION
+#include "SimulatedHeaterSensor.h"
+#endif
+
 #if HAS_SMART_DRIVERS
 #include "TmcDriverTemperatureSensor.h"
 #endif
 
 #include "CAN/CanInterface.h"
+#include "Movement/StepTimer.h"
+
+ObjectPool TemperatureSensor::pool("sensors");
 
 // Constructor
 TemperatureSensor::TemperatureSensor(unsigned int sensorNum, const char *t)
-	: next(nullptr), sensorNumber(sensorNum), sensorType(t), whenLastRead(0), lastResult(TemperatureError::notReady), lastRealError(TemperatureError::success) {}
+	: sensorNumber(sensorNum), configDigest(0), sensorType(t), whenLastRead(0), lastResult(TemperatureError::notReady), lastRealError(TemperatureError::success) {}
 
 // Virtual destructor
 TemperatureSensor::~TemperatureSensor()
@@ -33,7 +45,7 @@ TemperatureSensor::~TemperatureSensor()
 // Return the latest temperature reading
 TemperatureError TemperatureSensor::GetLatestTemperature(float& t)
 {
-	if (millis() - whenLastRead > TemperatureReadingTimeout)
+	if (StepTimer::GetTimerTicks() - whenLastRead > TemperatureReadingTimeout * (StepTimer::StepClockRate/1000))
 	{
 		lastTemperature = BadErrorTemperature;
 		lastResult = TemperatureError::timeout;
@@ -62,7 +74,7 @@ void TemperatureSensor::SetResult(float t, TemperatureError rslt)
 {
 	lastResult = rslt;
 	lastTemperature = t;
-	whenLastRead = millis();
+	whenLastRead = StepTimer::GetTimerTicks();
 	if (rslt != TemperatureError::success)
 	{
 		lastRealError = rslt;
@@ -74,7 +86,21 @@ void TemperatureSensor::SetResult(TemperatureError rslt)
 {
 	lastResult = lastRealError = rslt;
 	lastTemperature = BadErrorTemperature;
-	whenLastRead = millis();
+	whenLastRead = StepTimer::GetTimerTicks();
+}
+
+// Process the I parameter, which virtual sensors use to set how often they are polled in milliseconds. Return true if it was present.
+// The interval is rounded to a multiple of the Heat task interval and limited so that readings don't time out.
+/*static*/ bool TemperatureSensor::GetPollIntervalParam(const CanMessageGenericParser& parser, uint32_t& interval)
+{
+	uint16_t millisWanted;
+	if (parser.GetUintParam('I', millisWanted))
+	{
+		const uint32_t rounded = ((millisWanted + MinHeatSampleIntervalMillis/2)/MinHeatSampleIntervalMillis) * MinHeatSampleIntervalMillis;
+		interval = constrain<uint32_t>(rounded, MinHeatSampleIntervalMillis, TemperatureReadingTimeout/2);
+		return true;
+	}
+	return false;
 }
 
 // Get the expansion board address. Overridden for remote sensors.
@@ -105,6 +131,10 @@ TemperatureSensor *TemperatureSensor::Create(unsigned int sensorNum, const char
 	{
 		ts = new LinearAnalogSensor(sensorNum);
 	}
+	else if (ReducedStringEquals(typeName, RemoteSensor::TypeName))
+	{
+		ts = new RemoteSensor(sensorNum);
+	}
 #if SUPPORT_SPI_SENSORS
 	else if (ReducedStringEquals(typeName, ThermocoupleSensor31855::TypeName))
 	{
@@ -139,11 +169,29 @@ TemperatureSensor *TemperatureSensor::Create(unsigned int sensorNum, const char
 		ts = new CpuTemperatureSensor(sensorNum);
 	}
 #endif
+#if HAS_VOLTAGE_MONITOR
+	else if (ReducedStringEquals(typeName, VoltageSensor::TypeNameVin))
+	{
+		ts = new VoltageSensor(sensorNum, false);
+	}
+#endif
+#if HAS_12V_MONITOR
+	else if (ReducedStringEquals(typeName, VoltageSensor::TypeNameV12))
+	{
+		ts = new VoltageSensor(sensorNum, true);
+	}
+#endif
 #if HAS_SMART_DRIVERS
 	else if (ReducedStringEquals(typeName, TmcDriverTemperatureSensor::TypeName))
 	{
 		ts = new TmcDriverTemperatureSensor(sensorNum);
 	}
+#endif
+#if SUPPORT_HEATER_SIMULATION
+	else if (ReducedStringEquals(typeName, SimulatedHeaterSensor::TypeName))
+	{
+		ts = new SimulatedHeaterSensor(sensorNum);
+	}
 #endif
 	else
 	{
@@ -155,74 +203,94 @@ TemperatureSensor *TemperatureSensor::Create(unsigned int sensorNum, const char
 }
 
 // Shared function used by two derived classes
-//	 pt100rtd list of resistances v temperature
-//
-//	DIN 43760 / IEC 751 resistance values (ohms) were multiplied by 100 and
-//	converted to 16 bit unsigned integers with no loss of accuracy.
-//
-//	Examples:
-//	1852 represents 18.52 ohms and corresponds to a temperature of -200C.
+// The Callendar-Van Dusen equation gives the resistance of a PT100 sensor at temperature T as R0 * (1 + A*T + B*T^2 + C*(T - 100)*T^3), where C is zero above 0C.
+// We tabulate its inverse at compile time, at equal steps of resistance, so that each conversion is an integer interpolation.
+// The resistance is passed in multiplied by 100 and converted to a 16-bit unsigned integer:
 //	10000 ==> 100.00 ohms @   0C
 //	13851 ==> 138.51 ohms @ 100C
 
-const float CelsiusMin = -100.0;					// starting temperature of the temp table below
-const float CelsiusInterval = 10.0;
+static constexpr double CvdA = 3.9083e-3;
+static constexpr double CvdB = -5.775e-7;
+static constexpr double CvdC = -4.183e-12;
 
-static const uint16_t tempTable[] =
+static constexpr uint16_t Pt100MinOhmsx100 = 6026;					// the resistance at -100C, below which we report a short circuit
+static constexpr uint16_t Pt100MaxOhmsx100 = 39048;					// the resistance at 850C, above which we report an open circuit
+static constexpr unsigned int Pt100TableStepBits = 8;				// the table has one entry every 2.56 ohms
+static constexpr size_t NumPt100TableEntries = ((Pt100MaxOhmsx100 - Pt100MinOhmsx100 + (1u << Pt100TableStepBits) - 1) >> Pt100TableStepBits) + 1;
+static constexpr int32_t Pt100TableUnitsPerDegree = 32;				// the table holds temperatures in units of 1/32C
+
+// Return the ratio of the PT100 resistance at temperature t to its resistance at 0C
+static constexpr double Pt100ResistanceRatio(double t)
 {
-	6026,  6430,  6833,  7233,  7633,  8031,  8427,  8822,  9216,  9609,
-	10000, 10390, 10779, 11167, 11554, 11940, 12324, 12708, 13090, 13471,
-	13851, 14229, 14607, 14983, 15358, 15733, 16105, 16477, 16848, 17217,
-	17586, 17953, 18319, 18684, 19047, 19410, 19771, 20131, 20490, 20848,
-	21205, 21561, 21915, 22268, 22621, 22972, 23321, 23670, 24018, 24364,
-	24709, 25053, 25396, 25738, 26078, 26418, 26756, 27093, 27429, 27764,
-	28098, 28430, 28762, 29092, 29421, 29749, 30075, 30401, 30725, 31048,
-	31371, 31692, 32012, 32330, 32648, 32964, 33279, 33593, 33906, 34218,
-	34528, 34838, 35146, 35453, 35759, 36064, 36367, 36670, 36971, 37271,
-	37570, 37868, 38165, 38460, 38755, 39048
-};
+	return 1.0 + CvdA * t + CvdB * t * t + ((t < 0.0) ? CvdC * (t - 100.0) * t * t * t : 0.0);
+}
 
-const size_t NumTempTableEntries = sizeof(tempTable)/sizeof(tempTable[0]);
+// Solve the Callendar-Van Dusen equation for the temperature by Newton's method, starting from the linear approximation
+static constexpr double Pt100Temperature(double ratio)
+{
+	double t = (ratio - 1.0)/CvdA;
+	for (unsigned int i = 0; i < 6; ++i)
+	{
+		const double slope = CvdA + 2.0 * CvdB * t + ((t < 0.0) ? CvdC * (4.0 * t - 300.0) * t * t : 0.0);
+		t -= (Pt100ResistanceRatio(t) - ratio)/slope;
+	}
+	return t;
+}
 
-/*static*/ TemperatureError TemperatureSensor::GetPT100Temperature(float& t, uint16_t ohmsx100)
+struct Pt100Table
 {
+	int16_t temperatures[NumPt100TableEntries];
 
-	// Formally-verified binary search routine, adapted from one of the eCv examples
-	size_t low = 0u, high = NumTempTableEntries;
-	while (high > low)
-	keep(low <= high; high <= NumTempTableEntries)
-	keep(low == 0u || tempTable[low - 1u] < ohmsx100)
-	keep(high == NumTempTableEntries || ohmsx100 <= tempTable[high])
-	decrease(high - low)
+	constexpr Pt100Table() : temperatures()
 	{
-		size_t mid = (high - low)/2u + low;			// get the mid point, avoiding arithmetic overflow
-		if (ohmsx100 <= tempTable[mid])
+		for (size_t i = 0; i < NumPt100TableEntries; ++i)
 		{
-			high = mid;
-		}
-		else
-		{
-			low = mid + 1u;
+			const double t = Pt100Temperature((double)(Pt100MinOhmsx100 + (i << Pt100TableStepBits)) * 0.0001) * (double)Pt100TableUnitsPerDegree;
+			temperatures[i] = (int16_t)((t >= 0.0) ? t + 0.5 : t - 0.5);
 		}
 	}
-	assert(low <= NumTempTableEntries);
-	assert(low == 0 || tempTable[low - 1] < ohmsx100);
-	assert(low == NumTempTableEntries || ohmsx100 <= tempTable[low]);
 
-	if (low == 0)									// if off the bottom of the table
+	// Interpolate the table. The caller must make sure that ohmsx100 is within range.
+	constexpr int32_t Interpolate(uint16_t ohmsx100) const
+	{
+		const uint32_t offset = ohmsx100 - Pt100MinOhmsx100;
+		const size_t index = offset >> Pt100TableStepBits;
+		const int32_t fraction = (int32_t)(offset & ((1u << Pt100TableStepBits) - 1));
+		return (fraction == 0)
+				? temperatures[index]
+					: temperatures[index] + ((((int32_t)temperatures[index + 1] - (int32_t)temperatures[index]) * fraction + (1 << (Pt100TableStepBits - 1))) >> Pt100TableStepBits);
+	}
+};
+
+static constexpr Pt100Table pt100Table;
+
+// Check the table against the exact formula across the whole range when we compile it
+static constexpr double MaxPt100TableError()
+{
+	double maxError = 0.0;
+	for (uint32_t ohmsx100 = Pt100MinOhmsx100; ohmsx100 <= Pt100MaxOhmsx100; ohmsx100 += 7)
+	{
+		const double error = (double)pt100Table.Interpolate(ohmsx100)/(double)Pt100TableUnitsPerDegree - Pt100Temperature((double)ohmsx100 * 0.0001);
+		maxError = max<double>(maxError, (error < 0.0) ? -error : error);
+	}
+	return maxError;
+}
+
+static_assert(MaxPt100TableError() < 0.05, "PT100 table is not accurate enough");
+
+/*static*/ TemperatureError TemperatureSensor::GetPT100Temperature(float& t, uint16_t ohmsx100)
+{
+	if (ohmsx100 < Pt100MinOhmsx100)				// if off the bottom of the table
 	{
 		return TemperatureError::shortCircuit;
 	}
 
-	if (low >= NumTempTableEntries)					// if off the top of the table
+	if (ohmsx100 > Pt100MaxOhmsx100)				// if off the top of the table
 	{
 		return TemperatureError::openCircuit;
 	}
 
-	const float temperatureFraction = (float)(ohmsx100 - tempTable[low - 1])/(float)(tempTable[low] - tempTable[low - 1]);
-	t = CelsiusInterval * (low - 1 + temperatureFraction) + CelsiusMin;
-
-	//debugPrintf("raw %f low %u temp %f\n", ohmsx100, low, t);
+	t = (float)pt100Table.Interpolate(ohmsx100) * (1.0/(float)Pt100TableUnitsPerDegree);
 	return TemperatureError::success;
 }
 
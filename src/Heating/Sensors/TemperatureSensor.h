@@ -6,6 +6,7 @@
 #include "GCodes/GCodeResult.h"
 #include <Hardware/IoPorts.h>
 #include <CanId.h>
+#include <ObjectPool.h>
 
 class CanMessageGenericParser;
 class CanTemperatureReport;
@@ -18,12 +19,20 @@ public:
 	// Virtual destructor
 	virtual ~TemperatureSensor();
 
+	// Sensors are allocated from a pool so that reconfiguring them doesn't fragment the heap
+	void* operator new(size_t sz) { return pool.Allocate(sz); }
+	void operator delete(void* p, size_t sz) { pool.Release(p, sz); }
+
+
 	// Get the latest temperature reading
 	TemperatureError GetLatestTemperature(float& t);
 
 	// Get the most recent reading without checking for timeout
 	float GetStoredReading() const noexcept { return lastTemperature; }
 
+	// Get the step clock time at which the most recent reading was taken
+	uint32_t GetLastReadingTime() const noexcept { return whenLastRead; }
+
 	// Configure the sensor from M305 parameters.
 	// If we find any parameters, process them and return true. If an error occurs while processing them, return error and write an error message to 'reply.
 	// If we find no relevant parameters, report the current parameters to 'reply' and return ok.
@@ -35,16 +44,16 @@ public:
 	// Return the sensor number
 	unsigned int GetSensorNumber() const { return sensorNumber; }
 
+	// Get or set the digest of the command that created this sensor, or 0 if the sensor has been configured further since then
+	uint32_t GetConfigDigest() const { return configDigest; }
+	void SetConfigDigest(uint32_t digest) { configDigest = digest; }
+
 	// Return the code for the most recent error
 	TemperatureError GetLastError() const { return lastRealError; }
 
 	// Copy the basic details to the reply buffer
 	void CopyBasicDetails(const StringRef& reply) const noexcept;
 
-	// Get/set the next sensor in the linked list
-	TemperatureSensor *GetNext() const { return next; }
-	void SetNext(TemperatureSensor *n) { next = n; }
-
 	// Get the expansion board address. Overridden for remote sensors.
 	virtual CanAddress GetBoardAddress() const;
 
@@ -57,20 +66,29 @@ public:
 	// Try to get a temperature reading
 	virtual void Poll() = 0;
 
+	// Convert a PT100 resistance to a temperature. Shared by two derived classes and public so that the benchmarks can time it.
+	static TemperatureError GetPT100Temperature(float& t, uint16_t ohmsx100);
+
+	// Return how often to poll the sensor in milliseconds. This must be a multiple of MinHeatSampleIntervalMillis.
+	// Sensors that need time to do a conversion or are slow to read use the default, sensors that read the ADC averaging filters can be polled faster.
+	virtual uint32_t GetPollInterval() const { return HeatSampleIntervalMillis; }
+
 protected:
 	void SetResult(float t, TemperatureError rslt);
 	void SetResult(TemperatureError rslt);
 
-	static TemperatureError GetPT100Temperature(float& t, uint16_t ohmsx100);		// shared function used by two derived classes
+	static bool GetPollIntervalParam(const CanMessageGenericParser& parser, uint32_t& interval);	// shared function used by the virtual sensors
 
 private:
+	static ObjectPool pool;
+
 	static constexpr uint32_t TemperatureReadingTimeout = 2000;			// any reading older than this number of milliseconds is considered unreliable
 
-	TemperatureSensor *next;
 	unsigned int sensorNumber;					// the number of this sensor
+	uint32_t configDigest;						// the digest of the command that created this sensor, or 0 if it has been configured further since
 	const char * const sensorType;
 	float lastTemperature;
-	uint32_t whenLastRead;
+	uint32_t whenLastRead;						// the step clock time of the last reading, so that consumers can tell exactly how far apart readings were
 	TemperatureError lastResult, lastRealError;
 };
 
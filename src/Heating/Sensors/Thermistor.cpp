@@ -8,7 +8,9 @@
 
 #include "Thermistor.h"
 #include "Platform.h"
+#include <Hardware/AdcCalibration.h>
 #include "CanMessageGenericParser.h"
+#include <Heating/PersistentSettings.h>
 
 // The Steinhart-Hart equation for thermistor resistance is:
 // 1/T = A + B ln(R) + C [ln(R)]^3
@@ -22,9 +24,10 @@
 Thermistor::Thermistor(unsigned int sensorNum, bool p_isPT1000)
 	: SensorWithPort(sensorNum, (p_isPT1000) ? "PT1000" : "Thermistor"), adcFilterChannel(-1),
 	  r25(DefaultR25), beta(DefaultBeta), shC(DefaultShc), seriesR(DefaultThermistorSeriesR),
-	  isPT1000(p_isPT1000), adcLowOffset(0), adcHighOffset(0)
+	  isPT1000(p_isPT1000), adcLowOffset(0), adcHighOffset(0), readingsAveraged(0)
 {
 	CalcDerivedParameters();
+	(void)PersistentSettings::LoadThermistorOffsets(sensorNum, adcLowOffset, adcHighOffset);		// use the saved offsets unless the command that creates us sets them
 }
 
 // Configure the temperature sensor
@@ -52,15 +55,40 @@ GCodeResult Thermistor::Configure(const CanMessageGenericParser& parser, const S
 		}
 	}
 
-	seen = parser.GetIntParam('L', adcLowOffset) || seen;
-	seen = parser.GetIntParam('H', adcHighOffset) || seen;
+	bool seenOffset = parser.GetIntParam('L', adcLowOffset);
+	seenOffset = parser.GetIntParam('H', adcHighOffset) || seenOffset;
+	if (seenOffset)
+	{
+		PersistentSettings::SaveThermistorOffsets(GetSensorNumber(), adcLowOffset, adcHighOffset);
+		seen = true;
+	}
+
+	// The F parameter sets the number of readings averaged. Short windows respond faster, long windows give lower noise.
+	uint8_t paramF;
+	if (parser.GetUintParam('F', paramF))
+	{
+		if (paramF != 0 && (paramF < (1u << AdcOversampleBits) || !ThermistorAveragingFilter::IsValidWindow(paramF)))
+		{
+			reply.printf("Number of readings averaged must be a power of 2 from %u to %u", 1u << AdcOversampleBits, min<unsigned int>(ThermistorAveragingFilter::MaxReadingsAveraged(), 128));
+			return GCodeResult::error;
+		}
+		readingsAveraged = paramF;
+		seen = true;
+	}
+
+#ifdef SAMC21
+	if (!ConfigureSdAdc(parser, reply, seen))
+	{
+		return GCodeResult::error;
+	}
+#endif
 
 	if (seen)
 	{
 		adcFilterChannel = Platform::GetAveragingFilterIndex(port);
 		if (adcFilterChannel >= 0)
 		{
-			Platform::GetAdcFilter(adcFilterChannel)->Init((1u << AnalogIn::AdcBits) - 1);
+			Platform::GetAdcFilter(adcFilterChannel)->Init((1u << AnalogIn::AdcBits) - 1, readingsAveraged);
 		}
 	}
 	else
@@ -75,7 +103,10 @@ GCodeResult Thermistor::Configure(const CanMessageGenericParser& parser, const S
 		{
 			reply.catf(", T:%.1f B:%.1f C:%.2e R:%.1f", (double)r25, (double)beta, (double)shC, (double)seriesR);
 		}
-		reply.catf(" L:%d H:%d", adcLowOffset, adcHighOffset);
+		reply.catf(" L:%d H:%d F:%u", adcLowOffset, adcHighOffset, (readingsAveraged == 0) ? (unsigned int)ThermistorAveragingFilter::DefaultReadingsAveraged() : readingsAveraged);
+#ifdef SAMC21
+		AppendSdAdcDetails(reply);
+#endif
 	}
 
 	return GCodeResult::ok;
@@ -87,15 +118,15 @@ void Thermistor::Poll()
 	const volatile ThermistorAveragingFilter* tempFilter = Platform::GetAdcFilter(adcFilterChannel);
 
 #if HAS_VREF_MONITOR
-	// Use the actual VSSA and VREF values read by the ADC
-	const volatile ThermistorAveragingFilter *vrefFilter = Platform::GetVrefFilter(adcFilterChannel);
-	const volatile ThermistorAveragingFilter *vssaFilter = Platform::GetVssaFilter(adcFilterChannel);			// this one may be null on SAMC21 tool boards
-	if (tempFilter->IsValid() && vrefFilter->IsValid() && (vssaFilter == nullptr || vssaFilter->IsValid()))
+	// Use the VSSA and VREF values read by the ADC, smoothed by the calibration service
+	static_assert(AdcCalibration::OversampleBits == Thermistor::AdcOversampleBits, "ADC reference readings have the wrong scale");
+	AdcCalibration::References refs;
+	uint32_t tempSum;
+	size_t tempEntries;
+	if (tempFilter->GetSnapshot(tempSum, tempEntries) && AdcCalibration::GetReferences(adcFilterChannel, refs))
 	{
-		const int32_t rawAveragedVssaReading = (vssaFilter == nullptr) ? 0 : vssaFilter->GetSum()/(vssaFilter->NumAveraged() >> Thermistor::AdcOversampleBits);
-		const int32_t rawAveragedVrefReading = vrefFilter->GetSum()/(vrefFilter->NumAveraged() >> Thermistor::AdcOversampleBits);
-		const int32_t averagedVssaReading = rawAveragedVssaReading + (adcLowOffset * (1 << (AnalogIn::AdcBits - 12 + Thermistor::AdcOversampleBits - 1)));
-		const int32_t averagedVrefReading = rawAveragedVrefReading + (adcHighOffset * (1 << (AnalogIn::AdcBits - 12 + Thermistor::AdcOversampleBits - 1)));
+		const int32_t averagedVssaReading = refs.vssa + (adcLowOffset * (1 << (AnalogIn::AdcBits - 12 + Thermistor::AdcOversampleBits - 1)));
+		const int32_t averagedVrefReading = refs.vref + (adcHighOffset * (1 << (AnalogIn::AdcBits - 12 + Thermistor::AdcOversampleBits - 1)));
 
 		// VREF is the measured voltage at VREF less the drop of a 15 ohm (EXP3HC) or 10 ohm (TOOL1LC) resistor.
 		// VSSA is the voltage measured across the VSSA fuse. We assume the same maximum load and the same 15 ohms maximum resistance for the fuse.
@@ -116,11 +147,13 @@ void Thermistor::Poll()
 		else
 		{
 #else
-	if (tempFilter.IsValid())
+	uint32_t tempSum;
+	size_t tempEntries;
+	if (tempFilter->GetSnapshot(tempSum, tempEntries))
 	{
 		{
 #endif
-			const int32_t averagedTempReading = tempFilter->GetSum()/(tempFilter->NumAveraged() >> Thermistor::AdcOversampleBits);
+			const int32_t averagedTempReading = tempSum/(tempEntries >> Thermistor::AdcOversampleBits);
 
 			// Calculate the resistance
 #if HAS_VREF_MONITOR
@@ -134,7 +167,8 @@ void Thermistor::Poll()
 			}
 			else
 			{
-				const float resistance = seriesR * (float)(averagedTempReading - averagedVssaReading)/(float)(averagedVrefReading - averagedTempReading);
+				// The reading normalised to the VSSA..VREF range, in units of 1/4 of an oversampled ADC count
+				const int32_t quarterCounts = ((averagedTempReading - averagedVssaReading) * (4 * OversampledAdcRange))/(averagedVrefReading - averagedVssaReading);
 #else
 				const int32_t averagedVrefReading = OversampledAdcRange + adcHighOffset;
 				if (averagedVrefReading <= averagedTempReading)
@@ -143,12 +177,12 @@ void Thermistor::Poll()
 				}
 				else
 				{
-				const float denom = (float)(averagedVrefReading - averagedTempReading) - 0.5;
 				const int32_t averagedVssaReading = adcLowOffset;
-				float resistance = seriesR * ((float)(averagedTempReading - averagedVssaReading) + 0.5)/denom;
+				const int32_t quarterCounts = ((2 * (averagedTempReading - averagedVssaReading) + 1) * (2 * OversampledAdcRange))/(averagedVrefReading - averagedVssaReading);
 #endif
 				if (isPT1000)
 				{
+					const float resistance = seriesR * (float)quarterCounts/(float)(4 * OversampledAdcRange - quarterCounts);
 					// We want 100 * the equivalent PT100 resistance, which is 10 * the actual PT1000 resistance
 					const uint16_t ohmsx100 = (uint16_t)lrintf(constrain<float>(resistance * 10, 0.0, 65535.0));
 					float t;
@@ -158,9 +192,7 @@ void Thermistor::Poll()
 				else
 				{
 					// Else it's a thermistor
-					const float logResistance = log(resistance);
-					const float recipT = shA + shB * logResistance + shC * logResistance * logResistance * logResistance;
-					const float temp =  (recipT > 0.0) ? (1.0/recipT) + ABS_ZERO : BadErrorTemperature;
+					const float temp = LookUpTemperature(quarterCounts);
 
 					if (temp < MinimumConnectedTemperature)
 					{
@@ -182,12 +214,82 @@ void Thermistor::Poll()
 	}
 }
 
-// Calculate shA and shB from the other parameters
+// Calculate shA and shB from the other parameters, then build the temperature table
 void Thermistor::CalcDerivedParameters()
 {
 	shB = 1.0/beta;
 	const float lnR25 = logf(r25);
 	shA = 1.0/(25.0 - ABS_ZERO) - shB * lnR25 - shC * lnR25 * lnR25 * lnR25;
+
+	if (!isPT1000)
+	{
+		for (size_t i = 0; i < HalfTableEntries; ++i)
+		{
+			const float position = (float)TablePosition(i);
+			const float temperatures[2] =
+			{
+				// At the bottom end the thermistor resistance is a fraction of the series resistance, at the top end it is a multiple of it.
+				// The bottom end of the bottom half is a short circuit and the top end of the top half is an open circuit.
+				(i == 0) ? BadErrorTemperature : CalcThermistorTemperature(seriesR * position/((float)OversampledAdcRange - position)),
+				(i == 0) ? ABS_ZERO : CalcThermistorTemperature(seriesR * ((float)OversampledAdcRange - position)/position)
+			};
+			for (size_t half = 0; half < 2; ++half)
+			{
+				temperatureTable[half * HalfTableEntries + i] = (int16_t)constrain<long>(lrintf(temperatures[half] * (float)TableUnitsPerDegree), INT16_MIN, INT16_MAX);
+			}
+		}
+	}
+}
+
+// Evaluate the Steinhart-Hart equation
+float Thermistor::CalcThermistorTemperature(float resistance) const
+{
+	const float logResistance = logf(resistance);
+	const float recipT = shA + shB * logResistance + shC * logResistance * logResistance * logResistance;
+	return (recipT > 0.0) ? (1.0/recipT) + ABS_ZERO : BadErrorTemperature;
+}
+
+// Look up the temperature corresponding to a normalised reading in units of 1/4 of an oversampled ADC count, using integer interpolation
+float Thermistor::LookUpTemperature(int32_t quarterCounts) const
+{
+	// Work out which half of the table to use and the distance from the corresponding end of the range, still in quarter counts
+	const int16_t *table;
+	uint32_t distance;
+	if (quarterCounts < 2 * OversampledAdcRange)
+	{
+		table = temperatureTable;
+		distance = (uint32_t)max<int32_t>(quarterCounts, 0);
+	}
+	else
+	{
+		table = temperatureTable + HalfTableEntries;
+		distance = (uint32_t)max<int32_t>(4 * OversampledAdcRange - quarterCounts, 0);
+	}
+
+	const uint32_t counts = distance >> 2;
+	if (counts >= (1u << LogHalfRange))
+	{
+		return (float)table[HalfTableEntries - 1] * (1.0/(float)TableUnitsPerDegree);
+	}
+
+	// Find the table entry at or below this distance. Within each octave the entries are spaced 2^shift counts apart.
+	size_t index;
+	unsigned int shift;
+	if (counts < (2u << TableOctaveBits))
+	{
+		index = counts;
+		shift = 0;
+	}
+	else
+	{
+		const unsigned int octave = 31 - __builtin_clz(counts);
+		shift = octave - TableOctaveBits;
+		index = ((octave + 1 - TableOctaveBits) << TableOctaveBits) + ((counts >> shift) & ((1u << TableOctaveBits) - 1));
+	}
+
+	const int32_t fraction = (int32_t)(distance - (TablePosition(index) << 2));			// less than 2^(shift + 2)
+	const int32_t t = table[index] + ((((int32_t)table[index + 1] - (int32_t)table[index]) * fraction) >> (shift + 2));
+	return (float)t * (1.0/(float)TableUnitsPerDegree);
 }
 
 // End
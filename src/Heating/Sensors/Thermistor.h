@@ -17,6 +17,10 @@
 // 1/T = A + (1/Beta) ln(R)
 //
 // The parameters that can be configured in RRF are R25 (the resistance at 25C), Beta, and optionally C.
+//
+// Evaluating this needs a logarithm, which is slow on processors without a FPU. So when the parameters are configured we tabulate the temperature
+// against the ADC reading normalised to the VSSA..VREF range. The temperature changes fastest near the ends of the range, so the table points
+// are spaced uniformly within each octave of distance from the nearer end, with 8 points per octave. Interpolation between them needs only shifts.
 
 class Thermistor : public SensorWithPort
 {
@@ -28,22 +32,42 @@ public:
 	static constexpr const char *TypeNamePT1000 = "pt1000";
 
 	void Poll() override;
+	uint32_t GetPollInterval() const override { return MinHeatSampleIntervalMillis; }
 
 private:
 	// For the theory behind ADC oversampling, see http://www.atmel.com/Images/doc8003.pdf
 	static constexpr unsigned int AdcOversampleBits = 2;					// we use 2-bit oversampling
 
-	void CalcDerivedParameters();											// calculate shA and shB
+	void CalcDerivedParameters();											// build the temperature table
+	float CalcThermistorTemperature(float resistance) const;				// evaluate the Steinhart-Hart equation, used to build the table
+	float LookUpTemperature(int32_t quarterCounts) const;					// interpolate the table
+
 
 	// The following are configurable parameters
 	int adcFilterChannel;
 	float r25, beta, shC, seriesR;											// parameters declared in the M305 command
 	bool isPT1000;															// true if it is a PT1000 sensor, not a thermistor
 	int8_t adcLowOffset, adcHighOffset;										// ADC low and high end offsets
+	uint8_t readingsAveraged;												// the number of ADC readings to average, or 0 for the default
 
 	// The following are derived from the configurable parameters
 	float shA, shB;															// derived parameters
 
+	// The table has one half for the lower half of the ADC range, indexed by the reading, and one for the upper half, indexed by the range minus the reading
+	static constexpr unsigned int TableOctaveBits = 3;						// we have 8 table entries per octave
+	static constexpr unsigned int LogHalfRange = AnalogIn::AdcBits + AdcOversampleBits - 1;
+	static constexpr size_t HalfTableEntries = ((LogHalfRange + 1 - TableOctaveBits) << TableOctaveBits) + 1;
+	static constexpr int32_t TableUnitsPerDegree = 64;						// the table holds temperatures in units of 1/64C
+	int16_t temperatureTable[2 * HalfTableEntries];
+
+	// Get the distance from the nearer end of the range in ADC counts that a table entry corresponds to
+	static constexpr uint32_t TablePosition(size_t index)
+	{
+		return (index < (2u << TableOctaveBits))
+				? index
+					: (((1u << TableOctaveBits) + (index & ((1u << TableOctaveBits) - 1))) << ((index >> TableOctaveBits) - 1));
+	}
+
 #if defined(SAME70) && SAME70
 	static constexpr unsigned int AdcBits = 14;								// We use the SAME70 ADC in x16 oversample mode
 #else
@@ -63,8 +63,13 @@ const SpiMode MAX31855_SpiMode = SpiMode::mode0;
 // Define the minimum interval between readings
 const uint32_t MinimumReadInterval = 100;		// minimum interval between reads, in milliseconds
 
+// The chip compensates for the cold junction itself, so we only need the low 16 bits for the fault details and the board temperature.
+// Most reads clock out just the high 16 bits, and we read all 32 bits at this interval or when the fault bit is set.
+const uint32_t FullReadInterval = 2000;			// milliseconds
+
 ThermocoupleSensor31855::ThermocoupleSensor31855(unsigned int sensorNum)
-	: SpiTemperatureSensor(sensorNum, "Thermocouple (MAX31855)", MAX31855_SpiMode, MAX31855_Frequency)
+	: SpiTemperatureSensor(sensorNum, "Thermocouple (MAX31855)", MAX31855_SpiMode, MAX31855_Frequency),
+	  coldJunctionTemperature(BadErrorTemperature), whenLastFullRead(0)
 {
 }
 
@@ -81,75 +86,114 @@ GCodeResult ThermocoupleSensor31855::Configure(const CanMessageGenericParser& pa
 	{
 		// Initialise the sensor
 		InitSpi();
+		whenLastFullRead = millis() - FullReadInterval;			// make the first read a full one
 	}
 	else
 	{
 		CopyBasicDetails(reply);
+		reply.catf(", cold junction %.1fC", (double)coldJunctionTemperature);
 	}
 	return GCodeResult::ok;
 }
 
 void ThermocoupleSensor31855::Poll()
 {
+	const bool fullRead = millis() - whenLastFullRead >= FullReadInterval;
 	uint32_t rawVal;
-	TemperatureError sts = DoSpiTransaction(nullptr, 4, rawVal);
+	TemperatureError sts = DoSpiTransaction(nullptr, (fullRead) ? 4 : 2, rawVal);
 	if (sts != TemperatureError::success)
 	{
 		SetResult(sts);
 	}
+	else if (fullRead)
+	{
+		whenLastFullRead = millis();
+		ProcessFullReading(rawVal);
+	}
+	else if ((rawVal & 0x0002) != 0)
+	{
+		// The reserved bit should always read 0. Likely the read was 0xFF 0xFF which is not uncommon when first powering up
+		SetResult(TemperatureError::ioError);
+	}
+	else if ((rawVal & 0x0001) != 0)
+	{
+		// The fault bit is set, so read the whole word to find out why
+		delayMicroseconds(1);
+		sts = DoSpiTransaction(nullptr, 4, rawVal);
+		if (sts != TemperatureError::success)
+		{
+			SetResult(sts);
+		}
+		else
+		{
+			whenLastFullRead = millis();
+			ProcessFullReading(rawVal);
+		}
+	}
 	else
 	{
-		if ((rawVal & 0x00020008) != 0)
+		rawVal >>= 2;							// shift the 14-bit temperature data to the bottom of the word
+		rawVal |= (0 - (rawVal & 0x2000));		// sign-extend the sign bit
+
+		// And convert to from units of 1/4C to 1C
+		SetResult((float)(0.25 * (float)(int32_t)rawVal), TemperatureError::success);
+	}
+}
+
+void ThermocoupleSensor31855::ProcessFullReading(uint32_t rawVal)
+{
+	if ((rawVal & 0x00020008) != 0)
+	{
+		// These two bits should always read 0. Likely the entire read was 0xFF 0xFF which is not uncommon when first powering up
+		SetResult(TemperatureError::ioError);
+	}
+	else if ((rawVal & 0x00010007) != 0)		// check the fault bits
+	{
+		// Check for three more types of bad reads as we set the response code:
+		//   1. A read in which the fault indicator bit (16) is set but the fault reason bits (0:2) are all clear;
+		//   2. A read in which the fault indicator bit (16) is clear, but one or more of the fault reason bits (0:2) are set; and,
+		//   3. A read in which more than one of the fault reason bits (0:1) are set.
+		if ((rawVal & 0x00010000) == 0)
 		{
-			// These two bits should always read 0. Likely the entire read was 0xFF 0xFF which is not uncommon when first powering up
+			// One or more fault reason bits are set but the fault indicator bit is clear
 			SetResult(TemperatureError::ioError);
 		}
-		else if ((rawVal & 0x00010007) != 0)		// check the fault bits
+		else
 		{
-			// Check for three more types of bad reads as we set the response code:
-			//   1. A read in which the fault indicator bit (16) is set but the fault reason bits (0:2) are all clear;
-			//   2. A read in which the fault indicator bit (16) is clear, but one or more of the fault reason bits (0:2) are set; and,
-			//   3. A read in which more than one of the fault reason bits (0:1) are set.
-			if ((rawVal & 0x00010000) == 0)
+			// At this point we are assured that bit 16 (fault indicator) is set and that at least one of the fault reason bits (0:2) are set.
+			// We now need to ensure that only one fault reason bit is set.
+			if (rawVal & 0x01)
 			{
-				// One or more fault reason bits are set but the fault indicator bit is clear
-				SetResult(TemperatureError::ioError);
+				// Open Circuit
+				SetResult(TemperatureError::openCircuit);
+			}
+			else if (rawVal & 0x02)
+			{
+				// Short to ground;
+				SetResult(TemperatureError::shortToGround);
+			}
+			else if (rawVal & 0x04)
+			{
+				// Short to Vcc
+				SetResult(TemperatureError::shortToVcc);
 			}
 			else
 			{
-				// At this point we are assured that bit 16 (fault indicator) is set and that at least one of the fault reason bits (0:2) are set.
-				// We now need to ensure that only one fault reason bit is set.
-				if (rawVal & 0x01)
-				{
-					// Open Circuit
-					SetResult(TemperatureError::openCircuit);
-				}
-				else if (rawVal & 0x02)
-				{
-					// Short to ground;
-					SetResult(TemperatureError::shortToGround);
-				}
-				else if (rawVal && 0x04)
-				{
-					// Short to Vcc
-					SetResult(TemperatureError::shortToVcc);
-				}
-				else
-				{
-					// Fault indicator was set but a fault reason was not set (nbits == 0) or too many fault reason bits were set (nbits > 1).
-					// Assume that a communication error with the MAX31855 has occurred.
-					SetResult(TemperatureError::ioError);
-				}
+				// Fault indicator was set but a fault reason was not set (nbits == 0) or too many fault reason bits were set (nbits > 1).
+				// Assume that a communication error with the MAX31855 has occurred.
+				SetResult(TemperatureError::ioError);
 			}
 		}
-		else
-		{
-			rawVal >>= 18;							// shift the 14-bit temperature data to the bottom of the word
-			rawVal |= (0 - (rawVal & 0x2000));		// sign-extend the sign bit
+	}
+	else
+	{
+		coldJunctionTemperature = (float)(int16_t)(rawVal & 0xFFF0) * (1.0/256.0);	// 12-bit signed value in units of 1/16C in bits 15:4
 
-			// And convert to from units of 1/4C to 1C
-			SetResult((float)(0.25 * (float)(int32_t)rawVal), TemperatureError::success);
-		}
+		rawVal >>= 18;							// shift the 14-bit temperature data to the bottom of the word
+		rawVal |= (0 - (rawVal & 0x2000));		// sign-extend the sign bit
+
+		// And convert to from units of 1/4C to 1C
+		SetResult((float)(0.25 * (float)(int32_t)rawVal), TemperatureError::success);
 	}
 }
 
@@ -21,6 +21,12 @@ public:
 	static constexpr const char *TypeName = "thermocouplemax31855";
 
 	void Poll() override;
+
+private:
+	void ProcessFullReading(uint32_t rawVal);
+
+	float coldJunctionTemperature;
+	uint32_t whenLastFullRead;
 };
 
 #endif
@@ -66,7 +66,7 @@ ThermocoupleSensor31856::ThermocoupleSensor31856(unsigned int sensorNum)
 GCodeResult ThermocoupleSensor31856::Configure(const CanMessageGenericParser& parser, const StringRef& reply)
 {
 	bool seen = false;
-	if (!ConfigurePort(parser, reply, seen))
+	if (!ConfigurePortWithDataReady(parser, reply, seen))
 	{
 		return GCodeResult::error;
 	}
@@ -132,6 +132,7 @@ GCodeResult ThermocoupleSensor31856::Configure(const CanMessageGenericParser& pa
 	{
 		CopyBasicDetails(reply);
 		reply.catf(", thermocouple type %c, reject %dHz", TypeLetters[thermocoupleType], (cr0 & 0x01) ? 50 : 60);
+		AppendDataReadyDetails(reply);
 	}
 	return GCodeResult::ok;
 }
@@ -164,8 +165,15 @@ TemperatureError ThermocoupleSensor31856::TryInitThermocouple() const
 	return sts;
 }
 
+// The chip converts continuously. If we have a data ready pin then we only read the result when there is a new one, and the reading times out if the pin stops signalling.
+// The fault status register follows the temperature registers, so reading it in the same transaction costs only one more byte.
 void ThermocoupleSensor31856::Poll()
 {
+	if (!IsNewDataAvailable())
+	{
+		return;
+	}
+
 	static const uint8_t dataOut[5] = {0x0C, 0x55, 0x55, 0x55, 0x55};	// read registers LTCB0, LTCB1, LTCB2, Fault status
 	uint32_t rawVal;
 	TemperatureError sts = DoSpiTransaction(dataOut, ARRAY_SIZE(dataOut), rawVal);
@@ -11,7 +11,11 @@
 #if HAS_SMART_DRIVERS
 
 TmcDriverTemperatureSensor::TmcDriverTemperatureSensor(unsigned int sensorNum)
+#if SUPPORT_DRIVER_TEMPERATURE_ESTIMATION
+	: TemperatureSensor(sensorNum, "TMC estimated temperature")
+#else
 	: TemperatureSensor(sensorNum, "TMC temperature warnings")
+#endif
 {
 }
 
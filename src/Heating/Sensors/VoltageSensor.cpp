@@ -0,0 +1,53 @@
+/*
+ * VoltageSensor.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "VoltageSensor.h"
+#include "Platform.h"
+#include "CanMessageGenericParser.h"
+
+#if HAS_VOLTAGE_MONITOR
+
+VoltageSensor::VoltageSensor(unsigned int sensorNum, bool p_isV12)
+	: TemperatureSensor(sensorNum, (p_isV12) ? "V12 voltage" : "VIN voltage"), pollInterval(HeatSampleIntervalMillis), isV12(p_isV12)
+{
+}
+
+GCodeResult VoltageSensor::Configure(const CanMessageGenericParser& parser, const StringRef& reply)
+{
+	if (!GetPollIntervalParam(parser, pollInterval) && !parser.HasParameter('Y'))
+	{
+		CopyBasicDetails(reply);
+#if HAS_12V_MONITOR
+		if (isV12)
+		{
+			reply.catf(", min %.1fV max %.1fV", (double)Platform::GetMinV12Voltage(), (double)Platform::GetMaxV12Voltage());
+		}
+		else
+#endif
+		{
+			reply.catf(", min %.1fV max %.1fV", (double)Platform::GetMinVinVoltage(), (double)Platform::GetMaxVinVoltage());
+		}
+		reply.catf(", interval %" PRIu32 "ms", pollInterval);
+	}
+	return GCodeResult::ok;
+}
+
+void VoltageSensor::Poll()
+{
+#if HAS_12V_MONITOR
+	if (isV12)
+	{
+		SetResult(Platform::GetCurrentV12Voltage(), TemperatureError::success);
+		return;
+	}
+#endif
+	SetResult(Platform::GetCurrentVinVoltage(), TemperatureError::success);
+}
+
+#endif
+
+// End
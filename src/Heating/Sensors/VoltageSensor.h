@@ -0,0 +1,38 @@
+/*
+ * VoltageSensor.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  Virtual sensors that report the VIN or V12 voltage from the Platform averaging filters, so that the main board gets them in the sensor broadcasts.
+ *  The reading is in volts.
+ */
+
+#ifndef SRC_HEATING_SENSORS_VOLTAGESENSOR_H_
+#define SRC_HEATING_SENSORS_VOLTAGESENSOR_H_
+
+#include "TemperatureSensor.h"
+
+#if HAS_VOLTAGE_MONITOR
+
+class VoltageSensor : public TemperatureSensor
+{
+public:
+	VoltageSensor(unsigned int sensorNum, bool p_isV12);
+
+	GCodeResult Configure(const CanMessageGenericParser& parser, const StringRef& reply) override;
+
+	static constexpr const char *TypeNameVin = "vin";
+	static constexpr const char *TypeNameV12 = "v12";
+
+	void Poll() override;
+	uint32_t GetPollInterval() const override { return pollInterval; }
+
+private:
+	uint32_t pollInterval;
+	bool isV12;
+};
+
+#endif
+
+#endif /* SRC_HEATING_SENSORS_VOLTAGESENSOR_H_ */
@@ -0,0 +1,175 @@
+/*
+ * Telemetry.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "Telemetry.h"
+#include <CanMessageBuffer.h>
+#include <CAN/CanInterface.h>
+#include <RTOSIface/RTOSIface.h>
+#include <StackSizes.h>
+
+static Task<StackSizes::TelemetryTaskWords> telemetryTask;
+
+namespace Telemetry
+{
+	// A report that the heater task has built. The heater task only writes it while it isn't pending and the telemetry task only reads it while it is.
+	template<class T> struct Snapshot
+	{
+		T msg;
+		uint8_t numReported;
+		volatile bool pending;
+	};
+
+	static volatile bool announcePending = false;
+	static Snapshot<CanMessageSensorTemperatures> sensorTemperatures;
+	static Snapshot<CanMessageHeatersStatus> heatersStatus;
+	static Snapshot<CanMessageFansReport> fansReport;
+#if HAS_SMART_DRIVERS
+	static Snapshot<CanMessageDriversStatus> driversStatus;
+#endif
+
+	static unsigned int numReportsSent = 0, numReportsDeferred = 0;		// for diagnostics
+	static uint32_t longestSendMillis = 0;								// the longest time we took to send the reports from one wakeup, for diagnostics
+
+	template<class T> static T *GetSnapshot(Snapshot<T>& snapshot)
+	{
+		if (snapshot.pending)
+		{
+			++numReportsDeferred;
+			return nullptr;
+		}
+		return &snapshot.msg;
+	}
+
+	template<class T> static void PostSnapshot(Snapshot<T>& snapshot, unsigned int numReported)
+	{
+		if (numReported != 0)
+		{
+			snapshot.numReported = (uint8_t)numReported;
+			__DMB();															// make sure the telemetry task sees the whole report when it sees that it is pending
+			snapshot.pending = true;
+			telemetryTask.Give();
+		}
+	}
+
+	// Send a snapshot if it is pending and then let the heater task have it back
+	template<class T> static void SendSnapshot(Snapshot<T>& snapshot, CanMessageBuffer *buf, bool broadcast)
+	{
+		if (snapshot.pending)
+		{
+			T * const msg = (broadcast) ? buf->SetupBroadcastMessage<T>(CanInterface::GetCanAddress())
+								: buf->SetupStatusMessage<T>(CanInterface::GetCanAddress(), CanId::MasterAddress);
+			*msg = snapshot.msg;
+			buf->dataLength = msg->GetActualDataLength(snapshot.numReported);
+			__DMB();															// make sure we have finished with the snapshot before we release it
+			snapshot.pending = false;
+			CanInterface::Send(buf);
+			++numReportsSent;
+		}
+	}
+}
+
+extern "C" [[noreturn]] void TelemetryLoop(void *)
+{
+	// Get a message buffer. We use the same one all the time and never release it.
+	CanMessageBuffer * const buf = CanInterface::AllocateBuffer(CanInterface::BufferUser::telemetry);
+
+	for (;;)
+	{
+		TaskBase::Take();
+		const uint32_t startTime = millis();
+		if (Telemetry::announcePending)
+		{
+			Telemetry::announcePending = false;
+			CanInterface::SendAnnounce(buf);
+		}
+		Telemetry::SendSnapshot(Telemetry::sensorTemperatures, buf, true);
+		Telemetry::SendSnapshot(Telemetry::heatersStatus, buf, false);
+		Telemetry::SendSnapshot(Telemetry::fansReport, buf, false);
+#if HAS_SMART_DRIVERS
+		if (Telemetry::driversStatus.pending)
+		{
+			CanMessageDriversStatus * const msg = buf->SetupStatusMessage<CanMessageDriversStatus>(CanInterface::GetCanAddress(), CanId::MasterAddress);
+			*msg = Telemetry::driversStatus.msg;
+			buf->dataLength = msg->GetActualDataLength();
+			__DMB();
+			Telemetry::driversStatus.pending = false;
+			CanInterface::Send(buf);
+			++Telemetry::numReportsSent;
+		}
+#endif
+		const uint32_t sendMillis = millis() - startTime;
+		if (sendMillis > Telemetry::longestSendMillis)
+		{
+			Telemetry::longestSendMillis = sendMillis;
+		}
+	}
+}
+
+void Telemetry::Init()
+{
+	telemetryTask.Create(TelemetryLoop, "TELEM", nullptr, TaskPriority::TelemetryPriority);
+}
+
+// Ask for our announcement to be sent. CanInterface::SendAnnounce doesn't send it once the main board has acknowledged it.
+void Telemetry::PostAnnounce()
+{
+	announcePending = true;
+	telemetryTask.Give();
+}
+
+CanMessageSensorTemperatures *Telemetry::GetSensorTemperaturesSnapshot()
+{
+	return GetSnapshot(sensorTemperatures);
+}
+
+void Telemetry::PostSensorTemperatures(unsigned int numReported)
+{
+	PostSnapshot(sensorTemperatures, numReported);
+}
+
+CanMessageHeatersStatus *Telemetry::GetHeatersStatusSnapshot()
+{
+	return GetSnapshot(heatersStatus);
+}
+
+void Telemetry::PostHeatersStatus(unsigned int numReported)
+{
+	PostSnapshot(heatersStatus, numReported);
+}
+
+CanMessageFansReport *Telemetry::GetFansReportSnapshot()
+{
+	return GetSnapshot(fansReport);
+}
+
+void Telemetry::PostFansReport(unsigned int numReported)
+{
+	PostSnapshot(fansReport, numReported);
+}
+
+#if HAS_SMART_DRIVERS
+
+CanMessageDriversStatus *Telemetry::GetDriversStatusSnapshot()
+{
+	return GetSnapshot(driversStatus);
+}
+
+void Telemetry::PostDriversStatus()
+{
+	PostSnapshot(driversStatus, 1);
+}
+
+#endif
+
+void Telemetry::Diagnostics(const StringRef& reply)
+{
+	reply.lcatf("Telemetry reports sent %u, deferred %u, longest send %" PRIu32 "ms", numReportsSent, numReportsDeferred, longestSendMillis);
+	numReportsSent = numReportsDeferred = 0;
+	longestSendMillis = 0;
+}
+
+// End
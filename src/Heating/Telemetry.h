@@ -0,0 +1,40 @@
+/*
+ * Telemetry.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  The task that sends our announcement and the sensor, heater, fan and driver status reports, so that the heater task never waits for the CAN bus.
+ *  The heater task builds each report in a snapshot and posts it. The telemetry task runs at a lower priority, copies each posted snapshot into its
+ *  CAN buffer and sends it, and then frees the snapshot. While a snapshot is still waiting to be sent the heater task can't get it, so it defers
+ *  that report to a later cycle. It doesn't record the values as reported until it posts them, so a deferred change is reported later instead of lost.
+ */
+
+#ifndef SRC_HEATING_TELEMETRY_H_
+#define SRC_HEATING_TELEMETRY_H_
+
+#include <RepRapFirmware.h>
+#include <CanMessageFormats.h>
+
+namespace Telemetry
+{
+	void Init();
+
+	// These are called by the heater task. The Get functions return nullptr if the last report of that kind hasn't been sent yet.
+	// Each Post function takes the number of items in the report, and if that is zero it frees the snapshot without sending anything.
+	void PostAnnounce();
+	CanMessageSensorTemperatures *GetSensorTemperaturesSnapshot();
+	void PostSensorTemperatures(unsigned int numReported);
+	CanMessageHeatersStatus *GetHeatersStatusSnapshot();
+	void PostHeatersStatus(unsigned int numReported);
+	CanMessageFansReport *GetFansReportSnapshot();
+	void PostFansReport(unsigned int numReported);
+#if HAS_SMART_DRIVERS
+	CanMessageDriversStatus *GetDriversStatusSnapshot();
+	void PostDriversStatus();
+#endif
+
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif /* SRC_HEATING_TELEMETRY_H_ */
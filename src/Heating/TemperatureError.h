@@ -29,7 +29,8 @@ enum class TemperatureError : uint8_t
 	unknownSensor,
 	overOrUnderVoltage,
 	badVref,
-	badVssa
+	badVssa,
+	sensorsDisagree							// the two sensors of a heater read too far apart for us to tell which one is right
 };
 
 const char* TemperatureErrorString(TemperatureError err);
@@ -0,0 +1,252 @@
+/*
+ * AnalogStream.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "AnalogStream.h"
+
+#if SUPPORT_ANALOG_STREAMING
+
+#include <CAN/CanInterface.h>
+#include <CanMessageBuffer.h>
+#include <CanMessageGenericParser.h>
+#include <Hardware/AnalogIn.h>
+#include <Hardware/IoPorts.h>
+#include <Movement/StepTimer.h>
+#include <RTOSIface/RTOSIface.h>
+
+namespace AnalogStream
+{
+#if defined(SAME51)
+	constexpr size_t BufferSize = 256;								// the number of samples we can hold, must be a power of 2
+#else
+	constexpr size_t BufferSize = 64;
+#endif
+	static_assert((BufferSize & (BufferSize - 1)) == 0, "BufferSize must be a power of 2");
+	constexpr size_t MaxSamplesPerMessage = ARRAY_SIZE(CanMessageAnalogStreamData::data);
+	constexpr uint16_t MaxDecimation = 256;
+	constexpr uint16_t MaxInterval = 1000;							// the longest interval between readings in milliseconds
+	constexpr uint32_t MaxLatencyMillis = 20;						// we send a part-filled message when its first sample has waited this long
+
+	static IoPort port;
+	static volatile bool running = false;
+	static uint16_t interval = 0;									// in milliseconds, 0 to read the input on every round of conversions
+	static uint16_t decimation = 1;									// the number of readings that we average into each sample
+	static uint32_t numSamplesRequested = 0;						// 0 to stream until we are told to stop
+
+	// Variables only used by the ADC task
+	static uint32_t readingsSum;
+	static uint16_t readingsInSum;
+	static uint32_t numSamplesTaken;
+
+	// The samples waiting to be sent. The ADC task advances putCount and the async sender task advances getCount, and neither wraps past the other.
+	static uint16_t samples[BufferSize];
+	static uint32_t sampleTicks[BufferSize];						// the step clock when each sample was completed
+	static volatile uint32_t putCount = 0, getCount = 0;
+	static volatile bool overflowed = false;						// true if we lost samples since the last message because the buffer was full
+
+	// Variables only used by the async sender task
+	static uint16_t nextSampleNumber;
+
+	// Statistics
+	static uint32_t numSamplesSent = 0, numMessagesSent = 0, numSamplesLost = 0;
+
+	// This is called by the ADC task each time the input has been converted
+	static void ReadingCallback(CallbackParameter, uint16_t reading)
+	{
+		if (!running)
+		{
+			return;
+		}
+
+		readingsSum += reading;
+		if (++readingsInSum < decimation)
+		{
+			return;
+		}
+
+		const uint16_t sample = (uint16_t)(readingsSum/readingsInSum);
+		readingsSum = 0;
+		readingsInSum = 0;
+		++numSamplesTaken;
+		const uint32_t put = putCount;
+		if (put - getCount >= BufferSize)
+		{
+			++numSamplesLost;										// the sender isn't keeping up
+			overflowed = true;
+		}
+		else
+		{
+			samples[put & (BufferSize - 1)] = sample;
+			sampleTicks[put & (BufferSize - 1)] = StepTimer::GetTimerTicks();
+			putCount = put + 1;
+		}
+
+		if (numSamplesRequested != 0 && numSamplesTaken >= numSamplesRequested)
+		{
+			running = false;
+			CanInterface::WakeAsyncSender();						// so that it sends the rest straight away
+		}
+		else if (putCount - getCount == MaxSamplesPerMessage)
+		{
+			CanInterface::WakeAsyncSender();
+		}
+	}
+
+	static void Stop()
+	{
+		running = false;
+		if (port.IsValid())
+		{
+			(void)AnalogIn::SetCallback(port.GetPin(), nullptr, CallbackParameter(), 0, false);
+			port.Release();
+		}
+	}
+
+	static void AppendStatus(const StringRef& reply)
+	{
+		reply.catf(" on ");
+		port.AppendPinName(reply);
+		if (interval == 0)
+		{
+			reply.cat(" every conversion");
+		}
+		else
+		{
+			reply.catf(" every %ums", interval);
+		}
+		reply.catf(", decimation %u, %s, samples sent %" PRIu32 " in %" PRIu32 " messages, lost %" PRIu32,
+					decimation, (running) ? "streaming" : "stopped", numSamplesSent, numMessagesSent, numSamplesLost);
+	}
+}
+
+// Start or stop streaming. The P parameter gives the port ("nil" to stop), R the interval between readings in milliseconds (default 0 to read on
+// every round of conversions), D the number of readings averaged into each sample and N the number of samples (default 0 to stream until stopped).
+GCodeResult AnalogStream::Configure(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, AnalogStreamParams);
+	String<StringLength20> portName;
+	if (!parser.GetStringParam('P', portName.GetRef()))
+	{
+		if (port.IsValid())
+		{
+			reply.copy("Analog stream");
+			AppendStatus(reply);
+		}
+		else
+		{
+			reply.copy("No analog stream");
+		}
+		return GCodeResult::ok;
+	}
+
+	uint16_t newInterval = 0, newDecimation = 1;
+	uint32_t newNumSamples = 0;
+	(void)parser.GetUintParam('R', newInterval);
+	(void)parser.GetUintParam('D', newDecimation);
+	(void)parser.GetUintParam('N', newNumSamples);
+	if (newInterval > MaxInterval || newDecimation == 0 || newDecimation > MaxDecimation)
+	{
+		reply.printf("Interval must be at most %ums and decimation between 1 and %u", MaxInterval, MaxDecimation);
+		return GCodeResult::error;
+	}
+
+	Stop();
+	if (!port.AssignPort(portName.c_str(), reply, PinUsedBy::sensor, PinAccess::readAnalog))
+	{
+		return GCodeResult::error;
+	}
+	if (!port.IsValid())
+	{
+		return GCodeResult::ok;										// the port was "nil", so we just stop
+	}
+
+	// The sender may still be sending samples from the previous stream, so discard them before we start the new one
+	{
+		TaskCriticalSectionLocker lock;
+		getCount = putCount;
+		overflowed = false;
+	}
+	interval = newInterval;
+	decimation = newDecimation;
+	numSamplesRequested = newNumSamples;
+	readingsSum = 0;
+	readingsInSum = 0;
+	numSamplesTaken = 0;
+	nextSampleNumber = 0;
+	numSamplesSent = numMessagesSent = numSamplesLost = 0;
+	running = true;
+	if (!AnalogIn::SetCallback(port.GetPin(), ReadingCallback, CallbackParameter(), interval, false))
+	{
+		running = false;
+		port.Release();
+		reply.copy("Failed to start analog stream");
+		return GCodeResult::error;
+	}
+	return GCodeResult::ok;
+}
+
+// Send a message of samples if we have a full one, or if the stream has ended, or if the oldest sample has waited long enough
+uint32_t AnalogStream::Spin(CanMessageBuffer *buf)
+{
+	uint32_t get = getCount;
+	const size_t numAvailable = putCount - get;
+	if (numAvailable == 0)
+	{
+		return (running) ? MaxLatencyMillis : TaskBase::TimeoutUnlimited;
+	}
+
+	if (running && numAvailable < MaxSamplesPerMessage)
+	{
+		const uint32_t waitedMillis = (StepTimer::GetTimerTicks() - sampleTicks[get & (BufferSize - 1)])/(StepTimer::StepClockRate/1000);
+		if (waitedMillis < MaxLatencyMillis)
+		{
+			return MaxLatencyMillis - waitedMillis;
+		}
+	}
+
+	if (!CanInterface::IsTxIdle())
+	{
+		return 1;													// leave the transmitter to our other messages
+	}
+
+	const size_t numToSend = min<size_t>(numAvailable, MaxSamplesPerMessage);
+	CanMessageAnalogStreamData * const msg = buf->SetupStatusMessage<CanMessageAnalogStreamData>(CanInterface::GetCanAddress(), CanId::MasterAddress);
+	msg->firstSampleNumber = nextSampleNumber;
+	msg->firstSampleTime = StepTimer::ConvertToMasterTime(sampleTicks[get & (BufferSize - 1)]);
+	msg->lastSampleTime = StepTimer::ConvertToMasterTime(sampleTicks[(get + numToSend - 1) & (BufferSize - 1)]);
+	msg->numSamples = numToSend;
+	msg->overflowed = overflowed;
+	msg->zero = 0;
+	overflowed = false;
+	for (size_t i = 0; i < numToSend; ++i)
+	{
+		msg->data[i] = samples[(get + i) & (BufferSize - 1)];
+	}
+	get += numToSend;
+	getCount = get;
+	nextSampleNumber += numToSend;
+	msg->lastPacket = !running && get == putCount;
+	buf->dataLength = msg->GetActualDataLength();
+	if (CanInterface::Send(buf))
+	{
+		++numMessagesSent;
+		numSamplesSent += numToSend;
+	}
+	return (putCount != get) ? 0 : (running) ? MaxLatencyMillis : TaskBase::TimeoutUnlimited;
+}
+
+void AnalogStream::Diagnostics(const StringRef& reply)
+{
+	if (port.IsValid())
+	{
+		reply.lcatf("Analog stream");
+		AppendStatus(reply);
+	}
+}
+
+#endif
+
+// End
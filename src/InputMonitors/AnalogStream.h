@@ -0,0 +1,35 @@
+/*
+ * AnalogStream.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Streams the readings of one analog input to the main board, so that it can monitor a probe, pressure sensor or filament width sensor live.
+ *  The input is converted on every round of ADC conversions or at a chosen interval, and each sample is the mean of a chosen number of readings.
+ *  The samples are timestamped with the step clock as they are taken and sent in analogStreamData messages that hold the master times of the first
+ *  and last samples, so the main board can place every sample in time. We only send when our CAN transmitter is idle, so that the stream never delays
+ *  our other messages, and the message type has the lowest priority on the bus.
+ */
+
+#ifndef SRC_INPUTMONITORS_ANALOGSTREAM_H_
+#define SRC_INPUTMONITORS_ANALOGSTREAM_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_ANALOG_STREAMING
+
+#include <GCodes/GCodeResult.h>
+
+class CanMessageBuffer;
+struct CanMessageGeneric;
+
+namespace AnalogStream
+{
+	GCodeResult Configure(const CanMessageGeneric& msg, const StringRef& reply);	// process an analogStream message
+	uint32_t Spin(CanMessageBuffer *buf);											// called by the async sender task, returns the maximum time in milliseconds before we want to be called again
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif
+
+#endif /* SRC_INPUTMONITORS_ANALOGSTREAM_H_ */
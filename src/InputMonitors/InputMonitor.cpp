@@ -10,29 +10,115 @@
 #include <CanMessageFormats.h>
 #include <Hardware/IoPorts.h>
 #include <CAN/CanInterface.h>
-
-InputMonitor *InputMonitor::monitorsList = nullptr;
+#include <CanMessageBuffer.h>
+#include <Movement/StepTimer.h>
+#include <Movement/Move.h>
+#include <Platform.h>
+#include <Hardware/FastStop.h>
+#include "LoadCell.h"
+#include <cctype>
+
+#if SUPPORT_TMC22xx
+# include <Movement/StepperDrivers/TMC22xx.h>
+# include <Hardware/Interrupts.h>
+#endif
+#if SUPPORT_TMC51xx
+# include <Movement/StepperDrivers/TMC51xx.h>
+#endif
+
+InputMonitor *InputMonitor::monitors[MaxInputMonitors] = { 0 };
+uint8_t InputMonitor::handleIndex[HandleIndexSize];
+uint32_t InputMonitor::usedSlots = 0;
+volatile uint32_t InputMonitor::pendingSends = 0;
 InputMonitor *InputMonitor::freeList = nullptr;
 ReadWriteLock InputMonitor::listLock;
+uint32_t InputMonitor::coalescingMillis = 10;
+volatile uint32_t InputMonitor::stallMonitoredDrivers = 0;
+
+#if HAS_STALL_DETECT
+
+// Check whether a pin name refers to the stall status of a local driver, e.g. "stall0". Return the driver number, or NumDrivers if it doesn't.
+static unsigned int GetStallDriverNumber(const char *pinName)
+{
+	if (StringStartsWith(pinName, "stall") && isdigit(pinName[5]))
+	{
+		unsigned int driver = 0;
+		const char *p = pinName + 5;
+		while (isdigit(*p) && driver < NumDrivers)
+		{
+			driver = (driver * 10) + (*p - '0');
+			++p;
+		}
+		if (*p == 0 && driver < NumDrivers)
+		{
+			return driver;
+		}
+	}
+	return NumDrivers;
+}
+
+#endif
 
 bool InputMonitor::Activate()
 {
 	bool ok = true;
 	if (!active)
 	{
+#if HAS_STALL_DETECT
+		if (IsStallMonitor())
+		{
+# if SUPPORT_TMC22xx
+			// The driver signals a stall on its DIAG pin, so we can use a pin change interrupt
+			const irqflags_t flags = cpu_irq_save();
+			ok = AttachInterrupt(DriverDiagPins[stallDriver], CommonStallPinInterrupt, InterruptMode::change, CallbackParameter(this));
+			state = IoPort::ReadPin(DriverDiagPins[stallDriver]);
+			cpu_irq_restore(flags);
+# else
+			// The driver task tells us when the stall status changes
+			state = (SmartDrivers::GetLiveStatus(stallDriver) & TMC_RR_SG) != 0;
+# endif
+		}
+		else
+#endif
+#if HAS_VOLTAGE_MONITOR
+		if (monitorsPowerFail)
+		{
+			(void)SetPowerFailMonitor();
+		}
+		else
+#endif
+#if SUPPORT_LOAD_CELL_PROBE
+		if (monitorsLoadCell)
+		{
+			ok = LoadCell::Start(threshold, CommonLoadCellInterrupt, CallbackParameter(this));
+			state = LoadCell::IsTriggered();
+		}
+		else
+#endif
 		if (threshold == 0)
 		{
 			// Digital input
 			const irqflags_t flags = cpu_irq_save();
-			ok = port.AttachInterrupt(CommonDigitalPortInterrupt, InterruptMode::change, CallbackParameter(this));
+			ok = port.AttachInterrupt(CommonDigitalPortInterrupt, InterruptMode::change, CallbackParameter(this), GetInterruptFilter(), (uint32_t)filter * DebounceUnitMicroseconds);
 			state = port.Read();
+#if SUPPORT_HARDWARE_FAST_STOP
+			if (usesFastStop && !state)
+			{
+				FastStop::Arm();
+			}
+#endif
 			cpu_irq_restore(flags);
 		}
 		else
 		{
 			// Analog port
 			state = port.ReadAnalog() >= threshold;
-			ok = port.SetAnalogCallback(CommonAnalogPortInterrupt, CallbackParameter(this), 1);
+			ok = port.SetAnalogCallback(CommonAnalogPortInterrupt, CallbackParameter(this), 0);		// convert on every round so that we respond to the threshold quickly
+			if (ok)
+			{
+				// If the ADC can compare the readings with the threshold in hardware, we get to know about a crossing one conversion after it happens instead of at the end of the round
+				(void)port.EnableAnalogWindowMonitor(threshold, CommonAnalogPortInterrupt, CallbackParameter(this));
+			}
 		}
 		active = true;
 		whenLastSent = millis();
@@ -44,9 +130,110 @@ bool InputMonitor::Activate()
 void InputMonitor::Deactivate()
 {
 	//TODO
+	if (active && IsAnalogPortMonitor())
+	{
+		port.DisableAnalogWindowMonitor();
+	}
+#if SUPPORT_HARDWARE_FAST_STOP
+	if (usesFastStop)
+	{
+		FastStop::Disarm();
+	}
+#endif
+#if HAS_VOLTAGE_MONITOR
+	if (active && monitorsPowerFail)
+	{
+		Platform::ClearPowerFailMonitor(CallbackParameter(this));
+	}
+#endif
+#if SUPPORT_LOAD_CELL_PROBE
+	if (active && monitorsLoadCell)
+	{
+		LoadCell::Stop(CallbackParameter(this));
+	}
+#endif
 	active = false;
 }
 
+#if HAS_VOLTAGE_MONITOR
+
+// Start or restart power fail monitoring at our threshold. Only one power fail monitor can be in use at a time, so this replaces any other one.
+bool InputMonitor::SetPowerFailMonitor()
+{
+	const float failVoltage = (float)((threshold == 0) ? DefaultPowerFailThreshold : threshold) * 0.1;
+	const irqflags_t flags = cpu_irq_save();
+	const bool usingWindowMonitor = Platform::SetPowerFailMonitor(failVoltage, CommonPowerFailInterrupt, CallbackParameter(this));
+	state = Platform::IsPowerFailing();
+	cpu_irq_restore(flags);
+	return usingWindowMonitor;
+}
+
+// This is called when the power starts to fail or recovers, from the ADC task or the ADC window monitor ISR, with interrupts disabled
+void InputMonitor::PowerFailInterrupt()
+{
+	const bool newState = Platform::IsPowerFailing();
+	if (newState != state)
+	{
+		state = newState;
+		if (active)
+		{
+			OnStateChanged(StepTimer::GetTimerTicks());
+			CanInterface::WakeAsyncSenderFromIsr();
+		}
+	}
+}
+
+/*static*/ void InputMonitor::CommonPowerFailInterrupt(CallbackParameter cbp)
+{
+	static_cast<InputMonitor*>(cbp.vp)->PowerFailInterrupt();
+}
+
+#endif
+
+#if SUPPORT_LOAD_CELL_PROBE
+
+// This is called by the AIN task when the load cell detects contact or release. 'whenTicks' is when the SDADC took the first reading that showed it.
+void InputMonitor::LoadCellInterrupt(bool triggered, uint32_t whenTicks)
+{
+	if (triggered != state)
+	{
+		const irqflags_t flags = cpu_irq_save();
+		state = triggered;
+		if (active)
+		{
+			OnStateChanged(whenTicks);
+			CanInterface::WakeAsyncSenderFromIsr();
+		}
+		cpu_irq_restore(flags);
+	}
+}
+
+/*static*/ void InputMonitor::CommonLoadCellInterrupt(CallbackParameter cbp, bool triggered, uint32_t whenTicks)
+{
+	static_cast<InputMonitor*>(cbp.vp)->LoadCellInterrupt(triggered, whenTicks);
+}
+
+#endif
+
+// Record that the state has changed and needs to be sent, and stop any local drivers bound to this input if it has triggered.
+// Called from an ISR, or with interrupts disabled. The caller must wake up the async sender task, which decides whether to send it now or hold it for a while.
+void InputMonitor::OnStateChanged(uint32_t changeTicks)
+{
+	if (state && driversToStop != 0)
+	{
+		moveInstance->StopDriversFromInput(driversToStop);
+	}
+
+	if (!sendDue)
+	{
+		whenChangedTicks = changeTicks;
+		whenChanged = millis();
+		sendDue = true;
+		AtomicCriticalSectionLocker lock;					// we may be interrupted by an ISR that reports a different monitor
+		pendingSends |= 1u << slot;
+	}
+}
+
 void InputMonitor::DigitalInterrupt()
 {
 	const bool newState = port.Read();
@@ -55,7 +242,26 @@ void InputMonitor::DigitalInterrupt()
 		state = newState;
 		if (active)
 		{
-			sendDue = true;
+#if SUPPORT_HARDWARE_FAST_STOP
+			if (usesFastStop)
+			{
+				if (newState)
+				{
+					FastStop::InputTriggered();			// the drivers are already disabled, so stop the moves and then enable them again
+					OnStateChanged(StepTimer::GetTimerTicks());
+					FastStop::RestoreDriversEnable();
+				}
+				else
+				{
+					FastStop::Arm();					// the EIC event for this edge has already happened, so it is safe to reconnect the route
+					OnStateChanged(StepTimer::GetTimerTicks());
+				}
+			}
+			else
+#endif
+			{
+				OnStateChanged(StepTimer::GetTimerTicks());
+			}
 			CanInterface::WakeAsyncSenderFromIsr();
 		}
 	}
@@ -64,20 +270,97 @@ void InputMonitor::DigitalInterrupt()
 void InputMonitor::AnalogInterrupt(uint16_t reading)
 {
 	const bool newState = reading >= threshold;
+#if SUPPORT_PROBE_SLOWDOWN
+	// If the probe is approaching its threshold, slow down the move so that it triggers accurately. The DDA only does this once per move.
+	if (!newState && slowDownThreshold != 0 && reading >= slowDownThreshold && active)
+	{
+		moveInstance->SlowDownFromInput(slowDownFactor);
+	}
+#endif
 	if (newState != state)
 	{
 		state = newState;
 		if (active)
 		{
-			sendDue = true;
+			OnStateChanged(StepTimer::GetTimerTicks());
 			CanInterface::WakeAsyncSenderFromIsr();
 		}
 	}
 }
 
+#if HAS_STALL_DETECT
+
+# if SUPPORT_TMC22xx
+
+void InputMonitor::StallPinInterrupt()
+{
+	const bool newState = IoPort::ReadPin(DriverDiagPins[stallDriver]);
+	if (newState != state)
+	{
+		state = newState;
+		if (active)
+		{
+			OnStateChanged(StepTimer::GetTimerTicks());
+			CanInterface::WakeAsyncSenderFromIsr();
+		}
+	}
+}
+
+/*static*/ void InputMonitor::CommonStallPinInterrupt(CallbackParameter cbp)
+{
+	static_cast<InputMonitor*>(cbp.vp)->StallPinInterrupt();
+}
+
+# endif
+
+// This is called by the driver task when the stall status of a driver changes. 'whenTicks' is the step clock when the driver reported it.
+/*static*/ void InputMonitor::DriverStallChanged(size_t driver, bool stalled, uint32_t whenTicks)
+{
+	bool changed = false;
+	{
+		ReadLocker lock(listLock);
+		for (uint32_t slots = usedSlots; slots != 0; )
+		{
+			const size_t slot = LowestSetBit(slots);
+			slots &= ~(1u << slot);
+			InputMonitor * const p = monitors[slot];
+			if (p->stallDriver == driver && p->active && p->state != stalled)
+			{
+				AtomicCriticalSectionLocker lock2;
+				p->state = stalled;
+				p->OnStateChanged(whenTicks);
+				changed = true;
+			}
+		}
+	}
+
+	if (changed)
+	{
+		CanInterface::WakeAsyncSender();
+	}
+}
+
+// Recalculate the bitmap of drivers that have stall monitors. Must own the write lock before calling this.
+/*static*/ void InputMonitor::UpdateStallMonitoredDrivers()
+{
+	uint32_t drivers = 0;
+	for (uint32_t slots = usedSlots; slots != 0; )
+	{
+		const size_t slot = LowestSetBit(slots);
+		slots &= ~(1u << slot);
+		if (monitors[slot]->IsStallMonitor())
+		{
+			drivers |= 1u << monitors[slot]->stallDriver;
+		}
+	}
+	stallMonitoredDrivers = drivers;
+}
+
+#endif
+
 /*static*/ void InputMonitor::Init()
 {
-	// Nothing needed here yet
+	RebuildIndex();
 }
 
 /*static*/ void InputMonitor::CommonDigitalPortInterrupt(CallbackParameter cbp)
@@ -90,43 +373,97 @@ void InputMonitor::AnalogInterrupt(uint16_t reading)
 	static_cast<InputMonitor*>(cbp.vp)->AnalogInterrupt(reading);
 }
 
-/*static*/ ReadLockedPointer<InputMonitor> InputMonitor::Find(uint16_t handle)
+// Find the slot of the monitor with this handle, or return NoSlot. Must own the read or write lock before calling this.
+/*static*/ size_t InputMonitor::FindSlot(uint16_t handle)
 {
-	ReadLocker lock(listLock);
-	InputMonitor *current = monitorsList;
-	while (current != nullptr && current->handle != handle)
+	size_t index = HashHandle(handle);
+	for (size_t i = 0; i < HandleIndexSize; ++i)
+	{
+		const uint8_t slot = handleIndex[index];
+		if (slot == NoSlot)
+		{
+			break;
+		}
+		if (monitors[slot]->handle == handle)
+		{
+			return slot;
+		}
+		index = (index + 1) & (HandleIndexSize - 1);
+	}
+	return NoSlot;
+}
+
+// Add the monitor in a slot to the handle index. Must own the write lock before calling this.
+/*static*/ void InputMonitor::AddToIndex(size_t slot)
+{
+	size_t index = HashHandle(monitors[slot]->handle);
+	while (handleIndex[index] != NoSlot)
 	{
-		current = current->next;
+		index = (index + 1) & (HandleIndexSize - 1);		// the index is at least twice as big as the number of slots, so there is always an empty entry
 	}
-	return ReadLockedPointer<InputMonitor>(lock, current);
+	handleIndex[index] = slot;
+}
+
+// Rebuild the handle index after deleting a monitor. Deleting an entry from an open addressed hash table would break the probe sequences of other entries,
+// and monitors are rarely deleted, so it is simplest to rebuild it. Must own the write lock before calling this.
+/*static*/ void InputMonitor::RebuildIndex()
+{
+	memset(handleIndex, NoSlot, sizeof(handleIndex));
+	for (uint32_t slots = usedSlots; slots != 0; )
+	{
+		const size_t slot = LowestSetBit(slots);
+		slots &= ~(1u << slot);
+		AddToIndex(slot);
+	}
+}
+
+/*static*/ ReadLockedPointer<InputMonitor> InputMonitor::Find(uint16_t handle)
+{
+	ReadLocker lock(listLock);
+	const size_t slot = FindSlot(handle);
+	return ReadLockedPointer<InputMonitor>(lock, (slot == NoSlot) ? nullptr : monitors[slot]);
+}
+
+// Put a new monitor in its slot. Must own the write lock before calling this.
+/*static*/ void InputMonitor::Insert(InputMonitor *m)
+{
+	monitors[m->slot] = m;
+	usedSlots |= 1u << m->slot;
+	AddToIndex(m->slot);
 }
 
 // Delete a monitor. Must own the write lock before calling this.
 /*static*/ bool InputMonitor::Delete(uint16_t handle)
 {
-	InputMonitor *prev = nullptr, *current = monitorsList;
-	while (current != nullptr)
+	const size_t slot = FindSlot(handle);
+	if (slot == NoSlot)
 	{
-		if (current->handle == handle)
-		{
-			current->Deactivate();
-			if (prev == nullptr)
-			{
-				monitorsList = current->next;
-			}
-			else
-			{
-				prev->next = current->next;
-			}
-			current->next = freeList;
-			freeList = current;
-			return true;
-		}
-		prev = current;
-		current = current->next;
+		return false;
 	}
 
-	return false;
+	InputMonitor * const current = monitors[slot];
+	current->Deactivate();
+#if SUPPORT_HARDWARE_FAST_STOP
+	if (current->usesFastStop)
+	{
+		FastStop::Detach(current->port.GetPin());
+		current->usesFastStop = false;
+	}
+#endif
+	{
+		AtomicCriticalSectionLocker lock;
+		current->sendDue = false;
+		pendingSends &= ~(1u << slot);
+	}
+	monitors[slot] = nullptr;
+	usedSlots &= ~(1u << slot);
+	RebuildIndex();
+	current->next = freeList;
+	freeList = current;
+#if HAS_STALL_DETECT
+	UpdateStallMonitoredDrivers();
+#endif
+	return true;
 }
 
 /*static*/ GCodeResult InputMonitor::Create(const CanMessageCreateInputMonitor& msg, size_t dataLength, const StringRef& reply, uint8_t& extra)
@@ -135,6 +472,12 @@ void InputMonitor::AnalogInterrupt(uint16_t reading)
 
 	Delete(msg.handle.u.all);						// delete any existing lock with the same handle
 
+	if (usedSlots == 0xFFFFFFFF)
+	{
+		reply.printf("Board %u has too many input monitors", CanInterface::GetCanAddress());
+		return GCodeResult::error;
+	}
+
 	// Allocate a new one
 	InputMonitor *newMonitor;
 	if (freeList == nullptr)
@@ -148,17 +491,76 @@ void InputMonitor::AnalogInterrupt(uint16_t reading)
 	}
 
 	newMonitor->handle = msg.handle.u.all;
+	newMonitor->slot = LowestSetBit(~usedSlots);
 	newMonitor->active = false;
 	newMonitor->state = false;
 	newMonitor->minInterval = msg.minInterval;
 	newMonitor->threshold = msg.threshold;
+	newMonitor->filter = msg.filter;
+	newMonitor->driversToStop = 0;
+#if SUPPORT_PROBE_SLOWDOWN
+	newMonitor->slowDownThreshold = 0;
+	newMonitor->slowDownFactor = 0;
+#endif
+	newMonitor->stallDriver = NoStallDriver;
+	newMonitor->monitorsPowerFail = false;
+	newMonitor->monitorsLoadCell = false;
+	newMonitor->usesFastStop = false;
 	newMonitor->sendDue = false;
 	String<StringLength50> pinName;
 	pinName.copy(msg.pinName, msg.GetMaxPinNameLength(dataLength));
+
+#if HAS_VOLTAGE_MONITOR
+	if (ReducedStringEquals(pinName.c_str(), "vinlow"))
+	{
+		newMonitor->port.Release();
+		newMonitor->monitorsPowerFail = true;
+		Insert(newMonitor);
+		(void)newMonitor->Activate();
+		extra = (newMonitor->state) ? 1 : 0;
+		return GCodeResult::ok;
+	}
+#endif
+
+#if SUPPORT_LOAD_CELL_PROBE
+	if (ReducedStringEquals(pinName.c_str(), "loadcell"))
+	{
+		newMonitor->port.Release();
+		newMonitor->monitorsLoadCell = true;
+		Insert(newMonitor);
+		const bool ok = newMonitor->Activate();
+		extra = (newMonitor->state) ? 1 : 0;
+		if (!ok)
+		{
+			reply.copy("Load cell is already in use");
+			return GCodeResult::error;
+		}
+		return GCodeResult::ok;
+	}
+#endif
+
+#if HAS_STALL_DETECT
+	const unsigned int stallDriver = GetStallDriverNumber(pinName.c_str());
+	if (stallDriver < NumDrivers)
+	{
+		newMonitor->port.Release();
+		newMonitor->stallDriver = stallDriver;
+		Insert(newMonitor);
+		UpdateStallMonitoredDrivers();
+		const bool ok = newMonitor->Activate();
+		extra = (newMonitor->state) ? 1 : 0;
+		if (!ok)
+		{
+			reply.copy("Failed to set driver stall interrupt");
+			return GCodeResult::error;
+		}
+		return GCodeResult::ok;
+	}
+#endif
+
 	if (newMonitor->port.AssignPort(pinName.c_str(), reply, PinUsedBy::endstop, (msg.threshold == 0) ? PinAccess::read : PinAccess::readAnalog))
 	{
-		newMonitor->next = monitorsList;
-		monitorsList = newMonitor;
+		Insert(newMonitor);
 		const bool ok = newMonitor->Activate();
 		extra = (newMonitor->state) ? 1 : 0;
 		if (!ok)
@@ -209,16 +611,152 @@ void InputMonitor::AnalogInterrupt(uint16_t reading)
 		break;
 
 	case CanMessageChangeInputMonitor::actionReturnPinName:
-		m->port.AppendPinName(reply);
+		if (m->IsStallMonitor())
+		{
+			reply.catf("stall%u", m->stallDriver);
+		}
+#if HAS_VOLTAGE_MONITOR
+		else if (m->monitorsPowerFail)
+		{
+			reply.catf("vinlow, threshold %.1fV", (double)((float)((m->threshold == 0) ? DefaultPowerFailThreshold : m->threshold) * 0.1));
+		}
+#endif
+#if SUPPORT_LOAD_CELL_PROBE
+		else if (m->monitorsLoadCell)
+		{
+			reply.catf("loadcell, threshold %u", (m->threshold == 0) ? LoadCell::DefaultThreshold : m->threshold);
+		}
+#endif
+		else
+		{
+			m->port.AppendPinName(reply);
+			if (m->threshold == 0)
+			{
+				const uint32_t debounceTime = m->port.GetDebounceMicroseconds();
+				if (debounceTime != 0)
+				{
+					reply.catf(", debounce %.2fms", (double)((float)debounceTime * 0.001));
+				}
+				else if (m->GetInterruptFilter() == InterruptFilter::none)
+				{
+					reply.cat(", unfiltered");
+				}
+			}
+		}
 		reply.catf(", min interval %ums", m->minInterval);
+		if (m->driversToStop != 0)
+		{
+			reply.catf(", stops drivers %04x", m->driversToStop);
+		}
+#if SUPPORT_PROBE_SLOWDOWN
+		if (m->slowDownThreshold != 0)
+		{
+			reply.catf(", slows to 1/%u at %u", m->slowDownFactor, m->slowDownThreshold);
+		}
+#endif
+#if SUPPORT_HARDWARE_FAST_STOP
+		if (m->usesFastStop)
+		{
+			reply.catf(", hardware fast stop (%" PRIu32 " stops)", FastStop::GetNumStops());
+		}
+#endif
 		rslt = GCodeResult::ok;
 		break;
 
+	case CanMessageChangeInputMonitor::actionSetDriversToStop:
+		{
+#if SUPPORT_HARDWARE_FAST_STOP
+			const uint16_t drivers = msg.param & ~UseFastStopFlag;
+			const bool wantFastStop = (msg.param & UseFastStopFlag) != 0;
+#else
+			const uint16_t drivers = msg.param;
+#endif
+			if (drivers >= (1u << NumDrivers))
+			{
+				reply.printf("Board %u does not have all of drivers %04x", CanInterface::GetCanAddress(), drivers);
+				rslt = GCodeResult::error;
+				break;
+			}
+			m->driversToStop = drivers;
+			rslt = GCodeResult::ok;
+#if SUPPORT_HARDWARE_FAST_STOP
+			if (wantFastStop && !m->usesFastStop)
+			{
+				if (m->IsStallMonitor() || m->monitorsPowerFail || m->monitorsLoadCell || m->threshold != 0 || !FastStop::Attach(m->port.GetPin()))
+				{
+					reply.copy("Hardware fast stop needs a digital input with a pin change interrupt");
+					rslt = GCodeResult::warning;
+				}
+				else
+				{
+					// Only one input can use the fast stop, so it is taken from any other monitor that had it
+					for (uint32_t slots = usedSlots; slots != 0; )
+					{
+						const size_t slot = LowestSetBit(slots);
+						slots &= ~(1u << slot);
+						monitors[slot]->usesFastStop = false;
+					}
+					const irqflags_t flags = cpu_irq_save();
+					m->usesFastStop = true;
+					if (m->active && !m->state)
+					{
+						FastStop::Arm();
+					}
+					cpu_irq_restore(flags);
+				}
+			}
+			else if (!wantFastStop && m->usesFastStop)
+			{
+				FastStop::Detach(m->port.GetPin());
+				m->usesFastStop = false;
+			}
+#endif
+		}
+		break;
+
 	case CanMessageChangeInputMonitor::actionChangeThreshold:
 		m->threshold = msg.param;
+#if HAS_VOLTAGE_MONITOR
+		if (m->active && m->monitorsPowerFail)
+		{
+			(void)m->SetPowerFailMonitor();
+		}
+		else
+#endif
+#if SUPPORT_LOAD_CELL_PROBE
+		if (m->active && m->monitorsLoadCell)
+		{
+			LoadCell::SetThreshold(m->threshold);
+		}
+		else
+#endif
+		if (m->active && m->IsAnalogPortMonitor())
+		{
+			(void)m->port.EnableAnalogWindowMonitor(m->threshold, CommonAnalogPortInterrupt, CallbackParameter(m.Ptr()));
+		}
 		rslt = GCodeResult::ok;
 		break;
 
+#if SUPPORT_PROBE_SLOWDOWN
+	case CanMessageChangeInputMonitor::actionSetSlowDown:
+		{
+			const uint16_t slowDownThreshold = msg.param & SlowDownThresholdMask;
+			const uint8_t slowDownFactor = msg.param >> SlowDownFactorShift;
+			if (msg.param != 0 && (!m->IsAnalogPortMonitor() || slowDownThreshold == 0 || slowDownThreshold >= m->threshold || slowDownFactor < MinSlowDownFactor))
+			{
+				reply.copy("Slowing down needs an analog input, a reading below the threshold and a factor of at least 2");
+				rslt = GCodeResult::error;
+				break;
+			}
+			const irqflags_t flags = cpu_irq_save();		// so that the ADC callback doesn't see a new threshold with the old factor
+			m->slowDownThreshold = slowDownThreshold;
+			m->slowDownFactor = slowDownFactor;
+			cpu_irq_restore(flags);
+			rslt = GCodeResult::ok;
+		}
+		break;
+#endif
+
 	case CanMessageChangeInputMonitor::actionChangeMinInterval:
 		m->minInterval = msg.param;
 		rslt = GCodeResult::ok;
@@ -236,34 +774,82 @@ void InputMonitor::AnalogInterrupt(uint16_t reading)
 
 // Check the input monitors and add any pending ones to the message
 // Return the number of ticks before we should be woken again, or TaskBase::TimeoutUnlimited if we shouldn't be work until an input changes state
+// To reduce the number of messages, we hold non-urgent state changes for up to coalescingMillis so that they can share a message.
+// As soon as any change is urgent or has been held long enough, we send all the ones that are due.
 /*static*/ uint32_t InputMonitor::AddStateChanges(CanMessageInputChanged *msg)
 {
 	uint32_t timeToWait = TaskBase::TimeoutUnlimited;
 	ReadLocker lock(listLock);
 
 	const uint32_t now = millis();
-	for (InputMonitor *p = monitorsList; p != nullptr; p = p->next)
+	const uint32_t pending = pendingSends;				// we only need to look at the monitors that have changes to send
+	bool sendNow = false;
+	for (uint32_t slots = pending; slots != 0; )
 	{
+		const size_t slot = LowestSetBit(slots);
+		slots &= ~(1u << slot);
+		const InputMonitor * const p = monitors[slot];
+		if (p->sendDue && now - p->whenLastSent >= p->minInterval)
+		{
+			if (p->IsUrgent() || now - p->whenChanged >= coalescingMillis)
+			{
+				sendNow = true;
+				break;
+			}
+		}
+	}
+
+	for (uint32_t slots = pending; slots != 0; )
+	{
+		const size_t slot = LowestSetBit(slots);
+		slots &= ~(1u << slot);
+		InputMonitor * const p = monitors[slot];
 		if (p->sendDue)
 		{
 			const uint32_t age = now - p->whenLastSent;
-			if (age >= p->minInterval)
+			if (!sendNow)
+			{
+				// Nothing needs to be sent yet, so just work out when we need to look again
+				const uint32_t timeLeft = (age >= p->minInterval)
+											? coalescingMillis - min<uint32_t>(now - p->whenChanged, coalescingMillis)
+												: p->minInterval - age;
+				if (timeLeft < timeToWait)
+				{
+					timeToWait = timeLeft;
+				}
+			}
+			else if (age >= p->minInterval)
 			{
 				bool state;
+				uint32_t whenChangedTicks;
 				{
-					InterruptCriticalSectionLocker lock;
+					AtomicCriticalSectionLocker lock;
 					p->sendDue = false;
+					pendingSends &= ~(1u << slot);
 					state = p->state;
+					whenChangedTicks = p->whenChangedTicks;
 				}
 
+				const bool isFirstEntry = (msg->numHandles == 0);
 				if (msg->AddEntry(p->handle, state))
 				{
 					p->whenLastSent = now;
+
+					// Report when the earliest change in the message happened, in master time. Urgent changes are sent as soon as they happen, so this is normally the trigger time of an endstop or probe.
+					const uint32_t triggerTime = StepTimer::ConvertToMasterTime(whenChangedTicks);
+					if (isFirstEntry || (int32_t)(triggerTime - msg->triggerTime) < 0)
+					{
+						msg->triggerTime = triggerTime;
+					}
 				}
 				else
 				{
-					p->sendDue = true;
-					return 1;
+					{
+						AtomicCriticalSectionLocker lock;
+						p->sendDue = true;
+						pendingSends |= 1u << slot;
+					}
+					return 0;							// the message is full, so send it and then come back for the rest straight away
 				}
 			}
 			else
@@ -280,4 +866,53 @@ void InputMonitor::AnalogInterrupt(uint16_t reading)
 	return timeToWait;
 }
 
+#if SUPPORT_READ_INPUTS
+
+// Reply to a request for the states of all the monitors whose handles match the mask and value in the request, and the readings of the analog ones.
+// We take the readings with interrupts disabled, so they are a consistent snapshot and a macro that checks many inputs needs only one CAN transaction.
+// If more monitors match than fit in the reply, we report as many as fit and return a warning so that the main board can narrow the selection.
+void InputMonitor::ReadInputs(CanMessageBuffer *buf)
+{
+	const CanMessageReadInputsRequest request = buf->msg.readInputsRequest;	// copy it because the reply overwrites it
+	CanMessageReadInputsReply * const reply = buf->SetupResponseMessage<CanMessageReadInputsReply>(request.requestId, CanInterface::GetCanAddress(), buf->id.Src());
+
+	size_t numReported = 0;
+	uint32_t states = 0;
+	bool truncated = false;
+	{
+		ReadLocker lock(listLock);
+		AtomicCriticalSectionLocker ilock;
+		for (uint32_t slots = usedSlots; slots != 0; )
+		{
+			const size_t slot = LowestSetBit(slots);
+			slots &= ~(1u << slot);
+			const InputMonitor * const p = monitors[slot];
+			if ((p->handle & request.handleMask) == request.handleValue)
+			{
+				if (numReported == ARRAY_SIZE(reply->results))
+				{
+					truncated = true;
+					break;
+				}
+				reply->results[numReported].handle = p->handle;
+				reply->results[numReported].value = (p->IsAnalogPortMonitor()) ? p->port.ReadAnalog() : 0;
+				if (p->state)
+				{
+					states |= 1u << numReported;
+				}
+				++numReported;
+			}
+		}
+	}
+
+	static_assert(ARRAY_SIZE(reply->results) <= 32, "State bitmap too small");
+	reply->resultCode = (uint8_t)((truncated) ? GCodeResult::warning : GCodeResult::ok);
+	reply->numReported = numReported;
+	reply->states = states;
+	buf->dataLength = reply->GetActualDataLength(numReported);
+	CanInterface::SendAndFree(buf);
+}
+
+#endif
+
 // End
@@ -16,6 +16,7 @@
 struct CanMessageCreateInputMonitor;
 struct CanMessageChangeInputMonitor;
 struct CanMessageInputChanged;
+class CanMessageBuffer;
 
 class InputMonitor
 {
@@ -28,31 +29,123 @@ public:
 	static GCodeResult Change(const CanMessageChangeInputMonitor& msg, const StringRef& reply, uint8_t& extra);
 
 	static uint32_t AddStateChanges(CanMessageInputChanged *msg);
+#if SUPPORT_READ_INPUTS
+	static void ReadInputs(CanMessageBuffer *buf);			// reply to a request for the states of several inputs, reusing the buffer
+#endif
+	static void SetCoalescingLatency(uint32_t ms) { coalescingMillis = ms; }
+	static uint32_t GetCoalescingLatency() { return coalescingMillis; }
 
 	static void CommonDigitalPortInterrupt(CallbackParameter cbp);
 	static void CommonAnalogPortInterrupt(CallbackParameter cbp, uint16_t reading);
 
+#if HAS_STALL_DETECT
+	// Monitors can report the stall status of a local driver instead of a pin, so that the main board can do sensorless homing on our axes
+	static void DriverStallChanged(size_t driver, bool stalled, uint32_t whenTicks);	// called by the driver task when a stall starts or ends
+	static bool IsMonitoringStall(size_t driver) { return (stallMonitoredDrivers & (1u << driver)) != 0; }
+#endif
+
+#if HAS_VOLTAGE_MONITOR
+	// A monitor on the virtual pin "vinlow" becomes active when VIN falls below its threshold, which is in tenths of a volt (0 for the default).
+	// It is checked on every VIN reading, so it can stop local drivers and tell the main board about a power failure before the drivers lose power.
+	static constexpr uint16_t DefaultPowerFailThreshold = 100;
+#endif
+
 private:
 	bool Activate();
 	void Deactivate();
 	void DigitalInterrupt();
 	void AnalogInterrupt(uint16_t reading);
+	void OnStateChanged(uint32_t changeTicks);
+	bool IsStallMonitor() const { return stallDriver != NoStallDriver; }
+	bool IsAnalogPortMonitor() const { return !IsStallMonitor() && !monitorsPowerFail && !monitorsLoadCell && threshold != 0; }
+
+#if HAS_STALL_DETECT
+	static void UpdateStallMonitoredDrivers();
+# if SUPPORT_TMC22xx
+	void StallPinInterrupt();
+	static void CommonStallPinInterrupt(CallbackParameter cbp);
+# endif
+#endif
+
+	// The filter byte in the create message selects how the EIC filters a digital input: 0 for the majority filter, NoInputFilter for none (lowest latency, for Z probes),
+	// or a hardware debounce time in units of DebounceUnitMicroseconds. Debouncing in hardware stops a bouncing switch from causing interrupts at all.
+	static constexpr uint8_t NoInputFilter = 0xFF;
+	static constexpr uint32_t DebounceUnitMicroseconds = 250;
+	InterruptFilter GetInterruptFilter() const { return (filter == 0) ? InterruptFilter::majority : (filter == NoInputFilter) ? InterruptFilter::none : InterruptFilter::debounce; }
+
+#if SUPPORT_PROBE_SLOWDOWN
+	// The parameter of the setSlowDown action holds the analog reading at which we slow down the current move in the low 12 bits,
+	// and the factor by which we slow it down (2 to 15) in the high 4 bits. Zero turns slowing down off.
+	static constexpr unsigned int SlowDownFactorShift = 12;
+	static constexpr uint16_t SlowDownThresholdMask = (1u << SlowDownFactorShift) - 1;
+	static constexpr uint8_t MinSlowDownFactor = 2;
+#endif
+
+#if SUPPORT_HARDWARE_FAST_STOP
+	// If this bit is set in the drivers to stop, a digital input also disables the drivers in hardware through the event system, for crash protection
+	static constexpr uint16_t UseFastStopFlag = 0x8000;
+#endif
+
+	// Monitors with no minimum interval are used for endstops and Z probes, so we report them at once instead of coalescing them with other changes
+	bool IsUrgent() const { return minInterval == 0; }
+
+#if HAS_VOLTAGE_MONITOR
+	bool SetPowerFailMonitor();
+	void PowerFailInterrupt();
+	static void CommonPowerFailInterrupt(CallbackParameter cbp);
+#endif
+
+#if SUPPORT_LOAD_CELL_PROBE
+	void LoadCellInterrupt(bool triggered, uint32_t whenTicks);
+	static void CommonLoadCellInterrupt(CallbackParameter cbp, bool triggered, uint32_t whenTicks);
+#endif
 
 	static bool Delete(uint16_t handle);
 	static ReadLockedPointer<InputMonitor> Find(uint16_t handle);
+	static size_t FindSlot(uint16_t handle);
+	static void Insert(InputMonitor *m);
+	static void AddToIndex(size_t slot);
+	static void RebuildIndex();
+	static size_t HashHandle(uint16_t handle) { return (handle ^ (handle >> 6) ^ (handle >> 12)) & (HandleIndexSize - 1); }
 
-	InputMonitor *next;
+	static constexpr size_t MaxInputMonitors = 32;			// the limit is the size of the pending sends bitmap
+	static constexpr size_t HandleIndexSize = 64;			// must be a power of 2 and at least twice MaxInputMonitors, so that lookups rarely probe more than one entry
+	static constexpr uint8_t NoSlot = 0xFF;
+
+	InputMonitor *next;										// link in the free list
 	IoPort port;
 	uint32_t whenLastSent;
+	volatile uint32_t whenChanged;							// when sendDue was last set
+	volatile uint32_t whenChangedTicks;						// the step clock when sendDue was last set, so that the main board can tell exactly when an endstop or probe triggered
 	uint16_t handle;
 	uint16_t minInterval;
 	uint16_t threshold;
+	uint16_t driversToStop;									// local drivers to stop when the input becomes active, so that homing doesn't wait for the main board
+#if SUPPORT_PROBE_SLOWDOWN
+	uint16_t slowDownThreshold;								// the analog reading at which we slow down the current move, or 0 if we don't
+	uint8_t slowDownFactor;									// the factor by which we slow it down
+#endif
+	uint8_t stallDriver;									// the local driver whose stall status we monitor, or NoStallDriver if we monitor the port
+	uint8_t slot;											// our index in the monitors array and bitmaps
+	uint8_t filter;											// the input filter requested by the main board
+	bool monitorsPowerFail;									// true if we monitor VIN for power failure instead of a port
+	bool monitorsLoadCell;									// true if we monitor the load cell on the virtual pin "loadcell" instead of a port
+	bool usesFastStop;										// true if this input is routed to the hardware fast stop
 	bool active;
 	volatile bool state;
 	volatile bool sendDue;
 
-	static InputMonitor *monitorsList;
+	// The monitors are held in an array of slots, with a hash table on the handle to find them and a bitmap of the ones that have state changes to send.
+	// So the time to look up a monitor and to report a change doesn't depend on how many monitors there are.
+	static InputMonitor *monitors[MaxInputMonitors];
+	static uint8_t handleIndex[HandleIndexSize];			// open addressed hash table of slot numbers, NoSlot if empty
+	static uint32_t usedSlots;								// bitmap of the slots in use
+	static volatile uint32_t pendingSends;					// bitmap of the slots whose monitors have sendDue set
 	static InputMonitor *freeList;
+	static uint32_t coalescingMillis;						// how long we may hold a non-urgent state change so that we can send it with others
+	static volatile uint32_t stallMonitoredDrivers;			// bitmap of the drivers that have stall monitors
+
+	static constexpr uint8_t NoStallDriver = 0xFF;
 
 	static ReadWriteLock listLock;
 };
@@ -0,0 +1,172 @@
+/*
+ * LoadCell.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "LoadCell.h"
+
+#if SUPPORT_LOAD_CELL_PROBE
+
+#include <Platform.h>
+#include <Hardware/AnalogIn.h>
+
+namespace LoadCell
+{
+	constexpr unsigned int FractionBits = 8;				// the baseline is held in units of 1/256 of an ADC count so that it can move by less than one count per reading
+	constexpr unsigned int BaselineShift = 5;				// the baseline follows the readings with a time constant of 32 readings
+	constexpr unsigned int SettlingReadings = 2u << BaselineShift;	// readings that we only use to set the baseline after starting
+	constexpr unsigned int ReadingsToTrigger = 2;			// consecutive readings beyond the threshold needed to detect contact, so that a single noisy reading doesn't trigger
+	constexpr unsigned int ReadingsToRelease = 2;			// consecutive readings within half the threshold needed to detect release
+	constexpr unsigned int ContinuousDecimation = 2;		// the SDADC decimation we use if it isn't already running continuously
+
+	static TriggerCallback callbackFn = nullptr;
+	static CallbackParameter callbackParam;
+	static volatile uint16_t threshold = DefaultThreshold;
+	static int32_t baseline;
+	static unsigned int readingsSinceStart;
+	static unsigned int consecutiveReadings;
+	static uint32_t firstReadingTicks;						// when the first of the consecutive readings was taken
+	static volatile bool triggered = false;
+	static bool changedDecimation = false;
+
+	// Statistics
+	static uint32_t numReadings = 0, numTriggers = 0;
+	static uint16_t maxDeviation = 0;
+
+	// This replaces the callback that feeds the temp0 SDADC readings into the averaging filter, which it still does so that M308 can still read this input
+	static void ReadingCallback(CallbackParameter cp, uint16_t reading)
+	{
+		static_cast<ThermistorAveragingFilter*>(cp.vp)->ProcessReading(reading);
+		if (callbackFn == nullptr)
+		{
+			return;
+		}
+
+		++numReadings;
+		const int32_t scaledReading = (int32_t)reading << FractionBits;
+		if (readingsSinceStart < SettlingReadings)
+		{
+			baseline = (readingsSinceStart == 0) ? scaledReading : baseline + ((scaledReading - baseline) >> BaselineShift);
+			++readingsSinceStart;
+			return;
+		}
+
+		const int32_t diff = scaledReading - baseline;
+		const uint16_t deviation = (uint16_t)(((diff < 0) ? -diff : diff) >> FractionBits);
+		if (deviation > maxDeviation)
+		{
+			maxDeviation = deviation;
+		}
+
+		if (!triggered)
+		{
+			if (deviation >= threshold)
+			{
+				if (consecutiveReadings == 0)
+				{
+					firstReadingTicks = AnalogIn::GetSdAdcBlockTicks();
+				}
+				if (++consecutiveReadings >= ReadingsToTrigger)
+				{
+					triggered = true;
+					consecutiveReadings = 0;
+					++numTriggers;
+					callbackFn(callbackParam, true, firstReadingTicks);
+				}
+			}
+			else
+			{
+				// Only follow the readings while there is no contact, otherwise a slow approach would move the baseline with it
+				consecutiveReadings = 0;
+				baseline += diff >> BaselineShift;
+			}
+		}
+		else if (2 * deviation < threshold)
+		{
+			if (consecutiveReadings == 0)
+			{
+				firstReadingTicks = AnalogIn::GetSdAdcBlockTicks();
+			}
+			if (++consecutiveReadings >= ReadingsToRelease)
+			{
+				triggered = false;
+				consecutiveReadings = 0;
+				callbackFn(callbackParam, false, firstReadingTicks);
+			}
+		}
+		else
+		{
+			consecutiveReadings = 0;
+		}
+	}
+}
+
+bool LoadCell::Start(uint16_t p_threshold, TriggerCallback fn, CallbackParameter cbp)
+{
+	if (callbackFn != nullptr && callbackParam.vp != cbp.vp)
+	{
+		return false;
+	}
+
+	{
+		TaskCriticalSectionLocker lock;						// the readings are processed by the AIN task
+		threshold = (p_threshold == 0) ? DefaultThreshold : p_threshold;
+		readingsSinceStart = 0;
+		consecutiveReadings = 0;
+		triggered = false;
+		callbackParam = cbp;
+		callbackFn = fn;
+	}
+
+	// We need a reading from every block of conversions to detect contact quickly, so run the SDADC continuously if it isn't already
+	if (AnalogIn::GetSdAdcDecimation() == 0)
+	{
+		(void)AnalogIn::SetSdAdcDecimation(ContinuousDecimation);
+		changedDecimation = true;
+	}
+	return AnalogIn::SetCallback(TempSensePins[0], ReadingCallback, Platform::GetAdcFilter(SdAdcTemp0FilterIndex), 0, true);
+}
+
+void LoadCell::SetThreshold(uint16_t p_threshold)
+{
+	threshold = (p_threshold == 0) ? DefaultThreshold : p_threshold;
+}
+
+void LoadCell::Stop(CallbackParameter cbp)
+{
+	if (callbackFn != nullptr && callbackParam.vp == cbp.vp)
+	{
+		ThermistorAveragingFilter * const filter = Platform::GetAdcFilter(SdAdcTemp0FilterIndex);
+		(void)AnalogIn::SetCallback(TempSensePins[0], filter->CallbackFeedIntoFilter, filter, 1, true);
+		if (changedDecimation && AnalogIn::GetSdAdcDecimation() == ContinuousDecimation)
+		{
+			(void)AnalogIn::SetSdAdcDecimation(0);
+		}
+		changedDecimation = false;
+		TaskCriticalSectionLocker lock;
+		callbackFn = nullptr;
+		triggered = false;
+	}
+}
+
+bool LoadCell::IsTriggered()
+{
+	return triggered;
+}
+
+void LoadCell::Diagnostics(const StringRef& reply)
+{
+	if (callbackFn != nullptr)
+	{
+		reply.lcatf("Load cell threshold %u, baseline %.1f, readings %" PRIu32 ", max deviation %u, triggers %" PRIu32 "%s",
+					threshold, (double)((float)baseline * (1.0/(float)(1u << FractionBits))), numReadings, maxDeviation, numTriggers, (triggered) ? ", triggered" : "");
+		numReadings = numTriggers = 0;
+		maxDeviation = 0;
+	}
+}
+
+#endif
+
+// End
@@ -0,0 +1,35 @@
+/*
+ * LoadCell.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Detects nozzle contact from a load cell or strain gauge amplifier connected to the temp0 input of a tool board, which the SDADC reads.
+ *  We run the SDADC continuously and compare each reading with a baseline that slowly follows the readings, so that drift and the weight of
+ *  the hoses and cables don't matter. Contact is detected in either direction a few readings after it happens.
+ */
+
+#ifndef SRC_INPUTMONITORS_LOADCELL_H_
+#define SRC_INPUTMONITORS_LOADCELL_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_LOAD_CELL_PROBE
+
+namespace LoadCell
+{
+	// The function called when contact is made or released. 'whenTicks' is the step clock when the SDADC finished the first reading that showed the change.
+	typedef void (*TriggerCallback)(CallbackParameter cbp, bool triggered, uint32_t whenTicks);
+
+	constexpr uint16_t DefaultThreshold = 50;				// the deviation from the baseline in ADC counts that we use if the threshold is 0
+
+	bool Start(uint16_t threshold, TriggerCallback fn, CallbackParameter cbp);	// returns false if another monitor is using the load cell
+	void SetThreshold(uint16_t threshold);
+	void Stop(CallbackParameter cbp);						// stop monitoring, if the monitor with this parameter is the one using the load cell
+	bool IsTriggered();
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif
+
+#endif /* SRC_INPUTMONITORS_LOADCELL_H_ */
@@ -10,7 +10,12 @@
 #include "Move.h"
 #include "Kinematics/LinearDeltaKinematics.h"		// for DELTA_AXES
 #include "CanMessageFormats.h"
+#include "StepBurstGenerator.h"
+#include "StepPulseTimer.h"
+#include "StepProfiler.h"
 #include <CAN/CanInterface.h>
+#include <Tracer.h>
+#include <DeferredLog.h>
 
 #ifdef DUET_NG
 # define DDA_MOVE_DEBUG	(0)
@@ -82,21 +87,52 @@ static size_t savedMovePointer = 0;
 
 DDA::DDA(DDA* n) : next(n), prev(nullptr), state(empty)
 {
-	for (DriveMovement*& p : pddm)
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
 	{
-		p = nullptr;
+		pddm[drive] = nullptr;
+		finishedDrives[drive].netSteps = 0;
+		finishedDrives[drive].finished = false;
 	}
 }
 
 void DDA::ReleaseDMs()
 {
-	for (DriveMovement*& p : pddm)
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
 	{
+		DriveMovement*& p = pddm[drive];
 		if (p != nullptr)
 		{
 			DriveMovement::Release(p);
 			p = nullptr;
 		}
+		finishedDrives[drive].netSteps = 0;
+		finishedDrives[drive].finished = false;
+	}
+}
+
+// Return the DMs of the drives that have taken all their steps to the pool, so that the moves behind this one can use them, and record what we still need to know
+// about those drives. Drives that were stopped early keep their DMs, because the net steps of the move include the steps they didn't take.
+// Called by the Move task, which is the only task that allocates and releases DMs, with the step interrupt locked out because StopDrive may be called at that priority.
+void DDA::ReleaseFinishedDMs()
+{
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		DriveMovement*& p = pddm[drive];
+		if (p != nullptr && p->state != DMState::moving && p->GetNetStepsLeft() == 0)
+		{
+			FinishedDrive& fd = finishedDrives[drive];
+			fd.netSteps = p->GetNetStepsTaken();
+			fd.microstepShift = p->microstepShift;
+			fd.isDeltaMovement = p->IsDeltaMovement();
+			fd.hadReversePhase = (p->reverseStartStep <= p->totalSteps);
+			fd.finished = true;
+			if (p->state == DMState::stepError)
+			{
+				flags.hadStepError = true;
+			}
+			DriveMovement::Release(p);
+			p = nullptr;
+		}
 	}
 }
 
@@ -110,11 +146,39 @@ pre(state == executing || state == frozen || state == completed)
 			: (int32_t)clocksNeeded;
 }
 
+// Return the speed at step clock 'now' as a fraction of the top speed, ignoring any input shaping. Called from the step ISR or with the step interrupt disabled.
+float DDA::GetSpeedFraction(uint32_t now) const
+pre(state == executing)
+{
+	if (topSpeed <= 0.0)
+	{
+		return 0.0;
+	}
+
+	const float t = (float)(int32_t)(now - afterPrepare.moveStartTime);
+	const float accelClocks = (acceleration > 0.0) ? (topSpeed - startSpeed)/acceleration : 0.0;
+	const float decelStart = (float)clocksNeeded - ((deceleration > 0.0) ? (topSpeed - endSpeed)/deceleration : 0.0);
+	const float speed = (t < accelClocks) ? startSpeed + acceleration * max<float>(t, 0.0)
+						: (t < decelStart) ? topSpeed
+							: topSpeed - deceleration * min<float>(t - decelStart, (float)clocksNeeded - decelStart);
+	return constrain<float>(speed/topSpeed, 0.0, 1.0);
+}
+
 // Insert the specified drive into the step list, in step time order.
 // We insert the drive before any existing entries with the same step time for best performance. Now that we generate step pulses
 // for multiple motors simultaneously, there is no need to preserve round-robin order.
 inline void DDA::InsertDM(DriveMovement *dm)
 {
+#if USE_SORTED_DM_ARRAY
+	size_t i = numActiveDMs;
+	while (i != 0 && activeDMs[i - 1]->nextStepTime >= dm->nextStepTime)
+	{
+		activeDMs[i] = activeDMs[i - 1];
+		--i;
+	}
+	activeDMs[i] = dm;
+	++numActiveDMs;
+#else
 	DriveMovement **dmp = &activeDMs;
 	while (*dmp != nullptr && (*dmp)->nextStepTime < dm->nextStepTime)
 	{
@@ -122,12 +186,28 @@ inline void DDA::InsertDM(DriveMovement *dm)
 	}
 	dm->nextDM = *dmp;
 	*dmp = dm;
+#endif
 }
 
 // Remove this drive from the list of drives with steps due
 // Called from the step ISR only.
 void DDA::RemoveDM(size_t drive)
 {
+#if USE_SORTED_DM_ARRAY
+	for (size_t i = 0; i < numActiveDMs; ++i)
+	{
+		if (activeDMs[i]->drive == drive)
+		{
+			--numActiveDMs;
+			while (i < numActiveDMs)
+			{
+				activeDMs[i] = activeDMs[i + 1];
+				++i;
+			}
+			break;
+		}
+	}
+#else
 	DriveMovement **dmp = &activeDMs;
 	while (*dmp != nullptr)
 	{
@@ -139,6 +219,7 @@ void DDA::RemoveDM(size_t drive)
 		}
 		dmp = &(dm->nextDM);
 	}
+#endif
 }
 
 void DDA::DebugPrintVector(const char *name, const float *vec, size_t len) const
@@ -154,11 +235,11 @@ void DDA::DebugPrintVector(const char *name, const float *vec, size_t len) const
 // Print the text followed by the DDA only
 void DDA::DebugPrint() const
 {
-	debugPrintf("DDA:");
-	debugPrintf("\n"
-				"a=%f d=%f startv=%f topv=%f endv=%f sa=%f sd=%f\n"
-				"cks=%" PRIu32 " sstcda=%" PRIu32 " tstcddpdsc=%" PRIu32 " exac=%" PRIi32 "\n",
-				(double)acceleration, (double)deceleration, (double)startSpeed, (double)topSpeed, (double)endSpeed, (double)accelDistance, (double)decelDistance,
+	// This is called from the Move task when a move looks wrong, so defer the formatting
+	deferredPrintf("DDA:\n"
+				"a=%f d=%f startv=%f topv=%f endv=%f sa=%f sd=%f\n",
+				(double)acceleration, (double)deceleration, (double)startSpeed, (double)topSpeed, (double)endSpeed, (double)accelDistance, (double)decelDistance);
+	deferredPrintf("cks=%" PRIu32 " sstcda=%" PRIu32 " tstcddpdsc=%" PRIu32 " exac=%" PRIi32 "\n",
 				clocksNeeded, afterPrepare.startSpeedTimesCdivA, afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks, afterPrepare.extraAccelerationClocks);
 }
 
@@ -184,19 +265,49 @@ void DDA::Init()
 // Set up a real move. Return true if it represents real movement, else false.
 // Return true if it is a real move
 bool DDA::Init(const CanMessageMovement& msg)
+{
+#if SUPPORT_EXTRUDER_MIXING
+	CanMessageMovement mixedMsg;
+	if (moveInstance->GetMixer().Apply(msg, mixedMsg))
+	{
+		return InitMove(mixedMsg);
+	}
+#endif
+	return InitMove(msg);
+}
+
+bool DDA::InitMove(const CanMessageMovement& msg)
 {
 	// 0. Update the endpoints (do we even need them?)
 	bool realMove = false;
 
 	for (size_t drive = 0; drive < NumDrivers; drive++)
 	{
-		int32_t delta = msg.perDrive[drive].steps;
+#if SUPPORT_BABYSTEPPING
+		int32_t steps = msg.perDrive[drive].steps + moveInstance->TakeBabySteps(drive, msg);
+#else
+		int32_t steps = msg.perDrive[drive].steps;
+#endif
+#if SUPPORT_LEADSCREW_CORRECTION
+		steps += moveInstance->GetKinematics().TakeLeadscrewCorrection(drive, msg.perDrive[drive].steps, msg);
+#endif
+#if SUPPORT_STEP_ERROR_CORRECTION
+		steps += moveInstance->TakeStepErrorCorrection(drive, msg);
+#endif
+#if SUPPORT_DYNAMIC_MICROSTEPPING
+		const int32_t delta = moveInstance->AdjustDriveSteps(drive, steps, msg);
+#else
+		const int32_t delta = steps;
+#endif
 
 		if (delta != 0)
 		{
 			realMove = true;
 			DriveMovement*& pdm = pddm[drive];
 			pdm = DriveMovement::Allocate(drive, DMState::moving);
+#if SUPPORT_DYNAMIC_MICROSTEPPING
+			pdm->microstepShift = moveInstance->GetMicrostepReduction(drive);
+#endif
 			pdm->totalSteps = labs(delta);				// for now this is the number of net steps, but gets adjusted later if there is a reverse in direction
 			pdm->direction = (delta >= 0);				// for now this is the direction of net movement, but gets adjusted later if it is a delta movement
 		}
@@ -209,12 +320,22 @@ bool DDA::Init(const CanMessageMovement& msg)
 	}
 
 	// 3. Store some values
+	SetMotionParameters(msg);
+	state = provisional;
+	Prepare(msg, true);
+	return true;
+}
+
+// Set up the timing, speeds and distances of the move from the movement message
+void DDA::SetMotionParameters(const CanMessageMovement& msg)
+{
 	afterPrepare.moveStartTime = msg.whenToExecute;
 	clocksNeeded = msg.accelerationClocks + msg.steadyClocks + msg.decelClocks;
 	flags.stopAllDrivesOnEndstopHit = msg.stopAllDrivesOnEndstopHit;
 
 	flags.hadHiccup = false;
 	flags.goingSlow = false;
+	flags.hadStepError = false;
 
 	topSpeed = 2.0/(2 * msg.steadyClocks + (msg.initialSpeedFraction + 1.0) * msg.accelerationClocks + (msg.finalSpeedFraction + 1.0) * msg.decelClocks);
 	startSpeed = topSpeed * msg.initialSpeedFraction;
@@ -225,15 +346,11 @@ bool DDA::Init(const CanMessageMovement& msg)
 
 	accelDistance = topSpeed * (1.0 + msg.initialSpeedFraction) * msg.accelerationClocks * 0.5;
 	decelDistance = topSpeed * (1.0 + msg.finalSpeedFraction) * msg.decelClocks * 0.5;
-
-	state = provisional;
-	Prepare(msg);
-	return true;
 }
 
 // Prepare this DDA for execution.
-// This must not be called with interrupts disabled, because it calls Platform::EnableDrive.
-void DDA::Prepare(const CanMessageMovement& msg)
+// If enableDrives is true then this must not be called with interrupts disabled, because it calls Platform::EnableDrive.
+void DDA::Prepare(const CanMessageMovement& msg, bool enableDrives)
 {
 	PrepParams params;
 	params.decelStartDistance = 1.0 - decelDistance;
@@ -247,7 +364,9 @@ void DDA::Prepare(const CanMessageMovement& msg)
 		params.a2plusb2 = fsquare(params.dvecX) + fsquare(params.dvecY);
 		params.initialX = msg.initialX;
 		params.initialY = msg.initialY;
-		params.dparams = static_cast<const LinearDeltaKinematics*>(&(moveInstance->GetKinematics()));
+		params.towers = static_cast<const LinearDeltaKinematics&>(moveInstance->GetKinematics()).GetTowerConstants();
+		params.recipAcceleration = 1.0/(double)acceleration;
+		params.recipDeceleration = 1.0/(double)deceleration;
 	}
 
 	afterPrepare.startSpeedTimesCdivA = (uint32_t)roundU32(startSpeed/acceleration);
@@ -256,14 +375,35 @@ void DDA::Prepare(const CanMessageMovement& msg)
 	afterPrepare.extraAccelerationClocks = msg.accelerationClocks - roundS32(accelDistance/topSpeed);
 	params.compFactor = (topSpeed - startSpeed)/topSpeed;
 
+#if USE_SORTED_DM_ARRAY
+	numActiveDMs = 0;
+#else
 	activeDMs = nullptr;
+#endif
+
+#if SUPPORT_INPUT_SHAPING
+	// Shape the acceleration and deceleration phases. This must be done before we prepare the DMs, because they may build step time tables from the shaped profile.
+	{
+		const InputShaper& shaper = moveInstance->GetShaper();
+		afterPrepare.decelStartClocks = msg.accelerationClocks + msg.steadyClocks;
+		afterPrepare.numAccelSegments = (uint8_t)shaper.BuildShapedPhase((float)msg.accelerationClocks, startSpeed, topSpeed - startSpeed, 0.0, afterPrepare.accelSegments);
+		afterPrepare.numDecelSegments = (uint8_t)shaper.BuildShapedPhase((float)msg.decelClocks, topSpeed, endSpeed - topSpeed, params.decelStartDistance, afterPrepare.decelSegments);
+	}
+#endif
+
+	afterPrepare.minCalcIntervalCartesian = MinCalcIntervalCartesian;
+	afterPrepare.minCalcIntervalDelta = MinCalcIntervalDelta;
+	unsigned int numFastDrives = 0;
 
 	for (size_t drive = 0; drive < NumDrivers; ++drive)
 	{
 		DriveMovement* const pdm = FindDM(drive);
 		if (pdm != nullptr && pdm->state == DMState::moving)
 		{
-			Platform::EnableDrive(drive);
+			if (enableDrives)
+			{
+				Platform::EnableDrive(drive);
+			}
 			if ((msg.deltaDrives & (1u << drive)) != 0)			// for now, additional axes are assumed to be not part of the delta mechanism
 			{
 				pdm->PrepareDeltaAxis(*this, params);
@@ -305,11 +445,19 @@ void DDA::Prepare(const CanMessageMovement& msg)
 				}
 			}
 
+			if (pdm->GetTopSpeedStepInterval() < FastDriveIntervalMultiplier * MinCalcIntervalCartesian)
+			{
+				++numFastDrives;
+			}
+
 			// Prepare for the first step
 			pdm->nextStep = 0;
 			pdm->nextStepTime = 0;
 			pdm->stepInterval = 999999;							// initialise to a large value so that we will calculate the time for just one step
 			pdm->stepsTillRecalc = 0;							// so that we don't skip the calculation
+#if USE_STEP_QUEUES
+			pdm->StartStepQueue(*this);							// precalculate the first few steps of Cartesian and extruder moves
+#endif
 #if SUPPORT_DELTA_MOVEMENT
 			const bool stepsToDo = (pdm->IsDeltaMovement())
 									? pdm->CalcNextStepTimeDelta(*this, false)
@@ -328,6 +476,14 @@ void DDA::Prepare(const CanMessageMovement& msg)
 		}
 	}
 
+	// If several drives will be stepping fast at the same time then the ISR has to calculate step times for all of them,
+	// so start calculating steps in batches at correspondingly lower step rates. This avoids most hiccups, which delay the move.
+	if (numFastDrives > 1)
+	{
+		afterPrepare.minCalcIntervalCartesian = MinCalcIntervalCartesian * numFastDrives;
+		afterPrepare.minCalcIntervalDelta = MinCalcIntervalDelta * numFastDrives;
+	}
+
 	if (Platform::Debug(moduleDda) && Platform::Debug(moduleMove))		// temp show the prepared DDA if debug enabled for both modules
 	{
 		DebugPrintAll();
@@ -336,21 +492,153 @@ void DDA::Prepare(const CanMessageMovement& msg)
 	state = frozen;					// must do this last so that the ISR doesn't start executing it before we have finished setting it up
 }
 
+#if SUPPORT_INPUT_SHAPING
+
+// Calculate the time at which the move reaches the specified fraction of its total distance during a shaped acceleration or deceleration phase
+uint32_t DDA::CalcShapedStepTime(float distance, bool accelerating) const
+{
+	const ShapedSegment * const segments = (accelerating) ? afterPrepare.accelSegments : afterPrepare.decelSegments;
+	size_t i = ((accelerating) ? afterPrepare.numAccelSegments : afterPrepare.numDecelSegments) - 1;
+	while (i != 0 && segments[i].startDistance > distance)
+	{
+		--i;
+	}
+
+	// Solve distance = startSpeed * t + acceleration * t^2/2. This form of the solution doesn't lose accuracy when the acceleration is small or zero.
+	const ShapedSegment& seg = segments[i];
+	const float d = distance - seg.startDistance;
+	float t = 0.0f;
+	if (d > 0.0f)
+	{
+		const float root = sqrtf(max<float>(fsquare(seg.startSpeed) + 2.0f * seg.acceleration * d, 0.0f));
+		const float denominator = seg.startSpeed + root;
+		if (denominator > 0.0f)
+		{
+			t = (2.0f * d)/denominator;
+		}
+
+		// If we are limiting jerk then that was only a first approximation, so refine it using Newton's method. A fixed number of iterations keeps the ISR time bounded.
+		if (seg.jerk != 0.0f)
+		{
+			for (unsigned int iteration = 0; iteration < MaxShapedStepIterations; ++iteration)
+			{
+				const float speed = seg.startSpeed + (seg.acceleration + 0.5f * seg.jerk * t) * t;
+				if (speed <= 0.0f)
+				{
+					break;
+				}
+				const float error = (seg.startSpeed + (0.5f * seg.acceleration + (1.0f/6.0f) * seg.jerk * t) * t) * t - d;
+				t = max<float>(t - error/speed, 0.0f);
+			}
+		}
+	}
+	return ((accelerating) ? 0 : afterPrepare.decelStartClocks) + (uint32_t)(seg.startTime + t + 0.5f);
+}
+
+#endif
+
+// Time the step calculations for a representative move of drive 0, using the current input shaping and (for delta moves) kinematics parameters.
+// The move is prepared in a local DDA but never executed, and the drive is not enabled. We disable the step queue so that every step is calculated here.
+// Return false if there is no DM free, or if we were asked for a delta move and the kinematics isn't linear delta.
+// This takes a DM from the free list, so it must only be called when no moves are running.
+/*static*/ bool DDA::BenchmarkStepTimes(bool delta, uint32_t& ticks, uint32_t& steps)
+{
+	constexpr int32_t BenchmarkSteps = 256;				// keep this small because we time the steps with interrupts disabled
+
+#if SUPPORT_DELTA_MOVEMENT
+	if (delta && !moveInstance->IsDeltaMode())
+#else
+	if (delta)
+#endif
+	{
+		return false;
+	}
+
+	CanMessageMovement msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.accelerationClocks = StepTimer::StepClockRate/200;	// 5ms acceleration, 10ms steady speed and 5ms deceleration
+	msg.steadyClocks = StepTimer::StepClockRate/100;
+	msg.decelClocks = StepTimer::StepClockRate/200;
+	msg.perDrive[0].steps = BenchmarkSteps;
+	if (delta)
+	{
+		msg.deltaDrives = 1;
+		msg.finalX = 10.0;
+		msg.finalY = 5.0;
+	}
+
+	DDA dda(nullptr);
+	DriveMovement * const pdm = DriveMovement::Allocate(0, DMState::moving);
+	if (pdm == nullptr)
+	{
+		return false;
+	}
+	dda.pddm[0] = pdm;
+#if SUPPORT_DYNAMIC_MICROSTEPPING
+	pdm->microstepShift = 0;
+#endif
+	pdm->totalSteps = BenchmarkSteps;
+	pdm->direction = true;
+	dda.SetMotionParameters(msg);
+	dda.state = provisional;
+	dda.Prepare(msg, false);
+#if USE_STEP_QUEUES
+	pdm->stepQueueActive = false;
+#endif
+
+	uint32_t numSteps = 1;								// Prepare calculated the first step
+	{
+		AtomicCriticalSectionLocker lock;
+		const uint32_t startTicks = StepTimer::GetTimerTicks();
+#if SUPPORT_DELTA_MOVEMENT
+		if (delta)
+		{
+			while (pdm->CalcNextStepTimeDelta(dda, false))
+			{
+				++numSteps;
+			}
+		}
+		else
+#endif
+		{
+			while (pdm->CalcNextStepTimeCartesian(dda, false))
+			{
+				++numSteps;
+			}
+		}
+		ticks = StepTimer::GetTimerTicks() - startTicks;
+	}
+	steps = numSteps;
+	dda.ReleaseDMs();
+	return true;
+}
+
 // The remaining functions are speed-critical, so use full optimisation
 // The GCC optimize pragma appears to be broken, if we try to force O3 optimisation here then functions are never inlined
 
 // Start executing this move. Must be called with interrupts disabled, to avoid a race condition.
-void DDA::Start(uint32_t tim)
+// If the move is late starting by no more than we can catch up, we keep its scheduled start time so that its steps stay in step with the drivers on other boards
+// that are executing the same move. Otherwise we have to reschedule it from when it actually starts, and we return false.
+STEP_PATH_RAMFUNC bool DDA::Start(uint32_t tim)
 pre(state == frozen)
 {
-	if ((int32_t)(afterPrepare.moveStartTime - tim) < 0)
+	const int32_t lateness = (int32_t)(tim - afterPrepare.moveStartTime);
+#if SUPPORT_STRICT_MOVE_START
+	const bool onSchedule = lateness <= (int32_t)MaxCatchUpClocks;
+#else
+	const bool onSchedule = lateness <= 0;
+#endif
+	if (!onSchedule)
 	{
-		afterPrepare.moveStartTime = tim;			// this move is late starting, so record the actual start time
+		afterPrepare.moveStartTime = tim;			// this move is too late starting, so record the actual start time
 	}
 	state = executing;
+	Tracer::Record(Tracer::Event::ddaStarted, (uint16_t)min<uint32_t>(clocksNeeded/(StepTimer::StepClockRate/1000), 0xFFFF));
 
-	if (activeDMs != nullptr)
+	if (FirstActiveDM() != nullptr)
 	{
+		// If we are using step bursts then the previous move has finished its burst by now, because the last step of a move is never in a burst
+		// and StepDrivers doesn't generate a step in software while a burst is running
 		for (size_t i = 0; i < NumDrivers; ++i)
 		{
 			DriveMovement* const pdm = FindDM(i);
@@ -361,27 +649,56 @@ pre(state == frozen)
 			}
 		}
 	}
+	return onSchedule;
 }
 
 uint32_t DDA::lastStepLowTime = 0;
 uint32_t DDA::lastDirChangeTime = 0;
 
+#if SUPPORT_STEP_ERROR_CORRECTION
+
+// Record the steps that a drive didn't take because it had a step error, at the microstepping that the main board uses, so that the Move task
+// can add them to the next moves of that drive. Called from the step ISR when a drive has no more steps, which is the only time that a step error can show up.
+inline void DDA::RecordLostSteps(const DriveMovement *dm) const
+{
+	const int32_t stepsLost = dm->GetNetStepsLost();
+	if (stepsLost != 0)
+	{
+		moveInstance->RecordLostSteps(dm->drive, stepsLost << dm->microstepShift);
+	}
+}
+
+#endif
+
 #if SINGLE_DRIVER
 
 // This is called by the interrupt service routine to execute steps.
 // It returns true if it needs to be called again on the DDA of the new current move, otherwise false.
 // This must be as fast as possible, because it determines the maximum movement speed.
 // This may occasionally get called prematurely, so it must check that a step is actually due before generating one.
-void DDA::StepDrivers(uint32_t now)
+STEP_PATH_RAMFUNC void DDA::StepDrivers(uint32_t now)
 {
+	PROFILE_STEP_PATH(stepDrivers);
 	// Determine whether the driver is due for stepping, overdue, or will be due very shortly
 	DriveMovement* const dm = activeDMs;
-	if (dm != nullptr && (now - afterPrepare.moveStartTime) + StepTimer::MinInterruptInterval >= dm->nextStepTime)	// if the next step is due
+	if (   dm != nullptr && (now - afterPrepare.moveStartTime) + StepTimer::MinInterruptInterval >= dm->nextStepTime	// if the next step is due
+#if SUPPORT_STEP_BURSTS
+		&& !StepBurstGenerator::IsBusy()								// and any burst has finished, else ScheduleNextStepInterrupt defers the step until it ends
+#endif
+	   )
 	{
 		// Step the driver
 #if SUPPORT_SLOW_DRIVERS
 		if (Platform::IsSlowDriver())									// if using a slow driver
 		{
+# if SUPPORT_STEP_PULSE_TIMER
+			// The step low time and direction setup time are measured from when the last pulse ended, which may still be in the future
+			while ((int32_t)(now - lastStepLowTime) < (int32_t)Platform::GetSlowDriverStepLowClocks() || now - lastDirChangeTime < Platform::GetSlowDriverDirSetupClocks())
+			{
+				now = StepTimer::GetTimerTicks();
+			}
+			lastStepLowTime = StepPulseTimer::Pulse();					// generate the step, the TC ends it
+# else
 			uint32_t lastStepPulseTime = lastStepLowTime;
 			while (now - lastStepPulseTime < Platform::GetSlowDriverStepLowClocks() || now - lastDirChangeTime < Platform::GetSlowDriverDirSetupClocks())
 			{
@@ -394,6 +711,7 @@ void DDA::StepDrivers(uint32_t now)
 			while (StepTimer::GetTimerTicks() - lastStepPulseTime < Platform::GetSlowDriverStepHighClocks()) {}
 			Platform::StepDriverLow();									// set all step pins low
 			lastStepLowTime = StepTimer::GetTimerTicks();
+# endif
 		}
 		else
 		{
@@ -403,6 +721,16 @@ void DDA::StepDrivers(uint32_t now)
 		Platform::StepDriverHigh();										// generate the step pulse
 #endif
 
+#if SUPPORT_STEP_BURSTS
+		// If the following steps are all at steady speed, try to have the hardware generate them
+		size_t burstSteps;
+		uint32_t firstBurstStepTime;
+		if ((burstSteps = dm->PrepareStepBurst(*this, StepBurstGenerator::GetIntervalBuffer(), StepBurstGenerator::MaxBurstSteps, firstBurstStepTime)) != 0)
+		{
+			StepBurstGenerator::Start(afterPrepare.moveStartTime + firstBurstStepTime, burstSteps);
+		}
+#endif
+
 #if SUPPORT_DELTA_MOVEMENT
 		const bool hasMoreSteps = (dm->IsDeltaMovement())
 				? dm->CalcNextStepTimeDelta(*this, true)
@@ -413,10 +741,18 @@ void DDA::StepDrivers(uint32_t now)
 		if (!hasMoreSteps)
 		{
 			activeDMs = nullptr;
+#if SUPPORT_STEP_ERROR_CORRECTION
+			RecordLostSteps(dm);
+#endif
 		}
 
 		// Reset the step pin low. We already did this if we are using any external drivers, but doing it again does no harm.
-		Platform::StepDriverLow();										// set the step pin low
+#if SUPPORT_STEP_PULSE_TIMER
+		if (!Platform::IsSlowDriver())									// if the pulse timer is ending the pulse then we mustn't cut it short
+#endif
+		{
+			Platform::StepDriverLow();									// set the step pin low
+		}
 	}
 
 	// If there are no more steps to do and the time for the move has nearly expired, flag the move as complete
@@ -432,18 +768,28 @@ void DDA::StepDrivers(uint32_t now)
 // It returns true if it needs to be called again on the DDA of the new current move, otherwise false.
 // This must be as fast as possible, because it determines the maximum movement speed.
 // This may occasionally get called prematurely, so it must check that a step is actually due before generating one.
-void DDA::StepDrivers(uint32_t now)
+STEP_PATH_RAMFUNC void DDA::StepDrivers(uint32_t now)
 {
+	PROFILE_STEP_PATH(stepDrivers);
 	// 1. There is no step 1.
 	// 2. Determine which drivers are due for stepping, overdue, or will be due very shortly
 	uint32_t driversStepping = 0;
-	DriveMovement* dm = activeDMs;
 	const uint32_t elapsedTime = (now - afterPrepare.moveStartTime) + StepTimer::MinInterruptInterval;
+#if USE_SORTED_DM_ARRAY
+	size_t numDue = 0;
+	while (numDue < numActiveDMs && elapsedTime >= activeDMs[numDue]->nextStepTime)	// if the next step is due
+	{
+		driversStepping |= Platform::GetDriversBitmap(activeDMs[numDue]->drive);
+		++numDue;
+	}
+#else
+	DriveMovement* dm = activeDMs;
 	while (dm != nullptr && elapsedTime >= dm->nextStepTime)		// if the next step is due
 	{
 		driversStepping |= Platform::GetDriversBitmap(dm->drive);
 		dm = dm->nextDM;
 	}
+#endif
 
 	// 3. Step the drivers
 #if SUPPORT_SLOW_DRIVERS
@@ -470,6 +816,55 @@ void DDA::StepDrivers(uint32_t now)
 	Platform::StepDriversHigh(driversStepping);						// generate the steps
 #endif
 
+#if USE_SORTED_DM_ARRAY
+	// 4. Calculate the next step times of all the drives that stepped and update the direction pins where necessary.
+	//    Then sort the drives that still have steps to do and merge them with the ones that didn't step, to keep the array in step-time order.
+	//    Note that the call to CalcNextStepTime may change the state of Direction pin.
+	DriveMovement *stepped[NumDrivers];
+	size_t numStepped = 0;
+	for (size_t i = 0; i < numDue; ++i)
+	{
+		DriveMovement * const dmStepped = activeDMs[i];
+# if SUPPORT_DELTA_MOVEMENT
+		const bool hasMoreSteps = (dmStepped->IsDeltaMovement())
+				? dmStepped->CalcNextStepTimeDelta(*this, true)
+				: dmStepped->CalcNextStepTimeCartesian(*this, true);
+# else
+		const bool hasMoreSteps = dmStepped->CalcNextStepTimeCartesian(*this, true);
+# endif
+		if (hasMoreSteps)
+		{
+			size_t j = numStepped;
+			while (j != 0 && stepped[j - 1]->nextStepTime > dmStepped->nextStepTime)
+			{
+				stepped[j] = stepped[j - 1];
+				--j;
+			}
+			stepped[j] = dmStepped;
+			++numStepped;
+		}
+#if SUPPORT_STEP_ERROR_CORRECTION
+		else
+		{
+			RecordLostSteps(dmStepped);
+		}
+#endif
+	}
+
+	// Merge in place. The write index never overtakes the read index of the drives that didn't step, because numStepped <= numDue.
+	size_t readIndex = numDue, writeIndex = 0, steppedIndex = 0;
+	while (steppedIndex < numStepped)
+	{
+		activeDMs[writeIndex++] = (readIndex < numActiveDMs && activeDMs[readIndex]->nextStepTime < stepped[steppedIndex]->nextStepTime)
+									? activeDMs[readIndex++]
+									: stepped[steppedIndex++];
+	}
+	while (readIndex < numActiveDMs)
+	{
+		activeDMs[writeIndex++] = activeDMs[readIndex++];
+	}
+	numActiveDMs = writeIndex;
+#else
 	// 4. Remove those drives from the list, calculate the next step times, update the direction pins where necessary,
 	//    and re-insert them so as to keep the list in step-time order.
 	//    Note that the call to CalcNextStepTime may change the state of Direction pin.
@@ -489,14 +884,21 @@ void DDA::StepDrivers(uint32_t now)
 		{
 			InsertDM(dmToInsert);
 		}
+#if SUPPORT_STEP_ERROR_CORRECTION
+		else
+		{
+			RecordLostSteps(dmToInsert);
+		}
+#endif
 		dmToInsert = nextToInsert;
 	}
+#endif
 
 	// 5. Reset all step pins low. We already did this if we are using any external drivers, but doing it again does no harm.
 	Platform::StepDriversLow();										// set all step pins low
 
 	// 6. If there are no more steps to do and the time for the move has nearly expired, flag the move as complete
-	if (activeDMs == nullptr && StepTimer::GetTimerTicks() - afterPrepare.moveStartTime + WakeupTime >= clocksNeeded)
+	if (FirstActiveDM() == nullptr && StepTimer::GetTimerTicks() - afterPrepare.moveStartTime + WakeupTime >= clocksNeeded)
 	{
 		state = completed;
 	}
@@ -504,6 +906,23 @@ void DDA::StepDrivers(uint32_t now)
 
 #endif
 
+#if USE_STEP_QUEUES
+
+// Top up the step time queues of the drives in this move. Called by the Move task while the move is executing.
+void DDA::FillStepQueues()
+{
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		DriveMovement * const pdm = FindDM(drive);
+		if (pdm != nullptr && pdm->state == DMState::moving)
+		{
+			pdm->FillStepQueue(*this);
+		}
+	}
+}
+
+#endif
+
 // Stop a drive and re-calculate the corresponding endpoint.
 // For extruder drivers, we need to be able to calculate how much of the extrusion was completed after calling this.
 void DDA::StopDrive(size_t drive)
@@ -511,9 +930,12 @@ void DDA::StopDrive(size_t drive)
 	DriveMovement* const pdm = FindDM(drive);
 	if (pdm != nullptr && pdm->state == DMState::moving)
 	{
+#if SUPPORT_STEP_BURSTS
+		pdm->nextStep -= StepBurstGenerator::Abort();				// allow for any steps in the current burst that were not generated
+#endif
 		pdm->state = DMState::idle;
 		RemoveDM(drive);
-		if (activeDMs == nullptr)
+		if (FirstActiveDM() == nullptr)
 		{
 			state = completed;
 		}
@@ -535,6 +957,61 @@ void DDA::MoveAborted()
 	state = completed;
 }
 
+#if SUPPORT_CONTROLLED_STOP
+
+// Set up a move that follows on from this one in the same direction and decelerates from its end speed to a stop, returning false if none is needed.
+// We use the deceleration of this move, or its acceleration if it doesn't decelerate. The distance to stop and the speed and deceleration are all
+// fractions of the length of this move, so each drive moves the same fraction of its steps in this move.
+// Only call this from the Move task, with the step interrupt locked out so that the move doesn't complete while we read its DMs.
+bool DDA::GetControlledStopMove(CanMessageMovement& msg) const
+{
+	if (endSpeed <= 0.0 || flags.stopAllDrivesOnEndstopHit)
+	{
+		return false;
+	}
+
+	constexpr uint32_t DefaultStopClocks = StepTimer::StepClockRate/10;		// how long we take to stop if this move neither accelerates nor decelerates
+	const float decel = (deceleration > 0.0) ? deceleration : (acceleration > 0.0) ? acceleration : endSpeed/DefaultStopClocks;
+	const float stopDistance = fsquare(endSpeed)/(2 * decel);
+
+	memset(&msg, 0, sizeof(msg));
+	bool anySteps = false;
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		if (MovesDrive(drive))
+		{
+			// The drive may have finished its steps already, in which case we released its DM and kept what we need from it
+			const DriveMovement * const pdm = FindDM(drive);
+			if ((pdm != nullptr) ? pdm->IsDeltaMovement() : finishedDrives[drive].isDeltaMovement)
+			{
+				return false;								// the towers don't move in a straight line, so we can't extrapolate the move
+			}
+			if ((pdm != nullptr) ? pdm->reverseStartStep > pdm->totalSteps : !finishedDrives[drive].hadReversePhase)	// if there is a reverse phase then the drive is an extruder that is retracting at the end, so leave it alone
+			{
+				const int32_t steps = lrintf((float)GetNetSteps(drive) * stopDistance);		// with no reverse phase the net steps are the total steps in the direction of movement
+				if (steps != 0)
+				{
+					msg.perDrive[drive].steps = steps;
+					anySteps = true;
+				}
+			}
+		}
+	}
+	if (!anySteps)
+	{
+		return false;
+	}
+
+	msg.whenToExecute = GetMoveFinishTime();
+	msg.accelerationClocks = msg.steadyClocks = 0;
+	msg.decelClocks = max<uint32_t>(lrintf(endSpeed/decel), 1);
+	msg.initialSpeedFraction = 1.0;
+	msg.finalSpeedFraction = 0.0;
+	return true;
+}
+
+#endif
+
 void DDA::StopDrivers(uint16_t whichDrivers)
 {
 	if (state == executing)
@@ -549,6 +1026,48 @@ void DDA::StopDrivers(uint16_t whichDrivers)
 	}
 }
 
+#if SUPPORT_PROBE_SLOWDOWN
+
+// Slow down the rest of this move by an integer factor, returning true if we did. Called with the step interrupt locked out when an analog Z probe
+// is approaching its threshold, so that the main board can approach fast and still trigger accurately. The drives switch to the steady speed phase.
+bool DDA::ReduceSpeed(uint32_t inverseSpeedFactor, uint32_t now)
+{
+	if (state != executing || flags.goingSlow)
+	{
+		return false;
+	}
+
+	flags.goingSlow = true;
+	topSpeed /= (float)inverseSpeedFactor;
+
+	// Adjust extraAccelerationClocks so that the step times in the steady speed phase are correct at the new speed from now on
+	const uint32_t clocksSoFar = now - afterPrepare.moveStartTime;
+	afterPrepare.extraAccelerationClocks = (afterPrepare.extraAccelerationClocks * (int32_t)inverseSpeedFactor) - ((int32_t)clocksSoFar * (int32_t)(inverseSpeedFactor - 1));
+
+	// Adjust the total clocks needed so that the steps still finish within the move
+	if (clocksSoFar < clocksNeeded)
+	{
+		clocksNeeded += (clocksNeeded - clocksSoFar) * (inverseSpeedFactor - 1);
+	}
+
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		DriveMovement * const pdm = FindDM(drive);
+		if (pdm != nullptr && pdm->state == DMState::moving)
+		{
+#if SUPPORT_STEP_BURSTS
+			pdm->nextStep -= StepBurstGenerator::Abort();			// the steps in the current burst that were not generated will be timed at the new speed
+#endif
+			pdm->ReduceSpeed(*this, inverseSpeedFactor);
+			RemoveDM(drive);
+			InsertDM(pdm);
+		}
+	}
+	return true;
+}
+
+#endif
+
 bool DDA::HasStepError() const
 {
 #if 0	//debug
@@ -558,6 +1077,11 @@ bool DDA::HasStepError() const
 	}
 #endif
 
+	if (flags.hadStepError)
+	{
+		return true;			// a drive whose DM we have already released had a step error
+	}
+
 	for (size_t drive = 0; drive < NumDrivers; ++drive)
 	{
 		const DriveMovement* const pdm = FindDM(drive);
@@ -581,7 +1105,83 @@ bool DDA::Free()
 int32_t DDA::GetStepsTaken(size_t drive) const
 {
 	const DriveMovement * const dmp = FindDM(drive);
-	return (dmp != nullptr) ? dmp->GetNetStepsTaken() : 0;
+	return (dmp != nullptr) ? dmp->GetNetStepsTaken() : finishedDrives[drive].netSteps;
+}
+
+#if SUPPORT_POSITION_REPORTS
+
+// Get the net steps that a drive has taken so far in this move and its current speed in steps per second, both at the microstepping that the main board uses.
+// The speed ignores any reversal of extruders due to pressure advance. Call this with the step interrupt locked out.
+void DDA::GetLiveMotion(size_t drive, uint32_t now, int32_t& stepsTaken, float& stepsPerSecond) const
+{
+	const DriveMovement * const dmp = FindDM(drive);
+	if (dmp == nullptr || state != executing)
+	{
+		stepsTaken = (state == executing) ? GetNetSteps(drive) : 0;		// if the drive has finished and we released its DM then it has taken all its steps
+		stepsPerSecond = 0.0;
+	}
+	else
+	{
+		stepsTaken = dmp->GetNetStepsTaken() << dmp->microstepShift;
+		const int32_t netSteps = (dmp->GetNetStepsTaken() + dmp->GetNetStepsLeft()) << dmp->microstepShift;
+		stepsPerSecond = (dmp->state == DMState::moving)
+							? GetSpeedFraction(now) * topSpeed * (float)netSteps * (float)StepTimer::StepClockRate
+								: 0.0;
+	}
+}
+
+#endif
+
+#if SUPPORT_PHASE_STEPPING
+
+// Get the fraction of the move distance covered at the specified time, calculated from the move profile instead of from the steps taken
+float DDA::GetDistanceFraction(uint32_t when) const
+pre(state == executing)
+{
+	const float t = constrain<float>((float)(int32_t)(when - afterPrepare.moveStartTime), 0.0, (float)clocksNeeded);
+	const float accelClocks = (acceleration > 0.0) ? (topSpeed - startSpeed)/acceleration : 0.0;
+	const float decelStart = (float)clocksNeeded - ((deceleration > 0.0) ? (topSpeed - endSpeed)/deceleration : 0.0);
+	const float distance = (t < accelClocks) ? (startSpeed + 0.5 * acceleration * t) * t
+							: (t < decelStart) ? accelDistance + topSpeed * (t - accelClocks)
+								: (1.0 - decelDistance) + (topSpeed - 0.5 * deceleration * (t - decelStart)) * (t - decelStart);
+	return constrain<float>(distance, 0.0, 1.0);
+}
+
+// Get the net steps including the fraction of a step that a drive should have taken at the specified time, at the microstepping that the drive uses.
+// For drives that follow the move profile exactly we calculate it from the profile, so that it doesn't depend on when the steps were generated.
+// We keep it within a step of the steps actually taken, so that a drive that was stopped early or a move that was slowed down doesn't make the motor jump.
+// Delta towers and extruders with pressure advance don't follow the profile, so for those we use the steps taken. Call this with the step interrupt locked out.
+float DDA::GetLiveSteps(size_t drive, uint32_t when) const
+{
+	const DriveMovement * const dmp = FindDM(drive);
+	if (dmp == nullptr)
+	{
+		return (float)finishedDrives[drive].netSteps;				// zero unless the drive has finished and we released its DM
+	}
+
+	const float stepsTaken = (float)dmp->GetNetStepsTaken();
+	if (state != executing || dmp->state != DMState::moving || !dmp->isShaped || flags.goingSlow)
+	{
+		return stepsTaken;
+	}
+	const float netSteps = (float)(dmp->GetNetStepsTaken() + dmp->GetNetStepsLeft());
+	return constrain<float>(GetDistanceFraction(when) * netSteps, stepsTaken - 1.0, stepsTaken + 1.0);
+}
+
+#endif
+
+// Get the net number of steps in this move in the forwards direction, converted back to the microstepping that the main board uses.
+// Only call this from the Move task, because that is where DMs are released.
+// Steps lost because of a step error are left out, because they are added to later moves.
+int32_t DDA::GetNetSteps(size_t drive) const
+{
+	const DriveMovement * const dmp = FindDM(drive);
+#if SUPPORT_STEP_ERROR_CORRECTION
+	return (dmp != nullptr) ? (dmp->GetNetStepsTaken() + dmp->GetNetStepsLeft() - dmp->GetNetStepsLost()) << dmp->microstepShift
+#else
+	return (dmp != nullptr) ? (dmp->GetNetStepsTaken() + dmp->GetNetStepsLeft()) << dmp->microstepShift
+#endif
+			: finishedDrives[drive].netSteps << finishedDrives[drive].microstepShift;
 }
 
 // End
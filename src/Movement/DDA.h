@@ -12,9 +12,15 @@
 #include "DriveMovement.h"
 #include "GCodes/GCodes.h"			// for class RawMove, HomeAxes
 #include "StepTimer.h"
+#include "InputShaper.h"
+#include "StepBurstGenerator.h"
 
 struct CanMessageMovement;
 
+#if USE_SORTED_DM_ARRAY && SINGLE_DRIVER
+# error USE_SORTED_DM_ARRAY is only supported on boards with more than one driver
+#endif
+
 // This defines a single coordinated movement of one or several motors
 class DDA
 {
@@ -35,7 +41,7 @@ public:
 
 	bool Init(const CanMessageMovement& msg);
 	void Init();													// Set up initial positions for machine startup
-	void Start(uint32_t tim) __attribute__ ((hot));					// Start executing the DDA, i.e. move the move.
+	bool Start(uint32_t tim) __attribute__ ((hot));					// Start executing the DDA, i.e. move the move. Returns false if it had to be rescheduled because it started late.
 	void StepDrivers(uint32_t now) __attribute__ ((hot));			// Take one step of the DDA, called by timed interrupt.
 	bool ScheduleNextStepInterrupt(StepTimer& timer) const;			// Schedule the next interrupt, returning true if we can't because it is already due
 
@@ -43,23 +49,48 @@ public:
 	void SetPrevious(DDA *p) { prev = p; }
 	void Complete() { state = completed; }
 	bool Free();
-	void Prepare(const CanMessageMovement& msg) __attribute__ ((hot));	// Calculate all the values and freeze this DDA
+	void Prepare(const CanMessageMovement& msg, bool enableDrives) __attribute__ ((hot));	// Calculate all the values and freeze this DDA
 	bool HasStepError() const;
+	void ReleaseFinishedDMs();										// Return the DMs of drives that have finished their steps to the pool
+#if USE_STEP_QUEUES
+	void FillStepQueues();
+#endif
 
 	DDAState GetState() const { return state; }
 	DDA* GetNext() const { return next; }
 	DDA* GetPrevious() const { return prev; }
+	bool MovesDrive(size_t drive) const { return FindDM(drive) != nullptr || finishedDrives[drive].finished; }
 	int32_t GetTimeLeft() const;
-	void InsertHiccup(uint32_t now);
+	float GetSpeedFraction(uint32_t now) const;						// Get the current speed as a fraction of the top speed, for outputs that follow the motion
+	uint32_t InsertHiccup(uint32_t now, uint32_t hiccupTime);
 
 	// Filament monitor support
 	int32_t GetStepsTaken(size_t drive) const;
+	int32_t GetNetSteps(size_t drive) const;						// Get the net steps of this move at the configured microstepping
+#if SUPPORT_POSITION_REPORTS
+	void GetLiveMotion(size_t drive, uint32_t now, int32_t& stepsTaken, float& stepsPerSecond) const;	// Get the progress and speed of a drive in an executing move
+#endif
+#if SUPPORT_PHASE_STEPPING
+	float GetLiveSteps(size_t drive, uint32_t when) const;			// Get the net steps including the fraction of a step that a drive should have taken at the specified time
+#endif
 
 	void MoveAborted();
 	void StopDrivers(uint16_t whichDrivers);
+#if SUPPORT_PROBE_SLOWDOWN
+	bool ReduceSpeed(uint32_t inverseSpeedFactor, uint32_t now);	// Slow down the rest of the move because a Z probe is approaching its threshold
+#endif
+#if SUPPORT_CONTROLLED_STOP
+	bool GetControlledStopMove(CanMessageMovement& msg) const;		// Set up a move that continues this one and decelerates to a stop
+#endif
 
 	uint32_t GetClocksNeeded() const { return clocksNeeded; }
+	uint32_t GetMoveStartTime() const { return afterPrepare.moveStartTime; }
 	uint32_t GetMoveFinishTime() const { return afterPrepare.moveStartTime + clocksNeeded; }
+#if SUPPORT_INPUT_SHAPING
+	bool IsAccelShaped() const { return afterPrepare.numAccelSegments != 0; }
+	bool IsDecelShaped() const { return afterPrepare.numDecelSegments != 0; }
+	uint32_t CalcShapedStepTime(float distance, bool accelerating) const __attribute__ ((hot));
+#endif
 
 #if HAS_SMART_DRIVERS
 	uint32_t GetStepInterval(size_t axis, uint32_t microstepShift) const;	// Get the current full step interval for this axis or extruder
@@ -87,18 +118,36 @@ public:
 	static constexpr uint32_t MaxStepInterruptTime = (80 * StepTimer::StepClockRate)/1000000;		// the maximum time we spend looping in the ISR in step clocks
 #endif
 	static constexpr uint32_t WakeupTime = (100 * StepTimer::StepClockRate)/1000000;				// stop resting 100us before the move is due to end
+	static constexpr uint32_t MaxHiccupTime = 8 * HiccupTime;										// the longest hiccup we insert when we keep running out of time
+#if SUPPORT_STRICT_MOVE_START
+	static constexpr uint32_t MaxCatchUpClocks = (500 * StepTimer::StepClockRate)/1000000;			// a move that starts later than this is rescheduled from when it starts instead of catching up
+#endif
+	static constexpr uint32_t FastDriveIntervalMultiplier = 4;										// a drive counts as fast if its top speed step interval is less than this times MinCalcInterval
+#if SUPPORT_INPUT_SHAPING
+	static constexpr unsigned int MaxShapedStepIterations = 3;										// the number of Newton iterations when calculating step times with limited jerk
+#endif
 
 	static void PrintMoves();										// print saved moves for debugging
+	static bool BenchmarkStepTimes(bool delta, uint32_t& ticks, uint32_t& steps);	// time the step calculations for a representative move without executing it
 
 	static uint32_t lastStepLowTime;								// when we last completed a step pulse to a slow driver
 	static uint32_t lastDirChangeTime;								// when we last change the DIR signal to a slow driver
 
 private:
+	bool InitMove(const CanMessageMovement& msg);					// set up a move from a movement message whose extruder steps have been mixed if necessary
+	void SetMotionParameters(const CanMessageMovement& msg);		// set up the speeds and distances from a movement message
+#if SUPPORT_PHASE_STEPPING
+	float GetDistanceFraction(uint32_t when) const;					// get the fraction of the move distance covered at the specified time according to the move profile
+#endif
 	DriveMovement *FindDM(size_t drive) const;
+	DriveMovement *FirstActiveDM() const;							// get the DM with the earliest step due, or nullptr if there are none
 	void StopDrive(size_t drive);									// stop movement of a drive and recalculate the endpoint
 	void InsertDM(DriveMovement *dm) __attribute__ ((hot));
 	void RemoveDM(size_t drive);
 	void ReleaseDMs();
+#if SUPPORT_STEP_ERROR_CORRECTION
+	void RecordLostSteps(const DriveMovement *dm) const __attribute__ ((hot));	// tell Move about the steps that a drive lost because of a step error
+#endif
 	void DebugPrintVector(const char *name, const float *vec, size_t len) const;
 
     DDA *next;								// The next one in the ring
@@ -112,21 +161,12 @@ private:
 		{
 			uint16_t goingSlow : 1,					// True if we have slowed the movement because the Z probe is approaching its threshold
 					 hadHiccup : 1,					// True if we had a hiccup while executing this move
-					 stopAllDrivesOnEndstopHit : 1;	// True if hitting an endstop stops the entire move
+					 stopAllDrivesOnEndstopHit : 1,	// True if hitting an endstop stops the entire move
+					 hadStepError : 1;				// True if a drive whose DM we have released had a step error
 		} flags;
 		uint16_t all;								// so that we can print all the flags at once for debugging
 	};
 
-	float acceleration;						// The acceleration to use
-	float deceleration;						// The deceleration to use
-
-    // These vary depending on how we connect the move with its predecessor and successor, but remain constant while the move is being executed
-	float startSpeed;
-	float endSpeed;
-	float topSpeed;
-	float accelDistance;
-	float decelDistance;
-
 	uint32_t clocksNeeded;
 
 	// Values that are not set or accessed before Prepare is called
@@ -138,12 +178,52 @@ private:
 		uint32_t topSpeedTimesCdivDPlusDecelStartClocks;
 		int32_t extraAccelerationClocks;	// the additional number of clocks needed because we started the move at less than topSpeed. Negative after ReduceHomingSpeed has been called.
 
+		// The step intervals below which we calculate steps in batches. These are increased when several drives will be stepping fast, to reduce the risk of hiccups.
+		uint32_t minCalcIntervalCartesian;
+		uint32_t minCalcIntervalDelta;
+
 		// These are used only in delta calculations
 		int32_t cKc;						// The Z movement fraction multiplied by Kc and converted to integer
+
+#if SUPPORT_INPUT_SHAPING
+		// The shaped acceleration and deceleration phases, used by the drives that follow the move profile exactly. A phase with no segments is not shaped.
+		uint32_t decelStartClocks;
+		uint8_t numAccelSegments;
+		uint8_t numDecelSegments;
+		ShapedSegment accelSegments[InputShaper::MaxSegments];
+		ShapedSegment decelSegments[InputShaper::MaxSegments];
+#endif
 	} afterPrepare;
 
+#if USE_SORTED_DM_ARRAY
+	DriveMovement *activeDMs[NumDrivers];	// contained DMs that need steps, in step time order
+	size_t numActiveDMs;					// how many entries in activeDMs are valid
+#else
     DriveMovement* activeDMs;				// list of contained DMs that need steps, in step time order
+#endif
 	DriveMovement *pddm[NumDrivers];		// These describe the state of each drive movement
+
+	// What we still need to know about a drive whose DM we released because it finished its steps before the move was recycled
+	struct FinishedDrive
+	{
+		int32_t netSteps;					// the net steps the drive took, at the microstepping it used, or zero if we haven't released its DM
+		uint8_t microstepShift : 4,
+				isDeltaMovement : 1,
+				hadReversePhase : 1,
+				finished : 1;
+	};
+	FinishedDrive finishedDrives[NumDrivers];
+
+	// The values above are used by the step ISR. The ones below are used to plan and prepare the move, and afterwards only by code outside the ISR.
+	float acceleration;						// The acceleration to use
+	float deceleration;						// The deceleration to use
+
+    // These vary depending on how we connect the move with its predecessor and successor, but remain constant while the move is being executed
+	float startSpeed;
+	float endSpeed;
+	float topSpeed;
+	float accelDistance;
+	float decelDistance;
 };
 
 // Find the DriveMovement record for a given drive, or return nullptr if there isn't one
@@ -152,24 +232,45 @@ inline DriveMovement *DDA::FindDM(size_t drive) const
 	return pddm[drive];
 }
 
+inline DriveMovement *DDA::FirstActiveDM() const
+{
+#if USE_SORTED_DM_ARRAY
+	return (numActiveDMs != 0) ? activeDMs[0] : nullptr;
+#else
+	return activeDMs;
+#endif
+}
+
 // Schedule the next interrupt, returning true if we can't because it is already due
 // Base priority must be >= NvicPriorityStep or interrupts disabled when calling this
 inline bool DDA::ScheduleNextStepInterrupt(StepTimer& timer) const
 {
 	if (state == executing)
 	{
-		const uint32_t whenDue = ((activeDMs != nullptr) ? activeDMs->nextStepTime : clocksNeeded - DDA::WakeupTime)
+		const DriveMovement * const dm = FirstActiveDM();
+		uint32_t whenDue = ((dm != nullptr) ? dm->nextStepTime : clocksNeeded - DDA::WakeupTime)
 								+ afterPrepare.moveStartTime;
+#if SUPPORT_STEP_BURSTS
+		// If a burst is still running then the next step can't be generated in software until it has ended
+		if (dm != nullptr && StepBurstGenerator::IsBusy() && (int32_t)(StepBurstGenerator::GetEndTime() - whenDue) > 0)
+		{
+			whenDue = StepBurstGenerator::GetEndTime();
+		}
+#endif
 		return timer.ScheduleCallbackFromIsr(whenDue);
 	}
 	return false;
 }
 
-// Insert a hiccup long enough to guarantee that we will exit the ISR
-inline void DDA::InsertHiccup(uint32_t now)
+// Insert a hiccup long enough to guarantee that we will exit the ISR, returning the number of clocks by which the rest of the move has been delayed
+inline uint32_t DDA::InsertHiccup(uint32_t now, uint32_t hiccupTime)
 {
-	const uint32_t ticksDueAfterStart = (activeDMs != nullptr) ? activeDMs->nextStepTime : clocksNeeded - DDA::WakeupTime;
-	afterPrepare.moveStartTime = now + DDA::HiccupTime - ticksDueAfterStart;
+	const DriveMovement * const dm = FirstActiveDM();
+	const uint32_t ticksDueAfterStart = (dm != nullptr) ? dm->nextStepTime : clocksNeeded - DDA::WakeupTime;
+	const uint32_t oldStartTime = afterPrepare.moveStartTime;
+	afterPrepare.moveStartTime = now + hiccupTime - ticksDueAfterStart;
+	flags.hadHiccup = true;
+	return afterPrepare.moveStartTime - oldStartTime;
 }
 
 #if HAS_SMART_DRIVERS
@@ -12,12 +12,22 @@
 #include "Kinematics/LinearDeltaKinematics.h"
 #include "StepTimer.h"
 #include "Platform.h"
+#include "StepBurstGenerator.h"
+#include "StepTimingKernel.h"
+#include "StepProfiler.h"
+#include <DeferredLog.h>
 
 // Static members
 
 DriveMovement *DriveMovement::freeList = nullptr;
 int DriveMovement::numFree = 0;
 int DriveMovement::minFree = 0;
+#if USE_STEP_QUEUES
+uint32_t DriveMovement::numStepQueueUnderruns = 0;
+#endif
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+float DriveMovement::smoothedPaCarry[NumDrivers] = { 0.0 };
+#endif
 
 void DriveMovement::InitialAllocate(unsigned int num)
 {
@@ -44,10 +54,24 @@ DriveMovement *DriveMovement::Allocate(size_t drive, DMState st)
 		dm->nextDM = nullptr;
 		dm->drive = (uint8_t)drive;
 		dm->state = st;
+#if USE_STEP_QUEUES
+		dm->stepQueueActive = false;
+#endif
 	}
 	return dm;
 }
 
+#if USE_STEP_QUEUES
+
+uint32_t DriveMovement::GetAndClearStepQueueUnderruns()
+{
+	const uint32_t ret = numStepQueueUnderruns;
+	numStepQueueUnderruns = 0;
+	return ret;
+}
+
+#endif
+
 // Constructors
 DriveMovement::DriveMovement(DriveMovement *next) : nextDM(next)
 {
@@ -59,6 +83,13 @@ DriveMovement::DriveMovement(DriveMovement *next) : nextDM(next)
 void DriveMovement::PrepareCartesianAxis(const DDA& dda, const PrepParams& params)
 {
 	isDeltaMovement = false;
+	isShaped = true;
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+	isSmoothedPa = false;
+#endif
+#if SUPPORT_INPUT_SHAPING
+	distancePerStep = 1.0f/(float)totalSteps;
+#endif
 	mp.cart.twoCsquaredTimesMmPerStepDivA = roundU64((double)2.0/((double)totalSteps * (double)dda.acceleration));
 	mp.cart.twoCsquaredTimesMmPerStepDivD = roundU64((double)2.0/((double)totalSteps * (double)dda.deceleration));
 
@@ -74,17 +105,21 @@ void DriveMovement::PrepareCartesianAxis(const DDA& dda, const PrepParams& param
 	if (dda.decelDistance * totalSteps < 0.5)
 	{
 		mp.cart.decelStartStep = totalSteps + 1;
-		twoDistanceToStopTimesCsquaredDivD = 0;
+		mp.cart.twoDistanceToStopTimesCsquaredDivD = 0;
 	}
 	else
 	{
 		mp.cart.decelStartStep = (uint32_t)(params.decelStartDistance * totalSteps) + 1;
-		twoDistanceToStopTimesCsquaredDivD = isquare64(params.topSpeedTimesCdivD) + roundU64((params.decelStartDistance * 2)/dda.deceleration);
+		mp.cart.twoDistanceToStopTimesCsquaredDivD = isquare64(params.topSpeedTimesCdivD) + roundU64((params.decelStartDistance * 2)/dda.deceleration);
 	}
 
 	// No reverse phase
 	reverseStartStep = totalSteps + 1;
 	mp.cart.fourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD = 0;
+
+#if USE_STEP_TIME_TABLES
+	BuildStepTimeTable(dda);
+#endif
 }
 
 // Prepare this DM for a Delta axis move
@@ -92,17 +127,22 @@ void DriveMovement::PrepareCartesianAxis(const DDA& dda, const PrepParams& param
 void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 {
 	isDeltaMovement = true;
-	const float stepsPerMm = Platform::DriveStepsPerUnit(drive);
-	const float A = params.initialX - params.dparams->GetTowerX(drive);
-	const float B = params.initialY - params.dparams->GetTowerY(drive);
+	isShaped = false;									// the tower positions are not proportional to the distance moved
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+	isSmoothedPa = false;
+#endif
+	const LinearDeltaKinematics::TowerConstants& tower = params.towers[drive];
+	const float stepsPerMm = tower.stepsPerMm;
+	const float A = params.initialX - tower.x;
+	const float B = params.initialY - tower.y;
 	const float aAplusbB = A * params.dvecX + B * params.dvecY;
-	const float dSquaredMinusAsquaredMinusBsquared = params.dparams->GetDiagonalSquared(drive) - fsquare(A) - fsquare(B);
+	const float dSquaredMinusAsquaredMinusBsquared = tower.diagonalSquared - fsquare(A) - fsquare(B);
 	const float h0MinusZ0 = sqrtf(dSquaredMinusAsquaredMinusBsquared);
 	mp.delta.hmz0sK = roundS32(h0MinusZ0 * stepsPerMm * DriveMovement::K2);
 	mp.delta.minusAaPlusBbTimesKs = -roundS32(aAplusbB * stepsPerMm * DriveMovement::K2);
 	mp.delta.dSquaredMinusAsquaredMinusBsquaredTimesKsquaredSsquared = roundS64(dSquaredMinusAsquaredMinusBsquared * fsquare(stepsPerMm * DriveMovement::K2));
-	mp.delta.twoCsquaredTimesMmPerStepDivA = roundU64((double)(2 * StepTimer::StepClockRateSquared)/((double)stepsPerMm * (double)dda.acceleration));
-	mp.delta.twoCsquaredTimesMmPerStepDivD = roundU64((double)(2 * StepTimer::StepClockRateSquared)/((double)stepsPerMm * (double)dda.deceleration));
+	mp.delta.twoCsquaredTimesMmPerStepDivA = roundU64(tower.twoCsquaredTimesMmPerStep * params.recipAcceleration);
+	mp.delta.twoCsquaredTimesMmPerStepDivD = roundU64(tower.twoCsquaredTimesMmPerStep * params.recipDeceleration);
 
 	// Calculate the distance at which we need to reverse direction.
 	if (params.a2plusb2 <= 0.0)
@@ -115,7 +155,7 @@ void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 	{
 		// The distance to reversal is the solution to a quadratic equation. One root corresponds to the carriages being below the bed,
 		// the other root corresponds to the carriages being above the bed.
-		const float drev = ((params.dvecZ * sqrtf(params.a2plusb2 * params.dparams->GetDiagonalSquared(drive) - fsquare(A * params.dvecY - B * params.dvecX)))
+		const float drev = ((params.dvecZ * sqrtf(params.a2plusb2 * tower.diagonalSquared - fsquare(A * params.dvecY - B * params.dvecX)))
 							- aAplusbB)/params.a2plusb2;
 		if (drev > 0.0 && drev < 1.0)		// if the reversal point is within range
 		{
@@ -163,19 +203,177 @@ void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 	if (dda.decelDistance * stepsPerMm < 0.5)
 	{
 		mp.delta.decelStartDsK = 0xFFFFFFFF;
-		twoDistanceToStopTimesCsquaredDivD = 0;
+		mp.delta.twoDistanceToStopTimesCsquaredDivD = 0;
 	}
 	else
 	{
 		mp.delta.decelStartDsK = roundU32(params.decelStartDistance * stepsPerMm * K2);
-		twoDistanceToStopTimesCsquaredDivD = isquare64(params.topSpeedTimesCdivD) + roundU64((params.decelStartDistance * 2)/dda.deceleration);
+		mp.delta.twoDistanceToStopTimesCsquaredDivD = isquare64(params.topSpeedTimesCdivD) + roundU64((params.decelStartDistance * 2)/dda.deceleration);
+	}
+
+#if USE_DELTA_SEGMENTS
+	BuildDeltaSegments(dda);
+#endif
+}
+
+#if SUPPORT_DELTA_MOVEMENT
+
+// Solve the tower equation to get d*s*K, where d = distance the head has travelled, s = steps/mm for this drive, K = a power of 2 to reduce the rounding errors
+inline int32_t DriveMovement::CalcDeltaDsK(const DDA &dda, int32_t hmz0sK, bool up) const
+{
+	const int32_t hmz0scK = (int32_t)(((int64_t)hmz0sK * dda.afterPrepare.cKc)/Kc);
+	const int32_t t1 = mp.delta.minusAaPlusBbTimesKs + hmz0scK;
+	// Due to rounding error we can end up trying to take the square root of a negative number if we do not take precautions here
+	const int64_t t2a = mp.delta.dSquaredMinusAsquaredMinusBsquaredTimesKsquaredSsquared - (int64_t)isquare64(hmz0sK) + (int64_t)isquare64(t1);
+	const int32_t t2 = (t2a > 0) ? StepTimeIsqrt64(t2a) : 0;
+	return (up) ? t1 - t2 : t1 + t2;
+}
+
+#endif
+
+#if USE_DELTA_SEGMENTS
+
+// Calculate dsK for the specified step exactly. Called only while preparing the move, when mp.delta.hmz0sK still holds its initial value.
+int32_t DriveMovement::CalcDeltaDsKAtStep(const DDA& dda, uint32_t stepNumber) const
+{
+	if (reverseStartStep > totalSteps)
+	{
+		// No reversal, so the carriage moves in the same direction for the whole move
+		const int32_t distanceK2 = (int32_t)(stepNumber * K2);
+		return CalcDeltaDsK(dda, (direction) ? mp.delta.hmz0sK + distanceK2 : mp.delta.hmz0sK - distanceK2, direction);
+	}
+
+	// The carriage moves up until step reverseStartStep - 1, then down
+	return (stepNumber < reverseStartStep)
+			? CalcDeltaDsK(dda, mp.delta.hmz0sK + (int32_t)(stepNumber * K2), true)
+			: CalcDeltaDsK(dda, mp.delta.hmz0sK + (int32_t)(2 * (reverseStartStep - 1) - stepNumber) * (int32_t)K2, false);
+}
+
+// Build the table of segments for this tower. Called at the end of PrepareDeltaAxis.
+// If there is a reversal then the function is hard to approximate close to it, so we work away from it on each side and reserve half the segments for each side.
+void DriveMovement::BuildDeltaSegments(const DDA& dda)
+{
+	deltaSegmentIndex = 0;
+	if (reverseStartStep <= totalSteps)
+	{
+		const size_t numUpSegments = AddDeltaSegments(dda, 0, MaxDeltaSegments/2, 1, reverseStartStep, false);
+		numDeltaSegments = (uint8_t)AddDeltaSegments(dda, numUpSegments, MaxDeltaSegments, reverseStartStep, totalSteps + 1, true);
+	}
+	else
+	{
+		numDeltaSegments = (uint8_t)AddDeltaSegments(dda, 0, MaxDeltaSegments, 1, totalSteps + 1, false);
+	}
+}
+
+// Add segments covering as many as possible of the steps from firstStep up to but not including endStep, starting from the low end or from the high end.
+// Return the new number of segments.
+size_t DriveMovement::AddDeltaSegments(const DDA& dda, size_t numSegments, size_t maxSegments, uint32_t firstStep, uint32_t endStep, bool fromEnd)
+{
+	const size_t firstNewSegment = numSegments;
+	uint32_t lowStep = firstStep, highStep = endStep;					// the steps not yet covered
+	uint32_t segmentSteps = MaxDeltaSegmentSteps;
+	while (numSegments < maxSegments && highStep >= lowStep + MinDeltaSegmentSteps)
+	{
+		segmentSteps = min<uint32_t>(segmentSteps, highStep - lowStep);
+		for (;;)
+		{
+			const uint32_t segStartStep = (fromEnd) ? highStep - segmentSteps : lowStep;
+			if (MakeDeltaSegment(dda, segStartStep, segStartStep + segmentSteps, deltaSegments[numSegments]))
+			{
+				break;
+			}
+			segmentSteps >>= 1;
+			if (segmentSteps < MinDeltaSegmentSteps)
+			{
+				break;
+			}
+		}
+
+		if (segmentSteps < MinDeltaSegmentSteps)
+		{
+			break;															// we can't approximate the remaining steps well enough
+		}
+
+		if (fromEnd)
+		{
+			highStep -= segmentSteps;
+		}
+		else
+		{
+			lowStep += segmentSteps;
+		}
+		++numSegments;
+	}
+
+	// Segments generated from the end are in reverse order, but the ISR needs them in ascending step order
+	if (fromEnd && numSegments != 0)
+	{
+		for (size_t i = firstNewSegment, j = numSegments - 1; i < j; ++i, --j)
+		{
+			const DeltaSegment temp = deltaSegments[i];
+			deltaSegments[i] = deltaSegments[j];
+			deltaSegments[j] = temp;
+		}
+	}
+	return numSegments;
+}
+
+// Fit a quadratic through the values of dsK at the first, middle and last steps of a segment, then check it at the quarter points.
+// Return true if the fit is good enough, in which case seg has been filled in.
+bool DriveMovement::MakeDeltaSegment(const DDA& dda, uint32_t startStep, uint32_t endStep, DeltaSegment& seg) const
+{
+	const uint32_t lastK = endStep - 1 - startStep;
+	const uint32_t midK = lastK/2;
+	if (midK == 0)
+	{
+		return false;
+	}
+
+	const int32_t startDsK = CalcDeltaDsKAtStep(dda, startStep);
+	// Single precision is enough because the rounding errors are much smaller than MaxDeltaSegmentError, and we check the result anyway
+	const float f01 = (float)(CalcDeltaDsKAtStep(dda, startStep + midK) - startDsK)/(float)midK;
+	const float f12 = (float)(CalcDeltaDsKAtStep(dda, startStep + lastK) - CalcDeltaDsKAtStep(dda, startStep + midK))/(float)(lastK - midK);
+	const float quadratic = (f12 - f01)/(float)lastK;
+	const float linear = f01 - (float)midK * quadratic;
+	const float scaledLinear = linear * (float)(1u << DeltaSegmentShift);
+	const float scaledQuadratic = quadratic * (float)(1u << DeltaSegmentShift);
+	if (fabsf(scaledLinear) >= 2147483648.0f || fabsf(scaledQuadratic) >= 2147483648.0f)
+	{
+		return false;
 	}
+
+	seg.startStep = startStep;
+	seg.endStep = endStep;
+	seg.startDsK = startDsK;
+	seg.dsKPerStep = (int32_t)lrintf(scaledLinear);
+	seg.dsKPerStepSquared = (int32_t)lrintf(scaledQuadratic);
+
+	// Check the fit at the quarter points using the same integer arithmetic as the ISR
+	for (uint32_t k : { lastK/4, midK, (3 * lastK)/4, lastK })
+	{
+		const int32_t approxDsK = seg.startDsK + (int32_t)(((int64_t)seg.dsKPerStep * k + (int64_t)seg.dsKPerStepSquared * (int64_t)isquare64(k)) >> DeltaSegmentShift);
+		const int32_t error = approxDsK - CalcDeltaDsKAtStep(dda, startStep + k);
+		if (error > MaxDeltaSegmentError || error < -MaxDeltaSegmentError)
+		{
+			return false;
+		}
+	}
+	return true;
 }
 
+#endif
+
 // Prepare this DM for an extruder move. The caller has already checked that pressure advance is enabled.
 void DriveMovement::PrepareExtruder(const DDA& dda, const PrepParams& params, float speedChange)
 {
 	isDeltaMovement = false;
+	isShaped = false;									// pressure advance changes the profile, so we don't shape it
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+	if (PrepareSmoothedExtruder(dda))
+	{
+		return;
+	}
+#endif
 
 	// Calculate the pressure advance parameters
 	const float compensationClocks = Platform::GetPressureAdvance(drive) * (float)StepTimer::StepClockRate;
@@ -186,6 +384,14 @@ void DriveMovement::PrepareExtruder(const DDA& dda, const PrepParams& params, fl
 	const float compensationDistance = (dda.endSpeed - dda.startSpeed) * compensationClocks;
 	int32_t netSteps = lrintf((1.0 + compensationDistance) * totalSteps);
 
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+	// If smoothed pressure advance left the extruder ahead of or behind its ideal position, make up the whole steps in this move and keep the fraction
+	const int32_t carrySteps = lrintf(smoothedPaCarry[drive]);
+	const int32_t adjustment = max<int32_t>((direction) ? -carrySteps : carrySteps, -max<int32_t>(netSteps, 0));
+	netSteps += adjustment;
+	smoothedPaCarry[drive] -= (float)((direction) ? -adjustment : adjustment);
+#endif
+
 	// Calculate the acceleration phase parameters
 	const float accelCompensationDistance = compensationClocks * (dda.topSpeed - dda.startSpeed);
 	mp.cart.accelStopStep = (uint32_t)((dda.accelDistance + accelCompensationDistance) * totalSteps) + 1;
@@ -203,27 +409,27 @@ void DriveMovement::PrepareExtruder(const DDA& dda, const PrepParams& params, fl
 		totalSteps = (uint32_t)max<int32_t>(netSteps, 0);
 		mp.cart.decelStartStep = reverseStartStep = netSteps + 1;
 		mp.cart.fourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD = 0;
-		twoDistanceToStopTimesCsquaredDivD = 0;
+		mp.cart.twoDistanceToStopTimesCsquaredDivD = 0;
 	}
 	else
 	{
 		mp.cart.decelStartStep = (uint32_t)((params.decelStartDistance + accelCompensationDistance) * totalSteps) + 1;
 		const int32_t initialDecelSpeedTimesCdivD = (int32_t)params.topSpeedTimesCdivD - (int32_t)mp.cart.compensationClocks;	// signed because it may be negative and we square it
 		const uint64_t initialDecelSpeedTimesCdivDSquared = isquare64(initialDecelSpeedTimesCdivD);
-		twoDistanceToStopTimesCsquaredDivD =
+		mp.cart.twoDistanceToStopTimesCsquaredDivD =
 			initialDecelSpeedTimesCdivDSquared + roundU64(((params.decelStartDistance + accelCompensationDistance) * 2)/dda.deceleration);
 
 		// See whether there is a reverse phase
 		const float compensationSpeedChange = dda.deceleration * compensationClocks;
 		const uint32_t stepsBeforeReverse = (compensationSpeedChange > dda.topSpeed)
 											? mp.cart.decelStartStep - 1
-											: twoDistanceToStopTimesCsquaredDivD/mp.cart.twoCsquaredTimesMmPerStepDivD;
+											: mp.cart.twoDistanceToStopTimesCsquaredDivD/mp.cart.twoCsquaredTimesMmPerStepDivD;
 		if (dda.endSpeed < compensationSpeedChange && (int32_t)stepsBeforeReverse > netSteps)
 		{
 			reverseStartStep = stepsBeforeReverse + 1;
 			totalSteps = (uint32_t)((int32_t)(2 * stepsBeforeReverse) - netSteps);
 			mp.cart.fourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD =
-					(int64_t)((2 * stepsBeforeReverse) * mp.cart.twoCsquaredTimesMmPerStepDivD) - (int64_t)twoDistanceToStopTimesCsquaredDivD;
+					(int64_t)((2 * stepsBeforeReverse) * mp.cart.twoCsquaredTimesMmPerStepDivD) - (int64_t)mp.cart.twoDistanceToStopTimesCsquaredDivD;
 		}
 		else
 		{
@@ -237,60 +443,433 @@ void DriveMovement::PrepareExtruder(const DDA& dda, const PrepParams& params, fl
 			mp.cart.fourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD = 0;
 		}
 	}
+
+#if USE_STEP_TIME_TABLES
+	BuildStepTimeTable(dda);
+#endif
+}
+
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+
+namespace
+{
+	// A part of an extruder move within which the extruder position in steps is a quadratic function of time: pos(startTime + t) = p0 + p1 * t + p2 * t^2
+	struct ExtruderPiece
+	{
+		float startTime;
+		float duration;
+		float p0, p1, p2;
+
+		float EndPosition() const { return p0 + (p1 + p2 * duration) * duration; }
+		bool IsIncreasing() const { return p1 + p2 * duration >= 0.0; }		// the pieces are monotonic, so check the slope in the middle
+	};
+
+	// Each of the acceleration and deceleration phases has up to 3 parts and the steady phase has 1, and each part may be split where the extruder turns round
+	constexpr size_t MaxExtruderPieces = 2 * (3 + 1 + 3);
+
+	// Add the pieces for one phase of a move with smoothed pressure advance, returning the new number of pieces.
+	// The extruder position is the move distance plus the advance time multiplied by a smoothed move speed. The smoothed speed changes with the same acceleration profile
+	// as we would get by low pass filtering the speed over the smoothing time, but kept within the phase so that the speed change over the phase is unchanged.
+	// So the acceleration is a trapezium instead of a rectangle. We update paSpeed to be the smoothed speed at the end of the phase.
+	size_t AddPhasePieces(ExtruderPiece *pieces, size_t numPieces, float phaseStartTime, float duration, float startDistance, float startSpeed, float acceleration,
+							float smoothingClocks, float steps, float advanceClocks, float initialSpeed, float& paSpeed)
+	{
+		if (duration < 1.0)
+		{
+			return numPieces;
+		}
+
+		// Work out the parts of the phase within which the jerk of the smoothed speed is constant
+		float partStarts[3], partLengths[3], partAccelerations[3], partJerks[3];
+		size_t numParts;
+		if (acceleration == 0.0)
+		{
+			partStarts[0] = 0.0;
+			partLengths[0] = duration;
+			partAccelerations[0] = partJerks[0] = 0.0;
+			numParts = 1;
+		}
+		else
+		{
+			const float rampTime = min<float>(smoothingClocks, 0.5 * duration);
+			const float peakAcceleration = (acceleration * duration)/(duration - rampTime);
+			partStarts[0] = 0.0;
+			partLengths[0] = rampTime;
+			partAccelerations[0] = 0.0;
+			partJerks[0] = peakAcceleration/rampTime;
+			partStarts[1] = rampTime;
+			partLengths[1] = duration - 2.0 * rampTime;
+			partAccelerations[1] = peakAcceleration;
+			partJerks[1] = 0.0;
+			partStarts[2] = duration - rampTime;
+			partLengths[2] = rampTime;
+			partAccelerations[2] = peakAcceleration;
+			partJerks[2] = -peakAcceleration/rampTime;
+			numParts = 3;
+		}
+
+		for (size_t i = 0; i < numParts; ++i)
+		{
+			const float t = partStarts[i];
+			const float length = partLengths[i];
+			if (length <= 0.0)
+			{
+				continue;
+			}
+
+			ExtruderPiece& piece = pieces[numPieces++];
+			piece.startTime = phaseStartTime + t;
+			piece.duration = length;
+			piece.p0 = steps * (startDistance + (startSpeed + 0.5 * acceleration * t) * t + advanceClocks * (paSpeed - initialSpeed));
+			piece.p1 = steps * (startSpeed + acceleration * t + advanceClocks * partAccelerations[i]);
+			piece.p2 = 0.5 * steps * (acceleration + advanceClocks * partJerks[i]);
+			paSpeed += (partAccelerations[i] + 0.5 * partJerks[i] * length) * length;
+
+			// If the extruder position turns round within this piece, split it so that each piece is monotonic
+			if (piece.p2 != 0.0)
+			{
+				const float turnTime = -piece.p1/(2.0 * piece.p2);
+				if (turnTime > 0.0 && turnTime < length)
+				{
+					ExtruderPiece& secondPiece = pieces[numPieces++];
+					secondPiece.startTime = piece.startTime + turnTime;
+					secondPiece.duration = length - turnTime;
+					secondPiece.p0 = piece.p0 + (piece.p1 + piece.p2 * turnTime) * turnTime;
+					secondPiece.p1 = 0.0;
+					secondPiece.p2 = piece.p2;
+					piece.duration = turnTime;
+				}
+			}
+		}
+		return numPieces;
+	}
+}
+
+// Prepare this DM for an extruder move using smoothed pressure advance. Return false if we can't, in which case the caller uses normal pressure advance.
+// The extruder never reverses. Where the smoothed position goes backwards the extruder waits until the position catches up again,
+// and if it is still ahead of the ideal position at the end of the move then we carry that forward to the next move.
+bool DriveMovement::PrepareSmoothedExtruder(const DDA& dda)
+{
+	isSmoothedPa = false;
+	const float smoothingClocks = Platform::GetPressureAdvanceSmoothing(drive) * (float)StepTimer::StepClockRate;
+	if (smoothingClocks < 1.0 || !direction || totalSteps >= MaxSmoothedPaSteps)
+	{
+		return false;									// PrepareExtruder makes up the carry in the step count
+	}
+
+	const float advanceClocks = Platform::GetPressureAdvance(drive) * (float)StepTimer::StepClockRate;
+	const float steps = (float)totalSteps;
+	const float accelClocks = (dda.acceleration > 0.0) ? (dda.topSpeed - dda.startSpeed)/dda.acceleration : 0.0;
+	const float decelClocks = (dda.deceleration > 0.0) ? (dda.topSpeed - dda.endSpeed)/dda.deceleration : 0.0;
+	const float decelStartClocks = max<float>((float)dda.clocksNeeded - decelClocks, accelClocks);
+
+	ExtruderPiece pieces[MaxExtruderPieces];
+	float paSpeed = dda.startSpeed;
+	size_t numPieces = AddPhasePieces(pieces, 0, 0.0, accelClocks, 0.0, dda.startSpeed, dda.acceleration, smoothingClocks, steps, advanceClocks, dda.startSpeed, paSpeed);
+	numPieces = AddPhasePieces(pieces, numPieces, accelClocks, decelStartClocks - accelClocks, dda.accelDistance, dda.topSpeed, 0.0, smoothingClocks, steps, advanceClocks, dda.startSpeed, paSpeed);
+	numPieces = AddPhasePieces(pieces, numPieces, decelStartClocks, decelClocks, 1.0 - dda.decelDistance, dda.topSpeed, -dda.deceleration, smoothingClocks, steps, advanceClocks, dda.startSpeed, paSpeed);
+
+	// Find the time at which the position first reaches each step
+	const float carry = smoothedPaCarry[drive];
+	uint32_t numSteps = 0;
+	uint32_t lastStepTime = 0;
+	size_t pieceIndex = 0;
+	for (;;)
+	{
+		const float target = carry + (float)(numSteps + 1);
+		while (pieceIndex < numPieces && (!pieces[pieceIndex].IsIncreasing() || pieces[pieceIndex].EndPosition() < target))
+		{
+			++pieceIndex;
+		}
+		if (pieceIndex == numPieces)
+		{
+			break;
+		}
+
+		// Solve p0 + p1 * t + p2 * t^2 = target in a way that is stable when p2 is small
+		const ExtruderPiece& piece = pieces[pieceIndex];
+		const float distance = target - piece.p0;
+		const float t = (distance <= 0.0) ? 0.0
+						: min<float>((2.0 * distance)/(piece.p1 + sqrtf(max<float>(fsquare(piece.p1) + 4.0 * piece.p2 * distance, 0.0))), piece.duration);
+		const uint32_t stepTime = min<uint32_t>((uint32_t)lrintf(piece.startTime + t), dda.clocksNeeded);
+		if (numSteps == 0)
+		{
+			mp.smoothed.firstStepTime = stepTime;
+		}
+		else
+		{
+			if (numSteps == MaxSmoothedPaSteps || stepTime - lastStepTime > 0xFFFF)
+			{
+				return false;							// we haven't changed the carry, so PrepareExtruder makes it up in the step count
+			}
+			mp.smoothed.stepIntervals[numSteps - 1] = (uint16_t)(stepTime - lastStepTime);
+		}
+		lastStepTime = stepTime;
+		++numSteps;
+	}
+
+	const float endPosition = (numPieces == 0) ? 0.0 : pieces[numPieces - 1].EndPosition();
+	smoothedPaCarry[drive] = carry + (float)numSteps - endPosition;
+
+	// Set up the other parameters so that nothing else tries to reverse or recalculate this move. The rest of mp.cart is overlaid by the step intervals.
+	mp.smoothed.accelStopStep = 0;
+	mp.smoothed.decelStartStep = reverseStartStep = numSteps + 1;
+	mp.smoothed.mmPerStepTimesCKdivtopSpeed = roundU32((float)K1/(steps * dda.topSpeed));
+	totalSteps = numSteps;
+#if USE_STEP_TIME_TABLES
+	numStepTableSegments = 0;
+#endif
+	isSmoothedPa = true;
+	return true;
+}
+
+#endif
+
+// Return the approximate step interval in step clocks when this drive is moving at the top speed of the move
+uint32_t DriveMovement::GetTopSpeedStepInterval() const
+{
+	return ((isDeltaMovement) ? mp.delta.mmPerStepTimesCKdivtopSpeed : mp.cart.mmPerStepTimesCKdivtopSpeed)/K1;
+}
+
+// Calculate the time of a step in the acceleration phase of a Cartesian axis or extruder move
+inline uint32_t DriveMovement::CalcAccelStepTime(const DDA &dda, uint32_t stepNumber) const
+{
+#if SUPPORT_INPUT_SHAPING
+	if (isShaped && dda.IsAccelShaped())
+	{
+		return dda.CalcShapedStepTime((float)stepNumber * distancePerStep, true);
+	}
+#endif
+	const uint32_t adjustedStartSpeedTimesCdivA = dda.afterPrepare.startSpeedTimesCdivA + mp.cart.compensationClocks;
+	return StepTimeIsqrt64(isquare64(adjustedStartSpeedTimesCdivA) + (mp.cart.twoCsquaredTimesMmPerStepDivA * stepNumber)) - adjustedStartSpeedTimesCdivA;
+}
+
+// Calculate the time of a step in the deceleration phase of a Cartesian axis or extruder move, before any reversal
+inline uint32_t DriveMovement::CalcDecelStepTime(const DDA &dda, uint32_t stepNumber) const
+{
+#if SUPPORT_INPUT_SHAPING
+	if (isShaped && dda.IsDecelShaped())
+	{
+		return dda.CalcShapedStepTime((float)stepNumber * distancePerStep, false);
+	}
+#endif
+	const uint64_t temp = mp.cart.twoCsquaredTimesMmPerStepDivD * stepNumber;
+	const uint32_t adjustedTopSpeedTimesCdivDPlusDecelStartClocks = dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks - mp.cart.compensationClocks;
+	// Allow for possible rounding error when the end speed is zero or very small
+	return (temp < mp.cart.twoDistanceToStopTimesCsquaredDivD)
+			? adjustedTopSpeedTimesCdivDPlusDecelStartClocks - StepTimeIsqrt64(mp.cart.twoDistanceToStopTimesCsquaredDivD - temp)
+			: adjustedTopSpeedTimesCdivDPlusDecelStartClocks;
+}
+
+// Calculate the time of a step in the steady speed phase of a Cartesian axis or extruder move
+inline uint32_t DriveMovement::CalcSteadyStepTime(const DDA &dda, uint32_t stepNumber) const
+{
+	static_assert(K1 == 1024, "StepTiming::MulDivK1 assumes K1 == 1024");
+	return (uint32_t)(  (int32_t)StepTiming::MulDivK1(mp.cart.mmPerStepTimesCKdivtopSpeed, stepNumber)
+					  + dda.afterPrepare.extraAccelerationClocks
+					  - (int32_t)mp.cart.accelCompensationClocks
+					 );
+}
+
+// Calculate the time of a step in the deceleration phase of a Cartesian axis or extruder move, after reversal
+inline uint32_t DriveMovement::CalcReverseStepTime(const DDA &dda, uint32_t stepNumber) const
+{
+	const uint32_t adjustedTopSpeedTimesCdivDPlusDecelStartClocks = dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks - mp.cart.compensationClocks;
+	return adjustedTopSpeedTimesCdivDPlusDecelStartClocks
+			+ StepTimeIsqrt64((int64_t)(mp.cart.twoCsquaredTimesMmPerStepDivD * stepNumber) - mp.cart.fourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD);
+}
+
+#if USE_STEP_TIME_TABLES
+
+inline uint32_t DriveMovement::CalcPhaseStepTime(const DDA &dda, uint32_t stepNumber, bool accelerating) const
+{
+	return (accelerating) ? CalcAccelStepTime(dda, stepNumber) : CalcDecelStepTime(dda, stepNumber);
+}
+
+// Build the table of step times for the acceleration and deceleration phases. Called at the end of PrepareCartesianAxis and PrepareExtruder.
+// Half the segments are reserved for the deceleration phase so that a long acceleration phase doesn't use them all.
+void DriveMovement::BuildStepTimeTable(const DDA& dda)
+{
+	stepTableIndex = 0;
+	const uint32_t accelEndStep = min<uint32_t>(mp.cart.accelStopStep, totalSteps + 1);
+	const size_t numAccelSegments = AddStepTimeSegments(dda, 0, MaxStepTableSegments/2, 1, accelEndStep, true);
+	const uint32_t decelFirstStep = max<uint32_t>(mp.cart.decelStartStep, accelEndStep);
+	const uint32_t decelEndStep = min<uint32_t>(reverseStartStep, totalSteps + 1);
+	numStepTableSegments = (uint8_t)AddStepTimeSegments(dda, numAccelSegments, MaxStepTableSegments, decelFirstStep, decelEndStep, false);
+}
+
+// Add segments to the step time table covering as many as possible of the steps from firstStep up to but not including endStep. Return the new number of segments.
+// The step rate is highest at the end of the acceleration phase and at the start of the deceleration phase, so that is where we place the segments.
+// Segment lengths can only get shorter as we move away from there, so each one starts with the length of the previous one.
+size_t DriveMovement::AddStepTimeSegments(const DDA& dda, size_t numSegments, size_t maxSegments, uint32_t firstStep, uint32_t endStep, bool accelerating)
+{
+	if (endStep < firstStep + MinStepTablePhaseSteps)
+	{
+		return numSegments;
+	}
+
+	const size_t firstNewSegment = numSegments;
+	uint32_t lowStep = firstStep, highStep = endStep;					// the steps not yet covered
+	uint32_t segmentSteps = endStep - firstStep;
+	while (numSegments < maxSegments && highStep - lowStep >= MinStepTableSegmentSteps)
+	{
+		segmentSteps = min<uint32_t>(segmentSteps, highStep - lowStep);
+		uint32_t segStartStep;
+		for (;;)
+		{
+			segStartStep = (accelerating) ? highStep - segmentSteps : lowStep;
+			if (CheckStepTimeSegment(dda, segStartStep, segStartStep + segmentSteps, accelerating))
+			{
+				break;
+			}
+			segmentSteps >>= 1;
+			if (segmentSteps < MinStepTableSegmentSteps)
+			{
+				break;
+			}
+		}
+
+		if (segmentSteps < MinStepTableSegmentSteps)
+		{
+			break;															// linear interpolation isn't good enough for the remaining steps
+		}
+
+		const uint32_t segEndStep = segStartStep + segmentSteps;
+		const uint32_t startTime = CalcPhaseStepTime(dda, segStartStep, accelerating);
+		const uint64_t clocksPerStep = ((uint64_t)(CalcPhaseStepTime(dda, segEndStep, accelerating) - startTime) << StepTableSlopeShift)/segmentSteps;
+		if (clocksPerStep > 0xFFFFFFFF)
+		{
+			break;															// the steps are too far apart to be worth tabulating
+		}
+
+		StepTimeSegment& seg = stepTable[numSegments];
+		seg.startStep = segStartStep;
+		seg.endStep = segEndStep;
+		seg.startTime = startTime;
+		seg.clocksPerStep = (uint32_t)clocksPerStep;
+		++numSegments;
+
+		if (accelerating)
+		{
+			highStep = segStartStep;
+		}
+		else
+		{
+			lowStep = segEndStep;
+		}
+	}
+
+	// The acceleration segments were generated in reverse order, but the ISR needs them in ascending step order
+	if (accelerating)
+	{
+		for (size_t i = firstNewSegment, j = numSegments - 1; i < j; ++i, --j)
+		{
+			const StepTimeSegment temp = stepTable[i];
+			stepTable[i] = stepTable[j];
+			stepTable[j] = temp;
+		}
+	}
+	return numSegments;
+}
+
+// Check whether linear interpolation between the times of the first and last steps of a segment is accurate enough.
+// We require the error in the middle of the segment to be no more than half the shortest step interval within the segment.
+bool DriveMovement::CheckStepTimeSegment(const DDA& dda, uint32_t startStep, uint32_t endStep, bool accelerating) const
+{
+	const uint32_t startTime = CalcPhaseStepTime(dda, startStep, accelerating);
+	const uint32_t endTime = CalcPhaseStepTime(dda, endStep, accelerating);
+	if (endTime <= startTime)
+	{
+		return false;
+	}
+
+	const uint32_t midStep = (startStep + endStep)/2;
+	const uint32_t midTime = CalcPhaseStepTime(dda, midStep, accelerating);
+	const uint32_t interpolatedMidTime = startTime + (uint32_t)(((uint64_t)(endTime - startTime) * (midStep - startStep))/(endStep - startStep));
+	const uint32_t error = (midTime > interpolatedMidTime) ? midTime - interpolatedMidTime : interpolatedMidTime - midTime;
+	const uint32_t shortestInterval = (accelerating)
+										? endTime - CalcPhaseStepTime(dda, endStep - 1, accelerating)
+										: CalcPhaseStepTime(dda, startStep + 1, accelerating) - startTime;
+	return 2 * error <= shortestInterval;
 }
 
+#endif
+
 void DriveMovement::DebugPrint(char c) const
 {
 	if (state != DMState::idle)
 	{
-		debugPrintf("DM%c%s dir=%c steps=%" PRIu32 " next=%" PRIu32 " rev=%" PRIu32 " interval=%" PRIu32
-					" 2dtstc2diva=%" PRIu64 "\n",
-					c, (state == DMState::stepError) ? " ERR:" : ":", (direction) ? 'F' : 'B', totalSteps, nextStep, reverseStartStep, stepInterval,
-					twoDistanceToStopTimesCsquaredDivD);
+		deferredPrintf("DM%c%s dir=%c steps=%" PRIu32 " next=%" PRIu32 " rev=%" PRIu32 " interval=%" PRIu32,
+					c, (state == DMState::stepError) ? " ERR:" : ":", (direction) ? 'F' : 'B', totalSteps, nextStep, reverseStartStep, stepInterval);
 
 		if (isDeltaMovement)
 		{
-			debugPrintf("hmz0sK=%" PRIi32 " minusAaPlusBbTimesKs=%" PRIi32 " dSquaredMinusAsquaredMinusBsquared=%" PRId64 "\n"
-						"2c2mmsda=%" PRIu64 "2c2mmsdd=%" PRIu64 " asdsk=%" PRIu32 " dsdsk=%" PRIu32 " mmstcdts=%" PRIu32 "\n",
-						mp.delta.hmz0sK, mp.delta.minusAaPlusBbTimesKs, mp.delta.dSquaredMinusAsquaredMinusBsquaredTimesKsquaredSsquared,
+			deferredPrintf(" 2dtstc2diva=%" PRIu64 "\n", mp.delta.twoDistanceToStopTimesCsquaredDivD);
+			deferredPrintf("hmz0sK=%" PRIi32 " minusAaPlusBbTimesKs=%" PRIi32 " dSquaredMinusAsquaredMinusBsquared=%" PRId64 "\n",
+						mp.delta.hmz0sK, mp.delta.minusAaPlusBbTimesKs, mp.delta.dSquaredMinusAsquaredMinusBsquaredTimesKsquaredSsquared);
+			deferredPrintf("2c2mmsda=%" PRIu64 "2c2mmsdd=%" PRIu64 " asdsk=%" PRIu32 " dsdsk=%" PRIu32 " mmstcdts=%" PRIu32 "\n",
 						mp.delta.twoCsquaredTimesMmPerStepDivA, mp.delta.twoCsquaredTimesMmPerStepDivD, mp.delta.accelStopDsK, mp.delta.decelStartDsK, mp.delta.mmPerStepTimesCKdivtopSpeed
 						);
+#if USE_DELTA_SEGMENTS
+			for (size_t i = 0; i < numDeltaSegments; ++i)
+			{
+				deferredPrintf("seg %u: steps %" PRIu32 "-%" PRIu32 " dsK=%" PRIi32 " lin=%" PRIi32 " quad=%" PRIi32 "\n",
+							(unsigned int)i, deltaSegments[i].startStep, deltaSegments[i].endStep, deltaSegments[i].startDsK, deltaSegments[i].dsKPerStep, deltaSegments[i].dsKPerStepSquared);
+			}
+#endif
 		}
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+		else if (isSmoothedPa)
+		{
+			deferredPrintf("\nsmoothed PA first=%" PRIu32 " mmPerStepTimesCdivtopSpeed=%" PRIu32 " carry=%.2f\n",
+						mp.smoothed.firstStepTime, mp.smoothed.mmPerStepTimesCKdivtopSpeed, (double)smoothedPaCarry[drive]);
+		}
+#endif
 		else
 		{
-			debugPrintf("accelStopStep=%" PRIu32 " decelStartStep=%" PRIu32 " 2c2mmsda=%" PRIu64 " 2c2mmsdd=%" PRIu64 "\n"
-						"mmPerStepTimesCdivtopSpeed=%" PRIu32 " fmsdmtstdca2=%" PRId64 " cc=%" PRIu32 " acc=%" PRIu32 "\n",
-						mp.cart.accelStopStep, mp.cart.decelStartStep, mp.cart.twoCsquaredTimesMmPerStepDivA, mp.cart.twoCsquaredTimesMmPerStepDivD,
+			deferredPrintf(" 2dtstc2diva=%" PRIu64 "\n", mp.cart.twoDistanceToStopTimesCsquaredDivD);
+			deferredPrintf("accelStopStep=%" PRIu32 " decelStartStep=%" PRIu32 " 2c2mmsda=%" PRIu64 " 2c2mmsdd=%" PRIu64 "\n",
+						mp.cart.accelStopStep, mp.cart.decelStartStep, mp.cart.twoCsquaredTimesMmPerStepDivA, mp.cart.twoCsquaredTimesMmPerStepDivD);
+			deferredPrintf("mmPerStepTimesCdivtopSpeed=%" PRIu32 " fmsdmtstdca2=%" PRId64 " cc=%" PRIu32 " acc=%" PRIu32 "\n",
 						mp.cart.mmPerStepTimesCKdivtopSpeed, mp.cart.fourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD, mp.cart.compensationClocks, mp.cart.accelCompensationClocks
 						);
+#if USE_STEP_TIME_TABLES
+			for (size_t i = 0; i < numStepTableSegments; ++i)
+			{
+				deferredPrintf("seg %u: steps %" PRIu32 "-%" PRIu32 " t=%" PRIu32 " cps=%" PRIu32 "\n",
+							(unsigned int)i, stepTable[i].startStep, stepTable[i].endStep, stepTable[i].startTime, stepTable[i].clocksPerStep);
+			}
+#endif
 		}
 	}
 	else
 	{
-		debugPrintf("DM%c: not moving\n", c);
+		deferredPrintf("DM%c: not moving\n", c);
 	}
 }
 
 // Calculate and store the time since the start of the move when the next step for the specified DriveMovement is due.
 // Return true if there are more steps to do.
 // This is also used for extruders on delta machines.
-bool DriveMovement::CalcNextStepTimeCartesianFull(const DDA &dda, bool live)
+STEP_PATH_RAMFUNC bool DriveMovement::CalcNextStepTimeCartesianFull(const DDA &dda, bool live)
 pre(nextStep < totalSteps; stepsTillRecalc == 0)
 {
+	PROFILE_STEP_PATH_IF(calcCartesian, live);
 	// Work out how many steps to calculate at a time.
 	// The last step before reverseStartStep must be single stepped to make sure that we don't reverse the direction too soon.
 	uint32_t shiftFactor = 0;		// assume single stepping
-	if (stepInterval < DDA::MinCalcIntervalCartesian)
+	const uint32_t minCalcInterval = dda.afterPrepare.minCalcIntervalCartesian;
+	if (stepInterval < minCalcInterval)
 	{
 		const uint32_t stepsToLimit = ((nextStep <= reverseStartStep && reverseStartStep <= totalSteps)
 										? reverseStartStep
 										: totalSteps
 									  ) - nextStep;
-		if (stepInterval < DDA::MinCalcIntervalCartesian/4 && stepsToLimit > 8)
+		if (stepInterval < minCalcInterval/4 && stepsToLimit > 8)
 		{
 			shiftFactor = 3;		// octal stepping
 		}
-		else if (stepInterval < DDA::MinCalcIntervalCartesian/2 && stepsToLimit > 4)
+		else if (stepInterval < minCalcInterval/2 && stepsToLimit > 4)
 		{
 			shiftFactor = 2;		// quad stepping
 		}
@@ -307,26 +886,31 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 	if (nextCalcStep < mp.cart.accelStopStep)
 	{
 		// acceleration phase
-		const uint32_t adjustedStartSpeedTimesCdivA = dda.afterPrepare.startSpeedTimesCdivA + mp.cart.compensationClocks;
-		nextCalcStepTime = isqrt64(isquare64(adjustedStartSpeedTimesCdivA) + (mp.cart.twoCsquaredTimesMmPerStepDivA * nextCalcStep)) - adjustedStartSpeedTimesCdivA;
+#if USE_STEP_TIME_TABLES
+		if (!LookUpStepTime(nextCalcStep, nextCalcStepTime))
+		{
+			nextCalcStepTime = CalcAccelStepTime(dda, nextCalcStep);
+		}
+#else
+		nextCalcStepTime = CalcAccelStepTime(dda, nextCalcStep);
+#endif
 	}
 	else if (nextCalcStep < mp.cart.decelStartStep)
 	{
 		// steady speed phase
-		nextCalcStepTime = (uint32_t)(  (int32_t)(((uint64_t)mp.cart.mmPerStepTimesCKdivtopSpeed * nextCalcStep)/K1)
-								  + dda.afterPrepare.extraAccelerationClocks
-								  - (int32_t)mp.cart.accelCompensationClocks
-								 );
+		nextCalcStepTime = CalcSteadyStepTime(dda, nextCalcStep);
 	}
 	else if (nextCalcStep < reverseStartStep)
 	{
 		// deceleration phase, not reversed yet
-		const uint64_t temp = mp.cart.twoCsquaredTimesMmPerStepDivD * nextCalcStep;
-		const uint32_t adjustedTopSpeedTimesCdivDPlusDecelStartClocks = dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks - mp.cart.compensationClocks;
-		// Allow for possible rounding error when the end speed is zero or very small
-		nextCalcStepTime = (temp < twoDistanceToStopTimesCsquaredDivD)
-						? adjustedTopSpeedTimesCdivDPlusDecelStartClocks - isqrt64(twoDistanceToStopTimesCsquaredDivD - temp)
-						: adjustedTopSpeedTimesCdivDPlusDecelStartClocks;
+#if USE_STEP_TIME_TABLES
+		if (!LookUpStepTime(nextCalcStep, nextCalcStepTime))
+		{
+			nextCalcStepTime = CalcDecelStepTime(dda, nextCalcStep);
+		}
+#else
+		nextCalcStepTime = CalcDecelStepTime(dda, nextCalcStep);
+#endif
 	}
 	else
 	{
@@ -339,9 +923,7 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 				Platform::SetDirection(drive, direction);
 			}
 		}
-		const uint32_t adjustedTopSpeedTimesCdivDPlusDecelStartClocks = dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks - mp.cart.compensationClocks;
-		nextCalcStepTime = adjustedTopSpeedTimesCdivDPlusDecelStartClocks
-							+ isqrt64((int64_t)(mp.cart.twoCsquaredTimesMmPerStepDivD * nextCalcStep) - mp.cart.fourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD);
+		nextCalcStepTime = CalcReverseStepTime(dda, nextCalcStep);
 	}
 
 	// When crossing between movement phases with high microstepping, due to rounding errors the next step may appear to be due before the last one
@@ -375,32 +957,158 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 	return true;
 }
 
+#if USE_STEP_QUEUES
+
+// Calculate the time of a step of a Cartesian axis or extruder move without changing any state, so that the Move task can do it while the ISR is executing the move
+uint32_t DriveMovement::CalcQueuedStepTime(const DDA &dda, uint32_t stepNumber) const
+{
+	const uint32_t stepTime = (stepNumber < mp.cart.accelStopStep) ? CalcAccelStepTime(dda, stepNumber)
+							: (stepNumber < mp.cart.decelStartStep) ? CalcSteadyStepTime(dda, stepNumber)
+								: (stepNumber < reverseStartStep) ? CalcDecelStepTime(dda, stepNumber)
+									: CalcReverseStepTime(dda, stepNumber);
+
+	// As in CalcNextStepTimeCartesianFull, if one of the last two steps is calculated to be late then bring it forward to the expected finish time.
+	// Any other late step is a step error, which the ISR detects when it takes the time from the queue.
+	return (stepTime > dda.clocksNeeded && stepNumber + 1 >= totalSteps) ? dda.clocksNeeded : stepTime;
+}
+
+// Set up the step queue for a new move and fill it. Called by DDA::Prepare before calculating the time of the first step.
+void DriveMovement::StartStepQueue(const DDA& dda)
+{
+	stepQueueGetIndex = stepQueuePutIndex = 0;
+	lastQueuedStep = 0;
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+	stepQueueActive = !isDeltaMovement && !isSmoothedPa;	// smoothed pressure advance moves already have all their step times
+#else
+	stepQueueActive = !isDeltaMovement;
+#endif
+	FillStepQueue(dda);
+}
+
+// Add as many step times to the queue as there is room for. Called by the Move task.
+void DriveMovement::FillStepQueue(const DDA& dda)
+{
+	uint8_t putIndex = stepQueuePutIndex;
+	while (stepQueueActive && lastQueuedStep < totalSteps && (uint8_t)(putIndex - stepQueueGetIndex) < StepQueueLength)
+	{
+		++lastQueuedStep;
+		stepQueue[putIndex & (StepQueueLength - 1)] = CalcQueuedStepTime(dda, lastQueuedStep);
+		++putIndex;
+		__DMB();										// make sure the ISR can't see the new index before it sees the step time
+		stepQueuePutIndex = putIndex;
+	}
+}
+
+// Take the time of step nextStep from the queue. Called from the step ISR and by Prepare.
+STEP_PATH_RAMFUNC bool DriveMovement::TakeQueuedStepTime(const DDA &dda, bool live, uint8_t getIndex)
+{
+	const uint32_t stepTime = stepQueue[getIndex & (StepQueueLength - 1)];
+	stepQueueGetIndex = getIndex + 1;
+	if ((uint8_t)(stepQueuePutIndex - (uint8_t)(getIndex + 1)) == StepQueueLength/2 && lastQueuedStep < totalSteps)
+	{
+		Move::WakeMoveTaskFromISR();						// get the Move task to top up the queue
+	}
+
+	if (nextStep == reverseStartStep)
+	{
+		direction = !direction;
+		if (live)
+		{
+			Platform::SetDirection(drive, direction);
+		}
+	}
+
+	stepInterval = (stepTime > nextStepTime) ? stepTime - nextStepTime : 0;
+	nextStepTime = stepTime;
+	if (stepTime > dda.clocksNeeded)
+	{
+		// We don't expect any step except the last to be late
+		state = DMState::stepError;
+		stepInterval = 10000000 + nextStepTime;				// so we can tell what happened in the debug print
+		return false;
+	}
+	return true;
+}
+
+#endif
+
+#if SUPPORT_STEP_BURSTS
+
+// If the steps following the current one are all in the steady speed phase, work out the intervals between them so that they can be generated by hardware.
+// On entry, the step numbered nextStep has just been generated. Return the number of steps in the burst and the time of the first one, or 0 if we can't do a burst.
+// If we return nonzero, nextStep and nextStepTime refer to the last step in the burst, so the caller must call CalcNextStepTimeCartesian to move on to the step after that.
+size_t DriveMovement::PrepareStepBurst(const DDA& dda, uint16_t *intervals, size_t maxSteps, uint32_t& firstStepTime)
+{
+	const uint32_t firstStep = nextStep + 1;
+	if (isDeltaMovement || firstStep < mp.cart.accelStopStep)
+	{
+		return 0;
+	}
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+	if (isSmoothedPa)
+	{
+		return 0;						// the step times don't follow the steady speed phase
+	}
+#endif
+
+	// Don't include the last step of the move or any step after the steady speed phase, so that those are still timed in software
+	const uint32_t endStep = min<uint32_t>(min<uint32_t>(mp.cart.decelStartStep, reverseStartStep), totalSteps);
+	if (firstStep + StepBurstGenerator::MinBurstSteps > endStep)
+	{
+		return 0;
+	}
+	const size_t numSteps = min<size_t>(endStep - firstStep, maxSteps);
+
+	firstStepTime = CalcSteadyStepTime(dda, firstStep);
+	uint32_t lastStepTime = firstStepTime;
+	for (size_t i = 1; i < numSteps; ++i)
+	{
+		const uint32_t stepTime = CalcSteadyStepTime(dda, firstStep + i);
+		const uint32_t interval = stepTime - lastStepTime;
+		if (interval < StepBurstGenerator::MinInterval || interval > StepBurstGenerator::MaxInterval)
+		{
+			return 0;					// the speed is too high or too low to generate the steps in hardware
+		}
+		intervals[i - 1] = (uint16_t)interval;
+		lastStepTime = stepTime;
+	}
+
+	nextStep = firstStep + numSteps - 1;
+	nextStepTime = lastStepTime;
+	stepsTillRecalc = 0;
+	return numSteps;
+}
+
+#endif
+
 #if SUPPORT_DELTA_MOVEMENT
 
 // Calculate the time since the start of the move when the next step for the specified DriveMovement is due
 // Return true if there are more steps to do
-bool DriveMovement::CalcNextStepTimeDeltaFull(const DDA &dda, bool live)
+STEP_PATH_RAMFUNC bool DriveMovement::CalcNextStepTimeDeltaFull(const DDA &dda, bool live)
 pre(nextStep < totalSteps; stepsTillRecalc == 0)
 {
+	PROFILE_STEP_PATH_IF(calcDelta, live);
 	// Work out how many steps to calculate at a time.
 	// The last step before reverseStartStep must be single stepped to make sure that we don't reverse the direction too soon.
 	// The simulator suggests that at 200steps/mm, the minimum step pulse interval for 400mm/sec movement is 4.5us
 	uint32_t shiftFactor = 0;		// assume single stepping
-	if (stepInterval < DDA::MinCalcIntervalDelta)
+	const uint32_t minCalcInterval = dda.afterPrepare.minCalcIntervalDelta;
+	if (stepInterval < minCalcInterval)
 	{
 		const uint32_t stepsToLimit = ((nextStep < reverseStartStep && reverseStartStep <= totalSteps)
 										? reverseStartStep
 										: totalSteps
 									  ) - nextStep;
-		if (stepInterval < DDA::MinCalcIntervalDelta/8 && stepsToLimit > 16)
+		if (stepInterval < minCalcInterval/8 && stepsToLimit > 16)
 		{
 			shiftFactor = 4;		// hexadecimal stepping
 		}
-		else if (stepInterval < DDA::MinCalcIntervalDelta/4 && stepsToLimit > 8)
+		else if (stepInterval < minCalcInterval/4 && stepsToLimit > 8)
 		{
 			shiftFactor = 3;		// octal stepping
 		}
-		else if (stepInterval < DDA::MinCalcIntervalDelta/2 && stepsToLimit > 4)
+		else if (stepInterval < minCalcInterval/2 && stepsToLimit > 4)
 		{
 			shiftFactor = 2;		// quad stepping
 		}
@@ -431,12 +1139,15 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 		mp.delta.hmz0sK += shiftedK2;
 	}
 
-	const int32_t hmz0scK = (int32_t)(((int64_t)mp.delta.hmz0sK * dda.afterPrepare.cKc)/Kc);
-	const int32_t t1 = mp.delta.minusAaPlusBbTimesKs + hmz0scK;
-	// Due to rounding error we can end up trying to take the square root of a negative number if we do not take precautions here
-	const int64_t t2a = mp.delta.dSquaredMinusAsquaredMinusBsquaredTimesKsquaredSsquared - (int64_t)isquare64(mp.delta.hmz0sK) + (int64_t)isquare64(t1);
-	const int32_t t2 = (t2a > 0) ? isqrt64(t2a) : 0;
-	const int32_t dsK = (direction) ? t1 - t2 : t1 + t2;
+#if USE_DELTA_SEGMENTS
+	int32_t dsK;
+	if (!LookUpDeltaDsK(nextStep + stepsTillRecalc, dsK))
+	{
+		dsK = CalcDeltaDsK(dda, mp.delta.hmz0sK, direction);
+	}
+#else
+	const int32_t dsK = CalcDeltaDsK(dda, mp.delta.hmz0sK, direction);
+#endif
 
 	// Now feed dsK into a modified version of the step algorithm for Cartesian motion without elasticity compensation
 	if (dsK < 0)
@@ -450,7 +1161,7 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 	if ((uint32_t)dsK < mp.delta.accelStopDsK)
 	{
 		// Acceleration phase
-		nextCalcStepTime = isqrt64(isquare64(dda.afterPrepare.startSpeedTimesCdivA) + (mp.delta.twoCsquaredTimesMmPerStepDivA * (uint32_t)dsK)/K2) - dda.afterPrepare.startSpeedTimesCdivA;
+		nextCalcStepTime = StepTimeIsqrt64(isquare64(dda.afterPrepare.startSpeedTimesCdivA) + (mp.delta.twoCsquaredTimesMmPerStepDivA * (uint32_t)dsK)/K2) - dda.afterPrepare.startSpeedTimesCdivA;
 	}
 	else if ((uint32_t)dsK < mp.delta.decelStartDsK)
 	{
@@ -463,8 +1174,8 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 	{
 		const uint64_t temp = (mp.delta.twoCsquaredTimesMmPerStepDivD * (uint32_t)dsK)/K2;
 		// Because of possible rounding error when the end speed is zero or very small, we need to check that the square root will work OK
-		nextCalcStepTime = (temp < twoDistanceToStopTimesCsquaredDivD)
-						? dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks - isqrt64(twoDistanceToStopTimesCsquaredDivD - temp)
+		nextCalcStepTime = (temp < mp.delta.twoDistanceToStopTimesCsquaredDivD)
+						? dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks - StepTimeIsqrt64(mp.delta.twoDistanceToStopTimesCsquaredDivD - temp)
 						: dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks;
 	}
 
@@ -518,6 +1229,12 @@ void DriveMovement::ReduceSpeed(const DDA& dda, uint32_t inverseSpeedFactor)
 		// Force the linear motion phase
 		mp.cart.accelStopStep = 0;
 		mp.cart.decelStartStep = totalSteps + 1;
+#if USE_STEP_TIME_TABLES
+		numStepTableSegments = 0;
+#endif
+#if USE_STEP_QUEUES
+		stepQueueActive = false;						// the queued step times are no longer valid
+#endif
 
 		// Adjust the speed
 		mp.cart.mmPerStepTimesCKdivtopSpeed *= inverseSpeedFactor;
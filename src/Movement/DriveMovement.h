@@ -9,10 +9,18 @@
 #define DRIVEMOVEMENT_H_
 
 #include "RepRapFirmware.h"
+#include "Kinematics/LinearDeltaKinematics.h"
 
-class LinearDeltaKinematics;
 class DDA;
 
+#if USE_DELTA_SEGMENTS && !SUPPORT_DELTA_MOVEMENT
+# error USE_DELTA_SEGMENTS requires SUPPORT_DELTA_MOVEMENT
+#endif
+
+#if USE_STEP_QUEUES && SUPPORT_STEP_BURSTS
+# error Step queues and step bursts cannot be used together
+#endif
+
 #define ROUND_TO_NEAREST	(0)			// 1 for round to nearest (as used in 1.20beta10), 0 for round down (as used prior to 1.20beta10)
 
 // Rounding functions, to improve code clarity. Also allows a quick switch between round-to-nearest and round down in the movement code.
@@ -104,7 +112,8 @@ struct PrepParams
 	// Parameters used only for delta moves
 	float initialX;
 	float initialY;
-	const LinearDeltaKinematics *dparams;
+	const LinearDeltaKinematics::TowerConstants *towers;	// indexed by drive number
+	double recipAcceleration, recipDeceleration;	// so that we only divide by the acceleration and deceleration once per move instead of once per tower
 	float a2plusb2;								// sum of the squares of the X and Y movement fractions
 	float dvecX, dvecY, dvecZ;
 };
@@ -135,7 +144,18 @@ public:
 	void DebugPrint(char c) const;
 	int32_t GetNetStepsLeft() const;
 	int32_t GetNetStepsTaken() const;
+#if SUPPORT_STEP_ERROR_CORRECTION
+	int32_t GetNetStepsLost() const;
+#endif
 	bool IsDeltaMovement() const { return isDeltaMovement; }
+	uint32_t GetTopSpeedStepInterval() const;
+#if USE_STEP_QUEUES
+	void StartStepQueue(const DDA& dda);
+	void FillStepQueue(const DDA& dda);
+#endif
+#if SUPPORT_STEP_BURSTS
+	size_t PrepareStepBurst(const DDA& dda, uint16_t *intervals, size_t maxSteps, uint32_t& firstStepTime) __attribute__ ((hot));
+#endif
 
 #if HAS_SMART_DRIVERS
 	uint32_t GetStepInterval(uint32_t microstepShift) const;	// Get the current full step interval for this axis or extruder
@@ -145,20 +165,55 @@ public:
 	static int NumFree() { return numFree; }
 	static int MinFree() { return minFree; }
 	static void ResetMinFree() { minFree = numFree; }
+#if USE_STEP_QUEUES
+	static uint32_t GetAndClearStepQueueUnderruns();
+#endif
 	static DriveMovement *Allocate(size_t drive, DMState st);
 	static void Release(DriveMovement *item);
 
 private:
 	bool CalcNextStepTimeCartesianFull(const DDA &dda, bool live) __attribute__ ((hot));
+	uint32_t CalcAccelStepTime(const DDA &dda, uint32_t stepNumber) const __attribute__ ((hot));
+	uint32_t CalcDecelStepTime(const DDA &dda, uint32_t stepNumber) const __attribute__ ((hot));
+	uint32_t CalcSteadyStepTime(const DDA &dda, uint32_t stepNumber) const __attribute__ ((hot));
+	uint32_t CalcReverseStepTime(const DDA &dda, uint32_t stepNumber) const __attribute__ ((hot));
+#if USE_STEP_QUEUES
+	uint32_t CalcQueuedStepTime(const DDA &dda, uint32_t stepNumber) const;
+	bool TakeQueuedStepTime(const DDA &dda, bool live, uint8_t getIndex) __attribute__ ((hot));
+#endif
+#if USE_STEP_TIME_TABLES
+	void BuildStepTimeTable(const DDA& dda);
+	uint32_t CalcPhaseStepTime(const DDA &dda, uint32_t stepNumber, bool accelerating) const;
+	size_t AddStepTimeSegments(const DDA& dda, size_t numSegments, size_t maxSegments, uint32_t firstStep, uint32_t endStep, bool accelerating);
+	bool CheckStepTimeSegment(const DDA& dda, uint32_t startStep, uint32_t endStep, bool accelerating) const;
+	bool LookUpStepTime(uint32_t stepNumber, uint32_t& stepTime) __attribute__ ((hot));
+#endif
 #if SUPPORT_DELTA_MOVEMENT
 	bool CalcNextStepTimeDeltaFull(const DDA &dda, bool live) __attribute__ ((hot));
+	int32_t CalcDeltaDsK(const DDA &dda, int32_t hmz0sK, bool up) const __attribute__ ((hot));
+#endif
+#if USE_DELTA_SEGMENTS
+	void BuildDeltaSegments(const DDA& dda);
+	int32_t CalcDeltaDsKAtStep(const DDA& dda, uint32_t stepNumber) const;
+	size_t AddDeltaSegments(const DDA& dda, size_t numSegments, size_t maxSegments, uint32_t firstStep, uint32_t endStep, bool fromEnd);
+	bool LookUpDeltaDsK(uint32_t stepNumber, int32_t& dsK) __attribute__ ((hot));
+#endif
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+	bool PrepareSmoothedExtruder(const DDA& dda);
 #endif
 
 	static DriveMovement *freeList;
 	static int numFree;
 	static int minFree;
+#if USE_STEP_QUEUES
+	static uint32_t numStepQueueUnderruns;
+#endif
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+	static constexpr size_t MaxSmoothedPaSteps = 64;	// the most steps in an extruder move for which we use smoothed pressure advance
+	static float smoothedPaCarry[NumDrivers];			// how many steps each extruder is ahead of its ideal position, because we don't reverse it
+#endif
 
-	// Parameters common to Cartesian, delta and extruder moves
+	// Parameters common to Cartesian, delta and extruder moves. These and the move parameters below are used by the step ISR, so we keep them together at the start.
 
 	DriveMovement *nextDM;								// link to next DM that needs a step
 
@@ -167,7 +222,8 @@ private:
 	uint8_t microstepShift : 4,							// log2 of the microstepping factor (for when we use dynamic microstepping adjustment)
 			direction : 1,								// true=forwards, false=backwards
 			fullCurrent : 1,							// true if the drivers are set to the full current, false if they are set to the standstill current
-			isDeltaMovement : 1;						// true if this motor is executing a delta tower move
+			isDeltaMovement : 1,						// true if this motor is executing a delta tower move
+			isShaped : 1;								// true if this motor follows the move profile exactly, so input shaping can be applied
 	uint8_t stepsTillRecalc;							// how soon we need to recalculate
 
 	uint32_t totalSteps;								// total number of steps for this move
@@ -178,47 +234,136 @@ private:
 	uint32_t nextStepTime;								// how many clocks after the start of this move the next step is due
 	uint32_t stepInterval;								// how many clocks between steps
 
-	// The following only needs to be stored per-drive if we are supporting pressure advance
-	uint64_t twoDistanceToStopTimesCsquaredDivD;
+#if SUPPORT_INPUT_SHAPING
+	float distancePerStep;								// the fraction of the total move distance per step, used in shaped phases
+#endif
 
-	// Parameters unique to a style of move (Cartesian, delta or extruder). Currently, extruders and Cartesian moves use the same parameters.
+	// Parameters unique to a style of move (Cartesian, delta or extruder). Currently, extruders and Cartesian moves use the same parameters,
+	// except for extruder moves with smoothed pressure advance, which only need their precomputed step times.
+	// All the structs start with mmPerStepTimesCKdivtopSpeed, and the Cartesian and smoothed structs also share accelStopStep and decelStartStep,
+	// so that code that reads those fields through mp.cart works whichever kind of move this is.
 	union MoveParams
 	{
 		struct CartesianParameters						// Parameters for Cartesian and extruder movement, including extruder pressure advance
 		{
+			uint32_t mmPerStepTimesCKdivtopSpeed;		// mmPerStepInHyperCuboidSpace * clock / topSpeed
+			uint32_t accelStopStep;						// the first step number at which we are no longer accelerating
+			uint32_t decelStartStep;					// the first step number at which we are decelerating
+			uint32_t compensationClocks;				// the pressure advance time in clocks
+			uint32_t accelCompensationClocks;			// compensationClocks * (1 - startSpeed/topSpeed)
+
 			// The following don't depend on how the move is executed, so they could be set up in Init() if we use fixed acceleration/deceleration
 			uint64_t twoCsquaredTimesMmPerStepDivA;		// 2 * clock^2 * mmPerStepInHyperCuboidSpace / acceleration
 			uint64_t twoCsquaredTimesMmPerStepDivD;		// 2 * clock^2 * mmPerStepInHyperCuboidSpace / deceleration
 
 			// The following depend on how the move is executed, so they must be set up in Prepare()
 			int64_t fourMaxStepDistanceMinusTwoDistanceToStopTimesCsquaredDivD;		// this one can be negative
-			uint32_t accelStopStep;						// the first step number at which we are no longer accelerating
-			uint32_t decelStartStep;					// the first step number at which we are decelerating
-			uint32_t mmPerStepTimesCKdivtopSpeed;		// mmPerStepInHyperCuboidSpace * clock / topSpeed
-			uint32_t compensationClocks;				// the pressure advance time in clocks
-			uint32_t accelCompensationClocks;			// compensationClocks * (1 - startSpeed/topSpeed)
+			uint64_t twoDistanceToStopTimesCsquaredDivD;
 		} cart;
 
 		struct DeltaParameters							// Parameters for delta movement
 		{
+			uint32_t mmPerStepTimesCKdivtopSpeed;
+
+			// The following depend on how the move is executed, so they must be set up in Prepare()
+			uint32_t accelStopDsK;
+			uint32_t decelStartDsK;
+
+			int32_t hmz0sK;								// the starting step position less the starting Z height, multiplied by the Z movement fraction and K (can go negative)
+			int32_t minusAaPlusBbTimesKs;
+
 			// The following don't depend on how the move is executed, so they could be set up in Init() if we use fixed acceleration/deceleration
 			uint64_t twoCsquaredTimesMmPerStepDivA;		// this could be stored in the DDA if all towers use the same steps/mm
 			uint64_t twoCsquaredTimesMmPerStepDivD;		// 2 * clock^2 * mmPerStepInHyperCuboidSpace / deceleration
 			int64_t dSquaredMinusAsquaredMinusBsquaredTimesKsquaredSsquared;
-			int32_t hmz0sK;								// the starting step position less the starting Z height, multiplied by the Z movement fraction and K (can go negative)
-			int32_t minusAaPlusBbTimesKs;
+			uint64_t twoDistanceToStopTimesCsquaredDivD;
+		} delta;
 
-			// The following depend on how the move is executed, so they must be set up in Prepare()
-			uint32_t accelStopDsK;
-			uint32_t decelStartDsK;
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+		// Precomputed step times for an extruder move with smoothed pressure advance. The extruder velocity is low pass filtered so that it changes
+		// continuously, and the extruder never reverses. These moves have few steps, typically on tool boards, so we calculate all the step times
+		// in the Move task and the ISR just adds up the intervals. Moves with too many steps use normal pressure advance instead.
+		struct SmoothedPaParameters
+		{
 			uint32_t mmPerStepTimesCKdivtopSpeed;
-		} delta;
+			uint32_t accelStopStep;
+			uint32_t decelStartStep;
+			uint32_t firstStepTime;						// the time of the first step, in step clocks after the start of the move
+			uint16_t stepIntervals[MaxSmoothedPaSteps - 1];	// the intervals between subsequent steps
+		} smoothed;
+#endif
 	} mp;
 
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+	bool isSmoothedPa;									// true if this move uses mp.smoothed
+#endif
+
+#if USE_STEP_TIME_TABLES
+	// Piecewise-linear approximation to the step times in the acceleration and deceleration phases of Cartesian and extruder moves.
+	// This is set up by Prepare() in the main task so that the ISR only needs to do a multiply and shift for most steps, instead of a square root.
+	// Where the linear approximation would not be accurate enough (typically at low speeds near the start of acceleration or the end of deceleration)
+	// the steps are not covered by the table and we calculate them exactly as before.
+	struct StepTimeSegment
+	{
+		uint32_t startStep;								// the first step number covered by this segment
+		uint32_t endStep;								// the step number after the last one covered by this segment
+		uint32_t startTime;								// the time of step startStep in step clocks after the start of the move
+		uint32_t clocksPerStep;							// the interpolation slope, multiplied by 2^StepTableSlopeShift
+	};
+
+	static constexpr size_t MaxStepTableSegments = 12;	// the maximum number of segments for the acceleration and deceleration phases together
+	static constexpr unsigned int StepTableSlopeShift = 12;
+	static constexpr uint32_t MinStepTableSegmentSteps = 8;	// it isn't worth using a segment shorter than this
+	static constexpr uint32_t MinStepTablePhaseSteps = 64;	// don't bother with a table for an acceleration or deceleration phase shorter than this
+
+	StepTimeSegment stepTable[MaxStepTableSegments];
+	uint8_t numStepTableSegments;						// how many entries in stepTable are valid
+	uint8_t stepTableIndex;								// the segment we are currently in or waiting for
+#endif
+
+#if USE_STEP_QUEUES
+	// Queue of precomputed step times for Cartesian and extruder moves. It is filled by the Move task and emptied by the step ISR,
+	// so that the ISR doesn't need to do any motion calculations unless the queue runs dry. If that happens, the ISR calculates the
+	// remaining steps of the move itself and the underrun is counted in the diagnostics.
+	static constexpr size_t StepQueueLength = 32;		// must be a power of 2 and no greater than 128
+
+	uint32_t stepQueue[StepQueueLength];				// the times of the steps after nextStep, in step clocks after the start of the move
+	uint32_t lastQueuedStep;							// the number of the last step that the Move task put in the queue
+	volatile uint8_t stepQueuePutIndex;					// updated only by the Move task
+	volatile uint8_t stepQueueGetIndex;					// updated only by the step ISR
+	volatile bool stepQueueActive;						// true if the ISR is taking step times from the queue
+#endif
+
 	static constexpr uint32_t NoStepTime = 0xFFFFFFFF;	// value to indicate that no further steps are needed when calculating the next step time
 	static constexpr uint32_t K1 = 1024;				// a power of 2 used to multiply the value mmPerStepTimesCdivtopSpeed to reduce rounding errors
 	static constexpr uint32_t K2 = 512;					// a power of 2 used in delta calculations to reduce rounding errors (but too large makes things worse)
 	static constexpr int32_t Kc = 1024 * 1024;			// a power of 2 for scaling the Z movement fraction
+
+#if USE_DELTA_SEGMENTS
+	// Piecewise quadratic approximation to the distance moved along the path (dsK) as a function of the step number of a delta tower.
+	// This is set up by PrepareDeltaAxis() so that the ISR doesn't need to solve the tower equation, which needs a square root, for most steps.
+	// Close to a reversal the function changes too quickly to approximate, so those steps are not covered by the table and we calculate them exactly.
+	struct DeltaSegment
+	{
+		uint32_t startStep;								// the first step number covered by this segment
+		uint32_t endStep;								// the step number after the last one covered by this segment
+		int32_t startDsK;								// dsK at step startStep
+		int32_t dsKPerStep;								// the linear coefficient, multiplied by 2^DeltaSegmentShift
+		int32_t dsKPerStepSquared;						// the quadratic coefficient, multiplied by 2^DeltaSegmentShift
+	};
+
+	static constexpr size_t MaxDeltaSegments = 8;		// the maximum number of segments before and after a reversal together
+	static constexpr unsigned int DeltaSegmentShift = 16;
+	static constexpr uint32_t MinDeltaSegmentSteps = 16;	// it isn't worth using a segment shorter than this
+	static constexpr uint32_t MaxDeltaSegmentSteps = 65536;	// limit the segment length so that the quadratic term can't overflow
+	static constexpr int32_t MaxDeltaSegmentError = (int32_t)K2/8;	// the largest error in dsK that we accept, equivalent to 1/8 step
+
+	bool MakeDeltaSegment(const DDA& dda, uint32_t startStep, uint32_t endStep, DeltaSegment& seg) const;
+
+	DeltaSegment deltaSegments[MaxDeltaSegments];
+	uint8_t numDeltaSegments;							// how many entries in deltaSegments are valid
+	uint8_t deltaSegmentIndex;							// the segment we are currently in or waiting for
+#endif
 };
 
 // Calculate and store the time since the start of the move when the next step for the specified DriveMovement is due.
@@ -230,6 +375,26 @@ inline bool DriveMovement::CalcNextStepTimeCartesian(const DDA &dda, bool live)
 	++nextStep;
 	if (nextStep <= totalSteps)
 	{
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+		if (isSmoothedPa)
+		{
+			stepInterval = (nextStep == 1) ? mp.smoothed.firstStepTime : mp.smoothed.stepIntervals[nextStep - 2];
+			nextStepTime += stepInterval;
+			return true;
+		}
+#endif
+#if USE_STEP_QUEUES
+		if (stepQueueActive)
+		{
+			const uint8_t getIndex = stepQueueGetIndex;
+			if (getIndex != stepQueuePutIndex)
+			{
+				return TakeQueuedStepTime(dda, live, getIndex);
+			}
+			stepQueueActive = false;	// the queue has run dry, so calculate the remaining steps here
+			++numStepQueueUnderruns;
+		}
+#endif
 		if (stepsTillRecalc != 0)
 		{
 			--stepsTillRecalc;			// we are doing double/quad/octal stepping
@@ -245,6 +410,57 @@ inline bool DriveMovement::CalcNextStepTimeCartesian(const DDA &dda, bool live)
 	return false;
 }
 
+#if USE_STEP_TIME_TABLES
+
+// Look up the time of a step in the precomputed table, returning true if the table covers it.
+// Steps are always calculated in ascending order, so we never need to go back to an earlier segment.
+inline bool DriveMovement::LookUpStepTime(uint32_t stepNumber, uint32_t& stepTime)
+{
+	while (stepTableIndex < numStepTableSegments)
+	{
+		const StepTimeSegment& seg = stepTable[stepTableIndex];
+		if (stepNumber < seg.startStep)
+		{
+			return false;						// this step is before the next segment
+		}
+		if (stepNumber < seg.endStep)
+		{
+			stepTime = seg.startTime + (uint32_t)(((uint64_t)(stepNumber - seg.startStep) * seg.clocksPerStep) >> StepTableSlopeShift);
+			return true;
+		}
+		++stepTableIndex;						// we have finished with this segment
+	}
+	return false;
+}
+
+#endif
+
+#if USE_DELTA_SEGMENTS
+
+// Get dsK for the specified step from the segment table if we can. Called only from the step ISR after the move has been prepared.
+// Step numbers passed to this are never less than the ones passed on previous calls, so we never need to go back to an earlier segment.
+inline bool DriveMovement::LookUpDeltaDsK(uint32_t stepNumber, int32_t& dsK)
+{
+	while (deltaSegmentIndex < numDeltaSegments)
+	{
+		const DeltaSegment& seg = deltaSegments[deltaSegmentIndex];
+		if (stepNumber < seg.startStep)
+		{
+			return false;						// this step is before the next segment
+		}
+		if (stepNumber < seg.endStep)
+		{
+			const uint32_t k = stepNumber - seg.startStep;
+			dsK = seg.startDsK + (int32_t)(((int64_t)seg.dsKPerStep * k + (int64_t)seg.dsKPerStepSquared * (int64_t)isquare64(k)) >> DeltaSegmentShift);
+			return true;
+		}
+		++deltaSegmentIndex;					// we have finished with this segment
+	}
+	return false;
+}
+
+#endif
+
 #if SUPPORT_DELTA_MOVEMENT
 
 // Calculate the time since the start of the move when the next step for the specified DriveMovement is due
@@ -312,6 +528,17 @@ inline int32_t DriveMovement::GetNetStepsTaken() const
 	return (direction) ? netStepsTaken : -netStepsTaken;
 }
 
+#if SUPPORT_STEP_ERROR_CORRECTION
+
+// Return the number of net steps in the forwards direction that the drive didn't take because of a step error.
+// We don't count them for delta towers, because their steps depend on the geometry of the whole move so we can't add them to another move.
+inline int32_t DriveMovement::GetNetStepsLost() const
+{
+	return (state == DMState::stepError && !isDeltaMovement) ? GetNetStepsLeft() : 0;
+}
+
+#endif
+
 // This is inlined because it is only called from one place
 inline void DriveMovement::Release(DriveMovement *item)
 {
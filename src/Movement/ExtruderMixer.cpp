@@ -0,0 +1,174 @@
+/*
+ * ExtruderMixer.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "ExtruderMixer.h"
+
+#if SUPPORT_EXTRUDER_MIXING
+
+#include <CAN/CanInterface.h>
+#include "CanMessageFormats.h"
+#include "CanMessageGenericParser.h"
+#include <RTOSIface/RTOSIface.h>
+
+ExtruderMixer::ExtruderMixer() : numDrivers(0), numMovesMixed(0), numRatioChanges(0)
+{
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		carry[drive] = 0.0;
+	}
+}
+
+GCodeResult ExtruderMixer::Configure(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, M567Params);
+	size_t numDriversSent, numNewRatios;
+	const uint8_t *newDrivers;
+	const float *newRatios;
+	const bool seenDrivers = parser.GetUint8ArrayParam('D', numDriversSent, newDrivers);
+	const bool seenRatios = parser.GetFloatArrayParam('E', numNewRatios, newRatios);
+	const size_t numNewDrivers = (seenDrivers) ? numDriversSent : numDrivers;
+	if (!seenDrivers && !seenRatios)
+	{
+		AppendDetails(reply);
+		return GCodeResult::ok;
+	}
+
+	if (seenDrivers)
+	{
+		if (numNewDrivers == 0 || numNewDrivers > NumDrivers)
+		{
+			reply.printf("Expected 1 to %u mixing drivers", NumDrivers);
+			return GCodeResult::error;
+		}
+		uint32_t driversSeen = 0;
+		for (size_t i = 0; i < numNewDrivers; ++i)
+		{
+			if (newDrivers[i] >= NumDrivers || (driversSeen & (1u << newDrivers[i])) != 0)
+			{
+				reply.printf("Bad or repeated mixing driver %u.%u", CanInterface::GetCanAddress(), newDrivers[i]);
+				return GCodeResult::error;
+			}
+			driversSeen |= 1u << newDrivers[i];
+		}
+		if (numNewDrivers == 1)
+		{
+			TaskCriticalSectionLocker lock;				// the Move task reads these
+			numDrivers = 0;
+			return GCodeResult::ok;
+		}
+	}
+
+	if (numNewDrivers < 2)
+	{
+		reply.copy("Mixing drivers not configured");
+		return GCodeResult::error;
+	}
+
+	float normalisedRatios[NumDrivers];
+	if (seenRatios)
+	{
+		if (numNewRatios != numNewDrivers)
+		{
+			reply.printf("Expected %u mix ratios", numNewDrivers);
+			return GCodeResult::error;
+		}
+		float total = 0.0;
+		for (size_t i = 0; i < numNewRatios; ++i)
+		{
+			if (newRatios[i] < 0.0)
+			{
+				reply.copy("Mix ratios must not be negative");
+				return GCodeResult::error;
+			}
+			total += newRatios[i];
+		}
+		if (total <= 0.0)
+		{
+			reply.copy("Mix ratios must not all be zero");
+			return GCodeResult::error;
+		}
+		for (size_t i = 0; i < numNewRatios; ++i)
+		{
+			normalisedRatios[i] = newRatios[i]/total;
+		}
+	}
+	else
+	{
+		// New drivers without new ratios, so share the steps equally
+		for (size_t i = 0; i < numNewDrivers; ++i)
+		{
+			normalisedRatios[i] = 1.0/(float)numNewDrivers;
+		}
+	}
+
+	TaskCriticalSectionLocker lock;						// the Move task reads these
+	if (seenDrivers)
+	{
+		memcpy(drivers, newDrivers, numNewDrivers);
+		numDrivers = numNewDrivers;
+	}
+	memcpy(ratios, normalisedRatios, numNewDrivers * sizeof(float));
+	++numRatioChanges;
+	return GCodeResult::ok;
+}
+
+// Split the extruder steps of a move across the mixing drivers. The message may still be in the move queue, so we put the mixed move in a copy.
+// The mixing drivers share the pressure advance of the first one.
+bool ExtruderMixer::Apply(const CanMessageMovement& msg, CanMessageMovement& mixedMsg)
+{
+	if (numDrivers < 2 || msg.perDrive[drivers[0]].steps == 0)
+	{
+		return false;
+	}
+
+	mixedMsg = msg;
+	const float totalSteps = (float)msg.perDrive[drivers[0]].steps;
+	const bool pressureAdvance = (msg.pressureAdvanceDrives & (1u << drivers[0])) != 0;
+	for (size_t i = 0; i < numDrivers; ++i)
+	{
+		const size_t drive = drivers[i];
+		const float wanted = totalSteps * ratios[i] + carry[drive];
+		const int32_t steps = lrintf(wanted);
+		carry[drive] = wanted - (float)steps;
+		mixedMsg.perDrive[drive].steps = (i == 0) ? steps : msg.perDrive[drive].steps + steps;
+		if (pressureAdvance)
+		{
+			mixedMsg.pressureAdvanceDrives |= 1u << drive;
+		}
+	}
+	++numMovesMixed;
+	return true;
+}
+
+void ExtruderMixer::AppendDetails(const StringRef& reply) const
+{
+	if (numDrivers < 2)
+	{
+		reply.copy("Extruder mixing off");
+	}
+	else
+	{
+		reply.copy("Extruder mixing drivers");
+		for (size_t i = 0; i < numDrivers; ++i)
+		{
+			reply.catf(" %u.%u:%.3f", CanInterface::GetCanAddress(), drivers[i], (double)ratios[i]);
+		}
+	}
+}
+
+void ExtruderMixer::Diagnostics(const StringRef& reply)
+{
+	if (numDrivers >= 2)
+	{
+		reply.lcatf("Mixed moves %" PRIu32 ", mix changes %" PRIu32, numMovesMixed, numRatioChanges);
+		numMovesMixed = numRatioChanges = 0;
+	}
+}
+
+#endif
+
+// End
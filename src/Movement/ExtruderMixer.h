@@ -0,0 +1,51 @@
+/*
+ * ExtruderMixer.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Local mixing of one extruder across several of our drivers, e.g. for a mixing hotend fed by two or three extruder motors.
+ *  The main board sends the extruder steps of the whole mix in the movement message as the steps of the first mixing driver, and zero steps
+ *  for the others. When we set up each move we split those steps across the mixing drivers in the current mix ratios, carrying the fractions
+ *  of a step forward to the next move so that no steps are lost. The main board configures us using the m567 message:
+ *  - D is the list of mixing drivers, the first of which carries the steps. A list with just one driver turns mixing off.
+ *  - E is the mix ratio of each driver. They are normalised, so they don't have to add up to 1.
+ *  E can be sent on its own to change the ratios. A new mix applies from the next move that we set up, so the main board doesn't have to
+ *  wait for its queue to drain or split the move into new segments.
+ */
+
+#ifndef SRC_MOVEMENT_EXTRUDERMIXER_H_
+#define SRC_MOVEMENT_EXTRUDERMIXER_H_
+
+#include "RepRapFirmware.h"
+
+#if SUPPORT_EXTRUDER_MIXING
+
+#include "GCodes/GCodeResult.h"
+
+struct CanMessageGeneric;
+struct CanMessageMovement;
+
+class ExtruderMixer
+{
+public:
+	ExtruderMixer();
+
+	GCodeResult Configure(const CanMessageGeneric& msg, const StringRef& reply);		// process a m567 message, called by the CAN command processor task
+	bool Apply(const CanMessageMovement& msg, CanMessageMovement& mixedMsg);			// split the extruder steps of a move, returning false if it isn't mixed. Called by the Move task.
+	void Diagnostics(const StringRef& reply);
+
+private:
+	void AppendDetails(const StringRef& reply) const;
+
+	float ratios[NumDrivers];							// the normalised mix ratios, in the order of the mixing drivers
+	float carry[NumDrivers];							// the fractions of a step carried forward, indexed by driver number
+	uint8_t drivers[NumDrivers];						// the mixing drivers, the first one carries the steps
+	size_t numDrivers;									// how many mixing drivers we have, mixing is off unless this is at least 2
+	uint32_t numMovesMixed;
+	uint32_t numRatioChanges;
+};
+
+#endif
+
+#endif /* SRC_MOVEMENT_EXTRUDERMIXER_H_ */
@@ -0,0 +1,287 @@
+/*
+ * InputShaper.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "InputShaper.h"
+
+#if SUPPORT_INPUT_SHAPING
+
+#include "StepTimer.h"
+#include "CanMessageFormats.h"
+#include "CanMessageGenericParser.h"
+#include <RTOSIface/RTOSIface.h>
+
+static const char * const ShaperNames[] = { "none", "ZV", "MZV", "EI" };
+
+InputShaper::InputShaper() : frequency(DefaultFrequency), damping(DefaultDamping), jerkFraction(0.0), type(InputShaperType::none)
+{
+	CalculateImpulses();
+}
+
+// Calculate the impulse amplitudes and times for the current shaper type, frequency and damping
+void InputShaper::CalculateImpulses()
+{
+	const float sqrtOneMinusDampingSquared = sqrtf(1.0 - fsquare(damping));
+	const float dampedPeriod = (float)StepTimer::StepClockRate/(frequency * sqrtOneMinusDampingSquared);
+	const float k = expf(-damping * Pi/sqrtOneMinusDampingSquared);
+
+	switch (type)
+	{
+	case InputShaperType::none:
+	default:
+		numImpulses = 1;						// a single impulse, so that we can still do jerk limiting
+		amplitudes[0] = 1.0;
+		delays[0] = 0.0;
+		break;
+
+	case InputShaperType::zv:
+		numImpulses = 2;
+		amplitudes[0] = 1.0;
+		amplitudes[1] = k;
+		delays[0] = 0.0;
+		delays[1] = 0.5 * dampedPeriod;
+		break;
+
+	case InputShaperType::mzv:
+		{
+			const float k2 = expf(-0.75 * damping * Pi/sqrtOneMinusDampingSquared);
+			numImpulses = 3;
+			amplitudes[0] = 1.0 - 1.0/sqrtf(2.0);
+			amplitudes[1] = (sqrtf(2.0) - 1.0) * k2;
+			amplitudes[2] = amplitudes[0] * fsquare(k2);
+			delays[0] = 0.0;
+			delays[1] = 0.375 * dampedPeriod;
+			delays[2] = 0.75 * dampedPeriod;
+		}
+		break;
+
+	case InputShaperType::ei:
+		{
+			constexpr float VibrationTolerance = 0.05;
+			numImpulses = 3;
+			amplitudes[0] = 0.25 * (1.0 + VibrationTolerance);
+			amplitudes[1] = 0.5 * (1.0 - VibrationTolerance) * k;
+			amplitudes[2] = amplitudes[0] * fsquare(k);
+			delays[0] = 0.0;
+			delays[1] = 0.5 * dampedPeriod;
+			delays[2] = dampedPeriod;
+		}
+		break;
+	}
+
+	// Normalise the amplitudes and find the centroid
+	float sum = 0.0;
+	for (size_t i = 0; i < numImpulses; ++i)
+	{
+		sum += amplitudes[i];
+	}
+	float centroid = 0.0;
+	for (size_t i = 0; i < numImpulses; ++i)
+	{
+		amplitudes[i] /= sum;
+		centroid += amplitudes[i] * delays[i];
+	}
+	totalDelay = delays[numImpulses - 1];
+	centroidOffset = centroid - 0.5 * totalDelay;
+}
+
+// Process a M593 command relayed from the main board. P is the shaper type, F the frequency in Hz, S the damping ratio and J the jerk limiting ramp fraction.
+// The Move task reads the parameters while preparing moves, so we set up a copy and only replace ours when the whole command is valid and the impulses have been calculated.
+GCodeResult InputShaper::Configure(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, M593Params);
+	InputShaper newShaper(*this);
+	bool seen = false;
+
+	uint8_t newType;
+	if (parser.GetUintParam('P', newType))
+	{
+		if (newType >= ARRAY_SIZE(ShaperNames))
+		{
+			reply.printf("Unknown input shaper type %u", newType);
+			return GCodeResult::error;
+		}
+		seen = true;
+		newShaper.type = (InputShaperType)newType;
+	}
+
+	float newFrequency;
+	if (parser.GetFloatParam('F', newFrequency))
+	{
+		if (newFrequency < MinFrequency || newFrequency > MaxFrequency)
+		{
+			reply.copy("Input shaper frequency out of range");
+			return GCodeResult::error;
+		}
+		seen = true;
+		newShaper.frequency = newFrequency;
+	}
+
+	float newDamping;
+	if (parser.GetFloatParam('S', newDamping))
+	{
+		if (newDamping < 0.0 || newDamping > MaxDamping)
+		{
+			reply.copy("Input shaper damping ratio out of range");
+			return GCodeResult::error;
+		}
+		seen = true;
+		newShaper.damping = newDamping;
+	}
+
+	float newJerkFraction;
+	if (parser.GetFloatParam('J', newJerkFraction))
+	{
+		if (newJerkFraction < 0.0 || newJerkFraction > MaxJerkFraction)
+		{
+			reply.copy("Jerk limiting ramp fraction out of range");
+			return GCodeResult::error;
+		}
+		seen = true;
+		newShaper.jerkFraction = newJerkFraction;
+	}
+
+	if (seen)
+	{
+		newShaper.CalculateImpulses();
+		TaskCriticalSectionLocker lock;			// stop the Move task seeing some of the new parameters and some of the old, this only affects moves that it prepares from now on
+		*this = newShaper;
+	}
+	else
+	{
+		AppendDetails(reply);
+	}
+	return GCodeResult::ok;
+}
+
+void InputShaper::AppendDetails(const StringRef& reply) const
+{
+	reply.printf("Input shaping: %s", ShaperNames[(size_t)type]);
+	if (type != InputShaperType::none)
+	{
+		reply.catf(" at %.1fHz damping %.2f, impulses", (double)frequency, (double)damping);
+		for (size_t i = 0; i < numImpulses; ++i)
+		{
+			reply.catf(" %.3f@%.2fms", (double)amplitudes[i], (double)(delays[i] * (1000.0f/(float)StepTimer::StepClockRate)));
+		}
+	}
+	if (jerkFraction > 0.0)
+	{
+		reply.catf(", jerk limiting ramps %.2f", (double)jerkFraction);
+	}
+}
+
+// Return the acceleration and jerk of the unshaped pulse at time x after it starts
+static inline void EvaluatePulse(float x, float width, float rampTime, float peakAcceleration, float& acceleration, float& jerk)
+{
+	if (x < 0.0 || x >= width)
+	{
+		acceleration = jerk = 0.0;
+	}
+	else if (x < rampTime)
+	{
+		jerk = peakAcceleration/rampTime;
+		acceleration = jerk * x;
+	}
+	else if (x < width - rampTime)
+	{
+		acceleration = peakAcceleration;
+		jerk = 0.0;
+	}
+	else
+	{
+		jerk = -peakAcceleration/rampTime;
+		acceleration = peakAcceleration * (width - x)/rampTime;
+	}
+}
+
+// Calculate the shaped profile for an acceleration or deceleration phase, returning the number of segments. Return 0 if the phase can't or shouldn't be shaped.
+// The acceleration pulse has width W and starts at time 'offset'. It is rectangular unless we are limiting jerk, in which case it is a trapezium.
+// After convolving it with the impulses it must fit within the phase, and its centroid must be in the middle of the phase. The impulse centroid is centroidOffset later than the middle of the impulses,
+// so we make the pulse shorter than the phase by totalDelay + 2 * |centroidOffset| and shift it to bring the centroid back to the middle.
+size_t InputShaper::BuildShapedPhase(float duration, float startSpeed, float speedChange, float startDistance, ShapedSegment *segments) const
+{
+	if ((type == InputShaperType::none && jerkFraction == 0.0) || duration <= 0.0)
+	{
+		return 0;
+	}
+
+	const float pulseWidth = duration - totalDelay - 2.0 * fabsf(centroidOffset);
+	if (pulseWidth < 0.1 * duration)
+	{
+		return 0;								// the phase is too short for this shaper, so leave it unshaped
+	}
+	const float offset = fabsf(centroidOffset) - centroidOffset;
+	const float rampTime = jerkFraction * pulseWidth;
+	const float peakAcceleration = speedChange/(pulseWidth - rampTime);
+
+	// Collect the times at which the acceleration or jerk changes, then sort them
+	float breakpoints[4 * MaxImpulses + 2];
+	size_t numBreakpoints = 0;
+	breakpoints[numBreakpoints++] = 0.0;
+	for (size_t i = 0; i < numImpulses; ++i)
+	{
+		const float pulseStart = offset + delays[i];
+		breakpoints[numBreakpoints++] = min<float>(pulseStart, duration);
+		breakpoints[numBreakpoints++] = min<float>(pulseStart + pulseWidth, duration);
+		if (rampTime > 0.0)
+		{
+			breakpoints[numBreakpoints++] = min<float>(pulseStart + rampTime, duration);
+			breakpoints[numBreakpoints++] = min<float>(pulseStart + pulseWidth - rampTime, duration);
+		}
+	}
+	for (size_t i = 1; i < numBreakpoints; ++i)
+	{
+		const float t = breakpoints[i];
+		size_t j = i;
+		while (j != 0 && breakpoints[j - 1] > t)
+		{
+			breakpoints[j] = breakpoints[j - 1];
+			--j;
+		}
+		breakpoints[j] = t;
+	}
+	breakpoints[numBreakpoints++] = duration;
+
+	// Build a segment for each interval between breakpoints, ignoring intervals shorter than one step clock
+	size_t numSegments = 0;
+	float speed = startSpeed;
+	float distance = startDistance;
+	for (size_t i = 0; i + 1 < numBreakpoints; ++i)
+	{
+		const float segStart = breakpoints[i];
+		const float segLength = breakpoints[i + 1] - segStart;
+		if (segLength < 1.0 || numSegments == MaxSegments)
+		{
+			continue;
+		}
+
+		// The acceleration is linear within the segment, so evaluate it in the middle where there is no ambiguity, then work back to the start
+		const float midTime = segStart + 0.5 * segLength;
+		float midAcceleration = 0.0, jerk = 0.0;
+		for (size_t j = 0; j < numImpulses; ++j)
+		{
+			float a, jk;
+			EvaluatePulse(midTime - offset - delays[j], pulseWidth, rampTime, peakAcceleration, a, jk);
+			midAcceleration += amplitudes[j] * a;
+			jerk += amplitudes[j] * jk;
+		}
+
+		ShapedSegment& seg = segments[numSegments++];
+		seg.startTime = segStart;
+		seg.startDistance = distance;
+		seg.startSpeed = speed;
+		seg.acceleration = midAcceleration - 0.5 * jerk * segLength;
+		seg.jerk = jerk;
+		distance += (speed + (0.5 * seg.acceleration + (1.0/6.0) * jerk * segLength) * segLength) * segLength;
+		speed += (seg.acceleration + 0.5 * jerk * segLength) * segLength;
+	}
+	return numSegments;
+}
+
+#endif
+
+// End
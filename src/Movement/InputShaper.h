@@ -0,0 +1,81 @@
+/*
+ * InputShaper.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  Input shaping to reduce ringing. The main board can't shape moves accurately across the CAN latency, so we do it here.
+ *  Ringing is excited by the abrupt changes in acceleration at the start and end of the acceleration and deceleration phases.
+ *  We replace the constant acceleration of each phase by a shorter rectangular pulse convolved with the shaper impulses, so that each
+ *  change in acceleration is split into several smaller ones timed to cancel the ringing at the configured frequency.
+ *  The pulse is positioned so that the centroid of the shaped acceleration is in the middle of the phase. Therefore the phase keeps its
+ *  duration, speed change and distance, and the rest of the move is not affected.
+ *  The same mechanism provides jerk limiting (S-curve acceleration): the pulse can have linear ramps instead of vertical edges, in which case
+ *  the acceleration within each segment changes linearly. Jerk limiting can be used with or without input shaping.
+ */
+
+#ifndef SRC_MOVEMENT_INPUTSHAPER_H_
+#define SRC_MOVEMENT_INPUTSHAPER_H_
+
+#include "RepRapFirmware.h"
+
+#if SUPPORT_INPUT_SHAPING
+
+#include "GCodes/GCodeResult.h"
+
+struct CanMessageGeneric;
+
+enum class InputShaperType : uint8_t
+{
+	none = 0,
+	zv,
+	mzv,
+	ei
+};
+
+// A segment of constant jerk (usually zero) within a shaped acceleration or deceleration phase. Units are step clocks and the fraction of the total move distance.
+struct ShapedSegment
+{
+	float startTime;						// when the segment starts, relative to the start of the phase
+	float startDistance;					// the distance moved when the segment starts, relative to the start of the move
+	float startSpeed;
+	float acceleration;						// the acceleration at the start of the segment, negative when decelerating
+	float jerk;								// the rate of change of acceleration, zero unless jerk limiting is enabled
+};
+
+class InputShaper
+{
+public:
+	static constexpr size_t MaxImpulses = 3;
+	static constexpr size_t MaxSegments = 4 * MaxImpulses + 1;	// the maximum number of segments in one shaped phase
+
+	InputShaper();
+
+	GCodeResult Configure(const CanMessageGeneric& msg, const StringRef& reply);		// process a M593 command relayed from the main board
+	size_t BuildShapedPhase(float duration, float startSpeed, float speedChange, float startDistance, ShapedSegment *segments) const;
+
+private:
+	void CalculateImpulses();
+	void AppendDetails(const StringRef& reply) const;
+
+	static constexpr float DefaultFrequency = 40.0;
+	static constexpr float DefaultDamping = 0.1;
+	static constexpr float MinFrequency = 4.0;
+	static constexpr float MaxFrequency = 1000.0;
+	static constexpr float MaxDamping = 0.5;
+	static constexpr float MaxJerkFraction = 0.5;
+
+	float frequency;						// the ringing frequency in Hz
+	float damping;							// the damping ratio
+	float jerkFraction;						// the fraction of the acceleration pulse taken by each of its ramps, or zero for no jerk limiting
+	float totalDelay;						// the delay of the last impulse in step clocks
+	float centroidOffset;					// the centroid of the impulses minus half the total delay, in step clocks
+	float amplitudes[MaxImpulses];			// the impulse amplitudes, normalised so that they add up to 1
+	float delays[MaxImpulses];				// the impulse times in step clocks, the first one is always zero
+	size_t numImpulses;
+	InputShaperType type;
+};
+
+#endif
+
+#endif /* SRC_MOVEMENT_INPUTSHAPER_H_ */
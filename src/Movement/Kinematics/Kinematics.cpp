@@ -17,6 +17,16 @@ Kinematics::Kinematics(KinematicsType t, float segsPerSecond, float minSegLength
 {
 }
 
+#if SUPPORT_LEADSCREW_CORRECTION
+
+GCodeResult Kinematics::ConfigureLeadscrewCorrections(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	reply.printf("%s kinematics doesn't support leadscrew corrections", GetName());
+	return GCodeResult::error;
+}
+
+#endif
+
 /*static*/ Kinematics *Kinematics::Create(KinematicsType k)
 {
 	switch (k)
@@ -10,6 +10,10 @@
 
 #include "RepRapFirmware.h"
 #include "Math/Matrix.h"
+#include "GCodes/GCodeResult.h"
+
+struct CanMessageGeneric;
+struct CanMessageMovement;
 
 inline floatc_t fcsquare(floatc_t a)
 {
@@ -154,6 +158,14 @@ public:
 	virtual void LimitSpeedAndAcceleration(DDA& dda, const float *normalisedDirectionVector) const = 0;
 #endif
 
+#if SUPPORT_LEADSCREW_CORRECTION
+	// Set or report the Z leadscrew corrections that we blend into moves ourselves. Override this in kinematics that support independent Z leadscrews.
+	virtual GCodeResult ConfigureLeadscrewCorrections(const CanMessageGeneric& msg, const StringRef& reply);
+
+	// Return the leadscrew correction steps to add to a drive in a new move. Called by DDA::Init.
+	virtual int32_t TakeLeadscrewCorrection(size_t drive, int32_t steps, const CanMessageMovement& msg) { return 0; }
+#endif
+
 	// Return true if the specified axis is a continuous rotation axis
 	virtual bool IsContinuousRotationAxis(size_t axis) const { return false; }
 
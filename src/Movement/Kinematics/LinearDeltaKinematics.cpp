@@ -75,6 +75,25 @@ void LinearDeltaKinematics::Recalc()
 	}
 
 	printRadiusSquared = fsquare(printRadius);
+
+	for (size_t axis = 0; axis < UsualNumTowers; ++axis)
+	{
+		towerConstants[axis].x = towerX[axis];
+		towerConstants[axis].y = towerY[axis];
+		towerConstants[axis].diagonalSquared = D2[axis];
+		SetStepsPerMm(axis, Platform::DriveStepsPerUnit(axis));
+	}
+}
+
+// Update the tower constants that depend on the steps per mm. Platform calls this when M92 changes the steps per mm of a drive.
+void LinearDeltaKinematics::SetStepsPerMm(size_t axis, float stepsPerMm)
+{
+	if (axis < UsualNumTowers)
+	{
+		TowerConstants& tc = towerConstants[axis];
+		tc.stepsPerMm = stepsPerMm;
+		tc.twoCsquaredTimesMmPerStep = (double)(2 * StepTimer::StepClockRateSquared)/(double)stepsPerMm;
+	}
 }
 
 // Calculate the motor position for a single tower from a Cartesian coordinate.
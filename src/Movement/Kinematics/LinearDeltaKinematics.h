@@ -30,6 +30,18 @@ public:
     float GetTowerY(size_t axis) const { return towerY[axis]; }
 	float GetHomedHeight() const { return homedHeight; }
 
+	// Constants for one tower that the step calculations use in every delta move, cached so that preparing a move doesn't recalculate them
+	struct TowerConstants
+	{
+		float x, y;										// the tower position
+		float diagonalSquared;
+		float stepsPerMm;
+		double twoCsquaredTimesMmPerStep;
+	};
+
+	const TowerConstants *GetTowerConstants() const { return towerConstants; }
+	void SetStepsPerMm(size_t axis, float stepsPerMm);								// Update the tower constants when the steps per mm of a drive have changed
+
 private:
 	void Init();
 	void Recalc();
@@ -71,6 +83,7 @@ private:
 	float coreFa, coreFb, coreFc;
 	float Q, Q2;
 	float D2[MaxTowers];
+	TowerConstants towerConstants[UsualNumTowers];
 
 	bool doneAutoCalibration;							// True if we have done auto calibration
 };
@@ -7,16 +7,132 @@
 
 #include "ZLeadscrewKinematics.h"
 
+#if SUPPORT_LEADSCREW_CORRECTION
+# include "Platform.h"
+# include "CAN/CanInterface.h"
+# include "CanMessageFormats.h"
+# include "CanMessageGenericParser.h"
+#endif
+
 const float M3ScrewPitch = 0.5;
 
 ZLeadscrewKinematics::ZLeadscrewKinematics(KinematicsType k)
 	: Kinematics(k, -1.0, 0.0, true), numLeadscrews(0), correctionFactor(1.0), maxCorrection(1.0), screwPitch(M3ScrewPitch)
 {
+#if SUPPORT_LEADSCREW_CORRECTION
+	SetCorrectionsDefaults();
+#endif
 }
 
 ZLeadscrewKinematics::ZLeadscrewKinematics(KinematicsType k, float segsPerSecond, float minSegLength, bool doUseRawG0)
 	: Kinematics(k, segsPerSecond, minSegLength, doUseRawG0), numLeadscrews(0), correctionFactor(1.0), maxCorrection(1.0), screwPitch(M3ScrewPitch)
 {
+#if SUPPORT_LEADSCREW_CORRECTION
+	SetCorrectionsDefaults();
+#endif
+}
+
+#if SUPPORT_LEADSCREW_CORRECTION
+
+void ZLeadscrewKinematics::SetCorrectionsDefaults()
+{
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		correctionRequested[drive] = correctionApplied[drive] = 0;
+		correctionMm[drive] = 0.0;
+	}
+	blendDistance = DefaultBlendDistance;
+	numCorrectedMoves = 0;
+}
+
+// Process a leadscrewCorrection message. C is the correction in mm of each of our drivers, B the blend distance in mm.
+// R1 tells us that the main board has homed Z or set the motor positions, so the corrections we have applied so far no longer count.
+GCodeResult ZLeadscrewKinematics::ConfigureLeadscrewCorrections(const CanMessageGeneric& msg, const StringRef& reply)
+{
+	CanMessageGenericParser parser(msg, LeadscrewCorrectionParams);
+	bool seen = false;
+
+	float blend;
+	if (parser.GetFloatParam('B', blend))
+	{
+		if (blend <= 0.0)
+		{
+			reply.copy("Blend distance must be greater than zero");
+			return GCodeResult::error;
+		}
+		seen = true;
+		blendDistance = blend;
+	}
+
+	uint8_t reset;
+	if (parser.GetUintParam('R', reset) && reset != 0)
+	{
+		seen = true;
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			correctionApplied[drive] = correctionRequested[drive];
+		}
+	}
+
+	size_t numCorrections;
+	const float *corrections;
+	if (parser.GetFloatArrayParam('C', numCorrections, corrections))
+	{
+		if (numCorrections != NumDrivers)
+		{
+			reply.printf("Expected corrections for %u drivers", NumDrivers);
+			return GCodeResult::error;
+		}
+		seen = true;
+		const float * const stepsPerMm = Platform::GetDriveStepsPerUnit();
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			correctionMm[drive] = corrections[drive];
+			correctionRequested[drive] = lrintf(corrections[drive] * stepsPerMm[drive]);
+		}
+	}
+
+	if (!seen)
+	{
+		reply.printf("Leadscrew corrections blended over %.2fmm, moves corrected %" PRIu32 ", drivers", (double)blendDistance, numCorrectedMoves);
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			reply.catf(" %u.%u:%.3f (%" PRIi32 " steps pending)",
+						CanInterface::GetCanAddress(), drive, (double)correctionMm[drive], correctionRequested[drive] - correctionApplied[drive]);
+		}
+	}
+	return GCodeResult::ok;
+}
+
+// Return the leadscrew correction steps to add to a drive that moves in a new move. We don't correct homing moves or drives that aren't moving.
+int32_t ZLeadscrewKinematics::TakeLeadscrewCorrection(size_t drive, int32_t steps, const CanMessageMovement& msg)
+{
+	const int32_t pending = correctionRequested[drive] - correctionApplied[drive];
+	if (   pending == 0
+		|| steps == 0
+		|| msg.stopAllDrivesOnEndstopHit
+		|| ((msg.deltaDrives | msg.pressureAdvanceDrives) & (1u << drive)) != 0
+	   )
+	{
+		return 0;
+	}
+
+	// Blend in the correction in proportion to the distance moved, but always make progress and never change the move by more than MaxCorrectionFraction
+	const float blendSteps = blendDistance * Platform::GetDriveStepsPerUnit()[drive];
+	const float absSteps = (float)labs(steps);
+	const int32_t blended = (absSteps >= blendSteps) ? labs(pending) : max<int32_t>(lrintf((float)labs(pending) * absSteps/blendSteps), 1);
+	const int32_t maxCorrection = min<int32_t>(blended, lrintf(absSteps * MaxCorrectionFraction));
+	if (maxCorrection <= 0)
+	{
+		return 0;
+	}
+
+	const int32_t correction = constrain<int32_t>(pending, -maxCorrection, maxCorrection);
+	correctionApplied[drive] = correctionApplied[drive] + correction;
+	++numCorrectedMoves;
+	return correction;
 }
 
+#endif
+
 // End
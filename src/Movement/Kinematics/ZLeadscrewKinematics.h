@@ -18,6 +18,12 @@ public:
 	ZLeadscrewKinematics(KinematicsType k);
 	ZLeadscrewKinematics(KinematicsType t, float segsPerSecond, float minSegLength, bool doUseRawG0);
 
+#if SUPPORT_LEADSCREW_CORRECTION
+	// Overridden base class functions. See Kinematics.h for descriptions.
+	GCodeResult ConfigureLeadscrewCorrections(const CanMessageGeneric& msg, const StringRef& reply) override;
+	int32_t TakeLeadscrewCorrection(size_t drive, int32_t steps, const CanMessageMovement& msg) override;
+#endif
+
 private:
 	void AppendCorrections(const floatc_t corrections[], const StringRef& reply) const;
 
@@ -28,6 +34,23 @@ private:
 	float correctionFactor;
 	float maxCorrection;
 	float screwPitch;
+
+#if SUPPORT_LEADSCREW_CORRECTION
+	// Leadscrew corrections applied locally. The main board sends the correction of each of our Z motors relative to the Z position it commands,
+	// and we blend the difference from the correction we have already applied into the Z moves we prepare, at the rate of its size per blend distance
+	// of Z movement. So levelling can be adjusted continuously without separate correction moves. The requested and applied corrections each have
+	// only one writer, so no locking is needed.
+	static constexpr float DefaultBlendDistance = 1.0;		// mm
+	static constexpr float MaxCorrectionFraction = 0.1;		// the most we change the steps of a move by, so the drive can't reverse or go much faster
+
+	void SetCorrectionsDefaults();
+
+	volatile int32_t correctionRequested[NumDrivers];		// in steps, updated only by the CAN command processor task
+	volatile int32_t correctionApplied[NumDrivers];			// in steps, updated only by the Move task
+	float correctionMm[NumDrivers];							// the corrections that the main board sent, for reporting
+	float blendDistance;									// the Z movement in mm over which we blend in a correction
+	uint32_t numCorrectedMoves;
+#endif
 };
 
 #endif /* SRC_MOVEMENT_KINEMATICS_ZLEADSCREWKINEMATICS_H_ */
@@ -37,17 +37,55 @@
 #include "StepTimer.h"
 #include "Platform.h"
 #include <CAN/CanInterface.h>
+#include <CanMessageBuffer.h>
 #include "Hardware/Interrupts.h"
+#include "Tasks.h"
 #include "CanMessageFormats.h"
+#include "StepProfiler.h"
+#include "StepBurstGenerator.h"
+#include "Tracer.h"
+#include "StackSizes.h"
+#include "MoveReplay.h"
+
+#if SUPPORT_DYNAMIC_MICROSTEPPING || SUPPORT_ENCODERS
+# if SUPPORT_TMC22xx
+#  include "StepperDrivers/TMC22xx.h"
+# endif
+# if SUPPORT_TMC51xx
+#  include "StepperDrivers/TMC51xx.h"
+# endif
+#endif
+
+static Task<StackSizes::MoveTaskWords> moveTask;
+
+// The Move task prepares moves as they arrive, so that the step ISR always has frozen moves to execute. It has a higher priority than the main task,
+// so preparation never waits behind housekeeping and configuration commands.
+extern "C" [[noreturn]] void MoveLoop(void *)
+{
+	for (;;)
+	{
+		(void)TaskBase::Take(moveInstance->Spin());
+	}
+}
 
-Move::Move() : currentDda(nullptr), scheduledMoves(0), completedMoves(0), numHiccups(0), active(false)
+Move::Move()
+	: currentDda(nullptr), scheduledMoves(0), completedMoves(0), numHiccups(0), hiccupClocks(0), lastHiccupTime(0), currentHiccupTime(DDA::HiccupTime), active(false)
 {
 	kinematics = Kinematics::Create(KinematicsType::cartesian);			// default to Cartesian
 
+	// Decide how long to make the DDA ring. Each DDA may need one DM per driver, but only the drives that move get one and it goes back to the pool
+	// as soon as the drive finishes, so we budget for DmsBudgetedPerDda of them per DDA and give whatever RAM is left to the DM pool.
+	const uint32_t bytesPerDda = sizeof(DDA) + DmsBudgetedPerDda * sizeof(DriveMovement);
+	const uint32_t freeRam = Tasks::GetNeverUsedRam();
+	const uint32_t ramAvailable = (freeRam > RamReservedAfterDdaRing) ? freeRam - RamReservedAfterDdaRing : 0;
+	ddaRingLength = constrain<unsigned int>(ramAvailable/bytesPerDda, MinDdaRingLength, MaxDdaRingLength);
+	const uint32_t ramForDms = (ramAvailable > ddaRingLength * sizeof(DDA)) ? ramAvailable - ddaRingLength * sizeof(DDA) : 0;
+	numDms = constrain<unsigned int>(ramForDms/sizeof(DriveMovement), ddaRingLength * DmsBudgetedPerDda, ddaRingLength * NumDrivers);
+
 	// Build the DDA ring
 	DDA *dda = new DDA(nullptr);
 	ddaRingGetPointer = ddaRingAddPointer = dda;
-	for (size_t i = 1; i < DdaRingLength; i++)
+	for (size_t i = 1; i < ddaRingLength; i++)
 	{
 		DDA * const oldDda = dda;
 		dda = new DDA(dda);
@@ -56,7 +94,73 @@ Move::Move() : currentDda(nullptr), scheduledMoves(0), completedMoves(0), numHic
 	ddaRingAddPointer->SetNext(dda);
 	dda->SetPrevious(ddaRingAddPointer);
 
-	DriveMovement::InitialAllocate(NumDms);
+	moveQueuePutIndex = moveQueueGetIndex = 0;
+	numLocalStops = 0;
+	lastLocalStopDrivers = 0;
+#if SUPPORT_PROBE_SLOWDOWN
+	numLocalSlowdowns = 0;
+#endif
+#if SUPPORT_DYNAMIC_MICROSTEPPING
+	numMicrostepChanges = 0;
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		maxStepRate[drive] = 0;
+		microstepCarry[drive] = 0;
+		configuredMicrostepping[drive] = 16;					// Platform::Init sets all drivers to x16 with interpolation
+		configuredInterpolation[drive] = true;
+		microstepReduction[drive] = 0;
+	}
+#endif
+#if SUPPORT_ENCODERS
+	for (volatile int32_t& pos : motorPositions)
+	{
+		pos = 0;
+	}
+#endif
+#if SUPPORT_FILAMENT_MONITORS
+	for (volatile int32_t& pos : extruderPositions)
+	{
+		pos = 0;
+	}
+#endif
+#if SUPPORT_BABYSTEPPING
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		babyStepsRequested[drive] = babyStepsApplied[drive] = 0;
+	}
+#endif
+#if SUPPORT_STEP_ERROR_CORRECTION
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		stepsLost[drive] = stepsCorrected[drive] = 0;
+	}
+	numStepErrorCorrections = numStepErrorCorrectionsDiscarded = 0;
+#endif
+#if SUPPORT_POSITION_REPORTS
+	for (int32_t& pos : drivePositions)
+	{
+		pos = 0;
+	}
+#endif
+#if SUPPORT_CONTROLLED_STOP
+	controlledStopRequested = controlledStopInProgress = controlledStopReportPending = false;
+	numControlledStops = 0;
+#endif
+#if SUPPORT_SPEED_OVERRIDE
+	numSpeedOverrides = numLateSpeedOverrides = 0;
+#endif
+#if SUPPORT_MOVE_MERGING
+	numMergedMoves = 0;
+#endif
+#if SUPPORT_JUNCTION_REPLANNING
+	numRaisedJunctions = 0;
+#endif
+	for (volatile float& rate : upcomingStepRates)
+	{
+		rate = 0.0;
+	}
+	ClearLookaheadStats();
+	DriveMovement::InitialAllocate(numDms);
 	timer.SetCallback(Move::TimerCallback, static_cast<void*>(this));
 }
 
@@ -76,7 +180,12 @@ void Move::Init()
 
 	idleCount = 0;
 
+#if SUPPORT_STEP_PROFILING
+	StepProfiler::Init();
+#endif
+
 	active = true;
+	moveTask.Create(MoveLoop, "MOVE", nullptr, TaskPriority::MovePriority);
 }
 
 void Move::Exit()
@@ -95,26 +204,54 @@ void Move::Exit()
 	{
 		(void)ddaRingCheckPointer->Free();
 		ddaRingCheckPointer = ddaRingCheckPointer->GetNext();
+		movesChanged = true;
 	}
 	active = false;												// don't accept any more moves
 }
 
-void Move::Spin()
+uint32_t Move::Spin()
 {
 	if (!active)
 	{
-		return;
+		return MoveTaskMaxSleepTicks;
 	}
 
+	uint32_t ticksToWait = MoveTaskMaxSleepTicks;
+
 	if (idleCount < 1000)
 	{
 		++idleCount;
 	}
 
+#if SUPPORT_CONTROLLED_STOP
+	if (controlledStopRequested)
+	{
+		controlledStopRequested = false;
+		DoControlledStop();
+	}
+	else if (controlledStopInProgress && NoLiveMovement())
+	{
+		controlledStopInProgress = false;
+		controlledStopReportPending = true;
+		CanInterface::WakeAsyncSender();
+	}
+#endif
+
+	// Return the DMs of drives that have finished their steps in the executing move to the pool, so that we can use them for the moves we add
+	{
+		AtomicCriticalSectionLocker lock;
+		DDA * const cdda = currentDda;
+		if (cdda != nullptr)
+		{
+			cdda->ReleaseFinishedDMs();
+		}
+	}
+
 	// Recycle the DDAs for completed moves, checking for DDA errors to print if Move debug is enabled
+	bool movesChanged = false;
 	while (ddaRingCheckPointer->GetState() == DDA::completed)
 	{
-		// Check for step errors and record/print them if we have any, before we lose the DMs
+		// Check for step errors and record/print them if we have any, before we lose the DMs. The DDA remembers errors in the DMs that it has already released.
 		if (ddaRingCheckPointer->HasStepError())
 		{
 			if (Platform::Debug(moduleMove))
@@ -125,7 +262,18 @@ void Move::Spin()
 			Platform::LogError(ErrorCode::BadMove);
 		}
 
+#if SUPPORT_ENCODERS
+		UpdateMotorPositions(*ddaRingCheckPointer);
+#endif
+#if SUPPORT_FILAMENT_MONITORS
+		UpdateExtruderPositions(*ddaRingCheckPointer);
+#endif
+
 		// Now release the DMs and check for underrun
+#if SUPPORT_POSITION_REPORTS
+		TaskCriticalSectionLocker lock;						// the position reports are sent by a higher priority task, so don't let it see the positions and the ring out of step
+		UpdateDrivePositions(*ddaRingCheckPointer);
+#endif
 		(void)ddaRingCheckPointer->Free();
 		ddaRingCheckPointer = ddaRingCheckPointer->GetNext();
 	}
@@ -156,26 +304,139 @@ void Move::Spin()
 		canAddMove = (unPreparedTime < StepTimer::StepClockRate/2 || unPreparedTime + prevMoveTime < 2 * StepTimer::StepClockRate);
 	}
 
+#if SUPPORT_SPEED_OVERRIDE
+	// Don't prepare moves that start more than MaxPrepareAheadClocks from now, so that a speed override can still change them
+	if (canAddMove
+# if SUPPORT_MOVE_REPLAY
+		&& !MoveReplay::IsReplaying()
+# endif
+	   )
+	{
+		uint32_t nextMoveTime;
+		const uint8_t getIndex = moveQueueGetIndex;
+		bool haveNextMove;
+		if (getIndex != moveQueuePutIndex)
+		{
+			nextMoveTime = moveQueue[getIndex & (MoveQueueLength - 1)].whenToExecute;
+			haveNextMove = true;
+		}
+		else
+		{
+			haveNextMove = CanInterface::PeekCanMoveTime(nextMoveTime);
+		}
+		if (haveNextMove)
+		{
+			const int32_t clocksTooEarly = (int32_t)(nextMoveTime - StepTimer::GetTimerTicks()) - (int32_t)MaxPrepareAheadClocks;
+			if (clocksTooEarly > 0)
+			{
+				canAddMove = false;
+				ticksToWait = min<uint32_t>(ticksToWait, (uint32_t)clocksTooEarly/(StepTimer::StepClockRate/1000) + 1);
+			}
+		}
+	}
+#endif
+
 	if (canAddMove)
 	{
-		// OK to add another move
-		CanMessageMovement move;
-		if (CanInterface::GetCanMove(move))
+		// OK to add another move. Take it from our own queue if possible, else from the overflow queue in CanInterface.
+		bool added = false;
+		bool haveReceiveTime = false;
+		uint32_t whenReceived = 0;
+		const uint8_t getIndex = moveQueueGetIndex;
+#if SUPPORT_MOVE_REPLAY
+		if (MoveReplay::IsReplaying())
 		{
-			if (ddaRingAddPointer->Init(move))
+			CanMessageMovement move;
+			added = MoveReplay::GetNextMove(move) && ddaRingAddPointer->Init(move);
+		}
+		else
+#endif
+		if (getIndex != moveQueuePutIndex)
+		{
+			const size_t slot = getIndex & (MoveQueueLength - 1);
+			whenReceived = moveQueueReceiveTimes[slot];
+			haveReceiveTime = true;
+#if SUPPORT_MOVE_MERGING
+			// Merge any following moves that are already queued and continue this one in a straight line at the same speed
+			CanMessageMovement merged = moveQueue[slot];
+			uint8_t endIndex = getIndex + 1;
+			{
+# if SUPPORT_SPEED_OVERRIDE
+				TaskCriticalSectionLocker lock;					// the CAN receiver task may be changing the timing of later moves
+# endif
+				while (endIndex != moveQueuePutIndex && TryMergeMoves(merged, moveQueue[endIndex & (MoveQueueLength - 1)]))
+				{
+					++endIndex;
+					++numMergedMoves;
+				}
+# if SUPPORT_JUNCTION_REPLANNING
+				// If the following move is already queued too, we can see both sides of the junction and may be able to go through it faster
+				if (endIndex != moveQueuePutIndex && TryRaiseJunctionSpeed(merged, moveQueue[endIndex & (MoveQueueLength - 1)]))
+				{
+					++numRaisedJunctions;
+				}
+# endif
+			}
+			added = ddaRingAddPointer->Init(merged);
+#else
+			const uint8_t endIndex = getIndex + 1;
+			added = ddaRingAddPointer->Init(moveQueue[slot]);
+#endif
+#if SUPPORT_MOVE_REPLAY
+			if (added)
+			{
+# if SUPPORT_JUNCTION_REPLANNING
+				MoveReplay::RecordMove(merged);					// record the move as we prepared it, because we may have changed the next move to join it
+# else
+				for (uint8_t index = getIndex; index != endIndex; ++index)
+				{
+					MoveReplay::RecordMove(moveQueue[index & (MoveQueueLength - 1)]);
+				}
+# endif
+			}
+#endif
+			__DMB();											// make sure we have finished with the slots before we release them
+			moveQueueGetIndex = endIndex;
+		}
+		else
+		{
+			CanMessageMovement move;
+			added = CanInterface::GetCanMove(move) && ddaRingAddPointer->Init(move);
+#if SUPPORT_MOVE_REPLAY
+			if (added)
 			{
-				ddaRingAddPointer = ddaRingAddPointer->GetNext();
-				idleCount = 0;
-				scheduledMoves++;
+				MoveReplay::RecordMove(move);
 			}
+#endif
+		}
+
+		if (added)
+		{
+			RecordMovePrepared(ddaRingAddPointer->GetMoveStartTime(), whenReceived, haveReceiveTime);
+			ddaRingAddPointer = ddaRingAddPointer->GetNext();
+			idleCount = 0;
+			scheduledMoves++;
+			movesChanged = true;
+			ticksToWait = 0;											// there may be more moves waiting
 		}
 	}
 
+	if (movesChanged)
+	{
+		UpdateUpcomingStepRates();
+	}
+
 	// See whether we need to kick off a move
 	if (currentDda == nullptr)
 	{
 		// No DDA is executing, so start executing a new one if possible
-		if (!canAddMove || idleCount > 10)							// better to have a few moves in the queue so that we can do lookahead
+		// Better to have a few moves in the queue so that we can do lookahead, but if the first move is due to start soon then we must start it
+		// so that it starts on time, because other boards may be executing the same move
+		if (   !canAddMove || idleCount > IdleCountBeforeStart
+#if SUPPORT_STRICT_MOVE_START
+			|| (int32_t)(ddaRingGetPointer->GetMoveStartTime() - StepTimer::GetTimerTicks()) < (int32_t)StrictStartLeadClocks
+#endif
+		   )
 		{
 			// Prepare one move and execute it. We assume that we will enter the next if-block before it completes, giving us time to prepare more moves.
 			DDA * const cdda = ddaRingGetPointer;					// capture volatile variable
@@ -184,24 +445,42 @@ void Move::Spin()
 				AtomicCriticalSectionLocker();
 
 				currentDda = cdda;
-				cdda->Start(StepTimer::GetTimerTicks());
+				const uint32_t now = StepTimer::GetTimerTicks();
+				const uint32_t whenScheduled = cdda->GetMoveStartTime();	// get this before we start the move, because starting a late move may change it
+				RecordMoveStart(whenScheduled, now, cdda->Start(now));
 				if (cdda->ScheduleNextStepInterrupt(timer))
 				{
-					Interrupt();
+					Interrupt(StepTimer::GetTimerTicks());
 				}
 			}
 		}
+
+		if (currentDda == nullptr && ddaRingGetPointer->GetState() != DDA::empty)
+		{
+			ticksToWait = min<uint32_t>(ticksToWait, 1);				// we have moves that haven't started yet, so come round again soon
+		}
 	}
-}
 
-#if 0
-// Try to push some babystepping through the lookahead queue
-float Move::PushBabyStepping(float amount)
-{
-	return ddaRingAddPointer->AdvanceBabyStepping(amount);
-}
+#if SUPPORT_MOVE_REPLAY
+	if (MoveReplay::IsReplaying() && NoLiveMovement())
+	{
+		MoveReplay::MovesFinished();
+	}
+#endif
+
+#if USE_STEP_QUEUES
+	// Top up the step time queues of the executing move. Drives that have finished have already had their DMs returned to the pool by ReleaseFinishedDMs earlier in Spin,
+	// and FillStepQueues skips any that have finished since then.
+	DDA * const cdda = currentDda;								// capture volatile variable
+	if (cdda != nullptr)
+	{
+		cdda->FillStepQueues();										// the step ISR wakes us when a queue is half empty
+	}
 #endif
 
+	return ticksToWait;
+}
+
 // Change the kinematics to the specified type if it isn't already
 // If it is already correct leave its parameters alone.
 // This violates our rule on no dynamic memory allocation after the initialisation phase,
@@ -419,65 +698,1020 @@ void Move::Diagnostics(MessageType mtype)
 	DriveMovement::ResetMinFree();
 #endif
 	Platform::MessageF(mtype, "Scheduled moves: %" PRIu32 ", completed moves: %" PRIu32 /*"\n"*/, scheduledMoves, completedMoves);
+#if SUPPORT_STEP_PROFILING
+	String<FormatStringLength> profile;
+	StepProfiler::Diagnostics(profile.GetRef());
+	Platform::MessageF(mtype, "%s\n", profile.c_str());
+#endif
 }
 
-// This is called from the step ISR when the current move has been completed
-void Move::CurrentMoveCompleted()
+// Fill in the movement fields of a binary diagnostics report. We report the same counters as Diagnostics but we don't reset them.
+void Move::GetDiagnostics(CanMessageDiagnosticsReply& msg) const
 {
-	currentDda = nullptr;
-	ddaRingGetPointer = ddaRingGetPointer->GetNext();
-	completedMoves++;
+	msg.scheduledMoves = scheduledMoves;
+	msg.completedMoves = completedMoves;
+	msg.hiccups = numHiccups;
+	msg.movesReceivedLate = min<uint32_t>(numReceivedLate, 0xFFFF);
+	msg.movesPreparedLate = min<uint32_t>(numPreparedLate, 0xFFFF);
+	msg.movesStartedLate = min<uint32_t>(numStartedLate, 0xFFFF);
+	msg.ringEmpty = min<uint32_t>(numRingEmpty, 0xFFFF);
+	msg.freeDms = (int8_t)min<int>(DriveMovement::NumFree(), 127);
+	msg.minFreeDms = (int8_t)min<int>(DriveMovement::MinFree(), 127);
 }
 
-void Move::StopDrivers(uint16_t whichDrivers)
+// Add a move to the move queue. Called by the CAN receiver task, which is the only producer.
+// Return true if successful, false if the queue is full in which case the caller must queue the move somewhere else.
+bool Move::QueueMove(const CanMessageMovement& msg, uint32_t whenReceived)
 {
-#if defined(SAME51)
-	const uint32_t oldPrio = ChangeBasePriority(NvicPriorityStep);
-#elif defined(SAMC21)
-	const irqflags_t flags = cpu_irq_save();
-#else
-# error Unsupported processor
+	const uint8_t putIndex = moveQueuePutIndex;
+	if ((uint8_t)(putIndex - moveQueueGetIndex) >= MoveQueueLength)
+	{
+		return false;
+	}
+	const size_t slot = putIndex & (MoveQueueLength - 1);
+	moveQueue[slot] = msg;
+	moveQueueReceiveTimes[slot] = whenReceived;
+	__DMB();													// make sure the Move task can't see the new index before it sees the message
+	moveQueuePutIndex = putIndex + 1;
+	return true;
+}
+
+#if SUPPORT_SPEED_OVERRIDE
+
+// Change the speed of all the moves in our queue that start at or after whenToApply, which is in local time and is normally a move boundary.
+// The time from whenToApply to the start and end of each move is divided by the speed factor, so the moves stay contiguous and all boards
+// that got the same override keep in step. Moves that we have already taken from the queue start earlier than whenToApply if the main board
+// sent the override at least SpeedOverrideLeadClocks ahead, so we don't need to change prepared moves.
+void Move::ApplySpeedOverride(uint32_t whenToApply, float speedFactor)
+{
+	bool late = false;
+	{
+		TaskCriticalSectionLocker lock;							// stop the Move task taking moves from the queue while we change them
+		for (uint8_t index = moveQueueGetIndex; index != moveQueuePutIndex; ++index)
+		{
+			if (!ApplySpeedOverride(moveQueue[index & (MoveQueueLength - 1)], whenToApply, speedFactor))
+			{
+				late = true;
+			}
+		}
+	}
+
+	// Check whether the executing move or any prepared move ends after the override time, in which case it has not been changed
+	{
+		AtomicCriticalSectionLocker lock;
+		for (DDA *dda = ddaRingGetPointer; dda != ddaRingAddPointer; dda = dda->GetNext())
+		{
+			if (dda->GetState() != DDA::completed && (int32_t)(dda->GetMoveFinishTime() - whenToApply) > 0)
+			{
+				late = true;
+				break;
+			}
+		}
+	}
+
+	++numSpeedOverrides;
+	if (late)
+	{
+		++numLateSpeedOverrides;
+	}
+}
+
+// Change the timing of a move for a speed override, returning false if it starts before whenToApply and ends after it, in which case we don't change it.
+// This is used for moves in local time and in master time, so it must only use differences between times.
+/*static*/ bool Move::ApplySpeedOverride(CanMessageMovement& msg, uint32_t whenToApply, float speedFactor)
+{
+	const int32_t startOffset = (int32_t)(msg.whenToExecute - whenToApply);
+	if (startOffset < 0)
+	{
+		return startOffset + (int32_t)(msg.accelerationClocks + msg.steadyClocks + msg.decelClocks) <= 0;
+	}
+
+	// Scale the start and end times and set the steady clocks to make up the difference, so that rounding errors don't accumulate along the queue
+	const uint32_t newStart = whenToApply + (uint32_t)lrintf((float)startOffset/speedFactor);
+	const uint32_t newEnd = whenToApply + (uint32_t)lrintf((float)(startOffset + (int32_t)(msg.accelerationClocks + msg.steadyClocks + msg.decelClocks))/speedFactor);
+	uint32_t accelerationClocks = (uint32_t)lrintf((float)msg.accelerationClocks/speedFactor);
+	uint32_t decelClocks = (uint32_t)lrintf((float)msg.decelClocks/speedFactor);
+	int32_t steadyClocks = (int32_t)(newEnd - newStart) - (int32_t)(accelerationClocks + decelClocks);
+	if (steadyClocks < 0)
+	{
+		// Rounding has made the acceleration and deceleration too long by a clock or two
+		if (decelClocks >= (uint32_t)-steadyClocks)
+		{
+			decelClocks -= (uint32_t)-steadyClocks;
+		}
+		else
+		{
+			accelerationClocks -= (uint32_t)-steadyClocks;
+		}
+		steadyClocks = 0;
+	}
+	msg.whenToExecute = newStart;
+	msg.accelerationClocks = accelerationClocks;
+	msg.steadyClocks = (uint32_t)steadyClocks;
+	msg.decelClocks = decelClocks;
+	return true;
+}
+
 #endif
-	DDA *cdda = currentDda;				// capture volatile
-	if (cdda != nullptr)
+
+#if SUPPORT_CONTROLLED_STOP
+
+void Move::RequestControlledStop()
+{
+	controlledStopRequested = true;
+	WakeMoveTask();
+}
+
+// Stop in a controlled way. Called by the Move task.
+// Moves that arrive from the main board after we have emptied the queues are executed normally, because it sends them after the stop message.
+void Move::DoControlledStop()
+{
+	for (int32_t& steps : controlledStopStepsNotTaken)
 	{
-		cdda->StopDrivers(whichDrivers);
-		if (cdda->GetState() == DDA::completed)
+		steps = 0;
+	}
+
+	// Discard the moves in our own queue and in the overflow queue
+	while (moveQueueGetIndex != moveQueuePutIndex)
+	{
+		const CanMessageMovement& msg = moveQueue[moveQueueGetIndex & (MoveQueueLength - 1)];
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
 		{
-			CurrentMoveCompleted();					// tell the DDA ring that the current move is complete
+			controlledStopStepsNotTaken[drive] += msg.perDrive[drive].steps;
+		}
+		__DMB();											// make sure we have finished with the slot before we release it
+		moveQueueGetIndex = moveQueueGetIndex + 1;
+	}
+	CanMessageMovement msg;
+	while (CanInterface::GetCanMove(msg))
+	{
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			controlledStopStepsNotTaken[drive] += msg.perDrive[drive].steps;
+		}
+	}
+
+	// Discard the moves in the ring that haven't started, and set up the move to decelerate to a stop after the current one if it doesn't end at a standstill
+	bool haveStopMove;
+	{
+		AtomicCriticalSectionLocker lock;
+		DDA * const cdda = currentDda;
+		DDA *dda = (cdda != nullptr) ? cdda->GetNext() : ddaRingGetPointer;
+		if (dda != ddaRingAddPointer)
+		{
+			DDA * const firstDiscarded = dda;
+			do
+			{
+				for (size_t drive = 0; drive < NumDrivers; ++drive)
+				{
+					controlledStopStepsNotTaken[drive] += dda->GetNetSteps(drive);
+				}
+				(void)dda->Free();
+				dda = dda->GetNext();
+				--scheduledMoves;
+			} while (dda != ddaRingAddPointer);
+			ddaRingAddPointer = firstDiscarded;
+		}
+		haveStopMove = cdda != nullptr && cdda->GetControlledStopMove(msg);
+	}
+
+	// Prepare the stop move outside the critical section, because DDA::Init enables the drives
+	if (haveStopMove && ddaRingAddPointer->Init(msg))
+	{
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			controlledStopStepsNotTaken[drive] -= msg.perDrive[drive].steps;
+		}
+		ddaRingAddPointer = ddaRingAddPointer->GetNext();
+		scheduledMoves++;
+	}
+
+	++numControlledStops;
+	controlledStopInProgress = true;
+	UpdateUpcomingStepRates();
+}
+
+// Tell the main board how many steps of the moves it sent us each drive didn't take because of the controlled stop
+void Move::SendControlledStopReport(CanMessageBuffer *buf)
+{
+	if (controlledStopReportPending)
+	{
+		auto msg = buf->SetupStatusMessage<CanMessageControlledStopReport>(CanInterface::GetCanAddress(), CanId::MasterAddress);
+		msg->numDrivers = NumDrivers;
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			msg->stepsNotTaken[drive] = controlledStopStepsNotTaken[drive];
+		}
+		buf->dataLength = msg->GetActualDataLength();
+		controlledStopReportPending = false;
+		CanInterface::SendAsync(buf);
+	}
+}
+
+#endif
+
+// Append the movement diagnostics to a CAN reply
+void Move::Diagnostics(const StringRef& reply)
+{
+	reply.printf("DDA ring %u, DMs %u free %d min %d", ddaRingLength, numDms, DriveMovement::NumFree(), DriveMovement::MinFree());
+	DriveMovement::ResetMinFree();
+
+	reply.lcat("Moves");
+#if SUPPORT_MOVE_MERGING
+	reply.catf(" merged %" PRIu32, numMergedMoves);
+	numMergedMoves = 0;
+#endif
+#if SUPPORT_JUNCTION_REPLANNING
+	reply.catf(", raised junctions %" PRIu32, numRaisedJunctions);
+	numRaisedJunctions = 0;
+#endif
+#if SUPPORT_CONTROLLED_STOP
+	reply.catf(", controlled stops %" PRIu32, numControlledStops);
+#endif
+#if SUPPORT_SPEED_OVERRIDE
+	reply.catf(", overrides %" PRIu32 " late %" PRIu32, numSpeedOverrides, numLateSpeedOverrides);
+#endif
+#if SUPPORT_EXTRUDER_MIXING
+	mixer.Diagnostics(reply);
+#endif
+#if SUPPORT_STEP_BURSTS
+	reply.catf("\nStep bursts %" PRIu32, StepBurstGenerator::GetNumBursts());
+#endif
+#if USE_STEP_QUEUES
+	reply.catf("\nStep queue underruns %" PRIu32, DriveMovement::GetAndClearStepQueueUnderruns());
+#endif
+#if SUPPORT_DYNAMIC_MICROSTEPPING
+	if (numMicrostepChanges != 0)
+	{
+		reply.catf("\nMicrostep changes %" PRIu32 ", reductions", numMicrostepChanges);
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			reply.catf(" %u", microstepReduction[drive]);
+		}
+	}
+#endif
+#if SUPPORT_BABYSTEPPING
+	bool babySteppingPending = false;
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		const int32_t pending = babyStepsRequested[drive] - babyStepsApplied[drive];
+		if (pending != 0)
+		{
+			if (!babySteppingPending)
+			{
+				reply.cat("\nBabysteps pending");
+				babySteppingPending = true;
+			}
+			reply.catf(" %u:%" PRIi32, drive, pending);
 		}
 	}
-#if defined(SAME51)
-	RestoreBasePriority(oldPrio);
-#elif defined(SAMC21)
-	cpu_irq_restore(flags);
-#else
-# error Unsupported processor
 #endif
 }
 
-// For debugging
-void Move::PrintCurrentDda() const
+// Append the statistics of moves that we stopped or slowed down locally to the reply and reset them, for M122 B# P15
+void Move::LocalStopDiagnostics(const StringRef& reply)
 {
-	if (currentDda != nullptr)
+	reply.lcatf("Local endstop stops %" PRIu32, numLocalStops);
+	if (numLocalStops != 0)
 	{
-		currentDda->DebugPrintAll();
+		reply.cat(", last at steps");
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			if (lastLocalStopDrivers & (1u << drive))
+			{
+				reply.catf(" %u:%" PRIi32, drive, lastLocalStopSteps[drive]);
+			}
+		}
+		numLocalStops = 0;
 	}
+#if SUPPORT_PROBE_SLOWDOWN
+	reply.lcatf("Local probe slowdowns %" PRIu32, numLocalSlowdowns);
+	numLocalSlowdowns = 0;
+#endif
 }
 
-uint32_t Move::GetAndClearHiccups()
+// Append the motion statistics to the reply and reset them, for M122 B# P17
+void Move::StatisticsDiagnostics(const StringRef& reply)
 {
-	const uint32_t nh = numHiccups;
-	numHiccups = 0;
-	return nh;
+#if SUPPORT_STEP_ERROR_CORRECTION
+	reply.lcatf("Step error corrections %u, discarded by homing %u, lost steps pending", numStepErrorCorrections, numStepErrorCorrectionsDiscarded);
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		reply.catf(" %" PRIi32, stepsLost[drive] - stepsCorrected[drive]);
+	}
+	numStepErrorCorrections = numStepErrorCorrectionsDiscarded = 0;
+#endif
+
+	static_assert(NumLeadTimeBuckets == 9, "Lead time bucket names need to be changed");
+	reply.lcat("Lead ms <1/<2/<4/<8/<16/<32/<64/<128/more:");
+	for (size_t i = 0; i < NumLeadTimeBuckets; ++i)
+	{
+		reply.catf("%c%" PRIu32, (i == 0) ? ' ' : '/', leadTimeHistogram[i]);
+	}
+	reply.lcatf("Late moves rcvd %" PRIu32 " prep %" PRIu32 " start %" PRIu32 " (max %.1fms), rescheduled %" PRIu32 ", ring empty %" PRIu32,
+				numReceivedLate, numPreparedLate, numStartedLate, (double)((float)maxStartLateness * (1000.0f/(float)StepTimer::StepClockRate)), numRescheduledStarts, numRingEmpty);
+	ClearLookaheadStats();
+}
+
+#if SUPPORT_BABYSTEPPING
+
+// Return the babystepping steps to add to a drive in a new move, limited so that the babystepping doesn't make the drive step too fast.
+// We don't babystep delta towers or extruders using pressure advance because their steps are calculated from the geometry of the move,
+// and we don't babystep homing or probing moves.
+int32_t Move::TakeBabySteps(size_t drive, const CanMessageMovement& msg)
+{
+	const int32_t pending = babyStepsRequested[drive] - babyStepsApplied[drive];
+	if (   pending == 0
+		|| msg.stopAllDrivesOnEndstopHit
+		|| ((msg.deltaDrives | msg.pressureAdvanceDrives) & (1u << drive)) != 0
+	   )
+	{
+		return 0;
+	}
+
+	const int32_t maxSteps = (int32_t)((msg.accelerationClocks + msg.steadyClocks + msg.decelClocks)/MinBabyStepClocks);
+	const int32_t steps = constrain<int32_t>(pending, -maxSteps, maxSteps);
+	babyStepsApplied[drive] = babyStepsApplied[drive] + steps;
+	return steps;
+}
+
+#endif
+
+#if SUPPORT_STEP_ERROR_CORRECTION
+
+// Return the number of steps that a drive lost because of step errors to add to a new move, at the microstepping that the main board uses. Called by DDA::Init.
+// We don't add them to delta moves or to extruders with pressure advance, because their steps aren't proportional to the move distance.
+// A homing move establishes a new position, so we discard the lost steps of the drives that it moves.
+int32_t Move::TakeStepErrorCorrection(size_t drive, const CanMessageMovement& msg)
+{
+	const int32_t pending = stepsLost[drive] - stepsCorrected[drive];
+	if (pending == 0)
+	{
+		return 0;
+	}
+
+	if (msg.stopAllDrivesOnEndstopHit)
+	{
+		if (msg.perDrive[drive].steps != 0)
+		{
+			stepsCorrected[drive] = stepsCorrected[drive] + pending;
+			++numStepErrorCorrectionsDiscarded;
+		}
+		return 0;
+	}
+
+	if (((msg.deltaDrives | msg.pressureAdvanceDrives) & (1u << drive)) != 0)
+	{
+		return 0;
+	}
+
+	const int32_t maxSteps = (int32_t)((msg.accelerationClocks + msg.steadyClocks + msg.decelClocks)/MinStepCorrectionClocks);
+	const int32_t steps = constrain<int32_t>(pending, -maxSteps, maxSteps);
+	if (steps != 0)
+	{
+		stepsCorrected[drive] = stepsCorrected[drive] + steps;
+		++numStepErrorCorrections;
+		if (Platform::Debug(moduleMove))
+		{
+			debugPrintf("Added %" PRIi32 " lost steps to a move of drive %u\n", steps, drive);
+		}
+	}
+	return steps;
+}
+
+#endif
+
+// Record the lookahead statistics for a move that has just been prepared. Called by the Move task.
+void Move::RecordMovePrepared(uint32_t whenScheduled, uint32_t whenReceived, bool haveReceiveTime)
+{
+	const int32_t leadTime = (int32_t)(whenScheduled - StepTimer::GetTimerTicks());
+	if (leadTime < 0)
+	{
+		if (haveReceiveTime && (int32_t)(whenScheduled - whenReceived) < 0)
+		{
+			++numReceivedLate;
+		}
+		else
+		{
+			++numPreparedLate;
+		}
+	}
+	else
+	{
+		const uint32_t leadTimeMillis = (uint32_t)leadTime/(StepTimer::StepClockRate/1000);
+		size_t bucket = 0;
+		while (bucket + 1 < NumLeadTimeBuckets && leadTimeMillis >= (1u << bucket))
+		{
+			++bucket;
+		}
+		++leadTimeHistogram[bucket];
+	}
+}
+
+// Record the start of a move. Called from the step ISR, or by the Move task with interrupts disabled.
+STEP_PATH_RAMFUNC void Move::RecordMoveStart(uint32_t whenScheduled, uint32_t whenStarted, bool onSchedule)
+{
+	if (!onSchedule)
+	{
+		++numRescheduledStarts;
+	}
+	const int32_t lateness = (int32_t)(whenStarted - whenScheduled);
+	if (lateness > (int32_t)LateStartThreshold)
+	{
+		++numStartedLate;
+		if ((uint32_t)lateness > maxStartLateness)
+		{
+			maxStartLateness = lateness;
+		}
+	}
+}
+
+void Move::ClearLookaheadStats()
+{
+	for (uint32_t& h : leadTimeHistogram)
+	{
+		h = 0;
+	}
+	numReceivedLate = numPreparedLate = numStartedLate = maxStartLateness = numRescheduledStarts = numRingEmpty = 0;
+}
+
+#if SUPPORT_MOVE_MERGING
+
+// Try to merge the next move into the move we are about to prepare, returning true if we did.
+// We can do this if the next move starts when this one ends, moves the same drives in the same ratios to within one step, and the two moves
+// join at their common top speed. Then the merged move has the same velocity profile and step counts as the two moves together.
+// Slicers often produce long runs of short collinear segments, so this saves preparing a DDA and allocating DMs for each of them.
+/*static*/ bool Move::TryMergeMoves(CanMessageMovement& move, const CanMessageMovement& next)
+{
+	if (   move.decelClocks != 0 || next.accelerationClocks != 0
+		|| move.deltaDrives != 0 || next.deltaDrives != 0				// delta moves are prepared from their start and end coordinates
+		|| move.pressureAdvanceDrives != next.pressureAdvanceDrives
+		|| move.stopAllDrivesOnEndstopHit || next.stopAllDrivesOnEndstopHit
+		|| next.whenToExecute != move.whenToExecute + move.accelerationClocks + move.steadyClocks
+		|| move.accelerationClocks + move.steadyClocks + next.steadyClocks + next.decelClocks > MaxMergedMoveClocks
+	   )
+	{
+		return false;
+	}
+
+	size_t refDrive;
+	if (!HaveSameStepRatios(move, next, refDrive))
+	{
+		return false;
+	}
+	const int32_t refSteps = move.perDrive[refDrive].steps;
+	const int32_t nextRefSteps = next.perDrive[refDrive].steps;
+
+	// Compare the top step rates of the reference drive, calculating the top speeds in the same way as DDA::Init
+	const float topSpeed = 2.0/(2 * move.steadyClocks + (move.initialSpeedFraction + 1.0) * move.accelerationClocks);
+	const float nextTopSpeed = 2.0/(2 * next.steadyClocks + (next.finalSpeedFraction + 1.0) * next.decelClocks);
+	const float stepRate = fabsf((float)refSteps * topSpeed);
+	const float nextStepRate = fabsf((float)nextRefSteps * nextTopSpeed);
+	if (fabsf(stepRate - nextStepRate) > 0.01 * max<float>(stepRate, nextStepRate))
+	{
+		return false;
+	}
+
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		move.perDrive[drive].steps += next.perDrive[drive].steps;
+	}
+	move.steadyClocks += next.steadyClocks;
+	move.decelClocks = next.decelClocks;
+	move.finalSpeedFraction = next.finalSpeedFraction;
+	return true;
+}
+
+#endif
+
+#if SUPPORT_MOVE_MERGING || SUPPORT_JUNCTION_REPLANNING
+
+// Return true if two moves move the same drives in the same directions and ratios to within one step, so they continue in a straight line.
+// Also return the drive that moves furthest in the first move, which we use as the reference drive when we compare their speeds.
+/*static*/ bool Move::HaveSameStepRatios(const CanMessageMovement& move, const CanMessageMovement& next, size_t& refDrive)
+{
+	// Compare the step ratios against the drive that moves furthest
+	refDrive = 0;
+	for (size_t drive = 1; drive < NumDrivers; ++drive)
+	{
+		if (labs(move.perDrive[drive].steps) > labs(move.perDrive[refDrive].steps))
+		{
+			refDrive = drive;
+		}
+	}
+	const int32_t refSteps = move.perDrive[refDrive].steps;
+	const int32_t nextRefSteps = next.perDrive[refDrive].steps;
+	if (refSteps == 0 || (refSteps < 0) != (nextRefSteps < 0) || nextRefSteps == 0)
+	{
+		return false;
+	}
+
+	const int64_t tolerance = labs(refSteps) + labs(nextRefSteps);
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		const int64_t crossProduct = (int64_t)move.perDrive[drive].steps * nextRefSteps - (int64_t)next.perDrive[drive].steps * refSteps;
+		if (crossProduct > tolerance || crossProduct < -tolerance)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+#endif
+
+#if SUPPORT_JUNCTION_REPLANNING
+
+// Return the top speed of a move as a fraction of the move per step clock, calculated in the same way as DDA::SetMotionParameters
+static inline float MoveTopSpeed(const CanMessageMovement& msg)
+{
+	return 2.0/(2 * msg.steadyClocks + (msg.initialSpeedFraction + 1.0) * msg.accelerationClocks + (msg.finalSpeedFraction + 1.0) * msg.decelClocks);
+}
+
+// Return the highest end speed that a move of the given distance and duration can have when it starts at startSpeed and accelerates at no more
+// than the given rate, which is the end speed at which it doesn't need to decelerate. Reversing time gives the highest start speed for a given end speed.
+// Distances are in steps and times in step clocks. Return a negative value if there is no such profile.
+static float MaxEndSpeed(float distance, float clocks, float startSpeed, float acceleration)
+{
+	const float discriminant = fsquare(clocks) - 2.0 * (distance - startSpeed * clocks)/acceleration;
+	return (discriminant < 0.0) ? -1.0 : startSpeed + acceleration * (clocks - sqrtf(discriminant));
+}
+
+// Calculate the profile of a move that covers the distance in the given time at the given start and end speeds, accelerating and decelerating
+// at the given rates. The top speed is the lower root of the quadratic for the distance, because the higher root needs more time than we have.
+static bool CalcMoveProfile(float distance, uint32_t clocks, float startSpeed, float endSpeed, float acceleration, float deceleration,
+								uint32_t& accelClocks, uint32_t& decelClocks, float& topSpeed)
+{
+	const float a = 0.5/acceleration + 0.5/deceleration;
+	const float b = (float)clocks + startSpeed/acceleration + endSpeed/deceleration;
+	const float c = 0.5 * fsquare(startSpeed)/acceleration + 0.5 * fsquare(endSpeed)/deceleration + distance;
+	const float discriminant = fsquare(b) - 4.0 * a * c;
+	if (discriminant < 0.0)
+	{
+		return false;
+	}
+	topSpeed = max<float>((b - sqrtf(discriminant))/(2.0 * a), max<float>(startSpeed, endSpeed));
+	accelClocks = (uint32_t)lrintf((topSpeed - startSpeed)/acceleration);
+	decelClocks = (uint32_t)lrintf((topSpeed - endSpeed)/deceleration);
+	return accelClocks + decelClocks <= clocks;
+}
+
+// Raise the speed at which a move joins the next one, if they continue in a straight line and the main board slowed down for the junction
+// only because it could not see the second move when it planned the first. Each move keeps its start time, duration and distance, so the
+// moves stay in step with the same moves on other boards. Each phase keeps the acceleration or deceleration that the main board gave it and
+// no move goes faster than before, so we stay within the limits that the main board planned to.
+// If we raise the junction speed then we change both messages and return true. Called with the next move still in the queue.
+/*static*/ bool Move::TryRaiseJunctionSpeed(CanMessageMovement& move, CanMessageMovement& next)
+{
+	if (   move.accelerationClocks == 0 || move.decelClocks == 0			// we need both phases so that we can lower the top speed
+		|| next.accelerationClocks == 0 || next.decelClocks == 0
+		|| move.deltaDrives != 0 || next.deltaDrives != 0				// delta moves are prepared from their start and end coordinates
+		|| move.pressureAdvanceDrives != next.pressureAdvanceDrives
+		|| move.stopAllDrivesOnEndstopHit || next.stopAllDrivesOnEndstopHit
+		|| next.whenToExecute != move.whenToExecute + move.accelerationClocks + move.steadyClocks + move.decelClocks
+	   )
+	{
+		return false;
+	}
+
+	size_t refDrive;
+	if (!HaveSameStepRatios(move, next, refDrive))
+	{
+		return false;
+	}
+
+	// Work in steps of the reference drive and step clocks, so that the speeds of the two moves can be compared
+	const float distance = fabsf((float)move.perDrive[refDrive].steps);
+	const uint32_t clocks = move.accelerationClocks + move.steadyClocks + move.decelClocks;
+	const float topSpeed = MoveTopSpeed(move) * distance;
+	const float startSpeed = topSpeed * move.initialSpeedFraction;
+	const float endSpeed = topSpeed * move.finalSpeedFraction;
+	const float acceleration = (topSpeed - startSpeed)/move.accelerationClocks;
+	const float deceleration = (topSpeed - endSpeed)/move.decelClocks;
+
+	const float nextDistance = fabsf((float)next.perDrive[refDrive].steps);
+	const uint32_t nextClocks = next.accelerationClocks + next.steadyClocks + next.decelClocks;
+	const float nextTopSpeed = MoveTopSpeed(next) * nextDistance;
+	const float nextStartSpeed = nextTopSpeed * next.initialSpeedFraction;
+	const float nextEndSpeed = nextTopSpeed * next.finalSpeedFraction;
+	const float nextAcceleration = (nextTopSpeed - nextStartSpeed)/next.accelerationClocks;
+	const float nextDeceleration = (nextTopSpeed - nextEndSpeed)/next.decelClocks;
+
+	if (   acceleration <= 0.0 || deceleration <= 0.0 || nextAcceleration <= 0.0 || nextDeceleration <= 0.0
+		|| fabsf(endSpeed - nextStartSpeed) > 0.01 * max<float>(topSpeed, nextTopSpeed)		// the main board didn't plan a continuous junction
+	   )
+	{
+		return false;
+	}
+
+	// The junction speed is limited by the first move reaching it without decelerating and the second move leaving it without accelerating
+	const float junctionSpeed = min<float>(MaxEndSpeed(distance, (float)clocks, startSpeed, acceleration),
+											MaxEndSpeed(nextDistance, (float)nextClocks, nextEndSpeed, nextDeceleration));
+	if (junctionSpeed < endSpeed * (1.0 + MinJunctionSpeedIncrease))
+	{
+		return false;
+	}
+
+	uint32_t accelClocks, decelClocks, nextAccelClocks, nextDecelClocks;
+	float newTopSpeed, newNextTopSpeed;
+	if (   !CalcMoveProfile(distance, clocks, startSpeed, junctionSpeed, acceleration, deceleration, accelClocks, decelClocks, newTopSpeed)
+		|| !CalcMoveProfile(nextDistance, nextClocks, junctionSpeed, nextEndSpeed, nextAcceleration, nextDeceleration, nextAccelClocks, nextDecelClocks, newNextTopSpeed)
+		|| newTopSpeed > topSpeed || newNextTopSpeed > nextTopSpeed
+	   )
+	{
+		return false;
+	}
+
+	// DDA::Init calculates the top speed from the phase times and speed fractions, so each move still covers exactly its own steps
+	move.accelerationClocks = accelClocks;
+	move.decelClocks = decelClocks;
+	move.steadyClocks = clocks - accelClocks - decelClocks;
+	move.initialSpeedFraction = startSpeed/newTopSpeed;
+	move.finalSpeedFraction = junctionSpeed/newTopSpeed;
+
+	next.accelerationClocks = nextAccelClocks;
+	next.decelClocks = nextDecelClocks;
+	next.steadyClocks = nextClocks - nextAccelClocks - nextDecelClocks;
+	next.initialSpeedFraction = junctionSpeed/newNextTopSpeed;
+	next.finalSpeedFraction = nextEndSpeed/newNextTopSpeed;
+	return true;
+}
+
+#endif
+
+#if SUPPORT_DYNAMIC_MICROSTEPPING
+
+// Set the step rate above which we reduce the microstepping of a drive. The rate is in driver steps per second, so it is the most that we ask the step ISR to generate
+// when the move needs the full reduction. Setting it to zero restores the configured microstepping at the next move boundary.
+void Move::SetMaxStepRate(size_t drive, uint32_t stepsPerSecond)
+{
+	maxStepRate[drive] = stepsPerSecond;
+}
+
+// This is called when the main board sets the microstepping of a drive, which overrides any reduction we made.
+// The main board only changes the microstepping when no moves are queued, so we can discard the carry.
+void Move::MicrosteppingChanged(size_t drive)
+{
+	bool interpolation;
+	configuredMicrostepping[drive] = SmartDrivers::GetMicrostepping(drive, interpolation);
+	configuredInterpolation[drive] = interpolation;
+	microstepReduction[drive] = 0;
+	microstepCarry[drive] = 0;
+}
+
+// Return true if no move that we haven't recycled yet uses this drive. Called by the Move task, so the DMs can't be released while we look at them.
+// Starting from the check pointer covers the executing move, and also completed moves whose steps we haven't added to the motor position at the microstepping they used.
+bool Move::IsDriveIdle(size_t drive) const
+{
+	for (const DDA *dda = ddaRingCheckPointer; dda != ddaRingAddPointer; dda = dda->GetNext())
+	{
+		if (dda->MovesDrive(drive))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Convert the number of steps that the main board asked for in a new move, which are at the configured microstepping, to the number of steps we give the driver.
+// If the drive is idle and the move starts late enough, choose the microstepping for this move from its peak step rate.
+// Steps that don't make up a whole driver step are carried forward to the next move, so that no steps are lost.
+int32_t Move::AdjustDriveSteps(size_t drive, int32_t steps, const CanMessageMovement& msg)
+{
+	if (maxStepRate[drive] == 0 && microstepReduction[drive] == 0)
+	{
+		return steps;
+	}
+
+	const int32_t totalSteps = steps + microstepCarry[drive];
+	if (steps != 0)
+	{
+		// Don't reduce the microstepping of delta towers or extruders using pressure advance, because their step calculations use the configured steps/mm
+		unsigned int wantedReduction = 0;
+		if (maxStepRate[drive] != 0 && ((msg.deltaDrives | msg.pressureAdvanceDrives) & (1u << drive)) == 0)
+		{
+			// Calculate the top speed as a fraction of the move per step clock in the same way as DDA::Init, then the peak step rate at the configured microstepping
+			const float topSpeed = 2.0/(2 * msg.steadyClocks + (msg.initialSpeedFraction + 1.0) * msg.accelerationClocks + (msg.finalSpeedFraction + 1.0) * msg.decelClocks);
+			const float peakStepRate = fabsf((float)totalSteps) * topSpeed * (float)StepTimer::StepClockRate;
+			while (   wantedReduction < MaxMicrostepReduction
+				   && (configuredMicrostepping[drive] >> (wantedReduction + 1)) != 0
+				   && peakStepRate > (float)maxStepRate[drive] * (float)(1u << wantedReduction)
+				  )
+			{
+				++wantedReduction;
+			}
+		}
+
+		// The new microstepping must reach the driver after its last move ends and before this one starts
+		if (   wantedReduction != microstepReduction[drive]
+			&& (int32_t)(msg.whenToExecute - StepTimer::GetTimerTicks()) >= (int32_t)MicrostepChangeLeadClocks
+			&& IsDriveIdle(drive)
+		   )
+		{
+			// Use interpolation while the microstepping is reduced, so that the motor still moves smoothly
+			if (SmartDrivers::SetMicrostepping(drive, configuredMicrostepping[drive] >> wantedReduction, configuredInterpolation[drive] || wantedReduction != 0))
+			{
+				microstepReduction[drive] = wantedReduction;
+				++numMicrostepChanges;
+			}
+		}
+	}
+
+	const int32_t divisor = 1 << microstepReduction[drive];
+	const int32_t driverSteps = totalSteps/divisor;				// this rounds towards zero, so the carry has the same sign as the total
+	microstepCarry[drive] = totalSteps - driverSteps * divisor;
+	return driverSteps;
+}
+
+#endif
+
+#if SUPPORT_ENCODERS
+
+// Add the steps taken by a completed move to the motor positions. Called by the Move task before it recycles the DDA.
+// Dynamic microstepping only changes the microstepping when no unrecycled move uses the drive, so it is still the microstepping that the move used.
+void Move::UpdateMotorPositions(const DDA& dda)
+{
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		if (dda.MovesDrive(drive))
+		{
+			bool dummy;
+			const unsigned int microsteps = SmartDrivers::GetMicrostepping(drive, dummy);
+			motorPositions[drive] += dda.GetStepsTaken(drive) * (int32_t)(256/microsteps);
+		}
+	}
+}
+
+#endif
+
+#if SUPPORT_PHASE_STEPPING
+
+// Get the position of a motor at the specified time in 1/256 full steps, including the moves that have completed but not been recycled and the progress of the executing move.
+// 'microsteps' is the microstepping that the driver uses. Called by the TMC task, which writes the coil currents of drivers in direct mode.
+// Locking out other tasks stops the Move task recycling moves and releasing their DMs while we look at them.
+int32_t Move::GetLiveMotorPosition(size_t drive, uint32_t when, uint32_t microsteps) const
+{
+	const int32_t unitsPerStep = (int32_t)(256/microsteps);
+	TaskCriticalSectionLocker taskLock;
+	int32_t position = motorPositions[drive];
+
+	AtomicCriticalSectionLocker lock;
+	const DDA *dda = ddaRingCheckPointer;
+	while (dda->GetState() == DDA::completed)
+	{
+		position += dda->GetStepsTaken(drive) * unitsPerStep;
+		dda = dda->GetNext();
+	}
+
+	const DDA * const cdda = currentDda;
+	if (cdda != nullptr)
+	{
+		position += lrintf(cdda->GetLiveSteps(drive, when) * (float)unitsPerStep);
+	}
+	return position;
+}
+
+#endif
+
+#if SUPPORT_FILAMENT_MONITORS
+
+// Add the net steps of a completed move to the extruder positions. Called by the Move task before it recycles the DDA.
+void Move::UpdateExtruderPositions(const DDA& dda)
+{
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		extruderPositions[drive] += dda.GetNetSteps(drive);
+	}
+}
+
+#endif
+
+#if SUPPORT_POSITION_REPORTS
+
+// Add the net steps of a completed move to the drive positions. Called by the Move task before it recycles the DDA.
+void Move::UpdateDrivePositions(const DDA& dda)
+{
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		drivePositions[drive] += dda.GetNetSteps(drive);
+	}
+}
+
+// Get the position of each drive now, including the moves that have completed but not been recycled and the progress of the executing move.
+// Called by the CAN async sender task. Locking out other tasks stops the Move task releasing the DMs of completed moves while we look at them.
+uint32_t Move::GetLivePositions(int32_t positions[NumDrivers], float stepsPerSecond[NumDrivers]) const
+{
+	TaskCriticalSectionLocker taskLock;
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		positions[drive] = drivePositions[drive];
+		stepsPerSecond[drive] = 0.0;
+	}
+
+	AtomicCriticalSectionLocker lock;
+	const uint32_t now = StepTimer::GetTimerTicks();
+	const DDA *dda = ddaRingCheckPointer;
+	while (dda->GetState() == DDA::completed)
+	{
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			positions[drive] += dda->GetNetSteps(drive);
+		}
+		dda = dda->GetNext();
+	}
+
+	const DDA * const cdda = currentDda;
+	if (cdda != nullptr)
+	{
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			int32_t stepsTaken;
+			cdda->GetLiveMotion(drive, now, stepsTaken, stepsPerSecond[drive]);
+			positions[drive] += stepsTaken;
+		}
+	}
+	return now;
+}
+
+#endif
+
+// Calculate the average step rate of each drive over the moves that are frozen or executing. This is called from the Move task whenever moves are added or recycled.
+// It is safe to look at the DMs here because the Move task is the only one that releases them.
+void Move::UpdateUpcomingStepRates()
+{
+	int32_t netSteps[NumDrivers] = { 0 };
+	uint32_t totalClocks = 0;
+	for (const DDA *dda = ddaRingCheckPointer; dda != ddaRingAddPointer; dda = dda->GetNext())
+	{
+		const DDA::DDAState st = dda->GetState();
+		if (st == DDA::frozen || st == DDA::executing)
+		{
+			totalClocks += dda->GetClocksNeeded();
+			for (size_t drive = 0; drive < NumDrivers; ++drive)
+			{
+				netSteps[drive] += dda->GetNetSteps(drive);
+			}
+		}
+	}
+
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		upcomingStepRates[drive] = (totalClocks == 0) ? 0.0 : ((float)netSteps[drive] * (float)StepTimer::StepClockRate)/(float)totalClocks;
+	}
+}
+
+// This is called from the step ISR when the current move has been completed
+STEP_PATH_RAMFUNC void Move::CurrentMoveCompleted()
+{
+	currentDda = nullptr;
+	ddaRingGetPointer = ddaRingGetPointer->GetNext();
+	completedMoves++;
+	Tracer::Record(Tracer::Event::ddaCompleted, (uint16_t)completedMoves);
+	WakeMoveTaskFromISR();												// the Move task needs to recycle the DDA and start the next move
+}
+
+/*static*/ void Move::WakeMoveTask()
+{
+	moveTask.Give();
+}
+
+/*static*/ void Move::WakeMoveTaskFromISR()
+{
+	moveTask.GiveFromISR();
+}
+
+void Move::StopDrivers(uint16_t whichDrivers)
+{
+#if defined(SAME51)
+	const uint32_t oldPrio = ChangeBasePriority(NvicPriorityStep);
+#elif defined(SAMC21)
+	const irqflags_t flags = cpu_irq_save();
+#else
+# error Unsupported processor
+#endif
+	DDA *cdda = currentDda;				// capture volatile
+	if (cdda != nullptr)
+	{
+		cdda->StopDrivers(whichDrivers);
+		if (cdda->GetState() == DDA::completed)
+		{
+			CurrentMoveCompleted();					// tell the DDA ring that the current move is complete
+		}
+	}
+#if defined(SAME51)
+	RestoreBasePriority(oldPrio);
+#elif defined(SAMC21)
+	cpu_irq_restore(flags);
+#else
+# error Unsupported processor
+#endif
+}
+
+// Stop some drivers because an input monitor bound to them has triggered, recording how far through the current move they were.
+// This is called from the input ISR, so we don't wait for the main board to receive the input change and send stopMovement.
+void Move::StopDriversFromInput(uint16_t whichDrivers)
+{
+#if defined(SAME51)
+	const uint32_t oldPrio = ChangeBasePriority(NvicPriorityStep);
+#elif defined(SAMC21)
+	const irqflags_t flags = cpu_irq_save();
+#else
+# error Unsupported processor
+#endif
+	DDA *cdda = currentDda;				// capture volatile
+	if (cdda != nullptr)
+	{
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			if (whichDrivers & (1u << drive))
+			{
+#if SUPPORT_DYNAMIC_MICROSTEPPING
+				lastLocalStopSteps[drive] = cdda->GetStepsTaken(drive) * (int32_t)(1u << microstepReduction[drive]);	// report them at the configured microstepping
+#else
+				lastLocalStopSteps[drive] = cdda->GetStepsTaken(drive);
+#endif
+			}
+		}
+		lastLocalStopDrivers = whichDrivers;
+		++numLocalStops;
+		cdda->StopDrivers(whichDrivers);
+		if (cdda->GetState() == DDA::completed)
+		{
+			CurrentMoveCompleted();					// tell the DDA ring that the current move is complete
+		}
+	}
+#if defined(SAME51)
+	RestoreBasePriority(oldPrio);
+#elif defined(SAMC21)
+	cpu_irq_restore(flags);
+#else
+# error Unsupported processor
+#endif
+}
+
+#if SUPPORT_PROBE_SLOWDOWN
+
+// Slow down the current move. This is like StopDriversFromInput, but for an analog probe input that is approaching its threshold.
+void Move::SlowDownFromInput(uint32_t inverseSpeedFactor)
+{
+#if defined(SAME51)
+	const uint32_t oldPrio = ChangeBasePriority(NvicPriorityStep);
+#elif defined(SAMC21)
+	const irqflags_t flags = cpu_irq_save();
+#else
+# error Unsupported processor
+#endif
+	DDA *cdda = currentDda;				// capture volatile
+	if (cdda != nullptr && cdda->ReduceSpeed(inverseSpeedFactor, StepTimer::GetTimerTicks()))
+	{
+		++numLocalSlowdowns;
+	}
+#if defined(SAME51)
+	RestoreBasePriority(oldPrio);
+#elif defined(SAMC21)
+	cpu_irq_restore(flags);
+#else
+# error Unsupported processor
+#endif
+}
+
+#endif
+
+// For debugging
+void Move::PrintCurrentDda() const
+{
+	if (currentDda != nullptr)
+	{
+		currentDda->DebugPrintAll();
+	}
+}
+
+uint32_t Move::GetAndClearHiccups()
+{
+	const uint32_t nh = numHiccups;
+	numHiccups = 0;
+	return nh;
+}
+
+uint32_t Move::GetAndClearHiccupClocks()
+{
+	const uint32_t hc = hiccupClocks;
+	hiccupClocks = 0;
+	return hc;
+}
+
+// This is called by the step timer. It isn't inline in Move.h because its address is taken, so we need a single copy of it that we can put in RAM.
+/*static*/ STEP_PATH_RAMFUNC void Move::TimerCallback(CallbackParameter cb)
+{
+	static_cast<Move*>(cb.vp)->Interrupt(StepTimer::GetCallbackStartTime());
 }
 
 // This is the function that is called by the timer interrupt to step the motors.
 // This may occasionally get called prematurely.
-void Move::Interrupt()
+STEP_PATH_RAMFUNC void Move::Interrupt(uint32_t now)
 {
-	const uint32_t isrStartTime = StepTimer::GetTimerTicks();
-	uint32_t now = isrStartTime;
+	PROFILE_STEP_PATH(moveInterrupt);
+	const uint32_t isrStartTime = now;
 	for (;;)
 	{
 		// Generate a step for the current move
@@ -497,11 +1731,13 @@ void Move::Interrupt()
 			cdda = ddaRingGetPointer;
 			if (cdda->GetState() != DDA::frozen)
 			{
+				++numRingEmpty;
 				return;
 			}
 
 			currentDda = cdda;
-			cdda->Start(finishTime);
+			const uint32_t whenScheduled = cdda->GetMoveStartTime();
+			RecordMoveStart(whenScheduled, finishTime, cdda->Start(finishTime));
 		}
 
 		// Schedule a callback at the time when the next step is due, and quit unless it is due immediately
@@ -515,9 +1751,14 @@ void Move::Interrupt()
 		if (now - isrStartTime >= DDA::MaxStepInterruptTime)
 		{
 			// Force a break by updating the move start time.
-			// If the inserted hiccup is too short then it won't help. So we double the hiccup time on each iteration.
+			// If the inserted hiccup is too short then it won't help. So if we had another hiccup just before the start of this ISR session, double the hiccup time.
 			++numHiccups;
-			cdda->InsertHiccup(now);
+			currentHiccupTime = (now - lastHiccupTime < currentHiccupTime + 2 * DDA::MaxStepInterruptTime)
+									? min<uint32_t>(currentHiccupTime * 2, DDA::MaxHiccupTime)
+									: DDA::HiccupTime;
+			lastHiccupTime = now;
+			hiccupClocks += cdda->InsertHiccup(now, currentHiccupTime);
+			Tracer::Record(Tracer::Event::hiccup, (uint16_t)min<uint32_t>(currentHiccupTime, 0xFFFF));
 
 			// Reschedule the next step interrupt. This time it should succeed if the hiccup time was long enough.
 			if (!cdda->ScheduleNextStepInterrupt(timer))
@@ -11,15 +11,28 @@
 #include "RepRapFirmware.h"
 #include "MessageType.h"
 #include "DDA.h"								// needed because of our inline functions
+#include "ExtruderMixer.h"
 #include "Kinematics/Kinematics.h"
+#include "CanMessageFormats.h"
+
+#if SUPPORT_JUNCTION_REPLANNING && !SUPPORT_MOVE_MERGING
+# error SUPPORT_JUNCTION_REPLANNING needs SUPPORT_MOVE_MERGING
+#endif
+
+class CanMessageBuffer;
 
 // Define the number of DDAs and DMs.
 // A DDA represents a move in the queue.
 // Each DDA needs one DM per drive that it moves.
 // However, DM's are large, so we provide fewer than DRIVES * DdaRingLength of them. The planner checks that enough DMs are available before filling in a new DDA.
+// Only the drives that move get a DM, and the Move task returns it to the pool as soon as the drive has taken all its steps, so most DDAs hold fewer than DRIVES of them.
+// The ring length is chosen at startup depending on how much RAM is free, within the limits set in the board definition.
+
+// The number of DMs per DDA that we budget for when we decide how long to make the DDA ring
+constexpr unsigned int DmsBudgetedPerDda = (NumDrivers + 1)/2;
 
-const unsigned int DdaRingLength = 20;
-const unsigned int NumDms = DdaRingLength * NumDrivers;
+// Movement messages received over CAN are copied into a queue of this length, so that the CAN buffer can be released immediately.
+const unsigned int MoveQueueLength = 8;						// must be a power of 2 and no greater than 128
 
 /**
  * This is the master movement class.  It controls all movement in the machine.
@@ -29,18 +42,49 @@ class Move
 public:
 	Move();
 	void Init();																	// Start me up
-	void Spin();																	// Called in a tight loop to keep the class going
+	uint32_t Spin();																// Called by the Move task, returns the maximum number of ticks to wait before calling it again
 	void Exit();																	// Shut down
 
-	void Interrupt() __attribute__ ((hot));											// Timer callback for step generation
+	void Interrupt(uint32_t now) __attribute__ ((hot));								// Timer callback for step generation, 'now' is the step clock time when it was called
 	bool AllMovesAreFinished();														// Is the look-ahead ring empty?  Stops more moves being added as well.
 
 	void StopDrivers(uint16_t whichDrivers);
+	void StopDriversFromInput(uint16_t whichDrivers);								// Stop drivers because a local endstop or probe triggered, called from an ISR
+#if SUPPORT_PROBE_SLOWDOWN
+	void SlowDownFromInput(uint32_t inverseSpeedFactor);							// Slow down the current move because an analog probe is near its threshold, called from an ISR
+#endif
+	bool QueueMove(const CanMessageMovement& msg, uint32_t whenReceived);			// Add a move to the queue, called by the CAN receiver task. Returns false if the queue is full.
+#if SUPPORT_SPEED_OVERRIDE
+	// The main board changes the speed of the moves it has already sent us by sending a speed override with the master time of a move boundary
+	// at least this far in the future. We don't prepare moves further ahead than MaxPrepareAheadClocks, so all the moves that start after that time
+	// are still in our queues and we can change their timing.
+# if SUPPORT_MOVE_MERGING
+	static constexpr uint32_t SpeedOverrideLeadClocks = (350 * StepTimer::StepClockRate)/1000;
+# else
+	static constexpr uint32_t SpeedOverrideLeadClocks = (250 * StepTimer::StepClockRate)/1000;
+# endif
+	void ApplySpeedOverride(uint32_t whenToApply, float speedFactor);				// Called by the CAN receiver task to change the speed of the queued moves
+	static bool ApplySpeedOverride(CanMessageMovement& msg, uint32_t whenToApply, float speedFactor);	// Change the timing of a move, returning false if it started too early
+#endif
+#if SUPPORT_CONTROLLED_STOP
+	void RequestControlledStop();													// Called by the CAN receiver task when the main board asks for a controlled stop
+	void SendControlledStopReport(CanMessageBuffer *buf);							// Called by the CAN async sender task to report a completed controlled stop
+#endif
 
 	void Diagnostics(MessageType mtype);											// Report useful stuff
+	void Diagnostics(const StringRef& reply);										// Append movement diagnostics to a CAN reply
+	void LocalStopDiagnostics(const StringRef& reply);								// Append the local stop and slowdown statistics to a CAN reply and reset them
+	void StatisticsDiagnostics(const StringRef& reply);								// Append the motion statistics to a CAN reply and reset them
+	void GetDiagnostics(CanMessageDiagnosticsReply& msg) const;						// Fill in the movement fields of a binary diagnostics report
 
 	// Kinematics and related functions
 	Kinematics& GetKinematics() const { return *kinematics; }
+#if SUPPORT_INPUT_SHAPING
+	InputShaper& GetShaper() { return shaper; }
+#endif
+#if SUPPORT_EXTRUDER_MIXING
+	ExtruderMixer& GetMixer() { return mixer; }
+#endif
 	bool SetKinematics(KinematicsType k);											// Set kinematics, return true if successful
 																					// Convert Cartesian coordinates to delta motor coordinates, return true if successful
 	// Temporary kinematics functions
@@ -49,13 +93,13 @@ public:
 
 	bool IsRawMotorMove(uint8_t moveType) const;									// Return true if this is a raw motor move
 
-	static void TimerCallback(CallbackParameter cb)
-	{
-		static_cast<Move*>(cb.vp)->Interrupt();
-	}
+	static void TimerCallback(CallbackParameter cb) __attribute__ ((hot));
 
 	void CurrentMoveCompleted() __attribute__ ((hot));								// Signal that the current move has just been completed
 
+	static void WakeMoveTask();														// Tell the Move task that a move has arrived
+	static void WakeMoveTaskFromISR();												// Tell the Move task that a move has completed or a step queue is running low
+
 	void PrintCurrentDda() const;													// For debugging
 
 	bool NoLiveMovement() const;													// Is a move running, or are there any queued?
@@ -64,6 +108,7 @@ public:
 	uint32_t GetCompletedMoves() const { return completedMoves; }					// How many moves have been completed?
 	void ResetMoveCounters() { scheduledMoves = completedMoves = 0; }
 	uint32_t GetAndClearHiccups();
+	uint32_t GetAndClearHiccupClocks();												// Get the total time by which hiccups have delayed moves, in step clocks
 
 	const DDA *GetCurrentDDA() const { return currentDda; }							// Return the DDA of the currently-executing move
 
@@ -71,10 +116,72 @@ public:
 	uint32_t GetStepInterval(size_t axis, uint32_t microstepShift) const;			// Get the current step interval for this axis or extruder
 #endif
 
+#if SUPPORT_DYNAMIC_MICROSTEPPING
+	void SetMaxStepRate(size_t drive, uint32_t stepsPerSecond);						// Set the step rate above which we reduce the microstepping, 0 to disable
+	uint32_t GetMaxStepRate(size_t drive) const { return maxStepRate[drive]; }
+	unsigned int GetMicrostepReduction(size_t drive) const { return microstepReduction[drive]; }
+	unsigned int GetConfiguredMicrostepping(size_t drive) const { return configuredMicrostepping[drive]; }
+	void MicrosteppingChanged(size_t drive);										// Called when the main board sets the microstepping
+	int32_t AdjustDriveSteps(size_t drive, int32_t steps, const CanMessageMovement& msg) __attribute__ ((hot));	// Convert the steps in a new move to driver steps
+#endif
+
+#if SUPPORT_BABYSTEPPING
+	void AddBabySteps(size_t drive, int32_t steps) { babyStepsRequested[drive] = babyStepsRequested[drive] + steps; }	// Called by the CAN command processor task
+	int32_t TakeBabySteps(size_t drive, const CanMessageMovement& msg);				// Get the babystepping steps to add to a new move, called by DDA::Init
+#endif
+
+#if SUPPORT_STEP_ERROR_CORRECTION
+	void RecordLostSteps(size_t drive, int32_t steps) { stepsLost[drive] = stepsLost[drive] + steps; }	// Called from the step ISR
+	int32_t TakeStepErrorCorrection(size_t drive, const CanMessageMovement& msg);	// Get the lost steps to add to a new move, called by DDA::Init
+#endif
+
+	float GetUpcomingStepRate(size_t drive) const { return upcomingStepRates[drive]; }	// Get the average steps per second of a drive over the moves that are queued or executing
+
+#if SUPPORT_ENCODERS
+	int32_t GetMotorPosition(size_t drive) const { return motorPositions[drive]; }	// Get the net position of a motor in 1/256 full steps after the moves that we have recycled
+#endif
+#if SUPPORT_PHASE_STEPPING
+	int32_t GetLiveMotorPosition(size_t drive, uint32_t when, uint32_t microsteps) const;	// Get the position of a motor at the specified time in 1/256 full steps
+#endif
+#if SUPPORT_POSITION_REPORTS
+	uint32_t GetLivePositions(int32_t positions[NumDrivers], float stepsPerSecond[NumDrivers]) const;	// Get the net position and speed of each drive now, returning the step clock time
+#endif
+#if SUPPORT_FILAMENT_MONITORS
+	int32_t GetExtruderPosition(size_t drive) const { return extruderPositions[drive]; }	// Get the net steps of a drive at the main board's microstepping after the moves that we have recycled
+#endif
+
 private:
 	bool DDARingAdd();									// Add a processed look-ahead entry to the DDA ring
 	DDA* DDARingGet();									// Get the next DDA ring entry to be run
 	bool DDARingEmpty() const;							// Anything there?
+	void RecordMovePrepared(uint32_t whenScheduled, uint32_t whenReceived, bool haveReceiveTime);
+	void RecordMoveStart(uint32_t whenScheduled, uint32_t whenStarted, bool onSchedule) __attribute__ ((hot));
+	void ClearLookaheadStats();
+#if SUPPORT_DYNAMIC_MICROSTEPPING
+	bool IsDriveIdle(size_t drive) const;
+#endif
+#if SUPPORT_ENCODERS
+	void UpdateMotorPositions(const DDA& dda);
+#endif
+#if SUPPORT_FILAMENT_MONITORS
+	void UpdateExtruderPositions(const DDA& dda);
+#endif
+#if SUPPORT_POSITION_REPORTS
+	void UpdateDrivePositions(const DDA& dda);
+#endif
+	void UpdateUpcomingStepRates();
+#if SUPPORT_CONTROLLED_STOP
+	void DoControlledStop();
+#endif
+#if SUPPORT_MOVE_MERGING
+	static bool TryMergeMoves(CanMessageMovement& move, const CanMessageMovement& next);
+#endif
+#if SUPPORT_MOVE_MERGING || SUPPORT_JUNCTION_REPLANNING
+	static bool HaveSameStepRatios(const CanMessageMovement& move, const CanMessageMovement& next, size_t& refDrive);
+#endif
+#if SUPPORT_JUNCTION_REPLANNING
+	static bool TryRaiseJunctionSpeed(CanMessageMovement& move, CanMessageMovement& next);
+#endif
 
 	// Variables that are in the DDARing class in RepRapFirmware (we have only one DDARing so they are here)
 	DDA* volatile currentDda;
@@ -82,17 +189,137 @@ private:
 	DDA* volatile ddaRingGetPointer;
 	DDA* ddaRingCheckPointer;
 
+	// Single-producer single-consumer queue of movement messages. The CAN receiver task adds to it and the Move task removes from it, so no locking is needed.
+	CanMessageMovement moveQueue[MoveQueueLength];
+	volatile uint8_t moveQueuePutIndex;					// updated only by the CAN receiver task
+	volatile uint8_t moveQueueGetIndex;					// updated only by the Move task
+	uint32_t moveQueueReceiveTimes[MoveQueueLength];	// the step clock when each queued move was received
+
 	StepTimer timer;
 	// End DDARing variables
 
+	unsigned int ddaRingLength;							// The number of DDAs in the ring
+	unsigned int numDms;								// The number of DMs we allocated
 	unsigned int idleCount;								// The number of times Spin was called and had no new moves to process
 
+	static constexpr uint32_t MoveTaskMaxSleepTicks = 100;		// the longest the Move task sleeps if nothing wakes it
+#if SUPPORT_SPEED_OVERRIDE
+	static constexpr uint32_t MaxPrepareAheadClocks = (200 * StepTimer::StepClockRate)/1000;	// we keep later moves as messages so that speed overrides can change them
+#endif
+	static constexpr unsigned int IdleCountBeforeStart = 2;		// how many passes without a new move before we start the first one, each waiting one tick
+#if SUPPORT_STRICT_MOVE_START
+	static constexpr uint32_t StrictStartLeadClocks = (2 * StepTimer::StepClockRate)/1000;	// we start a move this long before it is due even if more moves may be coming
+#endif
+
 	Kinematics *kinematics;								// What kinematics we are using
+#if SUPPORT_INPUT_SHAPING
+	InputShaper shaper;									// The input shaping to apply to new moves
+#endif
+#if SUPPORT_EXTRUDER_MIXING
+	ExtruderMixer mixer;								// The extruder mixing to apply to new moves
+#endif
 
 	unsigned int stepErrors;							// count of step errors, for diagnostics
 	uint32_t scheduledMoves;							// Move counters for the code queue
 	volatile uint32_t completedMoves;					// This one is modified by an ISR, hence volatile
 	uint32_t numHiccups;								// How many times we delayed an interrupt to avoid using too much CPU time in interrupts
+	uint32_t hiccupClocks;								// The total time by which hiccups delayed moves
+	uint32_t lastHiccupTime;							// When we last inserted a hiccup
+	uint32_t currentHiccupTime;							// How long the last hiccup was
+
+	// Lookahead telemetry, so that we can tell why we ran out of moves. The Move task records when moves are ready and the step ISR records when they start.
+	static constexpr size_t NumLeadTimeBuckets = 9;
+	static constexpr uint32_t LateStartThreshold = StepTimer::StepClockRate/10000;	// a move that starts more than 100us late counts as late
+	uint32_t leadTimeHistogram[NumLeadTimeBuckets];		// how long before its scheduled start each move was ready. Bucket n counts lead times < 2^n ms, the last one counts all longer ones.
+	uint32_t numReceivedLate;							// moves that arrived after their scheduled start time
+	uint32_t numPreparedLate;							// moves that arrived in time but were not ready until after their scheduled start time
+	uint32_t numStartedLate;							// moves that started late for any reason
+	uint32_t maxStartLateness;							// the worst start delay in step clocks
+	uint32_t numRescheduledStarts;						// moves that started too late to catch up, so they no longer run in step with the same move on other boards
+	uint32_t numRingEmpty;								// how many times we completed a move and had no other move ready
+#if SUPPORT_MOVE_MERGING
+	uint32_t numMergedMoves;							// how many moves we merged into the move before them instead of giving them their own DDA
+	static constexpr uint32_t MaxMergedMoveClocks = StepTimer::StepClockRate/10;	// the longest move we make by merging, so that moves are still recycled promptly
+#endif
+#if SUPPORT_JUNCTION_REPLANNING
+	uint32_t numRaisedJunctions;						// how many junctions between queued moves we went through faster than the main board planned
+	static constexpr float MinJunctionSpeedIncrease = 0.02;	// we don't replan a junction unless we can raise its speed by at least this fraction
+#endif
+
+	// Local endstop stops, so that we can check how far each motor got
+	uint32_t numLocalStops;								// how many times a local input stopped some drivers
+	uint16_t lastLocalStopDrivers;						// the drivers stopped by the last local stop
+	int32_t lastLocalStopSteps[NumDrivers];				// the net steps each of them had taken in the move when it was stopped
+#if SUPPORT_PROBE_SLOWDOWN
+	uint32_t numLocalSlowdowns;							// how many moves we slowed down because an analog probe was near its threshold
+#endif
+
+#if SUPPORT_DYNAMIC_MICROSTEPPING
+	// Dynamic microstepping. The main board always sends steps at the configured microstepping. When a drive would step faster than maxStepRate
+	// we reduce its microstepping by a power of 2 and divide its steps accordingly. We only change the microstepping when the drive is idle and the
+	// next move starts late enough for the new setting to reach the driver, so the change always happens at a move boundary.
+	static constexpr unsigned int MaxMicrostepReduction = 4;					// the most we divide the microstepping by is 2^4
+	static constexpr uint32_t MicrostepChangeLeadClocks = StepTimer::StepClockRate/100;	// how far ahead a move must start for us to change the microstepping
+	uint32_t maxStepRate[NumDrivers];					// the step rate at the configured microstepping above which we reduce the microstepping, 0 if disabled
+	int32_t microstepCarry[NumDrivers];					// steps at the configured microstepping that we haven't done yet because they are less than one driver step
+	uint32_t configuredMicrostepping[NumDrivers];		// the microstepping set by the main board
+	uint32_t numMicrostepChanges;						// how many times we changed the microstepping, for diagnostics
+	uint8_t microstepReduction[NumDrivers];				// log2 of how much we have divided the configured microstepping by
+	bool configuredInterpolation[NumDrivers];			// the interpolation setting from the main board
+#endif
+
+#if SUPPORT_ENCODERS
+	// The motor positions, so that the drivers can compare them with the encoder positions. We use 1/256 full steps so that changes in microstepping don't affect them.
+	volatile int32_t motorPositions[NumDrivers];
+#endif
+
+#if SUPPORT_FILAMENT_MONITORS
+	// The net steps of each drive in the microstepping that the main board uses, so that filament monitors can compare them with the measured filament movement
+	volatile int32_t extruderPositions[NumDrivers];
+#endif
+
+#if SUPPORT_BABYSTEPPING
+	// Babystepping. The main board sends us the steps to add to each drive at the configured microstepping. We add them to the moves we prepare next,
+	// so they take effect without the main board having to wait for its queue to drain. Moves that we have already prepared are not changed.
+	// The requested and applied counts each have only one writer, so no locking is needed.
+	static constexpr uint32_t MinBabyStepClocks = StepTimer::StepClockRate/20000;	// we add at most one babystep per this many step clocks of a move
+	volatile int32_t babyStepsRequested[NumDrivers];	// updated only by the CAN command processor task
+	volatile int32_t babyStepsApplied[NumDrivers];		// updated only by the Move task
+#endif
+
+#if SUPPORT_STEP_ERROR_CORRECTION
+	// Step error correction. When a drive has a step error it stops stepping for the rest of the move, so the step ISR records the steps it didn't take
+	// and we add them to the next moves of that drive that we prepare, at the rate that we add babysteps. Moves that we have already prepared are not changed.
+	// The lost and corrected counts each have only one writer, so no locking is needed.
+	static constexpr uint32_t MinStepCorrectionClocks = StepTimer::StepClockRate/20000;	// we add at most one lost step per this many step clocks of a move
+	volatile int32_t stepsLost[NumDrivers];				// updated only by the step ISR
+	volatile int32_t stepsCorrected[NumDrivers];		// updated only by the Move task
+	unsigned int numStepErrorCorrections;				// how many moves we have added lost steps to, for diagnostics
+	unsigned int numStepErrorCorrectionsDiscarded;		// how many times a homing move made us discard lost steps, for diagnostics
+#endif
+
+#if SUPPORT_SPEED_OVERRIDE
+	uint32_t numSpeedOverrides;							// how many speed overrides we have applied
+	uint32_t numLateSpeedOverrides;						// how many of them came too late to change a move that started before the override time and ended after it
+#endif
+
+#if SUPPORT_CONTROLLED_STOP
+	// Controlled stop. We discard the moves that haven't started, let the current move finish, and add a move that decelerates to a stop if it doesn't.
+	// When the drives have stopped we tell the main board how many steps of the moves it sent each drive didn't take, so that it can work out where they stopped.
+	volatile bool controlledStopRequested;				// set by the CAN receiver task
+	bool controlledStopInProgress;						// waiting for the current move and the stop move to complete
+	volatile bool controlledStopReportPending;			// set by the Move task, cleared by the CAN async sender task
+	uint32_t numControlledStops;
+	int32_t controlledStopStepsNotTaken[NumDrivers];	// at the configured microstepping
+#endif
+
+#if SUPPORT_POSITION_REPORTS
+	// The net steps of each drive at the microstepping that the main board uses after the moves that we have recycled, so that we can report the motor positions
+	int32_t drivePositions[NumDrivers];
+#endif
+
+	// The average step rate of each drive over the queued and executing moves, so that heaters can anticipate changes in the extrusion rate
+	volatile float upcomingStepRates[NumDrivers];
 
 	bool active;										// Are we live and running?
 };
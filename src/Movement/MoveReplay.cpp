@@ -0,0 +1,252 @@
+/*
+ * MoveReplay.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "MoveReplay.h"
+
+#if SUPPORT_MOVE_REPLAY
+
+#include "Move.h"
+#include "DriveMovement.h"
+#include <Platform.h>
+#include <Tasks.h>
+#include <Hardware/Flash.h>
+
+namespace MoveReplay
+{
+	enum class State : uint8_t { idle = 0, recording, replaying };
+
+	struct ReplayHeader
+	{
+		uint32_t magic;
+		uint32_t numMoves;
+		uint32_t moveSize;								// so that we don't replay moves recorded by a build with a different message format
+		uint32_t stepClockRate;							// the recorded moves are in local step clocks, so they are only valid for the same step clock rate
+		uint32_t crc;									// CRC32 of the saved moves
+	};
+
+	constexpr uint32_t ReplayMagic = 0x5245504C;		// "REPL"
+	constexpr uint32_t ReplayAreaSize = 0x10000;		// the top 64K of flash memory, which is well clear of the end of the firmware
+	constexpr uint32_t ReplayAreaStart = FLASH_ADDR + FLASH_SIZE - ReplayAreaSize;
+	constexpr uint32_t ReplayMovesStart = ReplayAreaStart + Flash::FlashPageSize;
+	constexpr size_t MaxMovesThatFit = (ReplayAreaSize - Flash::FlashPageSize)/sizeof(CanMessageMovement);
+	constexpr size_t MaxRecordedMoves = (MaxMovesThatFit < 400) ? MaxMovesThatFit : 400;	// limited by the RAM we are prepared to use while recording
+	constexpr uint32_t ReplayStartDelay = StepTimer::StepClockRate/10;	// allow time for the first few moves to be prepared before the first one starts
+
+	static volatile State state = State::idle;
+	static CanMessageMovement *recordBuffer = nullptr;	// allocated the first time we record
+	static volatile size_t numRecorded = 0;
+
+	// Replay state, only changed by the Move task while we are replaying
+	static size_t numToReplay = 0;
+	static volatile size_t replayIndex = 0;
+	static uint32_t replayStartTime, nextMoveTime, isrTicksAtStart;
+
+	// Results of the last replay
+	static bool haveResults = false;
+	static size_t resultMoves;
+	static uint32_t resultPlannedClocks, resultActualClocks, resultIsrClocks, resultHiccups, resultHiccupClocks, resultUnderruns;
+
+	static const ReplayHeader& SavedHeader() { return *reinterpret_cast<const ReplayHeader*>(ReplayAreaStart); }
+	static const CanMessageMovement *SavedMoves() { return reinterpret_cast<const CanMessageMovement*>(ReplayMovesStart); }
+
+	static bool SavedMovesValid()
+	{
+		const ReplayHeader& hdr = SavedHeader();
+		return hdr.magic == ReplayMagic && hdr.moveSize == sizeof(CanMessageMovement) && hdr.stepClockRate == StepTimer::StepClockRate
+			&& hdr.numMoves != 0 && hdr.numMoves <= MaxMovesThatFit
+			&& hdr.crc == Flash::CalculateCrc32(ReplayMovesStart, hdr.numMoves * sizeof(CanMessageMovement));
+	}
+}
+
+GCodeResult MoveReplay::StartRecording(const StringRef& reply)
+{
+	if (state == State::replaying)
+	{
+		reply.copy("Replay in progress");
+		return GCodeResult::error;
+	}
+	if (recordBuffer == nullptr)
+	{
+		// This violates our rule on no dynamic memory allocation after the initialisation phase, but recording is only used for testing
+		recordBuffer = new CanMessageMovement[MaxRecordedMoves];
+	}
+	numRecorded = 0;
+	state = State::recording;
+	reply.printf("Recording up to %u moves", MaxRecordedMoves);
+	return GCodeResult::ok;
+}
+
+GCodeResult MoveReplay::SaveRecording(const StringRef& reply)
+{
+	if (state != State::recording)
+	{
+		reply.copy("Not recording");
+		return GCodeResult::error;
+	}
+
+	// Erasing and writing the flash memory stalls the step interrupt, so we only do it when no moves are running
+	if (!moveInstance->NoLiveMovement())
+	{
+		reply.copy("Moves are still running, try again later");
+		return GCodeResult::error;
+	}
+
+	state = State::idle;
+	const size_t count = numRecorded;
+	if (count == 0)
+	{
+		reply.copy("No moves were recorded");
+		return GCodeResult::error;
+	}
+
+	if (ReplayAreaStart < Flash::GetFirmwareEnd())
+	{
+		reply.copy("Firmware overlaps the replay area");
+		return GCodeResult::error;
+	}
+
+	ReplayHeader hdr;
+	hdr.magic = ReplayMagic;
+	hdr.numMoves = count;
+	hdr.moveSize = sizeof(CanMessageMovement);
+	hdr.stepClockRate = StepTimer::StepClockRate;
+
+	// Write the header last, so that a failed save leaves no valid header
+	bool ok = Flash::Unlock(ReplayAreaStart, ReplayAreaSize)
+			&& Flash::Erase(ReplayAreaStart, ReplayAreaSize)
+			&& Flash::Write(ReplayMovesStart, count * sizeof(CanMessageMovement), reinterpret_cast<uint8_t*>(recordBuffer));
+	if (ok)
+	{
+		hdr.crc = Flash::CalculateCrc32(ReplayMovesStart, count * sizeof(CanMessageMovement));
+		ok = Flash::Write(ReplayAreaStart, sizeof(hdr), reinterpret_cast<uint8_t*>(&hdr));
+	}
+	(void)Flash::Lock(ReplayAreaStart, ReplayAreaSize);
+
+	if (!ok || !SavedMovesValid())
+	{
+		reply.copy("Failed to save the recorded moves");
+		return GCodeResult::error;
+	}
+	reply.printf("Saved %u moves%s", count, (count == MaxRecordedMoves) ? " (recording buffer full)" : "");
+	return GCodeResult::ok;
+}
+
+GCodeResult MoveReplay::StartReplay(const StringRef& reply)
+{
+	if (state != State::idle)
+	{
+		reply.copy((state == State::recording) ? "Recording in progress" : "Replay in progress");
+		return GCodeResult::error;
+	}
+	if (!moveInstance->NoLiveMovement())
+	{
+		reply.copy("Moves are running");
+		return GCodeResult::error;
+	}
+	if (!SavedMovesValid())
+	{
+		reply.copy("No valid moves saved");
+		return GCodeResult::error;
+	}
+
+	Platform::DisableAllDrives();
+	numToReplay = SavedHeader().numMoves;
+	replayIndex = 0;
+	haveResults = false;
+	state = State::replaying;
+	Move::WakeMoveTask();
+	reply.printf("Replaying %u moves with drivers disabled", numToReplay);
+	return GCodeResult::ok;
+}
+
+GCodeResult MoveReplay::GetResults(const StringRef& reply)
+{
+	if (state == State::replaying)
+	{
+		reply.printf("Replay in progress, %u of %u moves queued", replayIndex, numToReplay);
+		return GCodeResult::ok;
+	}
+	if (!haveResults)
+	{
+		reply.copy("No replay results");
+		return GCodeResult::error;
+	}
+
+	const float actualMillis = (float)resultActualClocks * (1000.0/(float)StepTimer::StepClockRate);
+	reply.printf("Replayed %u moves in %.1fms (planned %.1fms), step ISR load %.1f%%, hiccups %" PRIu32 " (%.2fms), step queue underruns %" PRIu32,
+					resultMoves, (double)actualMillis, (double)((float)resultPlannedClocks * (1000.0/(float)StepTimer::StepClockRate)),
+					(double)((resultActualClocks == 0) ? 0.0 : (float)resultIsrClocks * 100.0/(float)resultActualClocks),
+					resultHiccups, (double)((float)resultHiccupClocks * (1000.0/(float)StepTimer::StepClockRate)), resultUnderruns);
+	return GCodeResult::ok;
+}
+
+bool MoveReplay::IsReplaying()
+{
+	return state == State::replaying;
+}
+
+void MoveReplay::RecordMove(const CanMessageMovement& msg)
+{
+	if (state == State::recording && numRecorded < MaxRecordedMoves)
+	{
+		recordBuffer[numRecorded] = msg;
+		numRecorded = numRecorded + 1;
+	}
+}
+
+// Get the next saved move with its start time changed so that it follows straight on from the previous one
+bool MoveReplay::GetNextMove(CanMessageMovement& msg)
+{
+	if (state != State::replaying || replayIndex >= numToReplay)
+	{
+		return false;
+	}
+
+	if (replayIndex == 0)
+	{
+		replayStartTime = StepTimer::GetTimerTicks() + ReplayStartDelay;
+		nextMoveTime = replayStartTime;
+		(void)moveInstance->GetAndClearHiccups();
+		(void)moveInstance->GetAndClearHiccupClocks();
+#if USE_STEP_QUEUES
+		(void)DriveMovement::GetAndClearStepQueueUnderruns();
+#endif
+		isrTicksAtStart = Tasks::isrTicks[(size_t)IsrId::stepTimer];
+	}
+
+	msg = SavedMoves()[replayIndex];
+	replayIndex = replayIndex + 1;
+	msg.whenToExecute = nextMoveTime;
+	msg.stopAllDrivesOnEndstopHit = false;				// we don't want recorded homing moves to wait for endstops
+	nextMoveTime += msg.accelerationClocks + msg.steadyClocks + msg.decelClocks;
+	return true;
+}
+
+void MoveReplay::MovesFinished()
+{
+	if (state == State::replaying && replayIndex >= numToReplay)
+	{
+		const uint32_t now = StepTimer::GetTimerTicks();
+		resultMoves = numToReplay;
+		resultPlannedClocks = nextMoveTime - replayStartTime;
+		resultActualClocks = now - replayStartTime;
+		resultIsrClocks = Tasks::isrTicks[(size_t)IsrId::stepTimer] - isrTicksAtStart;
+		resultHiccups = moveInstance->GetAndClearHiccups();
+		resultHiccupClocks = moveInstance->GetAndClearHiccupClocks();
+#if USE_STEP_QUEUES
+		resultUnderruns = DriveMovement::GetAndClearStepQueueUnderruns();
+#else
+		resultUnderruns = 0;
+#endif
+		haveResults = true;
+		state = State::idle;
+	}
+}
+
+#endif
+
+// End
@@ -0,0 +1,41 @@
+/*
+ * MoveReplay.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Recording and replay of the movement messages we receive, so that the performance of a firmware build can be measured on real hardware
+ *  using a known sequence of moves, without needing the main board to send them. These are driven by diagnostic tests:
+ *   M122 B# P1010	start recording the movement messages that the Move task takes, until the buffer is full or P1011 is sent
+ *   M122 B# P1011	stop recording and save the recorded moves in the reserved area at the top of flash memory
+ *   M122 B# P1012	disable the drivers and replay the saved moves back to back as fast as they can be executed
+ *   M122 B# P1013	report the results of the last replay: step ISR load, hiccups and step queue underruns
+ */
+
+#ifndef SRC_MOVEMENT_MOVEREPLAY_H_
+#define SRC_MOVEMENT_MOVEREPLAY_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_MOVE_REPLAY
+
+#include <GCodes/GCodeResult.h>
+#include <CanMessageFormats.h>
+
+namespace MoveReplay
+{
+	GCodeResult StartRecording(const StringRef& reply);
+	GCodeResult SaveRecording(const StringRef& reply);
+	GCodeResult StartReplay(const StringRef& reply);
+	GCodeResult GetResults(const StringRef& reply);
+
+	// These are called by the Move task
+	bool IsReplaying();
+	void RecordMove(const CanMessageMovement& msg);		// record a move that the Move task has just accepted, if we are recording
+	bool GetNextMove(CanMessageMovement& msg);			// get the next move to replay, returning false if there are no more
+	void MovesFinished();								// called when there are no moves running or queued while we are replaying
+}
+
+#endif
+
+#endif /* SRC_MOVEMENT_MOVEREPLAY_H_ */
@@ -0,0 +1,193 @@
+/*
+ * StepBurstGenerator.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "StepBurstGenerator.h"
+
+#if SUPPORT_STEP_BURSTS
+
+#include "StepTimer.h"
+#include "Platform.h"
+#include <Hardware/DmacManager.h>
+#include <Hardware/Peripherals.h>
+#include <hri_evsys_c21.h>
+#include <hri_mclk_c21.h>
+#include <hri_tc_c21.h>
+
+namespace StepBurstGenerator
+{
+	static uint16_t intervals[MaxBurstSteps];				// the intervals between consecutive pulses, in the form needed by the TC period register
+	static uint32_t burstStartTime;							// when we started the current or last burst
+	static uint32_t firstPulseDelay;						// how long after burstStartTime the first pulse was due
+	static uint32_t burstEndTime;							// when the last pulse of the current or last burst ends
+	static size_t burstPulses;								// the number of pulses in the current or last burst
+	static bool active = false;								// true if we started a burst and we haven't yet seen the TC stopped after the end of it
+	static uint32_t numBursts = 0;
+
+	// Second DMA descriptor, linked from the main one, which writes the one-shot command to the TC on the last underflow before the end of the burst
+	COMPILER_ALIGNED(16) static DmacDescriptor oneShotDescriptor;
+	static const uint8_t oneShotCommand = TC_CTRLBSET_ONESHOT;
+}
+
+void StepBurstGenerator::Init()
+{
+	// Set up the TC to count down at the same rate as the step clock, with the period taken from CC0
+	EnableTcClock(StepBurstTcNumber, GclkTiming);
+
+	if (!hri_tc_is_syncing(StepBurstTc, TC_SYNCBUSY_SWRST))
+	{
+		if (hri_tc_get_CTRLA_reg(StepBurstTc, TC_CTRLA_ENABLE))
+		{
+			hri_tc_clear_CTRLA_ENABLE_bit(StepBurstTc);
+			hri_tc_wait_for_sync(StepBurstTc, TC_SYNCBUSY_ENABLE);
+		}
+		hri_tc_write_CTRLA_reg(StepBurstTc, TC_CTRLA_SWRST);
+	}
+	hri_tc_wait_for_sync(StepBurstTc, TC_SYNCBUSY_SWRST);
+
+	hri_tc_write_CTRLA_reg(StepBurstTc, TC_CTRLA_MODE_COUNT16 | StepTimer::TcPrescaler);
+	hri_tc_write_DBGCTRL_reg(StepBurstTc, 0);
+	hri_tc_write_EVCTRL_reg(StepBurstTc, TC_EVCTRL_OVFEO | TC_EVCTRL_MCEO1);
+	hri_tc_write_WAVE_reg(StepBurstTc, TC_WAVE_WAVEGEN_MFRQ);
+	hri_tccount16_write_CC_reg(StepBurstTc, 0, MaxInterval);
+	hri_tccount16_write_CC_reg(StepBurstTc, 1, PulseClocks - 1);
+	hri_tc_set_CTRLB_DIR_bit(StepBurstTc);
+	hri_tc_set_CTRLA_ENABLE_bit(StepBurstTc);
+	hri_tc_wait_for_sync(StepBurstTc, TC_SYNCBUSY_ENABLE);
+	hri_tc_write_CTRLB_CMD_bf(StepBurstTc, TC_CTRLBSET_CMD_STOP_Val);
+	hri_tc_wait_for_sync(StepBurstTc, TC_SYNCBUSY_CTRLB);
+
+	// Route the TC events to the PORT event inputs for the step pin. Event input 0 sets the pin, event input 1 clears it.
+	hri_mclk_set_APBCMASK_EVSYS_bit(MCLK);
+	EVSYS->CHANNEL[StepBurstSetEventChannel].reg = EVSYS_CHANNEL_EVGEN(EVSYS_ID_GEN_TC0_MCX_1) | EVSYS_CHANNEL_PATH_ASYNCHRONOUS;
+	EVSYS->CHANNEL[StepBurstClearEventChannel].reg = EVSYS_CHANNEL_EVGEN(EVSYS_ID_GEN_TC0_OVF) | EVSYS_CHANNEL_PATH_ASYNCHRONOUS;
+	EVSYS->USER[EVSYS_ID_USER_PORT_EV_0].reg = EVSYS_USER_CHANNEL(StepBurstSetEventChannel + 1);
+	EVSYS->USER[EVSYS_ID_USER_PORT_EV_1].reg = EVSYS_USER_CHANNEL(StepBurstClearEventChannel + 1);
+
+	const uint32_t pinNumber = StepPins[0] & 31;
+#if ACTIVE_HIGH_STEP
+	StepPio->EVCTRL.reg = PORT_EVCTRL_PID0(pinNumber) | PORT_EVCTRL_EVACT0_SET | PORT_EVCTRL_PORTEI0
+						| PORT_EVCTRL_PID1(pinNumber) | PORT_EVCTRL_EVACT1_CLR | PORT_EVCTRL_PORTEI1;
+#else
+	StepPio->EVCTRL.reg = PORT_EVCTRL_PID0(pinNumber) | PORT_EVCTRL_EVACT0_CLR | PORT_EVCTRL_PORTEI0
+						| PORT_EVCTRL_PID1(pinNumber) | PORT_EVCTRL_EVACT1_SET | PORT_EVCTRL_PORTEI1;
+#endif
+
+	// Set up the fixed parts of the DMA transfers
+	hri_dmacdescriptor_write_BTCTRL_reg(&oneShotDescriptor, DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE | DMAC_BTCTRL_BLOCKACT_NOACT);
+	hri_dmacdescriptor_write_BTCNT_reg(&oneShotDescriptor, 1);
+	hri_dmacdescriptor_write_SRCADDR_reg(&oneShotDescriptor, reinterpret_cast<uint32_t>(&oneShotCommand));
+	hri_dmacdescriptor_write_DSTADDR_reg(&oneShotDescriptor, reinterpret_cast<uint32_t>(&(StepBurstTc->CTRLBSET.reg)));
+	hri_dmacdescriptor_write_DESCADDR_reg(&oneShotDescriptor, 0);
+	DmacManager::DisableChannel(StepBurstDmaChannel);
+}
+
+uint16_t *StepBurstGenerator::GetIntervalBuffer()
+{
+	return intervals;
+}
+
+uint32_t StepBurstGenerator::GetNumBursts()
+{
+	return numBursts;
+}
+
+// Start a burst of step pulses. The first pulse is due at firstPulseTime (in step clocks).
+// On entry, intervals[0..numPulses-2] hold the intervals between consecutive pulses, which must all be between MinInterval and MaxInterval.
+// The caller must check that a burst is not already active.
+void StepBurstGenerator::Start(uint32_t firstPulseTime, size_t numPulses)
+pre(numPulses >= MinBurstSteps; numPulses <= MaxBurstSteps; !IsBusy())
+{
+	// Convert the intervals to TC period register values
+	uint32_t totalClocks = 0;
+	for (size_t i = 0; i < numPulses - 1; ++i)
+	{
+		totalClocks += intervals[i];
+		intervals[i] -= 1;
+	}
+
+	// Set up the DMA to load the period of pulse N+2 on underflow N, then set one-shot mode on underflow numPulses - 1
+	DmacManager::DisableChannel(StepBurstDmaChannel);
+	DmacManager::SetBtctrl(StepBurstDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_HWORD | DMAC_BTCTRL_STEPSIZE_X1 | DMAC_BTCTRL_STEPSEL_SRC | DMAC_BTCTRL_SRCINC | DMAC_BTCTRL_BLOCKACT_NOACT);
+	DmacManager::SetSourceAddress(StepBurstDmaChannel, &intervals[1]);
+	DmacManager::SetDestinationAddress(StepBurstDmaChannel, &(StepBurstTc->CCBUF[0].reg));
+	DmacManager::SetDataLength(StepBurstDmaChannel, numPulses - 2);
+	DmacManager::SetNextDescriptor(StepBurstDmaChannel, &oneShotDescriptor);
+	DmacManager::SetTriggerSource(StepBurstDmaChannel, DmaTrigSource::tc0_ovf);
+
+	// We need to disable all interrupts, because once we read the current step clock we have only a few microseconds to start the TC
+	AtomicCriticalSectionLocker lock;
+
+	const uint32_t now = StepTimer::GetTimerTicks();
+	const int32_t delay = (int32_t)(firstPulseTime - now);
+	firstPulseDelay = (delay > 0) ? (uint32_t)delay : 0;
+	StepBurstTc->CTRLBCLR.reg = TC_CTRLBCLR_ONESHOT;
+	StepBurstTc->CC[0].reg = firstPulseDelay + PulseClocks - 1;		// the first period ends when the first pulse ends
+	StepBurstTc->CCBUF[0].reg = intervals[0];						// this is copied to CC0 on the first underflow
+	while (StepBurstTc->SYNCBUSY.reg & (TC_SYNCBUSY_CTRLB | TC_SYNCBUSY_CC0)) { }
+	DmacManager::EnableChannel(StepBurstDmaChannel, StepBurstDmaPriority);
+	StepBurstTc->CTRLBSET.reg = TC_CTRLBSET_CMD_RETRIGGER;
+
+	burstStartTime = now;
+	burstEndTime = now + firstPulseDelay + PulseClocks + totalClocks;
+	burstPulses = numPulses;
+	active = true;
+	++numBursts;
+}
+
+// Return true if a burst is in progress
+bool StepBurstGenerator::IsBusy()
+{
+	if (active)
+	{
+		// The STOP bit may not be cleared immediately after we retrigger the TC, so we check the time as well
+		if ((int32_t)(StepTimer::GetTimerTicks() - burstEndTime) < 0 || (StepBurstTc->STATUS.reg & TC_STATUS_STOP) == 0)
+		{
+			return true;
+		}
+		active = false;
+	}
+	return false;
+}
+
+// Return when the last pulse of the current or last burst ends. The step ISR doesn't generate a step in software until this time.
+uint32_t StepBurstGenerator::GetEndTime()
+{
+	return burstEndTime;
+}
+
+// Stop any burst in progress and return the number of pulses that were not generated
+uint32_t StepBurstGenerator::Abort()
+{
+	if (!IsBusy())
+	{
+		return 0;
+	}
+
+	AtomicCriticalSectionLocker lock;
+	StepBurstTc->CTRLBSET.reg = TC_CTRLBSET_CMD_STOP;
+	DmacManager::DisableChannel(StepBurstDmaChannel);
+	Platform::StepDriverLow();										// in case we stopped it in the middle of a pulse
+	active = false;
+
+	// Count how many pulses were started before we stopped the TC
+	const uint32_t stopTime = StepTimer::GetTimerTicks();
+	uint32_t pulseTime = burstStartTime + firstPulseDelay;
+	size_t pulsesDone = 0;
+	while (pulsesDone < burstPulses && (int32_t)(stopTime - pulseTime) >= 0)
+	{
+		if (pulsesDone + 1 < burstPulses)
+		{
+			pulseTime += (uint32_t)intervals[pulsesDone] + 1;		// the intervals have already been converted to period register values
+		}
+		++pulsesDone;
+	}
+	return burstPulses - pulsesDone;
+}
+
+#endif
+
+// End
@@ -0,0 +1,45 @@
+/*
+ * StepBurstGenerator.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  Hardware generation of bursts of step pulses on single-driver boards.
+ *  The step pin on these boards is not connected to a TC or TCC output, so we use a TC counting down in MFRQ mode and route its
+ *  compare 1 event (which happens a fixed number of clocks before underflow) and its overflow/underflow event through the event system
+ *  to the PORT event inputs, to set and clear the step pin respectively. DMA triggered by the underflow loads the period for each
+ *  subsequent step from a buffer of intervals. The last DMA beat is a linked descriptor that sets one-shot mode, so that the TC stops
+ *  after generating the last pulse of the burst. Once a burst has been started, no CPU involvement is needed until it ends.
+ */
+
+#ifndef SRC_MOVEMENT_STEPBURSTGENERATOR_H_
+#define SRC_MOVEMENT_STEPBURSTGENERATOR_H_
+
+#include "RepRapFirmware.h"
+
+#if SUPPORT_STEP_BURSTS
+
+#if !SINGLE_DRIVER || SUPPORT_SLOW_DRIVERS
+# error Step bursts are only supported on single-driver boards without external drivers
+#endif
+
+namespace StepBurstGenerator
+{
+	constexpr size_t MaxBurstSteps = 64;						// the maximum number of steps in a burst
+	constexpr size_t MinBurstSteps = 8;							// it isn't worth starting a burst with fewer steps than this
+	constexpr uint32_t PulseClocks = 2;							// how long before the end of each period we set the step pin (one step clock is 1.33us at the default step clock rate)
+	constexpr uint32_t MinInterval = PulseClocks + 2;			// the minimum step interval we can generate
+	constexpr uint32_t MaxInterval = 65535;						// the maximum step interval we can generate using a 16-bit TC
+
+	void Init();
+	uint16_t *GetIntervalBuffer();														// get the buffer for the caller to store the intervals between the pulses
+	void Start(uint32_t firstPulseTime, size_t numPulses) __attribute__ ((hot));		// start a burst, base priority must be >= NvicPriorityStep
+	bool IsBusy() __attribute__ ((hot));
+	uint32_t GetEndTime();																// get when the current or last burst ends, in step clocks
+	uint32_t Abort();																	// stop any burst and return the number of pulses not generated
+	uint32_t GetNumBursts();
+}
+
+#endif
+
+#endif /* SRC_MOVEMENT_STEPBURSTGENERATOR_H_ */
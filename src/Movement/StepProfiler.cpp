@@ -0,0 +1,112 @@
+/*
+ * StepProfiler.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "StepProfiler.h"
+
+#if SUPPORT_STEP_PROFILING
+
+namespace StepProfiler
+{
+	struct Statistics
+	{
+		uint32_t numCalls;
+		uint32_t minCycles;
+		uint32_t maxCycles;
+		uint64_t totalCycles;
+		uint32_t histogram[NumHistogramBuckets];
+
+		void Clear()
+		{
+			numCalls = 0;
+			minCycles = 0xFFFFFFFF;
+			maxCycles = 0;
+			totalCycles = 0;
+			for (uint32_t& h : histogram)
+			{
+				h = 0;
+			}
+		}
+	};
+
+	static Statistics stats[(size_t)Point::numPoints];
+	static volatile bool resetRequested = true;
+
+	static const char * const PointNames[] = { "ISR", "Step", "Cart", "Delta" };
+	static_assert(ARRAY_SIZE(PointNames) == (size_t)Point::numPoints, "Wrong number of profile point names");
+}
+
+void StepProfiler::Init()
+{
+#if defined(SAME51)
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+	resetRequested = true;
+}
+
+// Record the time taken by one call. Called only from the step ISR.
+STEP_PATH_RAMFUNC void StepProfiler::Record(Point p, uint32_t cycles)
+{
+	if (resetRequested)
+	{
+		for (Statistics& s : stats)
+		{
+			s.Clear();
+		}
+		resetRequested = false;
+	}
+
+	Statistics& s = stats[(size_t)p];
+	++s.numCalls;
+	s.totalCycles += cycles;
+	if (cycles < s.minCycles)
+	{
+		s.minCycles = cycles;
+	}
+	if (cycles > s.maxCycles)
+	{
+		s.maxCycles = cycles;
+	}
+
+	size_t bucket = 0;
+	uint32_t limit = 1u << FirstBucketShift;
+	while (cycles >= limit && bucket + 1 < NumHistogramBuckets)
+	{
+		++bucket;
+		limit <<= 1;
+	}
+	++s.histogram[bucket];
+}
+
+// Append the statistics to the reply and then reset them. The reply is limited in length, so keep it compact.
+void StepProfiler::Diagnostics(const StringRef& reply)
+{
+	reply.lcatf("Step cycles calls,min/avg/max,hist <%u:", 1u << FirstBucketShift);
+	for (size_t i = 0; i < (size_t)Point::numPoints; ++i)
+	{
+		const Statistics& s = stats[i];
+		if (!resetRequested && s.numCalls != 0)
+		{
+			reply.lcatf("%s %" PRIu32 ",%" PRIu32 "/%" PRIu32 "/%" PRIu32 ",",
+						PointNames[i], s.numCalls, s.minCycles, (uint32_t)(s.totalCycles/s.numCalls), s.maxCycles);
+			for (size_t j = 0; j < NumHistogramBuckets; ++j)
+			{
+				reply.catf("%c%" PRIu32, (j == 0) ? ' ' : '/', s.histogram[j]);
+			}
+		}
+		else
+		{
+			reply.lcatf("%s 0", PointNames[i]);
+		}
+	}
+	resetRequested = true;
+}
+
+#endif
+
+// End
@@ -0,0 +1,93 @@
+/*
+ * StepProfiler.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  Instrumentation to measure the number of CPU cycles spent in the step ISR and the functions it calls.
+ *  On the SAME51 we use the DWT cycle counter. The SAMC21 doesn't have one, so we use the SysTick counter, which FreeRTOS clocks from the CPU clock.
+ *  The statistics are only ever written by the step ISR, so no locking is needed. When the diagnostics are read we ask the ISR to reset them
+ *  on its next update, so a report may occasionally include a partial update.
+ */
+
+#ifndef SRC_MOVEMENT_STEPPROFILER_H_
+#define SRC_MOVEMENT_STEPPROFILER_H_
+
+#include "RepRapFirmware.h"
+
+#if SUPPORT_STEP_PROFILING
+
+namespace StepProfiler
+{
+	enum class Point : uint8_t
+	{
+		moveInterrupt = 0,					// Move::Interrupt
+		stepDrivers,						// DDA::StepDrivers
+		calcCartesian,						// DriveMovement::CalcNextStepTimeCartesianFull
+		calcDelta,							// DriveMovement::CalcNextStepTimeDeltaFull
+		numPoints
+	};
+
+	constexpr size_t NumHistogramBuckets = 6;
+	constexpr unsigned int FirstBucketShift = 7;			// the first bucket counts calls that took fewer than 2^FirstBucketShift cycles, each subsequent one doubles
+
+	void Init();
+	void Record(Point p, uint32_t cycles) __attribute__ ((hot));
+	void Diagnostics(const StringRef& reply);				// append the statistics to the reply and reset them
+
+#if defined(SAME51)
+
+	inline uint32_t GetCycleCount()
+	{
+		return DWT->CYCCNT;
+	}
+
+	inline uint32_t GetCyclesSince(uint32_t startCount)
+	{
+		return DWT->CYCCNT - startCount;
+	}
+
+#elif defined(SAMC21)
+
+	// SysTick counts down from the reload value, so convert it to a count that increases
+	inline uint32_t GetCycleCount()
+	{
+		return SysTick->LOAD - SysTick->VAL;
+	}
+
+	// Intervals longer than one SysTick period (1ms) are not measured correctly, but the ISR should never take that long
+	inline uint32_t GetCyclesSince(uint32_t startCount)
+	{
+		const uint32_t now = GetCycleCount();
+		return (now >= startCount) ? now - startCount : now + SysTick->LOAD + 1 - startCount;
+	}
+
+#else
+# error Unsupported processor
+#endif
+
+	// Class to time a block of code. If 'enabled' is false then nothing is recorded, so that we only profile calls made from the step ISR.
+	class Timer
+	{
+	public:
+		Timer(Point p, bool enabled = true) : startCount(GetCycleCount()), point(p), active(enabled) { }
+		~Timer() { if (active) { Record(point, GetCyclesSince(startCount)); } }
+
+	private:
+		uint32_t startCount;
+		Point point;
+		bool active;
+	};
+}
+
+# define PROFILE_STEP_PATH(_point)					StepProfiler::Timer stepProfilerTimer(StepProfiler::Point::_point)
+# define PROFILE_STEP_PATH_IF(_point, _enabled)		StepProfiler::Timer stepProfilerTimer(StepProfiler::Point::_point, _enabled)
+
+#else
+
+# define PROFILE_STEP_PATH(_point)					do { } while (false)
+# define PROFILE_STEP_PATH_IF(_point, _enabled)		do { } while (false)
+
+#endif
+
+#endif /* SRC_MOVEMENT_STEPPROFILER_H_ */
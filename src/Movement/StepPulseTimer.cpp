@@ -0,0 +1,83 @@
+/*
+ * StepPulseTimer.cpp
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ */
+
+#include "StepPulseTimer.h"
+
+#if SUPPORT_STEP_PULSE_TIMER
+
+#include "StepTimer.h"
+#include "Platform.h"
+#include <Hardware/Peripherals.h>
+#include <hri_evsys_c21.h>
+#include <hri_mclk_c21.h>
+#include <hri_tc_c21.h>
+
+namespace StepPulseTimer
+{
+	static uint32_t pulseClocks = 1;							// the number of step clocks from setting the step pin to the TC clearing it
+}
+
+void StepPulseTimer::Init()
+{
+	// Set up the TC to count up at the same rate as the step clock, stopping when it reaches CC0. Resynchronise the prescaler on retrigger so that the pulse length is exact.
+	EnableTcClock(StepPulseTcNumber, GclkTiming);
+
+	if (!hri_tc_is_syncing(StepPulseTc, TC_SYNCBUSY_SWRST))
+	{
+		if (hri_tc_get_CTRLA_reg(StepPulseTc, TC_CTRLA_ENABLE))
+		{
+			hri_tc_clear_CTRLA_ENABLE_bit(StepPulseTc);
+			hri_tc_wait_for_sync(StepPulseTc, TC_SYNCBUSY_ENABLE);
+		}
+		hri_tc_write_CTRLA_reg(StepPulseTc, TC_CTRLA_SWRST);
+	}
+	hri_tc_wait_for_sync(StepPulseTc, TC_SYNCBUSY_SWRST);
+
+	hri_tc_write_CTRLA_reg(StepPulseTc, TC_CTRLA_MODE_COUNT16 | StepTimer::TcPrescaler | TC_CTRLA_PRESCSYNC_RESYNC);
+	hri_tc_write_DBGCTRL_reg(StepPulseTc, 0);
+	hri_tc_write_EVCTRL_reg(StepPulseTc, TC_EVCTRL_OVFEO);
+	hri_tc_write_WAVE_reg(StepPulseTc, TC_WAVE_WAVEGEN_MFRQ);
+	hri_tccount16_write_CC_reg(StepPulseTc, 0, pulseClocks);
+	hri_tc_set_CTRLB_ONESHOT_bit(StepPulseTc);
+	hri_tc_set_CTRLA_ENABLE_bit(StepPulseTc);
+	hri_tc_wait_for_sync(StepPulseTc, TC_SYNCBUSY_ENABLE);
+	hri_tc_write_CTRLB_CMD_bf(StepPulseTc, TC_CTRLBSET_CMD_STOP_Val);
+	hri_tc_wait_for_sync(StepPulseTc, TC_SYNCBUSY_CTRLB);
+
+	// Route the TC overflow event to PORT event input 0, which clears the step pin
+	hri_mclk_set_APBCMASK_EVSYS_bit(MCLK);
+	EVSYS->CHANNEL[StepPulseClearEventChannel].reg = EVSYS_CHANNEL_EVGEN(EVSYS_ID_GEN_TC0_OVF) | EVSYS_CHANNEL_PATH_ASYNCHRONOUS;
+	EVSYS->USER[EVSYS_ID_USER_PORT_EV_0].reg = EVSYS_USER_CHANNEL(StepPulseClearEventChannel + 1);
+
+	const uint32_t pinNumber = StepPins[0] & 31;
+#if ACTIVE_HIGH_STEP
+	StepPio->EVCTRL.reg = PORT_EVCTRL_PID0(pinNumber) | PORT_EVCTRL_EVACT0_CLR | PORT_EVCTRL_PORTEI0;
+#else
+	StepPio->EVCTRL.reg = PORT_EVCTRL_PID0(pinNumber) | PORT_EVCTRL_EVACT0_SET | PORT_EVCTRL_PORTEI0;
+#endif
+}
+
+// Set the step high time. The count from zero to CC0 takes CC0 + 1 clocks, which gives us one clock in hand for the delay in retriggering the TC.
+void StepPulseTimer::SetPulseClocks(uint32_t clocks)
+{
+	pulseClocks = constrain<uint32_t>(clocks, 1, MaxPulseClocks);
+	AtomicCriticalSectionLocker lock;							// don't let the step ISR retrigger the TC while we wait for the register to synchronise
+	StepPulseTc->CC[0].reg = pulseClocks;
+	while (StepPulseTc->SYNCBUSY.reg & TC_SYNCBUSY_CC0) { }
+}
+
+// Start a step pulse. The TC clears the step pin when the pulse time has elapsed.
+uint32_t StepPulseTimer::Pulse()
+{
+	Platform::StepDriverHigh();
+	StepPulseTc->CTRLBSET.reg = TC_CTRLBSET_CMD_RETRIGGER;
+	return StepTimer::GetTimerTicks() + pulseClocks + 1;
+}
+
+#endif
+
+// End
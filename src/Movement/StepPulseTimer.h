@@ -0,0 +1,36 @@
+/*
+ * StepPulseTimer.h
+ *
+ *  Created on: 15 Oct 2020
+ *      Author: David
+ *
+ *  Hardware timing of the end of each step pulse for slow external drivers on single-driver boards, so that the step ISR doesn't have to
+ *  busy-wait for the configured step high time. The step ISR sets the step pin and retriggers a TC in one-shot mode. The TC overflow event
+ *  is routed through the event system to the PORT event input for the step pin, which clears the pin at the end of the high time.
+ *  The step low time and direction setup and hold times are still enforced in software, but measured from when the pulse ends,
+ *  so the ISR only waits if a step or direction change is due before the driver can accept it.
+ */
+
+#ifndef SRC_MOVEMENT_STEPPULSETIMER_H_
+#define SRC_MOVEMENT_STEPPULSETIMER_H_
+
+#include "RepRapFirmware.h"
+
+#if SUPPORT_STEP_PULSE_TIMER
+
+#if !SINGLE_DRIVER || !SUPPORT_SLOW_DRIVERS || SUPPORT_STEP_BURSTS
+# error The step pulse timer is only supported on single-driver boards with slow driver support and without step bursts
+#endif
+
+namespace StepPulseTimer
+{
+	constexpr uint32_t MaxPulseClocks = 65535;					// the longest pulse we can time using a 16-bit TC
+
+	void Init();
+	void SetPulseClocks(uint32_t clocks);						// set the step high time in step clocks
+	uint32_t Pulse() __attribute__ ((hot));						// start a step pulse and return the step clock time at which it ends, base priority must be >= NvicPriorityStep
+}
+
+#endif
+
+#endif /* SRC_MOVEMENT_STEPPULSETIMER_H_ */
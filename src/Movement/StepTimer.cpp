@@ -8,24 +8,35 @@
 #include "StepTimer.h"
 #include <RTOSIface/RTOSIface.h>
 #include "Move.h"
+#include <Tasks.h>
 
-StepTimer * volatile StepTimer::pendingList = nullptr;
+StepTimer *StepTimer::wheel[WheelSize] = { nullptr };
+uint32_t StepTimer::wheelBucketsUsed = 0;
+StepTimer::Ticks StepTimer::wheelTime = 0;
+StepTimer::Ticks StepTimer::armedInterruptTime = 0;
+bool StepTimer::interruptArmed = false;
+bool StepTimer::inInterrupt = false;
+StepTimer::Ticks StepTimer::callbackStartTime = 0;
+uint32_t StepTimer::numCallbacks = 0;
+uint32_t StepTimer::numLateCallbacks = 0;
+uint32_t StepTimer::maxCallbackLateness = 0;
 uint32_t StepTimer::localTimeOffset = 0;
+uint32_t StepTimer::whenLastSyncReceived = 0;
+uint32_t StepTimer::lastSyncMasterTime = 0;
+float StepTimer::clockDrift = 0.0;
+float StepTimer::syncJitter = 0.0;
+uint32_t StepTimer::maxSyncError = 0;
+uint32_t StepTimer::numSyncResets = 0;
 uint32_t StepTimer::whenLastSynced;
 bool StepTimer::synced = false;
 
+static_assert(TimingClockFrequency == 48000000, "StepTimer::TcPrescaler assumes that the step TC is clocked at 48MHz");
+
 void StepTimer::Init()
 {
 	// We use StepTcNumber+1 as the slave for 32-bit mode so we need to clock that one too
-#if defined(SAME51)
-	EnableTcClock(StepTcNumber, GCLK_PCHCTRL_GEN_GCLK2_Val);
-	EnableTcClock(StepTcNumber + 1, GCLK_PCHCTRL_GEN_GCLK2_Val);
-#elif defined(SAMC21)
-	EnableTcClock(StepTcNumber, GCLK_PCHCTRL_GEN_GCLK0_Val);
-	EnableTcClock(StepTcNumber + 1, GCLK_PCHCTRL_GEN_GCLK0_Val);
-#else
-# error Unsupported processor
-#endif
+	EnableTcClock(StepTcNumber, GclkTiming);
+	EnableTcClock(StepTcNumber + 1, GclkTiming);
 
 	if (!hri_tc_is_syncing(StepTc, TC_SYNCBUSY_SWRST))
 	{
@@ -38,7 +49,7 @@ void StepTimer::Init()
 	}
 	hri_tc_wait_for_sync(StepTc, TC_SYNCBUSY_SWRST);
 
-	hri_tc_write_CTRLA_reg(StepTc, TC_CTRLA_MODE_COUNT32 | TC_CTRLA_PRESCALER_DIV64);
+	hri_tc_write_CTRLA_reg(StepTc, TC_CTRLA_MODE_COUNT32 | TcPrescaler);
 	hri_tc_write_DBGCTRL_reg(StepTc, 0);
 	hri_tc_write_EVCTRL_reg(StepTc, 0);
 	hri_tc_write_WAVE_reg(StepTc, TC_WAVE_WAVEGEN_NFRQ);
@@ -59,9 +70,51 @@ void StepTimer::Init()
 	return synced;
 }
 
+// Get the current offset, allowing for the difference in clock frequencies since the last sync message
+/*static*/ uint32_t StepTimer::GetLocalTimeOffset()
+{
+	return localTimeOffset + (int32_t)lrintf(clockDrift * (float)(GetTimerTicks() - whenLastSyncReceived));
+}
+
+// Process a time sync message. The receive time comes from the CAN receive timestamp, so it doesn't depend on how long the message waited to be processed.
+// This behaves as a PLL: we predict the offset using the clock frequency difference that we have measured so far, then correct both the offset and the frequency difference
+// by a fraction of the error. So the offset changes smoothly instead of jumping on every sync message, and the jitter in the message timing is filtered out.
+/*static*/ void StepTimer::ProcessTimeSync(uint32_t timeSent, uint32_t whenReceived)
+{
+	const uint32_t measuredOffset = whenReceived - ConvertToLocalClocks(timeSent);
+	const uint32_t interval = whenReceived - whenLastSyncReceived;
+	const uint32_t predictedOffset = localTimeOffset + (int32_t)lrintf(clockDrift * (float)interval);
+	const int32_t error = (int32_t)(measuredOffset - predictedOffset);
+	const uint32_t errorMagnitude = (uint32_t)labs(error);
+
+	if (!IsSynced() || errorMagnitude > MaxSyncError || interval == 0)
+	{
+		// We have only just started, or we lost sync, or the master clock has jumped
+		localTimeOffset = measuredOffset;
+		clockDrift = 0.0;
+		syncJitter = 0.0;
+		++numSyncResets;
+	}
+	else
+	{
+		localTimeOffset = predictedOffset + (int32_t)lrintf(SyncOffsetGain * (float)error);
+		clockDrift = constrain<float>(clockDrift + (SyncDriftGain * (float)error)/(float)interval, -MaxClockDrift, MaxClockDrift);
+		syncJitter += SyncJitterFilterGain * ((float)errorMagnitude - syncJitter);
+		if (errorMagnitude > maxSyncError)
+		{
+			maxSyncError = errorMagnitude;
+		}
+	}
+
+	whenLastSyncReceived = whenReceived;
+	lastSyncMasterTime = timeSent;
+	synced = true;
+	whenLastSynced = millis();
+}
+
 // Schedule an interrupt at the specified clock count, or return true if that time is imminent or has passed already.
 // On entry, interrupts must be disabled or the base priority must be <= step interrupt priority.
-bool StepTimer::ScheduleTimerInterrupt(uint32_t tim)
+STEP_PATH_RAMFUNC bool StepTimer::ScheduleTimerInterrupt(uint32_t tim)
 {
 	// We need to disable all interrupts, because once we read the current step clock we have only 6us to set up the interrupt, or we will miss it
 	AtomicCriticalSectionLocker lock;
@@ -72,11 +125,19 @@ bool StepTimer::ScheduleTimerInterrupt(uint32_t tim)
 		return true;												// tell the caller to simulate an interrupt instead
 	}
 
+	ArmTimerInterrupt(tim);
+	return false;
+}
+
+// Arm the interrupt. Interrupts must be disabled, and the caller must have read the step clock since disabling them and checked that the time is at least MinInterruptInterval ahead.
+inline void StepTimer::ArmTimerInterrupt(uint32_t tim)
+{
 	StepTc->CC[0].reg = tim;
 	while (StepTc->SYNCBUSY.reg & TC_SYNCBUSY_CC0) { }
 	StepTc->INTFLAG.reg = TC_INTFLAG_MC0;							// clear any existing compare match
 	StepTc->INTENSET.reg = TC_INTFLAG_MC0;
-	return false;
+	armedInterruptTime = tim;
+	interruptArmed = true;
 }
 
 // Make sure we get no timer interrupts
@@ -85,39 +146,143 @@ void StepTimer::DisableTimerInterrupt()
 	StepTc->INTENCLR.reg = TC_INTFLAG_MC0;
 }
 
+// Find the pending callback that is due soonest, or return nullptr if there are none.
+// All pending callbacks are due no earlier than wheelTime, so we search the buckets in order starting from the one that wheelTime is in.
+// A bucket may also hold callbacks due on a later turn of the wheel, so we ignore those unless there is nothing due on this turn.
+/*static*/ STEP_PATH_RAMFUNC StepTimer *StepTimer::FindFirstPending()
+{
+	const uint32_t bucketsUsed = wheelBucketsUsed;
+	if (bucketsUsed == 0)
+	{
+		return nullptr;
+	}
+
+	const uint32_t startBucket = GetBucket(wheelTime);
+	const uint32_t wheelTimeBucketNumber = wheelTime >> WheelBucketShift;
+	uint32_t remaining = (startBucket == 0) ? bucketsUsed : (bucketsUsed >> startBucket) | (bucketsUsed << (WheelSize - startBucket));
+	while (remaining != 0)
+	{
+		const uint32_t distance = __builtin_ctz(remaining);
+		remaining &= remaining - 1;
+
+		StepTimer *best = nullptr;
+		for (StepTimer *tmr = wheel[(startBucket + distance) & (WheelSize - 1)]; tmr != nullptr; tmr = tmr->next)
+		{
+			if ((((tmr->whenDue >> WheelBucketShift) - wheelTimeBucketNumber) & WheelTurnMask) == distance
+				&& (best == nullptr || (int32_t)(tmr->whenDue - best->whenDue) < 0))
+			{
+				best = tmr;
+			}
+		}
+		if (best != nullptr)
+		{
+			return best;
+		}
+	}
+
+	// Everything pending is due on a later turn of the wheel, so just find the soonest
+	StepTimer *best = nullptr;
+	for (StepTimer *bucket : wheel)
+	{
+		for (StepTimer *tmr = bucket; tmr != nullptr; tmr = tmr->next)
+		{
+			if (best == nullptr || tmr->whenDue - wheelTime < best->whenDue - wheelTime)
+			{
+				best = tmr;
+			}
+		}
+	}
+	return best;
+}
+
+// Add this timer to the bucket for its due time
+STEP_PATH_RAMFUNC void StepTimer::InsertInWheel()
+{
+	const size_t bucket = GetBucket(whenDue);
+	StepTimer * const first = wheel[bucket];
+	next = first;
+	prev = nullptr;
+	if (first != nullptr)
+	{
+		first->prev = this;
+	}
+	wheel[bucket] = this;
+	wheelBucketsUsed |= 1u << bucket;
+}
+
+// Remove this timer from its bucket
+STEP_PATH_RAMFUNC void StepTimer::RemoveFromWheel()
+{
+	if (prev != nullptr)
+	{
+		prev->next = next;
+	}
+	else
+	{
+		const size_t bucket = GetBucket(whenDue);
+		wheel[bucket] = next;
+		if (next == nullptr)
+		{
+			wheelBucketsUsed &= ~(1u << bucket);
+		}
+	}
+	if (next != nullptr)
+	{
+		next->prev = prev;
+	}
+	active = false;
+}
+
 // The guts of the ISR
 /*static*/ inline void StepTimer::Interrupt()
 {
-	StepTimer * tmr = pendingList;
-	if (tmr != nullptr)
+	interruptArmed = false;											// the interrupt has been disabled
+	inInterrupt = true;
+	for (;;)
 	{
-		for (;;)
+		StepTimer * const tmr = FindFirstPending();
+		if (tmr == nullptr)
 		{
-			StepTimer * const nextTimer = tmr->next;
-			pendingList = nextTimer;								// remove it from the pending list
-
-			tmr->active = false;
-			tmr->callback(tmr->cbParam);							// execute its callback. This may schedule another callback and hence change the pending list.
+			break;
+		}
 
-			tmr = pendingList;
-			if (tmr == nullptr || tmr != nextTimer)
+		// Read the step clock once and use it both to decide whether the callback is due and, if it isn't, to arm the interrupt.
+		// We must disable all interrupts between reading the clock and arming the interrupt, or we might miss it.
+		int32_t howSoon;
+		{
+			AtomicCriticalSectionLocker lock;
+			callbackStartTime = GetTimerTicks();
+			howSoon = (int32_t)(tmr->whenDue - callbackStartTime);
+			if (howSoon >= (int32_t)MinInterruptInterval)
 			{
-				break;												// no more timers, or another timer has been inserted and an interrupt scheduled
+				// Nothing else is due yet
+				wheelTime = callbackStartTime;
+				ArmTimerInterrupt(tmr->whenDue);
+				break;
 			}
+		}
 
-			if (!ScheduleTimerInterrupt(tmr->whenDue))
+		tmr->RemoveFromWheel();
+		++numCallbacks;
+		if (howSoon < -(int32_t)LateCallbackThreshold)
+		{
+			++numLateCallbacks;
+			if ((uint32_t)-howSoon > maxCallbackLateness)
 			{
-				break;
+				maxCallbackLateness = (uint32_t)-howSoon;
 			}
 		}
+		tmr->callback(tmr->cbParam);								// execute its callback. This may schedule another callback.
 	}
+	inInterrupt = false;
 }
 
 // Step pulse timer interrupt
 extern "C" void STEP_TC_HANDLER() __attribute__ ((hot));
 
-void STEP_TC_HANDLER()
+STEP_PATH_RAMFUNC void STEP_TC_HANDLER()
 {
+	IsrTimer timer(IsrId::stepTimer);
 	uint8_t tcsr = StepTc->INTFLAG.reg;								// read the status register, which clears the status bits
 	tcsr &= StepTc->INTENSET.reg;									// select only enabled interrupts
 
@@ -132,7 +297,7 @@ void STEP_TC_HANDLER()
 	}
 }
 
-StepTimer::StepTimer() : next(nullptr), callback(nullptr), active(false)
+StepTimer::StepTimer() : next(nullptr), prev(nullptr), callback(nullptr), active(false)
 {
 }
 
@@ -144,57 +309,36 @@ void StepTimer::SetCallback(TimerCallbackFunction cb, CallbackParameter param)
 }
 
 // Schedule a callback at a particular tick count, returning true if it was not scheduled because it is already due or imminent.
-bool StepTimer::ScheduleCallbackFromIsr(Ticks when)
+STEP_PATH_RAMFUNC bool StepTimer::ScheduleCallbackFromIsr(Ticks when)
 {
 	if (active)
 	{
-		CancelCallbackFromIsr();
+		RemoveFromWheel();
 	}
 
-	whenDue = when;
+	const Ticks now = GetTimerTicks();
+	if ((int32_t)(when - now) < (int32_t)MinInterruptInterval)
+	{
+		return true;
+	}
 
-	StepTimer* pst = pendingList;
+	if (wheelBucketsUsed == 0)
+	{
+		wheelTime = now;											// nothing is pending, so bring the wheel up to date
+	}
+	whenDue = when;
+	InsertInWheel();
+	active = true;
 
-	// Optimise the common case of no other timer in the list
-	if (pst == nullptr)
+	// If we are executing callbacks then the ISR will arm the interrupt when it has finished, otherwise do it now if this callback is the first one due
+	if (!inInterrupt && (!interruptArmed || (int32_t)(when - armedInterruptTime) < 0))
 	{
-		// No other callbacks are scheduled
 		if (ScheduleTimerInterrupt(when))
 		{
+			RemoveFromWheel();
 			return true;
 		}
-		next = nullptr;
-		pendingList = this;
 	}
-	else
-	{
-		const Ticks now = GetTimerTicks();
-		const int32_t howSoon = (int32_t)(when - now);
-		if (howSoon < (int32_t)(pst->whenDue - now))
-		{
-			// This callback is due earlier than the first existing one
-			if (ScheduleTimerInterrupt(when))
-			{
-				return true;
-			}
-			next = pst;
-			pendingList = this;
-		}
-		else
-		{
-			StepTimer *prev;
-			do
-			{
-				prev = pst;
-				pst = pst->next;
-			}
-			while (pst != nullptr && (int32_t)(pst->whenDue - now) <= howSoon);
-			next = pst;
-			prev->next = this;
-		}
-	}
-
-	active = true;
 	return false;
 }
 
@@ -205,16 +349,12 @@ bool StepTimer::ScheduleCallback(Ticks when)
 }
 
 // Cancel any scheduled callback for this timer. Harmless if there is no callback scheduled.
+// If the interrupt was armed for this callback then it will happen anyway, but the ISR won't find anything to do.
 void StepTimer::CancelCallbackFromIsr()
 {
-	for (StepTimer** ppst = const_cast<StepTimer**>(&pendingList); *ppst != nullptr; ppst = &((*ppst)->next))
+	if (active)
 	{
-		if (*ppst == this)
-		{
-			*ppst = this->next;		// unlink this from the pending list
-			active = false;
-			break;
-		}
+		RemoveFromWheel();
 	}
 }
 
@@ -224,4 +364,32 @@ void StepTimer::CancelCallback()
 	CancelCallbackFromIsr();
 }
 
+// Append the callback and clock synchronisation statistics to the reply and reset them
+/*static*/ void StepTimer::GetDiagnostics(CanMessageDiagnosticsReply& msg)
+{
+	msg.lateCallbacks = min<uint32_t>(numLateCallbacks, 0xFFFF);
+	msg.syncResets = min<uint32_t>(numSyncResets, 0xFF);
+	if (IsSynced())
+	{
+		msg.flags |= CanMessageDiagnosticsReply::FlagClockSynced;
+	}
+}
+
+/*static*/ void StepTimer::Diagnostics(const StringRef& reply)
+{
+	uint32_t calls, late, maxLateness;
+	{
+		AtomicCriticalSectionLocker lock;
+		calls = numCallbacks;
+		late = numLateCallbacks;
+		maxLateness = maxCallbackLateness;
+		numCallbacks = numLateCallbacks = maxCallbackLateness = 0;
+	}
+	reply.lcatf("Timer callbacks %" PRIu32 ", late %" PRIu32 " (max %.1fus)", calls, late, (double)((float)maxLateness * (1000000.0f/(float)StepClockRate)));
+	reply.lcatf("Clock sync %s, drift %.2fppm, jitter %.1fus, max error %.1fus, resyncs %" PRIu32,
+				(IsSynced()) ? "ok" : "lost", (double)(clockDrift * 1.0e6f), (double)(syncJitter * (1000000.0f/(float)StepClockRate)),
+				(double)((float)maxSyncError * (1000000.0f/(float)StepClockRate)), numSyncResets);
+	maxSyncError = 0;
+}
+
 // End
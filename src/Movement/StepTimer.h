@@ -10,7 +10,18 @@
 
 #include "RepRapFirmware.h"
 
-// Class to implement a software timer with a few microseconds resolution
+// The step clock runs at 750kHz shifted left by STEP_CLOCK_SHIFT, so 0 gives 750kHz (1.33us resolution), 2 gives 3MHz and 3 gives 6MHz.
+// The main board always uses 750kHz, so times and durations in CAN messages are converted when they arrive and when we send them.
+#ifndef STEP_CLOCK_SHIFT
+# define STEP_CLOCK_SHIFT		0
+#endif
+
+struct CanMessageDiagnosticsReply;
+
+// Class to implement a software timer with a few microseconds resolution.
+// Pending callbacks are kept in a timer wheel of buckets, each covering a fixed range of tick counts, with a bitmap of the buckets that are in use.
+// So scheduling and cancelling a callback take constant time, and the time for which interrupts are disabled doesn't depend on how many timers there are.
+// Callbacks due further ahead than one turn of the wheel stay in their bucket until the wheel comes round to them again.
 class StepTimer
 {
 public:
@@ -41,44 +52,100 @@ public:
 	// Disable the timer interrupt. Called when we shut down the system.
 	static void DisableTimerInterrupt();
 
-	// Get the current tick count
+	// Get the current tick count. Each call costs a read synchronisation of the TC count register, see the benchmarks.
 	static Ticks GetTimerTicks() __attribute__ ((hot));
 
+	// Get the tick count that the ISR read just before it executed the current callback. Only valid when called from a callback.
+	static Ticks GetCallbackStartTime() { return callbackStartTime; }
+
 	// Get the tick rate (can also access it directly as StepClockRate)
 	static uint32_t GetTickRate() { return StepClockRate; }
 
 	// ISR called from StepTimer. May sometimes get called prematurely.
 	static void Interrupt();
 
-	static uint32_t GetLocalTimeOffset() { return localTimeOffset; }
-	static void SetLocalTimeOffset(uint32_t offset) { localTimeOffset = offset; synced = true; whenLastSynced = millis(); }
-	static uint32_t ConvertToLocalTime(uint32_t masterTime) { return masterTime + localTimeOffset; }
-	static uint32_t ConvertToMasterTime(uint32_t localTime) { return localTime - localTimeOffset; }
+	static uint32_t GetLocalTimeOffset();										// get the current local time minus master time in local ticks
+	static void ProcessTimeSync(uint32_t timeSent, uint32_t whenReceived);		// process a time sync message from the main board
+	static uint32_t ConvertToLocalTime(uint32_t masterTime) { return (masterTime << StepClockShift) + GetLocalTimeOffset(); }
+	static uint32_t ConvertToMasterTime(uint32_t localTime);
 	static uint32_t GetMasterTime() { return ConvertToMasterTime(GetTimerTicks()); }
+	static uint32_t ConvertToLocalClocks(uint32_t masterClocks) { return masterClocks << StepClockShift; }	// convert a duration from the main board
 
 	static bool IsSynced();
 
-	static constexpr uint32_t StepClockRate = 48000000/64;						// 48MHz divided by 64
+	static void Diagnostics(const StringRef& reply);							// append the callback and clock sync statistics to the reply and reset them
+	static void GetDiagnostics(CanMessageDiagnosticsReply& msg);				// fill in the clock fields of a binary diagnostics report
+
+	static constexpr unsigned int StepClockShift = STEP_CLOCK_SHIFT;
+	static_assert(StepClockShift == 0 || StepClockShift == 2 || StepClockShift == 3, "STEP_CLOCK_SHIFT must be 0, 2 or 3");
+	static constexpr uint32_t MasterStepClockRate = 48000000/64;				// the rate of the main board's step clock, which master times are in
+	static constexpr uint32_t StepClockRate = MasterStepClockRate << StepClockShift;
+	static constexpr uint32_t TcPrescaler = (StepClockShift == 3) ? TC_CTRLA_PRESCALER_DIV8		// the prescaler for TCs that count step clocks from the timing GCLK
+											: (StepClockShift == 2) ? TC_CTRLA_PRESCALER_DIV16
+												: TC_CTRLA_PRESCALER_DIV64;
 	static constexpr uint64_t StepClockRateSquared = (uint64_t)StepClockRate * StepClockRate;
 	static constexpr float StepClocksToMillis = 1000.0/(float)StepClockRate;
-	static constexpr uint32_t MinInterruptInterval = 6;							// about 6us
+	static constexpr uint32_t MinInterruptInterval = 6 << StepClockShift;		// about 8us
 	static constexpr uint32_t MinSyncInterval = 1000;							// maximum interval in milliseconds between sync messages for us to remain synced
 
 private:
+	static constexpr size_t WheelSize = 32;										// the number of buckets, which must be 32 because we keep a 32-bit bitmap of them
+	static constexpr unsigned int WheelBucketShift = 8 + StepClockShift;		// each bucket covers about 341us whatever the step clock rate, so the wheel turns every 10.9ms
+	static constexpr uint32_t WheelTurnMask = (1u << (32 - WheelBucketShift)) - 1;
+	static constexpr uint32_t LateCallbackThreshold = 2 * MinInterruptInterval;	// callbacks executed later than this are counted as late
+
+	// Clock synchronisation. We track both the offset and the frequency difference between our clock and the master clock.
+	static constexpr uint32_t MaxSyncError = StepClockRate/1000;				// if a sync message is out by more than 1ms then we resynchronise from scratch
+	static constexpr float SyncOffsetGain = 0.25;								// the fraction of each offset error that we correct immediately
+	static constexpr float SyncDriftGain = 0.0625;								// the fraction of each offset error that we attribute to frequency difference
+	static constexpr float MaxClockDrift = 0.001;								// the clocks are crystal controlled, so the frequency difference should be very much less than this
+	static constexpr float SyncJitterFilterGain = 0.125;
+
+	static size_t GetBucket(Ticks when) { return (when >> WheelBucketShift) & (WheelSize - 1); }
 	static bool ScheduleTimerInterrupt(uint32_t tim);							// Schedule an interrupt at the specified clock count, or return true if it has passed already
+	static void ArmTimerInterrupt(uint32_t tim);								// Arm the interrupt at a clock count that the caller has checked is far enough ahead
+	static StepTimer *FindFirstPending();										// find the pending callback that is due soonest
+	void InsertInWheel();
+	void RemoveFromWheel();
 
-	StepTimer *next;
+	StepTimer *next;															// links to the other timers in the same bucket
+	StepTimer *prev;
 	Ticks whenDue;
 	TimerCallbackFunction callback;
 	CallbackParameter cbParam;
 	volatile bool active;
 
-	static StepTimer * volatile pendingList;									// list of pending callbacks, soonest first
-	static uint32_t localTimeOffset;											// local time minus master time
+	static StepTimer *wheel[WheelSize];											// lists of pending callbacks in no particular order
+	static uint32_t wheelBucketsUsed;											// bit N is set if bucket N is not empty
+	static Ticks wheelTime;														// a tick count not later than the due time of any pending callback
+	static Ticks armedInterruptTime;											// when the hardware interrupt is due, if armed
+	static bool interruptArmed;
+	static bool inInterrupt;													// true while we are executing callbacks, so we don't need to arm the interrupt when scheduling one
+	static Ticks callbackStartTime;												// the tick count read by the ISR before the current callback, so that the callback doesn't need to read it again
+
+	static uint32_t numCallbacks;
+	static uint32_t numLateCallbacks;
+	static uint32_t maxCallbackLateness;
+
+	static uint32_t localTimeOffset;											// local time minus master time when we processed the last sync message
+	static uint32_t whenLastSyncReceived;										// the local tick count when the last sync message arrived
+	static uint32_t lastSyncMasterTime;											// the master time in the last sync message, so that we can recover the high bits when converting to master time
+	static float clockDrift;													// the rate at which the offset changes, in ticks per tick
+	static float syncJitter;													// the smoothed magnitude of the offset errors, in ticks
+	static uint32_t maxSyncError;												// the largest offset error that we corrected without resynchronising
+	static uint32_t numSyncResets;												// how many times we have resynchronised from scratch
 	static uint32_t whenLastSynced;												// the millis tick count when we last synced
 	static bool synced;
 };
 
+// Convert a local time to master time. Shifting the local time right would lose the high bits of the master time, so we work relative to the master time
+// in the last sync message. This is correct for local times within 2^31 ticks of that message, which is at least 5 minutes.
+inline uint32_t StepTimer::ConvertToMasterTime(uint32_t localTime)
+{
+	const uint32_t scaledMasterTime = localTime - GetLocalTimeOffset();			// the master time shifted left by StepClockShift, modulo 2^32
+	return lastSyncMasterTime + (uint32_t)((int32_t)(scaledMasterTime - (lastSyncMasterTime << StepClockShift)) >> StepClockShift);
+}
+
 inline StepTimer::Ticks StepTimer::GetTimerTicks()
 {
 	StepTc->CTRLBSET.reg = TC_CTRLBSET_CMD_READSYNC;
@@ -0,0 +1,84 @@
+/*
+ * StepTimingKernel.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "StepTimingKernel.h"
+#include "StepTimer.h"
+#include <Hardware/Peripherals.h>
+
+namespace
+{
+	constexpr size_t NumBenchmarkValues = 64;
+	constexpr size_t ChunkSize = 8;					// we time the calls in chunks of this many with interrupts disabled, so keep this small
+	static_assert(NumBenchmarkValues % ChunkSize == 0, "NumBenchmarkValues must be a multiple of ChunkSize");
+
+	uint64_t sqrtArgs[NumBenchmarkValues];
+	uint32_t mulArgs[NumBenchmarkValues];
+	volatile uint32_t benchmarkSink;				// to stop the compiler optimising the calculations away
+
+	// Time a function called for each of the benchmark values, returning the total step clocks. Interrupts are disabled only while we time each chunk.
+	template<class F> uint32_t TimeCalls(F func)
+	{
+		uint32_t ticks = 0;
+		for (size_t i = 0; i < NumBenchmarkValues; i += ChunkSize)
+		{
+			AtomicCriticalSectionLocker lock;
+			const uint32_t startTicks = StepTimer::GetTimerTicks();
+			for (size_t j = i; j < i + ChunkSize; ++j)
+			{
+				func(j);
+			}
+			ticks += StepTimer::GetTimerTicks() - startTicks;
+		}
+		return ticks;
+	}
+
+	// Append the time per call to the reply, in CPU cycles
+	void AppendCyclesPerCall(const StringRef& reply, const char *name, uint32_t ticks)
+	{
+		const float cycles = ((float)ticks * (float)SystemCoreClock)/((float)StepTimer::StepClockRate * (float)NumBenchmarkValues);
+		reply.catf(" %s %.1f", name, (double)cycles);
+	}
+}
+
+// Measure how long the kernel functions take compared with the generic ones, so that we can check that we have selected the best one for this board.
+// The arguments are typical of the values we get when executing moves lasting from a few milliseconds to a few tens of seconds.
+void StepTimingBenchmark(const StringRef& reply)
+{
+	uint32_t seed = 12345;
+	for (size_t i = 0; i < NumBenchmarkValues; ++i)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		const uint32_t stepTime = (seed >> 8) + 1000;			// up to 2^24 step clocks, about 22 seconds
+		sqrtArgs[i] = isquare64(stepTime) + (seed & 0xFFFF);
+		mulArgs[i] = seed >> 16;
+	}
+	const uint32_t mmPerStepTimesCKdivtopSpeed = 100 * 1024;		// about 7500 steps/sec
+
+	// The sums should be zero if the kernel functions give the same results as the generic ones
+	uint32_t sqrtSum = 0, mulSum = 0;
+	const uint32_t genericSqrtTicks = TimeCalls([&sqrtSum](size_t i) { sqrtSum += isqrt64(sqrtArgs[i]); });
+#if USE_FPU_STEP_TIMING
+	const uint32_t kernelSqrtTicks = TimeCalls([&sqrtSum](size_t i) { sqrtSum -= StepTiming::Isqrt64(sqrtArgs[i]); });
+#else
+	benchmarkSink = sqrtSum;
+	sqrtSum = 0;												// there is no kernel square root on this board to compare with
+#endif
+	const uint32_t genericMulTicks = TimeCalls([&mulSum, mmPerStepTimesCKdivtopSpeed](size_t i) { mulSum += (uint32_t)(((uint64_t)mmPerStepTimesCKdivtopSpeed * mulArgs[i])/1024); });
+	const uint32_t kernelMulTicks = TimeCalls([&mulSum, mmPerStepTimesCKdivtopSpeed](size_t i) { mulSum -= StepTiming::MulDivK1(mmPerStepTimesCKdivtopSpeed, mulArgs[i]); });
+	benchmarkSink = sqrtSum + mulSum;
+
+	reply.lcatf("Step timing kernel (%s), cycles per call:", (USE_FPU_STEP_TIMING) ? "FPU" : "integer");
+	AppendCyclesPerCall(reply, "isqrt64", genericSqrtTicks);
+#if USE_FPU_STEP_TIMING
+	AppendCyclesPerCall(reply, "kernel isqrt", kernelSqrtTicks);
+#endif
+	AppendCyclesPerCall(reply, "muldiv64", genericMulTicks);
+	AppendCyclesPerCall(reply, "kernel muldiv", kernelMulTicks);
+	reply.catf(", results %s", (sqrtSum == 0 && mulSum == 0) ? "match" : "DIFFER");
+}
+
+// End
@@ -0,0 +1,77 @@
+/*
+ * StepTimingKernel.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  The arithmetic primitives used to calculate step times, specialised at compile time for the processor on each board.
+ *  The SAMC21 (Cortex M0+) has no FPU and no 32x32->64 bit multiply instruction, so we use 32-bit integer arithmetic where we can.
+ *  We have nothing faster than isqrt64 for square roots on it, so StepTimeIsqrt64 uses isqrt64 directly.
+ *  The SAME51 (Cortex M4F) has a single precision FPU and a 32x32->64 bit multiply instruction, so we use the FPU to get a
+ *  first approximation to square roots and then correct it using integer arithmetic.
+ */
+
+#ifndef SRC_MOVEMENT_STEPTIMINGKERNEL_H_
+#define SRC_MOVEMENT_STEPTIMINGKERNEL_H_
+
+#include "RepRapFirmware.h"
+#include "Math/Isqrt.h"
+
+template<bool UseFpu> struct StepTimingKernel;
+
+// Integer-only kernel
+template<> struct StepTimingKernel<false>
+{
+	// Return (a * n)/1024, which must fit in 32 bits. When n < 2^22 the product of n and the low 10 bits of a fits in 32 bits, so we can avoid a 64-bit multiplication
+	// and the result is exact. Larger step numbers only occur in very long moves, for which we use the 64-bit multiplication.
+	static inline uint32_t MulDivK1(uint32_t a, uint32_t n) __attribute__ ((always_inline))
+	{
+		return (n < (1u << 22)) ? (a >> 10) * n + (((a & 1023u) * n) >> 10) : (uint32_t)(((uint64_t)a * n) >> 10);
+	}
+};
+
+// FPU-assisted kernel
+template<> struct StepTimingKernel<true>
+{
+	static inline uint32_t MulDivK1(uint32_t a, uint32_t n) __attribute__ ((always_inline))
+	{
+		return (uint32_t)(((uint64_t)a * n) >> 10);
+	}
+
+	// Return the integer square root of a 64-bit number. The single precision square root is accurate to within a few units
+	// provided that the result is less than 2^26, so we need only a few correction steps. We fall back to the integer algorithm for larger numbers.
+	static inline uint32_t Isqrt64(uint64_t num) __attribute__ ((always_inline))
+	{
+		if (num >= (1ull << 52))
+		{
+			return isqrt64(num);
+		}
+		const float f = (float)(uint32_t)(num >> 32) * 4294967296.0f + (float)(uint32_t)num;	// avoid the library function to convert uint64_t to float
+		uint32_t root = (uint32_t)sqrtf(f);
+		while (isquare64(root) > num)
+		{
+			--root;
+		}
+		while (isquare64(root + 1) <= num)
+		{
+			++root;
+		}
+		return root;
+	}
+};
+
+typedef StepTimingKernel<USE_FPU_STEP_TIMING> StepTiming;
+
+// Return the integer square root of a 64-bit number using the fastest method for this processor
+static inline __attribute__ ((always_inline)) uint32_t StepTimeIsqrt64(uint64_t num)
+{
+#if USE_FPU_STEP_TIMING
+	return StepTiming::Isqrt64(num);
+#else
+	return isqrt64(num);
+#endif
+}
+
+void StepTimingBenchmark(const StringRef& reply);			// measure the time taken by the kernel functions and append the results to the reply
+
+#endif /* SRC_MOVEMENT_STEPTIMINGKERNEL_H_ */
@@ -14,6 +14,7 @@ enum class DriverMode : unsigned int
 	randomOffTime,
 	spreadCycle,
 	stealthChop,			// includes stealthChop2
+	direct,					// coil currents written directly by the firmware (TMC5160 phase stepping)
 	unknown					// must be last!
 };
 
@@ -24,6 +25,20 @@ inline const char* TranslateDriverMode(DriverMode mode)
 	return TranslateDriverMode((unsigned int)mode);
 }
 
+// Bit assignments of the compact driver status that we include in periodic driver status reports to the main board.
+// These are the same for all smart drivers, so that the main board doesn't need to know which type of driver we have.
+constexpr uint32_t CompactStatusSgResultMask = 0x03FF;			// bits 0-9 are SG_RESULT
+constexpr unsigned int CompactStatusCsActualShift = 10;			// bits 10-14 are CS_ACTUAL, the current scale the driver is using
+constexpr uint32_t CompactStatusCsActualMask = 0x1Fu << CompactStatusCsActualShift;
+constexpr uint32_t CompactStatusOt = 1u << 16;					// over temperature shutdown
+constexpr uint32_t CompactStatusOtpw = 1u << 17;				// over temperature warning
+constexpr uint32_t CompactStatusS2g = 1u << 18;					// short to ground or to VS
+constexpr uint32_t CompactStatusOla = 1u << 19;					// open load phase A
+constexpr uint32_t CompactStatusOlb = 1u << 20;					// open load phase B
+constexpr uint32_t CompactStatusStst = 1u << 21;				// standstill
+constexpr uint32_t CompactStatusStall = 1u << 22;				// stall detected
+constexpr uint32_t CompactStatusSgValid = 1u << 23;				// SG_RESULT is a valid load measurement, not zero or the chopper on time at standstill
+
 // Register codes used to implement M569 command parameters.
 // This common set is used for all smart drivers. Not all are complete registers, some are just parts of registers.
 
@@ -6,6 +6,8 @@
  */
 
 #include "TMC22xx.h"
+#include <Tracer.h>
+#include <StackSizes.h>
 
 #if SUPPORT_TMC22xx
 
@@ -50,7 +52,7 @@ constexpr float MinimumOpenLoadMotorCurrent = 300;			// minimum current in mA fo
 constexpr uint32_t DefaultMicrosteppingShift = 4;			// x16 microstepping
 constexpr bool DefaultInterpolation = true;					// interpolation enabled
 constexpr uint32_t DefaultTpwmthrsReg = 2000;				// low values (high changeover speed) give horrible jerk at the changeover from stealthChop to spreadCycle
-constexpr size_t TmcTaskStackWords = 100;
+constexpr uint32_t StandstillPollInterval = 10;				// how often we read the driver status in milliseconds when no motors are moving and there is nothing to write
 
 #if HAS_STALL_DETECT
 const int DefaultStallDetectThreshold = 1;
@@ -78,6 +80,32 @@ enum class DriversState : uint8_t
 
 static DriversState driversState = DriversState::noPower;
 
+// Timing of driver initialisation, so that we can see how long the drivers are disabled after power is restored following a supply dip.
+// The drivers take their logic supply from VIN, so a dip that makes us flag no power may have reset them, and we always restore all the cached register values.
+static uint32_t whenInitialisationStarted = 0;				// the step clock when the drivers last needed to be initialised
+static uint32_t lastInitialisationTicks = 0;				// how long the last initialisation took
+static uint32_t maxInitialisationTicks = 0;					// the longest initialisation since the counts were last reported
+static uint32_t numInitialisations = 0;
+
+// Record that the drivers have been initialised and enabled
+static void InitialisationCompleted()
+{
+	lastInitialisationTicks = StepTimer::GetTimerTicks() - whenInitialisationStarted;
+	if (lastInitialisationTicks > maxInitialisationTicks)
+	{
+		maxInitialisationTicks = lastInitialisationTicks;
+	}
+	++numInitialisations;
+}
+
+static void AppendInitialisationTimes(const StringRef& reply)
+{
+	constexpr float MillisPerTick = 1000.0/(float)StepTimer::StepClockRate;
+	reply.catf("\nDriver initialisations %" PRIu32 ", last took %.2fms, max %.2fms",
+				numInitialisations, (double)((float)lastInitialisationTicks * MillisPerTick), (double)((float)maxInitialisationTicks * MillisPerTick));
+	maxInitialisationTicks = 0;
+}
+
 // GCONF register (0x00, RW)
 constexpr uint8_t REGNUM_GCONF = 0x00;
 constexpr uint32_t GCONF_USE_VREF = 1 << 0;					// use external VRef
@@ -331,6 +359,7 @@ public:
 	void AppendDriverStatus(const StringRef& reply);
 	uint8_t GetDriverNumber() const { return driverNumber; }
 	bool UpdatePending() const;
+	bool IsMoving() const { return moving; }
 
 #if TMC22xx_HAS_ENABLE_PINS
 	bool UsesGlobalEnable() const { return enablePin == NoPin; }
@@ -349,6 +378,7 @@ public:
 	void AbortTransfer();
 
 	uint32_t ReadLiveStatus() const;
+	uint32_t GetCompactStatus() const;
 	uint32_t ReadAccumulatedStatus(uint32_t bitsToKeep);
 
 	// Variables used by the ISR
@@ -483,6 +513,7 @@ private:
 	volatile uint8_t writeRegCRCs[NumWriteRegisters];		// CRCs of the messages needed to update the registers
 	static const uint8_t ReadRegCRCs[NumReadRegisters];		// CRCs of the messages needed to read the registers
 	bool enabled;											// true if driver is enabled
+	bool moving;											// true if the motor was moving when we last completed a transfer
 };
 
 // Static data members of class TmcDriverState
@@ -498,7 +529,7 @@ Uart * const TmcDriverState::uart = UART_TMC22xx;
 #endif
 
 // TMC22xx management task
-static Task<TmcTaskStackWords> tmcTask;
+static Task<StackSizes::TmcTaskWords> tmcTask;
 
 static DmaCallbackReason dmaFinishedReason;
 
@@ -767,6 +798,7 @@ pre(!driversPowered)
 	failedOp = 0xFF;
 	registerToRead = 0;
 	lastIfCount = 0;
+	moving = false;
 	readErrors = writeErrors = numReads = numWrites = numTimeouts = numDmaErrors = 0;
 #if HAS_STALL_DETECT
 	ResetLoadRegisters();
@@ -1003,6 +1035,28 @@ uint32_t TmcDriverState::ReadLiveStatus() const
 	return ret;
 }
 
+// Get the status, load and current scale in the compact format that we send to the main board in driver status reports
+uint32_t TmcDriverState::GetCompactStatus() const
+{
+	const uint32_t status = ReadLiveStatus();
+	const uint32_t drvStatus = readRegisters[ReadDrvStat];
+	uint32_t ret = (((drvStatus >> 16) & 0x1F) << CompactStatusCsActualShift) & CompactStatusCsActualMask;		// CS_ACTUAL is in bits 16-20 of DRV_STATUS
+	ret |= ((status & TMC_RR_OT) ? CompactStatusOt : 0)
+		 | ((status & TMC_RR_OTPW) ? CompactStatusOtpw : 0)
+		 | ((status & TMC_RR_S2G) ? CompactStatusS2g : 0)
+		 | ((status & TMC_RR_OLA) ? CompactStatusOla : 0)
+		 | ((status & TMC_RR_OLB) ? CompactStatusOlb : 0)
+		 | ((status & TMC_RR_STST) ? CompactStatusStst : 0)
+		 | ((status & TMC_RR_SG) ? CompactStatusStall : 0);
+#if HAS_STALL_DETECT
+	if (IsTmc2209() && (status & TMC_RR_STST) == 0)
+	{
+		ret |= (readRegisters[ReadSgResult] & SG_RESULT_MASK) | CompactStatusSgValid;
+	}
+#endif
+	return ret;
+}
+
 // Read the status
 uint32_t TmcDriverState::ReadAccumulatedStatus(uint32_t bitsToKeep)
 {
@@ -1076,6 +1130,12 @@ void TmcDriverState::AppendDriverStatus(const StringRef& reply)
 // This is called by the ISR when the SPI transfer has completed
 inline void TmcDriverState::TransferDone()
 {
+#if defined(SAME51) || defined(SAMC21)
+	moving = moveInstance->GetStepInterval(axisNumber, microstepShiftFactor) != 0;
+#else
+	moving = reprap.GetMove().GetStepInterval(axisNumber, microstepShiftFactor) != 0;
+#endif
+
 	if (sendData[2] & 0x80)								// if we were writing a register
 	{
 		const uint8_t currentIfCount = receiveData[18];
@@ -1325,6 +1385,60 @@ void UART_TMC_DRV1_Handler()
 
 #endif
 
+// Return true if any driver has registers to write or its motor is moving, in which case we need to keep the UART busy
+static bool AnyDriverBusy()
+{
+	for (size_t drive = 0; drive < GetNumTmcDrivers(); ++drive)
+	{
+		if (driverStates[drive].UpdatePending() || driverStates[drive].IsMoving())
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// If no motors are moving and there are no registers to write, we only need to read the driver status occasionally.
+// Wait until it's time to read it again, but check every tick so that we respond quickly when a move starts or a register changes.
+static void WaitUntilPollDue()
+{
+	for (uint32_t ticks = 0; ticks < StandstillPollInterval && driversState == DriversState::ready && moveInstance->GetCurrentDDA() == nullptr && !AnyDriverBusy(); ++ticks)
+	{
+		delay(1);
+	}
+}
+
+#if !TMC22xx_SINGLE_DRIVER
+
+// Choose the driver for the next transaction. Writes take priority, so that a new motor current or enable state reaches every driver before we spend time
+// reading status from any of them. Otherwise we read the drivers in turn, skipping those whose motors are stationary unless no motors are moving.
+static TmcDriverState *SelectNextDriver(TmcDriverState *previous)
+{
+	const size_t numDrivers = GetNumTmcDrivers();
+	const size_t start = (previous == nullptr) ? 0 : (size_t)(previous - driverStates) + 1;
+	for (size_t i = 0; i < numDrivers; ++i)
+	{
+		TmcDriverState * const d = &driverStates[(start + i) % numDrivers];
+		if (d->UpdatePending())
+		{
+			return d;
+		}
+	}
+
+	for (size_t i = 0; i < numDrivers; ++i)
+	{
+		TmcDriverState * const d = &driverStates[(start + i) % numDrivers];
+		if (d->IsMoving())
+		{
+			return d;
+		}
+	}
+
+	return &driverStates[start % numDrivers];
+}
+
+#endif
+
 extern "C" [[noreturn]] void TmcLoop(void *)
 {
 	TmcDriverState * currentDriver = nullptr;
@@ -1350,14 +1464,12 @@ extern "C" [[noreturn]] void TmcLoop(void *)
 #if TMC22xx_SINGLE_DRIVER
 			currentDriver = driverStates;
 #else
-			currentDriver = (currentDriver == nullptr || currentDriver + 1 == driverStates + GetNumTmcDrivers())
-								? driverStates
-									: currentDriver + 1;
+			currentDriver = SelectNextDriver(currentDriver);
 #endif
 			currentDriver->StartTransfer();
 
 			// Wait for the end-of-transfer interrupt
-			const bool timedOut = TaskBase::Take(TransferTimeout);
+			const bool timedOut = (TaskBase::Take(TransferTimeout) == 0);
 			DmacManager::DisableCompletedInterrupt(TmcRxDmaChannel);
 
 			if (timedOut)
@@ -1368,6 +1480,7 @@ extern "C" [[noreturn]] void TmcLoop(void *)
 			else if (dmaFinishedReason == DmaCallbackReason::complete)
 			{
 				currentDriver->UartTmcHandler();
+				Tracer::Record(Tracer::Event::tmcTransfer, (uint16_t)(currentDriver - driverStates));
 
 				if (driversState == DriversState::initialising)
 				{
@@ -1390,11 +1503,13 @@ extern "C" [[noreturn]] void TmcLoop(void *)
 					{
 						fastDigitalWriteLow(GlobalTmc22xxEnablePin);
 						driversState = DriversState::ready;
+						InitialisationCompleted();
 					}
 				}
 #if TMC22xx_SINGLE_DRIVER
 				delay(2);						// TMC22xx can't handle back-to-back reads, so we need a short delay
 #endif
+				WaitUntilPollDue();
 			}
 			else if (dmaFinishedReason != DmaCallbackReason::none)
 			{
@@ -1542,6 +1657,11 @@ uint32_t SmartDrivers::GetAccumulatedStatus(size_t drive, uint32_t bitsToKeep)
 	return (drive < GetNumTmcDrivers()) ? driverStates[drive].ReadAccumulatedStatus(bitsToKeep) : 0;
 }
 
+uint32_t SmartDrivers::GetCompactStatus(size_t drive)
+{
+	return (drive < GetNumTmcDrivers()) ? driverStates[drive].GetCompactStatus() : 0;
+}
+
 // Set microstepping or chopper control register
 bool SmartDrivers::SetMicrostepping(size_t drive, unsigned int microsteps, bool interpolate)
 {
@@ -1590,6 +1710,7 @@ void SmartDrivers::Spin(bool powered)
 	{
 		if (driversState == DriversState::noPower)
 		{
+			whenInitialisationStarted = StepTimer::GetTimerTicks();
 			driversState = DriversState::notInitialised;
 			tmcTask.Give();									// wake up the TMC task because the drivers need to be initialised
 		}
@@ -1602,6 +1723,11 @@ void SmartDrivers::Spin(bool powered)
 }
 
 // This is called from the tick ISR, possibly while Spin (with powered either true or false) is being executed
+bool SmartDrivers::AreDriversReady()
+{
+	return driversState == DriversState::ready;
+}
+
 void SmartDrivers::TurnDriversOff()
 {
 	// When using TMC2660 drivers, this is called when an over-voltage event occurs, so that we can try to protect the drivers by disabling them.
@@ -1652,6 +1778,10 @@ void SmartDrivers::AppendDriverStatus(size_t drive, const StringRef& reply)
 	if (drive < GetNumTmcDrivers())
 	{
 		driverStates[drive].AppendDriverStatus(reply);
+		if (drive + 1 == GetNumTmcDrivers())
+		{
+			AppendInitialisationTimes(reply);
+		}
 	}
 }
 
@@ -55,12 +55,14 @@ namespace SmartDrivers
 	void EnableDrive(size_t drive, bool en);
 	uint32_t GetLiveStatus(size_t drive);
 	uint32_t GetAccumulatedStatus(size_t drive, uint32_t bitsToKeep);
+	uint32_t GetCompactStatus(size_t drive);
 	bool SetMicrostepping(size_t drive, unsigned int microsteps, bool interpolation);
 	unsigned int GetMicrostepping(size_t drive, bool& interpolation);
 	bool SetDriverMode(size_t driver, unsigned int mode);
 	DriverMode GetDriverMode(size_t driver);
 	void Spin(bool powered);
 	void TurnDriversOff();
+	bool AreDriversReady();									// true if the drivers are powered and initialised, so that the enable pin may be active
 	void SetStallThreshold(size_t driver, int sgThreshold);
 	void SetStallFilter(size_t driver, bool sgFilter);
 	void SetStallMinimumStepsPerSecond(size_t driver, unsigned int stepsPerSecond);
@@ -5,6 +5,11 @@
  *      Author: David
  *  Purpose:
  *  	Support for TMC5130, TMC5160 and TMC5161 stepper drivers
+ *
+ *  Drivers in direct mode (M569 D4) ignore the step pulses. Instead, we write the coil currents over SPI in most transfers, calculating them from
+ *  the position that the move profile says the motor should have reached when the transfer completes. The steps are still generated so that
+ *  the motor positions, endstops and stall detection work as before, but because they no longer drive the motor the microstepping can be set
+ *  low to reduce the step interrupt load without making the motion any less smooth.
  */
 
 #include "TMC51xx.h"
@@ -13,8 +18,12 @@
 
 #include <RTOSIface/RTOSIface.h>
 #include <Movement/Move.h>
+#include <InputMonitors/InputMonitor.h>
 #include <Hardware/DmacManager.h>
 #include <General/Portability.h>
+#include <Platform.h>
+#include <Tracer.h>
+#include <StackSizes.h>
 
 #if SAME51 || SAMC21
 
@@ -34,6 +43,10 @@ static inline const Move& GetMoveInstance() { return reprap.GetMove(); }
 
 //#define TMC_TYPE	5130
 #define TMC_TYPE	5160
+
+#if SUPPORT_PHASE_STEPPING && !SUPPORT_ENCODERS
+# error SUPPORT_PHASE_STEPPING needs SUPPORT_ENCODERS, which keeps the motor positions
+#endif
 #define DEBUG_DRIVER_TIMEOUT	0
 
 constexpr float MinimumMotorCurrent = 50.0;
@@ -46,7 +59,17 @@ const bool DefaultStallDetectFiltered = false;
 const unsigned int DefaultMinimumStepsPerSecond = 200;		// for stall detection: 1 rev per second assuming 1.8deg/step, as per the TMC5160 datasheet
 const uint32_t DefaultTcoolthrs = 2000;						// max interval between 1/256 microsteps for stall detection to be enabled
 const uint32_t DefaultThigh = 200;
-constexpr size_t TmcTaskStackWords = 100;
+
+// Load-dependent run current scaling. We read SG_RESULT when the motor is moving fast enough for it to be valid, and reduce the run current while the
+// load margin is high. SG_RESULT falls as the load increases, so we increase the current quickly when it drops below the lower limit.
+constexpr uint32_t FullCurrentScale = 256;					// the run current scale factor that gives the configured motor current
+constexpr uint32_t CurrentScaleUpStep = 16;					// how much we increase the scale factor each time we find the load margin is too low
+constexpr uint32_t CurrentScaleDownStep = 2;				// how much we decrease the scale factor each time we find the load margin is high
+constexpr unsigned int MinCurrentScalingPercent = 25;		// the lowest minimum current that we allow to be configured
+constexpr uint16_t DefaultSgLowerLimit = 100;
+constexpr uint16_t DefaultSgUpperLimit = 400;
+constexpr float MinEncoderCountsPerStep = 1.0;				// ENC_CONST has a 16-bit signed integer part, so this is the lowest resolution we can handle
+constexpr float MaxEncoderCountsPerStep = 1000.0;
 
 #if TMC_TYPE == 5130
 constexpr float SenseResistor = 0.11;						// 0.082R external + 0.03 internal
@@ -68,6 +91,14 @@ constexpr float RecipFullScaleCurrent = SenseResistor/325.0;		// 1.0 divided by
 // - we poll all ?? drivers in about ??us
 const uint32_t DriversSpiClockFrequency = 2000000;			// 2MHz SPI clock
 const uint32_t TransferTimeout = 2;							// any transfer should complete within 2 ticks @ 1ms/tick
+const uint32_t StandstillPollInterval = 10;					// how often we poll the drivers in milliseconds when no motors are moving and there is nothing to write
+constexpr size_t NumTransferSlots = 2;						// we prepare the next SPI transfer while the current one is in progress, so we need two sets of buffers
+
+#if SUPPORT_PHASE_STEPPING
+constexpr unsigned int DirectModeRegisterInterval = 4;		// in direct mode we read a register in one transfer out of this many, and write the coil currents in the others
+constexpr uint32_t DirectModeLeadTicks = (2 * 5 * 8 * MaxSmartDrivers * (uint64_t)StepTimer::StepClockRate)/DriversSpiClockFrequency;
+															// we set up each transfer while the previous one is running, so the coil currents take effect about two transfer times later
+#endif
 
 // GCONF register (0x00, RW)
 constexpr uint8_t REGNUM_GCONF = 0x00;
@@ -199,10 +230,21 @@ const uint32_t DefaultThighReg = DefaultThigh;
 
 constexpr uint8_t REGNUM_VACTUAL = 0x22;
 
+// The other ramp generator registers (RAMPMODE, XACTUAL, VMAX, AMAX etc.) are not used. The drivers are wired with SD_MODE high,
+// which selects step/dir mode and bypasses the internal ramp generator, and moves must stay synchronised with the other drives in any case.
+// In direct mode, the XTARGET register holds the coil currents instead.
+constexpr uint8_t REGNUM_XDIRECT = 0x2D;					// coil A current in bits 0-8 and coil B current in bits 16-24, both signed, scaled by IHOLD
+
 // Sequencer registers (read only)
 constexpr uint8_t REGNUM_MSCNT = 0x6A;
 constexpr uint8_t REGNUM_MSCURACT = 0x6B;
 
+// Encoder registers. An encoder connected to the ENCA/ENCB inputs is counted in step/dir mode as well as when using the ramp generator.
+constexpr uint8_t REGNUM_ENCMODE = 0x38;					// we leave this at the default, i.e. no N channel and binary ENC_CONST
+constexpr uint8_t REGNUM_X_ENC = 0x39;						// encoder position (RW), ENC_CONST is added to it or subtracted from it for each encoder count
+constexpr uint8_t REGNUM_ENC_CONST = 0x3A;					// signed 16.16 fixed point, we set it so that X_ENC is in 1/256 full steps
+constexpr uint32_t DefaultEncConstReg = 1u << 16;
+
 // Chopper control registers
 
 // CHOPCONF register
@@ -260,6 +302,64 @@ enum class DriversState : uint8_t
 
 static DriversState driversState = DriversState::noPower;
 
+// Timing of driver initialisation, so that we can see how long the drivers are disabled after power is restored following a supply dip.
+// The drivers take their logic supply from VIN, so a dip that makes us flag no power may have reset them, and we always restore all the cached register values.
+static uint32_t whenInitialisationStarted = 0;				// the step clock when the drivers last needed to be initialised
+static uint32_t lastInitialisationTicks = 0;				// how long the last initialisation took
+static uint32_t maxInitialisationTicks = 0;					// the longest initialisation since the counts were last reported
+static uint32_t numInitialisations = 0;
+
+// Record that the drivers have been initialised and enabled
+static void InitialisationCompleted()
+{
+	lastInitialisationTicks = StepTimer::GetTimerTicks() - whenInitialisationStarted;
+	if (lastInitialisationTicks > maxInitialisationTicks)
+	{
+		maxInitialisationTicks = lastInitialisationTicks;
+	}
+	++numInitialisations;
+}
+
+#if SUPPORT_PHASE_STEPPING
+
+// One quarter of a sine wave with an amplitude of 255, in 1/256 full steps. Coil A follows the sine and coil B the cosine, like the internal sequencer does.
+static uint8_t quarterSineTable[257];
+
+static void InitSineTable()
+{
+	for (size_t i = 0; i < ARRAY_SIZE(quarterSineTable); ++i)
+	{
+		quarterSineTable[i] = (uint8_t)lrintf(255.0 * sinf((float)i * (Pi/512.0)));
+	}
+}
+
+// Get the sine of an electrical angle in 1/256 full steps (1024 per electrical cycle) scaled by the amplitude, which is at most 255
+static int32_t ScaledSine(uint32_t angle, uint32_t amplitude)
+{
+	const uint32_t index = angle & 255;
+	const uint32_t quadrant = (angle >> 8) & 3;
+	const int32_t val = (int32_t)((quarterSineTable[(quadrant & 1) ? 256 - index : index] * amplitude)/255);
+	return (quadrant >= 2) ? -val : val;
+}
+
+// Get the XDIRECT register value for an electrical angle and current amplitude
+static uint32_t CoilCurrents(uint32_t angle, uint32_t amplitude)
+{
+	const uint32_t coilA = (uint32_t)ScaledSine(angle, amplitude) & 0x01FF;
+	const uint32_t coilB = (uint32_t)ScaledSine(angle + 256, amplitude) & 0x01FF;
+	return coilA | (coilB << 16);
+}
+
+#endif
+
+static void AppendInitialisationTimes(const StringRef& reply)
+{
+	constexpr float MillisPerTick = 1000.0/(float)StepTimer::StepClockRate;
+	reply.catf("\nDriver initialisations %" PRIu32 ", last took %.2fms, max %.2fms",
+				numInitialisations, (double)((float)lastInitialisationTicks * MillisPerTick), (double)((float)maxInitialisationTicks * MillisPerTick));
+	maxInitialisationTicks = 0;
+}
+
 //----------------------------------------------------------------------------------------------------------------------------------
 // Private types and methods
 
@@ -274,14 +374,26 @@ public:
 	unsigned int GetMicrostepping(bool& interpolation) const;		// Get microstepping
 	bool SetDriverMode(unsigned int mode);
 	DriverMode GetDriverMode() const;
+#if SUPPORT_PHASE_STEPPING
+	bool IsDirectMode() const { return (writeRegisters[WriteGConf] & GCONF_DIRECT_MODE) != 0; }
+#endif
 	void SetCurrent(float current);
 	void Enable(bool en);
 	void AppendDriverStatus(const StringRef& reply, bool clearGlobalStats);
 	bool UpdatePending() const { return (registersToUpdate | newRegistersToUpdate) != 0; }
+	bool IsMoving() const { return moving; }
+	bool NeedsPolling() const;
 	void SetStallDetectThreshold(int sgThreshold);
 	void SetStallDetectFilter(bool sgFilter);
 	void SetStallMinimumStepsPerSecond(unsigned int stepsPerSecond);
 	void AppendStallConfig(const StringRef& reply) const;
+	bool SetCurrentScaling(unsigned int minPercent, uint16_t sgLowerLimit, uint16_t sgUpperLimit);
+	void AppendCurrentScaling(const StringRef& reply) const;
+#if SUPPORT_ENCODERS
+	bool SetEncoderCountsPerStep(float counts);
+	float GetEncoderCountsPerStep() const { return encoderCountsPerStep; }
+	void AppendEncoderStatus(const StringRef& reply) const;
+#endif
 
 	bool SetRegister(SmartDriverRegister reg, uint32_t regVal);
 	uint32_t GetRegister(SmartDriverRegister reg) const;
@@ -290,12 +402,14 @@ public:
 	void SetStandstillCurrentPercent(float percent);
 
 	static void TransferTimedOut() { ++numTimeouts; }
+	static void TransferChained() { ++numChainedTransfers; }
 
 	uint32_t ReadLiveStatus() const;
+	uint32_t GetCompactStatus() const;
 	uint32_t ReadAccumulatedStatus(uint32_t bitsToKeep);
 
-	void GetSpiCommand(uint8_t *sendDdataBlock);
-	void TransferSucceeded(const uint8_t *rcvDataBlock);
+	void GetSpiCommand(uint8_t *sendDdataBlock, size_t slot);
+	void TransferSucceeded(const uint8_t *rcvDataBlock, size_t slot, uint32_t whenCompleted);
 	void TransferFailed();
 
 private:
@@ -303,6 +417,10 @@ private:
 	void UpdateRegister(size_t regIndex, uint32_t regVal);
 	void UpdateChopConfRegister();							// calculate the chopper control register and flag it for sending
 	void UpdateCurrent();
+	void AdjustRunCurrent(bool sgValid, uint32_t sgResult);
+#if SUPPORT_PHASE_STEPPING
+	uint32_t GetCoilCurrents();
+#endif
 
 	void ResetLoadRegisters()
 	{
@@ -323,15 +441,20 @@ private:
 	static constexpr unsigned int Write5160ShortConf = 8;	// short circuit detection configuration
 	static constexpr unsigned int Write5160DrvConf = 9;		// driver timing
 	static constexpr unsigned int Write5160GlobalScaler = 10; // motor current scaling
+	static constexpr unsigned int WriteEncConst = 11;		// encoder counts to position conversion factor
+	static constexpr unsigned int WriteXEnc = 12;			// encoder position, we only ever write zero to it
 
-	static constexpr unsigned int NumWriteRegisters = 11;	// the number of registers that we write to
+	static constexpr unsigned int NumWriteRegisters = 13;	// the number of registers that we write to
 #else
-	static constexpr unsigned int NumWriteRegisters = 8;	// the number of registers that we write to
+	static constexpr unsigned int WriteEncConst = 8;		// encoder counts to position conversion factor
+	static constexpr unsigned int WriteXEnc = 9;			// encoder position, we only ever write zero to it
+
+	static constexpr unsigned int NumWriteRegisters = 10;	// the number of registers that we write to
 #endif
 
 	static const uint8_t WriteRegNumbers[NumWriteRegisters];	// the register numbers that we write to
 
-	static constexpr unsigned int NumReadRegisters = 4;		// the number of registers that we read from
+	static constexpr unsigned int NumReadRegisters = 5;		// the number of registers that we read from
 	static const uint8_t ReadRegNumbers[NumReadRegisters];	// the register numbers that we read from
 
 	// Read register numbers, in same order as ReadRegNumbers
@@ -339,6 +462,11 @@ private:
 	static constexpr unsigned int ReadDrvStat = 1;
 	static constexpr unsigned int ReadMsCnt = 2;
 	static constexpr unsigned int ReadPwmScale = 3;
+	static constexpr unsigned int ReadXEnc = 4;
+
+	// The order in which we read the registers. We read DRV_STATUS every other time because it has the stall and fault status that we need to see quickly.
+	static constexpr unsigned int ReadSequenceLength = 8;
+	static const uint8_t ReadSequence[ReadSequenceLength];
 
 	static constexpr uint8_t NoRegIndex = 0xFF;				// this means no register updated, or no register requested
 
@@ -356,15 +484,37 @@ private:
 	uint32_t axisNumber;									// the axis number of this driver as used to index the DriveMovements in the DDA
 	uint32_t microstepShiftFactor;							// how much we need to shift 1 left by to get the current microstepping
 	uint32_t motorCurrent;									// the configured motor current in mA
+	uint32_t maxSgValidInterval;							// the longest full step interval at which SG_RESULT is valid
+	uint16_t runCurrentScale;								// the factor we apply to the run current, FullCurrentScale means the configured current
+	uint16_t minRunCurrentScale;							// the lowest value of runCurrentScale, FullCurrentScale means no current scaling
+	uint16_t sgLowerLimit;									// if SG_RESULT is below this then we increase the run current
+	uint16_t sgUpperLimit;									// if SG_RESULT is above this then we reduce the run current
+#if SUPPORT_ENCODERS
+	float encoderCountsPerStep;								// encoder counts per full step, zero if no encoder is configured
+	int32_t motorPositionAtEncoderZero;						// the motor position in 1/256 full steps when we last zeroed X_ENC
+	bool encoderPositionValid;								// true if we have read X_ENC since we last zeroed it
+#endif
+#if SUPPORT_PHASE_STEPPING
+	int32_t directPhaseOffset;								// what we add to the motor position to get the electrical angle in direct mode
+	uint16_t numCoilWrites;									// how many times we wrote the coil currents
+	uint8_t directModeSequence;								// counts transfers in direct mode so that we still read the registers
+	uint8_t standstillAmplitude;							// the coil current amplitude at standstill in direct mode
+	bool directPhaseValid;									// false if we need to set directPhaseOffset
+#endif
 
 	uint16_t numReads, numWrites;							// how many successful reads and writes we had
 	static uint16_t numTimeouts;							// how many times a transfer timed out
+	static uint32_t numChainedTransfers;					// how many transfers were started by the DMA complete callback
 
 	uint8_t standstillCurrentFraction;						// divide this by 256 to get the motor current standstill fraction
-	uint8_t regIndexBeingUpdated;							// which register we are sending
-	uint8_t regIndexRequested;								// the register we asked to read in the previous transaction, or 0xFF
+	uint8_t regIndexBeingUpdated[NumTransferSlots];			// which register we are sending in each transfer slot
+	uint8_t regIndexRequested[NumTransferSlots];			// the register we asked to read in each transfer slot, or 0xFF
 	uint8_t previousRegIndexRequested;						// the register we asked to read in the previous transaction, or 0xFF
+	uint8_t readSequenceIndex;								// where we are in ReadSequence
+	uint8_t driverNumber;									// the number of this driver
 	bool enabled;											// true if driver is enabled
+	bool moving;											// true if the motor was moving when we last polled the driver
+	bool stalled;											// true if the driver reported a stall in the last transfer
 };
 
 const uint8_t TmcDriverState::WriteRegNumbers[NumWriteRegisters] =
@@ -380,8 +530,10 @@ const uint8_t TmcDriverState::WriteRegNumbers[NumWriteRegisters] =
 #if TMC_TYPE == 5160
 	REGNUM_5160_SHORTCONF,
 	REGNUM_5160_DRVCONF,
-	REGNUM_5160_GLOBAL_SCALER
+	REGNUM_5160_GLOBAL_SCALER,
 #endif
+	REGNUM_ENC_CONST,
+	REGNUM_X_ENC
 };
 
 const uint8_t TmcDriverState::ReadRegNumbers[NumReadRegisters] =
@@ -389,10 +541,17 @@ const uint8_t TmcDriverState::ReadRegNumbers[NumReadRegisters] =
 	REGNUM_GSTAT,
 	REGNUM_DRV_STATUS,
 	REGNUM_MSCNT,
-	REGNUM_PWM_SCALE
+	REGNUM_PWM_SCALE,
+	REGNUM_X_ENC
+};
+
+const uint8_t TmcDriverState::ReadSequence[ReadSequenceLength] =
+{
+	ReadDrvStat, ReadMsCnt, ReadDrvStat, ReadGStat, ReadDrvStat, ReadXEnc, ReadDrvStat, ReadPwmScale
 };
 
 uint16_t TmcDriverState::numTimeouts = 0;								// how many times a transfer timed out
+uint32_t TmcDriverState::numChainedTransfers = 0;						// how many transfers were started by the DMA complete callback
 
 // Initialise the state of the driver and its CS pin
 void TmcDriverState::Init(uint32_t p_driverNumber)
@@ -400,10 +559,15 @@ pre(!driversPowered)
 {
 	axisNumber = p_driverNumber;										// axes are mapped straight through to drivers initially
 	driverBit = DriversBitmap::MakeFromBits(p_driverNumber);
+	driverNumber = p_driverNumber;
 	enabled = false;
+	stalled = false;
 	registersToUpdate = newRegistersToUpdate = 0;
 	motorCurrent = 0;
 	standstillCurrentFraction = 181; 									// default to 1/sqrt(2)
+	runCurrentScale = minRunCurrentScale = FullCurrentScale;			// current scaling is disabled by default
+	sgLowerLimit = DefaultSgLowerLimit;
+	sgUpperLimit = DefaultSgUpperLimit;
 
 	// Set default values for all registers and flag them to be updated
 	UpdateRegister(WriteGConf, DefaultGConfReg);
@@ -420,21 +584,57 @@ pre(!driversPowered)
 	SetStallDetectThreshold(DefaultStallDetectThreshold);				// this also updates the CoolConf register
 	SetStallMinimumStepsPerSecond(DefaultMinimumStepsPerSecond);
 	UpdateRegister(WritePwmConf, DefaultPwmConfReg);
+	UpdateRegister(WriteEncConst, DefaultEncConstReg);
+#if SUPPORT_ENCODERS
+	encoderCountsPerStep = 0.0;
+	motorPositionAtEncoderZero = 0;
+	encoderPositionValid = false;
+#endif
+#if SUPPORT_PHASE_STEPPING
+	directPhaseOffset = 0;
+	numCoilWrites = 0;
+	directModeSequence = 0;
+	standstillAmplitude = 255;
+	directPhaseValid = false;
+#endif
 
 	for (size_t i = 0; i < NumReadRegisters; ++i)
 	{
 		accumulatedReadRegisters[i] = readRegisters[i] = 0;
 	}
 
-	regIndexBeingUpdated = regIndexRequested = previousRegIndexRequested = NoRegIndex;
+	for (size_t slot = 0; slot < NumTransferSlots; ++slot)
+	{
+		regIndexBeingUpdated[slot] = regIndexRequested[slot] = NoRegIndex;
+	}
+	previousRegIndexRequested = NoRegIndex;
+	readSequenceIndex = 0;
+	moving = false;
 	numReads = numWrites = 0;
 }
 
-// Set a register value and flag it for updating
+// Return true if we need to transfer data to or from the driver continuously.
+// In direct mode we must keep writing the coil currents from as soon as a move is queued, because the motor only moves when we do.
+bool TmcDriverState::NeedsPolling() const
+{
+	return UpdatePending() || moving
+#if SUPPORT_PHASE_STEPPING
+		|| (IsDirectMode() && !GetMoveInstance().NoLiveMovement())
+#endif
+		;
+}
+
+// Set a register value and flag it for updating. The writeRegisters array shadows the driver registers, so if the value hasn't changed we don't need to send it.
+// This relies on WriteAll being called whenever the driver may have lost its register values.
+// Registers may be updated by the TMC task as well as by other tasks, so we must make sure that we don't lose a flag bit.
 void TmcDriverState::UpdateRegister(size_t regIndex, uint32_t regVal)
 {
-	writeRegisters[regIndex] = regVal;
-	newRegistersToUpdate |= (1u << regIndex);							// flag it for sending
+	if (writeRegisters[regIndex] != regVal)
+	{
+		TaskCriticalSectionLocker lock;
+		writeRegisters[regIndex] = regVal;
+		newRegistersToUpdate |= (1u << regIndex);						// flag it for sending
+	}
 }
 
 // Calculate the chopper control register and flag it for sending
@@ -446,8 +646,7 @@ void TmcDriverState::UpdateChopConfRegister()
 void TmcDriverState::SetStallDetectThreshold(int sgThreshold)
 {
 	const uint32_t sgVal = ((uint32_t)constrain<int>(sgThreshold, -64, 63)) & 127u;
-	writeRegisters[WriteCoolConf] = (writeRegisters[WriteCoolConf] & ~COOLCONF_SGT_MASK) | (sgVal << COOLCONF_SGT_SHIFT);
-	newRegistersToUpdate |= 1u << WriteCoolConf;
+	UpdateRegister(WriteCoolConf, (writeRegisters[WriteCoolConf] & ~COOLCONF_SGT_MASK) | (sgVal << COOLCONF_SGT_SHIFT));
 }
 
 inline void TmcDriverState::SetAxisNumber(size_t p_axisNumber)
@@ -595,15 +794,15 @@ bool TmcDriverState::SetDriverMode(unsigned int mode)
 	switch (mode)
 	{
 	case (unsigned int)DriverMode::spreadCycle:
-		UpdateRegister(WriteGConf, writeRegisters[WriteGConf] & ~GCONF_STEALTHCHOP);
-		return true;
+		UpdateRegister(WriteGConf, writeRegisters[WriteGConf] & ~(GCONF_STEALTHCHOP | GCONF_DIRECT_MODE));
+		break;
 
 	case (unsigned int)DriverMode::stealthChop:
-		UpdateRegister(WriteGConf, writeRegisters[WriteGConf] | GCONF_STEALTHCHOP);
-		return true;
+		UpdateRegister(WriteGConf, (writeRegisters[WriteGConf] & ~GCONF_DIRECT_MODE) | GCONF_STEALTHCHOP);
+		break;
 
 	case (unsigned int)DriverMode::constantOffTime:
-		UpdateRegister(WriteGConf, writeRegisters[WriteGConf] & ~GCONF_STEALTHCHOP);
+		UpdateRegister(WriteGConf, writeRegisters[WriteGConf] & ~(GCONF_STEALTHCHOP | GCONF_DIRECT_MODE));
 		UpdateRegister(WriteChopConf,
 #if TMC_TYPE == 5130
 			(writeRegisters[WriteChopConf] | CHOPCONF_CHM) & ~CHOPCONF_5130_RNDTOFF
@@ -611,24 +810,42 @@ bool TmcDriverState::SetDriverMode(unsigned int mode)
 			writeRegisters[WriteChopConf] | CHOPCONF_CHM
 #endif
 			);
-		return true;
+		break;
 
 #if TMC_TYPE == 5130
 	case (unsigned int)DriverMode::randomOffTime:
-		UpdateRegister(WriteGConf, writeRegisters[WriteGConf] & ~GCONF_STEALTHCHOP);
+		UpdateRegister(WriteGConf, writeRegisters[WriteGConf] & ~(GCONF_STEALTHCHOP | GCONF_DIRECT_MODE));
 		UpdateRegister(WriteChopConf, writeRegisters[WriteChopConf] | CHOPCONF_CHM | CHOPCONF_5130_RNDTOFF);
-		return true;
+		break;
+#endif
+
+#if SUPPORT_PHASE_STEPPING && TMC_TYPE == 5160
+	// Velocity based stealthChop current regulation doesn't work in direct mode, so we use spreadCycle.
+	// The main board only changes the mode when the motor is stopped, which is just as well because the sequencer doesn't follow the phase while we are in direct mode.
+	case (unsigned int)DriverMode::direct:
+		if (!IsDirectMode())
+		{
+			directPhaseValid = false;							// start from the phase that the sequencer has reached
+		}
+		UpdateRegister(WriteGConf, (writeRegisters[WriteGConf] & ~GCONF_STEALTHCHOP) | GCONF_DIRECT_MODE);
+		break;
 #endif
 
 	default:
 		return false;
 	}
+
+#if SUPPORT_PHASE_STEPPING
+	UpdateCurrent();											// direct mode uses IHOLD for the run current
+#endif
+	return true;
 }
 
 // Get the driver mode
 DriverMode TmcDriverState::GetDriverMode() const
 {
-	return ((writeRegisters[WriteGConf] & GCONF_STEALTHCHOP) != 0) ? DriverMode::stealthChop
+	return ((writeRegisters[WriteGConf] & GCONF_DIRECT_MODE) != 0) ? DriverMode::direct
+		: ((writeRegisters[WriteGConf] & GCONF_STEALTHCHOP) != 0) ? DriverMode::stealthChop
 		: ((writeRegisters[WriteChopConf] & CHOPCONF_CHM) == 0) ? DriverMode::spreadCycle
 #if TMC_TYPE == 5130
 			: ((writeRegisters[WriteChopConf] & CHOPCONF_5130_RNDTOFF) != 0) ? DriverMode::randomOffTime
@@ -649,7 +866,7 @@ void TmcDriverState::UpdateCurrent()
 	// Assume a current sense resistor of 0.082 ohms, to which we must add 0.025 ohms internal resistance.
 	// Full scale peak motor current in the high sensitivity range is give by I = 0.18/(R+0.03) = 0.18/0.105 ~= 1.6A
 	// This gives us a range of 50mA to 1.6A in 50mA steps in the high sensitivity range (VSENSE = 1)
-	const uint32_t iRunCsBits = (32 * motorCurrent - 800)/1615;		// formula checked by simulation on a spreadsheet
+	const uint32_t iRunCsBits = (32 * ((motorCurrent * runCurrentScale)/FullCurrentScale) - 800)/1615;	// formula checked by simulation on a spreadsheet
 	const uint32_t iHoldCurrent = (motorCurrent * standstillCurrentFraction)/256;	// set standstill current
 	const uint32_t iHoldCsBits = (32 * iHoldCurrent - 800)/1615;	// formula checked by simulation on a spreadsheet
 	UpdateRegister(WriteIholdIrun,
@@ -674,7 +891,22 @@ void TmcDriverState::UpdateCurrent()
 	const uint8_t limitedStandstillCurrentFraction = (motorCurrent * standstillCurrentFraction <= MaxStandstillCurrentTimes256)
 														? standstillCurrentFraction
 															: (uint8_t)(MaxStandstillCurrentTimes256/motorCurrent);
-	const uint32_t iHold = (iRun * limitedStandstillCurrentFraction)/256;
+	uint32_t iHold = (iRun * limitedStandstillCurrentFraction)/256;
+
+	// Apply the run current scaling to IRUN only, so that it doesn't affect the standstill current
+	if (runCurrentScale < FullCurrentScale && iRun != 0)
+	{
+		iRun = max<uint32_t>((iRun * runCurrentScale)/FullCurrentScale, 1);
+	}
+
+# if SUPPORT_PHASE_STEPPING
+	// In direct mode the driver scales the coil currents by IHOLD, so we set IHOLD to the run current and reduce the coil current amplitude at standstill instead
+	standstillAmplitude = (uint8_t)((255 * limitedStandstillCurrentFraction)/256);
+	if (IsDirectMode())
+	{
+		iHold = iRun;
+	}
+# endif
 	UpdateRegister(WriteIholdIrun,
 					(writeRegisters[WriteIholdIrun] & ~(IHOLDIRUN_IRUN_MASK | IHOLDIRUN_IHOLD_MASK)) | (iRun << IHOLDIRUN_IRUN_SHIFT) | (iHold << IHOLDIRUN_IHOLD_SHIFT));
 	UpdateRegister(Write5160GlobalScaler, gs);
@@ -683,6 +915,63 @@ void TmcDriverState::UpdateCurrent()
 #endif
 }
 
+// Adjust the run current according to the load margin. Called from the TMC task each time we read DRV_STATUS.
+void TmcDriverState::AdjustRunCurrent(bool sgValid, uint32_t sgResult)
+{
+	if (minRunCurrentScale < FullCurrentScale)
+	{
+		uint32_t newScale = runCurrentScale;
+		if (!sgValid)
+		{
+			newScale = FullCurrentScale;								// we can't measure the load at standstill or low speed, so use the configured current
+		}
+		else if (sgResult < sgLowerLimit)
+		{
+			newScale = min<uint32_t>(runCurrentScale + CurrentScaleUpStep, FullCurrentScale);
+		}
+		else if (sgResult > sgUpperLimit)
+		{
+			newScale = max<uint32_t>(runCurrentScale - CurrentScaleDownStep, minRunCurrentScale);
+		}
+
+		if (newScale != runCurrentScale)
+		{
+			runCurrentScale = newScale;
+			UpdateCurrent();
+		}
+	}
+}
+
+// Configure the load-dependent run current scaling. A minimum current of 100% disables it. An SG_RESULT limit of zero leaves that limit unchanged.
+bool TmcDriverState::SetCurrentScaling(unsigned int minPercent, uint16_t p_sgLowerLimit, uint16_t p_sgUpperLimit)
+{
+	const uint16_t newLowerLimit = (p_sgLowerLimit != 0) ? p_sgLowerLimit : sgLowerLimit;
+	const uint16_t newUpperLimit = (p_sgUpperLimit != 0) ? p_sgUpperLimit : sgUpperLimit;
+	if (minPercent < MinCurrentScalingPercent || minPercent > 100 || newLowerLimit >= newUpperLimit || newUpperLimit > TMC_RR_SGRESULT)
+	{
+		return false;
+	}
+	sgLowerLimit = newLowerLimit;
+	sgUpperLimit = newUpperLimit;
+	minRunCurrentScale = (minPercent * FullCurrentScale)/100;
+	runCurrentScale = FullCurrentScale;
+	UpdateCurrent();
+	return true;
+}
+
+void TmcDriverState::AppendCurrentScaling(const StringRef& reply) const
+{
+	if (minRunCurrentScale < FullCurrentScale)
+	{
+		reply.catf(", current scaling min %" PRIu32 "%% SG limits %u/%u now %" PRIu32 "%%",
+					((uint32_t)minRunCurrentScale * 100)/FullCurrentScale, sgLowerLimit, sgUpperLimit, ((uint32_t)runCurrentScale * 100)/FullCurrentScale);
+	}
+	else
+	{
+		reply.cat(", current scaling off");
+	}
+}
+
 // Enable or disable the driver
 void TmcDriverState::Enable(bool en)
 {
@@ -699,6 +988,26 @@ uint32_t TmcDriverState::ReadLiveStatus() const
 	return readRegisters[ReadDrvStat] & (TMC_RR_SG | TMC_RR_OT | TMC_RR_OTPW | TMC_RR_S2G | TMC_RR_OLA | TMC_RR_OLB | TMC_RR_STST);
 }
 
+// Get the status, load and current scale in the compact format that we send to the main board in driver status reports
+uint32_t TmcDriverState::GetCompactStatus() const
+{
+	const uint32_t status = ReadLiveStatus();
+	const uint32_t drvStatus = readRegisters[ReadDrvStat];
+	uint32_t ret = (((drvStatus >> 16) & 0x1F) << CompactStatusCsActualShift) & CompactStatusCsActualMask;		// CS_ACTUAL is in bits 16-20 of DRV_STATUS
+	ret |= ((status & TMC_RR_OT) ? CompactStatusOt : 0)
+		 | ((status & TMC_RR_OTPW) ? CompactStatusOtpw : 0)
+		 | ((status & TMC_RR_S2G) ? CompactStatusS2g : 0)
+		 | ((status & TMC_RR_OLA) ? CompactStatusOla : 0)
+		 | ((status & TMC_RR_OLB) ? CompactStatusOlb : 0)
+		 | ((status & TMC_RR_STST) ? CompactStatusStst : 0)
+		 | ((status & TMC_RR_SG) ? CompactStatusStall : 0);
+	if ((status & TMC_RR_STST) == 0)							// in standstill, SG_RESULT returns the chopper on-time instead
+	{
+		ret |= (drvStatus & TMC_RR_SGRESULT) | CompactStatusSgValid;
+	}
+	return ret;
+}
+
 // Read the status
 uint32_t TmcDriverState::ReadAccumulatedStatus(uint32_t bitsToKeep)
 {
@@ -741,11 +1050,19 @@ void TmcDriverState::AppendDriverStatus(const StringRef& reply, bool clearGlobal
 		reply.cat(" ok");
 	}
 
-	reply.catf(", reads %u, writes %u timeouts %u", numReads, numWrites, numTimeouts);
+	reply.catf(", reads %u, writes %u timeouts %u chained %" PRIu32, numReads, numWrites, numTimeouts, numChainedTransfers);
 	numReads = numWrites = 0;
+#if SUPPORT_PHASE_STEPPING
+	if (IsDirectMode())
+	{
+		reply.catf(", coil writes %u", numCoilWrites);
+	}
+	numCoilWrites = 0;
+#endif
 	if (clearGlobalStats)
 	{
 		numTimeouts = 0;
+		numChainedTransfers = 0;
 	}
 
 	if (minSgLoadRegister <= maxSgLoadRegister)
@@ -756,25 +1073,64 @@ void TmcDriverState::AppendDriverStatus(const StringRef& reply, bool clearGlobal
 	{
 		reply.cat(", SG min/max not available");
 	}
+#if SUPPORT_ENCODERS
+	AppendEncoderStatus(reply);
+#endif
 	ResetLoadRegisters();
 }
 
-void TmcDriverState::SetStallDetectFilter(bool sgFilter)
+#if SUPPORT_ENCODERS
+
+// Set the encoder resolution, or zero if there is no encoder. A negative value means that the encoder counts down when the motor runs forwards.
+// We set ENC_CONST so that X_ENC is in 1/256 full steps and then zero X_ENC, which sets the reference point for the position error.
+bool TmcDriverState::SetEncoderCountsPerStep(float counts)
 {
-	if (sgFilter)
+	if (counts != 0.0 && (fabsf(counts) < MinEncoderCountsPerStep || fabsf(counts) > MaxEncoderCountsPerStep))
 	{
-		writeRegisters[WriteCoolConf] |= COOLCONF_SGFILT;
+		return false;
 	}
-	else
+	encoderCountsPerStep = counts;
+	UpdateRegister(WriteEncConst, (counts == 0.0) ? DefaultEncConstReg : (uint32_t)(int32_t)lrintf((65536.0 * 256.0)/counts));
+
+	TaskCriticalSectionLocker lock;
+	newRegistersToUpdate |= 1u << WriteXEnc;							// writeRegisters[WriteXEnc] is always zero, so UpdateRegister won't flag it
+	return true;
+}
+
+// Append the encoder status. The error is the encoder position minus the position that the completed moves should have reached, so it is only meaningful when no moves are pending.
+// We don't correct the error because the main board owns the machine position, but reporting it tells the user when a motor is being run too close to its torque limit.
+void TmcDriverState::AppendEncoderStatus(const StringRef& reply) const
+{
+	if (encoderCountsPerStep != 0.0)
 	{
-		writeRegisters[WriteCoolConf] &= ~COOLCONF_SGFILT;
+		reply.catf(", encoder %.2f counts/step", (double)encoderCountsPerStep);
+		if (!encoderPositionValid)
+		{
+			reply.cat(" position unknown");
+		}
+		else if (!GetMoveInstance().NoLiveMovement())
+		{
+			reply.cat(" moving");
+		}
+		else
+		{
+			const int32_t error = (int32_t)readRegisters[ReadXEnc] - (GetMoveInstance().GetMotorPosition(axisNumber) - motorPositionAtEncoderZero);
+			reply.catf(" error %.2f steps", (double)((float)error * (1.0f/256)));
+		}
 	}
-	newRegistersToUpdate |= 1u << WriteCoolConf;
+}
+
+#endif
+
+void TmcDriverState::SetStallDetectFilter(bool sgFilter)
+{
+	UpdateRegister(WriteCoolConf, (sgFilter) ? writeRegisters[WriteCoolConf] | COOLCONF_SGFILT : writeRegisters[WriteCoolConf] & ~COOLCONF_SGFILT);
 }
 
 void TmcDriverState::SetStallMinimumStepsPerSecond(unsigned int stepsPerSecond)
 {
 	UpdateRegister(WriteTcoolthrs, (12000000 + (128 * stepsPerSecond))/(256 * stepsPerSecond));
+	maxSgValidInterval = StepTimer::StepClockRate/stepsPerSecond;
 }
 
 void TmcDriverState::AppendStallConfig(const StringRef& reply) const
@@ -787,23 +1143,44 @@ void TmcDriverState::AppendStallConfig(const StringRef& reply) const
 	}
 	reply.catf("stall threshold %d, filter %s, steps/sec %" PRIu32 ", coolstep %" PRIx32,
 				threshold, ((filtered) ? "on" : "off"), 12000000 / (256 * writeRegisters[WriteTcoolthrs]), writeRegisters[WriteCoolConf] & 0xFFFF);
+	AppendCurrentScaling(reply);
 }
 
-void TmcDriverState::GetSpiCommand(uint8_t *sendDataBlock)
+// Set up the command for the transfer in the specified slot. The transfer in the other slot may still be in progress.
+void TmcDriverState::GetSpiCommand(uint8_t *sendDataBlock, size_t slot)
 {
+	// If the other slot is writing a register then we mustn't send that one again, and if it has been changed since then we must leave it flagged
+	// in newRegistersToUpdate so that TransferSucceeded for the other slot doesn't mark it as up to date.
+	const uint8_t otherRegIndex = regIndexBeingUpdated[slot ^ 1];
+	const uint32_t registerInFlight = (otherRegIndex < NumWriteRegisters) ? 1u << otherRegIndex : 0;
+
 	// Find which register to send. The common case is when no registers need to be updated.
 	{
 		TaskCriticalSectionLocker lock;
-		registersToUpdate |= newRegistersToUpdate;
-		newRegistersToUpdate = 0;
+		registersToUpdate |= newRegistersToUpdate & ~registerInFlight;
+		newRegistersToUpdate &= registerInFlight;
 	}
 
-	if (registersToUpdate == 0)
+	const uint32_t registersToSend = registersToUpdate & ~registerInFlight;
+
+#if SUPPORT_PHASE_STEPPING
+	// In direct mode we write the coil currents in most transfers. Register writes come first, and we read a register now and again so that we still see the driver status.
+	if (registersToSend == 0 && IsDirectMode() && ++directModeSequence % DirectModeRegisterInterval != 0)
+	{
+		regIndexBeingUpdated[slot] = regIndexRequested[slot] = NoRegIndex;
+		sendDataBlock[0] = REGNUM_XDIRECT | 0x80;
+		StoreBE32(sendDataBlock + 1, GetCoilCurrents());
+		return;
+	}
+#endif
+
+	if (registersToSend == 0)
 	{
 		// Read a register
-		regIndexBeingUpdated = NoRegIndex;
-		regIndexRequested = (regIndexRequested >= NumReadRegisters - 1) ? 0 : regIndexRequested + 1;
-		sendDataBlock[0] = ReadRegNumbers[regIndexRequested];
+		regIndexBeingUpdated[slot] = NoRegIndex;
+		regIndexRequested[slot] = ReadSequence[readSequenceIndex];
+		readSequenceIndex = (readSequenceIndex + 1) % ReadSequenceLength;
+		sendDataBlock[0] = ReadRegNumbers[regIndexRequested[slot]];
 		sendDataBlock[1] = 0;
 		sendDataBlock[2] = 0;
 		sendDataBlock[3] = 0;
@@ -812,24 +1189,51 @@ void TmcDriverState::GetSpiCommand(uint8_t *sendDataBlock)
 	else
 	{
 		// Write a register
-		const size_t regNum = LowestSetBit(registersToUpdate);
-		regIndexBeingUpdated = regNum;
+		const size_t regNum = LowestSetBit(registersToSend);
+		regIndexBeingUpdated[slot] = regNum;
+		regIndexRequested[slot] = NoRegIndex;
 		sendDataBlock[0] = WriteRegNumbers[regNum] | 0x80;
 		StoreBE32(sendDataBlock + 1, writeRegisters[regNum]);
 	}
 }
 
-void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock)
+#if SUPPORT_PHASE_STEPPING
+
+// Calculate the coil currents from the position that the motor should have reached when the transfer we are setting up completes.
+// The electrical angle follows the level of the DIR pin, so that the motor turns the same way as it does in step/dir mode.
+uint32_t TmcDriverState::GetCoilCurrents()
+{
+	int32_t position = GetMoveInstance().GetLiveMotorPosition(axisNumber, StepTimer::GetTimerTicks() + DirectModeLeadTicks, 1u << microstepShiftFactor);
+	if (Platform::GetDirectionValue(driverNumber) != (ACTIVE_HIGH_DIR != 0))
+	{
+		position = -position;
+	}
+	if (!directPhaseValid)
+	{
+		directPhaseOffset = (int32_t)(readRegisters[ReadMsCnt] & 1023) - position;
+		directPhaseValid = true;
+	}
+	++numCoilWrites;
+	return CoilCurrents((uint32_t)(position + directPhaseOffset), (moving) ? 255 : standstillAmplitude);
+}
+
+#endif
+
+// Process the data received in the transfer in the specified slot. The transfers complete in the order that they were set up.
+// 'whenCompleted' is the step clock when the transfer completed, which we use to timestamp stall reports.
+void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock, size_t slot, uint32_t whenCompleted)
 {
 	// If we wrote a register, mark it up to date
-	if (regIndexBeingUpdated < NumWriteRegisters)
+	const uint8_t regIndexWritten = regIndexBeingUpdated[slot];
+	if (regIndexWritten < NumWriteRegisters)
 	{
-		registersToUpdate &= ~(1u << regIndexBeingUpdated);
+		registersToUpdate &= ~(1u << regIndexWritten);
 		++numWrites;
 	}
 
 	// Get the full step interval, we will need it later
 	const uint32_t interval = GetMoveInstance().GetStepInterval(axisNumber, microstepShiftFactor);		// get the full step interval
+	moving = (interval != 0);
 
 	// If we read a register, update our copy
 	if (previousRegIndexRequested < NumReadRegisters)
@@ -839,6 +1243,8 @@ void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock)
 		if (previousRegIndexRequested == ReadDrvStat)
 		{
 			// We treat the DRV_STATUS register separately
+			const bool sgValid = (regVal & TMC_RR_STST) == 0 && interval != 0 && interval <= maxSgValidInterval;
+			AdjustRunCurrent(sgValid, regVal & TMC_RR_SGRESULT);
 			if ((regVal & TMC_RR_STST) == 0)							// in standstill, SG_RESULT returns the chopper on-time instead
 			{
 				const uint32_t sgResult = regVal & TMC_RR_SGRESULT;
@@ -877,10 +1283,22 @@ void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock)
 		}
 	}
 
+#if SUPPORT_ENCODERS
+	// When we zero X_ENC, record the motor position so that we can calculate the position error. An X_ENC value that arrives in the same transfer was read before the write.
+	if (regIndexWritten == WriteXEnc)
+	{
+		motorPositionAtEncoderZero = GetMoveInstance().GetMotorPosition(axisNumber);
+		encoderPositionValid = false;
+	}
+	else if (previousRegIndexRequested == ReadXEnc)
+	{
+		encoderPositionValid = true;
+	}
+#endif
+
 	// Deal with the stall status
-	if (   (rcvDataBlock[0] & (1u << 2)) != 0							// if the status indicates stalled
-		&& interval != 0
-	   )
+	const bool nowStalled = (rcvDataBlock[0] & (1u << 2)) != 0 && interval != 0;	// if the status indicates stalled
+	if (nowStalled)
 	{
 		readRegisters[ReadDrvStat] |= TMC_RR_SG;
 		accumulatedReadRegisters[ReadDrvStat] |= TMC_RR_SG;
@@ -890,24 +1308,47 @@ void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock)
 		readRegisters[ReadDrvStat] &= ~TMC_RR_SG;
 	}
 
-	previousRegIndexRequested = (regIndexBeingUpdated == NoRegIndex) ? regIndexRequested : NoRegIndex;
+	// If an input monitor is watching this driver, tell it when the stall status changes so that it can tell the main board and stop any local drivers bound to it
+	if (nowStalled != stalled)
+	{
+		stalled = nowStalled;
+		if (InputMonitor::IsMonitoringStall(driverNumber))
+		{
+			InputMonitor::DriverStallChanged(driverNumber, nowStalled, whenCompleted);
+		}
+	}
+
+	// The data for the register we requested in this transfer comes back in the next one
+	previousRegIndexRequested = (regIndexWritten == NoRegIndex) ? regIndexRequested[slot] : NoRegIndex;
+	regIndexBeingUpdated[slot] = regIndexRequested[slot] = NoRegIndex;		// this slot is no longer in use
 }
 
 void TmcDriverState::TransferFailed()
 {
-	regIndexRequested = previousRegIndexRequested = NoRegIndex;
+	for (size_t slot = 0; slot < NumTransferSlots; ++slot)
+	{
+		regIndexBeingUpdated[slot] = regIndexRequested[slot] = NoRegIndex;
+	}
+	previousRegIndexRequested = NoRegIndex;
 }
 
 // State structures for all drivers
 static TmcDriverState driverStates[MaxSmartDrivers];
 
 // TMC51xx management task
-static Task<TmcTaskStackWords> tmcTask;
+static Task<StackSizes::TmcTaskWords> tmcTask;
 
-static uint8_t sendData[5 * MaxSmartDrivers];
-static uint8_t rcvData[5 * MaxSmartDrivers];
+static uint8_t sendData[NumTransferSlots][5 * MaxSmartDrivers];
+static uint8_t rcvData[NumTransferSlots][5 * MaxSmartDrivers];
 
-static DmaCallbackReason dmaFinishedReason;
+// The DMA complete callback starts the next transfer immediately if the task has already set it up, so that while the motors are moving we poll the drivers
+// back to back. We can't chain the transfers using linked DMA descriptors, because CS must go high between them to make the drivers latch the data.
+static volatile DmaCallbackReason dmaFinishedReasons[NumTransferSlots];
+static volatile uint32_t whenTransfersCompleted[NumTransferSlots];	// the step clock when the transfer in each slot completed
+static volatile uint32_t numTransfersCompleted = 0;			// incremented by the DMA complete callback
+static volatile bool transferRunning = false;				// true while a transfer is in progress
+static volatile bool nextTransferReady = false;				// true if the task has set up the next transfer and wants the DMA complete callback to start it
+static volatile uint8_t runningSlot = 0;					// the slot used by the transfer that is in progress or most recently completed
 
 #if DEBUG_DRIVER_TIMEOUT
 static uint8_t lastFailureStatus;
@@ -918,8 +1359,8 @@ static uint16_t lastRxBytesTransferred;
 static uint32_t lastFailureDmaActiveStatus;
 #endif
 
-// Set up the PDC or DMAC to send a register and receive the status, but don't enable it yet
-static void SetupDMA()
+// Set up the PDC or DMAC to send a register and receive the status using the buffers for the specified slot, but don't enable it yet
+static void SetupDMA(size_t slot)
 {
 #if SAME70
 	/* From the data sheet:
@@ -978,9 +1419,9 @@ static void SetupDMA()
 						| XDMAC_CC_SAM_FIXED_AM
 						| XDMAC_CC_DAM_INCREMENTED_AM
 						| XDMAC_CC_PERID(TMC51xx_DmaRxPerid);
-		p_cfg.mbr_ubc = ARRAY_SIZE(rcvData);
+		p_cfg.mbr_ubc = ARRAY_SIZE(rcvData[slot]);
 		p_cfg.mbr_sa = reinterpret_cast<uint32_t>(&(USART_TMC51xx->US_RHR));
-		p_cfg.mbr_da = reinterpret_cast<uint32_t>(rcvData);
+		p_cfg.mbr_da = reinterpret_cast<uint32_t>(rcvData[slot]);
 		xdmac_configure_transfer(XDMAC, DmacChanTmcRx, &p_cfg);
 	}
 
@@ -998,8 +1439,8 @@ static void SetupDMA()
 						| XDMAC_CC_SAM_INCREMENTED_AM
 						| XDMAC_CC_DAM_FIXED_AM
 						| XDMAC_CC_PERID(TMC51xx_DmaTxPerid);
-		p_cfg.mbr_ubc = ARRAY_SIZE(sendData);
-		p_cfg.mbr_sa = reinterpret_cast<uint32_t>(sendData);
+		p_cfg.mbr_ubc = ARRAY_SIZE(sendData[slot]);
+		p_cfg.mbr_sa = reinterpret_cast<uint32_t>(sendData[slot]);
 		p_cfg.mbr_da = reinterpret_cast<uint32_t>(&(USART_TMC51xx->US_THR));
 		xdmac_configure_transfer(XDMAC, DmacChanTmcTx, &p_cfg);
 	}
@@ -1009,14 +1450,18 @@ static void SetupDMA()
 	DmacManager::DisableChannel(TmcTxDmaChannel);
 	DmacManager::SetTriggerSourceSercomRx(TmcRxDmaChannel, SERCOM_TMC51xx_NUMBER);
 	DmacManager::SetTriggerSourceSercomTx(TmcTxDmaChannel, SERCOM_TMC51xx_NUMBER);
+	DmacManager::SetDestinationAddress(TmcRxDmaChannel, rcvData[slot]);
+	DmacManager::SetDataLength(TmcRxDmaChannel, ARRAY_SIZE(rcvData[slot]));		// this also adjusts the destination address
+	DmacManager::SetSourceAddress(TmcTxDmaChannel, sendData[slot]);
+	DmacManager::SetDataLength(TmcTxDmaChannel, ARRAY_SIZE(sendData[slot]));		// this also adjusts the source address
 #else
 	spiPdc->PERIPH_PTCR = (PERIPH_PTCR_RXTDIS | PERIPH_PTCR_TXTDIS);		// disable the PDC
 
-	spiPdc->PERIPH_TPR = reinterpret_cast<uint32_t>(sendData);
-	spiPdc->PERIPH_TCR = ARRAY_SIZE(sendData);
+	spiPdc->PERIPH_TPR = reinterpret_cast<uint32_t>(sendData[slot]);
+	spiPdc->PERIPH_TCR = ARRAY_SIZE(sendData[slot]);
 
-	spiPdc->PERIPH_RPR = reinterpret_cast<uint32_t>(rcvData);
-	spiPdc->PERIPH_RCR = ARRAY_SIZE(rcvData);
+	spiPdc->PERIPH_RPR = reinterpret_cast<uint32_t>(rcvData[slot]);
+	spiPdc->PERIPH_RCR = ARRAY_SIZE(rcvData[slot]);
 #endif
 }
 
@@ -1096,24 +1541,74 @@ static inline void EnableEndOfTransferInterrupt()
 #endif
 }
 
+// Start a transfer using the buffers for the specified slot. Called from the TMC task with interrupts disabled, or from the DMA complete callback.
+// On the SAME51 the only way I have found to get reliable transfers and no timeouts is to disable SPI, enable DMA, and then enable SPI.
+// Enabling SPI before DMA sometimes results in timeouts.
+// Unfortunately, when we disable SPI the SCLK line floats. Therefore we disable SPI for as little time as possible.
+static void StartTransfer(size_t slot)
+{
+	SetupDMA(slot);										// set up the PDC or DMAC
+	dmaFinishedReasons[slot] = DmaCallbackReason::none;
+	runningSlot = slot;
+	transferRunning = true;
+
+	fastDigitalWriteLow(GlobalTmc51xxCSPin);			// set CS low
+	EnableEndOfTransferInterrupt();
+	ResetSpi();
+	EnableDma();
+	EnableSpi();
+}
+
+// Stop any transfer that is in progress and don't start another one
+static void StopTransfers()
+{
+	{
+		InterruptCriticalSectionLocker lock;
+		nextTransferReady = false;
+		transferRunning = false;
+		DisableEndOfTransferInterrupt();
+	}
+	DisableDma();
+	fastDigitalWriteHigh(GlobalTmc51xxCSPin);			// set CS high
+}
+
 // DMA complete callback
 void RxDmaCompleteCallback(CallbackParameter param, DmaCallbackReason reason)
 {
 #if SAME70
 	xdmac_channel_disable_interrupt(XDMAC, DmacChanTmcRx, 0xFFFFFFFF);
 #endif
-	dmaFinishedReason = reason;
 	fastDigitalWriteHigh(GlobalTmc51xxCSPin);			// set CS high
+	const size_t slot = runningSlot;
+	dmaFinishedReasons[slot] = reason;
+	whenTransfersCompleted[slot] = StepTimer::GetTimerTicks();
+	transferRunning = false;
+	++numTransfersCompleted;
+
+	// If the task has already set up the next transfer, start it now. The CS high time before we set it low again is well above the minimum.
+	if (nextTransferReady && reason == DmaCallbackReason::complete)
+	{
+		nextTransferReady = false;
+		StartTransfer(slot ^ 1);
+		TmcDriverState::TransferChained();
+	}
 	tmcTask.GiveFromISR();
 }
 
 extern "C" [[noreturn]] void TmcLoop(void *)
 {
-	bool timedOut = true;
+	size_t slot = 0;									// the slot used by the transfer we are waiting for
+	bool running = false;								// true if we have started the transfer in that slot and not yet processed its results
+	uint32_t transfersProcessed = 0;					// the value of numTransfersCompleted when we last processed a transfer
 	for (;;)
 	{
 		if (driversState == DriversState::noPower)
 		{
+			if (running)
+			{
+				StopTransfers();
+				running = false;
+			}
 			TaskBase::Take();
 		}
 		else
@@ -1126,73 +1621,67 @@ extern "C" [[noreturn]] void TmcLoop(void *)
 				}
 				driversState = DriversState::initialising;
 			}
-			else if (!timedOut)
+
+			// If no transfer is in progress then start one. Driver 0 is the first in the SPI chain so we must write them in reverse order.
+			if (!running)
 			{
-				// Handle the read response - data comes out of the drivers in reverse driver order
-				const uint8_t *readPtr = rcvData + 5 * numTmc51xxDrivers;
-				for (size_t drive = 0; drive < numTmc51xxDrivers; ++drive)
+				uint8_t *writeBufPtr = sendData[slot] + 5 * numTmc51xxDrivers;
+				for (size_t i = 0; i < numTmc51xxDrivers; ++i)
 				{
-					readPtr -= 5;
-					driverStates[drive].TransferSucceeded(readPtr);
+					writeBufPtr -= 5;
+					driverStates[i].GetSpiCommand(writeBufPtr, slot);
 				}
 
-				if (driversState == DriversState::initialising)
-				{
-					// If all drivers that share the global enable have been initialised, set the global enable
-					bool allInitialised = true;
-					for (size_t i = 0; i < numTmc51xxDrivers; ++i)
-					{
-						if (driverStates[i].UpdatePending())
-						{
-							allInitialised = false;
-							break;
-						}
-					}
-
-					if (allInitialised)
-					{
-						fastDigitalWriteLow(GlobalTmc51xxEnablePin);
-						driversState = DriversState::ready;
-					}
-				}
+				TaskCriticalSectionLocker lock;
+				InterruptCriticalSectionLocker lock2;
+				transfersProcessed = numTransfersCompleted;
+				StartTransfer(slot);
+				running = true;
 			}
 
-			// Set up data to write. Driver 0 is the first in the SPI chain so we must write them in reverse order.
-			uint8_t *writeBufPtr = sendData + 5 * numTmc51xxDrivers;
-			for (size_t i = 0; i < numTmc51xxDrivers; ++i)
+			// If any motors are moving or there are registers to write, set up the next transfer so that it can start as soon as this one completes.
+			// Otherwise we only need to poll the drivers occasionally.
+			bool busy = (driversState != DriversState::ready) || GetMoveInstance().GetCurrentDDA() != nullptr;
+			for (size_t drive = 0; drive < numTmc51xxDrivers && !busy; ++drive)
 			{
-				writeBufPtr -= 5;
-				driverStates[i].GetSpiCommand(writeBufPtr);
+				busy = driverStates[drive].NeedsPolling();
 			}
 
-			// Kick off a transfer.
-			// On the SAME51 the only way I have found to get reliable transfers and no timeouts is to disable SPI, enable DMA, and then enable SPI.
-			// Enabling SPI before DMA sometimes results in timeouts.
-			// Unfortunately, when we disable SPI the SCLK line floats. Therefore we disable SPI for as little time as possible.
+			const size_t nextSlot = slot ^ 1;
+			bool nextPrepared = false;
+			if (busy)
 			{
-				TaskCriticalSectionLocker lock;
-
-				SetupDMA();											// set up the PDC or DMAC
-				dmaFinishedReason = DmaCallbackReason::none;
-
-				InterruptCriticalSectionLocker lock2;
+				uint8_t *writeBufPtr = sendData[nextSlot] + 5 * numTmc51xxDrivers;
+				for (size_t i = 0; i < numTmc51xxDrivers; ++i)
+				{
+					writeBufPtr -= 5;
+					driverStates[i].GetSpiCommand(writeBufPtr, nextSlot);
+				}
+				nextPrepared = true;
 
-				fastDigitalWriteLow(GlobalTmc51xxCSPin);			// set CS low
-				xTaskNotifyStateClear(nullptr);
-				EnableEndOfTransferInterrupt();
-				ResetSpi();
-				EnableDma();
-				EnableSpi();
+				InterruptCriticalSectionLocker lock;
+				if (transferRunning)
+				{
+					nextTransferReady = true;					// the DMA complete callback will start it
+				}
 			}
 
-			// Wait for the end-of-transfer interrupt
-			timedOut = TaskBase::Take(TransferTimeout);
-			DisableEndOfTransferInterrupt();
+			// Wait for the transfer to complete. We may get extra wakeups, so check the completion count.
+			bool timedOut = false;
+			while (numTransfersCompleted == transfersProcessed)
+			{
+				if (TaskBase::Take(TransferTimeout) == 0 && numTransfersCompleted == transfersProcessed)
+				{
+					timedOut = true;
+					break;
+				}
+			}
+			const DmaCallbackReason finishedReason = dmaFinishedReasons[slot];
 
 #if DEBUG_DRIVER_TIMEOUT
-			if (timedOut || dmaFinishedReason != DmaCallbackReason::complete)
+			if (timedOut || finishedReason != DmaCallbackReason::complete)
 			{
-				lastFailureStatus = (uint8_t)dmaFinishedReason;
+				lastFailureStatus = (uint8_t)finishedReason;
 				if (timedOut)
 				{
 					lastFailureStatus |= 0x80;
@@ -1202,23 +1691,97 @@ extern "C" [[noreturn]] void TmcLoop(void *)
 				lastFailureDmaActiveStatus = DMAC->ACTIVE.reg;
 			}
 #endif
-			DisableDma();
-			if (timedOut || dmaFinishedReason != DmaCallbackReason::complete)
+			if (timedOut || finishedReason != DmaCallbackReason::complete)
 			{
 #if DEBUG_DRIVER_TIMEOUT
 				lastTxBytesTransferred = DmacManager::GetBytesTransferred(TmcTxDmaChannel);
 				lastRxBytesTransferred = DmacManager::GetBytesTransferred(TmcRxDmaChannel);
 #endif
+				StopTransfers();
+				running = false;
 				TmcDriverState::TransferTimedOut();
 				// If the transfer was interrupted then we will have written dud data to the drivers. So we should re-initialise them all.
 				// Unfortunately registers that we don't normally write to may have changed too.
 				fastDigitalWriteHigh(GlobalTmc51xxEnablePin);
-				fastDigitalWriteHigh(GlobalTmc51xxCSPin);			// set CS high
+				whenInitialisationStarted = StepTimer::GetTimerTicks();
 				driversState = DriversState::notInitialised;
 				for (size_t drive = 0; drive < numTmc51xxDrivers; ++drive)
 				{
 					driverStates[drive].TransferFailed();
 				}
+				continue;
+			}
+
+			++transfersProcessed;
+			Tracer::Record(Tracer::Event::tmcTransfer, 0xFFFF);
+
+			// If we set up the next transfer too late for the DMA complete callback to start it, start it now
+			if (nextPrepared)
+			{
+				TaskCriticalSectionLocker lock;
+				InterruptCriticalSectionLocker lock2;
+				if (!transferRunning && runningSlot != nextSlot)
+				{
+					StartTransfer(nextSlot);
+				}
+			}
+			else
+			{
+				DisableDma();
+			}
+
+			// Handle the read response - data comes out of the drivers in reverse driver order
+			const uint8_t *readPtr = rcvData[slot] + 5 * numTmc51xxDrivers;
+			for (size_t drive = 0; drive < numTmc51xxDrivers; ++drive)
+			{
+				readPtr -= 5;
+				driverStates[drive].TransferSucceeded(readPtr, slot, whenTransfersCompleted[slot]);
+			}
+
+			if (driversState == DriversState::initialising)
+			{
+				// If all drivers that share the global enable have been initialised, set the global enable
+				bool allInitialised = true;
+				for (size_t i = 0; i < numTmc51xxDrivers; ++i)
+				{
+					if (driverStates[i].UpdatePending())
+					{
+						allInitialised = false;
+						break;
+					}
+				}
+
+				if (allInitialised)
+				{
+					fastDigitalWriteLow(GlobalTmc51xxEnablePin);
+					driversState = DriversState::ready;
+					InitialisationCompleted();
+				}
+			}
+
+			slot = nextSlot;
+			running = nextPrepared;
+			if (!running)
+			{
+				// No motors are moving and there are no registers to write, so we don't need to poll the drivers continuously.
+				// Wait until it's time to poll them again, but check every tick so that we respond quickly when a move starts or a register changes.
+				for (uint32_t ticks = 0; ticks < StandstillPollInterval && GetMoveInstance().GetCurrentDDA() == nullptr; ++ticks)
+				{
+					bool busyNow = false;
+					for (size_t drive = 0; drive < numTmc51xxDrivers; ++drive)
+					{
+						if (driverStates[drive].NeedsPolling())
+						{
+							busyNow = true;
+							break;
+						}
+					}
+					if (busyNow || driversState != DriversState::ready)
+					{
+						break;
+					}
+					delay(1);
+				}
 			}
 		}
 	}
@@ -1280,14 +1843,14 @@ void SmartDrivers::Init()
 	DmacManager::SetBtctrl(TmcRxDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
 								| DMAC_BTCTRL_DSTINC | DMAC_BTCTRL_STEPSEL_DST | DMAC_BTCTRL_STEPSIZE_X1);
 	DmacManager::SetSourceAddress(TmcRxDmaChannel, &(SERCOM_TMC51xx->SPI.DATA.reg));
-	DmacManager::SetDestinationAddress(TmcRxDmaChannel, rcvData);
-	DmacManager::SetDataLength(TmcRxDmaChannel, ARRAY_SIZE(rcvData));
+	DmacManager::SetDestinationAddress(TmcRxDmaChannel, rcvData[0]);
+	DmacManager::SetDataLength(TmcRxDmaChannel, ARRAY_SIZE(rcvData[0]));
 
 	DmacManager::SetBtctrl(TmcTxDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
 								| DMAC_BTCTRL_SRCINC | DMAC_BTCTRL_STEPSEL_SRC | DMAC_BTCTRL_STEPSIZE_X1);
-	DmacManager::SetSourceAddress(TmcTxDmaChannel, sendData);
+	DmacManager::SetSourceAddress(TmcTxDmaChannel, sendData[0]);
 	DmacManager::SetDestinationAddress(TmcTxDmaChannel, &(SERCOM_TMC51xx->SPI.DATA.reg));
-	DmacManager::SetDataLength(TmcTxDmaChannel, ARRAY_SIZE(sendData));
+	DmacManager::SetDataLength(TmcTxDmaChannel, ARRAY_SIZE(sendData[0]));
 
 	DmacManager::SetInterruptCallback(TmcRxDmaChannel, RxDmaCompleteCallback, 0U);
 
@@ -1328,6 +1891,9 @@ void SmartDrivers::Init()
 #endif
 
 	driversState = DriversState::noPower;
+#if SUPPORT_PHASE_STEPPING
+	InitSineTable();
+#endif
 	for (size_t driver = 0; driver < numTmc51xxDrivers; ++driver)
 	{
 		driverStates[driver].Init(driver);
@@ -1381,6 +1947,11 @@ uint32_t SmartDrivers::GetAccumulatedStatus(size_t driver, uint32_t bitsToKeep)
 	return (driver < numTmc51xxDrivers) ? driverStates[driver].ReadAccumulatedStatus(bitsToKeep) : 0;
 }
 
+uint32_t SmartDrivers::GetCompactStatus(size_t driver)
+{
+	return (driver < numTmc51xxDrivers) ? driverStates[driver].GetCompactStatus() : 0;
+}
+
 // Set microstepping and microstep interpolation
 bool SmartDrivers::SetMicrostepping(size_t driver, unsigned int microsteps, bool interpolate)
 {
@@ -1424,6 +1995,28 @@ DriverMode SmartDrivers::GetDriverMode(size_t driver)
 	return (driver < numTmc51xxDrivers) ? driverStates[driver].GetDriverMode() : DriverMode::unknown;
 }
 
+#if SUPPORT_ENCODERS
+
+bool SmartDrivers::SetEncoderCountsPerStep(size_t driver, float counts)
+{
+	return driver < numTmc51xxDrivers && driverStates[driver].SetEncoderCountsPerStep(counts);
+}
+
+float SmartDrivers::GetEncoderCountsPerStep(size_t driver)
+{
+	return (driver < numTmc51xxDrivers) ? driverStates[driver].GetEncoderCountsPerStep() : 0.0;
+}
+
+void SmartDrivers::AppendEncoderStatus(size_t driver, const StringRef& reply)
+{
+	if (driver < numTmc51xxDrivers)
+	{
+		driverStates[driver].AppendEncoderStatus(reply);
+	}
+}
+
+#endif
+
 // Flag that the the drivers have been powered up or down
 // Before the first call to this function with 'powered' true, you must call Init()
 void SmartDrivers::Spin(bool powered)
@@ -1434,6 +2027,7 @@ void SmartDrivers::Spin(bool powered)
 	{
 		if (driversState == DriversState::noPower)
 		{
+			whenInitialisationStarted = StepTimer::GetTimerTicks();
 			driversState = DriversState::notInitialised;
 			tmcTask.Give();									// wake up the TMC task because the drivers need to be initialised
 		}
@@ -1446,6 +2040,11 @@ void SmartDrivers::Spin(bool powered)
 }
 
 // This is called from the tick ISR, possibly while Spin (with powered either true or false) is being executed
+bool SmartDrivers::AreDriversReady()
+{
+	return driversState == DriversState::ready;
+}
+
 void SmartDrivers::TurnDriversOff()
 {
 	digitalWrite(GlobalTmc51xxEnablePin, true);				// disable the drivers
@@ -1476,6 +2075,11 @@ void SmartDrivers::SetStallMinimumStepsPerSecond(size_t driver, unsigned int ste
 	}
 }
 
+bool SmartDrivers::SetCurrentScaling(size_t driver, unsigned int minPercent, uint16_t sgLowerLimit, uint16_t sgUpperLimit)
+{
+	return driver < numTmc51xxDrivers && driverStates[driver].SetCurrentScaling(minPercent, sgLowerLimit, sgUpperLimit);
+}
+
 void SmartDrivers::AppendStallConfig(size_t driver, const StringRef& reply)
 {
 	if (driver < numTmc51xxDrivers)
@@ -1493,6 +2097,10 @@ void SmartDrivers::AppendDriverStatus(size_t driver, const StringRef& reply)
 	if (driver < numTmc51xxDrivers)
 	{
 		driverStates[driver].AppendDriverStatus(reply, driver + 1 == numTmc51xxDrivers);
+		if (driver + 1 == numTmc51xxDrivers)
+		{
+			AppendInitialisationTimes(reply);
+		}
 	}
 
 #if DEBUG_DRIVER_TIMEOUT
@@ -29,6 +29,7 @@ namespace SmartDrivers
 	void Init();
 	void Spin(bool powered);
 	void TurnDriversOff();
+	bool AreDriversReady();									// true if the drivers are powered and initialised, so that the enable pin may be active
 
 	void SetAxisNumber(size_t driver, uint32_t axisNumber);
 	uint32_t GetAxisNumber(size_t drive);
@@ -36,6 +37,7 @@ namespace SmartDrivers
 	void EnableDrive(size_t driver, bool en);
 	uint32_t GetLiveStatus(size_t driver);
 	uint32_t GetAccumulatedStatus(size_t drive, uint32_t bitsToKeep);
+	uint32_t GetCompactStatus(size_t drive);
 	bool SetMicrostepping(size_t drive, unsigned int microsteps, bool interpolation);
 	unsigned int GetMicrostepping(size_t drive, bool& interpolation);
 	bool SetDriverMode(size_t driver, unsigned int mode);
@@ -44,11 +46,17 @@ namespace SmartDrivers
 	void SetStallFilter(size_t driver, bool sgFilter);
 	void SetStallMinimumStepsPerSecond(size_t driver, unsigned int stepsPerSecond);
 	void AppendStallConfig(size_t driver, const StringRef& reply);
+	bool SetCurrentScaling(size_t driver, unsigned int minPercent, uint16_t sgLowerLimit, uint16_t sgUpperLimit);
 	void AppendDriverStatus(size_t driver, const StringRef& reply);
 	float GetStandstillCurrentPercent(size_t driver);
 	void SetStandstillCurrentPercent(size_t driver, float percent);
 	bool SetRegister(size_t driver, SmartDriverRegister reg, uint32_t regVal);
 	uint32_t GetRegister(size_t driver, SmartDriverRegister reg);
+#if SUPPORT_ENCODERS
+	bool SetEncoderCountsPerStep(size_t driver, float counts);
+	float GetEncoderCountsPerStep(size_t driver);
+	void AppendEncoderStatus(size_t driver, const StringRef& reply);
+#endif
 };
 
 #endif
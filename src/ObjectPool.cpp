@@ -0,0 +1,131 @@
+/*
+ * ObjectPool.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "ObjectPool.h"
+#include <RTOSIface/RTOSIface.h>
+
+ObjectPool *ObjectPool::pools = nullptr;
+
+ObjectPool::ObjectPool(const char *p_name) : name(p_name), numUnpooled(0)
+{
+	for (SizeClass& sc : sizeClasses)
+	{
+		sc.freeList = nullptr;
+		sc.size = 0;
+		sc.numAllocated = sc.numInUse = sc.maxInUse = 0;
+	}
+	next = pools;
+	pools = this;
+}
+
+// Find the size class for blocks of this size, optionally creating it. The caller must stop other tasks running.
+ObjectPool::SizeClass *ObjectPool::FindSizeClass(size_t size, bool create)
+{
+	for (SizeClass& sc : sizeClasses)
+	{
+		if (sc.size == size)
+		{
+			return &sc;
+		}
+		if (sc.size == 0)
+		{
+			if (!create)
+			{
+				break;
+			}
+			sc.size = size;
+			return &sc;
+		}
+	}
+	return nullptr;
+}
+
+void *ObjectPool::Allocate(size_t size)
+{
+	size = RoundUpSize(size);
+	{
+		TaskCriticalSectionLocker lock;
+
+		SizeClass * const sc = FindSizeClass(size, true);
+		if (sc == nullptr)
+		{
+			++numUnpooled;
+		}
+		else
+		{
+			++sc->numInUse;
+			if (sc->numInUse > sc->maxInUse)
+			{
+				sc->maxInUse = sc->numInUse;
+			}
+			FreeBlock * const block = sc->freeList;
+			if (block != nullptr)
+			{
+				sc->freeList = block->next;
+				return block;
+			}
+			++sc->numAllocated;
+		}
+	}
+
+	// There was no free block, so take one from the heap. We don't do this in the critical section because malloc takes its own mutex.
+	return ::operator new(size);
+}
+
+void ObjectPool::Release(void *p, size_t size)
+{
+	if (p == nullptr)
+	{
+		return;
+	}
+
+	size = RoundUpSize(size);
+	{
+		TaskCriticalSectionLocker lock;
+
+		SizeClass * const sc = FindSizeClass(size, false);
+		if (sc != nullptr)
+		{
+			FreeBlock * const block = static_cast<FreeBlock*>(p);
+			block->next = sc->freeList;
+			sc->freeList = block;
+			--sc->numInUse;
+			return;
+		}
+		--numUnpooled;
+	}
+	::operator delete(p);
+}
+
+// Report the usage of all the pools. For each size we report the number of blocks in use, the most that have been in use at once, and the number taken from the heap.
+/*static*/ void ObjectPool::Diagnostics(const StringRef& reply)
+{
+	reply.lcat("Pools (size in use/max/allocated):");
+	for (const ObjectPool *pool = pools; pool != nullptr; pool = pool->next)
+	{
+		reply.catf(" %s", pool->name);
+		bool none = true;
+		for (const SizeClass& sc : pool->sizeClasses)
+		{
+			if (sc.size != 0)
+			{
+				reply.catf(" %u %u/%u/%u", sc.size, sc.numInUse, sc.maxInUse, sc.numAllocated);
+				none = false;
+			}
+		}
+		if (pool->numUnpooled != 0)
+		{
+			reply.catf(" unpooled %" PRIu32, pool->numUnpooled);
+		}
+		else if (none)
+		{
+			reply.cat(" none");
+		}
+	}
+}
+
+// End
@@ -0,0 +1,58 @@
+/*
+ * ObjectPool.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  Pools for objects that are created and deleted when the main board reconfigures us, such as fans, heaters and temperature sensors.
+ *  A pool keeps a free list for each object size that it has allocated. Deleted objects go on the free list for their size instead of back to the heap,
+ *  so reconfiguring the same objects repeatedly re-uses the same memory instead of fragmenting the heap, and allocation takes a bounded time.
+ *  Memory is taken from the heap when a free list is empty, so a pool only uses as much RAM as the most objects of each size that have existed at once.
+ */
+
+#ifndef SRC_OBJECTPOOL_H_
+#define SRC_OBJECTPOOL_H_
+
+#include "RepRapFirmware.h"
+
+class ObjectPool
+{
+public:
+	explicit ObjectPool(const char *p_name);
+
+	ObjectPool(const ObjectPool&) = delete;
+
+	void *Allocate(size_t size);					// allocate a block, may be called from any task
+	void Release(void *p, size_t size);				// release a block, the size must be the one that it was allocated with
+
+	static void Diagnostics(const StringRef& reply);	// report the usage of all the pools
+
+private:
+	static constexpr size_t MaxSizeClasses = 6;		// blocks of other sizes are allocated on the heap and returned to it when they are released
+
+	struct FreeBlock
+	{
+		FreeBlock *next;
+	};
+
+	struct SizeClass
+	{
+		FreeBlock *freeList;
+		uint16_t size;								// the block size in bytes, or 0 if this size class is unused
+		uint16_t numAllocated;						// the number of blocks of this size taken from the heap
+		uint16_t numInUse;
+		uint16_t maxInUse;
+	};
+
+	static size_t RoundUpSize(size_t size) { return (size + 7) & ~(size_t)7; }
+	SizeClass *FindSizeClass(size_t size, bool create);
+
+	ObjectPool *next;
+	const char *name;
+	uint32_t numUnpooled;							// the number of blocks in use that we allocated on the heap because we ran out of size classes
+	SizeClass sizeClasses[MaxSizeClasses];
+
+	static ObjectPool *pools;
+};
+
+#endif /* SRC_OBJECTPOOL_H_ */
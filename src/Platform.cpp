@@ -12,14 +12,26 @@
 #include <Hardware/AnalogOut.h>
 #include <Hardware/Serial.h>
 #include <Movement/Move.h>
+#include <Movement/Kinematics/LinearDeltaKinematics.h>
 #include "Movement/StepperDrivers/TMC51xx.h"
 #include "Movement/StepperDrivers/TMC22xx.h"
 #include <atmel_start.h>
 #include <Config/peripheral_clk_config.h>
 #include "AdcAveragingFilter.h"
 #include "Movement/StepTimer.h"
+#include "Movement/StepBurstGenerator.h"
+#include "Movement/StepPulseTimer.h"
 #include <CAN/CanInterface.h>
 #include "Tasks.h"
+#include "Tracer.h"
+#include "SoftwareReset.h"
+#include "StartupProfiler.h"
+#include "WarmRestart.h"
+#include "Hardware/NvmWriter.h"
+#include "Hardware/AdcCalibration.h"
+#include "CAN/RemoteConsole.h"
+#include "Movement/MoveReplay.h"
+#include "Benchmarks.h"
 #include "Heating/Heat.h"
 #include "Heating/Sensors/TemperatureSensor.h"
 #include "Fans/FansManager.h"
@@ -35,21 +47,25 @@ static Uart uart0(3, SERCOM3_0_IRQn);
 
 extern "C" void SERCOM3_0_Handler()
 {
+	IsrTimer timer(IsrId::uart);
 	uart0.Interrupt();
 }
 
 extern "C" void SERCOM3_1_Handler()
 {
+	IsrTimer timer(IsrId::uart);
 	uart0.Interrupt();
 }
 
 extern "C" void SERCOM3_2_Handler()
 {
+	IsrTimer timer(IsrId::uart);
 	uart0.Interrupt();
 }
 
 extern "C" void SERCOM3_3_Handler()
 {
+	IsrTimer timer(IsrId::uart);
 	uart0.Interrupt();
 }
 
@@ -63,6 +79,7 @@ static Uart uart0(4, SERCOM4_IRQn);
 
 extern "C" void SERCOM4_Handler()
 {
+	IsrTimer timer(IsrId::uart);
 	uart0.Interrupt();
 }
 
@@ -102,11 +119,6 @@ namespace Platform
 # endif
 #endif
 
-#if !SINGLE_DRIVER
-	uint32_t driveDriverBits[NumDrivers];
-	uint32_t allDriverBits = 0;
-#endif
-
 	static bool directions[NumDrivers];
 	static bool driverAtIdleCurrent[NumDrivers];
 	static int8_t enableValues[NumDrivers] = { 0 };
@@ -115,7 +127,14 @@ namespace Platform
 #endif
 	static float stepsPerMm[NumDrivers];
 	static float motorCurrents[NumDrivers];
+#if HAS_SMART_DRIVERS
+	static float stealthChopSpeeds[NumDrivers];				// the speed in mm/sec above which we leave stealthChop, or zero to use the TPWMTHRS register as set
+	static float coolStepSpeeds[NumDrivers];				// the speed in mm/sec above which coolStep and stall detection are active, or zero to use TCOOLTHRS as set
+#endif
 	static float pressureAdvance[NumDrivers];
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+	static float pressureAdvanceSmoothing[NumDrivers];		// the extruder velocity smoothing time in seconds, or zero for normal pressure advance
+#endif
 	static float idleCurrentFactor;
 
 	static volatile uint16_t currentVin, highestVin, lowestVin;
@@ -162,6 +181,26 @@ namespace Platform
 	static uint8_t nextDriveToPoll;
 #endif
 
+#if SUPPORT_DRIVER_TEMPERATURE_ESTIMATION
+	// Estimated driver temperatures. The drivers only tell us when they pass the warning and shutdown temperatures, so we model each driver
+	// as a first order thermal system heated by the square of its current, starting from the MCU temperature. The live status from the
+	// latest SPI or UART transfer corrects the estimate whenever it disagrees with the warning flag, and corrects the heating factor too.
+	constexpr uint32_t DriverTemperatureUpdateInterval = 100;	// milliseconds
+	constexpr float DriverWarningTemperature = 120.0;			// the temperature at which the drivers set the OTPW flag
+	constexpr float DriverShutdownTemperature = 150.0;			// the temperature at which the drivers set the OT flag and turn off
+	constexpr float DriverThermalTimeConstant = 30.0;			// seconds
+	constexpr float InitialDriverHeatingFactor = 15.0;			// the steady state temperature rise in C per amp squared before we have corrected it
+	constexpr float MinDriverHeatingFactor = 2.0;
+	constexpr float MaxDriverHeatingFactor = 200.0;
+	constexpr float DriverHeatingFactorDecrease = 0.98;			// how much we reduce the heating factor each time the warning flag shows that we estimated too high
+
+	static float driverTemperatures[NumDrivers];
+	static float driverHeatingFactors[NumDrivers];
+	static DriversBitmap enabledDrivers;
+	static uint32_t lastDriverTemperatureUpdate = 0;
+	static uint32_t numDriverTemperatureCorrections = 0;
+#endif
+
 #if HAS_SMART_DRIVERS && HAS_VOLTAGE_MONITOR
 	bool warnDriversNotPowered;
 #endif
@@ -183,8 +222,50 @@ namespace Platform
 		return (uint16_t)(voltage * ((1u << AnalogIn::AdcBits)/VinMonitorVoltageRange));
 	}
 
+# if HAS_12V_MONITOR
+	inline constexpr float AdcReadingToV12Voltage(uint16_t adcVal)
+	{
+		return adcVal * (V12MonitorVoltageRange/(1u << AnalogIn::AdcBits));
+	}
+# endif
+
 	constexpr uint16_t driverPowerOnAdcReading = PowerVoltageToAdcReading(10.0);			// minimum voltage at which we initialise the drivers
 	constexpr uint16_t driverPowerOffAdcReading = PowerVoltageToAdcReading(9.5);			// voltages below this flag the drivers as unusable
+	constexpr float PowerRestoredHysteresis = 0.5;											// how far VIN must rise above the power fail voltage before we treat the power as restored
+
+	// Power fail monitoring. We check every VIN reading against the threshold instead of waiting for Spin to look at the averaged voltage.
+	// On the SAME51 the ADC window monitor also interrupts as soon as a conversion is below the threshold, without waiting for the end of the round.
+	static volatile uint16_t powerFailAdcReading = 0;		// VIN readings below this mean the power is failing, 0 means we are not monitoring it
+	static uint16_t powerRestoredAdcReading = 0;			// VIN readings at or above this mean the power has been restored
+	static volatile bool powerFailing = false;
+	static StandardCallbackFunction powerFailCallback = nullptr;
+	static CallbackParameter powerFailCallbackParam;
+
+	// Check a VIN reading against the power fail thresholds. Called from the ADC task for every VIN reading, and from the ADC window monitor ISR.
+	static void CheckVinReading(uint16_t reading)
+	{
+		AtomicCriticalSectionLocker lock;
+		const uint16_t failReading = powerFailAdcReading;
+		if (failReading != 0 && ((powerFailing) ? reading >= powerRestoredAdcReading : reading < failReading))
+		{
+			powerFailing = !powerFailing;
+			if (powerFailCallback != nullptr)
+			{
+				powerFailCallback(powerFailCallbackParam);
+			}
+		}
+	}
+
+	static void VinReadingCallback(CallbackParameter cp, uint16_t reading)
+	{
+		vinFilter.ProcessReading(reading);
+		CheckVinReading(reading);
+	}
+
+	static void VinWindowMonitorCallback(CallbackParameter cp, uint16_t reading)
+	{
+		CheckVinReading(reading);
+	}
 
 #endif
 
@@ -249,6 +330,17 @@ namespace Platform
 	// Send the specified message to the specified destinations. The Error and Warning flags have already been handled.
 	void RawMessage(MessageType type, const char *message)
 	{
+#if SUPPORT_REMOTE_CONSOLE
+		RemoteConsole::Write(message);
+#endif
+
+		// When using DMA the message is queued without blocking, or discarded if there is no room, so that debug output doesn't affect timing
+		if (uart0.IsTxDmaEnabled())
+		{
+			(void)uart0.TryPutMessage("{\"message\":\"", message, "\"}\n");
+			return;
+		}
+
 		MutexLocker lock(messageMutex);
 
 		uart0.PutString("{\"message\":\"");
@@ -291,6 +383,13 @@ namespace Platform
 #endif
 
 		StepTimer::Init();										// initialise the step pulse timer CAN1
+		Tracer::Init();											// this needs the step timer
+#if SUPPORT_STEP_BURSTS
+		StepBurstGenerator::Init();								// initialise the hardware step burst generator
+#endif
+#if SUPPORT_STEP_PULSE_TIMER
+		StepPulseTimer::Init();									// initialise the hardware step pulse timer for slow drivers
+#endif
 	}
 
 	[[noreturn]] RAMFUNC static void EraseAndReset()
@@ -334,6 +433,9 @@ namespace Platform
 
 	static void ShutdownAll()
 	{
+#if SUPPORT_WARM_RESTART
+		WarmRestart::Discard();							// the main board will configure us again after this reset
+#endif
 #if SUPPORT_TMC51xx
 		IoPort::WriteDigital(GlobalTmc51xxEnablePin, true);
 #endif
@@ -342,6 +444,7 @@ namespace Platform
 #endif
 		Heat::SwitchOffAll();
 		DisableAllDrives();
+		NvmWriter::Flush();								// the motors are off, so we can write any settings that are still queued
 		delay(10);										// allow existing processing to complete, drivers to be turned off and CAN replies to be sent
 		CanInterface::Shutdown();
 		digitalWrite(DiagLedPin, false);				// turn the DIAG LED off
@@ -392,15 +495,13 @@ namespace Platform
 
 void Platform::SoftwareReset(uint16_t reason, const uint32_t *stk)
 {
-#if defined(SAME51)
-	//TODO save reset data in NVM
-	//	qq;
-#elif defined(SAMC21)
-	//TODO save reset data in NVM
-	//	qq;
-#else
-# error Unsupported processor
-#endif
+	Tracer::Record(Tracer::Event::softwareReset, reason);
+
+	// Save the reset data in the EEPROM so that we can report it after the reset, even if the board is power cycled in the meantime.
+	// It is static because we may be here because the stack overflowed.
+	static SoftwareResetData srData;
+	srData.Populate(reason, millis(), stk);
+	srData.Save();
 	ResetProcessor();
 }
 
@@ -454,7 +555,34 @@ void Platform::Init()
 	gpio_set_pin_function(PortAPin(12), PINMUX_PA12D_SERCOM4_PAD0);		// TxD
 #endif
 
-	uart0.Init(256, 0, 57600, 3);
+	uart0.Init(256, 0, 57600, 3, true);
+	StartupProfiler::RecordStage(StartupStage::ioInit);
+
+	// Bring up CAN and announce ourselves as early as we can, so that the main board processes our announcement while we initialise the rest of the board.
+	// The step timer and interrupt priorities must be set up first, because the CAN receiver task timestamps messages and enables the CAN interrupt as soon as it starts.
+#if HAS_ADDRESS_SWITCHES
+	// Set up the board ID switch inputs
+	for (unsigned int i = 0; i < 4; ++i)
+	{
+		IoPort::SetPinMode(BoardAddressPins[i], INPUT_PULLUP);
+	}
+	delayMicroseconds(10);										// give the pullup resistors time to charge the switch inputs
+#endif
+
+#if defined(SAME51)
+
+	// Check whether address switches are set to zero. If so then reset and load new firmware
+	const CanAddress switches = ReadBoardAddress();
+	const CanAddress defaultAddress = (switches == 0) ? CanId::ExpansionBoardFirmwareUpdateAddress : switches;
+
+#elif defined(SAMC21)
+
+	constexpr CanAddress defaultAddress = CanId::ToolBoardDefaultAddress;
+
+#endif
+	InitialiseInterrupts();
+	CanInterface::Init(defaultAddress);
+	StartupProfiler::RecordStage(StartupStage::canInit);
 
 	// Initialise the rest of the IO subsystem
 	AnalogIn::Init();
@@ -465,28 +593,20 @@ void Platform::Init()
 	ADC_temperature_init();
 #endif
 
-#if HAS_ADDRESS_SWITCHES
-	// Set up the board ID switch inputs
-	for (unsigned int i = 0; i < 4; ++i)
-	{
-		IoPort::SetPinMode(BoardAddressPins[i], INPUT_PULLUP);
-	}
-#endif
-
 	// Set up VIN voltage monitoring
 	currentVin = highestVin = 0;
 	lowestVin = 9999;
 	numUnderVoltageEvents = previousUnderVoltageEvents = numOverVoltageEvents = previousOverVoltageEvents = 0;
 
 	vinFilter.Init(0);
-	AnalogIn::EnableChannel(VinMonitorPin, vinFilter.CallbackFeedIntoFilter, &vinFilter, 1, false);
+	AnalogIn::EnableChannel(VinMonitorPin, VinReadingCallback, CallbackParameter(), 0, false);		// read VIN on every round so that we detect power failure quickly
 
 #if HAS_12V_MONITOR
 	currentV12 = highestV12 = 0;
 	lowestV12 = 9999;
 
 	v12Filter.Init(0);
-	AnalogIn::EnableChannel(V12MonitorPin, v12Filter.CallbackFeedIntoFilter, &v12Filter, 1, false);
+	AnalogIn::EnableChannel(V12MonitorPin, v12Filter.CallbackFeedIntoFilter, &v12Filter, 0, false);
 #endif
 
 #if HAS_VREF_MONITOR
@@ -516,15 +636,16 @@ void Platform::Init()
 
 #if defined(SAME51)
 	tpFilter.Init(0);
-	AnalogIn::EnableTemperatureSensor(0, tpFilter.CallbackFeedIntoFilter, &tpFilter, 1, 0);
+	AnalogIn::EnableTemperatureSensor(0, tpFilter.CallbackFeedIntoFilter, &tpFilter, McuTempReadingInterval, 0);
 	tcFilter.Init(0);
-	AnalogIn::EnableTemperatureSensor(1, tcFilter.CallbackFeedIntoFilter, &tcFilter, 1, 0);
+	AnalogIn::EnableTemperatureSensor(1, tcFilter.CallbackFeedIntoFilter, &tcFilter, McuTempReadingInterval, 0);
 #elif defined(SAMC21)
 	tsensFilter.Init(0);
-	AnalogIn::EnableTemperatureSensor(tsensFilter.CallbackFeedIntoFilter, &tsensFilter, 1);
+	AnalogIn::EnableTemperatureSensor(tsensFilter.CallbackFeedIntoFilter, &tsensFilter, McuTempReadingInterval);
 #else
 # error Unsupported processor
 #endif
+	StartupProfiler::RecordStage(StartupStage::adcInit);
 
 #if HAS_BUTTONS
 	for (size_t i = 0; i < NumButtons; ++i)
@@ -536,6 +657,14 @@ void Platform::Init()
 	// Initialise stepper drivers
 #if HAS_SMART_DRIVERS
 	SmartDrivers::Init();
+# if SUPPORT_DRIVER_TEMPERATURE_ESTIMATION
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		driverTemperatures[driver] = ROOM_TEMPERATURE;
+		driverHeatingFactors[driver] = InitialDriverHeatingFactor;
+	}
+	enabledDrivers.Clear();
+# endif
 	temperatureShutdownDrivers.Clear();
 	temperatureWarningDrivers.Clear();
 	shortToGroundDrivers.Clear();
@@ -572,20 +701,19 @@ void Platform::Init()
 # endif
 		IoPort::SetHighDriveStrength(EnablePins[i]);
 		driverIsEnabled[i] = false;
-#endif
-#if !SINGLE_DRIVER
-		const uint32_t driverBit = 1u << (StepPins[i] & 31);
-		driveDriverBits[i] = driverBit;
-		allDriverBits |= driverBit;
 #endif
 		stepsPerMm[i] = DefaultStepsPerMm;
 		directions[i] = true;
 		driverAtIdleCurrent[i] = false;
 		motorCurrents[i] = 0.0;
 		pressureAdvance[i] = 0.0;
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+		pressureAdvanceSmoothing[i] = 0.0;
+#endif
 
 #if HAS_SMART_DRIVERS
 		SmartDrivers::SetMicrostepping(i, 16, true);
+		stealthChopSpeeds[i] = coolStepSpeeds[i] = 0.0;
 #endif
 	}
 
@@ -604,21 +732,7 @@ void Platform::Init()
 #if HAS_SMART_DRIVERS && HAS_VOLTAGE_MONITOR
 	warnDriversNotPowered = false;
 #endif
-
-#if defined(SAME51)
-
-	// Check whether address switches are set to zero. If so then reset and load new firmware
-	const CanAddress switches = ReadBoardAddress();
-	const CanAddress defaultAddress = (switches == 0) ? CanId::ExpansionBoardFirmwareUpdateAddress : switches;
-
-#elif defined(SAMC21)
-
-	constexpr CanAddress defaultAddress = CanId::ToolBoardDefaultAddress;
-
-#endif
-	CanInterface::Init(defaultAddress);
-
-	InitialiseInterrupts();
+	StartupProfiler::RecordStage(StartupStage::driversInit);
 
 	// Read the unique ID
 	for (unsigned int i = 0; i < 4; ++i)
@@ -632,6 +746,7 @@ void Platform::Init()
 	uniqueId[4] ^= (uniqueId[4] >> 10);
 
 	lastPollTime = millis();
+	StartupProfiler::RecordStage(StartupStage::platformInit);
 }
 
 void Platform::Spin()
@@ -665,11 +780,42 @@ void Platform::Spin()
 		}
 	}
 
+	NvmWriter::Spin();
+#if HAS_VREF_MONITOR
+	AdcCalibration::Spin();
+#endif
+
 	// Get the VIN voltage
-	currentVin = vinFilter.GetSum()/vinFilter.NumAveraged();
+	uint32_t vinSum;
+	const bool vinValid = vinFilter.GetSnapshot(vinSum);
+	currentVin = vinSum/vinFilter.NumAveraged();
+	if (vinValid)
+	{
+		if (currentVin > highestVin)
+		{
+			highestVin = currentVin;
+		}
+		if (currentVin < lowestVin)
+		{
+			lowestVin = currentVin;
+		}
+	}
 	const float voltsVin = (currentVin * VinMonitorVoltageRange)/(1u << AnalogIn::AdcBits);
 #if HAS_12V_MONITOR
-	currentV12 = v12Filter.GetSum()/v12Filter.NumAveraged();
+	uint32_t v12Sum;
+	const bool v12Valid = v12Filter.GetSnapshot(v12Sum);
+	currentV12 = v12Sum/v12Filter.NumAveraged();
+	if (v12Valid)
+	{
+		if (currentV12 > highestV12)
+		{
+			highestV12 = currentV12;
+		}
+		if (currentV12 < lowestV12)
+		{
+			lowestV12 = currentV12;
+		}
+	}
 	const float volts12 = (currentV12 * V12MonitorVoltageRange)/(1u << AnalogIn::AdcBits);
 	if (!powered && voltsVin >= 10.5 && volts12 >= 10.5)
 	{
@@ -697,6 +843,12 @@ void Platform::Spin()
 
 	// Thermostatically-controlled fans (do this after getting TMC driver status)
 	const uint32_t now = millis();
+#if SUPPORT_DRIVER_TEMPERATURE_ESTIMATION
+	if (now - lastDriverTemperatureUpdate >= DriverTemperatureUpdateInterval)
+	{
+		UpdateDriverTemperatures(now);
+	}
+#endif
 	const bool checkSensors = (now - lastFanCheckTime >= FanCheckInterval);
 	(void)FansManager::CheckFans(checkSensors);
 	if (checkSensors)
@@ -832,40 +984,42 @@ void Platform::Spin()
 	}
 #endif
 
-	if (now - lastPollTime > 2000)
-	{
-		lastPollTime = now;
-
-		// Get the chip temperature
+	// Get the chip temperature. We do this on every call so that the MCU temperature sensor is as fresh as the other sensors.
 #if defined(SAME51)
-		if (tcFilter.IsValid() && tpFilter.IsValid())
-		{
-			// From the datasheet:
-			// T = (tl * vph * tc - th * vph * tc - tl * tp *vch + th * tp * vcl)/(tp * vcl - tp * vch - tc * vpl * tc * vph)
-			const uint16_t tc_result = tcFilter.GetSum()/(tcFilter.NumAveraged() << (AnalogIn::AdcBits - 12));
-			const uint16_t tp_result = tpFilter.GetSum()/(tpFilter.NumAveraged() << (AnalogIn::AdcBits - 12));
-
-			int32_t result =  (tempCalF1 * tc_result - tempCalF2 * tp_result);
-			const int32_t divisor = (tempCalF3 * tp_result - tempCalF4 * tc_result);
-			result = (divisor == 0) ? 0 : result/divisor;
-			currentMcuTemperature = (float)result/16 + mcuTemperatureAdjust;
+	uint32_t tcSum, tpSum;
+	if (tcFilter.GetSnapshot(tcSum) && tpFilter.GetSnapshot(tpSum))
+	{
+		// From the datasheet:
+		// T = (tl * vph * tc - th * vph * tc - tl * tp *vch + th * tp * vcl)/(tp * vcl - tp * vch - tc * vpl * tc * vph)
+		const uint16_t tc_result = tcSum/(tcFilter.NumAveraged() << (AnalogIn::AdcBits - 12));
+		const uint16_t tp_result = tpSum/(tpFilter.NumAveraged() << (AnalogIn::AdcBits - 12));
+
+		int32_t result =  (tempCalF1 * tc_result - tempCalF2 * tp_result);
+		const int32_t divisor = (tempCalF3 * tp_result - tempCalF4 * tc_result);
+		result = (divisor == 0) ? 0 : result/divisor;
+		currentMcuTemperature = (float)result/16 + mcuTemperatureAdjust;
 #elif defined(SAMC21)
-		if (tsensFilter.IsValid())
-		{
-			const int16_t temperatureTimes100 = (int16_t)((uint16_t)(tsensFilter.GetSum()/tsensFilter.NumAveraged()) ^ (1u << 15));
-			currentMcuTemperature = (float)temperatureTimes100 * 0.01;
+	uint32_t tsensSum;
+	if (tsensFilter.GetSnapshot(tsensSum))
+	{
+		const int16_t temperatureTimes100 = (int16_t)((uint16_t)(tsensSum/tsensFilter.NumAveraged()) ^ (1u << 15));
+		currentMcuTemperature = (float)temperatureTimes100 * 0.01;
 #else
 # error Unsupported processor
 #endif
-			if (currentMcuTemperature < lowestMcuTemperature)
-			{
-				lowestMcuTemperature = currentMcuTemperature;
-			}
-			if (currentMcuTemperature > highestMcuTemperature)
-			{
-				highestMcuTemperature = currentMcuTemperature;
-			}
+		if (currentMcuTemperature < lowestMcuTemperature)
+		{
+			lowestMcuTemperature = currentMcuTemperature;
+		}
+		if (currentMcuTemperature > highestMcuTemperature)
+		{
+			highestMcuTemperature = currentMcuTemperature;
 		}
+	}
+
+	if (now - lastPollTime > 2000)
+	{
+		lastPollTime = now;
 
 		static unsigned int nextSensor = 0;
 
@@ -947,26 +1101,6 @@ ThermistorAveragingFilter *Platform::GetAdcFilter(unsigned int filterNumber)
 	return &thermistorFilters[filterNumber];
 }
 
-ThermistorAveragingFilter *Platform::GetVssaFilter(unsigned int filterNumber)
-{
-#ifdef SAMC21
-	// The SDADC channel has INN connected to VSSA and no separate VSSA monitor
-	return (filterNumber < NumThermistorInputs) ? &thermistorFilters[VssaFilterIndex] : nullptr;
-#else
-	return &thermistorFilters[VssaFilterIndex];
-#endif
-}
-
-ThermistorAveragingFilter *Platform::GetVrefFilter(unsigned int filterNumber)
-{
-#ifdef SAMC21
-	// The SDADC channel has a separate VSSA monitor
-	return (filterNumber == SdAdcTemp0FilterIndex) ? &thermistorFilters[SdAdcVrefFilterIndex] : &thermistorFilters[VrefFilterIndex];
-#else
-	return &thermistorFilters[VrefFilterIndex];
-#endif
-}
-
 void Platform::GetMcuTemperatures(float& minTemp, float& currentTemp, float& maxTemp)
 {
 	minTemp = lowestMcuTemperature;
@@ -986,7 +1120,7 @@ uint32_t Platform::GetHeatTaskIdleTicks()
 
 void Platform::HandleHeaterFault(unsigned int heater)
 {
-	//TODO report the heater fault to the main board
+	Heat::RequestImmediateReport();			// the heater status report tells the main board that the heater is in the fault state
 }
 
 void Platform::MessageF(MessageType type, const char *fmt, va_list vargs)
@@ -1033,6 +1167,11 @@ void Platform::Message(MessageType type, const char *message)
 	}
 }
 
+uint32_t Platform::GetAndClearDroppedMessages()
+{
+	return uart0.GetAndClearDroppedMessages();
+}
+
 void Platform::LogError(ErrorCode e)
 {
 	errorCodeBits |= (uint32_t)e;
@@ -1047,6 +1186,18 @@ float Platform::DriveStepsPerUnit(size_t drive) { return stepsPerMm[drive]; }
 
 const float *Platform::GetDriveStepsPerUnit() { return stepsPerMm; }
 
+void Platform::SetDriveStepsPerUnit(size_t drive, float value)
+{
+	stepsPerMm[drive] = value;
+#if HAS_SMART_DRIVERS
+	UpdateSpeedThresholds(drive);
+#endif
+	if (moveInstance->IsDeltaMode())
+	{
+		static_cast<LinearDeltaKinematics&>(moveInstance->GetKinematics()).SetStepsPerMm(drive, value);
+	}
+}
+
 #if SUPPORT_SLOW_DRIVERS
 
 void Platform::SetDriverStepTiming(size_t drive, const float timings[4])
@@ -1058,6 +1209,9 @@ void Platform::SetDriverStepTiming(size_t drive, const float timings[4])
 			slowDriverStepTimingClocks[i] = min<float>(timings[i], 50.0);
 		}
 	}
+#if SUPPORT_STEP_PULSE_TIMER
+	StepPulseTimer::SetPulseClocks(GetSlowDriverStepHighClocks());
+#endif
 #if SINGLE_DRIVER
 	isSlowDriver = true;
 #else
@@ -1077,6 +1231,20 @@ void Platform::SetPressureAdvance(size_t driver, float advance)
 	pressureAdvance[driver] = advance;
 }
 
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+
+float Platform::GetPressureAdvanceSmoothing(size_t driver)
+{
+	return pressureAdvanceSmoothing[driver];
+}
+
+void Platform::SetPressureAdvanceSmoothing(size_t driver, float smoothingTime)
+{
+	pressureAdvanceSmoothing[driver] = smoothingTime;
+}
+
+#endif
+
 void Platform::SetDirectionValue(size_t drive, bool dVal)
 {
 	if (drive < NumDrivers)
@@ -1108,7 +1276,7 @@ void Platform::SetDirection(size_t driver, bool direction)
 # endif
 		if (isSlowDriver)
 		{
-			while (StepTimer::GetTimerTicks() - DDA::lastStepLowTime < GetSlowDriverDirHoldClocks()) { }
+			while ((int32_t)(StepTimer::GetTimerTicks() - DDA::lastStepLowTime) < (int32_t)GetSlowDriverDirHoldClocks()) { }
 		}
 #endif
 		digitalWrite(DirectionPins[driver], d);
@@ -1145,6 +1313,15 @@ int8_t Platform::GetEnableValue(size_t driver)
 	return (driver < NumDrivers) ? enableValues[driver] : 0;
 }
 
+#if !HAS_SMART_DRIVERS
+
+bool Platform::IsDriverEnabled(size_t driver)
+{
+	return driver < NumDrivers && driverIsEnabled[driver];
+}
+
+#endif
+
 void Platform::EnableDrive(size_t driver)
 {
 #if HAS_SMART_DRIVERS
@@ -1154,6 +1331,9 @@ void Platform::EnableDrive(size_t driver)
 		UpdateMotorCurrent(driver);
 	}
 	SmartDrivers::EnableDrive(driver, true);
+# if SUPPORT_DRIVER_TEMPERATURE_ESTIMATION
+	enabledDrivers.SetBit(driver);
+# endif
 #else
 	if (enableValues[driver] >= 0)
 	{
@@ -1166,6 +1346,9 @@ void Platform::DisableDrive(size_t driver)
 {
 #if HAS_SMART_DRIVERS
 	SmartDrivers::EnableDrive(driver, false);
+# if SUPPORT_DRIVER_TEMPERATURE_ESTIMATION
+	enabledDrivers &= ~DriversBitmap::MakeFromBits(driver);
+# endif
 #else
 	if (enableValues[driver] >= 0)
 	{
@@ -1209,6 +1392,51 @@ void Platform::SetMotorCurrent(size_t driver, float current)
 	UpdateMotorCurrent(driver);
 }
 
+unsigned int Platform::GetConfiguredMicrostepping(size_t driver)
+{
+# if SUPPORT_DYNAMIC_MICROSTEPPING
+	return moveInstance->GetConfiguredMicrostepping(driver);
+# else
+	bool dummy;
+	return SmartDrivers::GetMicrostepping(driver, dummy);
+# endif
+}
+
+// Set the speeds in mm/sec at which the driver changes from stealthChop to spreadCycle and at which coolStep and stall detection become active.
+// Zero means leave the corresponding register as it was set directly.
+void Platform::SetChangeoverSpeeds(size_t driver, float stealthChopSpeed, float coolStepSpeed)
+{
+	stealthChopSpeeds[driver] = stealthChopSpeed;
+	coolStepSpeeds[driver] = coolStepSpeed;
+	UpdateSpeedThresholds(driver);
+}
+
+float Platform::GetStealthChopSpeed(size_t driver) { return stealthChopSpeeds[driver]; }
+
+float Platform::GetCoolStepSpeed(size_t driver) { return coolStepSpeeds[driver]; }
+
+// Recalculate the TPWMTHRS and TCOOLTHRS registers of a driver from the configured speeds. The registers hold the time between 1/256 microsteps in
+// driver clocks, which doesn't depend on the microstepping we actually use, so we use the microstepping set by the main board to convert from mm/sec.
+void Platform::UpdateSpeedThresholds(size_t driver)
+{
+	constexpr float DriverClockRate = 12000000.0;			// the nominal frequency of the TMC driver internal clock
+	constexpr uint32_t MaxThresholdReg = (1u << 20) - 1;	// TPWMTHRS and TCOOLTHRS are 20 bits
+	const float fullStepsPerMm = stepsPerMm[driver]/(float)GetConfiguredMicrostepping(driver);
+
+	if (stealthChopSpeeds[driver] > 0.0)
+	{
+		const float tpwmthrs = DriverClockRate/(256.0 * fullStepsPerMm * stealthChopSpeeds[driver]);
+		(void)SmartDrivers::SetRegister(driver, SmartDriverRegister::tpwmthrs, min<uint32_t>(max<uint32_t>(lrintf(tpwmthrs), 1), MaxThresholdReg));
+	}
+
+# if HAS_STALL_DETECT
+	if (coolStepSpeeds[driver] > 0.0)
+	{
+		SmartDrivers::SetStallMinimumStepsPerSecond(driver, max<unsigned int>(lrintf(fullStepsPerMm * coolStepSpeeds[driver]), 1));
+	}
+# endif
+}
+
 #endif
 
 #if HAS_ADDRESS_SWITCHES
@@ -1228,6 +1456,11 @@ uint8_t Platform::ReadBoardAddress()
 
 #endif
 
+const uint32_t *Platform::GetUniqueId()
+{
+	return uniqueId;
+}
+
 // Append the unique processor ID to a string as 30 base5 alphanumeric digits with 5 embedded separators
 void Platform::AppendUniqueId(const StringRef& str)
 {
@@ -1278,6 +1511,76 @@ void Platform::AppendUniqueId(const StringRef& str)
 }
 
 #if HAS_SMART_DRIVERS
+
+# if SUPPORT_DRIVER_TEMPERATURE_ESTIMATION
+
+// Update the estimated driver temperatures from the motor currents and the driver status from the latest transfer
+void Platform::UpdateDriverTemperatures(uint32_t now)
+{
+	const float alpha = min<float>((float)(now - lastDriverTemperatureUpdate) * (0.001/DriverThermalTimeConstant), 1.0);
+	lastDriverTemperatureUpdate = now;
+	const float ambient = currentMcuTemperature;
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		const float amps = (enabledDrivers.IsBitSet(driver))
+							? ((driverAtIdleCurrent[driver]) ? motorCurrents[driver] * idleCurrentFactor : motorCurrents[driver]) * 0.001
+								: 0.0;
+		float& temperature = driverTemperatures[driver];
+		temperature += (ambient + driverHeatingFactors[driver] * fsquare(amps) - temperature) * alpha;
+
+		const uint32_t stat = (enableValues[driver] >= 0) ? SmartDrivers::GetLiveStatus(driver) : 0;
+		if ((stat & (TMC_RR_OT | TMC_RR_OTPW)) != 0)
+		{
+			if (temperature < DriverWarningTemperature)
+			{
+				// The driver got hotter than we estimated, so it heats up faster than we thought
+				if (temperature > ambient + 1.0)
+				{
+					driverHeatingFactors[driver] = min<float>(driverHeatingFactors[driver] * (DriverWarningTemperature - ambient)/(temperature - ambient), MaxDriverHeatingFactor);
+				}
+				temperature = DriverWarningTemperature;
+				++numDriverTemperatureCorrections;
+			}
+			if ((stat & TMC_RR_OT) != 0)
+			{
+				temperature = max<float>(temperature, DriverShutdownTemperature);
+			}
+		}
+		else if (temperature > DriverWarningTemperature && (stat & TMC_RR_STST) == 0)
+		{
+			// The driver is cooler than we estimated
+			driverHeatingFactors[driver] = max<float>(driverHeatingFactors[driver] * DriverHeatingFactorDecrease, MinDriverHeatingFactor);
+			temperature = DriverWarningTemperature;
+			++numDriverTemperatureCorrections;
+		}
+	}
+}
+
+// Get the highest estimated driver temperature
+float Platform::GetTmcDriversTemperature()
+{
+	const DriversBitmap mask = DriversBitmap::MakeLowestNBits(MaxSmartDrivers);
+	float highest = (temperatureShutdownDrivers.Intersects(mask)) ? DriverShutdownTemperature : 0.0;
+	for (size_t driver = 0; driver < MaxSmartDrivers; ++driver)
+	{
+		highest = max<float>(highest, driverTemperatures[driver]);
+	}
+	return highest;
+}
+
+void Platform::AppendDriverTemperatures(const StringRef& reply)
+{
+	reply.lcat("Estimated driver temperatures:");
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		reply.catf(" %u:%.0fC (%.1fC/A^2)", driver, (double)driverTemperatures[driver], (double)driverHeatingFactors[driver]);
+	}
+	reply.catf(", corrections %" PRIu32, numDriverTemperatureCorrections);
+	numDriverTemperatureCorrections = 0;
+}
+
+# else
+
 // TMC driver temperatures
 float Platform::GetTmcDriversTemperature()
 {
@@ -1286,6 +1589,9 @@ float Platform::GetTmcDriversTemperature()
 			: (temperatureWarningDrivers.Intersects(mask)) ? 100.0
 				: 0.0;
 }
+
+# endif
+
 #endif
 
 void Platform::Tick()
@@ -1310,6 +1616,28 @@ void Platform::StartReset()
 	ShutdownAndReset();
 }
 
+// Disable the drivers and stop any movement straight away. This is called from the CAN ISR when an emergency stop arrives, so it mustn't take locks or wait.
+// EmergencyStop does the rest when the receiver task gets to the message.
+void Platform::EmergencyStopDrivers()
+{
+#if SUPPORT_TMC51xx
+	IoPort::WriteDigital(GlobalTmc51xxEnablePin, true);
+#endif
+#if SUPPORT_TMC22xx
+	IoPort::WriteDigital(GlobalTmc22xxEnablePin, true);
+#endif
+#if !HAS_SMART_DRIVERS
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		DisableDrive(driver);
+	}
+#endif
+	if (moveInstance != nullptr)					// we announce ourselves before Move has been created
+	{
+		moveInstance->StopDrivers((1u << NumDrivers) - 1);
+	}
+}
+
 // This is called when we start processing any CAN message except for regular messages e.g. time sync
 void Platform::OnProcessingCanMessage()
 {
@@ -1337,6 +1665,23 @@ GCodeResult Platform::DoDiagnosticTest(const CanMessageDiagnosticTest& msg, cons
 		deferredCommand = DeferredCommand::testDivideByZero;
 		return GCodeResult::ok;
 
+	case 1005:	// time the core calculation kernels
+		return Benchmarks::Run(reply);
+
+#if SUPPORT_MOVE_REPLAY
+	case 1010:
+		return MoveReplay::StartRecording(reply);
+
+	case 1011:
+		return MoveReplay::SaveRecording(reply);
+
+	case 1012:
+		return MoveReplay::StartReplay(reply);
+
+	case 1013:
+		return MoveReplay::GetResults(reply);
+#endif
+
 	default:
 		reply.printf("Unknown test type %u", msg.testType);
 		return GCodeResult::error;
@@ -1361,23 +1706,57 @@ float Platform::GetMaxVinVoltage()
 	return AdcReadingToPowerVoltage(highestVin);
 }
 
+// Start monitoring for power failure, replacing any existing monitor. Return true if the ADC window monitor is being used, false if we only check the reading at the end of each round.
+bool Platform::SetPowerFailMonitor(float failVoltage, StandardCallbackFunction fn, CallbackParameter cbp)
+{
+	const uint16_t failReading = PowerVoltageToAdcReading(failVoltage);
+	{
+		AtomicCriticalSectionLocker lock;
+		powerFailCallback = fn;
+		powerFailCallbackParam = cbp;
+		powerRestoredAdcReading = PowerVoltageToAdcReading(failVoltage + PowerRestoredHysteresis);
+		powerFailAdcReading = failReading;
+		powerFailing = currentVin < failReading;
+	}
+	return AnalogIn::EnableWindowMonitor(VinMonitorPin, failReading, VinWindowMonitorCallback, CallbackParameter(), false);
+}
+
+// Stop monitoring for power failure, if the monitor is the one with this callback parameter
+void Platform::ClearPowerFailMonitor(CallbackParameter cbp)
+{
+	if (powerFailAdcReading != 0 && powerFailCallbackParam.vp == cbp.vp)
+	{
+		AnalogIn::DisableWindowMonitor(VinMonitorPin, false);
+		AtomicCriticalSectionLocker lock;
+		powerFailAdcReading = 0;
+		powerFailCallback = nullptr;
+		powerFailing = false;
+	}
+}
+
+// Return true if we are monitoring for power failure and VIN has fallen below the threshold and not yet recovered
+bool Platform::IsPowerFailing()
+{
+	return powerFailing;
+}
+
 #endif
 
 #if HAS_12V_MONITOR
 
 float Platform::GetMinV12Voltage()
 {
-	return AdcReadingToPowerVoltage(lowestV12);
+	return AdcReadingToV12Voltage(lowestV12);
 }
 
 float Platform::GetCurrentV12Voltage()
 {
-	return AdcReadingToPowerVoltage(currentV12);
+	return AdcReadingToV12Voltage(currentV12);
 }
 
 float Platform::GetMaxV12Voltage()
 {
-	return AdcReadingToPowerVoltage(highestV12);
+	return AdcReadingToV12Voltage(highestV12);
 }
 
 #endif
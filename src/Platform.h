@@ -14,13 +14,20 @@
 
 class CanMessageDiagnosticTest;
 
-// Define the number of temperature readings we average for each thermistor. This should be a power of 2 and at least 4 ^ AD_OVERSAMPLE_BITS.
-constexpr size_t ThermistorReadingsAveraged = 64;
+// Define the number of temperature readings we average for each thermistor. The total number averaged should be a power of 2 and at least 4 ^ AD_OVERSAMPLE_BITS.
+// We reject spikes before averaging, so we can average fewer readings than we used to and respond faster to changes in temperature.
+constexpr size_t ThermistorReadingsAveraged = 16;	// the number of entries in the averaging buffer
+constexpr size_t ThermistorReadingsDecimation = 2;	// the number of readings that we add together for each entry, so we average 32 readings
 constexpr size_t ZProbeReadingsAveraged = 8;		// We average this number of readings with IR on, and the same number with IR off
 constexpr size_t McuTempReadingsAveraged = 16;
+constexpr uint32_t McuTempReadingInterval = 50;	// milliseconds between MCU temperature readings, so the averaging buffer covers 0.8 seconds
 constexpr size_t VinReadingsAveraged = 8;
 
-typedef AdcAveragingFilter<ThermistorReadingsAveraged> ThermistorAveragingFilter;
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+constexpr float MaxPressureAdvanceSmoothingTime = 0.1;		// the longest extruder velocity smoothing time in seconds
+#endif
+
+typedef AdcAveragingFilter<ThermistorReadingsAveraged, ThermistorReadingsDecimation, true> ThermistorAveragingFilter;
 typedef AdcAveragingFilter<ZProbeReadingsAveraged> ZProbeAveragingFilter;
 
 #if HAS_VREF_MONITOR
@@ -56,9 +63,35 @@ namespace Platform
 	// The data would ideally be private, but they are used by inline functions so they can't be unless we convert this namespace to a static class
 #if SINGLE_DRIVER
 	constexpr uint32_t DriverBit = 1u << (StepPins[0] & 31);
+	static_assert((StepPins[0] >> 5) == 0, "Step pin must be on StepPio");
 #else
-	extern uint32_t driveDriverBits[NumDrivers];
-	extern uint32_t allDriverBits;
+	// The step pin bits are fixed by the board, so we calculate them at compile time. Then the step ISR sets all the step pins low
+	// using an immediate value, and finds the bit for each drive in a table in flash memory instead of one that Init fills in.
+	constexpr uint32_t CalcAllDriverBits()
+	{
+		uint32_t bits = 0;
+		for (Pin p : StepPins)
+		{
+			bits |= 1u << (p & 31);
+		}
+		return bits;
+	}
+
+	constexpr bool AllStepPinsOnOnePort()
+	{
+		for (Pin p : StepPins)
+		{
+			if ((p >> 5) != 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	constexpr uint32_t AllDriverBits = CalcAllDriverBits();
+	static_assert(AllStepPinsOnOnePort(), "All step pins must be on StepPio");
+	static_assert(__builtin_popcount(AllDriverBits) == NumDrivers, "Each driver must have its own step pin");
 #endif
 
 #if SUPPORT_SLOW_DRIVERS
@@ -90,13 +123,19 @@ namespace Platform
 	void Message(MessageType type, const char *message);
 	void MessageF(MessageType type, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
 	void MessageF(MessageType type, const char *fmt, va_list vargs);
+	uint32_t GetAndClearDroppedMessages();				// messages discarded because the UART transmit buffer was full
 	void LogError(ErrorCode e);
 	bool Debug(Module module);
 
 	float DriveStepsPerUnit(size_t drive);
 	const float *GetDriveStepsPerUnit();
+	void SetDriveStepsPerUnit(size_t drive, float value);
 	float GetPressureAdvance(size_t driver);
 	void SetPressureAdvance(size_t driver, float advance);
+#if SUPPORT_SMOOTHED_PRESSURE_ADVANCE
+	float GetPressureAdvanceSmoothing(size_t driver);
+	void SetPressureAdvanceSmoothing(size_t driver, float smoothingTime);
+#endif
 
 #if SINGLE_DRIVER
 	inline void StepDriverLow()
@@ -122,9 +161,9 @@ namespace Platform
 	inline void StepDriversLow()
 	{
 #if ACTIVE_HIGH_STEP
-		StepPio->OUTCLR.reg = allDriverBits;
+		StepPio->OUTCLR.reg = AllDriverBits;
 #else
-		StepPio->OUTSET.reg = allDriverBits;
+		StepPio->OUTSET.reg = AllDriverBits;
 #endif
 	}
 
@@ -137,7 +176,7 @@ namespace Platform
 #endif
 	}
 
-	inline uint32_t GetDriversBitmap(size_t driver) { return driveDriverBits[driver]; } 		// Get the step bit for this driver
+	constexpr uint32_t GetDriversBitmap(size_t driver) { return 1u << (StepPins[driver] & 31); }	// Get the step bit for this driver
 #endif
 
 	inline unsigned int GetProhibitedExtruderMovements(unsigned int extrusions, unsigned int retractions) { return 0; }
@@ -146,6 +185,9 @@ namespace Platform
 	bool GetDirectionValue(size_t driver);
 	void SetEnableValue(size_t driver, int8_t eVal);
 	int8_t GetEnableValue(size_t driver);
+#if !HAS_SMART_DRIVERS
+	bool IsDriverEnabled(size_t driver);
+#endif
 	void EnableDrive(size_t driver);
 	void DisableDrive(size_t driver);
 	void DisableAllDrives();
@@ -154,12 +196,19 @@ namespace Platform
 #if HAS_SMART_DRIVERS
 	void SetMotorCurrent(size_t driver, float current);		//TODO avoid the int->float->int conversion
 	float GetTmcDriversTemperature();
+# if SUPPORT_DRIVER_TEMPERATURE_ESTIMATION
+	void UpdateDriverTemperatures(uint32_t now);			// called from Spin
+	void AppendDriverTemperatures(const StringRef& reply);
+# endif
+	unsigned int GetConfiguredMicrostepping(size_t driver);	// the microstepping set by the main board, ignoring any dynamic reduction
+	void SetChangeoverSpeeds(size_t driver, float stealthChopSpeed, float coolStepSpeed);
+	float GetStealthChopSpeed(size_t driver);
+	float GetCoolStepSpeed(size_t driver);
+	void UpdateSpeedThresholds(size_t driver);				// call this when the microstepping or steps/mm changes
 #endif
 
 	int GetAveragingFilterIndex(const IoPort&);
 	ThermistorAveragingFilter *GetAdcFilter(unsigned int filterNumber);
-	ThermistorAveragingFilter *GetVssaFilter(unsigned int filterNumber);
-	ThermistorAveragingFilter *GetVrefFilter(unsigned int filterNumber);
 
 	void GetMcuTemperatures(float& minTemp, float& currentTemp, float& maxTemp);
 
@@ -173,6 +222,7 @@ namespace Platform
 #endif
 
 	void AppendUniqueId(const StringRef& str);
+	const uint32_t *GetUniqueId();								// return the four words of the processor's unique ID
 
 	void Tick();
 
@@ -184,6 +234,7 @@ namespace Platform
 	GCodeResult DoDiagnosticTest(const CanMessageDiagnosticTest& msg, const StringRef& reply);
 
 	[[noreturn]]void EmergencyStop();
+	void EmergencyStopDrivers();
 	[[noreturn]]void SoftwareReset(uint16_t reason, const uint32_t *stk = nullptr);
 
 	[[noreturn]]inline void ResetProcessor()
@@ -196,6 +247,11 @@ namespace Platform
 	float GetMinVinVoltage();
 	float GetCurrentVinVoltage();
 	float GetMaxVinVoltage();
+
+	// Fast power failure detection, so that we can act before the drivers lose power. The callback is called from an ISR when the power starts to fail and when it recovers.
+	bool SetPowerFailMonitor(float failVoltage, StandardCallbackFunction fn, CallbackParameter cbp);
+	void ClearPowerFailMonitor(CallbackParameter cbp);
+	bool IsPowerFailing();
 #endif
 
 #if HAS_12V_MONITOR
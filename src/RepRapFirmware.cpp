@@ -7,12 +7,19 @@
 
 #include "RepRapFirmware.h"
 #include "Movement/Move.h"
+#include "Movement/StepTimer.h"
 #include "GCodes/GCodes.h"
 #include "Heating/Heat.h"
 #include "InputMonitors/InputMonitor.h"
 #include "Platform.h"
 #include "CommandProcessing/CommandProcessor.h"
 #include "RTOSIface/RTOSIface.h"
+#include "CAN/CanInterface.h"
+#include "Tracer.h"
+#include "DeferredLog.h"
+#include "StartupProfiler.h"
+#include "WarmRestart.h"
+#include "Accelerometers/AccelerometerHandler.h"
 
 Move *moveInstance;
 
@@ -21,22 +28,94 @@ namespace RepRap
 	static unsigned int heatTaskIdleTicks = 0;
 	static bool resetting = false;
 
+	// Timing of the Spin functions of the subsystems, so that we can see when one of them delays the others
+	enum class SpinModule : uint8_t
+	{
+		platform = 0,
+		gcodes,
+		commandProcessor,
+		numModules
+	};
+
+	static const char * const SpinModuleNames[] = { "Platform", "GCodes", "CommandProcessor" };
+	static_assert(ARRAY_SIZE(SpinModuleNames) == (size_t)SpinModule::numModules, "Spin module names don't match the modules");
+
+	struct SpinTimes
+	{
+		uint64_t totalTicks;
+		uint32_t maxTicks;
+		uint32_t count;
+	};
+
+	constexpr uint32_t DefaultSlowSpinThresholdMillis = 50;
+	constexpr uint32_t SlowSpinReportIntervalMillis = 10000;		// report slow spins no more often than this, so that we don't flood the main board with messages
+
+	static SpinTimes spinTimes[(size_t)SpinModule::numModules] = { 0 };
+	static uint32_t slowSpinThresholdTicks = DefaultSlowSpinThresholdMillis * (StepTimer::StepClockRate/1000);
+	static uint32_t numSlowSpins = 0;
+	static uint32_t whenLastSlowSpinReported = 0;
+	static bool haveReportedSlowSpin = false;
+
+	// Record the time taken by a subsystem's Spin function and return the time at which the next one starts
+	static uint32_t RecordSpinTime(SpinModule module, uint32_t startTicks)
+	{
+		const uint32_t now = StepTimer::GetTimerTicks();
+		const uint32_t ticks = now - startTicks;
+		SpinTimes& st = spinTimes[(size_t)module];
+		st.totalTicks += ticks;
+		++st.count;
+		if (ticks > st.maxTicks)
+		{
+			st.maxTicks = ticks;
+		}
+
+		if (ticks < slowSpinThresholdTicks)
+		{
+			return now;
+		}
+
+		++numSlowSpins;
+		Tracer::Record(Tracer::Event::slowSpin, (uint16_t)module);
+		const uint32_t nowMillis = millis();
+		if (!haveReportedSlowSpin || nowMillis - whenLastSlowSpinReported >= SlowSpinReportIntervalMillis)
+		{
+			Platform::MessageF(WarningMessage, "Board %u: %s spin took %.1fms\n",
+								CanInterface::GetCanAddress(), SpinModuleNames[(size_t)module], (double)((float)ticks * (1000.0f/(float)StepTimer::StepClockRate)));
+			whenLastSlowSpinReported = nowMillis;
+			haveReportedSlowSpin = true;
+		}
+		return StepTimer::GetTimerTicks();										// don't count the time taken to report it against the next subsystem
+	}
+
 	void Init()
 	{
+		DeferredLog::Init();
 		Platform::Init();
 		GCodes::Init();
 		Heat::Init();
 		InputMonitor::Init();
+#if SUPPORT_ACCELEROMETERS
+		AccelerometerHandler::Init();
+#endif
+		StartupProfiler::RecordStage(StartupStage::heatInit);
 		moveInstance = new Move();
 		moveInstance->Init();
+		StartupProfiler::RecordStage(StartupStage::moveInit);
+#if SUPPORT_WARM_RESTART
+		WarmRestart::Init();
+#endif
 	}
 
 	void Spin()
 	{
+		uint32_t startTicks = StepTimer::GetTimerTicks();
 		Platform::Spin();
+		startTicks = RecordSpinTime(SpinModule::platform, startTicks);
 		GCodes::Spin();
+		startTicks = RecordSpinTime(SpinModule::gcodes, startTicks);
 		CommandProcessor::Spin();
-		moveInstance->Spin();
+		(void)RecordSpinTime(SpinModule::commandProcessor, startTicks);
+		DeferredLog::Spin();
 //		//RTOSIface::Yield();
 //		delay(1);
 	}
@@ -68,6 +147,29 @@ namespace RepRap
 #endif
 		}
 	}
+
+	// Report the Spin function times since the last report, then clear them
+	void Diagnostics(const StringRef& reply)
+	{
+		constexpr float MillisPerTick = 1000.0f/(float)StepTimer::StepClockRate;
+		reply.copy("Spin times ms max/avg:");
+		for (size_t i = 0; i < (size_t)SpinModule::numModules; ++i)
+		{
+			SpinTimes& st = spinTimes[i];
+			const float average = (st.count == 0) ? 0.0 : (float)st.totalTicks/(float)st.count;
+			reply.catf(" %s %.2f/%.3f", SpinModuleNames[i], (double)((float)st.maxTicks * MillisPerTick), (double)(average * MillisPerTick));
+			st.totalTicks = 0;
+			st.maxTicks = st.count = 0;
+		}
+		reply.lcatf("Slow spins %" PRIu32 " (threshold %.0fms)", numSlowSpins, (double)((float)slowSpinThresholdTicks * MillisPerTick));
+		numSlowSpins = 0;
+	}
+
+	// Set the time above which a Spin function is reported as slow
+	void SetSlowSpinThreshold(uint32_t millis)
+	{
+		slowSpinThresholdTicks = millis * (StepTimer::StepClockRate/1000);
+	}
 }
 
 void debugPrintf(const char* fmt, ...)
@@ -256,23 +256,6 @@ union CallbackParameter
 
 typedef void (*StandardCallbackFunction)(CallbackParameter);
 
-// Atomic section locker, alternative to InterruptCriticalSectionLocker (is safe to call from within an ISR, and may be faster)
-class AtomicCriticalSectionLocker
-{
-public:
-	AtomicCriticalSectionLocker() : flags(cpu_irq_save())
-	{
-	}
-
-	~AtomicCriticalSectionLocker()
-	{
-		cpu_irq_restore(flags);
-	}
-
-private:
-	irqflags_t flags;
-};
-
 // Macro to give us the number of elements in an array
 #ifndef ARRAY_SIZE
 # define ARRAY_SIZE(_x)	(sizeof(_x)/sizeof(_x[0]))
@@ -291,6 +274,8 @@ namespace RepRap
 	void Init();
 	void Spin();
 	void Tick();
+	void Diagnostics(const StringRef& reply);
+	void SetSlowSpinThreshold(uint32_t millis);
 }
 
 // Module numbers and names, used for diagnostics and debug
@@ -330,6 +315,49 @@ constexpr Pin NoPin = 0xFF;
 
 #include "Config/BoardDef.h"
 
+// Attribute for the functions that the step ISR executes. Running them from RAM makes the ISR time predictable, and it is the worst case ISR time that limits the step rate.
+#if USE_RAM_STEP_PATH
+# define STEP_PATH_RAMFUNC	RAMFUNC
+#else
+# define STEP_PATH_RAMFUNC
+#endif
+
+#if SUPPORT_CRITICAL_SECTION_PROFILING
+
+// Time every critical section that disables interrupts, by call site. Only the outermost section of a nest is timed.
+namespace CriticalSectionProfiler
+{
+	irqflags_t Save(const char *file, unsigned int line);			// disable interrupts and start timing if they were enabled
+	void Restore(irqflags_t flags);									// stop timing if we are about to enable interrupts, then restore them
+	void Diagnostics(const StringRef& reply);						// append the worst call sites to the reply and reset the statistics
+}
+
+# define cpu_irq_save()				CriticalSectionProfiler::Save(__FILE__, __LINE__)
+# define cpu_irq_restore(_flags)	CriticalSectionProfiler::Restore(_flags)
+
+#endif
+
+// Atomic section locker, alternative to InterruptCriticalSectionLocker (is safe to call from within an ISR, and may be faster)
+class AtomicCriticalSectionLocker
+{
+public:
+#if SUPPORT_CRITICAL_SECTION_PROFILING
+	AtomicCriticalSectionLocker(const char *file = __builtin_FILE(), unsigned int line = __builtin_LINE()) : flags(CriticalSectionProfiler::Save(file, line))
+#else
+	AtomicCriticalSectionLocker() : flags(cpu_irq_save())
+#endif
+	{
+	}
+
+	~AtomicCriticalSectionLocker()
+	{
+		cpu_irq_restore(flags);
+	}
+
+private:
+	irqflags_t flags;
+};
+
 typedef uint16_t PwmFrequency;
 
 typedef Bitmap<uint32_t> AxesBitmap;				// Type of a bitmap representing a set of axes
@@ -343,8 +371,10 @@ static_assert(MaxSensors <= SensorsBitmap::MaxBits());
 // Task priorities
 namespace TaskPriority
 {
-	static constexpr int SpinPriority = 1;							// priority for tasks that rarely block
+	static constexpr int SpinPriority = 1;							// priority for the main task, which sleeps when it has nothing to do
 	static constexpr int HeatPriority = 2;
+	static constexpr int TelemetryPriority = 1;					// below the heater task, so that waiting for the CAN bus never delays heater control
+	static constexpr int MovePriority = 3;							// above the housekeeping tasks, so that moves are always prepared in time
 	static constexpr int DhtPriority = 2;
 	static constexpr int TmcPriority = 2;
 	static constexpr int AinPriority = 2;
@@ -354,6 +384,7 @@ namespace TaskPriority
 	static constexpr int CanSenderPriority = 3;
 	static constexpr int CanReceiverPriority = 3;
 	static constexpr int CanAsyncSenderPriority = 4;
+	static constexpr int AccelerometerPriority = 3;				// the accelerometer FIFO fills in about 20ms at the highest rates
 }
 
 #endif /* SRC_REPRAPFIRMWARE_H_ */
@@ -7,6 +7,8 @@
 
 #include "SoftwareReset.h"
 #include "Tasks.h"
+#include "Tracer.h"
+#include <Hardware/EEPROM.h>
 
 extern uint32_t _estack;			// defined in the linker script
 
@@ -92,6 +94,75 @@ void SoftwareResetData::Populate(uint16_t reason, uint32_t time, const uint32_t
 			++stk;
 		}
 	}
+	else
+	{
+		sp = 0;
+		for (uint32_t& stval : stack)
+		{
+			stval = 0xFFFFFFFF;
+		}
+	}
+
+	numTraceRecords = Tracer::CopyLatest(trace, ARRAY_SIZE(trace)/2);
+	for (size_t i = 2 * numTraceRecords; i < ARRAY_SIZE(trace); ++i)
+	{
+		trace[i] = 0;
+	}
+}
+
+// Save this in the EEPROM. This is called from the fault handlers with interrupts disabled, so the write must not depend on the RTOS.
+void SoftwareResetData::Save() const
+{
+	(void)EEPROM::Write(reinterpret_cast<const char*>(this), SoftwareResetDataEepromOffset, sizeof(*this));
+}
+
+// Load the software reset data saved in the EEPROM, returning false if there is none or it was saved by a different version of this struct
+/*static*/ bool SoftwareResetData::Load(SoftwareResetData& data)
+{
+	return EEPROM::Read(reinterpret_cast<char*>(&data), SoftwareResetDataEepromOffset, sizeof(data))
+		&& data.magic == magicValue
+		&& data.numTraceRecords <= ARRAY_SIZE(data.trace)/2;
+}
+
+// Report part of the saved data. It is too long to fit in one reply, so the main board asks for each part in turn.
+void SoftwareResetData::Report(const StringRef& reply, unsigned int part) const
+{
+	switch (part)
+	{
+	case 0:
+		{
+			char taskNameChars[5];
+			memcpy(taskNameChars, &taskName, 4);
+			taskNameChars[4] = 0;
+			reply.lcatf("Last software reset: %s (0x%04x) at %" PRIu32 "ms, task %s, free RAM %" PRIu32,
+						ReasonText[(resetReason >> 5) & 0x0F], resetReason, when, (taskName == 0) ? "none" : taskNameChars, neverUsedRam);
+			reply.lcatf("HFSR %08" PRIx32 " CFSR %08" PRIx32 " ICSR %08" PRIx32 " BFAR %08" PRIx32 " SP %08" PRIx32, hfsr, cfsr, icsr, bfar, sp);
+		}
+		break;
+
+	case 1:
+		reply.lcatf("Trace before reset (time event arg):");
+		for (size_t i = 0; i < numTraceRecords; ++i)
+		{
+			if (i % 4 == 0)
+			{
+				reply.lcat("");
+			}
+			reply.catf(" %08" PRIx32 " %02x %04x", trace[2 * i], (unsigned int)(trace[2 * i + 1] >> 16), (unsigned int)(trace[2 * i + 1] & 0xFFFF));
+		}
+		break;
+
+	case 2:
+		reply.lcatf("Stack:");
+		for (uint32_t stval : stack)
+		{
+			reply.catf(" %08" PRIx32, stval);
+		}
+		break;
+
+	default:
+		break;
+	}
 }
 
 // End
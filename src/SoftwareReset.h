@@ -62,11 +62,19 @@ struct SoftwareResetData
 	uint32_t when;								// value of the RTC when the software reset occurred
 	uint32_t taskName;							// first 4 bytes of the task name
 	uint32_t stack[23];							// stack when the exception occurred, with the program counter at the bottom
+	uint32_t numTraceRecords;					// the number of valid trace records that follow
+	uint32_t trace[2 * 8];						// the latest trace records, oldest first, each stored as the time then event << 16 | arg
 
 	bool isVacant() const;						// return true if this struct can be written without erasing it first
 	void Populate(uint16_t reason, uint32_t time, const uint32_t *stk);
+	void Save() const;							// save this in the EEPROM, called just before a software reset
+	void Report(const StringRef& reply, unsigned int part) const;	// part 0 is the reason and registers, part 1 the trace records, part 2 the stack
 
-	static const uint16_t versionValue = 8;		// increment this whenever this struct changes
+	static const unsigned int NumReportParts = 3;
+
+	static bool Load(SoftwareResetData& data);	// load the data saved before the last reset, returning false if there isn't any
+
+	static const uint16_t versionValue = 9;		// increment this whenever this struct changes
 	static const uint16_t magicValue = 0x7D00 | versionValue;	// value we use to recognise that all the flash data has been written
 	static const size_t numberOfSlots = 4;		// number of storage slots used to implement wear levelling - must fit in 512 bytes
 
@@ -74,6 +82,9 @@ struct SoftwareResetData
 	static uint8_t extraDebugInfo;				// extra info for debugging can be stored here
 };
 
-static_assert(SoftwareResetData::numberOfSlots * sizeof(SoftwareResetData) <= 512, "Can't fit software reset data in user signature area");
+// On the expansion boards we keep one copy of the software reset data at the end of the EEPROM, which is at least 4K on all of them.
+// The SmartEEPROM on the SAME51 does its own wear levelling, and software resets are rare enough that the SAMC21 RWW EEPROM doesn't need it.
+constexpr uint32_t SoftwareResetDataEepromOffset = 4096 - 256;
+static_assert(sizeof(SoftwareResetData) <= 256, "Can't fit software reset data in the space reserved for it in the EEPROM");
 
 #endif /* SRC_SOFTWARERESET_H_ */
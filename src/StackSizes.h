@@ -0,0 +1,40 @@
+/*
+ * StackSizes.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  The stack sizes of all the tasks, in words. To re-size them, build with SUPPORT_STACK_PROFILING set to 1, which makes every stack half as big again
+ *  so that nothing overflows while we measure. Run the heaviest workload the board will see, including auto tuning, filament monitors and M122 reports,
+ *  then use M122 P8 to get the words used by each task and the recommended size including a margin, and copy the recommended sizes here.
+ */
+
+#ifndef SRC_STACKSIZES_H_
+#define SRC_STACKSIZES_H_
+
+#include "RepRapFirmware.h"
+
+namespace StackSizes
+{
+#if SUPPORT_STACK_PROFILING
+	constexpr unsigned int Profiled(unsigned int words) { return words + words/2; }
+#else
+	constexpr unsigned int Profiled(unsigned int words) { return words; }
+#endif
+
+	// The margin added to the measured stack use when we recommend a size, to allow for code paths that the workload didn't exercise
+	constexpr unsigned int MarginPercent = 25;
+	constexpr unsigned int MinMarginWords = 32;
+
+	constexpr unsigned int MainTaskWords = Profiled(800);				// MAIN
+	constexpr unsigned int HeaterTaskWords = Profiled(400);			// HEAT, must be large enough for auto tuning
+	constexpr unsigned int TelemetryTaskWords = Profiled(150);		// TELEM
+	constexpr unsigned int MoveTaskWords = Profiled(500);				// MOVE
+	constexpr unsigned int CanReceiverTaskWords = Profiled(400);		// CanRecv
+	constexpr unsigned int CanAsyncSenderTaskWords = Profiled(400);	// CanAsync
+	constexpr unsigned int AnalogInTaskWords = Profiled(200);			// AIN
+	constexpr unsigned int TmcTaskWords = Profiled(100);				// TMC
+	constexpr unsigned int AccelerometerTaskWords = Profiled(200);	// ACCEL
+}
+
+#endif /* SRC_STACKSIZES_H_ */
@@ -0,0 +1,58 @@
+/*
+ * StartupProfiler.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "StartupProfiler.h"
+
+namespace StartupProfiler
+{
+	static const char * const StageNames[] = { "IO", "CAN", "ADC", "drivers", "platform", "heat", "move", "ack", "command" };
+	static_assert(ARRAY_SIZE(StageNames) == (size_t)StartupStage::numStages, "Startup stage names don't match the stages");
+
+	static uint32_t stageTimes[(size_t)StartupStage::numStages] = { 0 };		// in microseconds, 0 if the stage hasn't completed
+
+	// Get the time since the scheduler started in microseconds. Some stages complete before the step timer is running, so we use the system tick.
+	static uint32_t GetMicroseconds()
+	{
+		for (;;)
+		{
+			const uint32_t ms = millis();
+			const uint32_t ticksPerMs = SysTick->LOAD + 1;
+			const uint32_t ticksElapsed = ticksPerMs - SysTick->VAL;		// SysTick counts down
+			if (millis() == ms)
+			{
+				return ms * 1000 + (ticksElapsed * 1000)/ticksPerMs;
+			}
+		}
+	}
+}
+
+void StartupProfiler::RecordStage(StartupStage stage)
+{
+	uint32_t& t = stageTimes[(size_t)stage];
+	if (t == 0)
+	{
+		t = max<uint32_t>(GetMicroseconds(), 1);
+	}
+}
+
+void StartupProfiler::Diagnostics(const StringRef& reply)
+{
+	reply.copy("Startup stages completed at ms:");
+	for (size_t i = 0; i < (size_t)StartupStage::numStages; ++i)
+	{
+		if (stageTimes[i] == 0)
+		{
+			reply.catf(" %s -", StageNames[i]);
+		}
+		else
+		{
+			reply.catf(" %s %.1f", StageNames[i], (double)((float)stageTimes[i] * 0.001));
+		}
+	}
+}
+
+// End
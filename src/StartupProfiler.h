@@ -0,0 +1,36 @@
+/*
+ * StartupProfiler.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  Records the time at which each stage of startup completed, so that we can see what delays the board becoming ready after power up.
+ *  Times are measured from when the scheduler started, which is within a few milliseconds of reset.
+ */
+
+#ifndef SRC_STARTUPPROFILER_H_
+#define SRC_STARTUPPROFILER_H_
+
+#include "RepRapFirmware.h"
+
+enum class StartupStage : uint8_t
+{
+	ioInit = 0,
+	canInit,									// the CAN interface is running and we have sent our first announcement
+	adcInit,
+	driversInit,
+	platformInit,
+	heatInit,
+	moveInit,
+	announceAcknowledged,						// the main board has acknowledged our announcement
+	firstCommand,								// we have received the first command from the main board
+	numStages
+};
+
+namespace StartupProfiler
+{
+	void RecordStage(StartupStage stage);		// record that a stage has completed, if it hasn't already been recorded; may be called from any task
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif /* SRC_STARTUPPROFILER_H_ */
@@ -10,6 +10,7 @@
 #include "Tasks.h"
 #include "Platform.h"
 #include "SoftwareReset.h"
+#include "StackSizes.h"
 #include <malloc.h>
 
 #include "FreeRTOS.h"
@@ -19,9 +20,31 @@ const uint8_t memPattern = 0xA5;
 
 extern "C" char *sbrk(int i);
 
-constexpr unsigned int MainTaskStackWords = 800;
+uint32_t Tasks::isrTicks[(size_t)IsrId::numIsrs] = { 0 };
 
-static Task<MainTaskStackWords> mainTask;
+// We measure the peak interrupt load over windows of this many milliseconds
+constexpr uint32_t LoadWindowMillis = 1000;
+
+static const char * const IsrNames[(size_t)IsrId::numIsrs] = { "step", "CAN", "DMA", "ADC", "EIC", "UART" };
+static uint32_t isrTicksAtWindowStart[(size_t)IsrId::numIsrs] = { 0 };
+static uint32_t isrPeakWindowTicks[(size_t)IsrId::numIsrs] = { 0 };
+static uint32_t isrTicksAtLastReport[(size_t)IsrId::numIsrs] = { 0 };
+static uint32_t lastReportTime = 0;									// the step clock when we last reported the CPU load
+
+#if configGENERATE_RUN_TIME_STATS
+constexpr size_t MaxReportedTasks = 16;
+static uint32_t taskRunTimeAtLastReport[MaxReportedTasks] = { 0 };	// indexed by position in the task list, which doesn't change once the tasks have been created
+
+// FreeRTOSConfig.h uses this as portGET_RUN_TIME_COUNTER_VALUE. The step clock is already running and is fast enough to time the tasks.
+extern "C" uint32_t GetRunTimeCounterValue()
+{
+	return StepTimer::GetTimerTicks();
+}
+#endif
+
+constexpr uint32_t MainTaskMaxSleepMillis = 10;						// the main task sleeps no longer than this when it isn't woken, because Platform::Spin polls the fans, LEDs and VIN
+
+static Task<StackSizes::MainTaskWords> mainTask;
 static Mutex spiMutex;
 static Mutex mallocMutex;
 
@@ -124,9 +147,23 @@ extern "C" void MainTask(void *pvParameters)
 	for (;;)
 	{
 		Spin();
+
+		// Wait until a command arrives or it is time to do the housekeeping again.
+		// Any subsystem that still has work to do when its Spin function returns wakes us again so that we don't wait.
+		(void)TaskBase::Take(MainTaskMaxSleepMillis);
 	}
 }
 
+void Tasks::WakeMainTask()
+{
+	mainTask.Give();
+}
+
+void Tasks::WakeMainTaskFromIsr()
+{
+	mainTask.GiveFromISR();
+}
+
 extern "C" uint32_t _estack;		// this is defined in the linker script
 
 namespace Tasks
@@ -145,6 +182,53 @@ namespace Tasks
 	}
 }
 
+#if SUPPORT_STACK_PROFILING
+
+// The allocated stack size of each task, which FreeRTOS doesn't record
+struct TaskStackSize
+{
+	const char *name;
+	unsigned int words;
+};
+
+static constexpr TaskStackSize TaskStackSizes[] =
+{
+	{ "MAIN", StackSizes::MainTaskWords },
+	{ "HEAT", StackSizes::HeaterTaskWords },
+	{ "TELEM", StackSizes::TelemetryTaskWords },
+	{ "MOVE", StackSizes::MoveTaskWords },
+	{ "CanRecv", StackSizes::CanReceiverTaskWords },
+	{ "CanAsync", StackSizes::CanAsyncSenderTaskWords },
+	{ "AIN", StackSizes::AnalogInTaskWords },
+	{ "TMC", StackSizes::TmcTaskWords },
+#if SUPPORT_ACCELEROMETERS
+	{ "ACCEL", StackSizes::AccelerometerTaskWords },
+#endif
+};
+
+// Report the stack words allocated to and used by each task, and the size to put in StackSizes.h
+void Tasks::StackDiagnostics(const StringRef& reply)
+{
+	reply.copy("Stack words allocated/used/recommended:");
+	for (const TaskBase *t = TaskBase::GetTaskList(); t != nullptr; t = t->GetNext())
+	{
+		TaskStatus_t taskDetails;
+		vTaskGetInfo(t->GetHandle(), &taskDetails, pdTRUE, eInvalid);
+		for (const TaskStackSize& ts : TaskStackSizes)
+		{
+			if (strcmp(ts.name, taskDetails.pcTaskName) == 0)
+			{
+				const unsigned int used = ts.words - taskDetails.usStackHighWaterMark;
+				const unsigned int recommended = (used + max<unsigned int>((used * StackSizes::MarginPercent)/100, StackSizes::MinMarginWords) + 7) & ~7u;
+				reply.catf(" %s %u/%u/%u", ts.name, ts.words, used, recommended);
+				break;
+			}
+		}
+	}
+}
+
+#endif
+
 uint32_t Tasks::GetNeverUsedRam()
 {
 	uint32_t maxStack, neverUsedRam;
@@ -178,9 +262,35 @@ void Tasks::Diagnostics(const StringRef& reply)
 		printed = true;
 	}
 
+	// Now the CPU load since the last report
+	const uint32_t now = StepTimer::GetTimerTicks();
+	const uint32_t elapsed = now - lastReportTime;
+	lastReportTime = now;
+	constexpr float WindowTicks = (float)(StepTimer::StepClockRate/1000 * LoadWindowMillis);
+	reply.lcat("Interrupt load %, peak %:");
+	for (size_t i = 0; i < (size_t)IsrId::numIsrs; ++i)
+	{
+		const uint32_t ticks = isrTicks[i];
+		reply.catf(" %s %.1f/%.1f", IsrNames[i], (double)((float)(ticks - isrTicksAtLastReport[i]) * 100.0/(float)elapsed), (double)((float)isrPeakWindowTicks[i] * 100.0/WindowTicks));
+		isrTicksAtLastReport[i] = ticks;
+		isrPeakWindowTicks[i] = 0;
+	}
+
+#if configGENERATE_RUN_TIME_STATS
+	reply.lcat("Task load %:");
+	size_t taskIndex = 0;
+	for (const TaskBase *t = TaskBase::GetTaskList(); t != nullptr && taskIndex < MaxReportedTasks; t = t->GetNext(), ++taskIndex)
+	{
+		TaskStatus_t taskDetails;
+		vTaskGetInfo(t->GetHandle(), &taskDetails, pdFALSE, eInvalid);
+		reply.catf(" %s %.1f", taskDetails.pcTaskName, (double)((float)(taskDetails.ulRunTimeCounter - taskRunTimeAtLastReport[taskIndex]) * 100.0/(float)elapsed));
+		taskRunTimeAtLastReport[taskIndex] = taskDetails.ulRunTimeCounter;
+	}
+#endif
+
 	// Show the up time and reason for the last reset
-	const uint32_t now = (uint32_t)(millis64()/1000u);		// get up time in seconds
-	reply.lcatf("Last reset %02d:%02d:%02d ago, cause: ", (unsigned int)(now/3600), (unsigned int)((now % 3600)/60), (unsigned int)(now % 60));
+	const uint32_t upTime = (uint32_t)(millis64()/1000u);		// get up time in seconds
+	reply.lcatf("Last reset %02d:%02d:%02d ago, cause: ", (unsigned int)(upTime/3600), (unsigned int)((upTime % 3600)/60), (unsigned int)(upTime % 60));
 
 	const uint8_t resetCause = RSTC->RCAUSE.reg;
 	switch (resetCause)
@@ -197,6 +307,15 @@ void Tasks::Diagnostics(const StringRef& reply)
 #endif
 	default:					reply.catf("%u", resetCause); break;
 	}
+
+	if (resetCause == RSTC_RCAUSE_SYST)
+	{
+		SoftwareResetData srData;
+		if (SoftwareResetData::Load(srData))
+		{
+			reply.catf(" (%s, use M122 P9 to P11 for details)", SoftwareResetData::ReasonText[(srData.resetReason >> 5) & 0x0F]);
+		}
+	}
 }
 
 static StaticTask_t xIdleTaskTCB;
@@ -214,6 +333,21 @@ extern "C" void vApplicationTickHook(void)
 		WDT->CLEAR.reg = 0xA5;
 	}
 
+	// At the end of each load window, record the peak time spent in each interrupt handler
+	if (((uint32_t)g_ms_ticks) % LoadWindowMillis == 0)
+	{
+		for (size_t i = 0; i < (size_t)IsrId::numIsrs; ++i)
+		{
+			const uint32_t ticks = Tasks::isrTicks[i];
+			const uint32_t windowTicks = ticks - isrTicksAtWindowStart[i];
+			if (windowTicks > isrPeakWindowTicks[i])
+			{
+				isrPeakWindowTicks[i] = windowTicks;
+			}
+			isrTicksAtWindowStart[i] = ticks;
+		}
+	}
+
 	RepRap::Tick();
 }
 
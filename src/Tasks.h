@@ -10,15 +10,50 @@
 
 #include "RepRapFirmware.h"
 #include "RTOSIface/RTOSIface.h"
+#include <Movement/StepTimer.h>
 
 void AppMain();
 
+// Interrupt handlers whose CPU time we account for
+enum class IsrId : uint8_t
+{
+	stepTimer = 0,
+	can,
+	dma,
+	adc,
+	eic,
+	uart,
+	numIsrs
+};
+
 namespace Tasks
 {
 	uint32_t GetNeverUsedRam();
 	Mutex* GetSpiMutex();
 	void Diagnostics(const StringRef& reply);
+#if SUPPORT_STACK_PROFILING
+	void StackDiagnostics(const StringRef& reply);
+#endif
 	uint32_t DoDivide(uint32_t a, uint32_t b);
+	void WakeMainTask();									// tell the main task that it has work to do
+	void WakeMainTaskFromIsr();
+
+	extern uint32_t isrTicks[(size_t)IsrId::numIsrs];		// step clocks spent in each interrupt handler, written only by that handler
 }
 
+// Declare one of these at the start of an interrupt handler to add the time it takes to the CPU time of that handler.
+// Time spent in higher priority interrupts that preempt the handler is included.
+class IsrTimer
+{
+public:
+	explicit IsrTimer(IsrId p_isr) : isr(p_isr), startTime(StepTimer::GetTimerTicks()) { }
+	~IsrTimer() { Tasks::isrTicks[(size_t)isr] += StepTimer::GetTimerTicks() - startTime; }
+
+	IsrTimer(const IsrTimer&) = delete;
+
+private:
+	IsrId isr;
+	uint32_t startTime;
+};
+
 #endif /* SRC_TASKS_H_ */
@@ -0,0 +1,175 @@
+/*
+ * Tracer.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "Tracer.h"
+
+#if SUPPORT_TRACE_BUFFER
+
+#include <Movement/StepTimer.h>
+
+namespace Tracer
+{
+	struct TraceRecord
+	{
+		uint32_t time;						// the step clock
+		uint8_t event;
+		uint8_t spare;
+		uint16_t arg;
+	};
+
+#if defined(SAME51)
+	constexpr size_t NumRecords = 256;		// must be a power of 2
+#else
+	constexpr size_t NumRecords = 64;		// must be a power of 2
+#endif
+	static_assert((NumRecords & (NumRecords - 1)) == 0, "NumRecords must be a power of 2");
+
+	constexpr uint32_t MagicValue = 0x54524331;
+	constexpr size_t RecordsPerReport = 14;	// the number of records that fit in a reply
+
+	struct TraceBuffer
+	{
+		uint32_t magic;						// MagicValue if the buffer is in use
+		uint32_t nextIndex;					// where the next record goes
+		uint32_t numRecorded;				// the number of records written since the buffer was started
+		TraceRecord records[NumRecords];
+	};
+
+#if defined(SAME51)
+	// The backup RAM is retained through all resets except power up and brownout, and the startup code doesn't initialise it
+	static_assert(2 * sizeof(TraceBuffer) <= BKUPRAM_SIZE, "Trace buffers don't fit in backup RAM");
+	static TraceBuffer& liveBuffer = *reinterpret_cast<TraceBuffer*>(BKUPRAM_ADDR);
+	static TraceBuffer& preservedBuffer = *reinterpret_cast<TraceBuffer*>(BKUPRAM_ADDR + sizeof(TraceBuffer));
+#else
+	// The SAMC21 has no backup RAM and the startup code clears all static data, so we can't preserve the records through a reset
+	static TraceBuffer liveBuffer;
+#endif
+
+	static bool running = false;			// true once the step clock is running and we have set up the live buffer
+
+	// Append the latest records in a buffer to the reply, oldest first. We take a copy of them first so that they don't change while we format them.
+	static void AppendRecords(const StringRef& reply, const TraceBuffer& buf)
+	{
+		TraceRecord latest[RecordsPerReport];
+		uint32_t numRecorded, numToReport;
+		{
+			AtomicCriticalSectionLocker lock;
+			numRecorded = buf.numRecorded;
+			numToReport = min<uint32_t>(min<uint32_t>(numRecorded, NumRecords), RecordsPerReport);
+			for (uint32_t i = 0; i < numToReport; ++i)
+			{
+				latest[i] = buf.records[(buf.nextIndex - numToReport + i) & (NumRecords - 1)];
+			}
+		}
+
+		reply.catf("%" PRIu32 " events, latest %" PRIu32 " (time, event, arg in hex):", numRecorded, numToReport);
+		for (uint32_t i = 0; i < numToReport; ++i)
+		{
+			reply.catf(" %08" PRIx32 "%02x%04x", latest[i].time, latest[i].event, latest[i].arg);
+		}
+	}
+}
+
+void Tracer::Init()
+{
+#if defined(SAME51)
+	const uint8_t resetCause = RSTC->RCAUSE.reg;
+	if (   (resetCause == RSTC_RCAUSE_SYST || resetCause == RSTC_RCAUSE_WDT || resetCause == RSTC_RCAUSE_EXT)
+		&& liveBuffer.magic == MagicValue
+		&& liveBuffer.nextIndex < NumRecords
+	   )
+	{
+		preservedBuffer = liveBuffer;
+	}
+	else
+	{
+		preservedBuffer.magic = 0;
+	}
+#endif
+	liveBuffer.nextIndex = 0;
+	liveBuffer.numRecorded = 0;
+	liveBuffer.magic = MagicValue;
+	running = true;
+}
+
+void Tracer::Record(Event e, uint16_t arg)
+{
+	if (!running)
+	{
+		return;
+	}
+
+	const uint32_t now = StepTimer::GetTimerTicks();
+	AtomicCriticalSectionLocker lock;
+	TraceRecord& r = liveBuffer.records[liveBuffer.nextIndex];
+	r.time = now;
+	r.event = (uint8_t)e;
+	r.arg = arg;
+	liveBuffer.nextIndex = (liveBuffer.nextIndex + 1) & (NumRecords - 1);
+	++liveBuffer.numRecorded;
+}
+
+// Copy the latest records into a compact form for the software reset data, returning the number copied
+size_t Tracer::CopyLatest(uint32_t *dest, size_t maxRecords)
+{
+	AtomicCriticalSectionLocker lock;
+	const size_t numToCopy = min<size_t>(min<uint32_t>(liveBuffer.numRecorded, NumRecords), maxRecords);
+	for (size_t i = 0; i < numToCopy; ++i)
+	{
+		const TraceRecord& r = liveBuffer.records[(liveBuffer.nextIndex - numToCopy + i) & (NumRecords - 1)];
+		*dest++ = r.time;
+		*dest++ = ((uint32_t)r.event << 16) | r.arg;
+	}
+	return numToCopy;
+}
+
+// Copy the records that have been written since the caller last called this, oldest first, and advance nextRecord past them.
+// numLost is set to the number of records that were overwritten before the caller could copy them.
+size_t Tracer::CopySince(uint32_t& nextRecord, uint32_t& numLost, uint32_t *dest, size_t maxRecords)
+{
+	AtomicCriticalSectionLocker lock;
+	const uint32_t numRecorded = liveBuffer.numRecorded;
+	numLost = 0;
+	if (numRecorded - nextRecord > NumRecords)
+	{
+		numLost = numRecorded - nextRecord - NumRecords;
+		nextRecord = numRecorded - NumRecords;
+	}
+	const size_t numToCopy = min<uint32_t>(numRecorded - nextRecord, maxRecords);
+	for (size_t i = 0; i < numToCopy; ++i)
+	{
+		const TraceRecord& r = liveBuffer.records[(liveBuffer.nextIndex - (numRecorded - nextRecord) + i) & (NumRecords - 1)];
+		*dest++ = r.time;
+		*dest++ = ((uint32_t)r.event << 16) | r.arg;
+	}
+	nextRecord += numToCopy;
+	return numToCopy;
+}
+
+void Tracer::Diagnostics(const StringRef& reply, bool preserved)
+{
+	if (!preserved)
+	{
+		reply.copy("Trace ");
+		AppendRecords(reply, liveBuffer);
+	}
+#if defined(SAME51)
+	else if (preservedBuffer.magic == MagicValue)
+	{
+		reply.copy("Trace before last reset ");
+		AppendRecords(reply, preservedBuffer);
+	}
+#endif
+	else
+	{
+		reply.copy("No trace was preserved from before the last reset");
+	}
+}
+
+#endif
+
+// End
@@ -0,0 +1,49 @@
+/*
+ * Tracer.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  RAM ring buffer of compact binary trace records for post-mortem timing analysis in the field, where we can't attach a debugger.
+ *  Each record holds the step clock, an event ID and a 16-bit argument. The records are reported in hex by M122 P6, and on the SAME51
+ *  the buffer is in backup RAM so that the records leading up to a software or watchdog reset can be reported afterwards by M122 P7.
+ */
+
+#ifndef SRC_TRACER_H_
+#define SRC_TRACER_H_
+
+#include "RepRapFirmware.h"
+
+namespace Tracer
+{
+	// Event IDs. Don't change existing values, because tools that decode the reports rely on them.
+	enum class Event : uint8_t
+	{
+		none = 0,
+		ddaStarted,						// arg is the move duration in milliseconds
+		ddaCompleted,					// arg is the low 16 bits of the number of completed moves
+		hiccup,							// arg is the hiccup time in step clocks
+		canReceived,					// arg is the message type
+		canSent,						// arg is the message type
+		heaterSpin,						// arg is the heater number
+		tmcTransfer,					// arg is the driver number, or 0xFFFF for a transfer to all drivers in the SPI chain
+		adcRound,						// arg is the ADC number
+		softwareReset,					// arg is the software reset reason
+		slowSpin						// arg is the number of the subsystem whose Spin function overran, as listed in RepRap::Diagnostics
+	};
+
+#if SUPPORT_TRACE_BUFFER
+	void Init();												// call this after initialising the step timer, events recorded before then are ignored
+	void Record(Event e, uint16_t arg);							// record an event, may be called from any task or ISR
+	void Diagnostics(const StringRef& reply, bool preserved);	// report the latest records, or those preserved from before the last reset
+	size_t CopyLatest(uint32_t *dest, size_t maxRecords);		// copy the latest records oldest first as pairs of words: time, then event << 16 | arg
+	size_t CopySince(uint32_t& nextRecord, uint32_t& numLost, uint32_t *dest, size_t maxRecords);	// copy records from number nextRecord onwards in the same form
+#else
+	inline void Init() { }
+	inline void Record(Event e, uint16_t arg) { }
+	inline size_t CopyLatest(uint32_t *dest, size_t maxRecords) { return 0; }
+	inline size_t CopySince(uint32_t& nextRecord, uint32_t& numLost, uint32_t *dest, size_t maxRecords) { numLost = 0; return 0; }
+#endif
+}
+
+#endif /* SRC_TRACER_H_ */
@@ -0,0 +1,198 @@
+/*
+ * WarmRestart.cpp
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ */
+
+#include "WarmRestart.h"
+
+#if SUPPORT_WARM_RESTART
+
+#include <CAN/CanInterface.h>
+#include <CanMessageBuffer.h>
+#include <CommandProcessing/CommandProcessor.h>
+#include <Hardware/Flash.h>
+
+namespace WarmRestart
+{
+	constexpr uint32_t MagicValue = 0x57524D32;
+	constexpr size_t JournalBytes = 3584;
+	constexpr size_t TraceBufferBytes = 4120;		// the backup RAM used by the live and preserved trace buffers, see Tracer.cpp
+	constexpr size_t RequestIdBytes = 2;			// every request message starts with the request ID, which changes each time the command is sent
+
+	struct JournalEntry
+	{
+		uint32_t wholeId;					// the CAN ID of the command
+		CommandProcessor::ConfigTarget configTarget;
+		uint8_t dataLength;
+		uint8_t spare[3];
+		uint8_t data[];						// the message data, padded to a multiple of 4 bytes
+
+		size_t Size() const { return sizeof(JournalEntry) + ((dataLength + 3u) & ~3u); }
+		CanMessageType MsgType() const { CanId id; id.SetReceivedId(wholeId); return id.MsgType(); }
+	};
+
+	struct ConfigJournal
+	{
+		uint32_t magic;						// MagicValue if the journal is valid
+		uint32_t crc;						// CRC32 of the entries
+		uint16_t numBytes;					// the number of bytes of entries
+		uint16_t numCommands;
+		CanAddress boardAddress;			// the CAN address we had when the commands were recorded
+		bool overflowed;					// true if a command didn't fit, so we can't restore the configuration
+		uint16_t spare;
+		uint8_t entries[JournalBytes];
+	};
+
+	// The backup RAM is retained through all resets except power up and brownout, and the startup code doesn't initialise it.
+	// The trace buffers use the start of it, so we put the journal at the end.
+	static_assert(sizeof(ConfigJournal) <= BKUPRAM_SIZE - TraceBufferBytes, "Configuration journal doesn't fit in backup RAM with the trace buffers");
+	static ConfigJournal& journal = *reinterpret_cast<ConfigJournal*>(BKUPRAM_ADDR + BKUPRAM_SIZE - sizeof(ConfigJournal));
+
+	static unsigned int numReplayed = 0;
+	static unsigned int numReplayFailures = 0;
+	static unsigned int numSuperseded = 0;
+	static unsigned int numUnchanged = 0;
+	static bool recording = false;			// false until we have checked the journal at startup
+
+	static uint32_t CalculateCrc()
+	{
+		return Flash::CalculateCrc32(reinterpret_cast<uint32_t>(journal.entries), journal.numBytes);
+	}
+
+	static void Clear()
+	{
+		journal.numBytes = journal.numCommands = 0;
+		journal.boardAddress = CanInterface::GetCanAddress();
+		journal.overflowed = false;
+		journal.crc = CalculateCrc();
+		journal.magic = MagicValue;
+	}
+}
+
+void WarmRestart::Init()
+{
+	const uint8_t resetCause = RSTC->RCAUSE.reg;
+	if (   (resetCause == RSTC_RCAUSE_SYST || resetCause == RSTC_RCAUSE_WDT)
+		&& journal.magic == MagicValue
+		&& journal.numBytes <= JournalBytes
+		&& !journal.overflowed
+		&& journal.boardAddress == CanInterface::GetCanAddress()
+		&& journal.crc == CalculateCrc()
+	   )
+	{
+		size_t offset = 0;
+		while (offset < journal.numBytes)
+		{
+			const JournalEntry& entry = *reinterpret_cast<const JournalEntry*>(journal.entries + offset);
+			CanMessageBuffer * const buf = CanInterface::AllocateBuffer(CanInterface::BufferUser::main);
+			buf->id.SetReceivedId(entry.wholeId);
+			buf->dataLength = entry.dataLength;
+			memcpy(buf->msg.raw, entry.data, entry.dataLength);
+			if (CommandProcessor::ReplayCommand(buf) == GCodeResult::ok)
+			{
+				++numReplayed;
+			}
+			else
+			{
+				++numReplayFailures;
+			}
+			offset += entry.Size();
+		}
+	}
+	else
+	{
+		Clear();
+	}
+	recording = true;
+}
+
+// Record a configuration command. Commands that only asked for a report aren't recorded, nor are commands identical to the last one that configured the same thing.
+// Earlier commands that the new one supersedes are removed, so that routine changes such as motor currents and pressure advance don't fill the journal.
+void WarmRestart::RecordCommand(const CanMessageBuffer& buf)
+{
+	const CanMessageType type = buf.id.MsgType();
+	CommandProcessor::ConfigTarget configTarget;
+	if (!recording || journal.overflowed || !CommandProcessor::IsConfigCommand(type) || !CommandProcessor::GetConfigTarget(buf, configTarget))
+	{
+		return;
+	}
+
+	const JournalEntry *lastForTarget = nullptr;
+	for (size_t offset = 0; offset < journal.numBytes; )
+	{
+		const JournalEntry& entry = *reinterpret_cast<const JournalEntry*>(journal.entries + offset);
+		if (entry.MsgType() == type && entry.configTarget.target == configTarget.target)
+		{
+			lastForTarget = &entry;
+		}
+		offset += entry.Size();
+	}
+	if (   lastForTarget != nullptr
+		&& lastForTarget->dataLength == buf.dataLength
+		&& buf.dataLength >= RequestIdBytes
+		&& memcmp(lastForTarget->data + RequestIdBytes, buf.msg.raw + RequestIdBytes, buf.dataLength - RequestIdBytes) == 0
+	   )
+	{
+		++numUnchanged;
+		return;
+	}
+
+	// Remove the entries that this command supersedes, moving the later ones down
+	size_t readOffset = 0, writeOffset = 0;
+	while (readOffset < journal.numBytes)
+	{
+		const JournalEntry& entry = *reinterpret_cast<const JournalEntry*>(journal.entries + readOffset);
+		const size_t size = entry.Size();
+		if (entry.MsgType() == type && configTarget.Supersedes(entry.configTarget))
+		{
+			--journal.numCommands;
+			++numSuperseded;
+		}
+		else
+		{
+			if (writeOffset != readOffset)
+			{
+				memmove(journal.entries + writeOffset, journal.entries + readOffset, size);
+			}
+			writeOffset += size;
+		}
+		readOffset += size;
+	}
+	journal.numBytes = writeOffset;
+
+	JournalEntry& entry = *reinterpret_cast<JournalEntry*>(journal.entries + journal.numBytes);
+	const size_t entrySize = sizeof(JournalEntry) + ((buf.dataLength + 3u) & ~3u);
+	if (journal.numBytes + entrySize > JournalBytes)
+	{
+		journal.overflowed = true;
+		return;
+	}
+
+	entry.wholeId = buf.id.GetWholeId();
+	entry.configTarget = configTarget;
+	entry.dataLength = buf.dataLength;
+	entry.spare[0] = entry.spare[1] = entry.spare[2] = 0;
+	memcpy(entry.data, buf.msg.raw, buf.dataLength);
+	memset(entry.data + buf.dataLength, 0, entrySize - sizeof(JournalEntry) - buf.dataLength);
+	journal.numBytes += entrySize;
+	++journal.numCommands;
+	journal.crc = CalculateCrc();
+}
+
+void WarmRestart::Discard()
+{
+	journal.magic = 0;
+}
+
+void WarmRestart::Diagnostics(const StringRef& reply)
+{
+	reply.lcatf("Config journal %u commands %u bytes CRC %08" PRIx32 "%s, superseded %u unchanged %u, replayed %u failed %u",
+				journal.numCommands, journal.numBytes, journal.crc, (journal.overflowed) ? " overflowed" : "",
+				numSuperseded, numUnchanged, numReplayed, numReplayFailures);
+}
+
+#endif
+
+// End
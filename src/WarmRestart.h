@@ -0,0 +1,35 @@
+/*
+ * WarmRestart.h
+ *
+ *  Created on: 14 Oct 2020
+ *      Author: David
+ *
+ *  Warm restart after a fault or watchdog reset. We keep a journal in backup RAM of the configuration commands that the main board has sent us
+ *  and that succeeded, such as M308, M950, M569 and input monitor commands. After a software or watchdog reset that the main board didn't ask for,
+ *  we replay the journal so that the board comes back with its sensors, heaters, fans, drivers and input monitors configured as they were.
+ *  A command replaces the earlier ones that configured the same heater, sensor, fan, port, input monitor or drivers and set no parameters that it doesn't,
+ *  and commands that only ask for a report or that repeat the last command for the same thing aren't recorded, so the journal doesn't grow as settings are changed.
+ *  When the main board resets us or restarts itself we discard the journal, because it will send the configuration again.
+ *  The journal is protected by a CRC, which M122 reports so that the configuration can be compared with what the main board sent.
+ */
+
+#ifndef SRC_WARMRESTART_H_
+#define SRC_WARMRESTART_H_
+
+#include "RepRapFirmware.h"
+
+#if SUPPORT_WARM_RESTART
+
+struct CanMessageBuffer;
+
+namespace WarmRestart
+{
+	void Init();											// check the journal and replay it if we had a warm restart, called once the subsystems have been initialised
+	void RecordCommand(const CanMessageBuffer& buf);		// record a command that succeeded, if it is a configuration command
+	void Discard();											// discard the journal because the main board will configure us again
+	void Diagnostics(const StringRef& reply);
+}
+
+#endif
+
+#endif /* SRC_WARMRESTART_H_ */